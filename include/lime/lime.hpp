@@ -19,6 +19,9 @@
 #ifndef lime_hpp
 #define lime_hpp
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <memory> //smart ptrs
 #include <unordered_map>
 #include <vector>
@@ -42,7 +45,18 @@ namespace lime {
 		DRMessage, /**< the plaintext input is encrypted inside the Double Ratchet message (each recipient get a different encryption): not optimal for messages with numerous recipient */
 		cipherMessage, /**< the plaintext input is encrypted with a random key and this random key is encrypted to each participant inside the Double Ratchet message(for a single recipient the overhead is 48 bytes) */
 		optimizeUploadSize, /**< optimize upload size: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on upload size only. This is the default policy used */
-		optimizeGlobalBandwidth /**< optimize bandwith usage: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on uploadand download (from server to recipients) sizes added. */
+		optimizeGlobalBandwidth, /**< optimize bandwith usage: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on uploadand download (from server to recipients) sizes added. */
+		senderKey /**< group mode: the plaintext is encrypted once in the cipher message with a sender key chain shared by all the recipient devices and signed with the sender identity key.\n
+			The chain is sent once to each device in a Double Ratchet message, then only ratcheted symmetrically: the other devices get a 3 bytes DR message.\n
+			The recipients given shall be all the devices of the group identified by the recipient user id: a device missing from them triggers a new chain.\n
+			Security trade-offs compared to the other policies:
+			- no post-compromise security: anyone getting a chain key can decrypt all the following messages of that chain, until the sender generates a new one(see lime::settings::senderKeyChain_maxMessages)\n
+			- recipients keep only the next key of the chain: a message older than the last one decrypted is not decrypted\n
+			- the chain is sent only once to each device and the sender is not notified of a failure to decrypt it: a device which did not get the chain(its DR message was lost)
+			  or lost its copy of it fails to decrypt all the following messages, up to lime::settings::senderKeyChain_maxMessages(1000), until the sender starts a new chain.
+			  It does so when the chain is used up or when a device holding it is missing from the recipients.\n
+			- a DR message distributing the chain processed after following messages only makes them fail when they are tried first: once it is processed they
+			  decrypt, if tried in the order they were encrypted */
 	};
 
 	/**
@@ -80,6 +94,39 @@ namespace lime {
 		RecipientData(const std::string &deviceId) : deviceId{deviceId}, peerStatus{lime::PeerDeviceStatus::unknown}, DRmessage{} {};
 	};
 
+	/** @brief The DR messages output of encrypt when they are all written in one buffer
+	 *
+	 * The buffer is resized once to the exact total size of the DR messages, reserve it beforehand(see LimeManager::encryptOutBuffersMaximumSize)
+	 * to encrypt without any allocation for the DR messages. The recipients DRmessage are then left empty.
+	 */
+	struct DRMessagesArena {
+		std::vector<uint8_t> buffer; /**< output: all the DR messages, one after the other */
+		std::vector<std::pair<size_t, size_t>> messages; /**< output: offset in buffer and size of each recipient DR message, in the recipients order, {0,0} for the recipients set to fail */
+		DRMessagesArena() : buffer{}, messages{} {};
+	};
+
+	/** @brief The decrypt_batch function input/output data structure
+	 *
+	 * give an incoming message and get it back with its plain text and sender device status
+	 */
+	struct DecryptionData {
+		const std::string recipientUserId; /**< input: the Id of intended recipient, see decrypt */
+		const std::string senderDeviceId; /**< input: the sender device Id (GRUU) */
+		const std::vector<uint8_t> DRmessage; /**< input: Double Ratchet message targeted to current device */
+		const std::vector<uint8_t> cipherMessage; /**< input: common part of the encrypted message, empty if not present in the incoming message */
+		lime::PeerDeviceStatus peerStatus; /**< output: the sender device status as returned by decrypt, fail if this message could not be decrypted */
+		std::vector<uint8_t> plainMessage; /**< output: the decrypted message */
+		/**
+		 * decryption data are built giving an incoming message
+		 * @param[in] recipientUserId	the Id of intended recipient
+		 * @param[in] senderDeviceId	the sender device Id (its GRUU)
+		 * @param[in] DRmessage		Double Ratchet message targeted to current device
+		 * @param[in] cipherMessage	common part of the encrypted message, can be empty
+		 */
+		DecryptionData(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage=std::vector<uint8_t>{})
+			: recipientUserId{recipientUserId}, senderDeviceId{senderDeviceId}, DRmessage{DRmessage}, cipherMessage{cipherMessage}, peerStatus{lime::PeerDeviceStatus::fail}, plainMessage{} {};
+	};
+
 	/** what a Lime callback could possibly say */
 	enum class CallbackReturn : uint8_t {
 		success, /**< operation completed successfully */
@@ -94,6 +141,20 @@ namespace lime {
 	 */
 	using limeCallback = std::function<void(const lime::CallbackReturn status, const std::string message)>;
 
+	/** @brief Callback giving the result of an asynchronous decryption
+	 *
+	 *  @param[in]	peerStatus	the sender device status as returned by the synchronous decrypt, fail if the message could not be decrypted
+	 *  @param[in]	message		in case of failure, an explanation, it may be empty
+	 */
+	using limeDecryptCallback = std::function<void(const lime::PeerDeviceStatus peerStatus, const std::string message)>;
+
+	/** @brief Run a job, ie: on a thread pool or an event loop
+	 *
+	 *  The job may be run before the executor returns or later, from any thread: it must then be copied.
+	 *  @param[in]	job	the function to run
+	 */
+	using limeExecutor = std::function<void(const std::function<void()> &job)>;
+
 	/* X3DH server communication : these functions prototypes are used to post data and get response from/to the X3DH server */
 	/**
 	 * @brief Get the response from server. The external service providing secure communication to the X3DH server shall forward to lime library the server's response
@@ -114,8 +175,271 @@ namespace lime {
 	 */
 	using limeX3DHServerPostData = std::function<void(const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &reponseProcess)>;
 
+	/* Streamed encryption/decryption: these functions prototypes are used to process large messages by chunks without holding them in one buffer */
+	/**
+	 * @brief Read a chunk of a streamed message
+	 *
+	 * @param[in]	offset	position in the message of the first byte to read
+	 * @param[out]	buffer	where to write the bytes read
+	 * @param[in]	size	maximum number of bytes to read, buffer is at least this size
+	 *
+	 * @return the number of bytes actually written in buffer, 0 when the end of the message is reached
+	 */
+	using limeStreamReader = std::function<size_t(const size_t offset, uint8_t *buffer, const size_t size)>;
+
+	/**
+	 * @brief Write a chunk of a streamed message, chunks are given in order
+	 *
+	 * @param[in]	buffer	the bytes to write
+	 * @param[in]	size	number of bytes in buffer
+	 */
+	using limeStreamWriter = std::function<void(const uint8_t *buffer, const size_t size)>;
+
+	/** Journaling mode of the local storage, see sqlite PRAGMA journal_mode */
+	enum class StorageJournalMode : uint8_t {
+		keep, /**< do not modify the journal mode of the database (it is persistent in the database file) */
+		rollback, /**< rollback journal deleted at the end of each transaction, sqlite default */
+		wal /**< write ahead log: readers do not block writer and a commit needs only one sync of the log */
+	};
+
+	/** Synchronisation level of the local storage, see sqlite PRAGMA synchronous. Explicit values are the ones used by sqlite */
+	enum class StorageSynchronous : int8_t {
+		keep=-1, /**< do not modify the synchronous setting, sqlite default is full */
+		off=0, /**< no sync at all: a power loss or OS crash may corrupt the database */
+		normal=1, /**< in wal mode, a power loss may lose the last commits but never corrupt the database */
+		full=2, /**< sync at each commit, sqlite default */
+		extra=3 /**< as full, also sync the directory when the rollback journal is deleted */
+	};
+
+	/** Default number of retries of a busy transaction start or commit in multi-process mode, see StorageOptions::busyRetries */
+	constexpr uint16_t storageBusyRetries = 8;
+
+	/** @brief Local storage tuning
+	 *
+	 *	Given to the LimeManager and forwarded to the local storage when the connection is opened.
+	 *	Default constructed options do not modify anything so the database behaves as a plain sqlite one.
+	 *	Set the options with the chained setters, ie: StorageOptions{}.set_journalMode(lime::StorageJournalMode::wal).set_shards(4), or start from a preset.
+	 */
+	struct StorageOptions {
+		/** journal mode, default keep: the mode stored in the database file is used */
+		lime::StorageJournalMode journalMode = lime::StorageJournalMode::keep;
+		/** synchronisation level, default keep: sqlite uses full */
+		lime::StorageSynchronous synchronous = lime::StorageSynchronous::keep;
+		/** in bytes, maximum size of the database file accessed through memory mapping, 0 disables it. Default -1: any negative value keeps the sqlite setting */
+		long long mmapSize = -1;
+		/** page cache size: positive is a number of pages, negative a size in KiB(sqlite semantic). Default 0 keeps the sqlite setting */
+		long long cacheSize = 0;
+		/** default false. Each local user gets its own connection, locked by its own mutex, so operations of different users run in parallel.
+		 * Connections wait for each other when writing(see busyTimeout), wal journal lets readers run along a writer.
+		 * The mutex given to the LimeManager then locks only its own connection, used by the operations not related to a local user.
+		 * Useless on an in memory database as each connection would get its own database. */
+		bool connectionPerUser = false;
+		/** default false. LimeManager::update does not delete the old stale sessions, message keys, SPks and OPks: LimeManager::cleanup shall be called periodically instead */
+		bool deferredCleanup = false;
+		/** number of database files the local users are spread on, default 0: 0 or 1 keep them all in the db_access one.
+		 * Shard n is the file db_access.n, a local user goes to the shard given by a hash of its device Id, so it must not be changed once users are created.
+		 * Each shard has its own connection and mutex: the mutex given to the LimeManager locks the shard 0 one. Peer devices status are set in all shards. */
+		uint16_t shards = 0;
+		/** write-behind mode, in number of queued sessions updates, default 0 disables it: the sessions are committed by the encryption or decryption updating them.
+		 * Otherwise the updates of stored sessions are queued and committed in groups by a background thread, at most 10 ms(lime::settings::writeBehind_maxDelay_ms) later.
+		 * When this number of sessions are queued, the next update commits them all at once. The new sessions and the ones storing or consuming skipped
+		 * message keys are still committed at once, so are the updates made within a transaction. LimeManager::flush is the durability barrier: see it before enabling this mode.
+		 * Ignored, with a warning, when multiProcess is set. */
+		uint16_t writeBehindDepth = 0;
+		/** default false. Several processes share the database files(ie: worker processes, an application and its notification extension).
+		 * The transactions updating the DR sessions take the database write lock when they start(BEGIN IMMEDIATE) and a busy database is retried,
+		 * see busyTimeout and busyRetries. Encryptions and decryptions hold the write lock while they use the sessions, the cached sessions modified by
+		 * another process since they were loaded are loaded again, the peer devices status and the SPks are always read from the database.
+		 * Disables the write-behind mode(writeBehindDepth is forced to 0) as the queued updates would not be seen by the other processes. wal journal is recommended. */
+		bool multiProcess = false;
+		/** in milliseconds, how long a connection waits for another one to release the database lock before failing with a busy error.
+		 * Default 0: 5000 ms(lime::settings::DB_busyTimeout_ms) when connectionPerUser or multiProcess is set, the sqlite setting(no wait) is kept otherwise */
+		uint32_t busyTimeout = 0;
+		/** number of times starting or committing a transaction is tried again after a busy error, with an exponential backoff starting at
+		 * 10 ms(lime::settings::DB_busyBackoff_ms). Default lime::storageBusyRetries, used only when multiProcess is set. */
+		uint16_t busyRetries = lime::storageBusyRetries;
+
+		/** @brief set journalMode @return this options */
+		StorageOptions &set_journalMode(const lime::StorageJournalMode value) {journalMode = value; return *this;};
+		/** @brief set synchronous @return this options */
+		StorageOptions &set_synchronous(const lime::StorageSynchronous value) {synchronous = value; return *this;};
+		/** @brief set mmapSize @return this options */
+		StorageOptions &set_mmapSize(const long long value) {mmapSize = value; return *this;};
+		/** @brief set cacheSize @return this options */
+		StorageOptions &set_cacheSize(const long long value) {cacheSize = value; return *this;};
+		/** @brief set connectionPerUser @return this options */
+		StorageOptions &set_connectionPerUser(const bool value) {connectionPerUser = value; return *this;};
+		/** @brief set deferredCleanup @return this options */
+		StorageOptions &set_deferredCleanup(const bool value) {deferredCleanup = value; return *this;};
+		/** @brief set shards @return this options */
+		StorageOptions &set_shards(const uint16_t value) {shards = value; return *this;};
+		/** @brief set writeBehindDepth @return this options */
+		StorageOptions &set_writeBehindDepth(const uint16_t value) {writeBehindDepth = value; return *this;};
+		/** @brief set multiProcess @return this options */
+		StorageOptions &set_multiProcess(const bool value) {multiProcess = value; return *this;};
+		/** @brief set busyTimeout, in milliseconds @return this options */
+		StorageOptions &set_busyTimeout(const uint32_t value) {busyTimeout = value; return *this;};
+		/** @brief set busyRetries @return this options */
+		StorageOptions &set_busyRetries(const uint16_t value) {busyRetries = value; return *this;};
+
+		/**
+		 * @brief preset for devices running on flash storage: wal journal and full sync so a commit is never lost but costs a single sync, small cache, no memory mapping
+		 */
+		static StorageOptions mobileDurable();
+		/**
+		 * @brief preset for servers managing a lot of users: wal journal and normal sync(an OS crash may lose the last commits), large cache and memory mapping, one connection per user
+		 */
+		static StorageOptions serverThroughput();
+		/**
+		 * @brief printable description of the options, used to log the settings in effect
+		 */
+		std::string to_string() const;
+	};
+
+	/** Operations timed by the runtime metrics, see LimeManager::get_metrics */
+	enum class MetricsOperation : uint8_t {
+		encrypt=0, /**< local user encryption, run again when the encryption was waiting for key bundles */
+		decrypt=1, /**< message decryption, including the session lookup and a possible X3DH session creation */
+		session_save=2, /**< Double Ratchet session write to local storage */
+		session_load=3, /**< Double Ratchet session read from local storage */
+		trySkippedMessageKeys=4, /**< lookup of a skipped message key in local storage */
+		X3DHRoundTrip=5, /**< time between posting a message to the X3DH server and getting its response */
+		OPkGeneration=6 /**< generation and storage of a OPks batch */
+	};
+	/** Number of values in lime::MetricsOperation */
+	constexpr size_t metricsOperationsCount = 7;
+	/** Latencies histogram buckets: bucket 0 counts the operations lasting less than 1 us, bucket n the ones lasting
+	 * [2^(n-1), 2^n[ us. The last one also counts the longer ones */
+	constexpr size_t metricsHistogramBuckets = 24;
+
+	/** @brief Metrics of one operation, all durations are in nanoseconds
+	 *
+	 *	The time spent in local storage accesses is accounted in DBTime, the rest of the operation time in cryptoTime.
+	 *	The X3DH round trip does not split them: both are 0 and only totalTime is set.
+	 */
+	struct OperationMetrics {
+		uint64_t calls; /**< number of operations completed */
+		uint64_t totalTime; /**< cumulated duration */
+		uint64_t DBTime; /**< cumulated local storage access time */
+		uint64_t cryptoTime; /**< cumulated time out of local storage */
+		std::array<uint64_t, metricsHistogramBuckets> latencyHistogram; /**< operations count per duration, see lime::metricsHistogramBuckets */
+		OperationMetrics() : calls{0}, totalTime{0}, DBTime{0}, cryptoTime{0}, latencyHistogram{} {};
+	};
+
+	/** @brief Runtime metrics of a LimeManager, see LimeManager::set_metricsEnabled */
+	struct Metrics {
+		std::array<OperationMetrics, metricsOperationsCount> operations; /**< indexed by lime::MetricsOperation */
+		uint64_t DRSessionsCacheHits; /**< Double Ratchet session found in the user cache on encryption or decryption */
+		uint64_t DRSessionsCacheMisses; /**< Double Ratchet session not in the user cache, looked up in local storage */
+		uint64_t staleSessionDecrypts; /**< messages decrypted with a stale session: the sender was using a session we already replaced */
+		uint64_t skippedKeysDerived; /**< message keys derived and stored for messages not received yet */
+		uint64_t DBMutexWaitTime; /**< time spent waiting for the local storage mutex held by another thread, in nanoseconds */
+		uint64_t usersMutexWaitTime; /**< time spent waiting for the manager users cache mutex held by another thread, in nanoseconds */
+		Metrics() : operations{}, DRSessionsCacheHits{0}, DRSessionsCacheMisses{0}, staleSessionDecrypts{0}, skippedKeysDerived{0}, DBMutexWaitTime{0}, usersMutexWaitTime{0} {};
+		/** @return the metrics of the given operation */
+		const OperationMetrics &operation(const lime::MetricsOperation op) const {return operations[static_cast<size_t>(op)];};
+	};
+
+	/** Local storage tables reported by LimeManager::get_storageUsage */
+	enum class StorageTable : uint8_t {
+		DRSessions=0, /**< Double Ratchet sessions, active and stale */
+		DRSkippedChains=1, /**< chains holding skipped message keys */
+		DRSkippedKeys=2, /**< skipped message keys, stored by chunks */
+		SPk=3, /**< X3DH signed pre-keys, current and stale */
+		OPk=4 /**< X3DH one-time pre-keys, on server or dispatched */
+	};
+	constexpr size_t storageTablesCount = 5;
+
+	/** @brief Rows of a local storage table belonging to a local user */
+	struct StorageTableUsage {
+		uint64_t rows; /**< number of rows */
+		uint64_t bytes; /**< size of the keys, states and messages held by these rows, without the database own overhead */
+		StorageTableUsage() : rows{0}, bytes{0} {};
+	};
+
+	/** @brief Local storage used by a local user */
+	struct UserStorageUsage {
+		std::string deviceId; /**< the local user device Id */
+		std::array<StorageTableUsage, storageTablesCount> tables; /**< indexed by lime::StorageTable */
+		UserStorageUsage(const std::string &deviceId) : deviceId{deviceId}, tables{} {};
+		/** @return the usage of the given table */
+		const StorageTableUsage &table(const lime::StorageTable t) const {return tables[static_cast<size_t>(t)];};
+	};
+
+	/** @brief Local storage usage of a LimeManager, see LimeManager::get_storageUsage */
+	struct StorageUsage {
+		uint64_t fileSize; /**< size of the database pages, all shards included, in bytes */
+		uint64_t freeSize; /**< part of it in free pages: LimeManager::compact gives them back to the file system, in bytes */
+		bool incrementalCompaction; /**< all the databases are in incremental compaction mode, see LimeManager::compact */
+		std::vector<UserStorageUsage> users; /**< all local users, active or not */
+		StorageUsage() : fileSize{0}, freeSize{0}, incrementalCompaction{true}, users{} {};
+	};
+
+	/** @brief An attribute of a tracing span: an integer or a string value */
+	struct TraceAttribute {
+		const char *key; /**< attribute name, a static string */
+		bool isString; /**< true when the value is in stringValue, false when in intValue */
+		int64_t intValue;
+		std::string stringValue;
+		TraceAttribute(const char *key, const int64_t value) : key{key}, isString{false}, intValue{value}, stringValue{} {};
+		TraceAttribute(const char *key, const std::string &value) : key{key}, isString{true}, intValue{0}, stringValue{value} {};
+	};
+
+	/** Tracing events type */
+	enum class TraceEventType : uint8_t {
+		spanBegin, /**< an operation starts */
+		spanEnd /**< the operation is over, the event holds its attributes */
+	};
+
+	/** @brief A tracing event, emitted at the begin and at the end of each traced operation(span)
+	 *
+	 * Spans are nested: a span started while another one is running in the same thread is its child.
+	 * The X3DH server round trip span is parented to the operation posting the request and ends in the thread delivering the response.
+	 * Span names are:
+	 * - lime.encrypt: attributes recipients, policy, missingDevices and fetchKeyBundles(1 when the encryption waits for the X3DH server)
+	 * - lime.X3DHRoundTrip: attributes requestSize, responseCode and responseSize
+	 * - lime.X3DHProcessResponse: child of the round trip, process the X3DH server response
+	 * - lime.cache_DR_sessions: attributes requested(sessions not in cache) and loaded
+	 * - lime.X3DH_init_sender_session: attributes bundles
+	 * - lime.session_save: attributes dbSessionId and insert(1 for a new session)
+	 */
+	struct TraceEvent {
+		lime::TraceEventType type;
+		const char *name; /**< span name, a static string */
+		uint64_t spanId; /**< unique for a LimeManager, never 0 */
+		uint64_t parentSpanId; /**< 0 for a root span */
+		uint64_t timestamp; /**< steady clock time, in ns */
+		std::vector<TraceAttribute> attributes; /**< set on span end only */
+	};
+
+	/**
+	 * @brief Tracing callback, see LimeManager::set_traceCallback
+	 *
+	 * Called synchronously from the thread running the operation, sometimes with lime internal locks held:
+	 * it must be quick and shall not call the LimeManager.
+	 */
+	using limeTraceCallback = std::function<void(const lime::TraceEvent &event)>;
+
 	/* Forward declare the class managing one lime user*/
 	class LimeGeneric;
+	/* Forward declare the class managing the local storage */
+	class Db;
+	/* Forward declare the thread pool used to encrypt in parallel */
+	class ThreadPool;
+	/* Forward declare the dispatcher running the asynchronous decryptions */
+	class SerialDispatcher;
+	/* Forward declare the runtime metrics collector */
+	class MetricsCollector;
+	/* Forward declare the tracing spans emitter */
+	class Tracer;
+	/* Forward declare the peer devices cache */
+	class PeerDevicesCache;
+	/* Forward declare the interactive and background operations scheduling */
+	class WorkLanes;
+	/* Forward declare the pre-generated key pairs pools */
+	class KeyPairPools;
+	/* Forward declare the X3DH requests batcher */
+	class X3DHBatcher;
 
 	/** @brief Manage several Lime objects(one is needed for each local user).
 	 *
@@ -123,13 +447,41 @@ namespace lime {
 	 *	All interactions should take place through the LimeManager object, any endpoint shall have only one LimeManager object instanciated
 	 */
 
+	/* Forward declare the cache holding the loaded users */
+	template <typename Key, typename Value>
+	class LRUCache;
+
 	class LimeManager {
 		private :
-			std::unordered_map<std::string, std::shared_ptr<LimeGeneric>> m_users_cache; // cache of already opened Lime Session, identified by user Id (GRUU)
+			std::unique_ptr<LRUCache<std::string, std::shared_ptr<LimeGeneric>>> m_users_cache; // cache of already opened Lime Session, identified by user Id (GRUU), least recently used idle users are unloaded when it is full
 			std::mutex m_users_mutex; // m_users_cache mutex
 			std::string m_db_access; // DB access information forwarded to SOCI to correctly access database
-			std::shared_ptr<std::recursive_mutex> m_db_mutex; // database access mutex
-			limeX3DHServerPostData m_X3DH_post_data; // send data to the X3DH key server
+			std::shared_ptr<std::recursive_mutex> m_db_mutex; // database access mutex, of shard 0 when sharded
+			lime::StorageOptions m_storageOptions; // requested local storage tuning, applied when the connection is opened
+			std::vector<std::shared_ptr<std::recursive_mutex>> m_shards_mutex; // database access mutex of each shard, the first one is m_db_mutex
+			std::vector<std::shared_ptr<lime::Db>> m_localStorage; // database connection of each shard shared by manager level operations and all loaded users, opened on first use
+			std::mutex m_cleanup_mutex; // serialize the cleanup calls
+			size_t m_cleanupShard; // shard being cleaned by the incremental cleanup
+			std::shared_ptr<lime::X3DHBatcher> m_X3DHBatcher; // group the users requests to the X3DH server when enabled, wraps the post function given at construction
+			limeX3DHServerPostData m_X3DH_post_data; // send data to the X3DH key server through m_X3DHBatcher
+			std::shared_ptr<lime::ThreadPool> m_threadPool; // threads shared by all users to encrypt for several recipients in parallel, nullptr when disabled
+			bool m_OPkPredictiveUpdate; // update queries the X3DH server for the OPks of a user only when their projected count is low
+			size_t m_updateConcurrency; // maximum number of users updated at once by update, 0 for no limit
+			limeExecutor m_updateExecutor; // run the users update started by update, nullptr to run them in the thread starting them
+			bool m_updateDeferFreshUsers; // update skips the users with a valid SPk and enough OPks projected on server
+			size_t m_DRSessionsCache_maxSessions; // DR sessions cache limits applied to all users
+			size_t m_DRSessionsCache_maxMemory;
+			std::shared_ptr<lime::MetricsCollector> m_metrics; // runtime metrics of all the users, given to the local storage connections
+			std::shared_ptr<lime::Tracer> m_tracer; // tracing spans emitter of all the users, given to the local storage connections
+			std::vector<std::shared_ptr<lime::PeerDevicesCache>> m_peerDevices; // peer devices read from local storage, one per shard shared by all its connections
+			std::vector<std::shared_ptr<lime::WorkLanes>> m_workLanes; // give the encryptions and decryptions precedence over the background operations, one per shard shared by all its connections
+			std::shared_ptr<lime::KeyPairPools> m_keyPairPools; // pre-generated key exchange key pairs, given to the local storage connections
+			std::mutex m_decryption_mutex; // protect the asynchronous decryption dispatcher creation
+			std::unique_ptr<lime::SerialDispatcher> m_decryptionDispatcher; // run the asynchronous decryptions, created on first use. Keep it the last member: it waits for the pending ones at destruction
+			void init_shards(); // helper function, set the per shard members according to the storage options
+			size_t get_shard(const std::string &localDeviceId) const; // helper function, return the shard holding a local user
+			std::shared_ptr<lime::Db> get_localStorage(const size_t shard=0); // helper function, open the shared database connection of a shard if not done yet and return it
+			std::shared_ptr<lime::Db> get_userStorage(const size_t shard); // helper function, return the connection to give to a local user of a shard: the shared one or a dedicated one
 			void load_user(std::shared_ptr<LimeGeneric> &user, const std::string &localDeviceId, const bool allStatus=false); // helper function, get from m_users_cache of local Storage the requested Lime object
 
 		public :
@@ -219,6 +571,57 @@ namespace lime {
 			 */
 			void encrypt(const std::string &localDeviceId, std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, std::shared_ptr<std::vector<uint8_t>> cipherMessage, const limeCallback &callback, lime::EncryptionPolicy encryptionPolicy=lime::EncryptionPolicy::optimizeUploadSize);
 
+			/**
+			 * @brief Encrypt a buffer(text or file) for a given list of recipient devices, writing all the DR messages in one buffer
+			 *
+			 * Same as encrypt but the DR messages are not given in the recipients DRmessage: they are written one after the other
+			 * in DRmessages buffer, sized once to their exact total size, DRmessages messages gets their offsets and sizes.
+			 *
+			 * @param[in]		localDeviceId	used to identify which local acount to use and also as the identified source of the message, shall be the GRUU
+			 * @param[in]		recipientUserId	the Id of intended recipient, see encrypt
+			 * @param[in,out]	recipients	a list of RecipientData holding the recipient device Id(GRUU), get the peer status after callback, see encrypt
+			 * @param[in]		plainMessage	a buffer holding the message to encrypt, can be text or data.
+			 * @param[out]		cipherMessage	points to the buffer to store the encrypted message which must be routed to all recipients(if one is produced, depends on encryption policy)
+			 * @param[out]		DRmessages	gets the DR messages of all recipients, see DRMessagesArena
+			 * @param[in]		callback	called when the DR messages are ready for all the recipients, see encrypt
+			 * @param[in]		encryptionPolicy	select how to manage the encryption, see encrypt
+			 */
+			void encrypt(const std::string &localDeviceId, std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, std::shared_ptr<std::vector<uint8_t>> cipherMessage,
+					std::shared_ptr<DRMessagesArena> DRmessages, const limeCallback &callback, lime::EncryptionPolicy encryptionPolicy=lime::EncryptionPolicy::optimizeUploadSize);
+
+			/**
+			 * @brief Encrypt a buffer for a given list of recipient devices if it can be done without the X3DH server
+			 *
+			 * When all the recipient devices already have a Double Ratchet session(or a prefetched key bundle, see prefetch_peerBundles),
+			 * the message is encrypted in the calling thread and the outputs are ready when this function returns: no callback, no shared_ptr on the inputs.
+			 * Otherwise nothing is encrypted and false is returned: the caller falls back to the asynchronous encrypt.
+			 *
+			 * if specified localDeviceId is not found in local Storage, throw an exception
+			 *
+			 * @param[in]		localDeviceId	used to identify which local acount to use and also as the identified source of the message, shall be the GRUU
+			 * @param[in]		recipientUserId	the Id of intended recipient, see encrypt
+			 * @param[in,out]	recipients	a list of RecipientData holding the recipient device Id(GRUU), get their DRmessage and peer status when true is returned, see encrypt
+			 * @param[in]		plainMessage	a buffer holding the message to encrypt, can be text or data.
+			 * @param[out]		cipherMessage	the encrypted message which must be routed to all recipients(if one is produced, depends on encryption policy)
+			 * @param[in]		encryptionPolicy	select how to manage the encryption, see encrypt
+			 *
+			 * @return	true when the message is encrypted, false when it would need network access to the X3DH server(or no recipient is left to encrypt to)
+			 */
+			bool try_encrypt(const std::string &localDeviceId, const std::string &recipientUserId, std::vector<RecipientData> &recipients, const std::vector<uint8_t> &plainMessage, std::vector<uint8_t> &cipherMessage, lime::EncryptionPolicy encryptionPolicy=lime::EncryptionPolicy::optimizeUploadSize);
+
+			/**
+			 * @brief Get the maximum sizes of the encrypt outputs for a given plain message size, whatever the encryption policy
+			 *
+			 * Use them to allocate the output buffers before encrypting: a DR message is at most DRmessageSize bytes, the cipher message at most cipherMessageSize bytes.
+			 * The DRMessagesArena buffer holds at most the recipients count times DRmessageSize bytes.
+			 *
+			 * @param[in]	plainMessageSize	size of the plain message to encrypt
+			 * @param[in]	curve			the curve used by the local user
+			 * @param[out]	DRmessageSize		maximum size of a DR message
+			 * @param[out]	cipherMessageSize	maximum size of the cipher message
+			 */
+			static void encryptOutBuffersMaximumSize(const size_t plainMessageSize, const lime::CurveId curve, size_t &DRmessageSize, size_t &cipherMessageSize);
+
 			/**
 			 * @brief Decrypt the given message
 			 *
@@ -241,6 +644,157 @@ namespace lime {
 			 */
 			lime::PeerDeviceStatus decrypt(const std::string &localDeviceId, const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, std::vector<uint8_t> &plainMessage);
 
+			/**
+			 * @brief Encrypt a large message(ie: a file) for a given list of recipient devices, streaming it instead of holding it in memory
+			 *
+			 * Same as encrypt using the cipherMessage encryption policy: the produced cipher message and DR messages are the same
+			 * and are decrypted by any of the decrypt functions.
+			 * The plain message is read and the cipher message written by chunks, they are both processed before this function returns,
+			 * so the reader and writer are never called afterward even if the encryption needs to wait for the X3DH server.
+			 *
+			 * @param[in]		localDeviceId	used to identify which local acount to use and also as the identified source of the message, shall be the GRUU
+			 * @param[in]		recipientUserId	the Id of intended recipient, shall be a sip:uri of user or conference, is used as associated data to ensure no-one can mess with intended recipient
+			 * @param[in,out]	recipients	a list of RecipientData holding the recipient device Id(GRUU), get the DRmessage and peer status after callback, see encrypt
+			 * @param[in]		plainStream	read the message to encrypt, can be text or data
+			 * @param[in]		cipherStream	write the encrypted message which must be routed to all recipients
+			 * @param[in]		callback	called when the DR messages are ready for all the recipients, see encrypt
+			 */
+			void encrypt(const std::string &localDeviceId, std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, const limeStreamReader &plainStream, const limeStreamWriter &cipherStream, const limeCallback &callback);
+
+			/**
+			 * @brief Decrypt a message encrypted with a cipher message, streaming the cipher message instead of holding it in memory
+			 *
+			 * The end of the cipher message(its authentication tag) is read first, then it is read sequentially by chunks.
+			 * The plain message is written by chunks as it is decrypted: it is authenticated only once all of it is processed,
+			 * if the return status is fail or an exception is raised, whatever was written must be discarded.
+			 *
+			 * @param[in]	localDeviceId		used to identify which local acount to use and also as the recipient device ID of the message, shall be the GRUU
+			 * @param[in]	recipientUserId		the Id of intended recipient, shall be a sip:uri of user or conference, is used as associated data to ensure no-one can mess with intended recipient
+			 * @param[in]	senderDeviceId		Identify sender Device, see decrypt
+			 * @param[in]	DRmessage		Double Ratchet message targeted to current device
+			 * @param[in]	cipherMessageSize	total size of the cipher message
+			 * @param[in]	cipherStream		read the cipher message
+			 * @param[in]	plainStream		write the decrypted message
+			 *
+			 * @return	fail if we cannot decrypt the message, unknown when it is the first message we ever receive from the sender device, untrusted for known but untrusted sender device, or trusted if it is
+			 */
+			lime::PeerDeviceStatus decrypt(const std::string &localDeviceId, const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const size_t cipherMessageSize, const limeStreamReader &cipherStream, const limeStreamWriter &plainStream);
+
+			/**
+			 * @brief Encrypt a buffer(text or file) for a given list of recipient devices, reading and writing caller's buffers
+			 *
+			 * Same as encrypt but the plain message and the cipher message are not copied in and out of internal buffers.
+			 * The encryption policy is resolved before this function returns, counting the recipients not already set to fail.
+			 * When it selects the cipher message, it is written in the given buffer before this function returns and the plain message
+			 * is not used anymore: the caller is free to release its buffers even if the callback is not called yet.
+			 * When it selects the DR message, the plain message is copied as it is encrypted in each DR message, cipherMessageSize is set to 0.
+			 *
+			 * @param[in]		localDeviceId		used to identify which local acount to use and also as the identified source of the message, shall be the GRUU
+			 * @param[in]		recipientUserId		the Id of intended recipient, shall be a sip:uri of user or conference, is used as associated data to ensure no-one can mess with intended recipient
+			 * @param[in,out]	recipients		a list of RecipientData holding the recipient device Id(GRUU), get the DRmessage and peer status after callback, see encrypt
+			 * @param[in]		plainMessage		the message to encrypt, can be text or data
+			 * @param[in]		plainMessageSize	size of the message to encrypt
+			 * @param[out]		cipherMessage		buffer to store the encrypted message which must be routed to all recipients, it must be at least plainMessageSize + 16 bytes
+			 * 						unless the DRMessage encryption policy is requested
+			 * @param[in]		cipherMessageMaxSize	size of the cipherMessage buffer
+			 * @param[out]		cipherMessageSize	size of the encrypted message written in cipherMessage, 0 when the payload is in the DR messages
+			 * @param[in]		callback		called when the DR messages are ready for all the recipients, see encrypt
+			 * @param[in]		encryptionPolicy	select how to manage the encryption, see encrypt
+			 */
+			void encrypt(const std::string &localDeviceId, const std::string &recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, const uint8_t *const plainMessage, const size_t plainMessageSize,
+					uint8_t *const cipherMessage, const size_t cipherMessageMaxSize, size_t &cipherMessageSize, const limeCallback &callback, lime::EncryptionPolicy encryptionPolicy=lime::EncryptionPolicy::optimizeUploadSize);
+
+			/**
+			 * @brief Decrypt the given message into a caller's buffer
+			 *
+			 * Same as decrypt but the cipher message is read from and the plain message written directly to the caller's buffers.
+			 * The plain message buffer must be large enough for any message these inputs could hold: at least cipherMessageSize - 16 bytes
+			 * when a cipher message is given, DRmessageSize otherwise. An exception is raised before any decryption is attempted if it is not.
+			 *
+			 * @param[in]	localDeviceId		used to identify which local acount to use and also as the recipient device ID of the message, shall be the GRUU
+			 * @param[in]	recipientUserId		the Id of intended recipient, shall be a sip:uri of user or conference, is used as associated data to ensure no-one can mess with intended recipient
+			 * @param[in]	senderDeviceId		Identify sender Device, see decrypt
+			 * @param[in]	DRmessage		Double Ratchet message targeted to current device
+			 * @param[in]	DRmessageSize		size of the Double Ratchet message
+			 * @param[in]	cipherMessage		common part of the encrypted message, can be nullptr if not present in the incoming message
+			 * @param[in]	cipherMessageSize	size of the cipher message, 0 if not present in the incoming message
+			 * @param[out]	plainMessage		the output buffer, its content must be discarded if the decryption fails
+			 * @param[in]	plainMessageMaxSize	size of the output buffer
+			 * @param[out]	plainMessageSize	size of the decrypted message
+			 *
+			 * @return	fail if we cannot decrypt the message, unknown when it is the first message we ever receive from the sender device, untrusted for known but untrusted sender device, or trusted if it is
+			 */
+			lime::PeerDeviceStatus decrypt(const std::string &localDeviceId, const std::string &recipientUserId, const std::string &senderDeviceId, const uint8_t *const DRmessage, const size_t DRmessageSize,
+					const uint8_t *const cipherMessage, const size_t cipherMessageSize, uint8_t *const plainMessage, const size_t plainMessageMaxSize, size_t &plainMessageSize);
+
+			/**
+			 * @brief Decrypt a batch of messages, ie: the ones queued while the device was offline
+			 *
+			 * Messages are decrypted in the given order, with the same result as calling decrypt on each of them.
+			 * The senders devices status are retrieved once and all the Double Ratchet sessions modifications are saved in one transaction
+			 * committed at the end of the batch. If the local storage fails, nothing is committed and an exception is raised.
+			 *
+			 * @param[in]		localDeviceId	used to identify which local acount to use and also as the recipient device ID of the messages, shall be the GRUU
+			 * @param[in,out]	messages	the incoming messages, get their plain message and their sender device status(fail if it could not be decrypted)
+			 */
+			void decrypt_batch(const std::string &localDeviceId, std::vector<DecryptionData> &messages);
+
+			/**
+			 * @brief Decrypt a message without blocking the caller
+			 *
+			 * The decryption is run by the executor set with set_decryptionExecutor, or a built-in thread if none is set.
+			 * Messages from the same sender device to the same local device are decrypted one after the other in the order
+			 * this function is called, so the Double Ratchet sessions process them as the synchronous decrypt would.
+			 * Decryptions pending when the LimeManager is destroyed are completed first.
+			 *
+			 * @param[in]	localDeviceId	used to identify which local acount to use and also as the recipient device ID of the message, shall be the GRUU
+			 * @param[in]	recipientUserId	the Id of intended recipient, shall be a sip:uri of user or conference, is used as associated data to ensure no-one can mess with intended recipient
+			 * @param[in]	senderDeviceId	Identify sender Device. This field shall be extracted from signaling data in transport protocol, is used to rebuild the authenticated data associated to the encrypted message
+			 * @param[in]	DRmessage	Double Ratcher message targeted to current device
+			 * @param[in]	cipherMessage	when present(depends on encryption policy) holds a common part of the encrypted message. Can be nullptr or empty.
+			 * @param[out]	plainMessage	the output buffer, valid when the callback is called with a status other than fail
+			 * @param[in]	callback	called with the sender device status(fail if the message could not be decrypted), from the executor thread
+			 */
+			void decrypt_async(const std::string &localDeviceId, std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<const std::string> senderDeviceId,
+					std::shared_ptr<const std::vector<uint8_t>> DRmessage, std::shared_ptr<const std::vector<uint8_t>> cipherMessage, std::shared_ptr<std::vector<uint8_t>> plainMessage,
+					const limeDecryptCallback &callback);
+
+			/**
+			 * @brief Set the executor running the asynchronous decryptions
+			 *
+			 * @param[in]	executor	the executor to use, nullptr for the built-in one(see lime::settings::asyncDecryption_threads)
+			 */
+			void set_decryptionExecutor(const limeExecutor &executor);
+
+			/**
+			 * @brief Warm up the sessions with a group of peer devices, so the first encryption to them is not slowed down
+			 *
+			 * Load from local storage the Double Ratchet sessions with the given peer devices, ie: when a group conversation is opened.
+			 * When requested, the devices without session get their key bundle from the X3DH server and a session is created for them,
+			 * an encryption requested meanwhile waits for it instead of fetching them again.
+			 * Devices without key bundle on the X3DH server are ignored.
+			 *
+			 * @param[in]	localDeviceId		used to identify which local acount to use, shall be the GRUU
+			 * @param[in]	peerDeviceIds		the peer devices Id (GRUU)
+			 * @param[in]	callback		called when the sessions are ready. It is called before this function returns if no X3DH server request is needed
+			 * @param[in]	fetchPeerBundles	when true, create the missing sessions, default is to only load the existing ones
+			 */
+			void prefetch_sessions(const std::string &localDeviceId, const std::vector<std::string> &peerDeviceIds, const limeCallback &callback, const bool fetchPeerBundles=false);
+
+			/**
+			 * @brief Fetch ahead of time the key bundles of peer devices we have no session with
+			 *
+			 * The key bundles are verified and kept in memory for a limited time(see lime::settings::peerBundle_cacheLifeTime_seconds).
+			 * The next encryption to one of these devices creates the session locally, without waiting for the X3DH server.
+			 * Each key bundle is used only once. Note that the X3DH server dispatches the One-time Pre-key of a bundle when it is fetched,
+			 * so a prefetched bundle which is never used wastes it.
+			 *
+			 * @param[in]	localDeviceId		used to identify which local acount to use, shall be the GRUU
+			 * @param[in]	peerDeviceIds		the peer devices Id (GRUU)
+			 * @param[in]	callback		called when the key bundles are stored. It is called before this function returns if no X3DH server request is needed
+			 */
+			void prefetch_peerBundles(const std::string &localDeviceId, const std::vector<std::string> &peerDeviceIds, const limeCallback &callback);
+
 			/**
 			 * @brief Update: shall be called once a day at least, performs checks, updates and cleaning operations
 			 *
@@ -258,6 +812,10 @@ namespace lime {
 			 * @note
 			 * The last two parameters are optional, if not used, set to defaults defined in lime::settings
 			 * (not done with param default value as the lime::settings shall not be available in public include)
+			 *
+			 * The users are updated as set by set_updatePipeline, by default all at once from the calling thread.
+			 * A user which cannot be loaded is reported as a failure in the callback, the others are still updated.
+			 * The LimeManager shall not be destroyed before the callback is called.
 			 */
 			void update(const limeCallback &callback, uint16_t OPkServerLowLimit, uint16_t OPkBatchSize);
 			/**
@@ -386,8 +944,257 @@ namespace lime {
 			 * @overload LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data)
 			 */
 			LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data);
+			/**
+			 * @brief Lime Manager constructor with local storage tuning
+			 *
+			 * @param[in]	db_access	string used to access DB: can be filename for sqlite3 or access params for mysql, directly forwarded to SOCI session opening
+			 * @param[in]	X3DH_post_data	A function to send data to the X3DH server, parameters includes a callback to transfer back the server response
+			 * @param[in]	db_mutex	a mutex used to lock database access
+			 * @param[in]	storageOptions	local storage settings(journal mode, synchronisation, memory mapping, cache size) applied when the database is opened
+			 */
+			LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data, std::shared_ptr<std::recursive_mutex> db_mutex, const lime::StorageOptions &storageOptions);
+			/**
+			 * @overload LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data, const lime::StorageOptions &storageOptions)
+			 */
+			LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data, const lime::StorageOptions &storageOptions);
+
+			/**
+			 * @brief Get the local storage settings in effect
+			 *
+			 * They may differ from the requested ones: sqlite can refuse a setting (ie: no wal or memory mapping on an in memory database)
+			 * and settings left to keep are reported as read from the database.
+			 *
+			 * @return the settings read back from the database connection
+			 */
+			lime::StorageOptions get_storageOptions();
+
+			/**
+			 * @brief Set the number of threads used to encrypt a message for several recipient devices in parallel
+			 *
+			 * The threads are shared by all the users managed by this LimeManager. Parallel encryption is used only when a message
+			 * has enough recipient devices, the sessions are then all saved in one local storage transaction, as in sequential mode.
+			 * Default is 0: encryption is performed sequentially in the calling thread.
+			 *
+			 * @param[in]	threadsCount	number of worker threads, 0 disables parallel encryption
+			 */
+			void set_encryptionThreads(const unsigned int threadsCount);
+
+			/**
+			 * @brief Enable or disable the predictive OPk update
+			 *
+			 * By default update() asks the X3DH server, for each user, the list of its OPks still there and uploads a new batch if needed.
+			 * In predictive mode, the OPks on server are projected from the local storage and from the OPks consumed by the X3DH init messages
+			 * received since the previous update: the server is queried only when this projection is under the OPk server low limit.
+			 * When uploading, the batch is grown to twice the consumption observed since the previous update.
+			 * A query is still made at least once every few updates as peers may fetch OPks without ever using them.
+			 *
+			 * @param[in]	enabled	true to enable the predictive mode
+			 */
+			void set_OPkPredictiveUpdate(const bool enabled);
+
+			/**
+			 * @brief Set the number of key exchange key pairs generated ahead of their use, for each curve
+			 *
+			 * The DR ratchet steps, performed when decrypting the first message of a peer reply, and the new sessions initialisations
+			 * draw their key pair from this pool instead of generating it inline. The pool is refilled by a background thread
+			 * once half of it is used. When it is empty, the key pair is generated inline.
+			 * The pooled private keys are wiped when drawn, when the pool is shrunk and when the manager is destroyed.
+			 * Default is 0: no pool, key pairs are always generated inline.
+			 *
+			 * @param[in]	depth	number of key pairs held per curve, 0 disables the pool
+			 */
+			void set_keyPairPoolDepth(const size_t depth);
+
+			/**
+			 * @brief Set how update() processes the users
+			 *
+			 * Updating a user is loading it, generating its new SPk and OPks if needed and exchanging with the X3DH server.
+			 * With a limit, update() starts that many users and starts the next one each time one is completed,
+			 * so a large number of users is not all loaded and sent to the X3DH server at once.
+			 * Default is no limit, no executor and no deferral.
+			 *
+			 * @param[in]	maxUsers		maximum number of users updated at once, 0 for no limit
+			 * @param[in]	executor		run each user update, so the keys generation is out of the thread calling update() or giving the X3DH server responses.
+			 * 					The X3DH server post function is then called from the executor. nullptr to run them from these threads.
+			 * @param[in]	deferFreshUsers		skip the users with a valid SPk whose OPks on server are known to be enough without querying it.
+			 * 					This is known only in predictive OPk update mode(see set_OPkPredictiveUpdate)
+			 */
+			void set_updatePipeline(const size_t maxUsers, const limeExecutor &executor, const bool deferFreshUsers);
+
+			/**
+			 * @brief Enable or disable the X3DH batch message
+			 *
+			 * When enabled, the requests of a local user to a same X3DH server are sent in one batch message during update()
+			 * and between begin_X3DHBatch and end_X3DHBatch. A batch is posted on behalf of the local device of its requests:
+			 * the transport authenticates it as it would each of the requests. The server shall support it: one which answers it with an error
+			 * gets the requests again one by one, as it does when disabled(default).
+			 *
+			 * @param[in]	enabled			true to group the requests
+			 * @param[in]	sharedCredential	the requests of all the local users go in the same batch, posted on behalf of the local device of its first request.
+			 * 					Only when the transport authenticates all the local users with one credential: the server shall then check
+			 * 					this credential may act for each device of the batch requests(ie: deleteUser, postSPk, getSelfOPks),
+			 * 					otherwise one device credentials would carry the requests of the others.
+			 */
+			void set_X3DHBatching(const bool enabled, const bool sharedCredential=false);
+
+			/**
+			 * @brief Queue the requests to the X3DH servers until end_X3DHBatch, ie: around a run of encryptions
+			 *
+			 * Calls may nest, the requests are sent when the last one is ended. Has no effect when batching is disabled.
+			 */
+			void begin_X3DHBatch();
+
+			/**
+			 * @brief Send the requests queued since begin_X3DHBatch
+			 */
+			void end_X3DHBatch();
+
+			/**
+			 * @brief Set the limits of the Double Ratchet sessions cache held by each local user
+			 *
+			 * When a limit is reached, the least recently used sessions are evicted from cache, they are reloaded from local storage
+			 * when needed again. Sessions not saved in local storage yet are never evicted so the limits may be temporarily exceeded.
+			 * Default is no limit.
+			 *
+			 * @param[in]	maxSessions	maximum number of sessions in each user cache, 0 for no limit
+			 * @param[in]	maxMemory	maximum memory used by the sessions in each user cache, in bytes, 0 for no limit
+			 */
+			void set_DRSessionsCacheLimits(const size_t maxSessions, const size_t maxMemory);
+
+			/**
+			 * @brief Get the Double Ratchet sessions cache usage of a local user
+			 *
+			 * @param[in]	localDeviceId	Identify the local user account, it must be unique and is also be used as Id on the X3DH key server, it shall be the GRUU
+			 * @param[out]	sessionsCount	number of sessions in cache
+			 * @param[out]	memorySize	estimation of the memory used by these sessions, in bytes
+			 */
+			void get_DRSessionsCacheUsage(const std::string &localDeviceId, size_t &sessionsCount, size_t &memorySize);
+
+			/**
+			 * @brief Save the Double Ratchet sessions cache of the users loaded in memory to a snapshot file
+			 *
+			 * Meant to be called at shutdown or when the application is suspended so the next start restores the sessions
+			 * with load_sessionsSnapshot instead of reading them one by one from local storage.
+			 * Each user snapshot is encrypted with a random key held in local storage. Only the last snapshot of a user can be loaded.
+			 *
+			 * @param[in]	filename	path of the snapshot file, replaced if it exists
+			 */
+			void save_sessionsSnapshot(const std::string &filename);
+
+			/**
+			 * @brief Restore the Double Ratchet sessions saved by save_sessionsSnapshot
+			 *
+			 * The sessions modified in local storage since the snapshot was taken are not restored, they are loaded as usual when needed.
+			 * The users of the snapshot are loaded in memory. The snapshot file is deleted: a snapshot is loaded only once.
+			 *
+			 * @param[in]	filename	path of the snapshot file
+			 *
+			 * @return the number of sessions restored, 0 if the file does not exist
+			 */
+			size_t load_sessionsSnapshot(const std::string &filename);
+
+			/**
+			 * @brief Set the maximum number of local users kept loaded in memory
+			 *
+			 * When it is reached, the least recently used users are unloaded, they are loaded again from local storage when needed.
+			 * A user is never unloaded while it has a pending operation: X3DH server request waiting for its response or queued encryption.
+			 * Default is no limit.
+			 *
+			 * @param[in]	maxUsers	maximum number of users kept loaded, 0 for no limit
+			 */
+			void set_usersCacheLimit(const size_t maxUsers);
+
+			/**
+			 * @brief Get the number of local users currently loaded in memory
+			 *
+			 * @return the number of users in cache
+			 */
+			size_t get_usersCacheSize();
+
+			/**
+			 * @brief Enable or disable the runtime metrics collection
+			 *
+			 * When disabled, the operations only check a flag: there is no clock read nor counter update.
+			 * Disabling keeps the metrics collected so far. Default is disabled.
+			 *
+			 * @param[in]	enabled	true to collect the metrics
+			 */
+			void set_metricsEnabled(const bool enabled);
+
+			/**
+			 * @brief Get the runtime metrics collected since the manager creation or the last reset
+			 *
+			 * They cover all the users managed by this LimeManager. The counters are read one by one while the operations go on,
+			 * so a snapshot taken under load may be slightly inconsistent(ie: an operation counted in calls but not yet in its histogram)
+			 *
+			 * @param[out]	metrics	the counters, durations and latencies histograms
+			 */
+			void get_metrics(lime::Metrics &metrics);
+
+			/**
+			 * @brief Reset all the runtime metrics to 0
+			 */
+			void reset_metrics();
+
+			/**
+			 * @brief Set the tracing callback, receiving the begin and end events of the traced operations spans
+			 *
+			 * With no callback, each traced operation only checks for one. Default is no callback.
+			 *
+			 * @param[in]	callback	the tracing callback, an empty function to stop tracing
+			 */
+			void set_traceCallback(const limeTraceCallback &callback);
+
+			/**
+			 * @brief Run a bounded step of the local storage cleanup
+			 *
+			 * Deletes, in small batches, what update() deletes at once: old stale DR sessions and their skipped message keys,
+			 * message keys kept for too long, old stale SPks and OPks. The database is released between batches so
+			 * encryptions and decryptions are not stalled. Each call resumes where the previous one stopped.
+			 * Meant to run periodically from a low priority maintenance task, with lime::StorageOptions::deferredCleanup set.
+			 *
+			 * @param[in]	timeBudget	no new batch is started once this duration is elapsed
+			 * @param[in]	rowBudget	maximum number of rows deleted by this call, 0 for no limit
+			 *
+			 * @return true when the cleanup is complete, false when a budget was exhausted: call it again later
+			 */
+			bool cleanup(const std::chrono::milliseconds timeBudget, const size_t rowBudget=0);
+
+			/**
+			 * @brief Get the local storage size and the rows held for each local user in the tables churning the most
+			 *
+			 * @param[out]	usage	the databases size and the per user, per table, rows count and size
+			 */
+			void get_storageUsage(lime::StorageUsage &usage);
+
+			/**
+			 * @brief Run a bounded step of the local storage compaction: give the free pages left by the deleted rows back to the file system
+			 *
+			 * The pages are released by small batches, each one holding the database on its own. Between them, the encryptions
+			 * and decryptions in progress go first. It does not run at the same time as cleanup(): run it after the cleanup is complete.
+			 * The databases created by this version are in incremental compaction mode. An older one must first be converted by a full
+			 * rewrite of the file, which holds the database during the whole operation: it is done only when allowVacuum is set.
+			 *
+			 * @param[in]	timeBudget	no new batch is started once this duration is elapsed
+			 * @param[in]	allowVacuum	convert the databases not in incremental compaction mode, regardless of the time budget
+			 *
+			 * @return true when there is no free page left, false when the time budget was exhausted or a database could not be compacted yet
+			 */
+			bool compact(const std::chrono::milliseconds timeBudget, const bool allowVacuum=false);
+
+			/**
+			 * @brief Commit the sessions updates queued by the write-behind mode, see lime::StorageOptions::writeBehindDepth
+			 *
+			 * This is the durability barrier of the write-behind mode: once it returns, the sessions state produced by all the
+			 * encryptions and decryptions completed before the call is in local storage. Until then, a crash gets the sessions back to an older state:
+			 * - the messages encrypted since then shall not be released before this call returns, the next encryptions would reuse their message keys
+			 * - the messages decrypted since then would be accepted again
+			 *
+			 * Does nothing when the write-behind mode is disabled.
+			 */
+			void flush();
 
-			~LimeManager() = default;
+			~LimeManager();
 	};
 } //namespace lime
 #endif /* lime_hpp */
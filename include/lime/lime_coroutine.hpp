@@ -0,0 +1,225 @@
+/*
+	lime_coroutine.hpp
+	@author Johan Pascal
+	@copyright	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef lime_coroutine_hpp
+#define lime_coroutine_hpp
+
+#if !defined(__cpp_impl_coroutine)
+#error "lime/lime_coroutine.hpp requires C++20 coroutines support"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lime/lime.hpp"
+
+/**
+ * @brief C++20 coroutine interface to the asynchronous LimeManager operations
+ *
+ * Header only, built on the callback API: the library itself does not need to be compiled as C++20.
+ * The operations return awaitables giving their lime::awaitable::CallbackResult instead of calling a limeCallback:
+ * - an operation completing within its call(ie: an encryption with all its sessions ready) does not suspend the coroutine.
+ * - otherwise the coroutine is resumed from the completion callback, in the thread delivering the X3DH server response: there is no
+ *   thread hop and the completion closure holds only a pointer to the awaiter, it does not need a heap allocation.
+ *   As a limeCallback, the resumed coroutine runs after lime released its locks and may call the LimeManager again, but it shall not destroy it.
+ * - the arguments are held by the awaiter until completion and the exceptions thrown by the operation call itself are rethrown by co_await.
+ */
+namespace lime {
+namespace awaitable {
+
+	/**
+	 * @brief Completion of an asynchronous operation, the arguments a limeCallback would have been given
+	 */
+	struct CallbackResult {
+		lime::CallbackReturn status; /**< success or fail */
+		std::string message; /**< details on the failure, empty on success */
+	};
+
+	/**
+	 * @brief Response from the X3DH server, produced by the awaitable transport given to make_X3DHServerPost
+	 */
+	struct X3DHServerResponse {
+		int code; /**< the HTTP(S) response code, lime expects 200, 0 when no response was received */
+		std::vector<uint8_t> body; /**< the response body */
+	};
+
+	namespace detail {
+		/**
+		 * @brief Awaiter of an operation completed by a limeCallback
+		 *
+		 * The operation is started by the launch function when the coroutine is suspending: the awaiter is then stored in
+		 * the coroutine frame so its callback can reach it. Whichever of the launch return and the callback comes last
+		 * decides if the coroutine is suspended or resumed.
+		 */
+		template <typename Launch>
+		class CallbackAwaiter {
+			private:
+				Launch m_launch; // start the operation with the given callback
+				CallbackResult m_result;
+				std::coroutine_handle<> m_handle;
+				std::atomic<bool> m_arrived; // set by the first of the launch return and the callback
+
+				void complete(const lime::CallbackReturn status, const std::string &message) {
+					m_result.status = status;
+					m_result.message = message;
+					if (m_arrived.exchange(true, std::memory_order_acq_rel)) { // the coroutine is suspended, resume it
+						m_handle.resume();
+					}
+				}
+
+			public:
+				explicit CallbackAwaiter(Launch &&launch) : m_launch(std::move(launch)), m_result{lime::CallbackReturn::fail, ""}, m_handle{}, m_arrived{false} {};
+				CallbackAwaiter(const CallbackAwaiter &) = delete;
+				CallbackAwaiter &operator=(const CallbackAwaiter &) = delete;
+
+				bool await_ready() const noexcept {return false;};
+				bool await_suspend(std::coroutine_handle<> handle) {
+					m_handle = handle;
+					m_launch(limeCallback([this](const lime::CallbackReturn status, const std::string message) {
+						complete(status, message);
+					}));
+					// the operation may have completed within the launch: do not suspend then
+					return !m_arrived.exchange(true, std::memory_order_acq_rel);
+				};
+				CallbackResult await_resume() {return std::move(m_result);};
+		};
+
+		template <typename Launch>
+		CallbackAwaiter<Launch> make_callbackAwaiter(Launch &&launch) {
+			return CallbackAwaiter<Launch>{std::move(launch)};
+		}
+
+		/**
+		 * @brief Coroutine running on its own until completion, its frame is destroyed when it ends
+		 */
+		struct DetachedTask {
+			struct promise_type {
+				DetachedTask get_return_object() noexcept {return {};};
+				std::suspend_never initial_suspend() noexcept {return {};};
+				std::suspend_never final_suspend() noexcept {return {};};
+				void return_void() noexcept {};
+				void unhandled_exception() noexcept {std::terminate();};
+			};
+		};
+
+		/* post a message through the awaitable transport and forward its response to lime, a transport exception is forwarded as no response */
+		template <typename AwaitablePost>
+		DetachedTask X3DHServerPost(std::shared_ptr<AwaitablePost> post, std::string url, std::string from, std::vector<uint8_t> message, limeX3DHServerResponseProcess responseProcess) {
+			X3DHServerResponse response{0, {}};
+			try {
+				response = co_await (*post)(url, from, message);
+			} catch (...) {
+				response = X3DHServerResponse{0, {}};
+			}
+			responseProcess(response.code, response.body); // lime processing of the response does not throw
+		}
+	} // namespace detail
+
+	/**
+	 * @brief Build a limeX3DHServerPostData from an awaitable transport, to give to the LimeManager constructor
+	 *
+	 * For each message posted, a coroutine awaits the transport and forwards the response to lime.
+	 * As for any limeX3DHServerPostData, the response must not be produced within the post call: lime may post holding locks its response processing needs,
+	 * so the transport awaitable shall suspend.
+	 *
+	 * @param[in]	post	callable as post(url, from, message), all three given as lvalues which remain valid until the response is produced,
+	 * 			returning an awaitable producing a lime::awaitable::X3DHServerResponse
+	 *
+	 * @return the post function to give to the LimeManager
+	 */
+	template <typename AwaitablePost>
+	limeX3DHServerPostData make_X3DHServerPost(AwaitablePost post) {
+		auto sharedPost = std::make_shared<AwaitablePost>(std::move(post)); // the pending posts keep the transport alive
+		return [sharedPost](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess) {
+			detail::X3DHServerPost(sharedPost, url, from, message, responseProcess);
+		};
+	}
+
+	/**
+	 * @brief Awaitable version of LimeManager::create_user
+	 *
+	 * @return an awaitable producing the operation CallbackResult
+	 */
+	inline auto create_user(LimeManager &manager, std::string localDeviceId, std::string x3dhServerUrl, const lime::CurveId curve, const uint16_t OPkInitialBatchSize) {
+		return detail::make_callbackAwaiter([&manager, localDeviceId=std::move(localDeviceId), x3dhServerUrl=std::move(x3dhServerUrl), curve, OPkInitialBatchSize](const limeCallback &callback) {
+			manager.create_user(localDeviceId, x3dhServerUrl, curve, OPkInitialBatchSize, callback);
+		});
+	}
+	/**
+	 * @overload create_user(LimeManager &manager, std::string localDeviceId, std::string x3dhServerUrl, const lime::CurveId curve)
+	 */
+	inline auto create_user(LimeManager &manager, std::string localDeviceId, std::string x3dhServerUrl, const lime::CurveId curve) {
+		return detail::make_callbackAwaiter([&manager, localDeviceId=std::move(localDeviceId), x3dhServerUrl=std::move(x3dhServerUrl), curve](const limeCallback &callback) {
+			manager.create_user(localDeviceId, x3dhServerUrl, curve, callback);
+		});
+	}
+
+	/**
+	 * @brief Awaitable version of LimeManager::delete_user
+	 *
+	 * @return an awaitable producing the operation CallbackResult
+	 */
+	inline auto delete_user(LimeManager &manager, std::string localDeviceId) {
+		return detail::make_callbackAwaiter([&manager, localDeviceId=std::move(localDeviceId)](const limeCallback &callback) {
+			manager.delete_user(localDeviceId, callback);
+		});
+	}
+
+	/**
+	 * @brief Awaitable version of LimeManager::encrypt
+	 *
+	 * The coroutine is suspended only when key bundles must be fetched from the X3DH server.
+	 *
+	 * @return an awaitable producing the operation CallbackResult, recipients and cipherMessage are set when it is a success
+	 */
+	inline auto encrypt(LimeManager &manager, std::string localDeviceId, std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients,
+			std::shared_ptr<const std::vector<uint8_t>> plainMessage, std::shared_ptr<std::vector<uint8_t>> cipherMessage, const lime::EncryptionPolicy encryptionPolicy=lime::EncryptionPolicy::optimizeUploadSize) {
+		return detail::make_callbackAwaiter([&manager, localDeviceId=std::move(localDeviceId), recipientUserId=std::move(recipientUserId), recipients=std::move(recipients),
+				plainMessage=std::move(plainMessage), cipherMessage=std::move(cipherMessage), encryptionPolicy](const limeCallback &callback) {
+			manager.encrypt(localDeviceId, recipientUserId, recipients, plainMessage, cipherMessage, callback, encryptionPolicy);
+		});
+	}
+
+	/**
+	 * @brief Awaitable version of LimeManager::update
+	 *
+	 * @return an awaitable producing the operation CallbackResult
+	 */
+	inline auto update(LimeManager &manager, const uint16_t OPkServerLowLimit, const uint16_t OPkBatchSize) {
+		return detail::make_callbackAwaiter([&manager, OPkServerLowLimit, OPkBatchSize](const limeCallback &callback) {
+			manager.update(callback, OPkServerLowLimit, OPkBatchSize);
+		});
+	}
+	/**
+	 * @overload update(LimeManager &manager)
+	 */
+	inline auto update(LimeManager &manager) {
+		return detail::make_callbackAwaiter([&manager](const limeCallback &callback) {
+			manager.update(callback);
+		});
+	}
+
+} // namespace awaitable
+} // namespace lime
+
+#endif /* lime_coroutine_hpp */
@@ -70,7 +70,8 @@ enum lime_ffi_EncryptionPolicy {
 	lime_ffi_EncryptionPolicy_DRMessage, /**< the plaintext input is encrypted inside the Double Ratchet message (each recipient get a different encryption): not optimal for messages with numerous recipient */
 	lime_ffi_EncryptionPolicy_cipherMessage, /**< the plaintext input is encrypted with a random key and this random key is encrypted to each participant inside the Double Ratchet message(for a single recipient the overhead is 48 bytes) */
 	lime_ffi_EncryptionPolicy_optimizeUploadSize, /**< optimize upload size: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on upload size only. This is the default policy used */
-	lime_ffi_EncryptionPolicy_optimizeGlobalBandwidth /**< optimize bandwith usage: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on uploadand download (from server to recipients) sizes added. */
+	lime_ffi_EncryptionPolicy_optimizeGlobalBandwidth, /**< optimize bandwith usage: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on uploadand download (from server to recipients) sizes added. */
+	lime_ffi_EncryptionPolicy_senderKey /**< encrypt with a sender key chain shared by the group, distributed over Double Ratchet sessions: constant cost per message whatever the recipients number, with weaker security properties. See lime::EncryptionPolicy::senderKey */
 };
 
 /**
@@ -109,6 +110,40 @@ typedef struct {
 	size_t DRmessageSize; /**< input/output: size off the DRmessage buffer at input, size of written data as output */
 } lime_ffi_RecipientData_t;
 
+/** Operations timed by the runtime metrics, used as index in lime_ffi_Metrics_t operations, mirrors lime::MetricsOperation */
+enum lime_ffi_MetricsOperation {
+	lime_ffi_MetricsOperation_encrypt = 0, /**< encrypt, including the X3DH init of new sessions but not the wait for the X3DH server */
+	lime_ffi_MetricsOperation_decrypt = 1, /**< decrypt */
+	lime_ffi_MetricsOperation_sessionSave = 2, /**< save a Double Ratchet session in local storage */
+	lime_ffi_MetricsOperation_sessionLoad = 3, /**< load a Double Ratchet session from local storage */
+	lime_ffi_MetricsOperation_trySkippedMessageKeys = 4, /**< look for a skipped message key in local storage */
+	lime_ffi_MetricsOperation_X3DHRoundTrip = 5, /**< from the post of a message to the X3DH server to its response */
+	lime_ffi_MetricsOperation_OPkGeneration = 6 /**< generate and store a batch of OPks */
+};
+
+#define LIME_FFI_METRICS_OPERATIONS_COUNT 7
+#define LIME_FFI_METRICS_HISTOGRAM_BUCKETS 24
+
+/** @brief Metrics of one operation, all durations are in nanoseconds */
+typedef struct {
+	uint64_t calls; /**< number of completed operations */
+	uint64_t totalTime; /**< cumulated duration */
+	uint64_t DBTime; /**< part of totalTime spent in local storage accesses */
+	uint64_t cryptoTime; /**< part of totalTime not spent in local storage */
+	uint64_t latencyHistogram[LIME_FFI_METRICS_HISTOGRAM_BUCKETS]; /**< operations count per duration: bucket 0 is less than 1us, bucket n is [2^(n-1), 2^n[ us, the last one holds all the longer ones */
+} lime_ffi_OperationMetrics_t;
+
+/** @brief Runtime metrics of a lime manager, see lime_ffi_set_metricsEnabled */
+typedef struct {
+	lime_ffi_OperationMetrics_t operations[LIME_FFI_METRICS_OPERATIONS_COUNT]; /**< indexed by lime_ffi_MetricsOperation */
+	uint64_t DRSessionsCacheHits; /**< Double Ratchet sessions found in the manager cache */
+	uint64_t DRSessionsCacheMisses; /**< Double Ratchet sessions not found in cache */
+	uint64_t staleSessionDecrypts; /**< messages decrypted with a session which is not the active one */
+	uint64_t skippedKeysDerived; /**< message keys derived and stored for out of order messages */
+	uint64_t DBMutexWaitTime; /**< time spent waiting for the local storage mutex held by another thread, in ns */
+	uint64_t usersMutexWaitTime; /**< time spent waiting for the manager users cache mutex held by another thread, in ns */
+} lime_ffi_Metrics_t;
+
 /** @brief Callback use to give a status on asynchronous operation
  *
  *	it returns a code and may return a string (could actually be empty) to detail what's happening
@@ -310,6 +345,66 @@ enum lime_ffi_PeerDeviceStatus lime_ffi_decrypt(lime_manager_t manager, const ch
 		const uint8_t *const cipherMessage, const size_t cipherMessageSize,
 		uint8_t *const plainMessage, size_t *plainMessageSize);
 
+/**
+ * @brief Encrypt a buffer (text or file) for a given list of recipient devices, reading from and writing to the caller's buffers
+ *
+ * Same as lime_ffi_encrypt but:
+ * - the plain message is read directly from the caller's buffer. It must stay valid until the callback is called.
+ * - when the encryption policy selects the cipher message, it is written directly in the caller's buffer before this function returns
+ *   and cipherMessageSize is updated then. It is set to 0 when the payload is in the DR messages.
+ * - the DR messages are written in the recipients buffers when all of them are ready, just before the callback is called. All the buffers are checked
+ *   before any is written: if one is too small, the callback is called once with a fail status.
+ *
+ * The output buffers shall be sized using lime_ffi_encryptOutBuffersMaximumSize.
+ *
+ * @param[in]		manager			pointer to the opaque structure used to interact with lime
+ * @param[in]		localDeviceId		used to identify which local acount to use and also as the identified source of the message, shall be the GRUU
+ * @param[in]		recipientUserId		the Id of intended recipient, see lime_ffi_encrypt
+ * @param[in,out]	recipients		a list of RecipientData, see lime_ffi_encrypt. It must stay valid until the callback is called.
+ * @param[in]		recipientsSize		how many recipients are in the recipients array
+ * @param[in]		plainMessage		a buffer holding the message to encrypt, can be text or data.
+ * @param[in]		plainMessageSize	size of the plainMessage buffer
+ * @param[out]		cipherMessage		points to the buffer to store the encrypted message which must be routed to all recipients(if one is produced, depends on encryption policy)
+ * @param[in,out]	cipherMessageSize	size of the cipherMessage buffer, is updated with the size of the actual data written in it before this function returns
+ * @param[in]		callback		called when the DR messages are written in the recipients buffers, giving the exit status and an error message in case of failure.
+ * @param[in]		callbackUserData	this pointer will be forwarded to the callback as first parameter
+ * @param[in]		encryptionPolicy	select how to manage the encryption, see lime_ffi_encrypt
+ *
+ * @return LIME_FFI_SUCCESS or a negative error code, the callback is not called when an error is returned
+ */
+int lime_ffi_encryptDirect(lime_manager_t manager, const char *localDeviceId,
+		const char *recipientUserId, lime_ffi_RecipientData_t *const recipients, const size_t recipientsSize,
+		const uint8_t *const plainMessage, const size_t plainMessageSize,
+		uint8_t *const cipherMessage, size_t *cipherMessageSize,
+		const lime_ffi_Callback callback, void *callbackUserData,
+		enum lime_ffi_EncryptionPolicy encryptionPolicy);
+
+/**
+ * @brief Decrypt the given message, reading from and writing to the caller's buffers
+ *
+ * Same as lime_ffi_decrypt but the cipher message, when present, is decrypted directly from and to the caller's buffers.
+ * The plainMessage buffer size is checked before any decryption is attempted: it must be at least cipherMessageSize - 16 when a cipher message is given,
+ * DRmessageSize otherwise. If it is not, fail is returned and the message can still be decrypted with a larger buffer.
+ *
+ * @param[in]		manager			pointer to the opaque structure used to interact with lime
+ * @param[in]		localDeviceId		used to identify which local acount to use and also as the recipient device ID of the message, shall be the GRUU
+ * @param[in]		recipientUserId		the Id of intended recipient, see lime_ffi_decrypt
+ * @param[in]		senderDeviceId		Identify sender Device, see lime_ffi_decrypt
+ * @param[in]		DRmessage		Double Ratchet message targeted to current device
+ * @param[in]		DRmessageSize		DRmessage buffer size
+ * @param[in]		cipherMessage		when present (depends on encryption policy) holds a common part of the encrypted message. Set to NULL if not present in the incoming message.
+ * @param[in]		cipherMessageSize	cipherMessage buffer size(set to 0 if no cipherMessage is present in the incoming message)
+ * @param[out]		plainMessage		the output buffer
+ * @param[in,out]	plainMessageSize	plainMessage buffer size, updated with the actual size of the data written
+ *
+ * @return	fail if we cannot decrypt the message, unknown when it is the first message we ever receive from the sender device, untrusted for known but untrusted sender device, or trusted if it is
+ */
+enum lime_ffi_PeerDeviceStatus lime_ffi_decryptDirect(lime_manager_t manager, const char *localDeviceId,
+		const char *recipientUserId, const char *senderDeviceId,
+		const uint8_t *const DRmessage, const size_t DRmessageSize,
+		const uint8_t *const cipherMessage, const size_t cipherMessageSize,
+		uint8_t *const plainMessage, size_t *plainMessageSize);
+
 /**
  * @brief retrieve self Identity Key, an EdDSA formatted public key
  *
@@ -424,6 +519,35 @@ int lime_ffi_set_x3dhServerUrl(lime_manager_t manager, const char *localDeviceId
  */
 int lime_ffi_get_x3dhServerUrl(lime_manager_t manager, const char *localDeviceId, char *x3dhServerUrl, size_t *x3dhServerUrlSize);
 
+/**
+ * @brief Enable or disable the runtime metrics collection, default is disabled
+ *
+ * @param[in]	manager		pointer to the opaque structure used to interact with lime
+ * @param[in]	enabled		0 to disable, any other value to enable
+ *
+ * @return LIME_FFI_SUCCESS or a negative error code
+ */
+int lime_ffi_set_metricsEnabled(lime_manager_t manager, const int enabled);
+
+/**
+ * @brief Get the runtime metrics collected since the manager creation or the last reset
+ *
+ * @param[in]	manager		pointer to the opaque structure used to interact with lime
+ * @param[out]	metrics		the counters, durations and latencies histograms
+ *
+ * @return LIME_FFI_SUCCESS or a negative error code
+ */
+int lime_ffi_get_metrics(lime_manager_t manager, lime_ffi_Metrics_t *metrics);
+
+/**
+ * @brief Reset all the runtime metrics to 0
+ *
+ * @param[in]	manager		pointer to the opaque structure used to interact with lime
+ *
+ * @return LIME_FFI_SUCCESS or a negative error code
+ */
+int lime_ffi_reset_metrics(lime_manager_t manager);
+
 #ifdef __cplusplus
 }
 #endif
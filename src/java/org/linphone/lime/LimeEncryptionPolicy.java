@@ -22,7 +22,8 @@ public enum LimeEncryptionPolicy {
 	DRMESSAGE(0), /**< the plaintext input is encrypted inside the Double Ratchet message (each recipient get a different encryption): not optimal for messages with numerous recipient */
 	CIPHERMESSAGE(1), /**< the plaintext input is encrypted with a random key and this random key is encrypted to each participant inside the Double Ratchet message(for a single recipient the overhead is 48 bytes) */
 	OPTIMIZEUPLOADSIZE(2), /**< optimize upload size: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on upload size only. This is the default policy used */
-	OPTIMIZEGLOBALBANDWIDTH(3); /**< optimize bandwith usage: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on uploadand download (from server to recipients) sizes added. */
+	OPTIMIZEGLOBALBANDWIDTH(3), /**< optimize bandwith usage: encrypt in DR message if plaintext is short enougth to beat the overhead introduced by cipher message scheme, otherwise use cipher message. Selection is made on uploadand download (from server to recipients) sizes added. */
+	SENDERKEY(4); /**< encrypt with a sender key chain shared by the group, distributed over Double Ratchet sessions: constant cost per message whatever the recipients number, with weaker security properties */
 
 	private int native_val; /* Store the native(used by jni) integer value */
 
@@ -18,6 +18,8 @@
 */
 package org.linphone.lime;
 
+import java.nio.ByteBuffer;
+
 /**
  * @brief A java wrapper around the native Lime Manager interface
  *
@@ -35,6 +37,8 @@ public class LimeManager {
 	// Enumeration translation is done on java side
 	private native int n_decrypt(String localDeviceId, String recipientUserId, String senderDeviceId, byte[] DRmessage, byte[] cipherMessage, LimeOutputBuffer plainMessage);
 	private native void n_encrypt(String localDeviceId, String recipientUserId, RecipientData[] recipients, byte[] plainMessage, LimeOutputBuffer cipherMessage, LimeStatusCallback statusObj, int encryptionPolicy);
+	private native long n_decryptDirect(String localDeviceId, String recipientUserId, String senderDeviceId, ByteBuffer DRmessage, int DRoffset, int DRsize, ByteBuffer cipherMessage, int cipherOffset, int cipherSize, ByteBuffer plainMessage, int plainOffset, int plainMaxSize);
+	private native int n_encryptDirect(String localDeviceId, String recipientUserId, RecipientData[] recipients, ByteBuffer plainMessage, int plainOffset, int plainSize, ByteBuffer cipherMessage, int cipherOffset, int cipherMaxSize, LimeStatusCallback statusObj, int encryptionPolicy);
 
 	private native void n_create_user(String localDeviceId, String serverURL, int curveId, int OPkInitialBatchSize, LimeStatusCallback statusObj);
 	private native void n_update(LimeStatusCallback statusObj, int OPkServerLowLimit, int OPkBatchSize);
@@ -159,6 +163,42 @@ public class LimeManager {
 		this.n_encrypt(localDeviceId, recipientUserId, recipients, plainMessage, cipherMessage, statusObj, LimeEncryptionPolicy.OPTIMIZEUPLOADSIZE.getNative());
 	}
 
+	/**
+	 * @brief Encrypt a buffer (text or file) for a given list of recipient devices, using direct ByteBuffers
+	 *
+	 * Same as encrypt but the native code reads the plain message from and writes the cipher message to the given direct buffers, no copy is made on the way.
+	 * The plain message is the buffer remaining bytes, they are all consumed. The cipher message is written at the cipher buffer position which is then
+	 * advanced by its size: nothing is written when the encryption policy selects the DR messages. The cipher message is written before this function returns
+	 * and the buffers are not accessed after it: they can be reused even if the statusObj callback is not called yet.
+	 * The DR messages are given back in the recipients array as with encrypt.
+	 *
+	 * @param[in]		localDeviceId	used to identify which local acount to use and also as the identified source of the message, shall be the GRUU
+	 * @param[in]		recipientUserId	the Id of intended recipient, shall be a sip:uri of user or conference, is used as associated data to ensure no-one can mess with intended recipient
+	 * @param[in,out]	recipients	a list of RecipientData, see encrypt
+	 * @param[in]		plainMessage	a direct buffer holding the message to encrypt between its position and limit
+	 * @param[out]		cipherMessage	a direct buffer to store the encrypted message, it must have at least plainMessage.remaining() + 16 bytes remaining
+	 * 					unless the DRMESSAGE encryption policy is requested
+	 * @param[in]		statusObj	called when the operation is completed, see encrypt
+	 * @param[in]		encryptionPolicy	select how to manage the encryption, see encrypt
+	 *
+	 * @throws LimeException when a buffer is not direct or too small
+	 */
+	public void encrypt(String localDeviceId, String recipientUserId, RecipientData[] recipients, ByteBuffer plainMessage, ByteBuffer cipherMessage, LimeStatusCallback statusObj, LimeEncryptionPolicy encryptionPolicy) throws LimeException {
+		if (!plainMessage.isDirect() || !cipherMessage.isDirect()) {
+			throw new LimeException("encrypt needs direct ByteBuffers");
+		}
+		int cipherMessageSize = this.n_encryptDirect(localDeviceId, recipientUserId, recipients, plainMessage, plainMessage.position(), plainMessage.remaining(), cipherMessage, cipherMessage.position(), cipherMessage.remaining(), statusObj, encryptionPolicy.getNative());
+		plainMessage.position(plainMessage.limit());
+		cipherMessage.position(cipherMessage.position() + cipherMessageSize);
+	}
+	/**
+	* @overload encrypt(String localDeviceId, String recipientUserId, RecipientData[] recipients, ByteBuffer plainMessage, ByteBuffer cipherMessage, LimeStatusCallback statusObj)
+	* convenience form using LimeEncryptionPolicy.OPTIMIZEUPLOADSIZE as default policy
+	*/
+	public void encrypt(String localDeviceId, String recipientUserId, RecipientData[] recipients, ByteBuffer plainMessage, ByteBuffer cipherMessage, LimeStatusCallback statusObj) throws LimeException {
+		this.encrypt(localDeviceId, recipientUserId, recipients, plainMessage, cipherMessage, statusObj, LimeEncryptionPolicy.OPTIMIZEUPLOADSIZE);
+	}
+
 	/**
 	 * @brief Decrypt the given message
 	 *
@@ -189,6 +229,41 @@ public class LimeManager {
 		return LimePeerDeviceStatus.fromNative(native_status);
 	}
 
+	/**
+	 * @brief Decrypt the given message, using direct ByteBuffers
+	 *
+	 * Same as decrypt but the native code reads the DR and cipher messages from and writes the plain message to the given direct buffers, no copy is made on the way.
+	 * The DR and cipher messages are the buffers remaining bytes, they are all consumed. The plain message is written at the plain buffer position which is then
+	 * advanced by its size.
+	 *
+	 * @param[in]		localDeviceId	used to identify which local acount to use and also as the recipient device ID of the message, shall be the GRUU
+	 * @param[in]		recipientUserId	the Id of intended recipient, see decrypt
+	 * @param[in]		senderDeviceId	Identify sender Device, see decrypt
+	 * @param[in]		DRmessage	a direct buffer holding the Double Ratchet message targeted to current device between its position and limit
+	 * @param[in]		cipherMessage	a direct buffer holding the common part of the encrypted message between its position and limit, can be null if not present in the incoming message
+	 * @param[out]		plainMessage	a direct buffer to store the decrypted message, it must have at least cipherMessage.remaining() - 16 bytes remaining
+	 * 					or DRmessage.remaining() when there is no cipher message. Its content must be discarded if the decryption fails.
+	 *
+	 * @return	LimePeerDeviceStatus.FAIL if we cannot decrypt the message, LimePeerDeviceStatus.UNKNOWN when it is the first message we ever receive from the sender device, LimePeerDeviceStatus.UNTRUSTED for known but untrusted sender device, or LimePeerDeviceStatus.TRUSTED if it is
+	 *
+	 * @throws LimeException when a buffer is not direct or too small
+	 */
+	public LimePeerDeviceStatus decrypt(String localDeviceId, String recipientUserId, String senderDeviceId, ByteBuffer DRmessage, ByteBuffer cipherMessage, ByteBuffer plainMessage) throws LimeException {
+		if (!DRmessage.isDirect() || (cipherMessage != null && !cipherMessage.isDirect()) || !plainMessage.isDirect()) {
+			throw new LimeException("decrypt needs direct ByteBuffers");
+		}
+		int cipherOffset = (cipherMessage != null)?cipherMessage.position():0;
+		int cipherSize = (cipherMessage != null)?cipherMessage.remaining():0;
+		// the native side packs the plain message size and the status in one long
+		long native_result = this.n_decryptDirect(localDeviceId, recipientUserId, senderDeviceId, DRmessage, DRmessage.position(), DRmessage.remaining(), cipherMessage, cipherOffset, cipherSize, plainMessage, plainMessage.position(), plainMessage.remaining());
+		DRmessage.position(DRmessage.limit());
+		if (cipherMessage != null) {
+			cipherMessage.position(cipherMessage.limit());
+		}
+		plainMessage.position(plainMessage.position() + (int)(native_result>>8));
+		return LimePeerDeviceStatus.fromNative((int)(native_result & 0xff));
+	}
+
 	/**
 	 * @brief Update: shall be called once a day at least, performs checks, updates and cleaning operations
 	 *
@@ -317,6 +392,30 @@ public class LimeManager {
 	 */
 	public native String get_x3dhServerUrl(String localDeviceId) throws LimeException;
 
+	private native long[] n_get_metrics();
+
+	/**
+	 * @brief Enable or disable the runtime metrics collection
+	 * Disabling keeps the metrics collected so far. Default is disabled.
+	 *
+	 * @param[in]	enabled	true to collect the metrics
+	 */
+	public native void set_metricsEnabled(boolean enabled);
+
+	/**
+	 * @brief Get the runtime metrics collected since the manager creation or the last reset
+	 *
+	 * @return	the counters, durations and latencies histograms
+	 */
+	public LimeMetrics get_metrics() {
+		return new LimeMetrics(this.n_get_metrics());
+	}
+
+	/**
+	 * @brief Reset all the runtime metrics to 0
+	 */
+	public native void reset_metrics();
+
 	/**
 	 * @brief native function to process the X3DH server response
 	 *
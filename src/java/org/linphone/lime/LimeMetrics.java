@@ -0,0 +1,79 @@
+/*
+	LimeMetrics.java
+	@author Johan Pascal
+	@copyright	Copyright (C) 2019  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+package org.linphone.lime;
+
+/** @brief Runtime metrics of a LimeManager, mirrors lime::Metrics
+ *  all durations are in nanoseconds
+ */
+public class LimeMetrics {
+	/** Operations timed, used as index in operations, mapped to lime::MetricsOperation */
+	public static final int ENCRYPT = 0;
+	public static final int DECRYPT = 1;
+	public static final int SESSION_SAVE = 2;
+	public static final int SESSION_LOAD = 3;
+	public static final int TRY_SKIPPED_MESSAGE_KEYS = 4;
+	public static final int X3DH_ROUND_TRIP = 5;
+	public static final int OPK_GENERATION = 6;
+	public static final int OPERATIONS_COUNT = 7;
+	/** bucket 0 is less than 1us, bucket n is [2^(n-1), 2^n[ us, the last one holds all the longer ones */
+	public static final int HISTOGRAM_BUCKETS = 24;
+
+	/** @brief Metrics of one operation */
+	public static class Operation {
+		public long calls; /**< number of completed operations */
+		public long totalTime; /**< cumulated duration */
+		public long DBTime; /**< part of totalTime spent in local storage accesses */
+		public long cryptoTime; /**< part of totalTime not spent in local storage */
+		public long[] latencyHistogram = new long[HISTOGRAM_BUCKETS]; /**< operations count per duration */
+	}
+
+	public Operation[] operations = new Operation[OPERATIONS_COUNT]; /**< indexed by the operations constants */
+	public long DRSessionsCacheHits; /**< Double Ratchet sessions found in the manager cache */
+	public long DRSessionsCacheMisses; /**< Double Ratchet sessions not found in cache */
+	public long staleSessionDecrypts; /**< messages decrypted with a session which is not the active one */
+	public long skippedKeysDerived; /**< message keys derived and stored for out of order messages */
+	public long DBMutexWaitTime; /**< time spent waiting for the local storage mutex held by another thread, in ns */
+	public long usersMutexWaitTime; /**< time spent waiting for the manager users cache mutex held by another thread, in ns */
+
+	/**
+	 * @brief build from the flat array given by the native code
+	 *
+	 * @param[in]	flat	for each operation: calls, totalTime, DBTime, cryptoTime and the histogram, then the six counters
+	 */
+	protected LimeMetrics(long[] flat) {
+		int index = 0;
+		for (int i=0; i<OPERATIONS_COUNT; i++) {
+			Operation op = new Operation();
+			op.calls = flat[index++];
+			op.totalTime = flat[index++];
+			op.DBTime = flat[index++];
+			op.cryptoTime = flat[index++];
+			for (int j=0; j<HISTOGRAM_BUCKETS; j++) {
+				op.latencyHistogram[j] = flat[index++];
+			}
+			operations[i] = op;
+		}
+		DRSessionsCacheHits = flat[index++];
+		DRSessionsCacheMisses = flat[index++];
+		staleSessionDecrypts = flat[index++];
+		skippedKeysDerived = flat[index++];
+		DBMutexWaitTime = flat[index++];
+		usersMutexWaitTime = flat[index++];
+	}
+}
@@ -23,7 +23,10 @@
 #include "bctoolbox/exception.hh"
 #include "lime_double_ratchet.hpp"
 #include "lime_double_ratchet_protocol.hpp"
+#include "lime_metrics.hpp"
+#include "lime_trace.hpp"
 #include <mutex>
+#include <algorithm>
 
 using namespace::std;
 
@@ -34,6 +37,33 @@ namespace lime {
 	/* Constructors                                                             */
 	/*                                                                          */
 	/****************************************************************************/
+	/* DR sessions cache helpers: sessions not in sync with local storage are never evicted as they could not be reloaded from it */
+	template <typename Curve>
+	static size_t DRSession_memoryFootprint(const std::shared_ptr<DR<Curve>> &DRSession) {
+		return DRSession->memoryFootprint();
+	}
+	template <typename Curve>
+	static bool DRSession_evictable(const std::shared_ptr<DR<Curve>> &DRSession) {
+		return !DRSession->isDirty();
+	}
+
+	/* encryption policy name given in the tracing spans */
+	static std::string encryptionPolicy_name(const lime::EncryptionPolicy encryptionPolicy) {
+		switch (encryptionPolicy) {
+			case lime::EncryptionPolicy::DRMessage:
+				return "DRMessage";
+			case lime::EncryptionPolicy::cipherMessage:
+				return "cipherMessage";
+			case lime::EncryptionPolicy::optimizeUploadSize:
+				return "optimizeUploadSize";
+			case lime::EncryptionPolicy::senderKey:
+				return "senderKey";
+			case lime::EncryptionPolicy::optimizeGlobalBandwidth:
+			default:
+				return "optimizeGlobalBandwidth";
+		}
+	}
+
 	/**
 	 * @brief Load user constructor
 	 *
@@ -46,15 +76,16 @@ namespace lime {
 	 * @param[in]		X3DH_post_data			A function used to communicate with the X3DH server
 	 * @param[in]		Uid				the DB internal Id for this user, speed up DB operations by holding it in DB
 	 *
-	 * @note: ownership of localStorage pointer is transfered to a shared pointer, private menber of Lime class
+	 * @note: localStorage is shared with the LimeManager and the other users it holds, it is kept as a private member of Lime class
 	 */
 	template <typename Curve>
-	Lime<Curve>::Lime(std::unique_ptr<lime::Db> &&localStorage, const std::string &deviceId, const std::string &url, const limeX3DHServerPostData &X3DH_post_data, const long int Uid)
-	: m_RNG{make_RNG()}, m_selfDeviceId{deviceId},
-	m_Ik{}, m_Ik_loaded(false),
+	Lime<Curve>::Lime(std::shared_ptr<lime::Db> localStorage, const std::string &deviceId, const std::string &url, const limeX3DHServerPostData &X3DH_post_data, const long int Uid)
+	: m_RNG{shared_RNG()}, m_selfDeviceId{deviceId},
+	m_Ik{}, m_Ik_loaded(false), m_SPk_cache{},
 	m_localStorage(std::move(localStorage)), m_db_Uid{Uid},
 	m_X3DH_post_data{X3DH_post_data}, m_X3DH_Server_URL{url},
-	m_DR_sessions_cache{}, m_ongoing_encryption{nullptr}, m_encryption_queue{}
+	m_DR_sessions_cache{DRSession_memoryFootprint<Curve>, DRSession_evictable<Curve>}, m_peerBundles_cache{}, m_fetching_bundles{}, m_encryption_queue{}, m_coalescing_fetches{0}, m_coalesced_fetch{nullptr}, m_threadPool{nullptr}, m_X3DHRequests{std::make_shared<int>(0)},
+	m_OPkPredictiveUpdate{false}, m_OPkConsumed{0}, m_OPkPredictiveUpdates{0}
 	{ }
 
 
@@ -68,15 +99,16 @@ namespace lime {
 	 * @param[in]		url				URL of the X3DH key server used to publish our keys
 	 * @param[in]		X3DH_post_data			A function used to communicate with the X3DH server
 	 *
-	 * @note: ownership of localStorage pointer is transfered to a shared pointer, private menber of Lime class
+	 * @note: localStorage is shared with the LimeManager and the other users it holds, it is kept as a private member of Lime class
 	 */
 	template <typename Curve>
-	Lime<Curve>::Lime(std::unique_ptr<lime::Db> &&localStorage, const std::string &deviceId, const std::string &url, const limeX3DHServerPostData &X3DH_post_data)
-	: m_RNG{make_RNG()}, m_selfDeviceId{deviceId},
-	m_Ik{}, m_Ik_loaded(false),
+	Lime<Curve>::Lime(std::shared_ptr<lime::Db> localStorage, const std::string &deviceId, const std::string &url, const limeX3DHServerPostData &X3DH_post_data)
+	: m_RNG{shared_RNG()}, m_selfDeviceId{deviceId},
+	m_Ik{}, m_Ik_loaded(false), m_SPk_cache{},
 	m_localStorage(std::move(localStorage)), m_db_Uid{0},
 	m_X3DH_post_data{X3DH_post_data}, m_X3DH_Server_URL{url},
-	m_DR_sessions_cache{}, m_ongoing_encryption{nullptr}, m_encryption_queue{}
+	m_DR_sessions_cache{DRSession_memoryFootprint<Curve>, DRSession_evictable<Curve>}, m_peerBundles_cache{}, m_fetching_bundles{}, m_encryption_queue{}, m_coalescing_fetches{0}, m_coalesced_fetch{nullptr}, m_threadPool{nullptr}, m_X3DHRequests{std::make_shared<int>(0)},
+	m_OPkPredictiveUpdate{false}, m_OPkConsumed{0}, m_OPkPredictiveUpdates{0}
 	{
 		create_user();
 	}
@@ -126,6 +158,7 @@ namespace lime {
 	template <typename Curve>
 	void Lime<Curve>::delete_peerDevice(const std::string &peerDeviceId) {
 		m_DR_sessions_cache.erase(peerDeviceId); // remove session from cache if any
+		m_peerBundles_cache.erase(peerDeviceId); // and its prefetched key bundle
 	}
 
 	template <typename Curve>
@@ -149,6 +182,25 @@ namespace lime {
 
 	template <typename Curve>
 	void Lime<Curve>::update_OPk(const limeCallback &callback, uint16_t OPkServerLowLimit, uint16_t OPkBatchSize) {
+		if (m_OPkPredictiveUpdate) {
+			bool query = true;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (OPk_skipQuery(OPkServerLowLimit)) {
+					query = false;
+				} else {
+					const auto consumed = m_OPkConsumed;
+					m_OPkConsumed = 0;
+					m_OPkPredictiveUpdates = 0;
+					// upload at least twice the consumption of the last period so the next one is covered
+					OPkBatchSize = static_cast<uint16_t>(std::max<size_t>(OPkBatchSize, std::min<size_t>(2*consumed, lime::settings::OPk_predictiveMaxBatchSize)));
+				}
+			}
+			if (!query) {
+				if (callback) callback(lime::CallbackReturn::success, "");
+				return;
+			}
+		}
 		// Request Server for the count of our OPk it still holds
 		// OPk server low limit cannot be zero, it must be at least one as we test the userData on this to check the server request was a getSelfOPks
 		// and republish the user if not found
@@ -158,6 +210,29 @@ namespace lime {
 		postToX3DHServer(userData, X3DHmessage); // in the response from server, if more OPks are needed, it will generate and post them before calling the callback
 	}
 
+	template <typename Curve>
+	bool Lime<Curve>::OPk_skipQuery(const uint16_t OPkServerLowLimit) {
+		// The OPks used by the X3DH init messages we received are already deleted from local storage.
+		// Peers may have fetched more that we did not see yet: expect as many as we saw during the last period
+		const auto localCount = X3DH_get_OPkCount();
+		const auto projectedCount = (localCount > m_OPkConsumed)?localCount - m_OPkConsumed:0;
+		const bool skip = (projectedCount >= OPkServerLowLimit && m_OPkPredictiveUpdates+1 < lime::settings::OPk_predictiveResyncUpdates);
+		LIME_LOGD<<"User "<<m_selfDeviceId<<" projects "<<projectedCount<<" OPks on server, "<<m_OPkConsumed<<" consumed since last update"<<(skip?"":", query server");
+		if (skip) { // start a new period
+			m_OPkConsumed = 0;
+			m_OPkPredictiveUpdates++;
+		}
+		return skip;
+	}
+
+	template <typename Curve>
+	bool Lime<Curve>::defer_update(const uint16_t OPkServerLowLimit) {
+		// the OPks on server are known without querying it only in predictive mode
+		if (!m_OPkPredictiveUpdate || !is_currentSPk_valid()) return false;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return OPk_skipQuery(OPkServerLowLimit);
+	}
+
 	template <typename Curve>
 	void Lime<Curve>::get_Ik(std::vector<uint8_t> &Ik) {
 		get_SelfIdentityKey(); // make sure our Ik is loaded in object
@@ -167,47 +242,70 @@ namespace lime {
 
 	template <typename Curve>
 	void Lime<Curve>::encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<std::vector<uint8_t>> cipherMessage, const limeCallback &callback) {
+		encrypt(recipientUserId, recipients, plainMessage, encryptionPolicy, cipherMessage, nullptr, nullptr, callback);
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<std::vector<uint8_t>> cipherMessage, std::shared_ptr<DRMessagesArena> DRmessages, const limeCallback &callback) {
+		encrypt(recipientUserId, recipients, plainMessage, encryptionPolicy, cipherMessage, nullptr, DRmessages, callback);
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, const limeStreamReader &plainStream, const limeStreamWriter &cipherStream, const limeCallback &callback) {
+		// the cipher message does not depend on the DR sessions: process it now so the streams are not needed anymore if we must wait for the X3DH server
+		auto cipherStreamKey = std::make_shared<CipherStreamKey>();
+		encryptCipherStream(plainStream, cipherStream, *recipientUserId, m_selfDeviceId, *cipherStreamKey);
+		encrypt(recipientUserId, recipients, nullptr, lime::EncryptionPolicy::cipherMessage, nullptr, cipherStreamKey, nullptr, callback);
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<std::vector<uint8_t>> cipherMessage, std::shared_ptr<const CipherStreamKey> cipherStreamKey, std::shared_ptr<DRMessagesArena> DRmessages, const limeCallback &callback) {
 		LIME_LOGI<<"encrypt from "<<m_selfDeviceId<<" to "<<recipients->size()<<" recipients";
+		InteractiveLane lane(*(m_localStorage->m_lanes)); // the background operations on local storage let us go first
+		auto metrics = m_localStorage->m_metrics.get();
+		MetricsTimer timer(metrics, lime::MetricsOperation::encrypt);
+		TraceSpan span(m_localStorage->m_tracer.get(), "lime.encrypt");
+		if (span) {
+			span.add("recipients", static_cast<int64_t>(recipients->size()));
+			span.add("policy", encryptionPolicy_name(encryptionPolicy));
+		}
 		/* Check if we have all the Double Ratchet sessions ready or shall we go for an X3DH */
-
-		/* Create the appropriate recipient infos and fill it with sessions found in cache */
-		// internal_recipients is a vector duplicating the recipients one in the same order (ignoring the one with peerStatus set to fail)
-		// This allows fast copying of relevant information back to recipients when encryption is completed
 		std::vector<RecipientInfos<Curve>> internal_recipients{};
+		std::vector<std::string> missing_devices{};
 
 		std::unique_lock<std::mutex> lock(m_mutex);
-		for (const auto &recipient : *recipients) {
-			// if the input recipient peerStatus is fail we must ignore it
-			// most likely: we're in a call after a key bundle fetch and this peer device does not have keys on the X3DH server
-			if (recipient.peerStatus != lime::PeerDeviceStatus::fail) {
-				auto sessionElem = m_DR_sessions_cache.find(recipient.deviceId);
-				if (sessionElem != m_DR_sessions_cache.end()) { // session is in cache
-					if (sessionElem->second->isActive()) { // the session in cache is active
-						internal_recipients.emplace_back(recipient.deviceId, sessionElem->second);
-					} else { // session in cache is not active(may append if last encryption reach sending chain symmetric ratchet usage)
-						internal_recipients.emplace_back(recipient.deviceId);
-						m_DR_sessions_cache.erase(recipient.deviceId); // remove unactive session from cache
-					}
-				} else { // session is not in cache, just create it and the session ptr will be a nullptr
-					internal_recipients.emplace_back(recipient.deviceId);
-				}
-			}
-		}
-
-		/* try to load all the session that are not in cache and set the peer Device status for all recipients*/
-		std::vector<std::string> missing_devices{};
-		cache_DR_sessions(internal_recipients, missing_devices);
+		get_DR_sessions(*recipients, internal_recipients, missing_devices);
+		span.add("missingDevices", static_cast<int64_t>(missing_devices.size()));
 
 		/* If we are still missing session we must ask the X3DH server for key bundles */
+		span.add("fetchKeyBundles", static_cast<int64_t>(missing_devices.size()>0));
 		if (missing_devices.size()>0) {
 			// create a new callbackUserData, it shall be then deleted in callback, store in all shared_ptr to input/output values needed to call this encrypt function
-			auto userData = make_shared<callbackUserData<Curve>>(this->shared_from_this(), callback, recipientUserId, recipients, plainMessage, cipherMessage, encryptionPolicy);
-			if (m_ongoing_encryption == nullptr) { // no ongoing asynchronous encryption process it
-				m_ongoing_encryption = userData;
-			} else { // some one else is expecting X3DH server response, enqueue this request
-				m_encryption_queue.push(userData);
+			auto userData = make_shared<callbackUserData<Curve>>(this->shared_from_this(), callback, recipientUserId, recipients, plainMessage, cipherMessage, encryptionPolicy, cipherStreamKey, DRmessages);
+			if (m_coalescing_fetches > 0) { // the encryption queue is being retried: merge the missing devices in one request, sent once the retry is over
+				bool isCoalescedFetch = false;
+				for (const auto &missing_device : missing_devices) {
+					if (m_fetching_bundles.insert(missing_device).second) { // this key bundle is not already being fetched
+						if (m_coalesced_fetch == nullptr) { // the first encryption needing a key bundle carries the merged request
+							m_coalesced_fetch = userData;
+							isCoalescedFetch = true;
+						}
+						m_coalesced_fetch->peerDevices.push_back(missing_device);
+					}
+				}
+				if (!isCoalescedFetch) { // this encryption will be retried when the key bundles it needs are fetched
+					m_encryption_queue.push(userData);
+				}
 				return;
 			}
+			for (const auto &missing_device : missing_devices) {
+				if (m_fetching_bundles.count(missing_device) > 0) { // some one else is expecting this key bundle from X3DH server, enqueue this request
+					m_encryption_queue.push(userData);
+					return;
+				}
+			}
+			m_fetching_bundles.insert(missing_devices.cbegin(), missing_devices.cend());
+			userData->peerDevices = missing_devices;
 			// retrieve bundles from X3DH server, when they arrive, it will run the X3DH initiation and create the DR sessions
 			std::vector<uint8_t> X3DHmessage{};
 			x3dh_protocol::buildMessage_getPeerBundles<Curve>(X3DHmessage, missing_devices);
@@ -216,39 +314,189 @@ namespace lime {
 			return;
 		}
 
-		// We have everyone: encrypt
-		encryptMessage(internal_recipients, *plainMessage, *recipientUserId, m_selfDeviceId, *cipherMessage, encryptionPolicy);
+		// We have everyone: encrypt, unless this is a sessions prefetch and there is nothing to encrypt
+		const bool prefetch = (plainMessage == nullptr && cipherStreamKey == nullptr);
+		bool DRmessagesInArena = false; // the DR messages were written directly in the arena
+		if (!prefetch) {
+			try {
+				// in multi-process mode, the sessions are checked and saved holding the database write lock
+				m_localStorage->run_exclusive([&]() {
+					refresh_DR_sessions(internal_recipients);
+					if (cipherStreamKey != nullptr) { // the cipher message was already streamed, encrypt its key material
+						encryptMessage(internal_recipients, *cipherStreamKey, m_selfDeviceId, m_threadPool);
+					} else if (encryptionPolicy == lime::EncryptionPolicy::senderKey) {
+						const auto distributions = encrypt_senderKey(internal_recipients, *plainMessage, *recipientUserId, *cipherMessage);
+						span.add("senderKeyDistributions", static_cast<int64_t>(distributions));
+					} else {
+						DRmessagesInArena = (DRmessages != nullptr);
+						encryptMessage(internal_recipients, *plainMessage, *recipientUserId, m_selfDeviceId, *cipherMessage, encryptionPolicy, m_threadPool, DRmessagesInArena?&(DRmessages->buffer):nullptr);
+					}
+				});
+			} catch (...) {
+				// sessions were not saved in local storage, the cached ones are now ahead of it: remove them from cache so they will be reloaded from local storage
+				// the new ones are not in local storage(their insert was rolled back): keep them, the next encryption inserts them
+				for (const auto &recipient : internal_recipients) {
+					if (recipient.DRSession == nullptr || recipient.DRSession->dbSessionId() != 0) {
+						m_DR_sessions_cache.erase(recipient.deviceId);
+					}
+				}
+				throw;
+			}
+			// sessions created by X3DH are now saved and can be evicted from cache
+			m_DR_sessions_cache.shrink();
+		}
 
 		// move DR messages to the input/output structure, ignoring again the input with peerStatus set to fail
 		// so the index on the internal_recipients still matches the way we created it from recipients
 		size_t i=0;
 		auto callbackStatus = lime::CallbackReturn::fail;
 		std::string callbackMessage{"All recipients failed to provide a key bundle"};
+		if (DRmessages != nullptr) {
+			DRmessages->messages.clear();
+			DRmessages->messages.reserve(recipients->size());
+			if (!DRmessagesInArena) DRmessages->buffer.clear();
+		}
 		for (auto &recipient : *recipients) {
 			if (recipient.peerStatus != lime::PeerDeviceStatus::fail) {
-				recipient.DRmessage = std::move(internal_recipients[i].DRmessage);
-				recipient.peerStatus = internal_recipients[i].peerStatus;
+				auto &internal_recipient = internal_recipients[i];
+				if (DRmessages == nullptr) {
+					recipient.DRmessage = std::move(internal_recipient.DRmessage);
+				} else if (DRmessagesInArena) {
+					DRmessages->messages.emplace_back(internal_recipient.DRmessageOffset, internal_recipient.DRmessageSize);
+				} else { // the DR messages were built separately(sender key policy): gather them in the arena
+					DRmessages->messages.emplace_back(DRmessages->buffer.size(), internal_recipient.DRmessage.size());
+					DRmessages->buffer.insert(DRmessages->buffer.end(), internal_recipient.DRmessage.cbegin(), internal_recipient.DRmessage.cend());
+				}
+				recipient.peerStatus = internal_recipient.peerStatus;
 				i++;
 				callbackStatus = lime::CallbackReturn::success; // we must have at least one recipient with a successful encryption to return success
 				callbackMessage.clear();
+			} else if (DRmessages != nullptr) {
+				DRmessages->messages.emplace_back(0, 0);
 			}
 		}
+		if (prefetch) { // devices without key bundle on the X3DH server are not an error when prefetching
+			callbackStatus = lime::CallbackReturn::success;
+			callbackMessage.clear();
+		}
 
 		lock.unlock(); // unlock before calling external callbacks
 		if (callback) callback(callbackStatus, callbackMessage);
-		lock.lock();
+	}
 
-		// is there no one in an asynchronous encryption process and do we have something in encryption queue to process
-		if (m_ongoing_encryption == nullptr && !m_encryption_queue.empty()) { // may happend when an encryption was queued but session was created by a previously queued encryption request
-			auto userData = m_encryption_queue.front();
-			m_encryption_queue.pop(); // remove it from queue and do it
-			lock.unlock(); // unlock before recursive call
-			encrypt(userData->recipientUserId, userData->recipients, userData->plainMessage, userData->encryptionPolicy, userData->cipherMessage, userData->callback);
+	template <typename Curve>
+	void Lime<Curve>::get_DR_sessions(const std::vector<RecipientData> &recipients, std::vector<RecipientInfos<Curve>> &internal_recipients, std::vector<std::string> &missing_devices) {
+		auto metrics = m_localStorage->m_metrics.get();
+		/* Create the appropriate recipient infos and fill it with sessions found in cache */
+		// internal_recipients is a vector duplicating the recipients one in the same order (ignoring the one with peerStatus set to fail)
+		// This allows fast copying of relevant information back to recipients when encryption is completed
+		for (const auto &recipient : recipients) {
+			// if the input recipient peerStatus is fail we must ignore it
+			// most likely: we're in a call after a key bundle fetch and this peer device does not have keys on the X3DH server
+			if (recipient.peerStatus != lime::PeerDeviceStatus::fail) {
+				auto sessionElem = m_DR_sessions_cache.find(recipient.deviceId);
+				if (sessionElem != m_DR_sessions_cache.end()) { // session is in cache
+					if (sessionElem->second->isActive()) { // the session in cache is active
+						internal_recipients.emplace_back(recipient.deviceId, sessionElem->second);
+						if (metrics) metrics->increment(lime::MetricsCounter::DRSessionsCacheHit);
+					} else { // session in cache is not active(may append if last encryption reach sending chain symmetric ratchet usage)
+						internal_recipients.emplace_back(recipient.deviceId);
+						m_DR_sessions_cache.erase(recipient.deviceId); // remove unactive session from cache
+						if (metrics) metrics->increment(lime::MetricsCounter::DRSessionsCacheMiss);
+					}
+				} else { // session is not in cache, just create it and the session ptr will be a nullptr
+					internal_recipients.emplace_back(recipient.deviceId);
+					if (metrics) metrics->increment(lime::MetricsCounter::DRSessionsCacheMiss);
+				}
+			}
+		}
+
+		/* try to load all the session that are not in cache and set the peer Device status for all recipients*/
+		cache_DR_sessions(internal_recipients, missing_devices);
+
+		/* create the sessions we have a prefetched key bundle for */
+		if (missing_devices.size()>0 && !m_peerBundles_cache.empty()) {
+			X3DH_init_sender_session_fromCache(internal_recipients, missing_devices);
+		}
+	}
+
+	/**
+	 * @brief In multi-process mode, load again the sessions of the recipients modified in local storage by another process since they were cached
+	 *
+	 * @param[in,out]	internal_recipients	the recipients, their out of date sessions are replaced by the current active ones
+	 *
+	 * @note caller must hold the Lime mutex and, through Db::run_exclusive, the database write lock so the sessions are not modified again before they are used
+	 */
+	template <typename Curve>
+	void Lime<Curve>::refresh_DR_sessions(std::vector<RecipientInfos<Curve>> &internal_recipients) {
+		if (!m_localStorage->multiProcess()) return;
+		bool outdated = false;
+		for (auto &recipient : internal_recipients) {
+			if (recipient.DRSession != nullptr && !recipient.DRSession->isCurrent()) {
+				m_DR_sessions_cache.erase(recipient.deviceId);
+				recipient.DRSession = nullptr;
+				outdated = true;
+			}
+		}
+		if (!outdated) return;
+		std::vector<std::string> missing_devices{};
+		cache_DR_sessions(internal_recipients, missing_devices);
+		if (!missing_devices.empty()) { // the sessions were deleted meanwhile, the key bundles would be needed
+			throw BCTBX_EXCEPTION << "DR sessions with "<<missing_devices.size()<<" recipients were deleted by another process";
 		}
 	}
 
+	template <typename Curve>
+	bool Lime<Curve>::try_encrypt(const std::string &recipientUserId, std::vector<RecipientData> &recipients, const std::vector<uint8_t> &plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::vector<uint8_t> &cipherMessage) {
+		InteractiveLane lane(*(m_localStorage->m_lanes));
+		std::vector<RecipientInfos<Curve>> internal_recipients{};
+		std::vector<std::string> missing_devices{};
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		get_DR_sessions(recipients, internal_recipients, missing_devices);
+		// a key bundle is needed or there is no one to encrypt to: let the asynchronous encrypt deal with it
+		if (missing_devices.size()>0 || internal_recipients.empty()) {
+			return false;
+		}
+
+		LIME_LOGI<<"synchronous encrypt from "<<m_selfDeviceId<<" to "<<recipients.size()<<" recipients";
+		// timed only when we actually encrypt: a false return is followed by an asynchronous encrypt that will be timed
+		MetricsTimer timer(m_localStorage->m_metrics.get(), lime::MetricsOperation::encrypt);
+		try {
+			m_localStorage->run_exclusive([&]() { // see encrypt
+				refresh_DR_sessions(internal_recipients);
+				if (encryptionPolicy == lime::EncryptionPolicy::senderKey) {
+					encrypt_senderKey(internal_recipients, plainMessage, recipientUserId, cipherMessage);
+				} else {
+					encryptMessage(internal_recipients, plainMessage, recipientUserId, m_selfDeviceId, cipherMessage, encryptionPolicy, m_threadPool, nullptr);
+				}
+			});
+		} catch (...) {
+			// same as the asynchronous encrypt: the cached sessions are now ahead of local storage, they will be reloaded from it, the new ones are kept
+			for (const auto &recipient : internal_recipients) {
+				if (recipient.DRSession == nullptr || recipient.DRSession->dbSessionId() != 0) {
+					m_DR_sessions_cache.erase(recipient.deviceId);
+				}
+			}
+			throw;
+		}
+		m_DR_sessions_cache.shrink();
+
+		// move DR messages to the input/output structure, internal_recipients matches recipients ignoring the ones with peerStatus set to fail
+		size_t i=0;
+		for (auto &recipient : recipients) {
+			if (recipient.peerStatus != lime::PeerDeviceStatus::fail) {
+				recipient.DRmessage = std::move(internal_recipients[i].DRmessage);
+				recipient.peerStatus = internal_recipients[i].peerStatus;
+				i++;
+			}
+		}
+		return true;
+	}
+
 	template <typename Curve>
 	lime::PeerDeviceStatus Lime<Curve>::decrypt(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage, std::vector<uint8_t> &plainMessage) {
+		InteractiveLane lane(*(m_localStorage->m_lanes));
 		std::lock_guard<std::mutex> lock(m_mutex);
 		// before trying to decrypt, we must check if the sender device is known in the local Storage and if we trust it
 		// a successful decryption will insert it in local storage so we must check first if it is there in order to detect new devices
@@ -258,15 +506,242 @@ namespace lime {
 		auto senderDeviceStatus = m_localStorage->get_peerDeviceStatus(senderDeviceId);
 
 		LIME_LOGI<<"decrypt from "<<senderDeviceId<<" to "<<recipientUserId;
+		const auto senderKeyType = sender_key::get_messageType<Curve>(DRmessage, cipherMessage);
+		bool decrypted = false;
+		// in multi-process mode, the sessions are checked and saved holding the database write lock
+		m_localStorage->run_exclusive([&]() {
+			if (senderKeyType != SenderKeyMessageType::none) {
+				decrypted = decrypt_senderKey(recipientUserId, senderDeviceId, DRmessage, cipherMessage, plainMessage, senderKeyType);
+			} else {
+				decrypted = decrypt_withDRSessions(senderDeviceId, DRmessage, [&](std::vector<std::shared_ptr<DR<Curve>>> &DRSessions) {
+						return decryptMessage<Curve>(senderDeviceId, m_selfDeviceId, recipientUserId, DRSessions, DRmessage, cipherMessage, plainMessage);
+					});
+			}
+		});
+		return decrypted?senderDeviceStatus:lime::PeerDeviceStatus::fail;
+	}
+
+	template <typename Curve>
+	lime::PeerDeviceStatus Lime<Curve>::decrypt(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const size_t cipherMessageSize, const limeStreamReader &cipherStream, const limeStreamWriter &plainStream) {
+		LIME_LOGI<<"decrypt stream from "<<senderDeviceId<<" to "<<recipientUserId;
+		// the cipher message auth tag is part of the DR message AD, read it first
+		CipherStreamKey streamKey;
+		readCipherStreamTag(cipherStream, cipherMessageSize, streamKey);
+
+		InteractiveLane lane(*(m_localStorage->m_lanes));
+		std::lock_guard<std::mutex> lock(m_mutex);
+		// get the sender device status before the decryption which may insert it in local storage, see decrypt
+		auto senderDeviceStatus = m_localStorage->get_peerDeviceStatus(senderDeviceId);
+		bool decrypted = false;
+		m_localStorage->run_exclusive([&]() { // see decrypt
+			decrypted = decrypt_withDRSessions(senderDeviceId, DRmessage, [&](std::vector<std::shared_ptr<DR<Curve>>> &DRSessions) {
+					auto DRSession = decryptMessage<Curve>(senderDeviceId, m_selfDeviceId, recipientUserId, DRSessions, DRmessage, streamKey);
+					if (DRSession != nullptr && !decryptCipherStream(cipherStream, cipherMessageSize, plainStream, recipientUserId, senderDeviceId, streamKey)) {
+						throw BCTBX_EXCEPTION << "Message key correctly deciphered but then failed to decipher message itself";
+					}
+					return DRSession;
+				});
+		});
+		return decrypted?senderDeviceStatus:lime::PeerDeviceStatus::fail;
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::decrypt_batch(std::vector<DecryptionData> &messages) {
+		InteractiveLane lane(*(m_localStorage->m_lanes));
+		std::lock_guard<std::mutex> lock(m_mutex);
+		LIME_LOGI<<"decrypt a batch of "<<messages.size()<<" messages to "<<m_selfDeviceId;
+
+		// hold the local storage during the whole batch: all the sessions modifications are committed at once
+		MetricsLockGuard<std::recursive_mutex> dbLock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+		m_localStorage->start_transaction();
+		// senders device status are retrieved once from local storage, see decrypt for details on their use
+		std::unordered_map<std::string, lime::PeerDeviceStatus> sendersDeviceStatus{};
+		try {
+			for (auto &message : messages) {
+				auto senderDeviceStatus = sendersDeviceStatus.find(message.senderDeviceId);
+				if (senderDeviceStatus == sendersDeviceStatus.end()) {
+					senderDeviceStatus = sendersDeviceStatus.emplace(message.senderDeviceId, m_localStorage->get_peerDeviceStatus(message.senderDeviceId)).first;
+				}
+
+				message.peerStatus = lime::PeerDeviceStatus::fail;
+				try {
+					const auto senderKeyType = sender_key::get_messageType<Curve>(message.DRmessage, message.cipherMessage);
+					bool decrypted = false;
+					if (senderKeyType != SenderKeyMessageType::none) {
+						decrypted = decrypt_senderKey(message.recipientUserId, message.senderDeviceId, message.DRmessage, message.cipherMessage, message.plainMessage, senderKeyType);
+					} else {
+						decrypted = decrypt_withDRSessions(message.senderDeviceId, message.DRmessage, [&](std::vector<std::shared_ptr<DR<Curve>>> &DRSessions) {
+							return decryptMessage<Curve>(message.senderDeviceId, m_selfDeviceId, message.recipientUserId, DRSessions, message.DRmessage, message.cipherMessage, message.plainMessage);
+						});
+					}
+					if (decrypted) {
+						message.peerStatus = senderDeviceStatus->second;
+						// the decryption inserted the unknown device in local storage, get its status as decrypt would for the next messages
+						if (senderDeviceStatus->second == lime::PeerDeviceStatus::unknown) {
+							senderDeviceStatus->second = m_localStorage->get_peerDeviceStatus(message.senderDeviceId);
+						}
+					}
+				} catch (BctbxException const &e) { // a message failing does not prevent the others from being decrypted
+					LIME_LOGE<<"Fail to decrypt message from "<<message.senderDeviceId<<" in batch : "<<e;
+				}
+			}
+			m_localStorage->commit_transaction();
+		} catch (...) {
+			m_localStorage->rollback_transaction();
+			// cached sessions may be ahead of local storage now, they will be reloaded when needed
+			m_DR_sessions_cache.clear();
+			throw;
+		}
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::prefetch_sessions(const std::vector<std::string> &peerDeviceIds, const bool fetchPeerBundles, const limeCallback &callback) {
+		LIME_LOGI<<"prefetch sessions from "<<m_selfDeviceId<<" to "<<peerDeviceIds.size()<<" peer devices";
+		if (fetchPeerBundles) {
+			// go through the encryption process without message: it loads the sessions, fetches the missing key bundles and
+			// creates the sessions, encryptions requested meanwhile are queued behind it instead of fetching the same key bundles
+			auto recipients = std::make_shared<std::vector<RecipientData>>();
+			recipients->reserve(peerDeviceIds.size());
+			for (const auto &peerDeviceId : peerDeviceIds) {
+				recipients->emplace_back(peerDeviceId);
+			}
+			encrypt(nullptr, recipients, nullptr, lime::EncryptionPolicy::optimizeUploadSize, nullptr, nullptr, callback);
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		std::vector<RecipientInfos<Curve>> internal_recipients{};
+		for (const auto &peerDeviceId : peerDeviceIds) {
+			auto sessionElem = m_DR_sessions_cache.find(peerDeviceId);
+			if (sessionElem == m_DR_sessions_cache.end() || !sessionElem->second->isActive()) {
+				internal_recipients.emplace_back(peerDeviceId);
+			}
+		}
+		// load them from local storage, the ones without session are just ignored
+		std::vector<std::string> missing_devices{};
+		cache_DR_sessions(internal_recipients, missing_devices);
+		lock.unlock(); // unlock before calling external callbacks
+		if (callback) callback(lime::CallbackReturn::success, "");
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::prefetch_peerBundles(const std::vector<std::string> &peerDeviceIds, const limeCallback &callback) {
+		LIME_LOGI<<"prefetch key bundles from "<<m_selfDeviceId<<" to "<<peerDeviceIds.size()<<" peer devices";
+		std::unique_lock<std::mutex> lock(m_mutex);
+		// get rid of the expired bundles
+		auto now = std::chrono::steady_clock::now();
+		for (auto cachedBundle = m_peerBundles_cache.begin(); cachedBundle != m_peerBundles_cache.end(); ) {
+			if (cachedBundle->second.expiry <= now) {
+				cachedBundle = m_peerBundles_cache.erase(cachedBundle);
+			} else {
+				++cachedBundle;
+			}
+		}
+
+		// devices with a session do not need a key bundle
+		std::vector<RecipientInfos<Curve>> internal_recipients{};
+		for (const auto &peerDeviceId : peerDeviceIds) {
+			auto sessionElem = m_DR_sessions_cache.find(peerDeviceId);
+			if (sessionElem == m_DR_sessions_cache.end() || !sessionElem->second->isActive()) {
+				internal_recipients.emplace_back(peerDeviceId);
+			}
+		}
+		std::vector<std::string> missing_devices{};
+		cache_DR_sessions(internal_recipients, missing_devices);
+
+		// nor do the ones with a key bundle already cached or being fetched
+		std::vector<std::string> fetch_devices{};
+		for (auto &missing_device : missing_devices) {
+			if (m_peerBundles_cache.count(missing_device) == 0 && m_fetching_bundles.count(missing_device) == 0) {
+				fetch_devices.push_back(std::move(missing_device));
+			}
+		}
+		if (fetch_devices.empty()) {
+			lock.unlock(); // unlock before calling external callbacks
+			if (callback) callback(lime::CallbackReturn::success, "");
+			return;
+		}
+
+		// encryptions to these devices now wait for the key bundles instead of fetching them again
+		m_fetching_bundles.insert(fetch_devices.cbegin(), fetch_devices.cend());
+		auto userData = make_shared<callbackUserData<Curve>>(this->shared_from_this(), callback);
+		userData->peerDevices = fetch_devices;
+		std::vector<uint8_t> X3DHmessage{};
+		x3dh_protocol::buildMessage_getPeerBundles<Curve>(X3DHmessage, fetch_devices);
+		lock.unlock(); // unlock before calling external callbacks
+		postToX3DHServer(userData, X3DHmessage);
+	}
+
+	/**
+	 * @brief Create the sessions with the missing devices we have a valid prefetched key bundle for
+	 *
+	 * @param[in,out]	internal_recipients	the recipients, get the created sessions
+	 * @param[in,out]	missing_devices		the devices without session, the ones getting one are removed
+	 *
+	 * @note caller must hold the Lime mutex
+	 */
+	template <typename Curve>
+	void Lime<Curve>::X3DH_init_sender_session_fromCache(std::vector<RecipientInfos<Curve>> &internal_recipients, std::vector<std::string> &missing_devices) {
+		std::vector<X3DH_peerBundle<Curve>> peersBundle{};
+		auto now = std::chrono::steady_clock::now();
+		for (auto missing_device = missing_devices.begin(); missing_device != missing_devices.end(); ) {
+			auto cachedBundle = m_peerBundles_cache.find(*missing_device);
+			if (cachedBundle != m_peerBundles_cache.end()) {
+				bool valid = cachedBundle->second.expiry > now;
+				if (valid) {
+					peersBundle.push_back(cachedBundle->second.bundle);
+				}
+				m_peerBundles_cache.erase(cachedBundle); // a bundle is used only once, its OPk shall not be used again
+				if (valid) {
+					missing_device = missing_devices.erase(missing_device);
+					continue;
+				}
+			}
+			++missing_device;
+		}
+		if (peersBundle.empty()) return;
+
+		X3DH_init_sender_session(peersBundle);
+		for (auto &recipient : internal_recipients) {
+			if (recipient.DRSession == nullptr) {
+				auto sessionElem = m_DR_sessions_cache.find(recipient.deviceId);
+				if (sessionElem != m_DR_sessions_cache.end()) {
+					recipient.DRSession = sessionElem->second;
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Find the DR session able to decrypt a message: cached session first, then the ones in local storage already knowing the sender ratchet public key,
+	 * then the other ones in local storage, then create one from the X3DH init if there is one
+	 *
+	 * @param[in]	senderDeviceId	the device Id (GRUU) of the message sender
+	 * @param[in]	DRmessage	the Double Ratchet message targeted to current device
+	 * @param[in]	DRdecrypt	try to decrypt the message with the given sessions, return the one which did or nullptr
+	 *
+	 * @note caller must hold the Lime mutex
+	 *
+	 * @return true if a session decrypted the message
+	 */
+	template <typename Curve>
+	bool Lime<Curve>::decrypt_withDRSessions(const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::function<std::shared_ptr<DR<Curve>>(std::vector<std::shared_ptr<DR<Curve>>> &)> &DRdecrypt) {
+		auto metrics = m_localStorage->m_metrics.get();
+		MetricsTimer timer(metrics, lime::MetricsOperation::decrypt);
 		// do we have any session (loaded or not) matching that senderDeviceId ?
 		auto sessionElem = m_DR_sessions_cache.find(senderDeviceId);
+		if (sessionElem != m_DR_sessions_cache.end() && !sessionElem->second->isCurrent()) { // another process modified it, load it again
+			m_DR_sessions_cache.erase(sessionElem);
+			sessionElem = m_DR_sessions_cache.end();
+		}
 		auto db_sessionIdInCache = 0; // this would be the db_sessionId of the session stored in cache if there is one, no session has the Id 0
+		if (metrics) metrics->increment((sessionElem != m_DR_sessions_cache.end())?lime::MetricsCounter::DRSessionsCacheHit:lime::MetricsCounter::DRSessionsCacheMiss);
 		if (sessionElem != m_DR_sessions_cache.end()) { // session is in cache, it is the active one, just give it a try
 			db_sessionIdInCache = sessionElem->second->dbSessionId();
 			std::vector<std::shared_ptr<DR<Curve>>> cached_DRSessions{1, sessionElem->second}; // copy the session pointer into a vector as the decrypt function ask for it
-			if (decryptMessage<Curve>(senderDeviceId, m_selfDeviceId, recipientUserId, cached_DRSessions, DRmessage, cipherMessage, plainMessage) != nullptr) {
+			if (DRdecrypt(cached_DRSessions) != nullptr) {
 				// we manage to decrypt the message with the current active session loaded in cache
-				return senderDeviceStatus;
+				return true;
 			} else { // remove session from cache
 				// session in local storage is not modified, so it's still the active one, it will change status to stale when an other active session will be created
 				m_DR_sessions_cache.erase(sessionElem);
@@ -275,18 +750,40 @@ namespace lime {
 
 		// If we are still here, no session in cache or it didn't decrypt with it. Lookup in localStorage
 		std::vector<std::shared_ptr<DR<Curve>>> DRSessions{};
+		auto decryptWithStoredSessions = [this, &DRdecrypt, &DRSessions, &senderDeviceId, metrics]() {
+			if (DRSessions.empty()) return false;
+			auto usedDRSession = DRdecrypt(DRSessions);
+			if (usedDRSession == nullptr) return false;
+			// we manage to decrypt with a session
+			if (metrics && !usedDRSession->isActive()) metrics->increment(lime::MetricsCounter::staleSessionDecrypt);
+			m_DR_sessions_cache.put(senderDeviceId, std::move(usedDRSession)); // store it in cache
+			return true;
+		};
+
+		// the sessions already knowing the sender ratchet public key given in the message header shall decrypt it, try them first
+		std::vector<long int> triedDRSessionIds{};
+		double_ratchet_protocol::DRHeader<Curve> header{DRmessage};
+		if (header.valid()) {
+			get_DRSessions(senderDeviceId, db_sessionIdInCache, header.DHs(), DRSessions);
+			if (decryptWithStoredSessions()) return true;
+			for (const auto &DRSession : DRSessions) {
+				triedDRSessionIds.push_back(DRSession->dbSessionId());
+			}
+			DRSessions.clear();
+		}
+
+		// fall back on the others: the sender performed a DH ratchet step or the session was stored before the peer public key was(schema 0.0.6)
 		// load in DRSessions all the session found in cache for this peer device, except the one with id db_sessionIdInCache(is ignored if 0) as we already tried it
 		get_DRSessions(senderDeviceId, db_sessionIdInCache, DRSessions);
-		auto usedDRSession = decryptMessage<Curve>(senderDeviceId, m_selfDeviceId, recipientUserId, DRSessions, DRmessage, cipherMessage, plainMessage);
-		if (usedDRSession != nullptr) { // we manage to decrypt with a session
-			m_DR_sessions_cache[senderDeviceId] = std::move(usedDRSession); // store it in cache
-			return senderDeviceStatus;
-		}
+		DRSessions.erase(std::remove_if(DRSessions.begin(), DRSessions.end(), [&triedDRSessionIds](const std::shared_ptr<DR<Curve>> &DRSession) {
+				return std::find(triedDRSessionIds.cbegin(), triedDRSessionIds.cend(), DRSession->dbSessionId()) != triedDRSessionIds.cend();
+			}), DRSessions.end());
+		if (decryptWithStoredSessions()) return true;
 
 		// No luck yet, is this message holds a X3DH header - if no we must give up
 		std::vector<uint8_t> X3DH_initMessage{};
 		if (!double_ratchet_protocol::parseMessage_get_X3DHinit<Curve>(DRmessage, X3DH_initMessage)) {
-			return lime::PeerDeviceStatus::fail;
+			return false;
 		}
 
 		// parse the X3DH init message, get keys from localStorage, compute the shared secrets, create DR_Session and return a shared pointer to it
@@ -296,15 +793,135 @@ namespace lime {
 			DRSessions.push_back(DRSession);
 		} catch (BctbxException const &e) {
 			LIME_LOGE<<"Fail to create the DR session from the X3DH init message : "<<e;
-			return lime::PeerDeviceStatus::fail;
+			return false;
 		}
 
-		if (decryptMessage<Curve>(senderDeviceId, m_selfDeviceId, recipientUserId, DRSessions, DRmessage, cipherMessage, plainMessage) != 0) {
+		if (DRdecrypt(DRSessions) != nullptr) {
 			// we manage to decrypt the message with this session, set it in cache
-			m_DR_sessions_cache[senderDeviceId] = std::move(DRSessions.front());
-			return senderDeviceStatus;
+			m_DR_sessions_cache.put(senderDeviceId, std::move(DRSessions.front()));
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * @brief Encrypt with the sender key chain of the group identified by the recipient user Id
+	 *
+	 * A new chain is started when we have none, when it reached lime::settings::senderKeyChain_maxMessages
+	 * or when a device holding it is not among the recipients anymore.
+	 * The recipients not holding the chain get it in a Double Ratchet message, the others get a DR message only flagging the sender key mode.
+	 * Once the chain is distributed, encrypting a message costs one AEAD encryption, one signature and one local storage update whatever the recipients number.
+	 *
+	 * @param[in,out]	internal_recipients	the recipients, all with a DR session. Their DR message is set
+	 * @param[in]		plainMessage		the message to encrypt
+	 * @param[in]		recipientUserId		the recipient user Id, identifies the group
+	 * @param[out]		cipherMessage		the message encrypted with the sender key chain
+	 *
+	 * @note caller must hold the Lime mutex
+	 *
+	 * @return the number of recipients which got the chain in their DR message
+	 */
+	template <typename Curve>
+	size_t Lime<Curve>::encrypt_senderKey(std::vector<RecipientInfos<Curve>> &internal_recipients, const std::vector<uint8_t> &plainMessage, const std::string &recipientUserId, std::vector<uint8_t> &cipherMessage) {
+		SenderKeyChain chain{};
+		long int skId = 0;
+		std::unordered_set<std::string> members{};
+		bool newChain = !load_senderKeyChain(recipientUserId, chain, skId, members) || chain.index >= lime::settings::senderKeyChain_maxMessages;
+		if (!newChain) { // a device removed from the group must not decrypt the next messages
+			std::unordered_set<std::string> recipientsIds{};
+			for (const auto &recipient : internal_recipients) {
+				recipientsIds.insert(recipient.deviceId);
+			}
+			newChain = std::any_of(members.cbegin(), members.cend(), [&recipientsIds](const std::string &member){return recipientsIds.count(member) == 0;});
+		}
+		if (newChain) {
+			sender_key::newChain(m_RNG, chain);
+			skId = 0;
+			members.clear();
+		}
+
+		// the recipients not holding the chain yet get it in a DR message
+		std::vector<RecipientInfos<Curve>> distributionRecipients{};
+		std::vector<size_t> distributionIndexes{};
+		std::vector<std::string> newMembers{};
+		for (size_t i=0; i<internal_recipients.size(); i++) {
+			if (members.count(internal_recipients[i].deviceId) == 0) {
+				distributionRecipients.push_back(internal_recipients[i]);
+				distributionIndexes.push_back(i);
+				newMembers.push_back(internal_recipients[i].deviceId);
+			} else {
+				sender_key::buildMessage_senderKey<Curve>(internal_recipients[i].DRmessage);
+			}
+		}
+		if (!distributionRecipients.empty()) {
+			std::vector<uint8_t> distribution{};
+			sender_key::buildMessage_distribution(chain, distribution);
+			std::vector<uint8_t> noCipherMessage{};
+			try {
+				encryptMessage(distributionRecipients, distribution, recipientUserId, m_selfDeviceId, noCipherMessage, lime::EncryptionPolicy::DRMessage, m_threadPool);
+			} catch (...) {
+				cleanBuffer(distribution.data(), distribution.size());
+				throw;
+			}
+			cleanBuffer(distribution.data(), distribution.size());
+			for (size_t i=0; i<distributionIndexes.size(); i++) {
+				internal_recipients[distributionIndexes[i]].DRmessage = std::move(distributionRecipients[i].DRmessage);
+			}
+		}
+
+		get_SelfIdentityKey();
+		sender_key::encryptMessage<Curve>(chain, m_Ik, plainMessage, recipientUserId, m_selfDeviceId, cipherMessage);
+		store_senderKeyChain(recipientUserId, chain, skId, newMembers);
+		return newMembers.size();
+	}
+
+	/**
+	 * @brief Decrypt a message encrypted with the sender key chain of the sender device
+	 *
+	 * When the DR message distributes the chain, it is decrypted with the DR sessions and the chain stored before decrypting the cipher message.
+	 * The chain is updated in local storage only when the cipher message is decrypted.
+	 *
+	 * @param[in]	recipientUserId	the recipient user Id, identifies the group
+	 * @param[in]	senderDeviceId	the sender device Id
+	 * @param[in]	DRmessage	the DR message
+	 * @param[in]	cipherMessage	the message encrypted with the sender key chain
+	 * @param[out]	plainMessage	the decrypted message
+	 * @param[in]	type		the DR message type as given by sender_key::get_messageType, not none
+	 *
+	 * @note caller must hold the Lime mutex
+	 *
+	 * @return true on success
+	 */
+	template <typename Curve>
+	bool Lime<Curve>::decrypt_senderKey(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage, std::vector<uint8_t> &plainMessage, const SenderKeyMessageType type) {
+		SenderKeyChain chain{};
+		if (type == SenderKeyMessageType::distribution) {
+			std::vector<uint8_t> distribution{};
+			const std::vector<uint8_t> noCipherMessage{};
+			if (!decrypt_withDRSessions(senderDeviceId, DRmessage, [&](std::vector<std::shared_ptr<DR<Curve>>> &DRSessions) {
+					return decryptMessage<Curve>(senderDeviceId, m_selfDeviceId, recipientUserId, DRSessions, DRmessage, noCipherMessage, distribution);
+				})) {
+				return false;
+			}
+			const bool validDistribution = sender_key::parseMessage_distribution(distribution, chain);
+			cleanBuffer(distribution.data(), distribution.size());
+			if (!validDistribution) {
+				LIME_LOGE<<"Invalid sender key chain distribution from "<<senderDeviceId<<" to "<<recipientUserId;
+				return false;
+			}
+			store_receiverKeyChain(recipientUserId, senderDeviceId, chain);
 		}
-		return lime::PeerDeviceStatus::fail;
+
+		DSA<Curve, lime::DSAtype::publicKey> senderIk;
+		if (!load_receiverKeyChain(recipientUserId, senderDeviceId, chain, senderIk)) {
+			LIME_LOGE<<"No sender key chain from "<<senderDeviceId<<" to "<<recipientUserId;
+			return false;
+		}
+		if (!sender_key::decryptMessage<Curve>(chain, senderIk, cipherMessage, recipientUserId, senderDeviceId, plainMessage)) {
+			return false;
+		}
+		store_receiverKeyChain(recipientUserId, senderDeviceId, chain);
+		return true;
 	}
 
 	template <typename Curve>
@@ -312,6 +929,43 @@ namespace lime {
 		return m_X3DH_Server_URL;
 	}
 
+	template <typename Curve>
+	void Lime<Curve>::set_threadPool(std::shared_ptr<lime::ThreadPool> threadPool) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_threadPool = threadPool;
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::set_OPkPredictiveUpdate(const bool enabled) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_OPkPredictiveUpdate = enabled;
+	}
+
+	template <typename Curve>
+	bool Lime<Curve>::is_idle() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		// every request posted to the X3DH server holds a copy of m_X3DHRequests until its response is processed
+		return m_fetching_bundles.empty() && m_encryption_queue.empty() && m_X3DHRequests.use_count() == 1;
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::flush() {
+		m_localStorage->flush_sessionUpdates();
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::set_DRSessionsCacheLimits(const size_t maxSessions, const size_t maxMemory) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_DR_sessions_cache.set_limits(maxSessions, maxMemory);
+	}
+
+	template <typename Curve>
+	void Lime<Curve>::get_DRSessionsCacheUsage(size_t &sessionsCount, size_t &memorySize) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		sessionsCount = m_DR_sessions_cache.size();
+		memorySize = m_DR_sessions_cache.memorySize();
+	}
+
 	/* instantiate Lime for C255 and C448 */
 #ifdef EC25519_ENABLED
 	/* These extern templates are defined in lime_localStorage.cpp */
@@ -319,17 +973,29 @@ namespace lime {
 	extern template bool Lime<C255>::activate_user();
 	extern template void Lime<C255>::get_SelfIdentityKey();
 	extern template void Lime<C255>::X3DH_generate_SPk(X<C255, lime::Xtype::publicKey> &publicSPk, DSA<C255, DSAtype::signature> &SPk_sig, uint32_t &SPk_id, const bool load);
+	extern template void Lime<C255>::X3DH_generate_keyPairs(std::vector<Xpair<C255>> &keyPairs);
 	extern template void Lime<C255>::X3DH_generate_OPks(std::vector<X<C255, lime::Xtype::publicKey>> &publicOPks, std::vector<uint32_t> &OPk_ids, const uint16_t OPk_number, const bool load);
+	extern template size_t Lime<C255>::fetch_peerDevicesStatus(const std::vector<std::string> &peerDeviceIds, std::unordered_map<std::string, lime::PeerDeviceStatus> &devicesStatus);
 	extern template void Lime<C255>::cache_DR_sessions(std::vector<RecipientInfos<C255>> &internal_recipients, std::vector<std::string> &missing_devices);
 	extern template void Lime<C255>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDBSessionId, std::vector<std::shared_ptr<DR<C255>>> &DRSessions);
+	extern template void Lime<C255>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDBSessionId, const X<C255, lime::Xtype::publicKey> &peerDH, std::vector<std::shared_ptr<DR<C255>>> &DRSessions);
+	extern template void Lime<C255>::get_sessionsSnapshot(std::vector<uint8_t> &snapshot);
+	extern template size_t Lime<C255>::set_sessionsSnapshot(const std::vector<uint8_t> &snapshot);
 	extern template void Lime<C255>::X3DH_get_SPk(uint32_t SPk_id, Xpair<C255> &SPk);
 	extern template bool Lime<C255>::is_currentSPk_valid(void);
 	extern template void Lime<C255>::X3DH_get_OPk(uint32_t OPk_id, Xpair<C255> &SPk);
 	extern template void Lime<C255>::X3DH_updateOPkStatus(const std::vector<uint32_t> &OPkIds);
+	extern template size_t Lime<C255>::X3DH_get_OPkCount(void);
 	extern template void Lime<C255>::set_x3dhServerUrl(const std::string &x3dhServerUrl);
+	extern template bool Lime<C255>::load_senderKeyChain(const std::string &groupId, SenderKeyChain &chain, long int &skId, std::unordered_set<std::string> &members);
+	extern template void Lime<C255>::store_senderKeyChain(const std::string &groupId, const SenderKeyChain &chain, const long int skId, const std::vector<std::string> &newMembers);
+	extern template bool Lime<C255>::load_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, SenderKeyChain &chain, DSA<C255, lime::DSAtype::publicKey> &senderIk);
+	extern template void Lime<C255>::store_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, const SenderKeyChain &chain);
 	/* These extern templates are defined in lime_x3dh.cpp*/
 	extern template void Lime<C255>::X3DH_init_sender_session(const std::vector<X3DH_peerBundle<C255>> &peerBundle);
-	extern template std::shared_ptr<DR<C255>> Lime<C255>::X3DH_init_receiver_session(const std::vector<uint8_t> X3DH_initMessage, const std::string &peerDeviceId);
+	extern template void Lime<C255>::X3DH_init_sender_session(const X3DH_peerBundles<C255> &peerBundle);
+	extern template void Lime<C255>::X3DH_cache_peerBundles(const X3DH_peerBundles<C255> &peerBundle);
+	extern template std::shared_ptr<DR<C255>> Lime<C255>::X3DH_init_receiver_session(const std::vector<uint8_t> &X3DH_initMessage, const std::string &peerDeviceId);
 	/* These extern templates are defined in lime_x3dh_protocol.cpp*/
 	extern template void Lime<C255>::postToX3DHServer(std::shared_ptr<callbackUserData<C255>> userData, const std::vector<uint8_t> &message);
 	extern template void Lime<C255>::process_response(std::shared_ptr<callbackUserData<C255>> userData, int responseCode, const std::vector<uint8_t> &responseBody) noexcept;
@@ -344,17 +1010,29 @@ namespace lime {
 	extern template bool Lime<C448>::activate_user();
 	extern template void Lime<C448>::get_SelfIdentityKey();
 	extern template void Lime<C448>::X3DH_generate_SPk(X<C448, lime::Xtype::publicKey> &publicSPk, DSA<C448, DSAtype::signature> &SPk_sig, uint32_t &SPk_id, const bool load);
+	extern template void Lime<C448>::X3DH_generate_keyPairs(std::vector<Xpair<C448>> &keyPairs);
 	extern template void Lime<C448>::X3DH_generate_OPks(std::vector<X<C448, lime::Xtype::publicKey>> &publicOPks, std::vector<uint32_t> &OPk_ids, const uint16_t OPk_number, const bool load);
+	extern template size_t Lime<C448>::fetch_peerDevicesStatus(const std::vector<std::string> &peerDeviceIds, std::unordered_map<std::string, lime::PeerDeviceStatus> &devicesStatus);
 	extern template void Lime<C448>::cache_DR_sessions(std::vector<RecipientInfos<C448>> &internal_recipients, std::vector<std::string> &missing_devices);
 	extern template void Lime<C448>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDBSessionId, std::vector<std::shared_ptr<DR<C448>>> &DRSessions);
+	extern template void Lime<C448>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDBSessionId, const X<C448, lime::Xtype::publicKey> &peerDH, std::vector<std::shared_ptr<DR<C448>>> &DRSessions);
+	extern template void Lime<C448>::get_sessionsSnapshot(std::vector<uint8_t> &snapshot);
+	extern template size_t Lime<C448>::set_sessionsSnapshot(const std::vector<uint8_t> &snapshot);
 	extern template void Lime<C448>::X3DH_get_SPk(uint32_t SPk_id, Xpair<C448> &SPk);
 	extern template bool Lime<C448>::is_currentSPk_valid(void);
 	extern template void Lime<C448>::X3DH_get_OPk(uint32_t OPk_id, Xpair<C448> &SPk);
 	extern template void Lime<C448>::X3DH_updateOPkStatus(const std::vector<uint32_t> &OPkIds);
+	extern template size_t Lime<C448>::X3DH_get_OPkCount(void);
 	extern template void Lime<C448>::set_x3dhServerUrl(const std::string &x3dhServerUrl);
+	extern template bool Lime<C448>::load_senderKeyChain(const std::string &groupId, SenderKeyChain &chain, long int &skId, std::unordered_set<std::string> &members);
+	extern template void Lime<C448>::store_senderKeyChain(const std::string &groupId, const SenderKeyChain &chain, const long int skId, const std::vector<std::string> &newMembers);
+	extern template bool Lime<C448>::load_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, SenderKeyChain &chain, DSA<C448, lime::DSAtype::publicKey> &senderIk);
+	extern template void Lime<C448>::store_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, const SenderKeyChain &chain);
 	/* These extern templates are defined in lime_x3dh.cpp*/
 	extern template void Lime<C448>::X3DH_init_sender_session(const std::vector<X3DH_peerBundle<C448>> &peerBundle);
-	extern template std::shared_ptr<DR<C448>> Lime<C448>::X3DH_init_receiver_session(const std::vector<uint8_t> X3DH_initMessage, const std::string &peerDeviceId);
+	extern template void Lime<C448>::X3DH_init_sender_session(const X3DH_peerBundles<C448> &peerBundle);
+	extern template void Lime<C448>::X3DH_cache_peerBundles(const X3DH_peerBundles<C448> &peerBundle);
+	extern template std::shared_ptr<DR<C448>> Lime<C448>::X3DH_init_receiver_session(const std::vector<uint8_t> &X3DH_initMessage, const std::string &peerDeviceId);
 	/* These extern templates are defined in lime_x3dh_protocol.cpp*/
 	extern template void Lime<C448>::postToX3DHServer(std::shared_ptr<callbackUserData<C448>> userData, const std::vector<uint8_t> &message);
 	extern template void Lime<C448>::process_response(std::shared_ptr<callbackUserData<C448>> userData, int responseCode, const std::vector<uint8_t> &responseBody) noexcept;
@@ -373,19 +1051,18 @@ namespace lime {
 	 *
 	 *	Once created a user cannot be modified, insertion of existing deviceId will raise an exception.
 	 *
-	 * @param[in]	dbFilename			Path to filename to use
+	 * @param[in]	localStorage			DB accessor, possibly shared with other users
 	 * @param[in]	deviceId			User to create in DB, deviceId shall be the GRUU
 	 * @param[in]	url				URL of X3DH key server to be used to publish our keys
 	 * @param[in]	curve				Which curve shall we use for this account, select the implemenation to instanciate when using this user
 	 * @param[in]	OPkInitialBatchSize		Number of OPks in the first batch uploaded to X3DH server
 	 * @param[in]	X3DH_post_data			A function used to communicate with the X3DH server
 	 * @param[in]	callback			To provide caller the operation result
-	 * @param[in]	db_mutex			a mutex to protect db access
 	 *
 	 * @return a pointer to the LimeGeneric class allowing access to API declared in lime_lime.hpp
 	 */
-	std::shared_ptr<LimeGeneric> insert_LimeUser(const std::string &dbFilename, const std::string &deviceId, const std::string &url, const lime::CurveId curve, const uint16_t OPkInitialBatchSize,
-			const limeX3DHServerPostData &X3DH_post_data, const limeCallback &callback, std::shared_ptr<std::recursive_mutex> db_mutex) {
+	std::shared_ptr<LimeGeneric> insert_LimeUser(std::shared_ptr<lime::Db> localStorage, const std::string &deviceId, const std::string &url, const lime::CurveId curve, const uint16_t OPkInitialBatchSize,
+			const limeX3DHServerPostData &X3DH_post_data, const limeCallback &callback) {
 		LIME_LOGI<<"Create Lime user "<<deviceId;
 		/* first check the requested curve is instanciable and return an exception if not */
 #ifndef EC25519_ENABLED
@@ -399,9 +1076,6 @@ namespace lime {
 		}
 #endif
 
-		/* open DB */
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(dbFilename, db_mutex)); // create as unique ptr, ownership is then passed to the Lime structure when instanciated
-
 		try {
 			//instanciate the correct Lime object
 			switch (curve) {
@@ -409,7 +1083,7 @@ namespace lime {
 #ifdef EC25519_ENABLED
 				{
 					/* constructor will insert user in Db, if already present, raise an exception*/
-					auto lime_ptr = std::make_shared<Lime<C255>>(std::move(localStorage), deviceId, url, X3DH_post_data);
+					auto lime_ptr = std::make_shared<Lime<C255>>(localStorage, deviceId, url, X3DH_post_data);
 					lime_ptr->publish_user(callback, OPkInitialBatchSize);
 					return lime_ptr;
 				}
@@ -419,7 +1093,7 @@ namespace lime {
 				case lime::CurveId::c448 :
 #ifdef EC448_ENABLED
 				{
-					auto lime_ptr = std::make_shared<Lime<C448>>(std::move(localStorage), deviceId, url, X3DH_post_data);
+					auto lime_ptr = std::make_shared<Lime<C448>>(localStorage, deviceId, url, X3DH_post_data);
 					lime_ptr->publish_user(callback, OPkInitialBatchSize);
 					return lime_ptr;
 				}
@@ -437,24 +1111,41 @@ namespace lime {
 		return nullptr;
 	};
 
+	/**
+	 * @brief : Insert user in database opening a dedicated DB accessor on the given file
+	 *
+	 * @param[in]	dbFilename			Path to filename to use
+	 * @param[in]	deviceId			User to create in DB, deviceId shall be the GRUU
+	 * @param[in]	url				URL of X3DH key server to be used to publish our keys
+	 * @param[in]	curve				Which curve shall we use for this account, select the implemenation to instanciate when using this user
+	 * @param[in]	OPkInitialBatchSize		Number of OPks in the first batch uploaded to X3DH server
+	 * @param[in]	X3DH_post_data			A function used to communicate with the X3DH server
+	 * @param[in]	callback			To provide caller the operation result
+	 * @param[in]	db_mutex			a mutex to protect db access
+	 *
+	 * @return a pointer to the LimeGeneric class allowing access to API declared in lime_lime.hpp
+	 */
+	std::shared_ptr<LimeGeneric> insert_LimeUser(const std::string &dbFilename, const std::string &deviceId, const std::string &url, const lime::CurveId curve, const uint16_t OPkInitialBatchSize,
+			const limeX3DHServerPostData &X3DH_post_data, const limeCallback &callback, std::shared_ptr<std::recursive_mutex> db_mutex) {
+		return insert_LimeUser(std::make_shared<lime::Db>(dbFilename, db_mutex), deviceId, url, curve, OPkInitialBatchSize, X3DH_post_data, callback);
+	}
+
 	/**
 	 * @brief : Load user from database and return a pointer to the control class instanciating the appropriate Lime children class
 	 *
 	 *	Fail to find the user will raise an exception
 	 *	If allStatus flag is set to false (default value), raise an exception on inactive users otherwise load inactive user.
 	 *
-	 * @param[in]	dbFilename		Path to filename to use
+	 * @param[in]	localStorage		DB accessor, possibly shared with other users
 	 * @param[in]	deviceId		User to lookup in DB, deviceId shall be the GRUU
 	 * @param[in]	X3DH_post_data		A function used to communicate with the X3DH server
-	 * @param[in]	db_mutex		a mutex to protect db access
 	 * @param[in]	allStatus		allow loading of inactive user if set to true
 	 *
 	 * @return a pointer to the LimeGeneric class allowing access to API declared in lime_lime.hpp
 	 */
-	std::shared_ptr<LimeGeneric> load_LimeUser(const std::string &dbFilename, const std::string &deviceId, const limeX3DHServerPostData &X3DH_post_data, std::shared_ptr<std::recursive_mutex> db_mutex, const bool allStatus) {
+	std::shared_ptr<LimeGeneric> load_LimeUser(std::shared_ptr<lime::Db> localStorage, const std::string &deviceId, const limeX3DHServerPostData &X3DH_post_data, const bool allStatus) {
 
-		/* open DB and load user */
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(dbFilename, db_mutex)); // create as unique ptr, ownership is then passed to the Lime structure when instanciated
+		/* load user */
 		auto curve = CurveId::unset;
 		long int Uid=0;
 		std::string x3dh_server_url;
@@ -479,14 +1170,14 @@ namespace lime {
 			switch (curve) {
 				case lime::CurveId::c25519 :
 #ifdef EC25519_ENABLED
-					return std::make_shared<Lime<C255>>(std::move(localStorage), deviceId, x3dh_server_url, X3DH_post_data, Uid);
+					return std::make_shared<Lime<C255>>(localStorage, deviceId, x3dh_server_url, X3DH_post_data, Uid);
 #endif
 				break;
 
 				case lime::CurveId::c448 :
 #ifdef EC448_ENABLED
 
-					return std::make_shared<Lime<C448>>(std::move(localStorage), deviceId, x3dh_server_url, X3DH_post_data, Uid);
+					return std::make_shared<Lime<C448>>(localStorage, deviceId, x3dh_server_url, X3DH_post_data, Uid);
 #endif
 				break;
 
@@ -500,4 +1191,19 @@ namespace lime {
 		}
 		return nullptr;
 	};
+
+	/**
+	 * @brief : Load user from database opening a dedicated DB accessor on the given file
+	 *
+	 * @param[in]	dbFilename		Path to filename to use
+	 * @param[in]	deviceId		User to lookup in DB, deviceId shall be the GRUU
+	 * @param[in]	X3DH_post_data		A function used to communicate with the X3DH server
+	 * @param[in]	db_mutex		a mutex to protect db access
+	 * @param[in]	allStatus		allow loading of inactive user if set to true
+	 *
+	 * @return a pointer to the LimeGeneric class allowing access to API declared in lime_lime.hpp
+	 */
+	std::shared_ptr<LimeGeneric> load_LimeUser(const std::string &dbFilename, const std::string &deviceId, const limeX3DHServerPostData &X3DH_post_data, std::shared_ptr<std::recursive_mutex> db_mutex, const bool allStatus) {
+		return load_LimeUser(std::make_shared<lime::Db>(dbFilename, db_mutex), deviceId, X3DH_post_data, allStatus);
+	}
 } //namespace lime
@@ -0,0 +1,738 @@
+/*
+	lime_crypto_bctoolbox.cpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2017  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lime_crypto_primitives.hpp"
+#include "bctoolbox/crypto.h"
+#include "bctoolbox/exception.hh"
+#include "bctoolbox/port.h"
+
+/* bctoolbox crypto backend: implements the lime_crypto_primitives interfaces, factories and algorithms specialisations */
+namespace lime {
+
+const char *crypto_backend(void) {
+	return "bctoolbox";
+}
+
+/***** Random Number Generator ********/
+/* the RNG context of a thread, its type is trivially destructible so it stays valid while the other thread local objects are destroyed */
+struct bctbx_threadRNGContext {
+	bctbx_rng_context_t *context;
+	size_t draws; // number of times the context was used since it was seeded
+};
+static thread_local bctbx_threadRNGContext s_threadRNGContext{nullptr, 0};
+
+/* free the thread RNG context when the thread exits */
+struct bctbx_threadRNGContextCleaner {
+	~bctbx_threadRNGContextCleaner() {
+		if (s_threadRNGContext.context != nullptr) {
+			bctbx_rng_context_free(s_threadRNGContext.context);
+			s_threadRNGContext.context = nullptr;
+		}
+	}
+};
+
+/**
+ * @brief get the calling thread RNG context
+ *
+ * It is created at first use and replaced by a newly seeded one from the system entropy source after
+ * lime::settings::threadRNG_reseedInterval uses.
+ */
+static bctbx_rng_context_t *bctbx_threadRNG_getContext(void) {
+	auto &threadContext = s_threadRNGContext;
+	if (threadContext.context == nullptr || threadContext.draws >= lime::settings::threadRNG_reseedInterval) {
+		static thread_local bctbx_threadRNGContextCleaner cleaner{}; // constructed at first use so it is destroyed at thread exit
+		(void)cleaner;
+		if (threadContext.context != nullptr) {
+			bctbx_rng_context_free(threadContext.context);
+		}
+		threadContext.context = bctbx_rng_context_new();
+		threadContext.draws = 0;
+	}
+	threadContext.draws++;
+	return threadContext.context;
+}
+
+/**
+ * @brief A wrapper around the bctoolbox Random Number Generator, implements the RNG interface
+ *
+ * It either owns its context or uses the one of the calling thread: the second kind can then be used concurrently by any thread
+ */
+class bctbx_RNG : public RNG {
+	private :
+		bctbx_rng_context_t *m_context; // the bctoolbox RNG context, nullptr when using the calling thread one
+
+		/* only bctbx_EDDSA and bctbx_ECDH needs a direct access to the actual RNG context */
+		template <typename Curve> friend class bctbx_EDDSA;
+		template <typename Curve> friend class bctbx_ECDH;
+
+		/**
+		 * @brief access internal RNG context
+		 * Used internally by the bctoolbox wrapper, is not exposed to the lime_crypto_primitive API.
+		 *
+		 * @return a pointer to the RNG context
+		 */
+		bctbx_rng_context_t *get_context(void) {
+			return (m_context != nullptr)?m_context:bctbx_threadRNG_getContext();
+		}
+
+	public:
+
+		void randomize(sBuffer<lime::settings::DRrandomSeedSize> &buffer) override {
+			bctbx_rng_get(get_context(), buffer.data(), buffer.size());
+		};
+
+		uint32_t randomize() override {
+			std::array<uint8_t, 4> buffer;
+			bctbx_rng_get(get_context(), buffer.data(), buffer.size());
+			// we are on 31 bits: keep the uint32_t MSb set to 0 (see RNG interface definition)
+			return (static_cast<uint32_t>(buffer[0]&0x7F)<<24 | static_cast<uint32_t>(buffer[1])<<16 | static_cast<uint32_t>(buffer[2])<<8 | static_cast<uint32_t>(buffer[3]));
+		};
+
+		/**
+		 * @param[in]	threadContexts	when true, do not create a context but use the one of the calling thread
+		 */
+		explicit bctbx_RNG(const bool threadContexts=false) : m_context{threadContexts?nullptr:bctbx_rng_context_new()} {}
+	
+		~bctbx_RNG() {
+			if (m_context != nullptr) {
+				bctbx_rng_context_free(m_context);
+				m_context = nullptr;
+			}
+		}
+}; // class bctbx_RNG
+
+/* Factory functions */
+std::shared_ptr<RNG> make_RNG() {
+	return std::make_shared<bctbx_RNG>();
+}
+
+std::shared_ptr<RNG> shared_RNG() {
+	static auto sharedRNG = std::make_shared<bctbx_RNG>(true);
+	return sharedRNG;
+}
+/***** Signature  ********************/
+/* bctbx_EdDSA specialized constructor */
+template <typename Curve>
+bctbx_EDDSAContext_t *bctbx_EDDSAInit(void) {
+	/* if this template is instanciated the static_assert will fail but will give us an error message with faulty Curve type */
+	static_assert(sizeof(Curve) != sizeof(Curve), "You must specialize Signature class constructor for your type");
+	return nullptr;
+}
+
+#ifdef EC25519_ENABLED
+	/* specialise ECDH context creation */
+	template <> bctbx_EDDSAContext_t *bctbx_EDDSAInit<C255>(void) {
+		return bctbx_CreateEDDSAContext(BCTBX_EDDSA_25519);
+	}
+#endif // EC25519_ENABLED
+
+#ifdef EC448_ENABLED
+	/* specialise ECDH context creation */
+	template <> bctbx_EDDSAContext_t *bctbx_EDDSAInit<C448>(void) {
+		return bctbx_CreateEDDSAContext(BCTBX_EDDSA_448);
+	}
+#endif // EC448_ENABLED
+
+/* bctbx_ECDH specialized constructor */
+template <typename Curve>
+bctbx_ECDHContext_t *bctbx_ECDHInit(void) {
+	/* if this template is instanciated the static_assert will fail but will give us an error message with faulty Curve type */
+	static_assert(sizeof(Curve) != sizeof(Curve), "You must specialize keyExchange class contructor for your type");
+	return nullptr;
+}
+
+#ifdef EC25519_ENABLED
+	/* specialise ECDH context creation */
+	template <> bctbx_ECDHContext_t *bctbx_ECDHInit<C255>(void) {
+		return bctbx_CreateECDHContext(BCTBX_ECDH_X25519);
+	}
+#endif //EC25519_ENABLED
+
+#ifdef EC448_ENABLED
+	/* specialise ECDH context creation */
+	template <> bctbx_ECDHContext_t *bctbx_ECDHInit<C448>(void) {
+		return bctbx_CreateECDHContext(BCTBX_ECDH_X448);
+	}
+#endif //EC448_ENABLED
+
+/***** Contexts pool *****************/
+/* context creation, wiping and destruction, overloaded on the context type */
+template <typename Curve>
+bctbx_EDDSAContext_t *bctbx_newContext(bctbx_EDDSAContext_t *) {
+	return bctbx_EDDSAInit<Curve>();
+}
+template <typename Curve>
+bctbx_ECDHContext_t *bctbx_newContext(bctbx_ECDHContext_t *) {
+	return bctbx_ECDHInit<Curve>();
+}
+
+static void bctbx_wipeBuffer(uint8_t *&buffer, size_t size) {
+	if (buffer != nullptr) {
+		bctbx_clean(buffer, size);
+		bctbx_free(buffer);
+		buffer = nullptr;
+	}
+}
+/* remove all keys from the context, so it is in the same state than a newly created one */
+static void bctbx_wipeContext(bctbx_EDDSAContext_t *context) {
+	bctbx_wipeBuffer(context->secretKey, context->secretLength);
+	bctbx_wipeBuffer(context->publicKey, context->pointCoordinateLength);
+}
+static void bctbx_wipeContext(bctbx_ECDHContext_t *context) {
+	bctbx_wipeBuffer(context->secret, context->secretLength);
+	bctbx_wipeBuffer(context->sharedSecret, context->pointCoordinateLength);
+	bctbx_wipeBuffer(context->peerPublic, context->pointCoordinateLength);
+	bctbx_wipeBuffer(context->selfPublic, context->pointCoordinateLength);
+}
+
+static void bctbx_destroyContext(bctbx_EDDSAContext_t *context) {
+	bctbx_DestroyEDDSAContext(context);
+}
+static void bctbx_destroyContext(bctbx_ECDHContext_t *context) {
+	bctbx_DestroyECDHContext(context);
+}
+
+/**
+ * @brief A per thread pool of bctoolbox EdDSA or ECDH contexts
+ *
+ * Signature and key exchange objects are created for each ratchet step or peer key bundle, they
+ * take their context in the pool instead of creating a new one and give it back, wiped of any key, when destroyed.
+ * Each thread has its own pool so no lock is needed, a context can be given back to another thread pool than the one it was taken from.
+ *
+ * @tparam	Curve	the curve the contexts are created for
+ * @tparam	Context	bctbx_EDDSAContext_t or bctbx_ECDHContext_t
+ */
+template <typename Curve, typename Context>
+class bctbx_contextPool {
+	private:
+		std::vector<Context *> m_contexts;
+		static thread_local bctbx_contextPool s_pool; // this thread pool
+		static thread_local bool s_closed; // set when this thread pool is destroyed, contexts given back after that are destroyed
+
+		bctbx_contextPool() : m_contexts{} {
+			m_contexts.reserve(lime::settings::cryptoContextPool_maxSize);
+		}
+	public:
+		~bctbx_contextPool() {
+			s_closed = true;
+			for (auto context : m_contexts) {
+				bctbx_destroyContext(context);
+			}
+		}
+
+		/**
+		 * @brief get a context without any key set, from this thread pool or newly created if it is empty
+		 */
+		static Context *get(void) {
+			if (!s_closed && !s_pool.m_contexts.empty()) {
+				auto context = s_pool.m_contexts.back();
+				s_pool.m_contexts.pop_back();
+				return context;
+			}
+			return bctbx_newContext<Curve>(static_cast<Context *>(nullptr));
+		}
+
+		/**
+		 * @brief wipe the keys from a context and give it back to this thread pool, it is destroyed if the pool is full
+		 */
+		static void release(Context *context) {
+			bctbx_wipeContext(context);
+			if (!s_closed && s_pool.m_contexts.size() < lime::settings::cryptoContextPool_maxSize) {
+				s_pool.m_contexts.push_back(context);
+			} else {
+				bctbx_destroyContext(context);
+			}
+		}
+};
+template <typename Curve, typename Context> thread_local bctbx_contextPool<Curve, Context> bctbx_contextPool<Curve, Context>::s_pool;
+template <typename Curve, typename Context> thread_local bool bctbx_contextPool<Curve, Context>::s_closed = false;
+
+/**
+ * @brief a wrapper around bctoolbox signature algorithms, implements the Signature interface
+ *
+ * Provides EdDSA on curves 25519 and 448
+ */
+template <typename Curve>
+class bctbx_EDDSA : public Signature<Curve> {
+	private :
+		bctbx_EDDSAContext_t *m_context; // the EDDSA context
+	public :
+		/* accessors */
+		const DSA<Curve, lime::DSAtype::privateKey> get_secret(void) override {
+			if (m_context->secretKey == nullptr) {
+				throw BCTBX_EXCEPTION << "invalid EdDSA secret key";
+			}
+			if (DSA<Curve, lime::DSAtype::privateKey>::ssize() != m_context->secretLength) {
+				throw BCTBX_EXCEPTION << "Invalid buffer to store EdDSA secret key";
+			}
+			DSA<Curve, lime::DSAtype::privateKey> s;
+			std::copy_n(m_context->secretKey, s.ssize(), s.data());
+			return s;
+		}
+		const DSA<Curve, lime::DSAtype::publicKey> get_public(void) override {
+			if (m_context->publicKey == nullptr) {
+				throw BCTBX_EXCEPTION << "invalid EdDSA public key";
+			}
+			if (DSA<Curve, lime::DSAtype::publicKey>::ssize() != m_context->pointCoordinateLength) {
+				throw BCTBX_EXCEPTION << "Invalid buffer to store EdDSA public key";
+			}
+			DSA<Curve, lime::DSAtype::publicKey> p;
+			std::copy_n(m_context->publicKey, p.ssize(), p.data());
+			return p;
+		}
+
+		/* Setting keys */
+		void set_secret(const DSA<Curve, lime::DSAtype::privateKey> &secretKey) override {
+			bctbx_EDDSA_setSecretKey(m_context, secretKey.data(), secretKey.ssize());
+		}
+
+		void set_public(const DSA<Curve, lime::DSAtype::publicKey> &publicKey) override {
+			bctbx_EDDSA_setPublicKey(m_context, publicKey.data(), publicKey.ssize());
+		}
+
+		void createKeyPair(std::shared_ptr<lime::RNG> rng) override {
+			// the dynamic cast will generate an exception if RNG is not actually a bctbx_RNG
+			bctbx_EDDSACreateKeyPair(m_context, (int (*)(void *, uint8_t *, size_t))bctbx_rng_get, dynamic_cast<lime::bctbx_RNG&>(*rng).get_context());
+		}
+
+		void derivePublic(void) override {
+			bctbx_EDDSADerivePublicKey(m_context);
+		}
+
+		void sign(const std::vector<uint8_t> &message, DSA<Curve, lime::DSAtype::signature> &signature) override {
+			auto sigSize = signature.size();
+			bctbx_EDDSA_sign(m_context, message.data(), message.size(), nullptr, 0, signature.data(), &sigSize);
+		}
+
+		void sign(const X<Curve, lime::Xtype::publicKey> &message, DSA<Curve, lime::DSAtype::signature> &signature) override {
+			auto sigSize = signature.size();
+			bctbx_EDDSA_sign(m_context, message.data(), message.ssize(), nullptr, 0, signature.data(), &sigSize);
+		}
+
+		bool verify(const std::vector<uint8_t> &message, const DSA<Curve, lime::DSAtype::signature> &signature) override {
+			return (bctbx_EDDSA_verify(m_context, message.data(), message.size(), nullptr, 0, signature.data(), signature.size()) == BCTBX_VERIFY_SUCCESS);
+		}
+
+		bool verify(const X<Curve, lime::Xtype::publicKey> &message, const DSA<Curve, lime::DSAtype::signature> &signature) override {
+			return (bctbx_EDDSA_verify(m_context, message.data(), message.ssize(), nullptr, 0, signature.data(), signature.ssize()) == BCTBX_VERIFY_SUCCESS);
+		}
+
+		bctbx_EDDSA() {
+			m_context = bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::get();
+		}
+		~bctbx_EDDSA(){
+			/* give the context back, its buffers are cleaned */
+			bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::release(m_context);
+			m_context = nullptr;
+		}
+}; // class bctbx_EDDSA
+
+/***** Key Exchange ******************/
+
+/**
+ * @brief a wrapper around bctoolbox key exchange algorithms, implements the keyExchange interface
+ *
+ * Provides X25519 and X448
+ */
+template <typename Curve>
+class bctbx_ECDH : public keyExchange<Curve> {
+	private :
+		bctbx_ECDHContext_t *m_context; // the ECDH context
+	public :
+		/* accessors */
+		const X<Curve, lime::Xtype::privateKey> get_secret(void) override {
+			if (m_context->secret == nullptr) {
+				throw BCTBX_EXCEPTION << "invalid ECDH secret key";
+			}
+			if (X<Curve, lime::Xtype::privateKey>::ssize() != m_context->secretLength) {
+				throw BCTBX_EXCEPTION << "Invalid buffer to store ECDH secret key";
+			}
+			X<Curve, lime::Xtype::privateKey> s;
+			std::copy_n(m_context->secret, s.ssize(), s.data());
+			return s;
+		}
+		const X<Curve, lime::Xtype::publicKey> get_selfPublic(void) override {
+			if (m_context->selfPublic == nullptr) {
+				throw BCTBX_EXCEPTION << "invalid ECDH self public key";
+			}
+			if (X<Curve, lime::Xtype::publicKey>::ssize() != m_context->pointCoordinateLength) {
+				throw BCTBX_EXCEPTION << "Invalid buffer to store ECDH self public key";
+			}
+			X<Curve, lime::Xtype::publicKey> p;
+			std::copy_n(m_context->selfPublic, p.ssize(), p.data());
+			return p;
+		}
+		const X<Curve, lime::Xtype::publicKey> get_peerPublic(void) override {
+			if (m_context->peerPublic == nullptr) {
+				throw BCTBX_EXCEPTION << "invalid ECDH peer public key";
+			}
+			if (X<Curve, lime::Xtype::publicKey>::ssize() != m_context->pointCoordinateLength) {
+				throw BCTBX_EXCEPTION << "Invalid buffer to store ECDH peer public key";
+			}
+			X<Curve, lime::Xtype::publicKey> p;
+			std::copy_n(m_context->peerPublic, p.ssize(), p.data());
+			return p;
+		}
+		const X<Curve, lime::Xtype::sharedSecret> get_sharedSecret(void) override {
+			if (m_context->sharedSecret == nullptr) {
+				throw BCTBX_EXCEPTION << "invalid ECDH shared secret";
+			}
+			if (X<Curve, lime::Xtype::sharedSecret>::ssize() != m_context->pointCoordinateLength) {
+				throw BCTBX_EXCEPTION << "Invalid buffer to store ECDH output";
+			}
+			X<Curve, lime::Xtype::sharedSecret> s;
+			std::copy_n(m_context->sharedSecret, s.ssize(), s.data());
+			return s;
+		}
+
+
+		/* Setting keys, accept Signature keys */
+		void set_secret(const X<Curve, lime::Xtype::privateKey> &secret) override {
+			bctbx_ECDHSetSecretKey(m_context, secret.data(), secret.ssize());
+		}
+
+		void set_secret(const DSA<Curve, lime::DSAtype::privateKey> &secret) override {
+			// we must create a temporary bctbx_EDDSA context and set the given key in
+			auto tmp_context = bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::get();
+			bctbx_EDDSA_setSecretKey(tmp_context, secret.data(), secret.ssize());
+
+			// Convert
+			bctbx_EDDSA_ECDH_privateKeyConversion(tmp_context, m_context);
+
+			// Cleaning
+			bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::release(tmp_context);
+		}
+
+		void set_selfPublic(const X<Curve, lime::Xtype::publicKey> &selfPublic) override {
+			bctbx_ECDHSetSelfPublicKey(m_context, selfPublic.data(), selfPublic.ssize());
+		}
+
+		void set_selfPublic(const DSA<Curve, lime::DSAtype::publicKey> &selfPublic) override {
+			// we must create a temporary bctbx_EDDSA context and set the given key in
+			auto tmp_context = bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::get();
+			bctbx_EDDSA_setPublicKey(tmp_context, selfPublic.data(), selfPublic.ssize());
+
+			// Convert in self Public
+			bctbx_EDDSA_ECDH_publicKeyConversion(tmp_context, m_context, BCTBX_ECDH_ISSELF);
+
+			// Cleaning
+			bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::release(tmp_context);
+		}
+
+		void set_peerPublic(const X<Curve, lime::Xtype::publicKey> &peerPublic) override {
+			bctbx_ECDHSetPeerPublicKey(m_context, peerPublic.data(), peerPublic.ssize());
+		}
+
+		void set_peerPublic(const DSA<Curve, lime::DSAtype::publicKey> &peerPublic) override {
+			// we must create a temporary bctbx_EDDSA context and set the given key in
+			auto tmp_context = bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::get();
+			bctbx_EDDSA_setPublicKey(tmp_context, peerPublic.data(), peerPublic.ssize());
+
+			// Convert in peer Public
+			bctbx_EDDSA_ECDH_publicKeyConversion(tmp_context, m_context, BCTBX_ECDH_ISPEER);
+
+			// Cleaning
+			bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::release(tmp_context);
+		}
+
+		void createKeyPair(std::shared_ptr<lime::RNG> rng) override {
+			// the dynamic cast will generate an exception if RNG is not actually a bctbx_RNG
+			bctbx_ECDHCreateKeyPair(m_context, (int (*)(void *, uint8_t *, size_t))bctbx_rng_get, dynamic_cast<lime::bctbx_RNG&>(*rng).get_context());
+		}
+
+		void deriveSelfPublic(void) override {
+			bctbx_ECDHDerivePublicKey(m_context);
+		}
+
+		void computeSharedSecret(void) override {
+			 bctbx_ECDHComputeSecret(m_context, nullptr, nullptr);
+		}
+
+		bctbx_ECDH() {
+			m_context = bctbx_contextPool<Curve, bctbx_ECDHContext_t>::get();
+		}
+		~bctbx_ECDH(){
+			/* give the context back, its buffers are cleaned */
+			bctbx_contextPool<Curve, bctbx_ECDHContext_t>::release(m_context);
+			m_context = nullptr;
+		}
+}; // class bctbx_ECDH
+
+
+/* Factory functions */
+template <typename Curve>
+std::shared_ptr<keyExchange<Curve>> make_keyExchange() {
+	return std::make_shared<bctbx_ECDH<Curve>>();
+}
+
+template <typename Curve>
+std::shared_ptr<Signature<Curve>> make_Signature() {
+	return std::make_shared<bctbx_EDDSA<Curve>>();
+}
+
+/* Direct key operations: use a pooled context and copy the result straight in the caller's buffer */
+template <typename Curve>
+void X_generateKeyPair(Xpair<Curve> &keyPair, RNG &rng) {
+	auto context = bctbx_contextPool<Curve, bctbx_ECDHContext_t>::get();
+	// the dynamic cast will generate an exception if RNG is not actually a bctbx_RNG
+	bctbx_ECDHCreateKeyPair(context, (int (*)(void *, uint8_t *, size_t))bctbx_rng_get, dynamic_cast<lime::bctbx_RNG&>(rng).get_context());
+	std::copy_n(context->selfPublic, X<Curve, lime::Xtype::publicKey>::ssize(), keyPair.publicKey().data());
+	std::copy_n(context->secret, X<Curve, lime::Xtype::privateKey>::ssize(), keyPair.privateKey().data());
+	bctbx_contextPool<Curve, bctbx_ECDHContext_t>::release(context);
+}
+
+template <typename Curve>
+void X_computeSharedSecret(const X<Curve, lime::Xtype::privateKey> &secret, const X<Curve, lime::Xtype::publicKey> &peerPublic, X<Curve, lime::Xtype::sharedSecret> &sharedSecret) {
+	auto context = bctbx_contextPool<Curve, bctbx_ECDHContext_t>::get();
+	bctbx_ECDHSetSecretKey(context, secret.data(), secret.ssize());
+	bctbx_ECDHSetPeerPublicKey(context, peerPublic.data(), peerPublic.ssize());
+	bctbx_ECDHComputeSecret(context, nullptr, nullptr);
+	std::copy_n(context->sharedSecret, sharedSecret.ssize(), sharedSecret.data());
+	bctbx_contextPool<Curve, bctbx_ECDHContext_t>::release(context);
+}
+
+template <typename Curve>
+void X_fromDSA(const DSA<Curve, lime::DSAtype::privateKey> &DSAKey, X<Curve, lime::Xtype::privateKey> &XKey) {
+	auto DSAContext = bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::get();
+	auto XContext = bctbx_contextPool<Curve, bctbx_ECDHContext_t>::get();
+	bctbx_EDDSA_setSecretKey(DSAContext, DSAKey.data(), DSAKey.ssize());
+	bctbx_EDDSA_ECDH_privateKeyConversion(DSAContext, XContext);
+	std::copy_n(XContext->secret, XKey.ssize(), XKey.data());
+	bctbx_contextPool<Curve, bctbx_ECDHContext_t>::release(XContext);
+	bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::release(DSAContext);
+}
+
+template <typename Curve>
+void X_fromDSA(const DSA<Curve, lime::DSAtype::publicKey> &DSAKey, X<Curve, lime::Xtype::publicKey> &XKey) {
+	auto DSAContext = bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::get();
+	auto XContext = bctbx_contextPool<Curve, bctbx_ECDHContext_t>::get();
+	bctbx_EDDSA_setPublicKey(DSAContext, DSAKey.data(), DSAKey.ssize());
+	bctbx_EDDSA_ECDH_publicKeyConversion(DSAContext, XContext, BCTBX_ECDH_ISPEER);
+	std::copy_n(XContext->peerPublic, XKey.ssize(), XKey.data());
+	bctbx_contextPool<Curve, bctbx_ECDHContext_t>::release(XContext);
+	bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::release(DSAContext);
+}
+
+template <typename Curve>
+bool DSA_verify(const DSA<Curve, lime::DSAtype::publicKey> &publicKey, const X<Curve, lime::Xtype::publicKey> &message, const DSA<Curve, lime::DSAtype::signature> &signature) {
+	auto context = bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::get();
+	bctbx_EDDSA_setPublicKey(context, publicKey.data(), publicKey.ssize());
+	auto ret = (bctbx_EDDSA_verify(context, message.data(), message.ssize(), nullptr, 0, signature.data(), signature.ssize()) == BCTBX_VERIFY_SUCCESS);
+	bctbx_contextPool<Curve, bctbx_EDDSAContext_t>::release(context);
+	return ret;
+}
+
+/* HMAC specialized template for SHA512 */
+template <> void HMAC<SHA512>(const uint8_t *const key, const size_t keySize, const uint8_t *const input, const size_t inputSize, uint8_t *hash, size_t hashSize) {
+	bctbx_hmacSha512(key, keySize, input, inputSize, static_cast<uint8_t>(std::min(SHA512::ssize(),hashSize)), hash);
+}
+
+/* HMAC batch specialized template for SHA512
+ * bctoolbox does not provide a multi-buffer SHA512, the jobs are computed one after the other.
+ * This is the place to plug one: callers already give all their independent computations at once */
+template <> void HMAC_batch<SHA512>(const HMACJob *const jobs, const size_t jobsCount) {
+	for (size_t i=0; i<jobsCount; i++) {
+		const auto &job = jobs[i];
+		bctbx_hmacSha512(job.key, job.keySize, job.input, job.inputSize, static_cast<uint8_t>(std::min(SHA512::ssize(),job.hashSize)), job.hash);
+	}
+}
+
+/* AEAD scheme specialiazed template with AES256-GCM, 16 bytes auth tag */
+template <> void AEAD_encrypt<AES256GCM>(const uint8_t *const key, const size_t keySize, const uint8_t *const IV, const size_t IVSize,
+		const uint8_t *const plain, const size_t plainSize, const uint8_t *const AD, const size_t ADSize,
+		uint8_t *tag, const size_t tagSize, uint8_t *cipher) {
+	/* perforn checks on sizes */
+	if (keySize != AES256GCM::keySize() || tagSize != AES256GCM::tagSize()) {
+		throw BCTBX_EXCEPTION << "invalid arguments for AEAD_encrypt AES256-GCM";
+	}
+	auto ret = bctbx_aes_gcm_encrypt_and_tag(key, keySize, plain, plainSize, AD, ADSize, IV, IVSize, tag, tagSize, cipher);
+	if (ret != 0) {
+		throw BCTBX_EXCEPTION << "AEAD_encrypt AES256-GCM error: "<<ret;
+	}
+}
+
+template <> bool AEAD_decrypt<AES256GCM>(const uint8_t *const key, const size_t keySize, const uint8_t *const IV, const size_t IVSize,
+		const uint8_t *const cipher, const size_t cipherSize, const uint8_t *const AD, const size_t ADSize,
+		const uint8_t *const tag, const size_t tagSize, uint8_t *plain) {
+	/* perforn checks on sizes */
+	if (keySize != AES256GCM::keySize() || tagSize != AES256GCM::tagSize()) {
+		throw BCTBX_EXCEPTION << "invalid arguments for AEAD_decrypt AES256-GCM";
+	}
+	auto ret = bctbx_aes_gcm_decrypt_and_auth(key, keySize, cipher, cipherSize, AD, ADSize, IV, IVSize, tag, tagSize, plain);
+	if (ret == 0) return true;
+	if (ret == BCTBX_ERROR_AUTHENTICATION_FAILED) return false;
+	throw BCTBX_EXCEPTION << "AEAD_decrypt AES256-GCM error: "<<ret;
+}
+
+/* AEAD batch specialized template with AES256-GCM, 16 bytes auth tag
+ * bctoolbox does not provide an interleaved AES-GCM, the jobs are encrypted one after the other.
+ * This is the place to plug one: callers already give all their independent encryptions at once */
+template <> void AEAD_encrypt_batch<AES256GCM>(const AEADJob *const jobs, const size_t jobsCount) {
+	/* perforn checks on sizes */
+	for (size_t i=0; i<jobsCount; i++) {
+		if (jobs[i].keySize != AES256GCM::keySize() || jobs[i].tagSize != AES256GCM::tagSize()) {
+			throw BCTBX_EXCEPTION << "invalid arguments for AEAD_encrypt_batch AES256-GCM, job "<<i;
+		}
+	}
+	for (size_t i=0; i<jobsCount; i++) {
+		const auto &job = jobs[i];
+		auto ret = bctbx_aes_gcm_encrypt_and_tag(job.key, job.keySize, job.plain, job.plainSize, job.AD, job.ADSize, job.IV, job.IVSize, job.tag, job.tagSize, job.cipher);
+		if (ret != 0) {
+			throw BCTBX_EXCEPTION << "AEAD_encrypt_batch AES256-GCM error: "<<ret<<" on job "<<i;
+		}
+	}
+}
+
+/***** Incremental AEAD ********************/
+/**
+ * @brief a wrapper around the bctoolbox AES-GCM incremental API, implements the AEADStream interface
+ */
+class bctbx_AES256GCMStream : public AEADStream {
+	private:
+		bctbx_aes_gcm_context_t *m_context; // bctoolbox context, it is freed when finishing the operation
+		const bool m_encrypt; // direction given at creation
+
+		// compute the tag and release the bctoolbox context
+		void finish(uint8_t *tag, const size_t tagSize) {
+			if (m_context == nullptr) {
+				throw BCTBX_EXCEPTION << "AES256-GCM stream already finished";
+			}
+			auto ret = bctbx_aes_gcm_finish(m_context, tag, tagSize);
+			m_context = nullptr;
+			if (ret != 0) {
+				throw BCTBX_EXCEPTION << "AES256-GCM stream finish error: "<<ret;
+			}
+		}
+	public:
+		void update(const uint8_t *const input, const size_t inputSize, uint8_t *output) override {
+			if (m_context == nullptr) {
+				throw BCTBX_EXCEPTION << "AES256-GCM stream already finished";
+			}
+			auto ret = bctbx_aes_gcm_process_chunk(m_context, input, inputSize, output);
+			if (ret != 0) {
+				throw BCTBX_EXCEPTION << "AES256-GCM stream error: "<<ret;
+			}
+		}
+
+		void encryptFinish(uint8_t *tag, const size_t tagSize) override {
+			if (!m_encrypt || tagSize != AES256GCM::tagSize()) {
+				throw BCTBX_EXCEPTION << "invalid arguments for AES256-GCM stream encryptFinish";
+			}
+			finish(tag, tagSize);
+		}
+
+		bool decryptFinish(const uint8_t *const tag, const size_t tagSize) override {
+			if (m_encrypt || tagSize != AES256GCM::tagSize()) {
+				throw BCTBX_EXCEPTION << "invalid arguments for AES256-GCM stream decryptFinish";
+			}
+			std::array<uint8_t, AES256GCM::tagSize()> computedTag;
+			finish(computedTag.data(), computedTag.size());
+			// constant time comparison
+			uint8_t diff = 0;
+			for (size_t i=0; i<computedTag.size(); i++) {
+				diff |= computedTag[i]^tag[i];
+			}
+			return (diff == 0);
+		}
+
+		bctbx_AES256GCMStream(const bool encrypt, const uint8_t *const key, const size_t keySize, const uint8_t *const IV, const size_t IVSize, const uint8_t *const AD, const size_t ADSize)
+		: m_context{nullptr}, m_encrypt{encrypt} {
+			if (keySize != AES256GCM::keySize()) {
+				throw BCTBX_EXCEPTION << "invalid arguments for AES256-GCM stream";
+			}
+			m_context = bctbx_aes_gcm_context_new(key, keySize, AD, ADSize, IV, IVSize, encrypt?BCTBX_GCM_ENCRYPT:BCTBX_GCM_DECRYPT);
+			if (m_context == nullptr) {
+				throw BCTBX_EXCEPTION << "AES256-GCM stream context creation failed";
+			}
+		}
+
+		~bctbx_AES256GCMStream() {
+			if (m_context != nullptr) { // the operation was not finished, finish it to release the context
+				std::array<uint8_t, AES256GCM::tagSize()> tag;
+				bctbx_aes_gcm_finish(m_context, tag.data(), tag.size());
+				m_context = nullptr;
+			}
+		}
+}; // class bctbx_AES256GCMStream
+
+/* Factory function */
+template <> std::shared_ptr<AEADStream> make_AEADStream<AES256GCM>(const bool encrypt, const uint8_t *const key, const size_t keySize, const uint8_t *const IV, const size_t IVSize,
+		const uint8_t *const AD, const size_t ADSize) {
+	return std::make_shared<bctbx_AES256GCMStream>(encrypt, key, keySize, IV, IVSize, AD, ADSize);
+}
+
+/* check buffer length are in sync with bctoolbox ones */
+#ifdef EC25519_ENABLED
+	static_assert(BCTBX_ECDH_X25519_PUBLIC_SIZE == X<C255, Xtype::publicKey>::ssize(), "bctoolbox and local defines mismatch");
+	// for ECDH public value and shared secret have the same size
+	static_assert(BCTBX_ECDH_X25519_PUBLIC_SIZE == X<C255, Xtype::sharedSecret>::ssize(), "bctoolbox and local defines mismatch");
+	static_assert(BCTBX_ECDH_X25519_PRIVATE_SIZE == X<C255, Xtype::privateKey>::ssize(), "bctoolbox and local defines mismatch");
+
+	static_assert(BCTBX_EDDSA_25519_PUBLIC_SIZE == DSA<C255, DSAtype::publicKey>::ssize(), "bctoolbox and local defines mismatch");
+	static_assert(BCTBX_EDDSA_25519_PRIVATE_SIZE == DSA<C255, DSAtype::privateKey>::ssize(), "bctoolbox and local defines mismatch");
+	static_assert(BCTBX_EDDSA_25519_SIGNATURE_SIZE == DSA<C255, DSAtype::signature>::ssize(), "bctoolbox and local defines mismatch");
+#endif //EC25519_ENABLED
+
+#ifdef EC448_ENABLED
+	static_assert(BCTBX_ECDH_X448_PUBLIC_SIZE == X<C448, Xtype::publicKey>::ssize(), "bctoolbox and local defines mismatch");
+	// for ECDH public value and shared secret have the same size
+	static_assert(BCTBX_ECDH_X448_PUBLIC_SIZE == X<C448, Xtype::sharedSecret>::ssize(), "bctoolbox and local defines mismatch");
+	static_assert(BCTBX_ECDH_X448_PRIVATE_SIZE == X<C448, Xtype::privateKey>::ssize(), "bctoolbox and local defines mismatch");
+
+	static_assert(BCTBX_EDDSA_448_PUBLIC_SIZE == DSA<C448, DSAtype::publicKey>::ssize(), "bctoolbox and local defines mismatch");
+	static_assert(BCTBX_EDDSA_448_PRIVATE_SIZE == DSA<C448, DSAtype::privateKey>::ssize(), "bctoolbox and local defines mismatch");
+	static_assert(BCTBX_EDDSA_448_SIGNATURE_SIZE == DSA<C448, DSAtype::signature>::ssize(), "bctoolbox and local defines mismatch");
+#endif //EC448_ENABLED
+
+/**
+ * @brief force a buffer values to zero in a way that shall prevent the compiler from optimizing it out
+ *
+ * @param[in,out]	buffer	the buffer to be cleared
+ * @param[in]		size	buffer size
+ */
+void cleanBuffer(uint8_t *buffer, size_t size) {
+	bctbx_clean(buffer, size);
+}
+
+/* template instanciations for Curve 25519 and Curve 448 */
+#ifdef EC25519_ENABLED
+	template class bctbx_ECDH<C255>;
+	template class bctbx_EDDSA<C255>;
+	template std::shared_ptr<keyExchange<C255>> make_keyExchange();
+	template std::shared_ptr<Signature<C255>> make_Signature();
+	template void X_generateKeyPair<C255>(Xpair<C255> &keyPair, RNG &rng);
+	template void X_computeSharedSecret<C255>(const X<C255, lime::Xtype::privateKey> &secret, const X<C255, lime::Xtype::publicKey> &peerPublic, X<C255, lime::Xtype::sharedSecret> &sharedSecret);
+	template void X_fromDSA<C255>(const DSA<C255, lime::DSAtype::privateKey> &DSAKey, X<C255, lime::Xtype::privateKey> &XKey);
+	template void X_fromDSA<C255>(const DSA<C255, lime::DSAtype::publicKey> &DSAKey, X<C255, lime::Xtype::publicKey> &XKey);
+	template bool DSA_verify<C255>(const DSA<C255, lime::DSAtype::publicKey> &publicKey, const X<C255, lime::Xtype::publicKey> &message, const DSA<C255, lime::DSAtype::signature> &signature);
+#endif //EC25519_ENABLED
+
+#ifdef EC448_ENABLED
+	template class bctbx_ECDH<C448>;
+	template class bctbx_EDDSA<C448>;
+	template std::shared_ptr<keyExchange<C448>> make_keyExchange();
+	template std::shared_ptr<Signature<C448>> make_Signature();
+	template void X_generateKeyPair<C448>(Xpair<C448> &keyPair, RNG &rng);
+	template void X_computeSharedSecret<C448>(const X<C448, lime::Xtype::privateKey> &secret, const X<C448, lime::Xtype::publicKey> &peerPublic, X<C448, lime::Xtype::sharedSecret> &sharedSecret);
+	template void X_fromDSA<C448>(const DSA<C448, lime::DSAtype::privateKey> &DSAKey, X<C448, lime::Xtype::privateKey> &XKey);
+	template void X_fromDSA<C448>(const DSA<C448, lime::DSAtype::publicKey> &DSAKey, X<C448, lime::Xtype::publicKey> &XKey);
+	template bool DSA_verify<C448>(const DSA<C448, lime::DSAtype::publicKey> &publicKey, const X<C448, lime::Xtype::publicKey> &message, const DSA<C448, lime::DSAtype::signature> &signature);
+#endif //EC448_ENABLED
+
+} // namespace lime
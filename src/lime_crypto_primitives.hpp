@@ -77,6 +77,10 @@ namespace lime {
 			X<Curve, lime::Xtype::privateKey> &privateKey(void) {return m_privKey;};
 			/// access the public key
 			X<Curve, lime::Xtype::publicKey> &publicKey(void) {return m_pubKey;};
+			/// read only access to the private key
+			const X<Curve, lime::Xtype::privateKey> &cprivateKey(void) const {return m_privKey;};
+			/// read only access to the public key
+			const X<Curve, lime::Xtype::publicKey> &cpublicKey(void) const {return m_pubKey;};
 			/// copy construct a key pair from public and private keys (no verification on validity of keys is performed)
 			Xpair(X<Curve, lime::Xtype::publicKey> &pub, X<Curve, lime::Xtype::privateKey> &priv):m_pubKey(pub),m_privKey(priv) {};
 			Xpair() :m_pubKey{},m_privKey{}{};
@@ -282,6 +286,45 @@ class Signature {
 		virtual ~Signature() = default;
 }; //class EdDSA
 
+/**
+ * @brief Incremental AEAD interface
+ *
+ * Encrypt or decrypt a message chunk by chunk so it never has to be held in one buffer.
+ * The direction is selected at context creation, see make_AEADStream.
+ * @note when decrypting, the output is authenticated only when decryptFinish returns true
+ */
+class AEADStream {
+	public:
+		/**
+		 * @brief Encrypt or decrypt a chunk of the message
+		 *
+		 * @param[in]	input		the chunk to process
+		 * @param[in]	inputSize	input buffer length
+		 * @param[out]	output		the processed chunk, shall be at least inputSize bytes long
+		 */
+		virtual void update(const uint8_t *const input, const size_t inputSize, uint8_t *output) = 0;
+
+		/**
+		 * @brief Terminate an encryption and produce the authentication tag
+		 *
+		 * @param[out]	tag		Buffer holding the generated tag
+		 * @param[in]	tagSize		Requested length for the generated tag, it must match the selected AEAD scheme or an exception is generated
+		 */
+		virtual void encryptFinish(uint8_t *tag, const size_t tagSize) = 0;
+
+		/**
+		 * @brief Terminate a decryption and check the authentication tag
+		 *
+		 * @param[in]	tag		Buffer holding the authentication tag
+		 * @param[in]	tagSize		Length of the tag, it must match the selected AEAD scheme or an exception is generated
+		 *
+		 * @return true if the authentication tag match
+		 */
+		virtual bool decryptFinish(const uint8_t *const tag, const size_t tagSize) = 0;
+
+		virtual ~AEADStream() = default;
+}; //class AEADStream
+
 /**
  * @brief templated HMAC
  *
@@ -300,6 +343,34 @@ void HMAC(const uint8_t *const key, const size_t keySize, const uint8_t *const i
 /* declare template specialisations */
 template <> void HMAC<SHA512>(const uint8_t *const key, const size_t keySize, const uint8_t *const input, const size_t inputSize, uint8_t *hash, size_t hashSize);
 
+/**
+ * @brief One HMAC computation of a batch, buffers are owned by the caller
+ */
+struct HMACJob {
+	const uint8_t *key; /**< HMAC key */
+	size_t keySize; /**< previous buffer size */
+	const uint8_t *input; /**< HMAC input */
+	size_t inputSize; /**< previous buffer size */
+	uint8_t *hash; /**< output, must be able to hold hashSize bytes and not overlap any key or input of the batch */
+	size_t hashSize; /**< amount of expected data, if more than selected Hash algorithm can compute, silently ignored and maximum output size is generated */
+};
+
+/**
+ * @brief templated batch of independent HMAC
+ *
+ * Computes the same outputs than calling HMAC on each job, but gives all of them at once to the
+ * underlying implementation so one able to process several buffers in parallel can be used.
+ *
+ * @tparam	hashAlgo	the hash algorithm used (only SHA512 available for now)
+ *
+ * @param[in,out]	jobs		the HMAC to compute, their outputs are written in their hash buffers
+ * @param[in]		jobsCount	number of jobs in the previous buffer
+ */
+template <typename hashAlgo>
+void HMAC_batch(const HMACJob *const jobs, const size_t jobsCount);
+/* declare template specialisations */
+template <> void HMAC_batch<SHA512>(const HMACJob *const jobs, const size_t jobsCount);
+
 /**
  * @brief HKDF as described in RFC5869
  *	@par Compute:
@@ -391,23 +462,148 @@ template <> bool AEAD_decrypt<AES256GCM>(const uint8_t *const key, const size_t
 		const uint8_t *const cipher, const size_t cipherSize, const uint8_t *const AD, const size_t ADSize,
 		const uint8_t *const tag, const size_t tagSize, uint8_t *plain);
 
+/**
+ * @brief One encryption of an AEAD batch, buffers are owned by the caller
+ */
+struct AEADJob {
+	const uint8_t *key; /**< Encryption key */
+	size_t keySize; /**< Key buffer length, it must match the selected AEAD scheme */
+	const uint8_t *IV; /**< Buffer holding the initialisation vector */
+	size_t IVSize; /**< Initialisation vector length in bytes */
+	const uint8_t *plain; /**< buffer to be encrypted */
+	size_t plainSize; /**< Length in bytes of buffer to be encrypted */
+	const uint8_t *AD; /**< Buffer holding additional data to be used in tag computation */
+	size_t ADSize; /**< Additional data length in bytes */
+	uint8_t *tag; /**< Buffer holding the generated tag */
+	size_t tagSize; /**< Requested length for the generated tag, it must match the selected AEAD scheme */
+	uint8_t *cipher; /**< Buffer holding the output, shall be at least the length of plain buffer */
+};
+
+/**
+ * @brief Encrypt and tag a batch of independent messages using scheme given as template parameter
+ *
+ * Computes the same outputs than calling AEAD_encrypt on each job, but gives all of them at once to the
+ * underlying implementation so one able to pipeline several encryptions can be used.
+ * All the jobs arguments are checked before any encryption: if one is invalid an exception is generated and no output is written.
+ *
+ * @param[in,out]	jobs		the encryptions to perform, their outputs are written in their tag and cipher buffers
+ * @param[in]		jobsCount	number of jobs in the previous buffer
+ */
+template <typename AEADAlgo>
+void AEAD_encrypt_batch(const AEADJob *const jobs, const size_t jobsCount);
+
+/* declare AEAD batch template specialisations */
+template <> void AEAD_encrypt_batch<AES256GCM>(const AEADJob *const jobs, const size_t jobsCount);
+
 
 /*************************************************************************************************/
 /********************** Factory Functions ********************************************************/
 /*************************************************************************************************/
-/* Use these to instantiate an object as they will pick the correct undurlying implemenation of virtual classes */
+/* Use these to instantiate an object as they will pick the correct undurlying implemenation of virtual classes
+ *
+ * They are implemented by the crypto backend selected at build time (CRYPTO_BACKEND cmake option) in src/lime_crypto_<backend>.cpp.
+ * A backend provides:
+ * - the factory functions and the RNG, keyExchange<Curve>, Signature<Curve> and AEADStream implementations they return
+ * - the HMAC, HMAC_batch, AEAD_encrypt, AEAD_decrypt and AEAD_encrypt_batch specialisations declared in this file
+ * - cleanBuffer and crypto_backend
+ * It must pass the crypto test suite, run on the reference test vectors.
+ */
+
+/**
+ * @brief Get the name of the crypto backend implementing these primitives
+ *
+ * @return the backend name, as given to the CRYPTO_BACKEND cmake option
+ */
+const char *crypto_backend(void);
+
 std::shared_ptr<RNG> make_RNG();
 
+/**
+ * @brief Get the process wide RNG
+ *
+ * Unlike the ones given by make_RNG, it is thread safe: each calling thread draws from its own context,
+ * created at first use and periodically replaced by a newly seeded one.
+ * Use it instead of creating a RNG for a few random bytes.
+ *
+ * @return the shared RNG, always the same object
+ */
+std::shared_ptr<RNG> shared_RNG();
+
+/**
+ * @brief Create an incremental AEAD context using scheme given as template parameter
+ *
+ * @param[in]	encrypt		true to encrypt, false to decrypt
+ * @param[in]	key		Encryption key
+ * @param[in]	keySize		Key buffer length, it must match the selected AEAD scheme or an exception is generated
+ * @param[in]	IV		Buffer holding the initialisation vector
+ * @param[in]	IVSize		Initialisation vector length in bytes
+ * @param[in]	AD		Buffer holding additional data to be used in tag computation
+ * @param[in]	ADSize		Additional data length in bytes
+ */
+template <typename AEADAlgo>
+std::shared_ptr<AEADStream> make_AEADStream(const bool encrypt, const uint8_t *const key, const size_t keySize, const uint8_t *const IV, const size_t IVSize,
+		const uint8_t *const AD, const size_t ADSize);
+template <> std::shared_ptr<AEADStream> make_AEADStream<AES256GCM>(const bool encrypt, const uint8_t *const key, const size_t keySize, const uint8_t *const IV, const size_t IVSize,
+		const uint8_t *const AD, const size_t ADSize);
+
 template <typename Curve>
 std::shared_ptr<keyExchange<Curve>> make_keyExchange();
 
 template <typename Curve>
 std::shared_ptr<Signature<Curve>> make_Signature();
 
+/*************************************************************************************************/
+/********************** Direct key operations ****************************************************/
+/*************************************************************************************************/
+/* The keyExchange and Signature interfaces above are stateful and return keys by value: on the
+ * Double Ratchet and X3DH hot paths the functions below are used instead, they are not virtual and
+ * write their result directly in the caller's buffer. */
+/**
+ * @brief Generate a key exchange key pair
+ *
+ * @param[out]	keyPair	the generated key pair
+ * @param[in]	rng	the RNG to use, it must be created by make_RNG or shared_RNG
+ */
+template <typename Curve>
+void X_generateKeyPair(Xpair<Curve> &keyPair, RNG &rng);
+
+/**
+ * @brief Compute a key exchange shared secret
+ *
+ * @param[in]	secret		self private key
+ * @param[in]	peerPublic	peer public key
+ * @param[out]	sharedSecret	the computed shared secret
+ */
+template <typename Curve>
+void X_computeSharedSecret(const X<Curve, lime::Xtype::privateKey> &secret, const X<Curve, lime::Xtype::publicKey> &peerPublic, X<Curve, lime::Xtype::sharedSecret> &sharedSecret);
+
+/**
+ * @brief Convert a signature key into a key exchange one
+ *
+ * @param[in]	DSAKey	the signature key to convert
+ * @param[out]	XKey	the converted key exchange key
+ */
+template <typename Curve>
+void X_fromDSA(const DSA<Curve, lime::DSAtype::privateKey> &DSAKey, X<Curve, lime::Xtype::privateKey> &XKey);
+template <typename Curve>
+void X_fromDSA(const DSA<Curve, lime::DSAtype::publicKey> &DSAKey, X<Curve, lime::Xtype::publicKey> &XKey);
+
+/**
+ * @brief Verify the signature of a key exchange public key
+ *
+ * @param[in]	publicKey	signer public key
+ * @param[in]	message		the signed key exchange public key
+ * @param[in]	signature	the signature to verify
+ *
+ * @return true if the signature is valid
+ */
+template <typename Curve>
+bool DSA_verify(const DSA<Curve, lime::DSAtype::publicKey> &publicKey, const X<Curve, lime::Xtype::publicKey> &message, const DSA<Curve, lime::DSAtype::signature> &signature);
+
 /*************************************************************************************************/
 /********************** Template Instanciation ***************************************************/
 /*************************************************************************************************/
-/* this templates are instanciated once in the lime_crypto_primitives.cpp file, explicitly tell anyone including this header that there is no need to re-instanciate them */
+/* this templates are instanciated once in the lime_crypto_primitives.cpp or crypto backend file, explicitly tell anyone including this header that there is no need to re-instanciate them */
 extern template void HMAC_KDF<SHA512, std::vector<uint8_t>>(const std::vector<uint8_t> &salt, const std::vector<uint8_t> &ikm, const std::vector<uint8_t> &info, uint8_t *output, size_t outputSize);
 extern template void HMAC_KDF<SHA512, std::string>(const std::vector<uint8_t> &salt, const std::vector<uint8_t> &ikm, const std::string &info, uint8_t *output, size_t outputSize);
 extern template void HMAC_KDF<SHA512, std::vector<uint8_t>>(const uint8_t *const salt, const size_t saltSize, const uint8_t *const ikm, const size_t ikmSize, const std::vector<uint8_t> &info, uint8_t *output, size_t outputSize);
@@ -416,6 +612,11 @@ extern template void HMAC_KDF<SHA512, std::string>(const uint8_t *const salt, co
 #ifdef EC25519_ENABLED
 	extern template std::shared_ptr<keyExchange<C255>> make_keyExchange();
 	extern template std::shared_ptr<Signature<C255>> make_Signature();
+	extern template void X_generateKeyPair<C255>(Xpair<C255> &keyPair, RNG &rng);
+	extern template void X_computeSharedSecret<C255>(const X<C255, lime::Xtype::privateKey> &secret, const X<C255, lime::Xtype::publicKey> &peerPublic, X<C255, lime::Xtype::sharedSecret> &sharedSecret);
+	extern template void X_fromDSA<C255>(const DSA<C255, lime::DSAtype::privateKey> &DSAKey, X<C255, lime::Xtype::privateKey> &XKey);
+	extern template void X_fromDSA<C255>(const DSA<C255, lime::DSAtype::publicKey> &DSAKey, X<C255, lime::Xtype::publicKey> &XKey);
+	extern template bool DSA_verify<C255>(const DSA<C255, lime::DSAtype::publicKey> &publicKey, const X<C255, lime::Xtype::publicKey> &message, const DSA<C255, lime::DSAtype::signature> &signature);
 	extern template class X<C255, lime::Xtype::publicKey>;
 	extern template class X<C255, lime::Xtype::privateKey>;
 	extern template class X<C255, lime::Xtype::sharedSecret>;
@@ -429,6 +630,11 @@ extern template void HMAC_KDF<SHA512, std::string>(const uint8_t *const salt, co
 #ifdef EC448_ENABLED
 	extern template std::shared_ptr<keyExchange<C448>> make_keyExchange();
 	extern template std::shared_ptr<Signature<C448>> make_Signature();
+	extern template void X_generateKeyPair<C448>(Xpair<C448> &keyPair, RNG &rng);
+	extern template void X_computeSharedSecret<C448>(const X<C448, lime::Xtype::privateKey> &secret, const X<C448, lime::Xtype::publicKey> &peerPublic, X<C448, lime::Xtype::sharedSecret> &sharedSecret);
+	extern template void X_fromDSA<C448>(const DSA<C448, lime::DSAtype::privateKey> &DSAKey, X<C448, lime::Xtype::privateKey> &XKey);
+	extern template void X_fromDSA<C448>(const DSA<C448, lime::DSAtype::publicKey> &DSAKey, X<C448, lime::Xtype::publicKey> &XKey);
+	extern template bool DSA_verify<C448>(const DSA<C448, lime::DSAtype::publicKey> &publicKey, const X<C448, lime::Xtype::publicKey> &message, const DSA<C448, lime::DSAtype::signature> &signature);
 	extern template class X<C448, lime::Xtype::publicKey>;
 	extern template class X<C448, lime::Xtype::privateKey>;
 	extern template class X<C448, lime::Xtype::sharedSecret>;
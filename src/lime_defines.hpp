@@ -64,6 +64,9 @@ namespace settings {
 	/// AEAD generates tag 16 bytes long
 	constexpr size_t DRMessageAuthTagSize=16;
 
+	/// sender key chains are identified by a random 16 bytes id
+	constexpr size_t senderKeyChainIdSize=16;
+
 /******************************************************************************/
 /*                                                                            */
 /* Local Storage related definitions                                          */
@@ -71,12 +74,24 @@ namespace settings {
 /******************************************************************************/
 	/** define a version number for the DB schema as an integer 0xMMmmpp
 	 *
-	 * current version is 0.0.1
+	 * current version is 0.0.6
+	 * - 0.0.2: DR sessions mutable state stored in a single record, indexes on DR sessions and skipped message keys lookups
+	 * - 0.0.3: skipped message keys stored by chunks of consecutive indexes
+	 * - 0.0.4: sender key chains
+	 * - 0.0.5: DR sessions row version, sessions snapshot keys
+	 * - 0.0.6: DR sessions peer current public key, to find the session matching a message header
+	 */
+	constexpr int DBuserVersion=0x000006;
+	/** number of consecutive skipped message keys stored in one DR_MSk_MK record, part of the storage format: do not modify
+	 * the record holds a mask with one bit per key so it cannot exceed 31
 	 */
-	constexpr int DBuserVersion=0x000001;
+	constexpr uint16_t DBMSkChunkSize = 16;
 	constexpr uint16_t DBInactiveUserBit = 0x0100;
 	constexpr uint16_t DBCurveIdByte = 0x00FF;
 	constexpr uint8_t DBInvalidIk = 0x00;
+	/// sessions snapshot file starts with this magic string followed by the format version byte
+	const std::string sessionsSnapshotMagic{"LIMESNAP"};
+	constexpr uint8_t sessionsSnapshotVersion = 0x01;
 
 /******************************************************************************/
 /*                                                                            */
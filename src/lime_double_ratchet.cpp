@@ -21,6 +21,9 @@
 #include "lime_double_ratchet.hpp"
 #include "lime_double_ratchet_protocol.hpp"
 #include "lime_localStorage.hpp"
+#include "lime_threadpool.hpp"
+#include "lime_metrics.hpp"
+#include "lime_keyPairPool.hpp"
 
 #include "bctoolbox/exception.hh"
 
@@ -75,15 +78,38 @@ namespace lime {
 	 * @param[out]		MK	Message Key(32 bytes) and IV(16 bytes) computed from HMAC_SHA512 keyed with CK
 	 */
 	static void KDF_CK(DRChainKey &CK, DRMKey &MK) noexcept {
-		// derive MK and IV from CK and constant
-		HMAC<SHA512>(CK.data(), CK.size(), hkdf_mk_info.data(), hkdf_mk_info.size(), MK.data(), MK.size());
-
 		// use temporary buffer, not likely that output and key could be the same buffer
 		DRChainKey tmp;
-		HMAC<SHA512>(CK.data(), CK.size(), hkdf_ck_info.data(), hkdf_ck_info.size(), tmp.data(), tmp.size());
+		// derive MK and IV from CK and constant, and the next CK: both are keyed with the current CK and are independent
+		const std::array<HMACJob, 2> jobs{{
+			HMACJob{CK.data(), CK.size(), hkdf_mk_info.data(), hkdf_mk_info.size(), MK.data(), MK.size()},
+			HMACJob{CK.data(), CK.size(), hkdf_ck_info.data(), hkdf_ck_info.size(), tmp.data(), tmp.size()}}};
+		HMAC_batch<SHA512>(jobs.data(), jobs.size());
 		CK = tmp;
 	}
 
+	/**
+	 * @brief Key Derivation Function used in Symmetric key ratchet chain, on several independent chains at once
+	 *
+	 * Same as KDF_CK, but all the derivations are given in one batch to the HMAC implementation
+	 *
+	 * @param[in,out]	CKs	Chain keys: input/output buffers used as key to compute MK and then next CK, they must all be different
+	 * @param[out]		MKs	Message Keys(32 bytes) and IV(16 bytes) computed from the matching CK, sized by the caller
+	 */
+	static void KDF_CK_batch(const std::vector<DRChainKey *> &CKs, std::vector<DRMKey> &MKs) {
+		std::vector<DRChainKey> tmp(CKs.size());
+		std::vector<HMACJob> jobs{};
+		jobs.reserve(2*CKs.size());
+		for (size_t i=0; i<CKs.size(); i++) {
+			jobs.push_back(HMACJob{CKs[i]->data(), CKs[i]->size(), hkdf_mk_info.data(), hkdf_mk_info.size(), MKs[i].data(), MKs[i].size()});
+			jobs.push_back(HMACJob{CKs[i]->data(), CKs[i]->size(), hkdf_ck_info.data(), hkdf_ck_info.size(), tmp[i].data(), tmp[i].size()});
+		}
+		HMAC_batch<SHA512>(jobs.data(), jobs.size());
+		for (size_t i=0; i<CKs.size(); i++) {
+			*(CKs[i]) = tmp[i];
+		}
+	}
+
 	/**
 	 * @brief Decrypt as described is spec section 3.1
 	 *
@@ -120,6 +146,25 @@ namespace lime {
 					plaintext.data());
 	}
 
+	/** @brief nesting level of the associated data scratch buffers: message level AD is extended in a ratchet level one */
+	enum class ADScratch : uint8_t {message=0, ratchet=1};
+
+	/**
+	 * @brief Per thread scratch buffers used to assemble associated data on the encrypt/decrypt path
+	 *
+	 * They keep their capacity between calls so once warmed up, building the AD does not reach the allocator.
+	 * The AD assembled at message level (encrypt/decryptMessage) is given to ratchetEncrypt/Decrypt which extends it
+	 * in its own buffer, so each level gets a distinct one.
+	 *
+	 * @param[in]	level	the nesting level requesting the buffer
+	 *
+	 * @return a reference to the calling thread buffer for this level, its content is left from previous use
+	 */
+	static std::vector<uint8_t> &AD_scratch(const ADScratch level) {
+		thread_local std::array<std::vector<uint8_t>, 2> buffers{};
+		return buffers[static_cast<size_t>(level)];
+	}
+
 	/****************************************************************************/
 	/* DR member functions                                                      */
 	/****************************************************************************/
@@ -147,31 +192,23 @@ namespace lime {
 	 */
 	template <typename Curve>
 	DR<Curve>::DR(std::shared_ptr<lime::Db> localStorage, const DRChainKey &SK, const SharedADBuffer &AD, const X<Curve, lime::Xtype::publicKey> &peerPublicKey, long int peerDid, const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, long int selfDid, const std::vector<uint8_t> &X3DH_initMessage, std::shared_ptr<RNG> RNG_context)
-	:m_DHr{peerPublicKey},m_DHr_valid{true}, m_DHs{},m_RK(SK),m_CKs{},m_CKr{},m_Ns(0),m_Nr(0),m_PN(0),m_sharedAD(AD),m_mkskipped{},
-	m_RNG{RNG_context},m_dbSessionId{0},m_usedNr{0},m_usedDHid{0}, m_usedOPkId{0}, m_localStorage{localStorage},m_dirty{DRSessionDbStatus::dirty},m_peerDid{peerDid},m_peerDeviceId{},
-	m_peerIk{},m_db_Uid{selfDid}, m_active_status{true}, m_X3DH_initMessage{X3DH_initMessage}
+	:m_DHr{peerPublicKey}, m_DHs{},m_RK(SK),m_CKs{},m_CKr{},m_sharedAD(AD),m_mkskipped{},m_mkskipped_index{},
+	m_RNG{RNG_context}, m_localStorage{localStorage}, m_X3DH_initMessage{X3DH_initMessage}, m_init{nullptr}, m_dbSessionId{0}, m_usedDHid{0}, m_peerDid{peerDid}, m_db_Uid{selfDid}, m_dbVersion{0},
+	m_Ns(0),m_Nr(0),m_PN(0), m_usedNr{0}, m_dirty{DRSessionDbStatus::dirty}, m_DHr_valid{true}, m_active_status{true}
 	{
-		// generate a new self key pair
-		auto DH = make_keyExchange<Curve>();
-		DH->createKeyPair(m_RNG);
-
-		// copy the peer public key into ECDH context
-		DH->set_peerPublic(peerPublicKey);
-
-		// get self key pair from context
-		m_DHs.publicKey() = DH->get_selfPublic();
-		m_DHs.privateKey() = DH->get_secret();
+		// get a new self key pair, directly in the session
+		m_localStorage->m_keyPairPools->get<Curve>().draw(m_DHs, *m_RNG);
 
 		// compute shared secret
-		DH->computeSharedSecret();
+		X<Curve, lime::Xtype::sharedSecret> DH_out;
+		X_computeSharedSecret<Curve>(m_DHs.privateKey(), m_DHr, DH_out);
 
 		// derive the root key
-		KDF_RK<Curve>(m_RK, m_CKs, DH->get_sharedSecret());
+		KDF_RK<Curve>(m_RK, m_CKs, DH_out);
 
 		// If we have no peerDid, copy peer DeviceId and Ik in the session so we can use them to create the peer device in local storage when first saving the session
 		if (peerDid == 0) {
-			m_peerDeviceId = peerDeviceId;
-			m_peerIk = peerIk;
+			m_init = std::unique_ptr<DRSessionInit<Curve>>(new DRSessionInit<Curve>(peerDeviceId, peerIk, 0));
 		}
 	}
 
@@ -191,14 +228,16 @@ namespace lime {
 	 */
 	template <typename Curve>
 	DR<Curve>::DR(std::shared_ptr<lime::Db> localStorage, const DRChainKey &SK, const SharedADBuffer &AD, const Xpair<Curve> &selfKeyPair, long int peerDid, const std::string &peerDeviceId, const uint32_t OPk_id, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, long int selfDid, std::shared_ptr<RNG> RNG_context)
-	:m_DHr{},m_DHr_valid{false},m_DHs{selfKeyPair},m_RK(SK),m_CKs{},m_CKr{},m_Ns(0),m_Nr(0),m_PN(0),m_sharedAD(AD),m_mkskipped{},
-	m_RNG{RNG_context},m_dbSessionId{0},m_usedNr{0},m_usedDHid{0}, m_usedOPkId{OPk_id}, m_localStorage{localStorage},m_dirty{DRSessionDbStatus::dirty},m_peerDid{peerDid},m_peerDeviceId{},
-	m_peerIk{},m_db_Uid{selfDid}, m_active_status{true}, m_X3DH_initMessage{}
+	:m_DHr{},m_DHs{selfKeyPair},m_RK(SK),m_CKs{},m_CKr{},m_sharedAD(AD),m_mkskipped{},m_mkskipped_index{},
+	m_RNG{RNG_context}, m_localStorage{localStorage}, m_X3DH_initMessage{}, m_init{nullptr}, m_dbSessionId{0}, m_usedDHid{0}, m_peerDid{peerDid}, m_db_Uid{selfDid}, m_dbVersion{0},
+	m_Ns(0),m_Nr(0),m_PN(0), m_usedNr{0}, m_dirty{DRSessionDbStatus::dirty}, m_DHr_valid{false}, m_active_status{true}
 	{
 		// If we have no peerDid, copy peer DeviceId and Ik in the session so we can use them to create the peer device in local storage when first saving the session
+		// same for the OPk id to delete it from local storage
 		if (peerDid == 0) {
-			m_peerDeviceId = peerDeviceId;
-			m_peerIk = peerIk;
+			m_init = std::unique_ptr<DRSessionInit<Curve>>(new DRSessionInit<Curve>(peerDeviceId, peerIk, OPk_id));
+		} else if (OPk_id != 0) {
+			m_init = std::unique_ptr<DRSessionInit<Curve>>(new DRSessionInit<Curve>(std::string{}, DSA<Curve, lime::DSAtype::publicKey>{}, OPk_id));
 		}
 	}
 
@@ -214,16 +253,90 @@ namespace lime {
 	 */
 	template <typename Curve>
 	DR<Curve>::DR(std::shared_ptr<lime::Db> localStorage, long sessionId, std::shared_ptr<RNG> RNG_context)
-	:m_DHr{},m_DHr_valid{true},m_DHs{},m_RK{},m_CKs{},m_CKr{},m_Ns(0),m_Nr(0),m_PN(0),m_sharedAD{},m_mkskipped{},
-	m_RNG{RNG_context},m_dbSessionId{sessionId},m_usedNr{0},m_usedDHid{0}, m_usedOPkId{0}, m_localStorage{localStorage},m_dirty{DRSessionDbStatus::clean},m_peerDid{0},m_peerDeviceId{},
-	m_peerIk{},m_db_Uid{0},	m_active_status{false}, m_X3DH_initMessage{}
+	:m_DHr{},m_DHs{},m_RK{},m_CKs{},m_CKr{},m_sharedAD{},m_mkskipped{},m_mkskipped_index{},
+	m_RNG{RNG_context}, m_localStorage{localStorage}, m_X3DH_initMessage{}, m_init{nullptr}, m_dbSessionId{sessionId}, m_usedDHid{0}, m_peerDid{0}, m_db_Uid{0}, m_dbVersion{0},
+	m_Ns(0),m_Nr(0),m_PN(0), m_usedNr{0}, m_dirty{DRSessionDbStatus::clean}, m_DHr_valid{true}, m_active_status{false}
 	{
 		session_load();
 	}
 
+	/**
+	 * @brief Create a new DR session from its local storage row, already fetched by the caller
+	 *
+	 * Used to load many sessions with one query instead of one per session, these sessions are all active.
+	 *
+	 * @param[in]	localStorage		Local storage accessor to save DR session and perform mkskipped lookup
+	 * @param[in]	sessionId		row id in the database identifying the session
+	 * @param[in]	peerDid			DR_sessions.Did
+	 * @param[in]	selfDid			DR_sessions.Uid
+	 * @param[in]	state			DR_sessions.state
+	 * @param[in]	AD			DR_sessions.AD
+	 * @param[in]	X3DH_initMessage	DR_sessions.X3DHInit, empty when NULL
+	 * @param[in]	hasSkippedKeys		when true, the index of the skipped message keys of this session is loaded from local storage
+	 * @param[in]	version			DR_sessions.version
+	 * @param[in]	RNG_context		A Random Number Generator context used for any rndom generation needed by this session
+	 */
+	template <typename Curve>
+	DR<Curve>::DR(std::shared_ptr<lime::Db> localStorage, long sessionId, long int peerDid, long int selfDid, const DRStateRecord<Curve> &state, const SharedADBuffer &AD, std::vector<uint8_t> &&X3DH_initMessage, const bool hasSkippedKeys, const uint32_t version, std::shared_ptr<RNG> RNG_context)
+	:m_DHr{},m_DHs{},m_RK{},m_CKs{},m_CKr{},m_sharedAD(AD),m_mkskipped{},m_mkskipped_index{},
+	m_RNG{RNG_context}, m_localStorage{localStorage}, m_X3DH_initMessage{std::move(X3DH_initMessage)}, m_init{nullptr}, m_dbSessionId{sessionId}, m_usedDHid{0}, m_peerDid{peerDid}, m_db_Uid{selfDid}, m_dbVersion{version},
+	m_Ns(0),m_Nr(0),m_PN(0), m_usedNr{0}, m_dirty{DRSessionDbStatus::clean}, m_DHr_valid{true}, m_active_status{true}
+	{
+		state_deserialize(state);
+		if (hasSkippedKeys) {
+			mkskipped_index_load();
+		}
+	}
+
 	template <typename Curve>
 	DR<Curve>::~DR() { }
 
+	/**
+	 * @brief Estimate the memory used by this session: the object itself and its dynamically allocated members
+	 *
+	 * Memory allocator overhead is not taken into account
+	 *
+	 * @return the size in bytes
+	 */
+	template <typename Curve>
+	size_t DR<Curve>::memoryFootprint(void) const {
+		size_t footprint = sizeof(DR<Curve>) + m_X3DH_initMessage.capacity();
+		if (m_init) {
+			footprint += sizeof(DRSessionInit<Curve>) + m_init->peerDeviceId.capacity();
+		}
+		for (const auto &chain : m_mkskipped) {
+			footprint += sizeof(chain) + chain.messageKeys.size()*(sizeof(std::uint16_t) + sizeof(DRMKey));
+		}
+		for (const auto &chainIndex : m_mkskipped_index) {
+			footprint += sizeof(chainIndex) + chainIndex.Nr.size()*sizeof(std::uint16_t);
+		}
+		return footprint;
+	}
+
+	/**
+	 * @brief Get what is needed to rebuild this session as the DR_sessions row constructor does
+	 *
+	 * Only an active session in sync with local storage can be rebuilt this way
+	 *
+	 * @param[out]	state			the mutable ratchet state record
+	 * @param[out]	AD			the session associated data
+	 * @param[out]	X3DH_initMessage	the X3DH init message still sent with each message, empty if there is none
+	 * @param[out]	hasSkippedKeys		true when the session holds skipped message keys in local storage
+	 *
+	 * @return false if the session is stale, not saved yet or modified since it was saved: the outputs are not set
+	 */
+	template <typename Curve>
+	bool DR<Curve>::get_snapshot(DRStateRecord<Curve> &state, SharedADBuffer &AD, std::vector<uint8_t> &X3DH_initMessage, bool &hasSkippedKeys) const {
+		if (m_dbSessionId == 0 || !m_active_status || m_dirty != DRSessionDbStatus::clean) {
+			return false;
+		}
+		state_serialize(state);
+		AD = m_sharedAD;
+		X3DH_initMessage = m_X3DH_initMessage;
+		hasSkippedKeys = !m_mkskipped_index.empty();
+		return true;
+	}
+
 	/**
 	 * @brief Derive chain keys until reaching the requested Id. Handling unordered messages
 	 *
@@ -243,6 +356,8 @@ namespace lime {
 			throw BCTBX_EXCEPTION << "DR Session is too far behind this message to derive requested amount of keys: "<<(until-m_Nr);
 		}
 
+		if (m_localStorage->m_metrics) m_localStorage->m_metrics->increment(lime::MetricsCounter::skippedKeyDerived, until-m_Nr);
+
 		// each call to this function is made with a different DHr
 		ReceiverKeyChain<Curve> newRChain{m_DHr};
 		m_mkskipped.push_back(newRChain);
@@ -273,28 +388,18 @@ namespace lime {
 		// this is our new DHr
 		m_DHr = headerDH;
 
-		// generate a new self key pair
-		auto DH = make_keyExchange<Curve>();
-
-		// copy the peer public key into ECDH context
-		DH->set_peerPublic(m_DHr);
-		DH->set_selfPublic(m_DHs.publicKey());
-		DH->set_secret(m_DHs.privateKey());
+		X<Curve, lime::Xtype::sharedSecret> DH_out;
 
 		//  Derive the new receiving chain key
-		DH->computeSharedSecret();
-		KDF_RK<Curve>(m_RK, m_CKr, DH->get_sharedSecret());
+		X_computeSharedSecret<Curve>(m_DHs.privateKey(), m_DHr, DH_out);
+		KDF_RK<Curve>(m_RK, m_CKr, DH_out);
 
-		// generate a new self key pair
-		DH->createKeyPair(m_RNG);
+		// get a new self key pair, directly in the session
+		m_localStorage->m_keyPairPools->get<Curve>().draw(m_DHs, *m_RNG);
 
 		//  Derive the new sending chain key
-		DH->computeSharedSecret();
-		KDF_RK<Curve>(m_RK, m_CKs, DH->get_sharedSecret());
-
-		// get self key pair from context
-		m_DHs.publicKey() = DH->get_selfPublic();
-		m_DHs.privateKey() = DH->get_secret();
+		X_computeSharedSecret<Curve>(m_DHs.privateKey(), m_DHr, DH_out);
+		KDF_RK<Curve>(m_RK, m_CKs, DH_out);
 
 		// modified the DR session, not in sync anymore with local storage
 		m_dirty = DRSessionDbStatus::dirty_ratchet;
@@ -311,46 +416,147 @@ namespace lime {
 	 * @param[in]	AD				Associated Data, this buffer shall hold: source GRUU<...> || recipient GRUU<...> || [ actual message AEAD auth tag OR recipient User Id]
 	 * @param[out]	ciphertext			buffer holding the header, cipher text and auth tag, shall contain the key and IV used to cipher the actual message, auth tag applies on AD || header
 	 * @param[in]	payloadDirectEncryption		A flag to set in message header: set when having payload in the DR message
+	 * @param[in]	saveSession			When false, the session is left dirty and caller is in charge of saving it(see sessions_save). Default is true
 	 */
 	template <typename Curve>
 	template <typename inputContainer> // input container can be a sBuffer (fixed size) holding a random seed or std::vector<uint8_t> holding the actual message
-	void DR<Curve>::ratchetEncrypt(const inputContainer &plaintext, std::vector<uint8_t> &&AD, std::vector<uint8_t> &ciphertext, const bool payloadDirectEncryption) {
+	void DR<Curve>::ratchetEncrypt(const inputContainer &plaintext, const std::vector<uint8_t> &AD, std::vector<uint8_t> &ciphertext, const bool payloadDirectEncryption, const bool saveSession) {
+		// the output size is known: get it in one allocation
+		ciphertext.resize(encryptedSize(plaintext.size()));
+		ratchetEncrypt(plaintext, AD, ciphertext.data(), payloadDirectEncryption, saveSession);
+	}
+
+	/**
+	 * @overload
+	 *
+	 * write the message in a buffer of at least encryptedSize(plaintext size) bytes
+	 */
+	template <typename Curve>
+	template <typename inputContainer>
+	void DR<Curve>::ratchetEncrypt(const inputContainer &plaintext, const std::vector<uint8_t> &AD, uint8_t *const ciphertext, const bool payloadDirectEncryption, const bool saveSession) {
 		m_dirty = DRSessionDbStatus::dirty_encrypt; // we're about to modify this session, it won't be in sync anymore with local storage
 		// chain key derivation(also compute message key)
 		DRMKey MK;
 		KDF_CK(m_CKs, MK);
 
-		// build header string in the ciphertext buffer
-		double_ratchet_protocol::buildMessage_header(ciphertext, m_Ns, m_PN, m_DHs.publicKey(), m_X3DH_initMessage, payloadDirectEncryption);
-		auto headerSize = ciphertext.size(); // cipher text holds only the DR header for now
-
-		// increment current sending chain message index
-		m_Ns++;
-
 		// build AD: given AD || sharedAD stored in session || header (see DR spec section 3.4)
-		AD.insert(AD.end(), m_sharedAD.cbegin(), m_sharedAD.cend());
-		AD.insert(AD.end(), ciphertext.cbegin(), ciphertext.cend()); // cipher text holds header only for now
-
-		// data will be written directly in the underlying structure by C library, so set size to the actual one
-		// header size + cipher text size + auth tag size
-		ciphertext.resize(ciphertext.size()+plaintext.size()+lime::settings::DRMessageAuthTagSize);
+		auto &DRAD = AD_scratch(ADScratch::ratchet);
+		DRAD.assign(AD.cbegin(), AD.cend());
+		auto headerSize = ratchetEncrypt_header(ciphertext, payloadDirectEncryption, DRAD);
 
 		AEAD_encrypt<AES256GCM>(MK.data(), lime::settings::DRMessageKeySize, // MK buffer also hold the IV
 				MK.data()+lime::settings::DRMessageKeySize, lime::settings::DRMessageIVSize, // IV is stored in the same buffer as key, after it
 				plaintext.data(), plaintext.size(),
-				AD.data(), AD.size(),
-				ciphertext.data()+headerSize+plaintext.size(), lime::settings::DRMessageAuthTagSize, // directly store tag after cipher text in the output buffer
-				ciphertext.data()+headerSize);
+				DRAD.data(), DRAD.size(),
+				ciphertext+headerSize+plaintext.size(), lime::settings::DRMessageAuthTagSize, // directly store tag after cipher text in the output buffer
+				ciphertext+headerSize);
+
+		if (saveSession) {
+			if (session_save() == true) {
+				m_dirty = DRSessionDbStatus::clean; // this session and local storage are back in sync
+			}
+		}
+	}
 
+
+	/**
+	 * @brief Size of the DR message ratchetEncrypt produces from a given input size
+	 *
+	 * header(with the X3DH init message until the peer answers) || cipher text || auth tag
+	 *
+	 * @param[in]	plaintextSize	size of the input to be encrypted
+	 *
+	 * @return the exact DR message size
+	 */
+	template <typename Curve>
+	size_t DR<Curve>::encryptedSize(const size_t plaintextSize) const noexcept {
+		return double_ratchet_protocol::headerSize<Curve>() + m_X3DH_initMessage.size() + plaintextSize + lime::settings::DRMessageAuthTagSize;
+	}
+
+	/**
+	 * @brief Build the message header for ratchetEncrypt and step the sending chain index
+	 *
+	 * @param[out]		ciphertext			gets the header, must be large enough for the whole message: header || cipher text || auth tag
+	 * @param[in]		payloadDirectEncryption		A flag to set in message header: set when having payload in the DR message
+	 * @param[in,out]	DRAD				holds the given associated data, the shared AD and the header are appended to it
+	 *
+	 * @return the header size
+	 */
+	template <typename Curve>
+	size_t DR<Curve>::ratchetEncrypt_header(uint8_t *const ciphertext, const bool payloadDirectEncryption, std::vector<uint8_t> &DRAD) {
+		// build header string in the ciphertext buffer
+		auto headerSize = double_ratchet_protocol::buildMessage_header<Curve>(ciphertext, m_Ns, m_PN, m_DHs.publicKey(), m_X3DH_initMessage, payloadDirectEncryption);
+
+		// increment current sending chain message index
+		m_Ns++;
 		if (m_Ns >= lime::settings::maxSendingChain) { // if we reached maximum encryption wuthout DH ratchet step, session becomes inactive
 			m_active_status = false;
 		}
 
-		if (session_save() == true) {
-			m_dirty = DRSessionDbStatus::clean; // this session and local storage are back in sync
-		}
+		// AD is given AD || sharedAD stored in session || header (see DR spec section 3.4)
+		DRAD.insert(DRAD.end(), m_sharedAD.cbegin(), m_sharedAD.cend());
+		DRAD.insert(DRAD.end(), ciphertext, ciphertext+headerSize); // cipher text holds header only for now
+		return headerSize;
 	}
 
+	/**
+	 * @brief Encrypt the same input to several recipients with their double ratchet sessions
+	 *
+	 * Same as calling ratchetEncrypt on each recipient session without saving it, but the chain keys
+	 * derivations and the encryptions are each performed in one batch.
+	 *
+	 * @param[in,out]	recipients			recipients device id(gruu) and DR Session, get the DR message. The sessions must all be different
+	 * @param[in]		plaintext			the input to be encrypted, may actually be a 32 bytes buffer holding the seed used to generate key+IV for a AES-GCM encryption to the actual message
+	 * @param[in]		AD				common part of the associated data, the recipient device id is appended to it
+	 * @param[in]		payloadDirectEncryption		A flag to set in message header: set when having payload in the DR message
+	 * @param[out]		arena				when not null, the DR messages are written there at the recipients DRmessageOffset instead of their DRmessage
+	 */
+	template <typename Curve>
+	template <typename inputContainer>
+	void DR<Curve>::ratchetEncrypt_batch(std::vector<RecipientInfos<Curve>> &recipients, const inputContainer &plaintext, const std::vector<uint8_t> &AD, const bool payloadDirectEncryption, uint8_t *const arena) {
+		// step all the sending chains in one derivation batch
+		std::vector<DRChainKey *> CKs{};
+		CKs.reserve(recipients.size());
+		for (auto &recipient : recipients) {
+			recipient.DRSession->m_dirty = DRSessionDbStatus::dirty_encrypt; // we're about to modify this session, it won't be in sync anymore with local storage
+			CKs.push_back(&(recipient.DRSession->m_CKs));
+		}
+		std::vector<DRMKey> MKs(recipients.size());
+		KDF_CK_batch(CKs, MKs);
+
+		// build the headers and the associated data: recipient AD || sharedAD || header, all of them are stored one after the other in the same buffer
+		auto &DRADs = AD_scratch(ADScratch::ratchet);
+		DRADs.clear();
+		std::vector<size_t> headerSizes(recipients.size());
+		std::vector<size_t> ADOffsets(recipients.size()+1);
+		std::vector<uint8_t *> ciphertexts(recipients.size());
+		for (size_t i=0; i<recipients.size(); i++) {
+			if (arena != nullptr) {
+				ciphertexts[i] = arena + recipients[i].DRmessageOffset;
+			} else {
+				recipients[i].DRmessage.resize(recipients[i].DRSession->encryptedSize(plaintext.size()));
+				ciphertexts[i] = recipients[i].DRmessage.data();
+			}
+			ADOffsets[i] = DRADs.size();
+			DRADs.insert(DRADs.end(), AD.cbegin(), AD.cend());
+			DRADs.insert(DRADs.end(), recipients[i].deviceId.cbegin(), recipients[i].deviceId.cend()); //insert recipient device id(gruu)
+			headerSizes[i] = recipients[i].DRSession->ratchetEncrypt_header(ciphertexts[i], payloadDirectEncryption, DRADs);
+		}
+		ADOffsets.back() = DRADs.size();
+
+		// the AD buffer is complete, it won't move anymore: encrypt all the messages in one batch
+		std::vector<AEADJob> jobs{};
+		jobs.reserve(recipients.size());
+		for (size_t i=0; i<recipients.size(); i++) {
+			jobs.push_back(AEADJob{MKs[i].data(), lime::settings::DRMessageKeySize, // MK buffer also hold the IV
+				MKs[i].data()+lime::settings::DRMessageKeySize, lime::settings::DRMessageIVSize, // IV is stored in the same buffer as key, after it
+				plaintext.data(), plaintext.size(),
+				DRADs.data()+ADOffsets[i], ADOffsets[i+1]-ADOffsets[i],
+				ciphertexts[i]+headerSizes[i]+plaintext.size(), lime::settings::DRMessageAuthTagSize, // directly store tag after cipher text in the output buffer
+				ciphertexts[i]+headerSizes[i]});
+		}
+		AEAD_encrypt_batch<AES256GCM>(jobs.data(), jobs.size());
+	}
 
 	/**
 	 * @brief Decrypt Double Ratchet message
@@ -381,26 +587,32 @@ namespace lime {
 		}
 
 		// build an Associated Data buffer: given AD || shared AD stored in session || header (as in DR spec section 3.4)
-		std::vector<uint8_t> DRAD{AD}; // copy given AD
+		auto &DRAD = AD_scratch(ADScratch::ratchet);
+		DRAD.assign(AD.cbegin(), AD.cend());
 		DRAD.insert(DRAD.end(), m_sharedAD.cbegin(), m_sharedAD.cend());
 		DRAD.insert(DRAD.end(), ciphertext.cbegin(), ciphertext.cbegin()+header.size());
 
 		DRMKey MK;
 		int maxAllowedDerivation = lime::settings::maxMessageSkip;
-		m_dirty = DRSessionDbStatus::dirty_decrypt; // we're about to modify the DR session, it will not be in sync anymore with local storage
 		if (!m_DHr_valid) { // it's the first message arriving after the initialisation of the chain in receiver mode, we have no existing history in this chain
+			m_dirty = DRSessionDbStatus::dirty_decrypt; // we're about to modify the DR session, it will not be in sync anymore with local storage
 			DHRatchet(header.DHs()); // just perform the DH ratchet step
 			m_DHr_valid=true;
 		} else {
-			// check stored message keys
-			if (trySkippedMessageKeys(header.Ns(), header.DHs(), MK)) {
+			// check stored message keys, a late message whose key is not there anymore throws before the session is modified
+			const bool skippedKeyFound = trySkippedMessageKeys(header.Ns(), header.DHs(), MK);
+			if (!skippedKeyFound && m_DHr==header.DHs() && header.Ns()<m_Nr) { // already used key of the current chain: do not derive the next ones
+				throw BCTBX_EXCEPTION << "DR Session got message "<<header.Ns()<<" already received on its current receiving chain";
+			}
+			m_dirty = DRSessionDbStatus::dirty_decrypt; // we're about to modify the DR session, it will not be in sync anymore with local storage
+			if (skippedKeyFound) {
 				if (decrypt(MK, ciphertext, header.size(), DRAD, plaintext) == true) {
 					//Decrypt went well, we must save the session to DB
 					if (session_save() == true) {
 						m_dirty = DRSessionDbStatus::clean; // this session and local storage are back in sync
 						m_usedDHid=0; // reset variables used to tell the local storage to delete them
 						m_usedNr=0;
-						m_X3DH_initMessage.clear(); // just in case we had a valid X3DH init in session, erase it as it's not needed after the first message received from peer
+						std::vector<uint8_t>{}.swap(m_X3DH_initMessage); // just in case we had a valid X3DH init in session, erase it as it's not needed after the first message received from peer
 					}
 					return true;
 				} else {
@@ -428,7 +640,7 @@ namespace lime {
 			if (session_save() == true) {
 				m_dirty = DRSessionDbStatus::clean; // this session and local storage are back in sync
 				m_mkskipped.clear(); // potential skipped message keys are now stored in DB, clear the local storage
-				m_X3DH_initMessage.clear(); // just in case we had a valid X3DH init in session, erase it as it's not needed after the first message received from peer
+				std::vector<uint8_t>{}.swap(m_X3DH_initMessage); // just in case we had a valid X3DH init in session, erase it as it's not needed after the first message received from peer
 			}
 			return true;
 		} else {
@@ -439,35 +651,120 @@ namespace lime {
 	/* template instanciations for Curve25519 and Curve448 */
 #ifdef EC25519_ENABLED
 	extern template bool DR<C255>::session_load();
-	extern template bool DR<C255>::session_save();
+	extern template bool DR<C255>::session_save(bool commit);
+	extern template void DR<C255>::sessions_save(const std::vector<std::shared_ptr<DR<C255>>> &sessions);
 	extern template bool DR<C255>::trySkippedMessageKeys(const uint16_t Nr, const X<C255, lime::Xtype::publicKey> &DHr, DRMKey &MK);
+	extern template void DR<C255>::mkskipped_index_load();
+	extern template void DR<C255>::state_serialize(DRStateRecord<C255> &record) const;
+	extern template void DR<C255>::state_deserialize(const DRStateRecord<C255> &record);
 	template class DR<C255>;
+	template void DR<C255>::ratchetEncrypt<std::vector<uint8_t>>(const std::vector<uint8_t> &plaintext, const std::vector<uint8_t> &AD, std::vector<uint8_t> &ciphertext, const bool payloadDirectEncryption, const bool saveSession);
+	template bool DR<C255>::ratchetDecrypt<std::vector<uint8_t>>(const std::vector<uint8_t> &cipherText, const std::vector<uint8_t> &AD, std::vector<uint8_t> &plaintext, const bool payloadDirectEncryption);
 #endif
 
 #ifdef EC448_ENABLED
 	extern template bool DR<C448>::session_load();
-	extern template bool DR<C448>::session_save();
+	extern template bool DR<C448>::session_save(bool commit);
+	extern template void DR<C448>::sessions_save(const std::vector<std::shared_ptr<DR<C448>>> &sessions);
 	extern template bool DR<C448>::trySkippedMessageKeys(const uint16_t Nr, const X<C448, lime::Xtype::publicKey> &DHr, DRMKey &MK);
+	extern template void DR<C448>::mkskipped_index_load();
+	extern template void DR<C448>::state_serialize(DRStateRecord<C448> &record) const;
+	extern template void DR<C448>::state_deserialize(const DRStateRecord<C448> &record);
 	template class DR<C448>;
+	template void DR<C448>::ratchetEncrypt<std::vector<uint8_t>>(const std::vector<uint8_t> &plaintext, const std::vector<uint8_t> &AD, std::vector<uint8_t> &ciphertext, const bool payloadDirectEncryption, const bool saveSession);
+	template bool DR<C448>::ratchetDecrypt<std::vector<uint8_t>>(const std::vector<uint8_t> &cipherText, const std::vector<uint8_t> &AD, std::vector<uint8_t> &plaintext, const bool payloadDirectEncryption);
 #endif
 	/**
-	 * @brief Encrypt a message to all recipients, identified by their device id
+	 * @brief Derive the cipher message key and IV from the random seed sent in the DR message
 	 *
-	 *	The plaintext is first encrypted by one randomly generated key using aes-gcm
-	 *	The key and IV are then encrypted with DR Session specific to each device
+	 * expansion of randomSeed to 48 bytes: 32 bytes random key + 16 bytes nonce, use HKDF with empty salt
 	 *
-	 * @param[in,out]	recipients	vector of recipients device id(gruu) and linked DR Session, DR Session are modified by the encryption\n
-	 *					The recipients struct also hold after encryption the double ratchet message targeted to that particular recipient
-	 * @param[in]		plaintext	data to be encrypted
-	 * @param[in]		recipientUserId	the recipient ID, not specific to a device(could be a sip-uri) or a user(could be a group sip-uri)
-	 * @param[in]		sourceDeviceId	the Id of sender device(gruu)
-	 * @param[out]		cipherMessage	message encrypted with a random generated key(and IV). May be an empty buffer depending on encryptionPolicy, recipients and plaintext characteristics
-	 * @param[in]		encryptionPolicy	select how to manage the encryption: direct use of Double Ratchet message or encrypt in the cipher message and use the DR message to share the cipher message key\n
-	 * 						default is optimized output size mode.
+	 * @param[in]	randomSeed	the seed
+	 * @param[out]	randomKey	key<DRMessageKeySize bytes> || IV<DRMessageIVSize bytes>
 	 */
-	template <typename Curve>
-	void encryptMessage(std::vector<RecipientInfos<Curve>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy) {
-		// Shall we set the payload in the DR message or in a separate cupher message buffer?
+	static void cipherMessage_key(const lime::sBuffer<lime::settings::DRrandomSeedSize> &randomSeed, lime::sBuffer<lime::settings::DRMessageKeySize+lime::settings::DRMessageIVSize> &randomKey) {
+		std::vector<uint8_t> emptySalt;
+		emptySalt.clear(); //just to be sure
+		HMAC_KDF<SHA512>(emptySalt.data(), emptySalt.size(), randomSeed.data(), randomSeed.size(), lime::settings::hkdf_randomSeed_info, randomKey.data(), randomKey.size());
+	}
+
+	/**
+	 * @brief Encrypt the payload to all recipients with their DR session and save the sessions
+	 *
+	 * @param[in,out]	recipients	recipients device id(gruu) and DR Session, get the DR message
+	 * @param[in]		payload		plaintext or random seed to be encrypted in the DR messages
+	 * @param[in]		AD		common part of the associated data, the recipient device id is appended to it
+	 * @param[in]		payloadDirectEncryption	true when payload is the plaintext
+	 * @param[in]		threadPool	if not null and there are enough recipients, the per recipient encryptions are spread on this pool threads
+	 * @param[out]		arena		when not null, the DR messages are written there at the recipients DRmessageOffset instead of their DRmessage
+	 */
+	template <typename Curve, typename inputContainer>
+	static void encryptRecipients(std::vector<RecipientInfos<Curve>>& recipients, const inputContainer &payload, const std::vector<uint8_t> &AD, const bool payloadDirectEncryption, std::shared_ptr<lime::ThreadPool> threadPool, uint8_t *const arena=nullptr) {
+		if (threadPool != nullptr && threadPool->size()>0 && recipients.size() >= lime::settings::parallelEncryption_minRecipients) {
+			// each recipient has its own DR session and output buffer: the encryptions are independent and do not access local storage
+			// AD is read by all the threads, each one builds the recipient AD in its own scratch buffer
+			threadPool->parallel_for(recipients.size(), [&recipients, &AD, &payload, payloadDirectEncryption, arena](const size_t i) {
+				auto &recipientAD = AD_scratch(ADScratch::message);
+				recipientAD.assign(AD.cbegin(), AD.cend());
+				recipientAD.insert(recipientAD.end(), recipients[i].deviceId.cbegin(), recipients[i].deviceId.cend()); //insert recipient device id(gruu)
+
+				// do not save the session now, they are all saved at once when every recipient is done
+				if (arena != nullptr) {
+					recipients[i].DRSession->ratchetEncrypt(payload, recipientAD, arena + recipients[i].DRmessageOffset, payloadDirectEncryption, false);
+				} else {
+					recipients[i].DRSession->ratchetEncrypt(payload, recipientAD, recipients[i].DRmessage, payloadDirectEncryption, false);
+				}
+			});
+		} else {
+			// derive the keys and encrypt to all recipients in batches
+			DR<Curve>::ratchetEncrypt_batch(recipients, payload, AD, payloadDirectEncryption, arena);
+		}
+
+		// save all the sessions in one transaction, this throws an exception if it fails and then none of them is saved
+		std::vector<std::shared_ptr<DR<Curve>>> DRSessions{};
+		DRSessions.reserve(recipients.size());
+		for (const auto &recipient : recipients) {
+			DRSessions.push_back(recipient.DRSession);
+		}
+		DR<Curve>::sessions_save(DRSessions);
+	}
+
+	/**
+	 * @brief Try the given DR sessions until one decrypts the DR message
+	 *
+	 * @param[in,out]	DRSessions	list of DR Sessions linked to sender device
+	 * @param[in]		DRmessage	the Double Ratchet message
+	 * @param[in]		AD		associated data, depends on the message type
+	 * @param[out]		payload		plaintext or random seed decrypted from the DR message
+	 * @param[in]		payloadDirectEncryption	true when payload is expected to be the plaintext
+	 *
+	 * @return the session which decrypted the message, nullptr if none could
+	 */
+	template <typename Curve, typename outputContainer>
+	static std::shared_ptr<DR<Curve>> ratchetDecrypt_sessions(std::vector<std::shared_ptr<DR<Curve>>>& DRSessions, const std::vector<uint8_t>& DRmessage, const std::vector<uint8_t>& AD, outputContainer &payload, const bool payloadDirectEncryption) {
+		for (auto& DRSession : DRSessions) {
+			try {
+				if (DRSession->ratchetDecrypt(DRmessage, AD, payload, payloadDirectEncryption) == true) {
+					return DRSession;
+				}
+			} catch (BctbxException const &e) { // any bctbx Exception is just considered as decryption failed (it shall occurs in case of maximum skipped keys reached or inconsistency ib the direct Encryption flag)
+				LIME_LOGW<<"Double Ratchet session failed to decrypt message and raised an exception saying : "<<e;
+				// lets keep trying with other sessions if provided
+			}
+		}
+		return nullptr;
+	}
+
+	/**
+	 * @brief Select where the payload is encrypted according to the encryption policy
+	 *
+	 * @param[in]	encryptionPolicy	the encryption policy requested
+	 * @param[in]	plaintextSize		size of the message to encrypt
+	 * @param[in]	recipientsCount		number of recipient devices
+	 *
+	 * @return true if the payload shall be encrypted in the DR messages, false if it goes in the cipher message
+	 */
+	bool selectPayloadDirectEncryption(const lime::EncryptionPolicy encryptionPolicy, const size_t plaintextSize, const size_t recipientsCount) {
 		bool payloadDirectEncryption;
 		switch (encryptionPolicy) {
 			case lime::EncryptionPolicy::DRMessage:
@@ -485,8 +782,8 @@ namespace lime {
 				// - cipher message policy : 	up is <plaintext size + authentication tag size>(cipher message size) + recipient number * random seed size
 				// 				down is recipient number * (random seed size + <plaintext size + authentication tag size>(the cipher message))
 				// Note: We are not taking in consideration the fact that being multipart, the message gets an extra multipart boundary when using cipher message mode
-				if ( 2*recipients.size()*plaintext.size() <=
-						(plaintext.size() + lime::settings::DRMessageAuthTagSize + (2*lime::settings::DRrandomSeedSize + plaintext.size() + lime::settings::DRMessageAuthTagSize)*recipients.size()) )  {
+				if ( 2*recipientsCount*plaintextSize <=
+						(plaintextSize + lime::settings::DRMessageAuthTagSize + (2*lime::settings::DRrandomSeedSize + plaintextSize + lime::settings::DRMessageAuthTagSize)*recipientsCount) )  {
 					payloadDirectEncryption = true;
 				} else {
 					payloadDirectEncryption = false;
@@ -500,13 +797,39 @@ namespace lime {
 				// - DR message policy:     recipients number * plaintext size (plaintext is present encrypted in each recipient message)
 				// - cipher message policy: plaintext size + authentication tag size (the cipher message) + recipients number * random seed size (each DR message holds the random seed as encrypted data)
 				// Note: We are not taking in consideration the fact that being multipart, the message gets an extra multipart boundary when using cipher message mode
-				if ( recipients.size()*plaintext.size() <= (plaintext.size() + lime::settings::DRMessageAuthTagSize + (lime::settings::DRrandomSeedSize*recipients.size())) ) {
+				if ( recipientsCount*plaintextSize <= (plaintextSize + lime::settings::DRMessageAuthTagSize + (lime::settings::DRrandomSeedSize*recipientsCount)) ) {
 					payloadDirectEncryption = true;
 				} else {
 					payloadDirectEncryption = false;
 				}
 				break;
 		}
+		return payloadDirectEncryption;
+	}
+
+	/**
+	 * @brief Encrypt a message to all recipients, identified by their device id
+	 *
+	 *	The plaintext is first encrypted by one randomly generated key using aes-gcm
+	 *	The key and IV are then encrypted with DR Session specific to each device
+	 *	All the modified DR sessions are then saved to local storage in one transaction: either they all are or none is.
+	 *
+	 * @param[in,out]	recipients	vector of recipients device id(gruu) and linked DR Session, DR Session are modified by the encryption\n
+	 *					The recipients struct also hold after encryption the double ratchet message targeted to that particular recipient
+	 * @param[in]		plaintext	data to be encrypted
+	 * @param[in]		recipientUserId	the recipient ID, not specific to a device(could be a sip-uri) or a user(could be a group sip-uri)
+	 * @param[in]		sourceDeviceId	the Id of sender device(gruu)
+	 * @param[out]		cipherMessage	message encrypted with a random generated key(and IV). May be an empty buffer depending on encryptionPolicy, recipients and plaintext characteristics
+	 * @param[in]		encryptionPolicy	select how to manage the encryption: direct use of Double Ratchet message or encrypt in the cipher message and use the DR message to share the cipher message key\n
+	 * 						default is optimized output size mode.
+	 * @param[in]		threadPool	if not null and there are enough recipients, the per recipient encryptions are spread on this pool threads
+	 * @param[out]		DRmessagesArena	if not null, it is resized once to the exact total size of the DR messages and they are all written in it, one after the other in the recipients order.
+	 * 					The recipients get their DRmessageOffset and DRmessageSize but not their DRmessage
+	 */
+	template <typename Curve>
+	void encryptMessage(std::vector<RecipientInfos<Curve>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<lime::ThreadPool> threadPool, std::vector<uint8_t> *DRmessagesArena) {
+		// Shall we set the payload in the DR message or in a separate cupher message buffer?
+		bool payloadDirectEncryption = selectPayloadDirectEncryption(encryptionPolicy, plaintext.size(), recipients.size());
 
 		/* associated data authenticated by the AEAD scheme used by double ratchet encrypt/decrypt
 		 * - Payload in the cipherMessage: auth tag from cipherMessage || source Device Id || recipient Device Id
@@ -521,14 +844,11 @@ namespace lime {
 		if (!payloadDirectEncryption) { // Payload is encrypted in a separate cipher message buffer while the key used to encrypt it is in the DR message
 			// First generate a key and IV, use it to encrypt the given message, Associated Data are : sourceDeviceId || recipientUserId
 			// generate the random seed
-			auto RNG_context = make_RNG();
-			RNG_context->randomize(randomSeed);
+			shared_RNG()->randomize(randomSeed);
 
-			// expansion of randomSeed to 48 bytes: 32 bytes random key + 16 bytes nonce, use HKDF with empty salt
-			std::vector<uint8_t> emptySalt;
-			emptySalt.clear(); //just to be sure
+			// expansion of randomSeed to 48 bytes: 32 bytes random key + 16 bytes nonce
 			lime::sBuffer<lime::settings::DRMessageKeySize+lime::settings::DRMessageIVSize> randomKey;
-			HMAC_KDF<SHA512>(emptySalt.data(), emptySalt.size(), randomSeed.data(), randomSeed.size(), lime::settings::hkdf_randomSeed_info, randomKey.data(), randomKey.size());
+			cipherMessage_key(randomSeed, randomKey);
 
 			// resize cipherMessage vector as it is adressed directly by C library: same as plain message + room for the authentication tag
 			cipherMessage.resize(plaintext.size()+lime::settings::DRMessageAuthTagSize);
@@ -558,15 +878,24 @@ namespace lime {
 		 */
 		AD.insert(AD.end(), sourceDeviceId.cbegin(), sourceDeviceId.cend());
 
-		for(size_t i=0; i<recipients.size(); i++) {
-			std::vector<uint8_t> recipientAD{AD}; // copy AD
-			recipientAD.insert(recipientAD.end(), recipients[i].deviceId.cbegin(), recipients[i].deviceId.cend()); //insert recipient device id(gruu)
-
-			if (payloadDirectEncryption) {
-				recipients[i].DRSession->ratchetEncrypt(plaintext, std::move(recipientAD), recipients[i].DRmessage, payloadDirectEncryption);
-			} else {
-				recipients[i].DRSession->ratchetEncrypt(randomSeed, std::move(recipientAD), recipients[i].DRmessage, payloadDirectEncryption);
+		uint8_t *arena = nullptr;
+		if (DRmessagesArena != nullptr) {
+			// the DR messages sizes only depend on their sessions and on the payload size: lay them out in the arena before encrypting
+			const size_t payloadSize = payloadDirectEncryption?plaintext.size():randomSeed.size();
+			size_t arenaSize = 0;
+			for (auto &recipient : recipients) {
+				recipient.DRmessageOffset = arenaSize;
+				recipient.DRmessageSize = recipient.DRSession->encryptedSize(payloadSize);
+				arenaSize += recipient.DRmessageSize;
 			}
+			DRmessagesArena->resize(arenaSize);
+			arena = DRmessagesArena->data();
+		}
+
+		if (payloadDirectEncryption) {
+			encryptRecipients(recipients, plaintext, AD, payloadDirectEncryption, threadPool, arena);
+		} else {
+			encryptRecipients(recipients, randomSeed, AD, payloadDirectEncryption, threadPool, arena);
 		}
 	}
 
@@ -588,82 +917,218 @@ namespace lime {
 	template <typename Curve>
 	std::shared_ptr<DR<Curve>> decryptMessage(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<Curve>>>& DRSessions, const std::vector<uint8_t>& DRmessage, const std::vector<uint8_t>& cipherMessage, std::vector<uint8_t>& plaintext) {
 		bool payloadDirectEncryption = (cipherMessage.size() == 0); // if we do not have any cipher message, then we must be in payload direct encryption mode: the payload is in the DR message
-		std::vector<uint8_t> AD; // the Associated Data authenticated by the AEAD scheme used in DR encrypt/decrypt
 
-		/* Prepare the AD given to ratchet decrypt, is inpacted by message type
-		 * - Payload in the cipherMessage: auth tag from cipherMessage || source Device Id || recipient Device Id
-		 * - Payload in the DR message: recipient User Id || source Device Id || recipient Device Id
-		 */
 		if (!payloadDirectEncryption) { // payload in cipher message
 			// check cipher Message validity, it must be at least auth tag bytes long
 			if (cipherMessage.size()<lime::settings::DRMessageAuthTagSize) {
 				throw BCTBX_EXCEPTION << "Invalid cipher message - too short";
 			}
-			AD.assign(cipherMessage.cend()-lime::settings::DRMessageAuthTagSize, cipherMessage.cend());
-		} else { // payload in DR message
-			AD.assign(recipientUserId.cbegin(), recipientUserId.cend());
+			// get the random seed from the DR message, the cipher message auth tag is part of its AD
+			CipherStreamKey streamKey;
+			std::copy_n(cipherMessage.cend()-lime::settings::DRMessageAuthTagSize, lime::settings::DRMessageAuthTagSize, streamKey.tag.begin());
+			auto DRSession = decryptMessage(sourceDeviceId, recipientDeviceId, recipientUserId, DRSessions, DRmessage, streamKey);
+			if (DRSession == nullptr) {
+				return nullptr; // no session correctly deciphered
+			}
+
+			// recompute the AD used for this encryption: source Device Id || recipient User Id
+			auto &localAD = AD_scratch(ADScratch::message);
+			localAD.assign(sourceDeviceId.cbegin(), sourceDeviceId.cend());
+			localAD.insert(localAD.end(), recipientUserId.cbegin(), recipientUserId.cend());
+
+			// resize plaintext vector: same as cipher message - authentication tag length
+			plaintext.resize(cipherMessage.size()-lime::settings::DRMessageAuthTagSize);
+
+			// rebuild the random key and IV from given seed
+			lime::sBuffer<lime::settings::DRMessageKeySize+lime::settings::DRMessageIVSize> randomKey;
+			cipherMessage_key(streamKey.randomSeed, randomKey);
+
+			// use it to decipher message
+			if (AEAD_decrypt<AES256GCM>(randomKey.data(), lime::settings::DRMessageKeySize, // random key buffer hold key<DRMessageKeySize bytes> || IV<DRMessageIVSize bytes>
+					randomKey.data()+lime::settings::DRMessageKeySize, lime::settings::DRMessageIVSize,
+					cipherMessage.data(), cipherMessage.size()-lime::settings::DRMessageAuthTagSize, // cipherMessage is Message || auth tag
+					localAD.data(), localAD.size(),
+					streamKey.tag.data(), streamKey.tag.size(), // tag is in the last 16 bytes of buffer
+					plaintext.data())) {
+				return DRSession;
+			} else {
+				throw BCTBX_EXCEPTION << "Message key correctly deciphered but then failed to decipher message itself";
+			}
 		}
+
+		// payload in DR message, the AD is: recipient User Id || source Device Id || recipient Device Id
+		auto &AD = AD_scratch(ADScratch::message);
+		AD.assign(recipientUserId.cbegin(), recipientUserId.cend());
 		AD.insert(AD.end(), sourceDeviceId.cbegin(), sourceDeviceId.cend());
 		AD.insert(AD.end(), recipientDeviceId.cbegin(), recipientDeviceId.cend());
 
-		// buffer to store the random seed used to derive key and IV to decrypt message
-		lime::sBuffer<lime::settings::DRrandomSeedSize> randomSeed;
+		return ratchetDecrypt_sessions(DRSessions, DRmessage, AD, plaintext, payloadDirectEncryption);
+	}
 
-		for (auto& DRSession : DRSessions) {
-			bool decryptStatus = false;
-			try {
-				// if payload is in the message, got the output directly in the plaintext buffer
-				if (payloadDirectEncryption) {
-					decryptStatus = DRSession->ratchetDecrypt(DRmessage, AD, plaintext, payloadDirectEncryption);
-				} else {
-					decryptStatus = DRSession->ratchetDecrypt(DRmessage, AD, randomSeed, payloadDirectEncryption);
-				}
-			} catch (BctbxException const &e) { // any bctbx Exception is just considered as decryption failed (it shall occurs in case of maximum skipped keys reached or inconsistency ib the direct Encryption flag)
-				LIME_LOGW<<"Double Ratchet session failed to decrypt message and raised an exception saying : "<<e;
-				decryptStatus = false; // lets keep trying with other sessions if provided
+	/**
+	 * @brief Decrypt the DR message of a message using a cipher message, retrieve the cipher message key material
+	 *
+	 * @param[in]		sourceDeviceId		the device Id of sender(gruu)
+	 * @param[in]		recipientDeviceId	the recipient ID, specific to current device(gruu)
+	 * @param[in]		recipientUserId		the recipient ID, not specific to a device(could be a sip-uri) or a user(could be a group sip-uri)
+	 * @param[in,out]	DRSessions		list of DR Sessions linked to sender device, first one shall be the one registered as active
+	 * @param[in]		DRmessage		Double Ratchet message holding the random seed used to encrypt the cipher message
+	 * @param[in,out]	streamKey		the tag must be set to the cipher message auth tag, get the random seed on success
+	 *
+	 * @return a shared pointer towards the session used to decrypt, nullptr if we couldn't find one to do it
+	 */
+	template <typename Curve>
+	std::shared_ptr<DR<Curve>> decryptMessage(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<Curve>>>& DRSessions, const std::vector<uint8_t>& DRmessage, CipherStreamKey &streamKey) {
+		// the AD is: auth tag from cipherMessage || source Device Id || recipient Device Id
+		auto &AD = AD_scratch(ADScratch::message);
+		AD.assign(streamKey.tag.cbegin(), streamKey.tag.cend());
+		AD.insert(AD.end(), sourceDeviceId.cbegin(), sourceDeviceId.cend());
+		AD.insert(AD.end(), recipientDeviceId.cbegin(), recipientDeviceId.cend());
+
+		return ratchetDecrypt_sessions(DRSessions, DRmessage, AD, streamKey.randomSeed, false);
+	}
+
+	/**
+	 * @brief Encrypt to all recipients the key material of a cipher message already encrypted by encryptCipherStream
+	 *
+	 * @param[in,out]	recipients	vector of recipients device id(gruu) and linked DR Session, get the DR message
+	 * @param[in]		streamKey	random seed and auth tag of the cipher message
+	 * @param[in]		sourceDeviceId	the Id of sender device(gruu)
+	 * @param[in]		threadPool	if not null and there are enough recipients, the per recipient encryptions are spread on this pool threads
+	 */
+	template <typename Curve>
+	void encryptMessage(std::vector<RecipientInfos<Curve>>& recipients, const CipherStreamKey &streamKey, const std::string& sourceDeviceId, std::shared_ptr<lime::ThreadPool> threadPool) {
+		// Associated Data to Double Ratchet encryption is: auth tag of cipherMessage AEAD || sourceDeviceId || recipient device Id(gruu)
+		std::vector<uint8_t> AD{streamKey.tag.cbegin(), streamKey.tag.cend()};
+		AD.insert(AD.end(), sourceDeviceId.cbegin(), sourceDeviceId.cend());
+
+		encryptRecipients(recipients, streamKey.randomSeed, AD, false, threadPool);
+	}
+
+	/**
+	 * @brief Encrypt a cipher message by chunks
+	 *
+	 * The output is the same as the cipher message produced by encryptMessage: cipher text || auth tag
+	 *
+	 * @param[in]	plainStream	read the message to encrypt
+	 * @param[in]	cipherStream	write the cipher message
+	 * @param[in]	recipientUserId	the recipient ID, not specific to a device(could be a sip-uri) or a user(could be a group sip-uri)
+	 * @param[in]	sourceDeviceId	the Id of sender device(gruu)
+	 * @param[out]	streamKey	the generated random seed and the cipher message auth tag, to be given to encryptMessage
+	 */
+	void encryptCipherStream(const limeStreamReader &plainStream, const limeStreamWriter &cipherStream, const std::string& recipientUserId, const std::string& sourceDeviceId, CipherStreamKey &streamKey) {
+		// generate the random seed and derive the key and IV from it
+		shared_RNG()->randomize(streamKey.randomSeed);
+		lime::sBuffer<lime::settings::DRMessageKeySize+lime::settings::DRMessageIVSize> randomKey;
+		cipherMessage_key(streamKey.randomSeed, randomKey);
+
+		// AD is source deviceId(gruu) || recipientUserId(sip uri)
+		std::vector<uint8_t> AD{sourceDeviceId.cbegin(), sourceDeviceId.cend()};
+		AD.insert(AD.end(), recipientUserId.cbegin(), recipientUserId.cend());
+
+		auto AEADContext = make_AEADStream<AES256GCM>(true, randomKey.data(), lime::settings::DRMessageKeySize,
+				randomKey.data()+lime::settings::DRMessageKeySize, lime::settings::DRMessageIVSize,
+				AD.data(), AD.size());
+
+		std::vector<uint8_t> input(lime::settings::cipherStream_chunkSize);
+		std::vector<uint8_t> output(lime::settings::cipherStream_chunkSize);
+		size_t offset = 0;
+		while (true) {
+			auto readSize = plainStream(offset, input.data(), input.size());
+			if (readSize == 0) break; // end of message
+			if (readSize > input.size()) {
+				throw BCTBX_EXCEPTION << "Stream reader returned more data than requested";
 			}
+			AEADContext->update(input.data(), readSize, output.data());
+			cipherStream(output.data(), readSize);
+			offset += readSize;
+		}
+		cleanBuffer(input.data(), input.size()); // it held a part of the plain message
 
-			if (decryptStatus == true) { // we got the DR message correctly deciphered
-				if (payloadDirectEncryption) { // we're done, payload was in the DR message
-					return DRSession;
-				}
-				// recompute the AD used for this encryption: source Device Id || recipient User Id
-				std::vector<uint8_t> localAD{sourceDeviceId.cbegin(), sourceDeviceId.cend()};
-				localAD.insert(localAD.end(), recipientUserId.cbegin(), recipientUserId.cend());
-
-				// resize plaintext vector: same as cipher message - authentication tag length
-				plaintext.resize(cipherMessage.size()-lime::settings::DRMessageAuthTagSize);
-
-				// rebuild the random key and IV from given seed
-				// use HKDF - RFC 5869 with empty salt
-				std::vector<uint8_t> emptySalt;
-				emptySalt.clear();
-				lime::sBuffer<lime::settings::DRMessageKeySize+lime::settings::DRMessageIVSize> randomKey;
-				HMAC_KDF<SHA512>(emptySalt.data(), emptySalt.size(), randomSeed.data(), randomSeed.size(), lime::settings::hkdf_randomSeed_info, randomKey.data(), randomKey.size());
-
-				// use it to decipher message
-				if (AEAD_decrypt<AES256GCM>(randomKey.data(), lime::settings::DRMessageKeySize, // random key buffer hold key<DRMessageKeySize bytes> || IV<DRMessageIVSize bytes>
-						randomKey.data()+lime::settings::DRMessageKeySize, lime::settings::DRMessageIVSize,
-						cipherMessage.data(), cipherMessage.size()-lime::settings::DRMessageAuthTagSize, // cipherMessage is Message || auth tag
-						localAD.data(), localAD.size(),
-						cipherMessage.data()+cipherMessage.size()-lime::settings::DRMessageAuthTagSize, lime::settings::DRMessageAuthTagSize, // tag is in the last 16 bytes of buffer
-						plaintext.data())) {
-					return DRSession;
-				} else {
-					throw BCTBX_EXCEPTION << "Message key correctly deciphered but then failed to decipher message itself";
-				}
+		// cipher message ends with the auth tag
+		AEADContext->encryptFinish(streamKey.tag.data(), streamKey.tag.size());
+		cipherStream(streamKey.tag.data(), streamKey.tag.size());
+	}
+
+	/**
+	 * @brief Read the auth tag at the end of a streamed cipher message
+	 *
+	 * @param[in]	cipherStream		read the cipher message
+	 * @param[in]	cipherMessageSize	total size of the cipher message
+	 * @param[out]	streamKey		get the cipher message auth tag
+	 */
+	void readCipherStreamTag(const limeStreamReader &cipherStream, const size_t cipherMessageSize, CipherStreamKey &streamKey) {
+		if (cipherMessageSize<lime::settings::DRMessageAuthTagSize) {
+			throw BCTBX_EXCEPTION << "Invalid cipher message - too short";
+		}
+		size_t tagOffset = 0;
+		while (tagOffset < streamKey.tag.size()) {
+			auto readSize = cipherStream(cipherMessageSize - lime::settings::DRMessageAuthTagSize + tagOffset, streamKey.tag.data()+tagOffset, streamKey.tag.size()-tagOffset);
+			if (readSize == 0 || readSize > streamKey.tag.size()-tagOffset) {
+				throw BCTBX_EXCEPTION << "Cipher message stream ended before its announced size";
 			}
+			tagOffset += readSize;
 		}
-		return nullptr; // no session correctly deciphered
+	}
+
+	/**
+	 * @brief Decrypt a cipher message by chunks
+	 *
+	 * @param[in]	cipherStream		read the cipher message
+	 * @param[in]	cipherMessageSize	total size of the cipher message: cipher text || auth tag
+	 * @param[in]	plainStream		write the plain message, it is authenticated only if this function returns true
+	 * @param[in]	recipientUserId		the recipient ID, not specific to a device(could be a sip-uri) or a user(could be a group sip-uri)
+	 * @param[in]	sourceDeviceId		the device Id of sender(gruu)
+	 * @param[in]	streamKey		random seed retrieved from the DR message and cipher message auth tag
+	 *
+	 * @return true if the cipher message is authenticated
+	 */
+	bool decryptCipherStream(const limeStreamReader &cipherStream, const size_t cipherMessageSize, const limeStreamWriter &plainStream, const std::string& recipientUserId, const std::string& sourceDeviceId, const CipherStreamKey &streamKey) {
+		if (cipherMessageSize<lime::settings::DRMessageAuthTagSize) {
+			throw BCTBX_EXCEPTION << "Invalid cipher message - too short";
+		}
+		// rebuild the random key and IV from given seed
+		lime::sBuffer<lime::settings::DRMessageKeySize+lime::settings::DRMessageIVSize> randomKey;
+		cipherMessage_key(streamKey.randomSeed, randomKey);
+
+		// AD is source deviceId(gruu) || recipientUserId(sip uri)
+		std::vector<uint8_t> AD{sourceDeviceId.cbegin(), sourceDeviceId.cend()};
+		AD.insert(AD.end(), recipientUserId.cbegin(), recipientUserId.cend());
+
+		auto AEADContext = make_AEADStream<AES256GCM>(false, randomKey.data(), lime::settings::DRMessageKeySize,
+				randomKey.data()+lime::settings::DRMessageKeySize, lime::settings::DRMessageIVSize,
+				AD.data(), AD.size());
+
+		const size_t cipherTextSize = cipherMessageSize - lime::settings::DRMessageAuthTagSize;
+		std::vector<uint8_t> input(std::min(lime::settings::cipherStream_chunkSize, cipherTextSize));
+		std::vector<uint8_t> output(input.size());
+		size_t offset = 0;
+		while (offset < cipherTextSize) {
+			auto requestedSize = std::min(input.size(), cipherTextSize - offset);
+			auto readSize = cipherStream(offset, input.data(), requestedSize);
+			if (readSize == 0 || readSize > requestedSize) {
+				throw BCTBX_EXCEPTION << "Cipher message stream ended before its announced size";
+			}
+			AEADContext->update(input.data(), readSize, output.data());
+			plainStream(output.data(), readSize);
+			offset += readSize;
+		}
+		cleanBuffer(output.data(), output.size()); // it held a part of the plain message
+
+		return AEADContext->decryptFinish(streamKey.tag.data(), streamKey.tag.size());
 	}
 
 	/* template instanciations for C25519 and C448 encryption/decryption functions */
 #ifdef EC25519_ENABLED
-	template void encryptMessage<C255>(std::vector<RecipientInfos<C255>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy);
+	template void encryptMessage<C255>(std::vector<RecipientInfos<C255>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<lime::ThreadPool> threadPool, std::vector<uint8_t> *DRmessagesArena);
 	template std::shared_ptr<DR<C255>> decryptMessage<C255>(const std::string& sourceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<C255>>>& DRSessions, const std::vector<uint8_t>& DRmessage, const std::vector<uint8_t>& cipherMessage, std::vector<uint8_t>& plaintext);
+	template void encryptMessage<C255>(std::vector<RecipientInfos<C255>>& recipients, const CipherStreamKey &streamKey, const std::string& sourceDeviceId, std::shared_ptr<lime::ThreadPool> threadPool);
+	template std::shared_ptr<DR<C255>> decryptMessage<C255>(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<C255>>>& DRSessions, const std::vector<uint8_t>& DRmessage, CipherStreamKey &streamKey);
 #endif
 #ifdef EC448_ENABLED
-	template void encryptMessage<C448>(std::vector<RecipientInfos<C448>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy);
+	template void encryptMessage<C448>(std::vector<RecipientInfos<C448>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<lime::ThreadPool> threadPool, std::vector<uint8_t> *DRmessagesArena);
 	template std::shared_ptr<DR<C448>> decryptMessage<C448>(const std::string& sourceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<C448>>>& DRSessions, const std::vector<uint8_t>& DRmessage, const std::vector<uint8_t>& cipherMessage, std::vector<uint8_t>& plaintext);
+	template void encryptMessage<C448>(std::vector<RecipientInfos<C448>>& recipients, const CipherStreamKey &streamKey, const std::string& sourceDeviceId, std::shared_ptr<lime::ThreadPool> threadPool);
+	template std::shared_ptr<DR<C448>> decryptMessage<C448>(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<C448>>>& DRSessions, const std::vector<uint8_t>& DRmessage, CipherStreamKey &streamKey);
 #endif
 }
@@ -22,9 +22,11 @@
 #include <array>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <memory>
 
+#include "lime/lime.hpp"
 #include "lime_settings.hpp"
 #include "lime_defines.hpp"
 #include "lime_crypto_primitives.hpp"
@@ -32,6 +34,7 @@
 namespace lime {
 
 	class Db; // forward declaration of class Db used by DR<Curve>, declared in lime_localStorage.hpp
+	class ThreadPool; // forward declaration of class ThreadPool used by encryptMessage, declared in lime_threadpool.hpp
 
 	/**
 	 * @brief the possible status of session regarding the Local Storage
@@ -55,6 +58,11 @@ namespace lime {
 	/** Shared Associated Data : stored at session initialisation, given by upper level(X3DH), shall be derived from Identity and Identity keys of sender and recipient, fixed size for storage convenience */
 	using SharedADBuffer = std::array<uint8_t, lime::settings::DRSessionSharedADSize>;
 
+	/** Mutable state of a DR session as stored in local storage, fixed layout: DHr || DHs public || DHs private || RK || CKs || CKr || Ns || Nr || PN
+	 * counters are 2 bytes big endian */
+	template <typename Curve>
+	using DRStateRecord = lime::sBuffer<2*Curve::Xsize(lime::Xtype::publicKey)+Curve::Xsize(lime::Xtype::privateKey)+3*lime::settings::DRChainKeySize+3*sizeof(uint16_t)>;
+
 	/**
 	 * @brief Chain storing the DH and MKs associated with Nr(uint16_t map index)
 	 * @tparam Curve	The elliptic curve to use: C255 or C448
@@ -70,6 +78,40 @@ namespace lime {
 		ReceiverKeyChain(X<Curve, lime::Xtype::publicKey> key) :DHr{std::move(key)}, messageKeys{} {};
 	};
 
+	/**
+	 * @brief In memory index of a chain of skipped message keys stored in local storage: its DHr and the Nr of the keys stored
+	 * @tparam Curve	The elliptic curve to use: C255 or C448
+	 */
+	template <typename Curve>
+	struct ReceiverKeyChainIndex {
+		long DHid; /**< local storage id of this chain */
+		X<Curve, lime::Xtype::publicKey> DHr; /**< peer public key identifying this chain */
+		std::unordered_set<std::uint16_t> Nr; /**< index of the message keys stored in this chain */
+		/**
+		 * Start a new empty chain index
+		 * @param[in]	DHid	local storage id of the chain
+		 * @param[in]	key	the peer DH public key used on this chain
+		 */
+		ReceiverKeyChainIndex(long DHid, X<Curve, lime::Xtype::publicKey> key) :DHid{DHid}, DHr{std::move(key)}, Nr{} {};
+	};
+
+	/**
+	 * @brief Data needed only to save a new DR session for the first time in local storage
+	 *
+	 * Allocated apart from the session state and released once the session is inserted in local storage
+	 * so the sessions loaded or already saved do not carry it.
+	 * @tparam Curve	The elliptic curve to use: C255 or C448
+	 */
+	template <typename Curve>
+	struct DRSessionInit {
+		std::string peerDeviceId; /**< if the peer device is not yet in local storage, its device Id so we can insert it */
+		DSA<Curve, lime::DSAtype::publicKey> peerIk; /**< if the peer device is not yet in local storage, its identity key so we can insert it */
+		uint32_t usedOPkId; /**< when the session is created on receiver side, the OPk id used so we can remove it from local storage, 0 if none */
+		DRSessionInit(const std::string &deviceId, const DSA<Curve, lime::DSAtype::publicKey> &Ik, const uint32_t OPkId) : peerDeviceId{deviceId}, peerIk{Ik}, usedOPkId{OPkId} {};
+	};
+
+	template <typename Curve> struct RecipientInfos; // defined after the DR class
+
 	/**
 	 * @brief store a Double Rachet session.
 	 *
@@ -81,58 +123,83 @@ namespace lime {
 	template <typename Curve>
 	class DR {
 		private:
-			/* State variables for Double Ratchet, see Double Ratchet spec section 3.2 for details */
+			/* State variables for Double Ratchet, see Double Ratchet spec section 3.2 for details
+			 * members are ordered by alignment so the cached sessions do not carry padding */
 			X<Curve, lime::Xtype::publicKey> m_DHr; // Remote public key
-			bool m_DHr_valid; // do we have a valid remote public key, flag used to spot the first message arriving at session creation in receiver mode
 			Xpair<Curve> m_DHs; // self Key pair
 			DRChainKey m_RK; // 32 bytes root key
 			DRChainKey m_CKs; // 32 bytes key chain for sending
 			DRChainKey m_CKr; // 32 bytes key chain for receiving
-			std::uint16_t m_Ns,m_Nr; // Message index in sending and receiving chain
-			std::uint16_t m_PN; // Number of messages in previous sending chain
 			SharedADBuffer m_sharedAD; // Associated Data derived from self and peer device Identity key, set once at session creation, given by X3DH
 			std::vector<lime::ReceiverKeyChain<Curve>> m_mkskipped; // list of skipped message indexed by DH receiver public key and Nr, store MK generated during on-going decrypt, lookup is done directly in DB.
+			std::vector<lime::ReceiverKeyChainIndex<Curve>> m_mkskipped_index; // skipped message keys chains stored in DB, the DB lookup is performed only if this index matches
 
 			/* helpers variables */
 			std::shared_ptr<RNG> m_RNG; // Random Number Generator context
+			std::shared_ptr<lime::Db> m_localStorage; // enable access to the database holding sessions and skipped message keys
+			std::vector<uint8_t> m_X3DH_initMessage; // store the X3DH init message to be able to prepend it to any message until we got a first response from peer so we're sure he was able to init the session on his side
+			std::unique_ptr<DRSessionInit<Curve>> m_init; // data needed only by the first save of a new session, nullptr once the session is in local storage
 			long int m_dbSessionId; // used to store row id from Database Storage
-			uint16_t m_usedNr; // store the index of message key used for decryption if it came from mkskipped db
 			long m_usedDHid; // store the index of DHr message key used for decryption if it came from mkskipped db(not zero only if used)
-			uint32_t m_usedOPkId; // when the session is created on receiver side, store the OPk id used so we can remove it from local storage when saving session for the first time.
-			std::shared_ptr<lime::Db> m_localStorage; // enable access to the database holding sessions and skipped message keys
-			DRSessionDbStatus m_dirty; // status of the object regarding its instance in local storage, could be: clean, dirty_encrypt, dirty_decrypt or dirty
-			long int m_peerDid; // used during session creation only to hold the peer device id in DB as we need it to insert the session in local Storage
-			std::string m_peerDeviceId; // used during session creation only, if the deviceId is not yet in local storage, to hold the peer device Id so we can insert it in DB when session is saved for the first time
-			DSA<Curve, lime::DSAtype::publicKey> m_peerIk; // used during session creation only, if the deviceId is not yet in local storage, to hold the peer device Ik so we can insert it in DB when session is saved for the first time
+			long int m_peerDid; // the peer device id in DB, 0 until the first save when the peer device is not yet in local storage
 			long int m_db_Uid; // used to link session to a local device Id
+			uint32_t m_dbVersion; // DR_sessions.version matching this session state, the row is updated only if it still holds it
+			std::uint16_t m_Ns,m_Nr; // Message index in sending and receiving chain
+			std::uint16_t m_PN; // Number of messages in previous sending chain
+			uint16_t m_usedNr; // store the index of message key used for decryption if it came from mkskipped db
+			DRSessionDbStatus m_dirty; // status of the object regarding its instance in local storage, could be: clean, dirty_encrypt, dirty_decrypt or dirty
+			bool m_DHr_valid; // do we have a valid remote public key, flag used to spot the first message arriving at session creation in receiver mode
 			bool m_active_status; // current status of this session, true if it is the active one, false if it is stale
-			std::vector<uint8_t> m_X3DH_initMessage; // store the X3DH init message to be able to prepend it to any message until we got a first response from peer so we're sure he was able to init the session on his side
 
 			/*helpers functions */
 			void skipMessageKeys(const uint16_t until, const int limit); /* check if we skipped some messages in current receiving chain, generate and store in session intermediate message keys */
 			void DHRatchet(const X<Curve, lime::Xtype::publicKey> &headerDH); /* perform a Diffie-Hellman ratchet using the given peer public key */
+			size_t ratchetEncrypt_header(uint8_t *const ciphertext, const bool payloadDirectEncryption, std::vector<uint8_t> &DRAD); /* build the message header, step the sending chain and complete the AD */
 			/* local storage related implemented in lime_localStorage.cpp */
-			bool session_save(); /* save/update session in database : updated component depends m_dirty value */
+			bool session_save(bool commit=true); /* save/update session in database : updated component depends m_dirty value, when commit is false the caller owns the transaction */
 			bool session_load(); /* load session in database */
+			bool session_deferrable() const; /* write-behind mode: can the session update be queued instead of saved at once */
+			void session_defer(); /* write-behind mode: queue the session update in its local storage */
 			bool trySkippedMessageKeys(const uint16_t Nr, const X<Curve, lime::Xtype::publicKey> &DHr, DRMKey &MK); /* check in DB if we have a message key matching public DH and Ns */
+			void mkskipped_index_load(); /* build the index of skipped message keys chains stored in DB */
+			void state_serialize(DRStateRecord<Curve> &record) const; /* write the mutable ratchet state in its local storage record */
+			void state_deserialize(const DRStateRecord<Curve> &record); /* read the mutable ratchet state from its local storage record */
 
 		public:
 			DR() = delete; // make sure the Double Ratchet is not initialised without parameters
 			DR(std::shared_ptr<lime::Db> localStorage, const DRChainKey &SK, const SharedADBuffer &AD, const X<Curve, lime::Xtype::publicKey> &peerPublicKey, const long int peerDid, const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, long int selfDeviceId, const std::vector<uint8_t> &X3DH_initMessage, std::shared_ptr<RNG> RNG_context); // call to initialise a session for sender: we have Shared Key and peer Public key
 			DR(std::shared_ptr<lime::Db> localStorage, const DRChainKey &SK, const SharedADBuffer &AD, const Xpair<Curve> &selfKeyPair, long int peerDid, const std::string &peerDeviceId, const uint32_t OPk_id, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, long int selfDeviceId, std::shared_ptr<RNG> RNG_context); // call at initialisation of a session for receiver: we have Share Key and self key pair
 			DR(std::shared_ptr<lime::Db> localStorage, long sessionId, std::shared_ptr<RNG> RNG_context); // load session from DB
+			DR(std::shared_ptr<lime::Db> localStorage, long sessionId, long int peerDid, long int selfDid, const DRStateRecord<Curve> &state, const SharedADBuffer &AD, std::vector<uint8_t> &&X3DH_initMessage, const bool hasSkippedKeys, const uint32_t version, std::shared_ptr<RNG> RNG_context); // build an active session from its already fetched DB row
 			DR(DR<Curve> &a) = delete; // can't copy a session, force usage of shared pointers
 			DR<Curve> &operator=(DR<Curve> &a) = delete; // can't copy a session
 			~DR();
 
 			template<typename inputContainer>
-			void ratchetEncrypt(const inputContainer &plaintext, std::vector<uint8_t> &&AD, std::vector<uint8_t> &ciphertext, const bool payloadDirectEncryption);
+			void ratchetEncrypt(const inputContainer &plaintext, const std::vector<uint8_t> &AD, std::vector<uint8_t> &ciphertext, const bool payloadDirectEncryption, const bool saveSession=true);
+			template<typename inputContainer>
+			void ratchetEncrypt(const inputContainer &plaintext, const std::vector<uint8_t> &AD, uint8_t *const ciphertext, const bool payloadDirectEncryption, const bool saveSession=true);
+			/// exact size of the DR message produced by ratchetEncrypt for an input of plaintextSize bytes
+			size_t encryptedSize(const size_t plaintextSize) const noexcept;
 			template<typename outputContainer>
 			bool ratchetDecrypt(const std::vector<uint8_t> &cipherText, const std::vector<uint8_t> &AD, outputContainer &plaintext, const bool payloadDirectEncryption);
 			/// return the session's local storage id
 			long int dbSessionId(void) const {return m_dbSessionId;};
 			/// return the current status of session
 			bool isActive(void) const {return m_active_status;}
+			/// return true if the session is not in sync with local storage
+			bool isDirty(void) const {return m_dirty != DRSessionDbStatus::clean;}
+			/* multi-process mode: check the session was not modified in local storage by another process, implemented in lime_localStorage.cpp */
+			bool isCurrent(void);
+			/// return an estimation of the memory used by this session
+			size_t memoryFootprint(void) const;
+			/// get the state of a clean active session to rebuild it later without reading its DB row
+			bool get_snapshot(DRStateRecord<Curve> &state, SharedADBuffer &AD, std::vector<uint8_t> &X3DH_initMessage, bool &hasSkippedKeys) const;
+			/* encrypt the same input to several recipients, the key derivations and encryptions are batched. Sessions are not saved */
+			template<typename inputContainer>
+			static void ratchetEncrypt_batch(std::vector<RecipientInfos<Curve>> &recipients, const inputContainer &plaintext, const std::vector<uint8_t> &AD, const bool payloadDirectEncryption, uint8_t *const arena=nullptr);
+			/* save a batch of sessions in one local storage transaction, implemented in lime_localStorage.cpp */
+			static void sessions_save(const std::vector<std::shared_ptr<DR<Curve>>> &sessions);
 	};
 
 
@@ -142,6 +209,8 @@ namespace lime {
 	template <typename Curve>
 	struct RecipientInfos : public RecipientData {
 		std::shared_ptr<DR<Curve>> DRSession; /**< DR Session to reach recipient */
+		size_t DRmessageOffset; /**< when the DR messages are written in an arena: offset of this recipient one */
+		size_t DRmessageSize; /**< when the DR messages are written in an arena: size of this recipient one */
 		/**
 		 * The deviceId is a constant and must be provided to the constructor to instanciate the base RecipientData class.
 		 * @note at construction, the peerStatus is always set to unknown as this status is then overriden with actual one fetched from DB, the ones not fetched are unknown
@@ -150,32 +219,64 @@ namespace lime {
 		 * @param[in]	session		The double ratchet session linking current device with this recipient.
 		 *
 		 */
-		RecipientInfos(const std::string &deviceId, std::shared_ptr<DR<Curve>> session) : RecipientData(deviceId),  DRSession{session} {};
+		RecipientInfos(const std::string &deviceId, std::shared_ptr<DR<Curve>> session) : RecipientData(deviceId),  DRSession{session}, DRmessageOffset{0}, DRmessageSize{0} {};
 		/**
 		 * @overload
 		 *
 		 * forward the deviceId to the RecipientData constructor and set the DRSession pointer to nullptr
 		 */
-		RecipientInfos(const std::string &deviceId) : RecipientData(deviceId),  DRSession{nullptr} {};
+		RecipientInfos(const std::string &deviceId) : RecipientData(deviceId),  DRSession{nullptr}, DRmessageOffset{0}, DRmessageSize{0} {};
 	};
 
+	/**
+	 * @brief Key material of a cipher message encrypted as a stream
+	 *
+	 * The cipher message is processed before the DR messages are built: then only this is needed to encrypt to the recipients
+	 */
+	struct CipherStreamKey {
+		lime::sBuffer<lime::settings::DRrandomSeedSize> randomSeed; /**< seed used to derive the cipher message key and IV, it is encrypted in the DR messages */
+		lime::sBuffer<lime::settings::DRMessageAuthTagSize> tag; /**< cipher message auth tag, part of the DR messages AD */
+	};
+
+	// select where the payload is encrypted according to the policy: true for the DR messages, false for the cipher message
+	bool selectPayloadDirectEncryption(const lime::EncryptionPolicy encryptionPolicy, const size_t plaintextSize, const size_t recipientsCount);
+
 	// helpers function wich are the one to be used to encrypt/decrypt messages
 	template <typename Curve>
-	void encryptMessage(std::vector<RecipientInfos<Curve>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy);
+	void encryptMessage(std::vector<RecipientInfos<Curve>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<lime::ThreadPool> threadPool=nullptr, std::vector<uint8_t> *DRmessagesArena=nullptr);
 
 	template <typename Curve>
 	std::shared_ptr<DR<Curve>> decryptMessage(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<Curve>>>& DRSessions, const std::vector<uint8_t>& DRmessage, const std::vector<uint8_t>& cipherMessage, std::vector<uint8_t>& plaintext);
 
+	// streamed cipher message: the cipher message is processed by chunks apart from the DR messages which only hold its key material
+	template <typename Curve>
+	void encryptMessage(std::vector<RecipientInfos<Curve>>& recipients, const CipherStreamKey &streamKey, const std::string& sourceDeviceId, std::shared_ptr<lime::ThreadPool> threadPool=nullptr);
+
+	template <typename Curve>
+	std::shared_ptr<DR<Curve>> decryptMessage(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<Curve>>>& DRSessions, const std::vector<uint8_t>& DRmessage, CipherStreamKey &streamKey);
+
+	void encryptCipherStream(const limeStreamReader &plainStream, const limeStreamWriter &cipherStream, const std::string& recipientUserId, const std::string& sourceDeviceId, CipherStreamKey &streamKey);
+	void readCipherStreamTag(const limeStreamReader &cipherStream, const size_t cipherMessageSize, CipherStreamKey &streamKey);
+	bool decryptCipherStream(const limeStreamReader &cipherStream, const size_t cipherMessageSize, const limeStreamWriter &plainStream, const std::string& recipientUserId, const std::string& sourceDeviceId, const CipherStreamKey &streamKey);
+
 	/* this templates are instanciated once in the lime_double_ratchet.cpp file, explicitly tell anyone including this header that there is no need to re-instanciate them */
 #ifdef EC25519_ENABLED
 	extern template class DR<C255>;
-	extern template void encryptMessage<C255>(std::vector<RecipientInfos<C255>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy);
+	extern template void DR<C255>::ratchetEncrypt<std::vector<uint8_t>>(const std::vector<uint8_t> &plaintext, const std::vector<uint8_t> &AD, std::vector<uint8_t> &ciphertext, const bool payloadDirectEncryption, const bool saveSession);
+	extern template bool DR<C255>::ratchetDecrypt<std::vector<uint8_t>>(const std::vector<uint8_t> &cipherText, const std::vector<uint8_t> &AD, std::vector<uint8_t> &plaintext, const bool payloadDirectEncryption);
+	extern template void encryptMessage<C255>(std::vector<RecipientInfos<C255>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<lime::ThreadPool> threadPool, std::vector<uint8_t> *DRmessagesArena);
 	extern template std::shared_ptr<DR<C255>> decryptMessage<C255>(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<C255>>>& DRSessions, const std::vector<uint8_t>& DRmessage, const std::vector<uint8_t>& cipherMessage, std::vector<uint8_t>& plaintext);
+	extern template void encryptMessage<C255>(std::vector<RecipientInfos<C255>>& recipients, const CipherStreamKey &streamKey, const std::string& sourceDeviceId, std::shared_ptr<lime::ThreadPool> threadPool);
+	extern template std::shared_ptr<DR<C255>> decryptMessage<C255>(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<C255>>>& DRSessions, const std::vector<uint8_t>& DRmessage, CipherStreamKey &streamKey);
 #endif
 #ifdef EC448_ENABLED
 	extern template class DR<C448>;
-	extern template void encryptMessage<C448>(std::vector<RecipientInfos<C448>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy);
+	extern template void DR<C448>::ratchetEncrypt<std::vector<uint8_t>>(const std::vector<uint8_t> &plaintext, const std::vector<uint8_t> &AD, std::vector<uint8_t> &ciphertext, const bool payloadDirectEncryption, const bool saveSession);
+	extern template bool DR<C448>::ratchetDecrypt<std::vector<uint8_t>>(const std::vector<uint8_t> &cipherText, const std::vector<uint8_t> &AD, std::vector<uint8_t> &plaintext, const bool payloadDirectEncryption);
+	extern template void encryptMessage<C448>(std::vector<RecipientInfos<C448>>& recipients, const std::vector<uint8_t>& plaintext, const std::string& recipientUserId, const std::string& sourceDeviceId, std::vector<uint8_t>& cipherMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<lime::ThreadPool> threadPool, std::vector<uint8_t> *DRmessagesArena);
 	extern template std::shared_ptr<DR<C448>> decryptMessage<C448>(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<C448>>>& DRSessions, const std::vector<uint8_t>& DRmessage, const std::vector<uint8_t>& cipherMessage, std::vector<uint8_t>& plaintext);
+	extern template void encryptMessage<C448>(std::vector<RecipientInfos<C448>>& recipients, const CipherStreamKey &streamKey, const std::string& sourceDeviceId, std::shared_ptr<lime::ThreadPool> threadPool);
+	extern template std::shared_ptr<DR<C448>> decryptMessage<C448>(const std::string& sourceDeviceId, const std::string& recipientDeviceId, const std::string& recipientUserId, std::vector<std::shared_ptr<DR<C448>>>& DRSessions, const std::vector<uint8_t>& DRmessage, CipherStreamKey &streamKey);
 #endif
 
 }
@@ -20,6 +20,7 @@
 #include "lime_double_ratchet_protocol.hpp"
 
 #include "bctoolbox/exception.hh"
+#include <algorithm>
 
 using namespace::std;
 using namespace::lime;
@@ -83,21 +84,21 @@ namespace lime {
 		 */
 		template <typename Curve>
 		void buildMessage_X3DHinit(std::vector<uint8_t> &message, const DSA<Curve, lime::DSAtype::publicKey> &Ik, const X<Curve, lime::Xtype::publicKey> &Ek, const uint32_t SPk_id, const uint32_t OPk_id, const bool OPk_flag) noexcept {
-			// make sure message is cleared and set its first byte to OPk flag
-			message.assign(1, static_cast<uint8_t>(OPk_flag?DR_X3DH_OPk_flag::withOPk:DR_X3DH_OPk_flag::withoutOPk));
-			message.reserve(1+Ik.size()+Ek.size()+4+(OPk_flag?4:0));
-
-			message.insert(message.end(), Ik.cbegin(), Ik.cend());
-			message.insert(message.end(), Ek.cbegin(), Ek.cend());
-			message.push_back((SPk_id>>24)&0xFF);
-			message.push_back((SPk_id>>16)&0xFF);
-			message.push_back((SPk_id>>8)&0xFF);
-			message.push_back((SPk_id)&0xFF);
+			using layout = DRLayout<Curve>;
+			// size the message once and write each field at its place
+			message.resize(X3DHinitSize<Curve>(OPk_flag));
+			message[layout::OPkFlag] = static_cast<uint8_t>(OPk_flag?DR_X3DH_OPk_flag::withOPk:DR_X3DH_OPk_flag::withoutOPk);
+			std::copy(Ik.cbegin(), Ik.cend(), message.begin()+layout::Ik);
+			std::copy(Ek.cbegin(), Ek.cend(), message.begin()+layout::Ek);
+			message[layout::SPkId] = (SPk_id>>24)&0xFF;
+			message[layout::SPkId+1] = (SPk_id>>16)&0xFF;
+			message[layout::SPkId+2] = (SPk_id>>8)&0xFF;
+			message[layout::SPkId+3] = (SPk_id)&0xFF;
 			if (OPk_flag) {
-				message.push_back((OPk_id>>24)&0xFF);
-				message.push_back((OPk_id>>16)&0xFF);
-				message.push_back((OPk_id>>8)&0xFF);
-				message.push_back((OPk_id)&0xFF);
+				message[layout::OPkId] = (OPk_id>>24)&0xFF;
+				message[layout::OPkId+1] = (OPk_id>>16)&0xFF;
+				message[layout::OPkId+2] = (OPk_id>>8)&0xFF;
+				message[layout::OPkId+3] = (OPk_id)&0xFF;
 			}
 		}
 
@@ -121,27 +122,23 @@ namespace lime {
 		 * @param[out]	OPk_flag	true if an OPk flag was present in the message
 		 */
 		template <typename Curve>
-		void parseMessage_X3DHinit(const std::vector<uint8_t>message, DSA<Curve, lime::DSAtype::publicKey> &Ik, X<Curve, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept {
-			OPk_flag = (message[0] == static_cast<uint8_t>(DR_X3DH_OPk_flag::withOPk))?true:false;
-			size_t index = 1;
-
-			Ik.assign(message.cbegin()+index);
-			index += DSA<Curve, lime::DSAtype::publicKey>::ssize();
+		void parseMessage_X3DHinit(const std::vector<uint8_t> &message, DSA<Curve, lime::DSAtype::publicKey> &Ik, X<Curve, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept {
+			using layout = DRLayout<Curve>;
+			OPk_flag = (message[layout::OPkFlag] == static_cast<uint8_t>(DR_X3DH_OPk_flag::withOPk))?true:false;
 
-			Ek.assign(message.cbegin()+index);
-			index += X<Curve, lime::Xtype::publicKey>::ssize();
+			Ik.assign(message.cbegin()+layout::Ik);
+			Ek.assign(message.cbegin()+layout::Ek);
 
-			SPk_id = static_cast<uint32_t>(message[index])<<24 |
-				static_cast<uint32_t>(message[index+1])<<16 |
-				static_cast<uint32_t>(message[index+2])<<8 |
-				static_cast<uint32_t>(message[index+3]);
+			SPk_id = static_cast<uint32_t>(message[layout::SPkId])<<24 |
+				static_cast<uint32_t>(message[layout::SPkId+1])<<16 |
+				static_cast<uint32_t>(message[layout::SPkId+2])<<8 |
+				static_cast<uint32_t>(message[layout::SPkId+3]);
 
 			if (OPk_flag) { // there is an OPk id
-				index+=4;
-				OPk_id = static_cast<uint32_t>(message[index])<<24 |
-						static_cast<uint32_t>(message[index+1])<<16 |
-						static_cast<uint32_t>(message[index+2])<<8 |
-						static_cast<uint32_t>(message[index+3]);
+				OPk_id = static_cast<uint32_t>(message[layout::OPkId])<<24 |
+						static_cast<uint32_t>(message[layout::OPkId+1])<<16 |
+						static_cast<uint32_t>(message[layout::OPkId+2])<<8 |
+						static_cast<uint32_t>(message[layout::OPkId+3]);
 			}
 		 }
 
@@ -160,19 +157,16 @@ namespace lime {
 				return false;
 			}
 
-			switch (message[0]) { // header[0] contains DR protocol version
+			using layout = DRLayout<Curve>;
+			switch (message[layout::version]) {
 				case double_ratchet_protocol::DR_v01: // version 0x01 of protocol
 				{
 					// if curveId is not matching or message type is not x3dhinit, return false
-					if (message[2] != static_cast<uint8_t>(Curve::curveId()) || !(message[1]&static_cast<uint8_t>(DR_message_type::X3DH_init_flag))) {
+					if (message[layout::curveId] != static_cast<uint8_t>(Curve::curveId()) || !(message[layout::messageType]&static_cast<uint8_t>(DR_message_type::X3DH_init_flag))) {
 						return false;
 					}
-					// check length, message[3] holds the OPk flag of the X3DH init message
-					size_t x3dh_initMessageSize = X3DHinitSize<Curve>(message[3] == 1);
-//					size_t x3dh_initMessageSize = 1 + DSA<Curve, lime::DSAtype::publicKey>::ssize() + X<Curve, lime::Xtype::publicKey>::ssize() + 4; // size of X3DH init message without OPk
-//					if (message[3] == 1) { // there is an OPk
-//						x3dh_initMessageSize += 4;
-//					}
+					// check length using the OPk flag of the X3DH init message
+					size_t x3dh_initMessageSize = X3DHinitSize<Curve>(message[layout::X3DHinit+layout::OPkFlag] == 1);
 
 					//header shall be actually longer because buffer passed is the whole message
 					if (message.size() <  x3dh_initMessageSize + headerSize<Curve>()) {
@@ -180,7 +174,7 @@ namespace lime {
 					}
 
 					// copy the message in the output buffer
-					X3DH_initMessage.assign(message.cbegin()+3, message.cbegin()+3+x3dh_initMessageSize);
+					X3DH_initMessage.assign(message.cbegin()+layout::X3DHinit, message.cbegin()+layout::X3DHinit+x3dh_initMessageSize);
 				}
 					return true;
 
@@ -210,94 +204,80 @@ namespace lime {
 		 * @param[in]	payloadDirectEncryption		Set the Payload Direct Encryption flag in header
 		 */
 		template <typename Curve>
-		void buildMessage_header(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<Curve, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> X3DH_initMessage, const bool payloadDirectEncryption) noexcept {
+		void buildMessage_header(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<Curve, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept {
+			header.resize(headerSize<Curve>() + X3DH_initMessage.size());
+			buildMessage_header<Curve>(header.data(), Ns, PN, DHs, X3DH_initMessage, payloadDirectEncryption);
+		}
+
+		/**
+		 * @overload
+		 *
+		 * write the header in a buffer of at least headerSize<Curve>() + X3DH_initMessage size bytes
+		 *
+		 * @return the header size
+		 */
+		template <typename Curve>
+		size_t buildMessage_header(uint8_t *const header, const uint16_t Ns, const uint16_t PN, const X<Curve, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept {
 			// Header is one buffer composed of:
-			// Version Number<1 byte> || message Type <1 byte> || curve Id <1 byte> || [<x3d init <variable>] || Ns <2 bytes> || PN <2 bytes> || Key type byte Id(1 byte) || self public key<DHKey::size bytes>
-			header.assign(1, static_cast<uint8_t>(double_ratchet_protocol::DR_v01));
+			// Version Number<1 byte> || message Type <1 byte> || curve Id <1 byte> || [<x3d init <variable>] || Ns <2 bytes> || PN <2 bytes> || self public key<DHKey::size bytes>
+			using layout = DRLayout<Curve>;
+			const auto x3dh_initMessageSize = X3DH_initMessage.size();
+			header[layout::version] = static_cast<uint8_t>(double_ratchet_protocol::DR_v01);
 			uint8_t messageType = 0;
 			if (payloadDirectEncryption) { // if requested, turn the payload direct encryption flag on
 				messageType |= static_cast<uint8_t>(lime::double_ratchet_protocol::DR_message_type::payload_direct_encryption_flag); // turn on the flag
 			}
-
 			if (X3DH_initMessage.size()>0) { // we do have an X3DH init message to insert in the header
 				messageType |= static_cast<uint8_t>(lime::double_ratchet_protocol::DR_message_type::X3DH_init_flag); // turn on the flag
-				header.push_back(messageType);
-				header.push_back(static_cast<uint8_t>(Curve::curveId()));
-				header.insert(header.end(), X3DH_initMessage.cbegin(), X3DH_initMessage.cend());
-			} else {
-				messageType &= ~static_cast<uint8_t>(lime::double_ratchet_protocol::DR_message_type::X3DH_init_flag); // be sure to have this flag turned off
-				header.push_back(messageType);
-				header.push_back(static_cast<uint8_t>(Curve::curveId()));
 			}
-			header.push_back((uint8_t)((Ns>>8)&0xFF));
-			header.push_back((uint8_t)(Ns&0xFF));
-			header.push_back((uint8_t)((PN>>8)&0xFF));
-			header.push_back((uint8_t)(PN&0xFF));
-			header.insert(header.end(), DHs.cbegin(), DHs.cend());
-		 }
+			header[layout::messageType] = messageType;
+			header[layout::curveId] = static_cast<uint8_t>(Curve::curveId());
+			std::copy(X3DH_initMessage.cbegin(), X3DH_initMessage.cend(), header+layout::X3DHinit);
+			header[layout::Ns(x3dh_initMessageSize)] = (uint8_t)((Ns>>8)&0xFF);
+			header[layout::Ns(x3dh_initMessageSize)+1] = (uint8_t)(Ns&0xFF);
+			header[layout::PN(x3dh_initMessageSize)] = (uint8_t)((PN>>8)&0xFF);
+			header[layout::PN(x3dh_initMessageSize)+1] = (uint8_t)(PN&0xFF);
+			std::copy(DHs.cbegin(), DHs.cend(), header+layout::DHs(x3dh_initMessageSize));
+			return headerSize<Curve>() + x3dh_initMessageSize;
+		}
 
 		/**
 		 * @brief parse a buffer to find a header at the begining of it
 		 *
 		 *	it perform some check on DR version byte and key id byte
-		 *	The valid flag is set if a valid header is found in input buffer
+		 *	The valid flag is set if a valid header is found in input buffer.
+		 *	The buffer is read in place: only the header fields are copied, never the rest of the message
+		 *
+		 * @param[in]	header		buffer holding the DR message, the header is at its begining
+		 * @param[in]	headerSize	size of the buffer (not only the header)
 		 */
 		template <typename Curve>
-		DRHeader<Curve>::DRHeader(const std::vector<uint8_t> header) : m_Ns{0},m_PN{0},m_DHs{},m_valid{false},m_size{0}{ // init valid to false and check during parsing if all is ok
+		DRHeader<Curve>::DRHeader(const uint8_t *const header, const size_t headerSize) noexcept : m_Ns{0},m_PN{0},m_DHs{},m_valid{false},m_size{0},m_payload_direct_encryption{false} { // init valid to false and check during parsing if all is ok
+			using layout = DRLayout<Curve>;
 			// make sure we have at least enough data to parse version<1 byte> || message type<1 byte> || curve Id<1 byte> || [x3dh init] || OPk flag without any ulterior checks on size
-			if (header.size()<headerSize<Curve>()) {
+			if (headerSize < double_ratchet_protocol::headerSize<Curve>()) {
 				return; // the valid_flag is false
 			}
 
-			switch (header[0]) { // header[0] contains DR protocol version
+			switch (header[layout::version]) {
 				case lime::double_ratchet_protocol::DR_v01: { // version 0x01 of protocol, see in lime_utils for details
-					if (header[2] != static_cast<uint8_t>(Curve::curveId())) return; // wrong curve in use, return with valid flag false
-					uint8_t messageType = header[1];
+					if (header[layout::curveId] != static_cast<uint8_t>(Curve::curveId())) return; // wrong curve in use, return with valid flag false
 					// Parse the message type byte(see .hpp for mapping):
-					if (messageType & static_cast<uint8_t>(lime::double_ratchet_protocol::DR_message_type::payload_direct_encryption_flag)) {
-						m_payload_direct_encryption = true;
-					} else {
-						m_payload_direct_encryption = false;
-					}
+					const uint8_t messageType = header[layout::messageType];
+					m_payload_direct_encryption = (messageType & static_cast<uint8_t>(lime::double_ratchet_protocol::DR_message_type::payload_direct_encryption_flag)) != 0;
+
+					// the X3DH init message is processed separatly, just skip it: its size is given by its OPk flag, the first byte after the curve id
+					size_t x3dh_initMessageSize = 0;
 					if (messageType & static_cast<uint8_t>(lime::double_ratchet_protocol::DR_message_type::X3DH_init_flag)) {
-						// header is :	Version<1 byte> ||
-						// 		message type <1 byte> ||
-						// 		curve id <1 byte> ||
-						// 		x3dh init message <variable> ||
-						// 		Ns<2 bytes> || PN <2 bytes> ||
-						// 		DHs < X<Curve, lime::Xtype::publicKey>::ssize() >
-						//
-						// x3dh init is : 	haveOPk <flag 1 byte : 0 no OPk, 1 OPk > ||
-						// 			self Ik < DSA<Curve, lime::DSAtype::publicKey>::ssize() bytes > ||
-						// 			Ek < X<Curve, lime::Xtype::publicKey>::keyLenght() bytes > ||
-						// 			peer SPk id < 4 bytes > ||
-						// 			[peer OPk id < 4 bytes >] {0,1} according to haveOPk flag
-						size_t x3dh_initMessageSize = 1 + DSA<Curve, lime::DSAtype::publicKey>::ssize() + X<Curve, lime::Xtype::publicKey>::ssize() + 4; // add size of X3DH init message without OPk
-						if (header[3] == 1) { // there is an OPk
-							x3dh_initMessageSize += 4;
-						}
-						m_size = headerSize<Curve>() + x3dh_initMessageSize;
+						x3dh_initMessageSize = X3DHinitSize<Curve>(header[layout::X3DHinit+layout::OPkFlag] == 1);
+					}
+					m_size = double_ratchet_protocol::headerSize<Curve>() + x3dh_initMessageSize;
 
-						// X3DH init message is processed separatly, just take care of the DR header values
-						if (header.size() >=  m_size) { //header shall be actually longer because buffer pass is the whole message
-							m_Ns = header[3+x3dh_initMessageSize]<<8|header[4+x3dh_initMessageSize];
-							m_PN = header[5+x3dh_initMessageSize]<<8|header[6+x3dh_initMessageSize];
-							m_DHs = X<Curve, lime::Xtype::publicKey>{header.cbegin()+7+x3dh_initMessageSize}; // DH key start after header other infos
-							m_valid = true;
-						}
-					} else { // There is no X3DH init message in the DR header
-						// header is :	Version<1 byte> ||
-						// 		message type <1 byte> ||
-						// 		curve id <1 byte> ||
-						// 		Ns<2 bytes> || PN <2 bytes> ||
-						// 		DHs < X<Curve, lime::Xtype::publicKey>::ssize() >
-						m_size = headerSize<Curve>(); // headerSize is the size when no X3DH init is present
-						if (header.size() >=  m_size) { //header shall be actually longer because buffer pass is the whole message
-							m_Ns = header[3]<<8|header[4];
-							m_PN = header[5]<<8|header[6];
-							m_DHs = X<Curve, lime::Xtype::publicKey>{header.cbegin()+7}; // DH key start after header other infos
-							m_valid = true;
-						}
+					if (headerSize >= m_size) { //header shall be actually longer because buffer pass is the whole message
+						m_Ns = static_cast<uint16_t>(header[layout::Ns(x3dh_initMessageSize)]<<8|header[layout::Ns(x3dh_initMessageSize)+1]);
+						m_PN = static_cast<uint16_t>(header[layout::PN(x3dh_initMessageSize)]<<8|header[layout::PN(x3dh_initMessageSize)+1]);
+						std::copy_n(header+layout::DHs(x3dh_initMessageSize), m_DHs.size(), m_DHs.begin());
+						m_valid = true;
 					}
 				}
 				break;
@@ -312,20 +292,26 @@ namespace lime {
 		//template size_t headerSize<C255>() noexcept;
 		//template size_t X3DHinitSize<C255>(bool haveOPk) noexcept;
 		template void buildMessage_X3DHinit<C255>(std::vector<uint8_t> &message, const DSA<C255, lime::DSAtype::publicKey> &Ik, const X<C255, lime::Xtype::publicKey> &Ek, const uint32_t SPk_id, const uint32_t OPk_id, const bool OPk_flag) noexcept;
-		template void parseMessage_X3DHinit<C255>(const std::vector<uint8_t>message, DSA<C255, lime::DSAtype::publicKey> &Ik, X<C255, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
+		template void parseMessage_X3DHinit<C255>(const std::vector<uint8_t> &message, DSA<C255, lime::DSAtype::publicKey> &Ik, X<C255, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
 		template bool parseMessage_get_X3DHinit<C255>(const std::vector<uint8_t> &message, std::vector<uint8_t> &X3DH_initMessage) noexcept;
-		template void buildMessage_header<C255>(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<C255, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		template void buildMessage_header<C255>(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<C255, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		template size_t buildMessage_header<C255>(uint8_t *const header, const uint16_t Ns, const uint16_t PN, const X<C255, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
 		template class DRHeader<C255>;
+		static_assert(DRLayout<C255>::DHs(0) + X<C255, lime::Xtype::publicKey>::ssize() == headerSize<C255>(), "DR header layout does not match its size");
+		static_assert(DRLayout<C255>::OPkId + 4 == X3DHinitSize<C255>(true), "X3DH init message layout does not match its size");
 #endif
 
 #ifdef EC448_ENABLED
 		//template size_t headerSize<C448>() noexcept;
 		//template size_t X3DHinitSize<C448>(bool haveOPk) noexcept;
 		template void buildMessage_X3DHinit<C448>(std::vector<uint8_t> &message, const DSA<C448, lime::DSAtype::publicKey> &Ik, const X<C448, lime::Xtype::publicKey> &Ek, const uint32_t SPk_id, const uint32_t OPk_id, const bool OPk_flag) noexcept;
-		template void parseMessage_X3DHinit<C448>(const std::vector<uint8_t>message, DSA<C448, lime::DSAtype::publicKey> &Ik, X<C448, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
+		template void parseMessage_X3DHinit<C448>(const std::vector<uint8_t> &message, DSA<C448, lime::DSAtype::publicKey> &Ik, X<C448, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
 		template bool parseMessage_get_X3DHinit<C448>(const std::vector<uint8_t> &message, std::vector<uint8_t> &X3DH_initMessage) noexcept;
-		template void buildMessage_header<C448>(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<C448, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		template void buildMessage_header<C448>(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<C448, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		template size_t buildMessage_header<C448>(uint8_t *const header, const uint16_t Ns, const uint16_t PN, const X<C448, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
 		template class DRHeader<C448>;
+		static_assert(DRLayout<C448>::DHs(0) + X<C448, lime::Xtype::publicKey>::ssize() == headerSize<C448>(), "DR header layout does not match its size");
+		static_assert(DRLayout<C448>::OPkId + 4 == X3DHinitSize<C448>(true), "X3DH init message layout does not match its size");
 #endif
 
 	} // namespace double_ratchet_protocol
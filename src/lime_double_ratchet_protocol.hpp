@@ -36,6 +36,32 @@ namespace lime {
 			return 7 + X<Curve, lime::Xtype::publicKey>::ssize();
 		}
 
+		/**
+		 * @brief offsets of the double ratchet packet header fields, see headerSize and X3DHinitSize for the layout
+		 *
+		 * The fields after the optional X3DH init message are shifted by its size, 0 when there is none
+		 */
+		template <typename Curve>
+		struct DRLayout {
+			static constexpr size_t version = 0; /**< Protocol Version Number */
+			static constexpr size_t messageType = 1; /**< Message Type */
+			static constexpr size_t curveId = 2; /**< curveId */
+			static constexpr size_t X3DHinit = 3; /**< optional X3DH init message */
+			/// Ns offset
+			static constexpr size_t Ns(const size_t X3DHinitSize) noexcept {return X3DHinit + X3DHinitSize;}
+			/// PN offset
+			static constexpr size_t PN(const size_t X3DHinitSize) noexcept {return Ns(X3DHinitSize) + 2;}
+			/// DHs offset
+			static constexpr size_t DHs(const size_t X3DHinitSize) noexcept {return PN(X3DHinitSize) + 2;}
+
+			/* X3DH init message fields, offsets from its begining */
+			static constexpr size_t OPkFlag = 0; /**< OPk flag */
+			static constexpr size_t Ik = 1; /**< sender identity key */
+			static constexpr size_t Ek = Ik + DSA<Curve, lime::DSAtype::publicKey>::ssize(); /**< sender ephemeral key */
+			static constexpr size_t SPkId = Ek + X<Curve, lime::Xtype::publicKey>::ssize(); /**< recipient SPk Id */
+			static constexpr size_t OPkId = SPkId + 4; /**< recipient OPk Id, when the OPk flag is set */
+		};
+
 		/**
 		 * @brief return the size of the X3DH init packet included in the double ratchet packet header
 		 *
@@ -52,13 +78,15 @@ namespace lime {
 		template <typename Curve>
 		void buildMessage_X3DHinit(std::vector<uint8_t> &message, const DSA<Curve, lime::DSAtype::publicKey> &Ik, const X<Curve, lime::Xtype::publicKey> &Ek, const uint32_t SPk_id, const uint32_t OPk_id, const bool OPk_flag) noexcept;
 		template <typename Curve>
-		void parseMessage_X3DHinit(const std::vector<uint8_t>message, DSA<Curve, lime::DSAtype::publicKey> &Ik, X<Curve, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
+		void parseMessage_X3DHinit(const std::vector<uint8_t> &message, DSA<Curve, lime::DSAtype::publicKey> &Ik, X<Curve, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
 
 		template <typename Curve>
 		bool parseMessage_get_X3DHinit(const std::vector<uint8_t> &message, std::vector<uint8_t> &X3DH_initMessage) noexcept;
 
 		template <typename Curve>
-		void buildMessage_header(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<Curve, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		void buildMessage_header(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<Curve, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		template <typename Curve>
+		size_t buildMessage_header(uint8_t *const header, const uint16_t Ns, const uint16_t PN, const X<Curve, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
 
 		/**
 		 * @brief helper class and functions to parse Double Ratchet message header and access its components
@@ -85,28 +113,32 @@ namespace lime {
 				/// what encryption mode is advertised in this header
 				bool payloadDirectEncryption(void) const {return m_payload_direct_encryption;}
 				/// read-only accessor to the size of parsed header
-				size_t size(void) {return m_size;}
+				size_t size(void) const {return m_size;}
 
 				/* ctor/dtor */
 				DRHeader() = delete;
-				DRHeader(const std::vector<uint8_t> header);
+				/// parse the header in place at the begining of a buffer holding the whole DR message, nothing is copied but the header fields
+				DRHeader(const uint8_t *const header, const size_t headerSize) noexcept;
+				DRHeader(const std::vector<uint8_t> &header) noexcept : DRHeader(header.data(), header.size()) {};
 				~DRHeader() {};
 		 };
 
 		/* this templates are intanciated in lime_double_ratchet_procotocol.cpp, do not re-instanciate it anywhere else */
 #ifdef EC25519_ENABLED
 		extern template void buildMessage_X3DHinit<C255>(std::vector<uint8_t> &message, const DSA<C255, lime::DSAtype::publicKey> &Ik, const X<C255, lime::Xtype::publicKey> &Ek, const uint32_t SPk_id, const uint32_t OPk_id, const bool OPk_flag) noexcept;
-		extern template void parseMessage_X3DHinit<C255>(const std::vector<uint8_t>message, DSA<C255, lime::DSAtype::publicKey> &Ik, X<C255, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
+		extern template void parseMessage_X3DHinit<C255>(const std::vector<uint8_t> &message, DSA<C255, lime::DSAtype::publicKey> &Ik, X<C255, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
 		extern template bool parseMessage_get_X3DHinit<C255>(const std::vector<uint8_t> &message, std::vector<uint8_t> &X3DH_initMessage) noexcept;
-		extern template void buildMessage_header<C255>(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<C255, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		extern template void buildMessage_header<C255>(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<C255, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		extern template size_t buildMessage_header<C255>(uint8_t *const header, const uint16_t Ns, const uint16_t PN, const X<C255, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
 		extern template class DRHeader<C255>;
 #endif
 
 #ifdef EC448_ENABLED
 		extern template void buildMessage_X3DHinit<C448>(std::vector<uint8_t> &message, const DSA<C448, lime::DSAtype::publicKey> &Ik, const X<C448, lime::Xtype::publicKey> &Ek, const uint32_t SPk_id, const uint32_t OPk_id, const bool OPk_flag) noexcept;
-		extern template void parseMessage_X3DHinit<C448>(const std::vector<uint8_t>message, DSA<C448, lime::DSAtype::publicKey> &Ik, X<C448, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
+		extern template void parseMessage_X3DHinit<C448>(const std::vector<uint8_t> &message, DSA<C448, lime::DSAtype::publicKey> &Ik, X<C448, lime::Xtype::publicKey> &Ek, uint32_t &SPk_id, uint32_t &OPk_id, bool &OPk_flag) noexcept;
 		extern template bool parseMessage_get_X3DHinit<C448>(const std::vector<uint8_t> &message, std::vector<uint8_t> &X3DH_initMessage) noexcept;
-		extern template void buildMessage_header<C448>(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<C448, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		extern template void buildMessage_header<C448>(std::vector<uint8_t> &header, const uint16_t Ns, const uint16_t PN, const X<C448, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
+		extern template size_t buildMessage_header<C448>(uint8_t *const header, const uint16_t Ns, const uint16_t PN, const X<C448, lime::Xtype::publicKey> &DHs, const std::vector<uint8_t> &X3DH_initMessage, const bool payloadDirectEncryption) noexcept;
 		extern template class DRHeader<C448>;
 #endif
 		/* These constants are needed only for tests purpose, otherwise their usage is internal only to double_ratchet_protocol.hpp */
@@ -115,10 +147,15 @@ namespace lime {
 
 		/** @brief DR message type byte bit mapping
 		 * @code{.unparsed}
-		 * | 7  6  5  4  3  2                1                      0         |
-		 * | <  Unused      > Payload_Direct_Encryption_Flag  X3DH_Init_Flag  |
+		 * | 7  6  5  4  3      2                 1                      0         |
+		 * | <  Unused   > Sender_Key_Flag Payload_Direct_Encryption_Flag  X3DH_Init_Flag  |
 		 * @endcode
 		 *
+		 * Sender_Key_Flag (bit 2):
+		 *      - set  : there is no Double Ratchet packet, the message is only Protocol Version || Message Type || curveId: the
+		 *               recipient already holds the sender key chain the cipher message is encrypted with
+		 *      - unset: the message holds a Double Ratchet packet
+		 *
 		 * Payload_Direct_Encryptiun Flag (bit 1):
 		 *      - set  : the Double Ratchet packet encrypts the user plaintext
 		 *      - unset: the Double Ratchet packet encrypts a random seed used to encrypt the user plaintext
@@ -129,7 +166,8 @@ namespace lime {
 		 */
 		enum class DR_message_type : uint8_t{
 			X3DH_init_flag=0x01, /**< bit 0 */
-			payload_direct_encryption_flag=0x02 /**< bit 1 */
+			payload_direct_encryption_flag=0x02, /**< bit 1 */
+			sender_key_flag=0x04 /**< bit 2 */
 		};
 
 		/** @brief haveOPk byte from X3DH init message mapping
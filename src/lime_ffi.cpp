@@ -83,6 +83,8 @@ static lime::EncryptionPolicy ffi2lime_EncryptionPolicy(const enum lime_ffi_Encr
 			return lime::EncryptionPolicy::optimizeUploadSize;
 		case lime_ffi_EncryptionPolicy_optimizeGlobalBandwidth :
 			return lime::EncryptionPolicy::optimizeGlobalBandwidth;
+		case lime_ffi_EncryptionPolicy_senderKey :
+			return lime::EncryptionPolicy::senderKey;
 		default:
 			return lime::EncryptionPolicy::optimizeUploadSize;
 	}
@@ -233,32 +235,10 @@ int lime_ffi_is_user(lime_manager_t manager, const char *localDeviceId) {
 }
 
 int lime_ffi_encryptOutBuffersMaximumSize(const size_t plainMessageSize, const enum lime_ffi_CurveId curve, size_t *DRmessageSize, size_t *cipherMessageSize) {
-	/* cipherMessage maximum size is plain message size + auth tag size */
-	*cipherMessageSize = plainMessageSize + lime::settings::DRMessageAuthTagSize;
-
-	/* DRmessage maximum size is :
-	 * DRmessage header size + X3DH init size + MAX(plain message size, RandomSeed Size) + auth tag size */
-	*DRmessageSize = std::max(plainMessageSize, lime::settings::DRrandomSeedSize) + lime::settings::DRMessageAuthTagSize;
-
-	switch (curve) {
-		case lime_ffi_CurveId_c25519:
-#ifdef EC25519_ENABLED
-			*DRmessageSize += lime::double_ratchet_protocol::headerSize<C255>() + lime::double_ratchet_protocol::X3DHinitSize<C255>(true);
-#else /* EC25519_ENABLED */
-			return LIME_FFI_INVALID_CURVE_ARGUMENT;
-#endif /* EC25519_ENABLED */
-			break;
-
-		case lime_ffi_CurveId_c448:
-#ifdef EC448_ENABLED
-			*DRmessageSize += lime::double_ratchet_protocol::headerSize<C448>() + lime::double_ratchet_protocol::X3DHinitSize<C448>(true);
-#else /* EC448_ENABLED */
-			return LIME_FFI_INVALID_CURVE_ARGUMENT;
-#endif /* EC448_ENBALED*/
-			break;
-
-		default :
-			return LIME_FFI_INVALID_CURVE_ARGUMENT;
+	try {
+		LimeManager::encryptOutBuffersMaximumSize(plainMessageSize, ffi2lime_CurveId(curve), *DRmessageSize, *cipherMessageSize);
+	} catch (BctbxException const &) {
+		return LIME_FFI_INVALID_CURVE_ARGUMENT;
 	}
 
 	return LIME_FFI_SUCCESS;
@@ -360,6 +340,77 @@ enum lime_ffi_PeerDeviceStatus lime_ffi_decrypt(lime_manager_t manager, const ch
 	}
 }
 
+int lime_ffi_encryptDirect(lime_manager_t manager, const char *localDeviceId,
+		const char *recipientUserId, lime_ffi_RecipientData_t *const recipients, const size_t recipientsSize,
+		const uint8_t *const plainMessage, const size_t plainMessageSize,
+		uint8_t *const cipherMessage, size_t *cipherMessageSize,
+		const lime_ffi_Callback callback, void *callbackUserData,
+		enum lime_ffi_EncryptionPolicy encryptionPolicy) {
+
+	/* lime works on a vector of recipients, the DR messages are copied in the caller's buffers when they are all ready */
+	auto l_recipients = make_shared<std::vector<RecipientData>>();
+	l_recipients->reserve(recipientsSize);
+	for (size_t i=0; i<recipientsSize; i++) {
+		l_recipients->emplace_back(recipients[i].deviceId);
+		// also propagate fail status spotting this entry to be ignored by the encryption engine
+		if (recipients[i].peerStatus == lime_ffi_PeerDeviceStatus_fail) {
+			l_recipients->back().peerStatus = lime::PeerDeviceStatus::fail;
+		}
+	}
+
+	/* the cipher message is written in the caller's buffer before encrypt returns, the callback has only the DR messages to deliver */
+	limeCallback cb([callback, callbackUserData, recipients, l_recipients](const lime::CallbackReturn status, const std::string message){
+			// check all the buffers before writing any so the caller gets one callback, whatever happens
+			for (size_t i=0; i<l_recipients->size(); i++) {
+				if ((*l_recipients)[i].DRmessage.size() > recipients[i].DRmessageSize) {
+					callback(callbackUserData, lime_ffi_CallbackReturn_fail, "DRmessage buffer is too small to hold result");
+					return;
+				}
+			}
+			for (size_t i=0; i<l_recipients->size(); i++) {
+				const auto &l_recipient = (*l_recipients)[i];
+				std::copy_n(l_recipient.DRmessage.begin(), l_recipient.DRmessage.size(), recipients[i].DRmessage);
+				recipients[i].DRmessageSize = l_recipient.DRmessage.size();
+				recipients[i].peerStatus = lime2ffi_PeerDeviceStatus(l_recipient.peerStatus);
+			}
+			callback(callbackUserData, lime2ffi_CallbackReturn(status), message.data());
+		});
+
+	/* encrypts */
+	try {
+		size_t written = 0;
+		manager->context->encrypt(std::string(localDeviceId), std::string(recipientUserId), l_recipients, plainMessage, plainMessageSize, cipherMessage, *cipherMessageSize, written, cb, ffi2lime_EncryptionPolicy(encryptionPolicy));
+		*cipherMessageSize = written;
+	} catch (BctbxException const &e) {
+		LIME_LOGE<<"FFI failed to encrypt: "<<e.str();
+		return LIME_FFI_INTERNAL_ERROR;
+	} catch (exception const &e) { // catch anything
+		LIME_LOGE<<"FFI failed to encrypt: "<<e.what();
+		return LIME_FFI_INTERNAL_ERROR;
+	}
+
+	return LIME_FFI_SUCCESS;
+}
+
+enum lime_ffi_PeerDeviceStatus lime_ffi_decryptDirect(lime_manager_t manager, const char *localDeviceId,
+		const char *recipientUserId, const char *senderDeviceId,
+		const uint8_t *const DRmessage, const size_t DRmessageSize,
+		const uint8_t *const cipherMessage, const size_t cipherMessageSize,
+		uint8_t *const plainMessage, size_t *plainMessageSize) {
+
+	try {
+		size_t written = 0;
+		auto ret = manager->context->decrypt(std::string(localDeviceId), std::string(recipientUserId), std::string(senderDeviceId), DRmessage, DRmessageSize, cipherMessage, cipherMessageSize, plainMessage, *plainMessageSize, written);
+		*plainMessageSize = written;
+		return lime2ffi_PeerDeviceStatus(ret);
+	} catch (BctbxException const &e) {
+		LIME_LOGE<<"FFI failed to decrypt: "<<e.str();
+		return lime_ffi_PeerDeviceStatus_fail;
+	} catch (exception const &e) { // catch anything
+		LIME_LOGE<<"FFI failed to decrypt: "<<e.what();
+		return lime_ffi_PeerDeviceStatus_fail;
+	}
+}
 
 int lime_ffi_manager_destroy(lime_manager_t manager) {
 	manager->context = nullptr;
@@ -471,4 +522,40 @@ int lime_ffi_get_x3dhServerUrl(lime_manager_t manager, const char *localDeviceId
 	}
 }
 
+int lime_ffi_set_metricsEnabled(lime_manager_t manager, const int enabled) {
+	manager->context->set_metricsEnabled(enabled!=0);
+	return LIME_FFI_SUCCESS;
+}
+
+int lime_ffi_get_metrics(lime_manager_t manager, lime_ffi_Metrics_t *metrics) {
+	static_assert(LIME_FFI_METRICS_OPERATIONS_COUNT == lime::metricsOperationsCount, "FFI metrics operations count mismatch");
+	static_assert(LIME_FFI_METRICS_HISTOGRAM_BUCKETS == lime::metricsHistogramBuckets, "FFI metrics histogram size mismatch");
+
+	lime::Metrics cppMetrics{};
+	manager->context->get_metrics(cppMetrics);
+
+	for (size_t i=0; i<lime::metricsOperationsCount; i++) {
+		const auto &op = cppMetrics.operations[i];
+		auto &ffiOp = metrics->operations[i];
+		ffiOp.calls = op.calls;
+		ffiOp.totalTime = op.totalTime;
+		ffiOp.DBTime = op.DBTime;
+		ffiOp.cryptoTime = op.cryptoTime;
+		std::copy_n(op.latencyHistogram.cbegin(), lime::metricsHistogramBuckets, ffiOp.latencyHistogram);
+	}
+	metrics->DRSessionsCacheHits = cppMetrics.DRSessionsCacheHits;
+	metrics->DRSessionsCacheMisses = cppMetrics.DRSessionsCacheMisses;
+	metrics->staleSessionDecrypts = cppMetrics.staleSessionDecrypts;
+	metrics->skippedKeysDerived = cppMetrics.skippedKeysDerived;
+	metrics->DBMutexWaitTime = cppMetrics.DBMutexWaitTime;
+	metrics->usersMutexWaitTime = cppMetrics.usersMutexWaitTime;
+
+	return LIME_FFI_SUCCESS;
+}
+
+int lime_ffi_reset_metrics(lime_manager_t manager) {
+	manager->context->reset_metrics();
+	return LIME_FFI_SUCCESS;
+}
+
 } // extern "C"
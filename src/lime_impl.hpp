@@ -22,15 +22,19 @@
 #include <memory>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <queue>
 #include <mutex>
+#include <chrono>
 
 #include "lime/lime.hpp"
 #include "lime_lime.hpp"
 #include "lime_crypto_primitives.hpp"
 #include "lime_localStorage.hpp"
 #include "lime_double_ratchet.hpp"
+#include "lime_lruCache.hpp"
 #include "lime_x3dh_protocol.hpp"
+#include "lime_sender_key.hpp"
 
 namespace lime {
 	// an enum used by network state engine to manage sequence packet sending(at user creation)
@@ -39,6 +43,12 @@ namespace lime {
 	template <typename Curve>
 	struct callbackUserData;
 
+	template <typename Curve>
+	struct X3DH_senderSecrets; // defined in lime_x3dh.cpp
+
+	template <typename Curve>
+	struct LimeBench; // gives the lime-bench access to the X3DH internals, defined in tester/lime-bench.cpp
+
 	/** @brief Implement the abstract class LimeGeneric
 	 *  @tparam Curve	The elliptic curve to use: C255 or C448
 	 */
@@ -54,6 +64,13 @@ namespace lime {
 			/* X3DH keys */
 			DSApair<Curve> m_Ik; // our identity key pair, is loaded from DB only if requested(to sign a SPK or to perform X3DH init)
 			bool m_Ik_loaded; // did we load the Ik yet?
+			/* SPks read from local storage: the X3DH init messages received in bursts refer to the same one or two SPks. Protected by the local storage mutex */
+			struct cachedSPk {
+				Xpair<Curve> SPk;
+				bool active; // the active SPk is valid until we generate a new one
+				std::chrono::steady_clock::time_point expiry; // a stale SPk is not used from cache after that: it may be deleted from local storage
+			};
+			std::unordered_map<uint32_t, cachedSPk> m_SPk_cache;
 
 			/* local storage related */
 			std::shared_ptr<lime::Db> m_localStorage; // shared pointer would be used/stored in Double Ratchet Sessions
@@ -64,11 +81,28 @@ namespace lime {
 			std::string m_X3DH_Server_URL; // url of x3dh key server
 
 			/* Double ratchet related */
-			std::unordered_map<std::string, std::shared_ptr<DR<Curve>>> m_DR_sessions_cache; // store already loaded DR session
+			LRUCache<std::string, std::shared_ptr<DR<Curve>>> m_DR_sessions_cache; // store already loaded DR session, the least recently used are evicted when its limits are reached
 
-			/* encryption queue: encryption requesting asynchronous operation(connection to X3DH server) are queued to avoid repeating a request to server */
-			std::shared_ptr<callbackUserData<Curve>> m_ongoing_encryption;
+			/* prefetched peer key bundles: used by the next encryption to the device to create a session without contacting the X3DH server */
+			struct cachedPeerBundle {
+				X3DH_peerBundle<Curve> bundle;
+				std::chrono::steady_clock::time_point expiry; // the bundle is not used after that
+			};
+			std::unordered_map<std::string, cachedPeerBundle> m_peerBundles_cache;
+
+			/* encryption queue: encryption requesting a key bundle already being fetched from the X3DH server are queued to avoid repeating a request to server
+			 * fetches of different key bundles run concurrently */
+			std::unordered_set<std::string> m_fetching_bundles; // peer devices whose key bundle is being fetched from the X3DH server
 			std::queue<std::shared_ptr<callbackUserData<Curve>>> m_encryption_queue;
+			/* when retrying the queued encryptions, all the key bundles they miss are fetched in one request to the X3DH server */
+			unsigned int m_coalescing_fetches; // number of queue retries in progress, key bundle requests are held while it is not 0
+			std::shared_ptr<callbackUserData<Curve>> m_coalesced_fetch; // the held request, fetching the key bundles of all the retried encryptions
+			std::shared_ptr<lime::ThreadPool> m_threadPool; // if set, used to encrypt for several recipients in parallel
+			std::shared_ptr<int> m_X3DHRequests; // copied by each pending request to the X3DH server: its use count tells if any is pending
+			/* predictive OPk update: the X3DH server is queried only when the OPks count projected from local storage is low */
+			bool m_OPkPredictiveUpdate;
+			uint32_t m_OPkConsumed; // OPks used by the X3DH init messages received since the last update
+			unsigned int m_OPkPredictiveUpdates; // updates without server query since the last one
 
 			/*** Private functions ***/
 			/* database related functions, implementation is in lime_localStorage.cpp */
@@ -78,28 +112,57 @@ namespace lime {
 			bool activate_user();
 			// user load from DB is implemented directly as a Db member function, output of it is passed to Lime<> ctor
 			void get_SelfIdentityKey(); // check our Identity key pair is loaded in Lime object, retrieve it from DB if it isn't
+			size_t fetch_peerDevicesStatus(const std::vector<std::string> &peerDeviceIds, std::unordered_map<std::string, lime::PeerDeviceStatus> &devicesStatus); // get the peer devices status from the peer devices cache or from local storage, return the number of devices not in cache
 			void cache_DR_sessions(std::vector<RecipientInfos<Curve>> &internal_recipients, std::vector<std::string> &missing_devices); // loop on internal recipient an try to load in DR session cache the one which have no session attached 
 			void get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDRSessionId, std::vector<std::shared_ptr<DR<Curve>>> &DRSessions); // load from local storage in DRSessions all DR session matching the peerDeviceId, ignore the one picked by id in 2nd arg
+			void get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDRSessionId, const X<Curve, lime::Xtype::publicKey> &peerDH, std::vector<std::shared_ptr<DR<Curve>>> &DRSessions); // same but load only the sessions already knowing the peer ratchet public key peerDH
+			bool load_senderKeyChain(const std::string &groupId, SenderKeyChain &chain, long int &skId, std::unordered_set<std::string> &members); // load our sender key chain to a group and the devices holding it
+			void store_senderKeyChain(const std::string &groupId, const SenderKeyChain &chain, const long int skId, const std::vector<std::string> &newMembers); // update our sender key chain to a group, replace it when skId is 0
+			bool load_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, SenderKeyChain &chain, DSA<Curve, lime::DSAtype::publicKey> &senderIk); // load the sender key chain of a peer device to a group and its identity key
+			void store_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, const SenderKeyChain &chain); // insert or update the sender key chain of a peer device to a group
 
 			/* X3DH related  - part related to exchange with server or localStorage - implemented in lime_x3dh_protocol.cpp or lime_localStorage.cpp */
 			void X3DH_generate_SPk(X<Curve, lime::Xtype::publicKey> &publicSPk, DSA<Curve, lime::DSAtype::signature> &SPk_sig, uint32_t &SPk_id, const bool load=false); // generate a new Signed Pre-Key key pair, store it in DB and set its public key, signature and Id in given params
+			void X3DH_generate_keyPairs(std::vector<Xpair<Curve>> &keyPairs); // generate a batch of key pairs, possibly using several threads
 			void X3DH_generate_OPks(std::vector<X<Curve, lime::Xtype::publicKey>> &publicOPks, std::vector<uint32_t> &OPk_ids, const uint16_t OPk_number, const bool load=false); // generate a new batch of OPks, store them in base and fill the vector with information to be sent to X3DH server
 			void X3DH_get_SPk(uint32_t SPk_id, Xpair<Curve> &SPk); // retrieve matching SPk from localStorage, throw an exception if not found
 			bool is_currentSPk_valid(void); // check validity of current SPk
 			void X3DH_get_OPk(uint32_t OPk_id, Xpair<Curve> &OPk); // retrieve matching OPk from localStorage, throw an exception if not found
 			void X3DH_updateOPkStatus(const std::vector<uint32_t> &OPkIds); // update OPks to tag those not anymore on X3DH server but not used and destroyed yet
+			size_t X3DH_get_OPkCount(void); // count the OPks in local storage we expect to be on the X3DH server
+			bool OPk_skipQuery(const uint16_t OPkServerLowLimit); // predictive OPk update: true and start a new period if the OPks projected on server are enough, m_mutex must be held
 			/* X3DH related  - part related to X3DH DR session initiation, implemented in lime_x3dh.cpp */
 			void X3DH_init_sender_session(const std::vector<X3DH_peerBundle<Curve>> &peersBundle); // compute a sender X3DH using the data from peer bundle, then create and load the DR_Session
-			std::shared_ptr<DR<Curve>> X3DH_init_receiver_session(const std::vector<uint8_t> X3DH_initMessage, const std::string &senderDeviceId); // from received X3DH init packet, try to compute the shared secrets, then create the DR_Session
+			void X3DH_init_sender_session(const X3DH_peerBundles<Curve> &peersBundle); // same but reading the bundles directly from the server response
+			void X3DH_create_sender_session(const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, const X<Curve, lime::Xtype::publicKey> &peerSPk, const long int peerDid, const bool haveOPk, const X3DH_senderSecrets<Curve> &secrets); // create and load the DR session from the secrets computed with one key bundle
+			void X3DH_cache_peerBundles(const X3DH_peerBundles<Curve> &peersBundle); // verify the prefetched peer bundles and store them in m_peerBundles_cache
+			void X3DH_init_sender_session_fromCache(std::vector<RecipientInfos<Curve>> &internal_recipients, std::vector<std::string> &missing_devices); // create sessions for the missing devices with a prefetched bundle and attach them to the recipients
+			std::shared_ptr<DR<Curve>> X3DH_init_receiver_session(const std::vector<uint8_t> &X3DH_initMessage, const std::string &senderDeviceId); // from received X3DH init packet, try to compute the shared secrets, then create the DR_Session
 
 			/* network related, implemented in lime_x3dh_protocol.cpp */
 			void postToX3DHServer(std::shared_ptr<callbackUserData<Curve>> userData, const std::vector<uint8_t> &message); // send a request to X3DH server
 			void process_response(std::shared_ptr<callbackUserData<Curve>> userData, int responseCode, const std::vector<uint8_t> &responseBody) noexcept; // callback on server response
 			void cleanUserData(std::shared_ptr<callbackUserData<Curve>> userData); // clean user data
 
+			/* encryption/decryption helpers, implemented in lime.cpp */
+			// encrypt either the plainMessage or the key material of an already streamed cipher message when cipherStreamKey is not null
+			void encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<std::vector<uint8_t>> cipherMessage, std::shared_ptr<const CipherStreamKey> cipherStreamKey, std::shared_ptr<DRMessagesArena> DRmessages, const limeCallback &callback);
+			// attach to the recipients their active DR session from cache, local storage or prefetched key bundles, list in missing_devices the ones still needing a key bundle. m_mutex must be held
+			void get_DR_sessions(const std::vector<RecipientData> &recipients, std::vector<RecipientInfos<Curve>> &internal_recipients, std::vector<std::string> &missing_devices);
+			// multi-process mode: load again the recipients sessions modified in local storage by another process. m_mutex and the database write lock must be held
+			void refresh_DR_sessions(std::vector<RecipientInfos<Curve>> &internal_recipients);
+			// look for the DR session able to decrypt the message and give them to DRdecrypt
+			bool decrypt_withDRSessions(const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::function<std::shared_ptr<DR<Curve>>(std::vector<std::shared_ptr<DR<Curve>>> &)> &DRdecrypt);
+			// sender key policy: distribute our chain to the recipients missing it and encrypt the message with it, return the number of distributions
+			size_t encrypt_senderKey(std::vector<RecipientInfos<Curve>> &internal_recipients, const std::vector<uint8_t> &plainMessage, const std::string &recipientUserId, std::vector<uint8_t> &cipherMessage);
+			// decrypt a message encrypted with the sender key chain of the sender device, store the chain first when the DR message distributes it
+			bool decrypt_senderKey(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage, std::vector<uint8_t> &plainMessage, const SenderKeyMessageType type);
+
+			friend struct LimeBench<Curve>;
+
 		public: /* Implement API defined in lime_lime.hpp in LimeGeneric abstract class */
-			Lime(std::unique_ptr<lime::Db> &&localStorage, const std::string &deviceId, const std::string &url, const limeX3DHServerPostData &X3DH_post_data);
-			Lime(std::unique_ptr<lime::Db> &&localStorage, const std::string &deviceId, const std::string &url, const limeX3DHServerPostData &X3DH_post_data, const long int Uid);
+			Lime(std::shared_ptr<lime::Db> localStorage, const std::string &deviceId, const std::string &url, const limeX3DHServerPostData &X3DH_post_data);
+			Lime(std::shared_ptr<lime::Db> localStorage, const std::string &deviceId, const std::string &url, const limeX3DHServerPostData &X3DH_post_data, const long int Uid);
 			~Lime();
 			Lime(Lime<Curve> &a) = delete; // can't copy a session, force usage of shared pointers
 			Lime<Curve> &operator=(Lime<Curve> &a) = delete; // can't copy a session
@@ -108,11 +171,27 @@ namespace lime {
 			void delete_peerDevice(const std::string &peerDeviceId) override;
 			void update_SPk(const limeCallback &callback) override;
 			void update_OPk(const limeCallback &callback, uint16_t OPkServerLowLimit, uint16_t OPkBatchSize) override;
+			bool defer_update(const uint16_t OPkServerLowLimit) override;
 			void get_Ik(std::vector<uint8_t> &Ik) override;
 			void encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<std::vector<uint8_t>> cipherMessage, const limeCallback &callback) override;
+			void encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<std::vector<uint8_t>> cipherMessage, std::shared_ptr<DRMessagesArena> DRmessages, const limeCallback &callback) override;
+			bool try_encrypt(const std::string &recipientUserId, std::vector<RecipientData> &recipients, const std::vector<uint8_t> &plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::vector<uint8_t> &cipherMessage) override;
 			lime::PeerDeviceStatus decrypt(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage, std::vector<uint8_t> &plainMessage) override;
+			void encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, const limeStreamReader &plainStream, const limeStreamWriter &cipherStream, const limeCallback &callback) override;
+			lime::PeerDeviceStatus decrypt(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const size_t cipherMessageSize, const limeStreamReader &cipherStream, const limeStreamWriter &plainStream) override;
+			void decrypt_batch(std::vector<DecryptionData> &messages) override;
+			void prefetch_sessions(const std::vector<std::string> &peerDeviceIds, const bool fetchPeerBundles, const limeCallback &callback) override;
+			void prefetch_peerBundles(const std::vector<std::string> &peerDeviceIds, const limeCallback &callback) override;
 			void set_x3dhServerUrl(const std::string &x3dhServerUrl) override;
 			std::string get_x3dhServerUrl() override;
+			void set_threadPool(std::shared_ptr<lime::ThreadPool> threadPool) override;
+			void set_OPkPredictiveUpdate(const bool enabled) override;
+			void set_DRSessionsCacheLimits(const size_t maxSessions, const size_t maxMemory) override;
+			bool is_idle() override;
+			void flush() override;
+			void get_DRSessionsCacheUsage(size_t &sessionsCount, size_t &memorySize) override;
+			void get_sessionsSnapshot(std::vector<uint8_t> &snapshot) override;
+			size_t set_sessionsSnapshot(const std::vector<uint8_t> &snapshot) override;
 	};
 
 	/**
@@ -132,33 +211,39 @@ namespace lime {
 		std::shared_ptr<const std::vector<uint8_t>> plainMessage;
 		/// ciphertext buffer. Needed for encryption: get a shared ref to keep params alive
 		std::shared_ptr<std::vector<uint8_t>> cipherMessage;
+		/// key material of an already streamed cipher message, used instead of plainMessage and cipherMessage when set
+		std::shared_ptr<const CipherStreamKey> cipherStreamKey;
+		/// when set, the DR messages are written there instead of the recipients DRmessage
+		std::shared_ptr<DRMessagesArena> DRmessages;
 		/// the encryption policy from the original encryption request(if running an encryption request), copy its value instead of holding a shared_ptr on it
 		lime::EncryptionPolicy encryptionPolicy;
 		/// Used when fetching from server self OPk to check if we shall upload more
 		uint16_t OPkServerLowLimit;
 		/// Used when fetching from server self OPk : how many will we upload if needed
 		uint16_t OPkBatchSize;
+		/// peer devices whose key bundle is fetched by this encryption request
+		std::vector<std::string> peerDevices;
 
 		/// created at user create/delete and keys Post. EncryptionPolicy is not used, set it to the default value anyway
 		callbackUserData(std::weak_ptr<Lime<Curve>> thiz, const limeCallback &callbackRef, uint16_t OPkInitialBatchSize=lime::settings::OPk_initialBatchSize)
 			: limeObj{thiz}, callback{callbackRef},
-			recipientUserId{nullptr}, recipients{nullptr}, plainMessage{nullptr}, cipherMessage{nullptr},
-			encryptionPolicy(lime::EncryptionPolicy::optimizeUploadSize), OPkServerLowLimit(0), OPkBatchSize(OPkInitialBatchSize) {};
+			recipientUserId{nullptr}, recipients{nullptr}, plainMessage{nullptr}, cipherMessage{nullptr}, cipherStreamKey{nullptr}, DRmessages{nullptr},
+			encryptionPolicy(lime::EncryptionPolicy::optimizeUploadSize), OPkServerLowLimit(0), OPkBatchSize(OPkInitialBatchSize), peerDevices{} {};
 
 		/// created at update: getSelfOPks. EncryptionPolicy is not used, set it to the default value anyway
 		callbackUserData(std::weak_ptr<Lime<Curve>> thiz, const limeCallback &callbackRef, uint16_t OPkServerLowLimit, uint16_t OPkBatchSize)
 			: limeObj{thiz}, callback{callbackRef},
-			recipientUserId{nullptr}, recipients{nullptr}, plainMessage{nullptr}, cipherMessage{nullptr},
-			encryptionPolicy(lime::EncryptionPolicy::optimizeUploadSize), OPkServerLowLimit{OPkServerLowLimit}, OPkBatchSize{OPkBatchSize} {};
+			recipientUserId{nullptr}, recipients{nullptr}, plainMessage{nullptr}, cipherMessage{nullptr}, cipherStreamKey{nullptr}, DRmessages{nullptr},
+			encryptionPolicy(lime::EncryptionPolicy::optimizeUploadSize), OPkServerLowLimit{OPkServerLowLimit}, OPkBatchSize{OPkBatchSize}, peerDevices{} {};
 
 		/// created at encrypt(getPeerBundle)
 		callbackUserData(std::weak_ptr<Lime<Curve>> thiz, const limeCallback &callbackRef,
 				std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients,
 				std::shared_ptr<const std::vector<uint8_t>> plainMessage, std::shared_ptr<std::vector<uint8_t>> cipherMessage,
-				lime::EncryptionPolicy policy)
+				lime::EncryptionPolicy policy, std::shared_ptr<const CipherStreamKey> cipherStreamKey=nullptr, std::shared_ptr<DRMessagesArena> DRmessages=nullptr)
 			: limeObj{thiz}, callback{callbackRef},
-			recipientUserId{recipientUserId}, recipients{recipients}, plainMessage{plainMessage}, cipherMessage{cipherMessage}, // copy construct all shared_ptr
-			encryptionPolicy(policy), OPkServerLowLimit(0), OPkBatchSize(0) {};
+			recipientUserId{recipientUserId}, recipients{recipients}, plainMessage{plainMessage}, cipherMessage{cipherMessage}, cipherStreamKey{cipherStreamKey}, DRmessages{DRmessages}, // copy construct all shared_ptr
+			encryptionPolicy(policy), OPkServerLowLimit(0), OPkBatchSize(0), peerDevices{} {};
 
 		/// do not copy callback data, force passing the pointer around after creation
 		callbackUserData(callbackUserData &a) = delete;
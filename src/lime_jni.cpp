@@ -19,6 +19,7 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <jni/jni.hpp>
+#include <functional>
 
 #include "lime_log.hpp"
 #include <lime/lime.hpp>
@@ -119,7 +120,7 @@ static jni::jint c2jCallbackReturn(lime::CallbackReturn status) {
  * @brief convert a int mapped java enumerated encryptionPolicy into a c++ one
  *
  * mapping is :
- * 	DRMESSAGE(0) CIPHERMESSAGE(1) OPTIMIZEUPLOADSIZE(2) OPTIMIZEGLOBALBANDWIDTH(3)
+ * 	DRMESSAGE(0) CIPHERMESSAGE(1) OPTIMIZEUPLOADSIZE(2) OPTIMIZEGLOBALBANDWIDTH(3) SENDERKEY(4)
  *
  * @param[in]	encryptionPolicy	The java mapped integer to an encryption policy enum
  * @return the c++ enumerated encryption policy (silently default to optimizeUploadSize)
@@ -132,6 +133,8 @@ static lime::EncryptionPolicy j2cEncryptionPolicy(jni::jint encryptionPolicy) {
 			return lime::EncryptionPolicy::cipherMessage;
 		case 3:
 			return lime::EncryptionPolicy::optimizeGlobalBandwidth;
+		case 4:
+			return lime::EncryptionPolicy::senderKey;
 		case 2:
 		default:
 			return lime::EncryptionPolicy::optimizeUploadSize;
@@ -158,6 +161,74 @@ static lime::CurveId j2cCurveId(jni::jint curveId) {
 	}
 }
 
+/**
+ * @brief get the JNIEnv of the current thread, attaching it to the JavaVM if it is not already
+ *
+ * The callbacks may be called from native threads(thread pool, update executor, http stack).
+ * A thread attached here stays attached until it exits so it pays the attachment only once.
+ *
+ * @param[in]	vm	the java VM
+ * @return the current thread env
+ */
+static jni::JNIEnv &getAttachedEnv(JavaVM *vm) {
+	thread_local jni::UniqueEnv attachedEnv{}; // detach the thread at its exit, only if we attached it
+	JNIEnv *env = nullptr;
+	if (vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_2) == JNI_OK) {
+		return *env;
+	}
+	attachedEnv = jni::AttachCurrentThread(*vm);
+	return *attachedEnv;
+}
+
+/**
+ * @brief Collect the java callbacks raised by the current thread while a native call from java is running and deliver them at once
+ * on the env given to the native call, when it is done
+ *
+ * A X3DH server response, a batched one in particular, may complete many operations:
+ * their callbacks are then delivered without getting the env for each of them and out of the lime library code.
+ * Batches may nest, the callbacks raised on a thread not running a batch are delivered right away.
+ * A native call throwing shall deliver its batch before forwarding the exception: the callbacks queued before the failure still reach java.
+ */
+class CallbacksBatch {
+	private:
+		std::vector<std::function<void(jni::JNIEnv &)>> m_callbacks;
+		CallbacksBatch *m_previous;
+		static thread_local CallbacksBatch *s_current;
+
+	public:
+		CallbacksBatch() : m_callbacks{}, m_previous{s_current} { s_current = this; };
+		~CallbacksBatch() { if (s_current == this) s_current = m_previous; };
+		CallbacksBatch(const CallbacksBatch &) = delete;
+		CallbacksBatch &operator=(const CallbacksBatch &) = delete;
+
+		/**
+		 * @brief stop collecting and deliver the collected callbacks
+		 * @param[in]	env	the current thread env
+		 */
+		void deliver(jni::JNIEnv &env) {
+			s_current = m_previous; // callbacks raised by the delivered ones are not part of this batch
+			std::vector<std::function<void(jni::JNIEnv &)>> callbacks{};
+			std::swap(callbacks, m_callbacks); // each one is delivered once, even when called again after a callback threw
+			for (auto &callback : callbacks) {
+				callback(env);
+			}
+		}
+
+		/**
+		 * @brief deliver a callback: queue it if the current thread runs a batch, call it right away otherwise
+		 * @param[in]	vm		the java VM
+		 * @param[in]	callback	the java callback call
+		 */
+		static void post(JavaVM *vm, std::function<void(jni::JNIEnv &)> &&callback) {
+			if (s_current != nullptr) {
+				s_current->m_callbacks.push_back(std::move(callback));
+			} else {
+				callback(getAttachedEnv(vm));
+			}
+		}
+};
+thread_local CallbacksBatch *CallbacksBatch::s_current = nullptr;
+
 extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*) {
 
 // java classes we would need to access
@@ -166,13 +237,48 @@ struct jStatusCallback { static constexpr auto Name() { return "org/linphone/lim
 struct jRecipientData { static constexpr auto Name() { return "org/linphone/lime/RecipientData"; } };
 struct jLimeOutputBuffer { static constexpr auto Name() { return "org/linphone/lime/LimeOutputBuffer"; } };
 struct jLimeException { static constexpr auto Name() { return "org/linphone/lime/LimeException"; } };
+struct jByteBuffer { static constexpr auto Name() { return "java/nio/ByteBuffer"; } };
 
 jni::JNIEnv& env { jni::GetEnv(*vm) };
 
+/**
+ * @brief Global references on the java classes and ids of the methods and fields used by the binding
+ *
+ * Looked up once, on a java thread: the native threads would pay the lookups at each call
+ * and may not even find the application classes with their class loader.
+ * Shared by a manager with its pending callbacks so it outlives the manager if needed.
+ */
+struct jClassesCache {
+	jni::Global<jni::Class<jPostToX3DH>, jni::EnvGettingDeleter> PostClass;
+	jni::Method<jPostToX3DH, void (jni::jlong, jni::String, jni::String, jni::Array<jni::jbyte>)> PostMethod;
+	jni::Global<jni::Class<jStatusCallback>, jni::EnvGettingDeleter> StatusClass;
+	jni::Method<jStatusCallback, void (jni::jint, jni::String)> StatusMethod;
+	jni::Global<jni::Class<jRecipientData>, jni::EnvGettingDeleter> RecipientDataClass;
+	jni::Field<jRecipientData, jni::String> RecipientDataDeviceIdField;
+	jni::Field<jRecipientData, jni::jint> RecipientDataPeerStatusField;
+	jni::Field<jRecipientData, jni::Array<jni::jbyte>> RecipientDataDRmessageField;
+	jni::Global<jni::Class<jLimeOutputBuffer>, jni::EnvGettingDeleter> LimeOutputBufferClass;
+	jni::Field<jLimeOutputBuffer, jni::Array<jni::jbyte>> LimeOutputBufferField;
+
+	jClassesCache(jni::JNIEnv &env) :
+		PostClass{jni::NewGlobal<jni::EnvGettingDeleter>(env, jni::Class<jPostToX3DH>::Find(env))},
+		PostMethod{PostClass.GetMethod<void (jni::jlong, jni::String, jni::String, jni::Array<jni::jbyte>)>(env, "postToX3DHServer")},
+		StatusClass{jni::NewGlobal<jni::EnvGettingDeleter>(env, jni::Class<jStatusCallback>::Find(env))},
+		StatusMethod{StatusClass.GetMethod<void (jni::jint, jni::String)>(env, "callback")},
+		RecipientDataClass{jni::NewGlobal<jni::EnvGettingDeleter>(env, jni::Class<jRecipientData>::Find(env))},
+		RecipientDataDeviceIdField{RecipientDataClass.GetField<jni::String>(env, "deviceId")},
+		RecipientDataPeerStatusField{RecipientDataClass.GetField<jni::jint>(env, "peerStatus")},
+		RecipientDataDRmessageField{RecipientDataClass.GetField<jni::Array<jni::jbyte>>(env, "DRmessage")},
+		LimeOutputBufferClass{jni::NewGlobal<jni::EnvGettingDeleter>(env, jni::Class<jLimeOutputBuffer>::Find(env))},
+		LimeOutputBufferField{LimeOutputBufferClass.GetField<jni::Array<jni::jbyte>>(env, "buffer")} {};
+	jClassesCache(const jClassesCache&) = delete; // noncopyable
+};
+
 
 struct jLimeManager {
 	static constexpr auto Name() { return "org/linphone/lime/LimeManager"; } // bind this class to the java LimeManager Class
 
+	std::shared_ptr<jClassesCache> m_jcache; /**< the java classes, methods and fields used by this manager and its callbacks */
 	std::unique_ptr<lime::LimeManager> m_manager; /**< a unique pointer to the actual lime manager */
 	jni::Global<jni::Object<jPostToX3DH>, jni::EnvGettingDeleter> jGlobalPostObj; /**< a global reference to the java postToX3DH object. TODO: unclear if EnvIgnoringDeleter is not a better fit here. */
 
@@ -181,11 +287,88 @@ struct jLimeManager {
 		env.ThrowNew(LimeExceptionClass, message.data());
 	}
 
+	/**
+	 * @brief get the address of a slice of a direct ByteBuffer, checking it is inside the buffer
+	 *
+	 * @param[in]	jbuffer	a direct ByteBuffer
+	 * @param[in]	offset	offset of the slice in the buffer
+	 * @param[in]	size	size of the slice
+	 * @return a pointer to the slice in the java buffer memory, throw an exception if the buffer is not direct or too small
+	 */
+	static uint8_t *directBufferSlice(jni::JNIEnv &env, jni::Object<jByteBuffer> &jbuffer, const jni::jint offset, const jni::jint size) {
+		auto address = static_cast<uint8_t *>(env.GetDirectBufferAddress(jni::Unwrap(jbuffer.get())));
+		if (address == nullptr) {
+			throw BCTBX_EXCEPTION << "ByteBuffer is not a direct one";
+		}
+		const auto capacity = env.GetDirectBufferCapacity(jni::Unwrap(jbuffer.get()));
+		if (offset < 0 || size < 0 || static_cast<jlong>(offset) + size > capacity) {
+			throw BCTBX_EXCEPTION << "ByteBuffer slice ["<<offset<<", "<<offset<<"+"<<size<<"[ is out of its "<<capacity<<" bytes";
+		}
+		return address + offset;
+	}
+
+	/**
+	 * @brief turn an array of java RecipientData into a vector of recipientData, only the device Id and peer status are read
+	 */
+	static std::shared_ptr<std::vector<lime::RecipientData>> j2cRecipients(jni::JNIEnv &env, const jClassesCache &jcache, jni::Array<jni::Object<jRecipientData>> &jrecipients) {
+		auto recipients = std::make_shared<std::vector<lime::RecipientData>>();
+		auto jrecipientsSize = jrecipients.Length(env);
+
+		recipients->reserve(jrecipientsSize);
+		for (size_t i=0; i<jrecipientsSize; i++) {
+			auto recipient = jrecipients.Get(env, i);
+			recipients->emplace_back(jni::Make<std::string>(env, recipient.Get(env, jcache.RecipientDataDeviceIdField)));
+			recipients->back().peerStatus = j2cPeerDeviceStatus(recipient.Get(env, jcache.RecipientDataPeerStatusField));
+		}
+		return recipients;
+	}
+
+	/**
+	 * @brief copy back to the java RecipientData the peerStatus and DRmessage produced by an encryption
+	 */
+	static void c2jRecipients(jni::JNIEnv &env, const jClassesCache &jcache, const jni::Array<jni::Object<jRecipientData>> &jrecipients, const std::vector<lime::RecipientData> &recipients) {
+		for (size_t i=0; i<recipients.size(); i++) {
+			auto jrecipient = jrecipients.Get(env, i); // recipient is the recipientData javaObject
+			jrecipient.Set(env, jcache.RecipientDataPeerStatusField, c2jPeerDeviceStatus(recipients[i].peerStatus));
+			auto jDRmessage = jni::Make<jni::Array<jni::jbyte>>(env, reinterpret_cast<const std::vector<int8_t>&>(recipients[i].DRmessage));
+			jrecipient.Set(env, jcache.RecipientDataDRmessageField, jDRmessage);
+		}
+	}
+
+	/**
+	 * @brief build a lime callback calling the given java LimeStatusCallback object
+	 *
+	 * The java callback is delivered through CallbacksBatch: in the batch of the current native call if any, on the current thread(attached if needed) otherwise.
+	 *
+	 * @param[in]	jstatusObj	the java LimeStatusCallback object, a global reference on it is held by the callback
+	 * @param[in]	outputs		when not nullptr, called before the java callback to set the operation outputs on the java side
+	 * @return the lime callback
+	 */
+	lime::limeCallback makeStatusCallback(jni::JNIEnv &env, jni::Object<jStatusCallback> &jstatusObj, std::function<void(jni::JNIEnv &)> &&outputs=nullptr) {
+		JavaVM *c_vm;
+		env.GetJavaVM(&c_vm);
+
+		// Here we create a global java reference on our object so we won't loose it even if this is called after the current java call
+		// This global java reference is given in a unique pointer(why??), so just turn it into a shared one so we can copy it into the closure
+		auto jstatusObjRef = std::make_shared<jni::Global<jni::Object<jStatusCallback>, jni::EnvGettingDeleter>>(jni::NewGlobal<jni::EnvGettingDeleter>(env, jstatusObj));
+		auto jcache = m_jcache;
+
+		return [c_vm, jcache, jstatusObjRef, outputs](const lime::CallbackReturn status, const std::string message) {
+			CallbacksBatch::post(c_vm, [jcache, jstatusObjRef, outputs, status, message](jni::JNIEnv &g_env) {
+				if (outputs) {
+					outputs(g_env);
+				}
+				// call the callback on the statusObj we got in param
+				jstatusObjRef->Call(g_env, jcache->StatusMethod, c2jCallbackReturn(status), jni::Make<jni::String>(g_env, message));
+			});
+		};
+	}
+
 	/** @brief Constructor
 	 * unlike the native lime manager constructor, this one get only one argument has cpp closure cannot be passed easily to java
 	 * @param[in]	db_access	the database access path
 	 */
-	jLimeManager(JNIEnv &env, const jni::String &db_access, jni::Object<jPostToX3DH> &jpostObj) : jGlobalPostObj{jni::NewGlobal<jni::EnvGettingDeleter>(env, jpostObj)} {
+	jLimeManager(JNIEnv &env, const jni::String &db_access, jni::Object<jPostToX3DH> &jpostObj) : m_jcache{std::make_shared<jClassesCache>(env)}, jGlobalPostObj{jni::NewGlobal<jni::EnvGettingDeleter>(env, jpostObj)} {
 		// turn the argument into a cpp string
 		std::string cpp_db_access = jni::Make<std::string>(env, db_access);
 
@@ -197,16 +380,13 @@ struct jLimeManager {
 		auto thiz = this;
 
 		m_manager = std::make_unique<lime::LimeManager>(cpp_db_access, [c_vm, thiz](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const lime::limeX3DHServerResponseProcess &responseProcess){
-			//  (TODO? make sure the current process is attached?)
-			jni::JNIEnv& g_env { jni::GetEnv(*c_vm)};
+			// posts may be issued from native threads(ie: update pipeline executor), attach it if needed
+			jni::JNIEnv& g_env { getAttachedEnv(c_vm) };
 			// Create a Cpp object to hold the reponseProcess closure (cannot give a stateful function to the java side)
 			auto process = new responseHolder(responseProcess);
-			// retrieve the postToX3DHServer  method
-			auto PostClass = jni::Class<jPostToX3DH>::Find(g_env);
-			auto PostMethod = PostClass.GetMethod<void (jni::jlong, jni::String, jni::String, jni::Array<jni::jbyte>)>(g_env, "postToX3DHServer");
 
 			// Call the postToX3DHServer method passing it our pointer holding the response process object
-			thiz->jGlobalPostObj.Call(g_env, PostMethod, jni::jlong(process), jni::Make<jni::String>(g_env, url), jni::Make<jni::String>(g_env, from), jni::Make<jni::Array<jni::jbyte>>(g_env, reinterpret_cast<const std::vector<int8_t>&>(message)));
+			thiz->jGlobalPostObj.Call(g_env, thiz->m_jcache->PostMethod, jni::jlong(process), jni::Make<jni::String>(g_env, url), jni::Make<jni::String>(g_env, from), jni::Make<jni::Array<jni::jbyte>>(g_env, reinterpret_cast<const std::vector<int8_t>&>(message)));
 		});
 	}
 
@@ -220,23 +400,7 @@ struct jLimeManager {
 
 	void create_user(jni::JNIEnv &env, const jni::String &localDeviceId, const jni::String &serverUrl, const jni::jint jcurveId, const jni::jint jOPkInitialBatchSize, jni::Object<jStatusCallback> &jstatusObj ) {
 		LIME_LOGD<<"JNI create_user user "<<jni::Make<std::string>(env, localDeviceId)<<" url "<<jni::Make<std::string>(env, serverUrl);
-		JavaVM *c_vm;
-		env.GetJavaVM(&c_vm);
-
-		// Here we create a global java reference on our object so we won't loose it even if this is called after the current java call
-		// This global java reference is given in a unique pointer(why??), so just turn it into a shared one so we can copy it into the closure
-		// We could move it to the closure, but it is itself copied into the create_user argument so it would fail
-		// Another solution would be to modify the create_user to have it moving the closure and not copying it, it will be used just once anyway
-		auto jstatusObjRef = std::make_shared<jni::Global<jni::Object<jStatusCallback>, jni::EnvGettingDeleter>>(jni::NewGlobal<jni::EnvGettingDeleter>(env, jstatusObj));
-
-		auto callback_lambda = [c_vm, jstatusObjRef](const lime::CallbackReturn status, const std::string message){
-					// get the env from VM, and retrieve the callback method on StatusCallback class
-					jni::JNIEnv& g_env { jni::GetEnv(*c_vm)};
-					auto StatusClass = jni::Class<jStatusCallback>::Find(g_env);
-					auto StatusMethod = StatusClass.GetMethod<void (jni::jint, jni::String)>(g_env, "callback");
-					// call the callback on the statusObj we got in param when calling create_user
-					jstatusObjRef->Call(g_env, StatusMethod, c2jCallbackReturn(status), jni::Make<jni::String>(g_env, message));
-				};
+		auto callback_lambda = makeStatusCallback(env, jstatusObj);
 
 		try {
 			m_manager->create_user( jni::Make<std::string>(env, localDeviceId),
@@ -251,20 +415,7 @@ struct jLimeManager {
 
 	void delete_user(jni::JNIEnv &env, const jni::String &localDeviceId, jni::Object<jStatusCallback> &jstatusObj ) {
 		LIME_LOGD<<"JNI delete_user user "<<jni::Make<std::string>(env, localDeviceId)<<std::endl;
-		JavaVM *c_vm;
-		env.GetJavaVM(&c_vm);
-
-		// see create_user for details on this
-		auto jstatusObjRef = std::make_shared<jni::Global<jni::Object<jStatusCallback>, jni::EnvGettingDeleter>>(jni::NewGlobal<jni::EnvGettingDeleter>(env, jstatusObj));
-
-		auto callback_lambda = [c_vm, jstatusObjRef](const lime::CallbackReturn status, const std::string message){
-					// get the env from VM, and retrieve the callback method on StatusCallback class
-					jni::JNIEnv& g_env { jni::GetEnv(*c_vm)};
-					auto StatusClass = jni::Class<jStatusCallback>::Find(g_env);
-					auto StatusMethod = StatusClass.GetMethod<void (jni::jint, jni::String)>(g_env, "callback");
-					// call the callback on the statusObj we got in param when calling create_user
-					jstatusObjRef->Call(g_env, StatusMethod, c2jCallbackReturn(status), jni::Make<jni::String>(g_env, message));
-				};
+		auto callback_lambda = makeStatusCallback(env, jstatusObj);
 
 		try {
 			m_manager->delete_user( jni::Make<std::string>(env, localDeviceId), callback_lambda);
@@ -294,9 +445,6 @@ struct jLimeManager {
 			jni::Object<jStatusCallback> &jstatusObj,
 			jni::jint encryptionPolicy) {
 
-		JavaVM *c_vm;
-		env.GetJavaVM(&c_vm);
-
 		LIME_LOGD<<"JNI Encrypt from "<<(jni::Make<std::string>(env, jlocalDeviceId))<<" to user "<<(jni::Make<std::string>(env, jrecipientUserId))<<" to "<<jrecipients.Length(env)<<" recipients"<<std::endl;
 
 		// turn the plain message byte array into a vector of uint8_t
@@ -306,66 +454,40 @@ struct jLimeManager {
 		auto cipherMessage = std::make_shared<std::vector<uint8_t>>();
 
 		// turn the array of jRecipientData into a vector of recipientData
-		auto recipients = std::make_shared<std::vector<lime::RecipientData>>();
-		auto RecipientDataClass = jni::Class<jRecipientData>::Find(env);
-		auto RecipientDataDeviceIdField = RecipientDataClass.GetField<jni::String>(env, "deviceId");
-		auto RecipientDataPeerStatusField = RecipientDataClass.GetField<jni::jint>(env, "peerStatus");
-		auto jrecipientsSize = jrecipients.Length(env);
-
-		for (size_t i=0; i<jrecipientsSize; i++) {
-			auto recipient = jrecipients.Get(env, i);
-			recipients->emplace_back(jni::Make<std::string>(env, recipient.Get(env, RecipientDataDeviceIdField)));
-			recipients->back().peerStatus = j2cPeerDeviceStatus(recipient.Get(env, RecipientDataPeerStatusField));
-		}
+		auto recipients = j2cRecipients(env, *m_jcache, jrecipients);
 
 		// we must have shared_pointer for recipientUserId
 		auto recipientUserId = std::make_shared<std::string>(jni::Make<std::string>(env, jrecipientUserId));
 
-		// see create_user for details on this
-		auto jstatusObjRef = std::make_shared<jni::Global<jni::Object<jStatusCallback>, jni::EnvGettingDeleter>>(jni::NewGlobal<jni::EnvGettingDeleter>(env, jstatusObj));
+		// see makeStatusCallback for details on this
 		auto jrecipientsRef = std::make_shared<jni::Global<jni::Array<jni::Object<jRecipientData>>, jni::EnvGettingDeleter>>(jni::NewGlobal<jni::EnvGettingDeleter>(env, jrecipients));
 		auto jcipherMessageRef = std::make_shared<jni::Global<jni::Object<jLimeOutputBuffer>, jni::EnvGettingDeleter>>(jni::NewGlobal<jni::EnvGettingDeleter>(env, jcipherMessage));
+		auto jcache = m_jcache;
 
-		m_manager->encrypt(jni::Make<std::string>(env, jlocalDeviceId),
-			recipientUserId,
-			recipients,
-			plainMessage,
-			cipherMessage,
-			[c_vm, jstatusObjRef, jrecipientsRef, jcipherMessageRef, recipients, cipherMessage] (const lime::CallbackReturn status, const std::string message) {
-				// get the env from VM
-				jni::JNIEnv& g_env { jni::GetEnv(*c_vm)};
-
-				// access to java RecipientData fields
-				auto RecipientDataClass = jni::Class<jRecipientData>::Find(g_env);
-				auto RecipientDataPeerStatusField = RecipientDataClass.GetField<jni::jint>(g_env, "peerStatus");
-				auto RecipientDataDRmessageField = RecipientDataClass.GetField<jni::Array<jni::jbyte>>(g_env, "DRmessage");
-
-				// retrieve the cpp recipients vector and copy back to the jrecipients the peerStatus and DRmessage(if any)
-				for (size_t i=0; i<recipients->size(); i++) {
-					auto jrecipient = jrecipientsRef->Get(g_env, i); // recipient is the recipientData javaObject
-					jrecipient.Set(g_env, RecipientDataPeerStatusField, c2jPeerDeviceStatus((*recipients)[i].peerStatus));
-					auto jDRmessage = jni::Make<jni::Array<jni::jbyte>>(g_env, reinterpret_cast<const std::vector<int8_t>&>((*recipients)[i].DRmessage));
-					jrecipient.Set(g_env, RecipientDataDRmessageField, jDRmessage);
-				}
-
-				// retrieve the LimeOutputBuffer class
-				auto LimeOutputBufferClass = jni::Class<jLimeOutputBuffer>::Find(g_env);
-				auto LimeOutputBufferField = LimeOutputBufferClass.GetField<jni::Array<jni::jbyte>>(g_env, "buffer");
-
-				// get the cipherMessage out
-				// Can't use directly a byte[] in parameter (as we must create it from c++ code) so use an dedicated class encapsulating a byte[]
-				auto jcipherMessageArray = jni::Make<jni::Array<jni::jbyte>>(g_env, reinterpret_cast<const std::vector<int8_t>&>(*cipherMessage));
-				jcipherMessageRef->Set(g_env, LimeOutputBufferField, jcipherMessageArray);
-
-				// retrieve the callback method on StatusCallback class
-				auto StatusClass = jni::Class<jStatusCallback>::Find(g_env);
-				auto StatusMethod = StatusClass.GetMethod<void (jni::jint, jni::String)>(g_env, "callback");
-
-				// call the callback on the statusObj we got in param when calling create_user
-				jstatusObjRef->Call(g_env, StatusMethod, c2jCallbackReturn(status), jni::Make<jni::String>(g_env, message));
-			},
-			j2cEncryptionPolicy(encryptionPolicy)
-		);
+		// when all sessions are already there, the callback is called before encrypt returns: deliver it on this env
+		CallbacksBatch batch{};
+		try {
+			m_manager->encrypt(jni::Make<std::string>(env, jlocalDeviceId),
+				recipientUserId,
+				recipients,
+				plainMessage,
+				cipherMessage,
+				makeStatusCallback(env, jstatusObj, [jcache, jrecipientsRef, jcipherMessageRef, recipients, cipherMessage] (jni::JNIEnv &g_env) {
+					// retrieve the cpp recipients vector and copy back to the jrecipients the peerStatus and DRmessage(if any)
+					c2jRecipients(g_env, *jcache, *jrecipientsRef, *recipients);
+
+					// get the cipherMessage out
+					// Can't use directly a byte[] in parameter (as we must create it from c++ code) so use an dedicated class encapsulating a byte[]
+					auto jcipherMessageArray = jni::Make<jni::Array<jni::jbyte>>(g_env, reinterpret_cast<const std::vector<int8_t>&>(*cipherMessage));
+					jcipherMessageRef->Set(g_env, jcache->LimeOutputBufferField, jcipherMessageArray);
+				}),
+				j2cEncryptionPolicy(encryptionPolicy)
+			);
+		} catch (...) { // the callbacks queued before the failure still reach java
+			batch.deliver(env);
+			throw;
+		}
+		batch.deliver(env);
 	}
 
 	jni::jint decrypt(jni::JNIEnv &env,  const jni::String &jlocalDeviceId,  const jni::String &jrecipientUserId, const jni::String &jsenderDeviceId,
@@ -390,53 +512,129 @@ struct jLimeManager {
 					*cipherMessage,
 					plainMessage);
 
-		// retrieve the LimeOutputBuffer class
-		auto LimeOutputBufferClass = jni::Class<jLimeOutputBuffer>::Find(env);
-		auto LimeOutputBufferField = LimeOutputBufferClass.GetField<jni::Array<jni::jbyte>>(env, "buffer");
-
-		// get the cipherMessage out
+		// get the plainMessage out
 		// Can't use directly a byte[] in parameter (as we must create it from c++ code) so use an dedicated class encapsulating a byte[]
 		auto jplainMessageArray = jni::Make<jni::Array<jni::jbyte>>(env, reinterpret_cast<const std::vector<int8_t>&>(plainMessage));
-		jplainMessage.Set(env, LimeOutputBufferField, jplainMessageArray);
+		jplainMessage.Set(env, m_jcache->LimeOutputBufferField, jplainMessageArray);
 
 		return c2jPeerDeviceStatus(status);
 	}
 
-	void update(jni::JNIEnv &env, jni::Object<jStatusCallback> &jstatusObj, jni::jint jOPkServerLowLimit, jni::jint jOPkBatchSize) {
-		JavaVM *c_vm;
-		env.GetJavaVM(&c_vm);
+	/**
+	 * @brief encrypt reading the plain message from and writing the cipher message to direct ByteBuffers, no copy is made on the way
+	 *
+	 * The cipher message, if any, is written before this function returns so the buffers are not referenced after it.
+	 * The DR messages are still given back in the recipients array when the callback is called.
+	 *
+	 * @return the size of the cipher message written at cipherOffset in the cipher buffer, 0 when the payload is in the DR messages
+	 */
+	jni::jint encryptDirect(jni::JNIEnv &env,  const jni::String &jlocalDeviceId,  const jni::String &jrecipientUserId, jni::Array<jni::Object<jRecipientData>> &jrecipients,
+			jni::Object<jByteBuffer> &jplainMessage, const jni::jint plainOffset, const jni::jint plainSize,
+			jni::Object<jByteBuffer> &jcipherMessage, const jni::jint cipherOffset, const jni::jint cipherMaxSize,
+			jni::Object<jStatusCallback> &jstatusObj,
+			jni::jint encryptionPolicy) {
 
-		LIME_LOGD<<"JNI update";
+		LIME_LOGD<<"JNI Encrypt(direct buffers) from "<<(jni::Make<std::string>(env, jlocalDeviceId))<<" to user "<<(jni::Make<std::string>(env, jrecipientUserId))<<" to "<<jrecipients.Length(env)<<" recipients"<<std::endl;
 
-		// see create_user for details on this
-		auto jstatusObjRef = std::make_shared<jni::Global<jni::Object<jStatusCallback>, jni::EnvGettingDeleter>>(jni::NewGlobal<jni::EnvGettingDeleter>(env, jstatusObj));
+		try {
+			const auto plainMessage = directBufferSlice(env, jplainMessage, plainOffset, plainSize);
+			auto cipherMessage = directBufferSlice(env, jcipherMessage, cipherOffset, cipherMaxSize);
 
-		m_manager->update([c_vm, jstatusObjRef] (const lime::CallbackReturn status, const std::string message)
-				{
-					// get the env from VM
-					jni::JNIEnv& g_env { jni::GetEnv(*c_vm)};
+			auto recipients = j2cRecipients(env, *m_jcache, jrecipients);
 
-					// retrieve the callback method on StatusCallback class
-					auto StatusClass = jni::Class<jStatusCallback>::Find(g_env);
-					auto StatusMethod = StatusClass.GetMethod<void (jni::jint, jni::String)>(g_env, "callback");
+			// see makeStatusCallback for details on this
+			auto jrecipientsRef = std::make_shared<jni::Global<jni::Array<jni::Object<jRecipientData>>, jni::EnvGettingDeleter>>(jni::NewGlobal<jni::EnvGettingDeleter>(env, jrecipients));
+			auto jcache = m_jcache;
 
-					// call the callback on the statusObj we got in param when calling create_user
-					jstatusObjRef->Call(g_env, StatusMethod, c2jCallbackReturn(status), jni::Make<jni::String>(g_env, message));
-				},
-				jOPkServerLowLimit, jOPkBatchSize);
+			size_t cipherMessageSize = 0;
+			CallbacksBatch batch{};
+			try {
+				m_manager->encrypt(jni::Make<std::string>(env, jlocalDeviceId),
+					jni::Make<std::string>(env, jrecipientUserId),
+					recipients,
+					plainMessage, static_cast<size_t>(plainSize),
+					cipherMessage, static_cast<size_t>(cipherMaxSize), cipherMessageSize,
+					makeStatusCallback(env, jstatusObj, [jcache, jrecipientsRef, recipients] (jni::JNIEnv &g_env) {
+						// copy back to the jrecipients the peerStatus and DRmessage(if any), the cipher message is already in the caller's buffer
+						c2jRecipients(g_env, *jcache, *jrecipientsRef, *recipients);
+					}),
+					j2cEncryptionPolicy(encryptionPolicy)
+				);
+			} catch (...) { // deliver the queued callbacks before the exception is converted to a java one
+				batch.deliver(env);
+				throw;
+			}
+			batch.deliver(env);
+			return static_cast<jni::jint>(cipherMessageSize);
+		} catch (BctbxException const &e) {
+			ThrowJavaLimeException(env, e.str());
+		} catch (std::exception const &e) { // catch anything
+			ThrowJavaLimeException(env, e.what());
+		}
+		return 0;
 	}
 
-	void get_selfIdentityKey(jni::JNIEnv &env, const jni::String &jlocalDeviceId, jni::Object<jLimeOutputBuffer> &jIk) {
+	/**
+	 * @brief decrypt reading the DR and cipher messages from and writing the plain message to direct ByteBuffers, no copy is made on the way
+	 *
+	 * @return the plain message size written at plainOffset in the plain buffer shifted left by 8 bits, ORed with the peer device status
+	 */
+	jni::jlong decryptDirect(jni::JNIEnv &env,  const jni::String &jlocalDeviceId,  const jni::String &jrecipientUserId, const jni::String &jsenderDeviceId,
+			jni::Object<jByteBuffer> &jDRmessage, const jni::jint DRoffset, const jni::jint DRsize,
+			jni::Object<jByteBuffer> &jcipherMessage, const jni::jint cipherOffset, const jni::jint cipherSize,
+			jni::Object<jByteBuffer> &jplainMessage, const jni::jint plainOffset, const jni::jint plainMaxSize) {
+
+		LIME_LOGD<<"JNI Decrypt(direct buffers) from "<<(jni::Make<std::string>(env, jsenderDeviceId))<<" for user "<<(jni::Make<std::string>(env, jrecipientUserId))<<" (device : "<<(jni::Make<std::string>(env, jlocalDeviceId))<<")"<<std::endl;
+
+		try {
+			const auto DRmessage = directBufferSlice(env, jDRmessage, DRoffset, DRsize);
+			// the cipher message is optional
+			const uint8_t *cipherMessage = nullptr;
+			size_t cipherMessageSize = 0;
+			if (jcipherMessage.get() != nullptr && cipherSize > 0) {
+				cipherMessage = directBufferSlice(env, jcipherMessage, cipherOffset, cipherSize);
+				cipherMessageSize = static_cast<size_t>(cipherSize);
+			}
+			auto plainMessage = directBufferSlice(env, jplainMessage, plainOffset, plainMaxSize);
+
+			size_t plainMessageSize = 0;
+			auto status = m_manager->decrypt(jni::Make<std::string>(env, jlocalDeviceId),
+						jni::Make<std::string>(env, jrecipientUserId),
+						jni::Make<std::string>(env, jsenderDeviceId),
+						DRmessage, static_cast<size_t>(DRsize),
+						cipherMessage, cipherMessageSize,
+						plainMessage, static_cast<size_t>(plainMaxSize), plainMessageSize);
+
+			return (static_cast<jni::jlong>(plainMessageSize)<<8) | c2jPeerDeviceStatus(status);
+		} catch (BctbxException const &e) {
+			ThrowJavaLimeException(env, e.str());
+		} catch (std::exception const &e) { // catch anything
+			ThrowJavaLimeException(env, e.what());
+		}
+		return c2jPeerDeviceStatus(lime::PeerDeviceStatus::fail);
+	}
+
+	void update(jni::JNIEnv &env, jni::Object<jStatusCallback> &jstatusObj, jni::jint jOPkServerLowLimit, jni::jint jOPkBatchSize) {
+		LIME_LOGD<<"JNI update";
+
+		// with no users or only deferred ones, the callback is called before update returns: deliver it on this env
+		CallbacksBatch batch{};
 		try {
-			// retrieve the LimeOutputBuffer class
-			auto LimeOutputBufferClass = jni::Class<jLimeOutputBuffer>::Find(env);
-			auto LimeOutputBufferField = LimeOutputBufferClass.GetField<jni::Array<jni::jbyte>>(env, "buffer");
+			m_manager->update(makeStatusCallback(env, jstatusObj), jOPkServerLowLimit, jOPkBatchSize);
+		} catch (...) { // the users updates completed before the failure still report their status to java
+			batch.deliver(env);
+			throw;
+		}
+		batch.deliver(env);
+	}
 
+	void get_selfIdentityKey(jni::JNIEnv &env, const jni::String &jlocalDeviceId, jni::Object<jLimeOutputBuffer> &jIk) {
+		try {
 			// get the Ik
 			std::vector<uint8_t> Ik{};
 			m_manager->get_selfIdentityKey(jni::Make<std::string>(env, jlocalDeviceId), Ik);
 			auto jIkArray = jni::Make<jni::Array<jni::jbyte>>(env, reinterpret_cast<const std::vector<int8_t>&>(Ik));
-			jIk.Set(env, LimeOutputBufferField, jIkArray);
+			jIk.Set(env, m_jcache->LimeOutputBufferField, jIkArray);
 		} catch (BctbxException const &e) {
 			ThrowJavaLimeException(env, e.str());
 		} catch (std::exception const &e) { // catch anything
@@ -491,6 +689,45 @@ struct jLimeManager {
 		}
 		return jni::Make<jni::String>(env, url);
 	}
+
+	void set_metricsEnabled(jni::JNIEnv &env, const jni::jboolean enabled) {
+		m_manager->set_metricsEnabled(enabled == JNI_TRUE);
+	}
+
+	/**
+	 * @brief get the metrics flattened in a long array, parsed by the java LimeMetrics constructor
+	 *
+	 * for each operation: calls, totalTime, DBTime, cryptoTime then the histogram buckets
+	 * followed by DRSessionsCacheHits, DRSessionsCacheMisses, staleSessionDecrypts, skippedKeysDerived, DBMutexWaitTime and usersMutexWaitTime
+	 */
+	jni::Local<jni::Array<jni::jlong>> get_metrics(jni::JNIEnv &env) {
+		lime::Metrics metrics{};
+		m_manager->get_metrics(metrics);
+
+		std::vector<jni::jlong> flat{};
+		flat.reserve(lime::metricsOperationsCount*(4+lime::metricsHistogramBuckets) + 6);
+		for (const auto &op : metrics.operations) {
+			flat.push_back(static_cast<jni::jlong>(op.calls));
+			flat.push_back(static_cast<jni::jlong>(op.totalTime));
+			flat.push_back(static_cast<jni::jlong>(op.DBTime));
+			flat.push_back(static_cast<jni::jlong>(op.cryptoTime));
+			for (const auto bucket : op.latencyHistogram) {
+				flat.push_back(static_cast<jni::jlong>(bucket));
+			}
+		}
+		flat.push_back(static_cast<jni::jlong>(metrics.DRSessionsCacheHits));
+		flat.push_back(static_cast<jni::jlong>(metrics.DRSessionsCacheMisses));
+		flat.push_back(static_cast<jni::jlong>(metrics.staleSessionDecrypts));
+		flat.push_back(static_cast<jni::jlong>(metrics.skippedKeysDerived));
+		flat.push_back(static_cast<jni::jlong>(metrics.DBMutexWaitTime));
+		flat.push_back(static_cast<jni::jlong>(metrics.usersMutexWaitTime));
+
+		return jni::Make<jni::Array<jni::jlong>>(env, flat);
+	}
+
+	void reset_metrics(jni::JNIEnv &env) {
+		m_manager->reset_metrics();
+	}
 };
 
 #define METHOD(MethodPtr, name) jni::MakeNativePeerMethod<decltype(MethodPtr), (MethodPtr)>(name)
@@ -504,6 +741,8 @@ jni::RegisterNativePeer<jLimeManager>(env, jni::Class<jLimeManager>::Find(env),
 	METHOD(&jLimeManager::is_user, "is_user"),
 	METHOD(&jLimeManager::encrypt, "n_encrypt"),
 	METHOD(&jLimeManager::decrypt, "n_decrypt"),
+	METHOD(&jLimeManager::encryptDirect, "n_encryptDirect"),
+	METHOD(&jLimeManager::decryptDirect, "n_decryptDirect"),
 	METHOD(&jLimeManager::update, "n_update"),
 	METHOD(&jLimeManager::get_selfIdentityKey, "get_selfIdentityKey"),
 	METHOD(&jLimeManager::set_peerDeviceStatus_Ik, "n_set_peerDeviceStatus_Ik"),
@@ -511,7 +750,10 @@ jni::RegisterNativePeer<jLimeManager>(env, jni::Class<jLimeManager>::Find(env),
 	METHOD(&jLimeManager::get_peerDeviceStatus, "n_get_peerDeviceStatus"),
 	METHOD(&jLimeManager::delete_peerDevice, "delete_peerDevice"),
 	METHOD(&jLimeManager::set_x3dhServerUrl, "set_x3dhServerUrl"),
-	METHOD(&jLimeManager::get_x3dhServerUrl, "get_x3dhServerUrl")
+	METHOD(&jLimeManager::get_x3dhServerUrl, "get_x3dhServerUrl"),
+	METHOD(&jLimeManager::set_metricsEnabled, "set_metricsEnabled"),
+	METHOD(&jLimeManager::get_metrics, "n_get_metrics"),
+	METHOD(&jLimeManager::reset_metrics, "reset_metrics")
 	);
 
 // bind the process_response to the static java LimeManager.process_response method
@@ -522,6 +764,7 @@ jni::RegisterNativePeer<jLimeManager>(env, jni::Class<jLimeManager>::Find(env),
  * It :
  * - converts from jbytes(signed char) to unsigned char the response array
  * - retrieves from the given back responseHolder pointer the closure pointer to callback the line lib and call it
+ * - delivers at once the status callbacks completed by this response
  */
 auto process_X3DHresponse= [](jni::JNIEnv &env, jni::Class<jLimeManager>&, jni::jlong processPtr, jni::jint responseCode, jni::Array<jni::jbyte> &response) {
 	// turn the response array into a vector of jbytes(signed char)
@@ -529,8 +772,16 @@ auto process_X3DHresponse= [](jni::JNIEnv &env, jni::Class<jLimeManager>&, jni::
 	jbyteArray2uin8_tVector(env, response, responseVector);
 	// retrieve the statefull closure pointer to response processing provided by the lime lib
 	auto responseHolderPtr = reinterpret_cast<responseHolder *>(processPtr);
-	responseHolderPtr->process(responseCode, *responseVector);
+	CallbacksBatch batch{};
+	try {
+		responseHolderPtr->process(responseCode, *responseVector);
+	} catch (...) { // the operations completed before the failure still report their status to java
 		delete(responseHolderPtr);
+		batch.deliver(env);
+		throw;
+	}
+	delete(responseHolderPtr);
+	batch.deliver(env);
 	};
 
 jni::RegisterNatives(env, *jni::Class<jLimeManager>::Find(env), jni::MakeNativeMethod("process_X3DHresponse", process_X3DHresponse));
@@ -0,0 +1,157 @@
+/*
+	lime_keyPairPool.cpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lime_keyPairPool.hpp"
+#include "lime_log.hpp"
+#include "bctoolbox/exception.hh"
+
+namespace lime {
+	template <typename Curve>
+	KeyPairPool<Curve>::KeyPairPool() : m_keyPairs{}, m_depth{0}, m_mutex{}, m_cv{}, m_refiller{}, m_refilling{false}, m_stop{false} {}
+
+	/**
+	 * @brief Stop the refill thread, the key pairs still in the pool are wiped by their destructor
+	 */
+	template <typename Curve>
+	KeyPairPool<Curve>::~KeyPairPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		if (m_refiller.joinable()) {
+			m_refiller.join();
+		}
+	}
+
+	/**
+	 * @brief Set the number of key pairs held by the pool, the pool is filled up to it in background
+	 *
+	 * @param[in]	depth	number of key pairs, 0 disables the pool and wipes the key pairs it holds
+	 */
+	template <typename Curve>
+	void KeyPairPool<Curve>::set_depth(const size_t depth) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_depth = depth;
+		if (m_keyPairs.size() > depth) {
+			m_keyPairs.resize(depth); // the removed ones are wiped by their destructor
+		}
+		if (depth == 0) {
+			m_keyPairs.shrink_to_fit();
+			return;
+		}
+		m_keyPairs.reserve(depth); // no reallocation, so no copies of the key pairs left in freed memory
+		if (!m_refiller.joinable()) {
+			m_refiller = std::thread(&KeyPairPool<Curve>::refiller, this);
+		}
+		m_refilling = true;
+		m_cv.notify_one();
+	}
+
+	/**
+	 * @return the number of key pairs currently in the pool
+	 */
+	template <typename Curve>
+	size_t KeyPairPool<Curve>::size() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_keyPairs.size();
+	}
+
+	/**
+	 * @brief Get a new key pair: the last generated one in the pool, or generated now if the pool is empty or disabled
+	 *
+	 * @param[out]	keyPair	the key pair
+	 * @param[in]	rng	the RNG used when the key pair is generated now, see X_generateKeyPair
+	 */
+	template <typename Curve>
+	void KeyPairPool<Curve>::draw(Xpair<Curve> &keyPair, RNG &rng) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_keyPairs.empty()) {
+				keyPair = m_keyPairs.back();
+				m_keyPairs.pop_back(); // the pool copy is wiped by its destructor
+				if (!m_refilling && m_keyPairs.size() <= m_depth/2) {
+					m_refilling = true;
+					m_cv.notify_one();
+				}
+				return;
+			}
+			if (m_depth > 0 && !m_refilling) {
+				m_refilling = true;
+				m_cv.notify_one();
+			}
+		}
+		X_generateKeyPair<Curve>(keyPair, rng);
+	}
+
+	/* refill thread: once a refill is requested, generate key pairs outside of the lock until the pool is full */
+	template <typename Curve>
+	void KeyPairPool<Curve>::refiller() {
+		auto RNG_context = make_RNG(); // used by this thread only
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_stop) {
+			m_cv.wait(lock, [this]{return m_stop || m_refilling;});
+			if (m_stop) break;
+			if (m_keyPairs.size() >= m_depth) { // full, or disabled
+				m_refilling = false;
+				continue;
+			}
+			lock.unlock();
+			Xpair<Curve> keyPair{};
+			try {
+				X_generateKeyPair<Curve>(keyPair, *RNG_context);
+			} catch (BctbxException const &e) {
+				LIME_LOGE<<"Key pair pool refill failed: "<<e;
+				lock.lock();
+				m_refilling = false; // the next draw will ask again
+				continue;
+			}
+			lock.lock();
+			if (m_keyPairs.size() < m_depth) {
+				m_keyPairs.push_back(keyPair);
+			}
+		}
+	}
+
+	void KeyPairPools::set_depth(const size_t depth) {
+#ifdef EC25519_ENABLED
+		m_C255.set_depth(depth);
+#endif
+#ifdef EC448_ENABLED
+		m_C448.set_depth(depth);
+#endif
+	}
+
+	/* template instanciations for Curves 25519 and 448 */
+#ifdef EC25519_ENABLED
+	template <>
+	KeyPairPool<C255> &KeyPairPools::get<C255>() {
+		return m_C255;
+	}
+	template class KeyPairPool<C255>;
+#endif
+
+#ifdef EC448_ENABLED
+	template <>
+	KeyPairPool<C448> &KeyPairPools::get<C448>() {
+		return m_C448;
+	}
+	template class KeyPairPool<C448>;
+#endif
+} // namespace lime
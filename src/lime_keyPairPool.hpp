@@ -0,0 +1,97 @@
+/*
+	lime_keyPairPool.hpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef lime_keyPairPool_hpp
+#define lime_keyPairPool_hpp
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "lime_crypto_primitives.hpp"
+
+namespace lime {
+
+	/**
+	 * @brief A pool of key exchange key pairs generated ahead of their use
+	 *
+	 * The DR ratchet steps and the X3DH sender sessions initialisations draw their new key pair from it instead of generating it inline.
+	 * When the pool falls to half its depth, a background thread, started on first use, refills it.
+	 * An empty pool or a depth of 0 does not block: the key pair is then generated by the caller.
+	 * The key pairs are held in sBuffers: they are wiped when drawn from the pool and when the pool is destroyed.
+	 */
+	template <typename Curve>
+	class KeyPairPool {
+		private:
+			std::vector<Xpair<Curve>> m_keyPairs; // the pre-generated key pairs
+			size_t m_depth; // the number of key pairs held when the pool is full, 0 disables the pool
+			std::mutex m_mutex; // protect the key pairs and the refiller flags
+			std::condition_variable m_cv; // signal the refiller
+			std::thread m_refiller; // the refill thread
+			bool m_refilling; // a refill was requested and is not completed yet
+			bool m_stop; // set when the pool is being destroyed
+			void refiller(); // refill thread main loop
+
+		public:
+			KeyPairPool();
+			KeyPairPool(const KeyPairPool &) = delete;
+			KeyPairPool &operator=(const KeyPairPool &) = delete;
+			~KeyPairPool();
+
+			void set_depth(const size_t depth);
+			size_t size();
+			void draw(Xpair<Curve> &keyPair, RNG &rng);
+	};
+
+	/**
+	 * @brief The key pair pools of all the curves, shared by the local storage connections of a LimeManager
+	 *
+	 * Reached by the sessions through their local storage so they draw from the pool of their manager.
+	 */
+	class KeyPairPools {
+		private:
+#ifdef EC25519_ENABLED
+			KeyPairPool<C255> m_C255;
+#endif
+#ifdef EC448_ENABLED
+			KeyPairPool<C448> m_C448;
+#endif
+
+		public:
+			KeyPairPools() = default;
+			KeyPairPools(const KeyPairPools &) = delete;
+			KeyPairPools &operator=(const KeyPairPools &) = delete;
+
+			void set_depth(const size_t depth);
+			template <typename Curve>
+			KeyPairPool<Curve> &get();
+	};
+
+	/* this templates are instanciated once in the lime_keyPairPool.cpp file, explicitly tell anyone including this header that there is no need to re-instanciate them */
+#ifdef EC25519_ENABLED
+	extern template class KeyPairPool<C255>;
+	template <> KeyPairPool<C255> &KeyPairPools::get<C255>();
+#endif
+#ifdef EC448_ENABLED
+	extern template class KeyPairPool<C448>;
+	template <> KeyPairPool<C448> &KeyPairPools::get<C448>();
+#endif
+} // namespace lime
+
+#endif //lime_keyPairPool_hpp
@@ -26,6 +26,8 @@
 #include <mutex>
 
 namespace lime {
+	class Db; // forward declaration, the local storage accessor can be shared by several users
+	class ThreadPool; // forward declaration, the thread pool can be shared by several users
 
 	/** @brief A pure abstract class defining the API to encrypt/decrypt/manage user and its keys
 	 *
@@ -75,6 +77,29 @@ namespace lime {
 		*/
 		virtual void encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<std::vector<uint8_t>> cipherMessage, const limeCallback &callback) = 0;
 
+		/**
+		 * @brief Encrypt a buffer for a given list of recipient devices, writing all the DR messages in one buffer
+		 *
+		 * Same as encrypt but the recipients DRmessage are left empty, their DR messages are in DRmessages, see lime::DRMessagesArena
+		 */
+		virtual void encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::shared_ptr<std::vector<uint8_t>> cipherMessage, std::shared_ptr<DRMessagesArena> DRmessages, const limeCallback &callback) = 0;
+
+		/**
+		 * @brief Encrypt a buffer for a given list of recipient devices if it does not need the X3DH server
+		 *
+		 * Same as encrypt but done in the calling thread: when every recipient has an active DR session(in cache, local storage or from a prefetched key bundle)
+		 * the DR messages and cipher message are produced before returning. Otherwise nothing is encrypted.
+		 *
+		 * @param[in]		recipientUserId		the Id of intended recipient, see encrypt
+		 * @param[in,out]	recipients		a list of RecipientData, see encrypt
+		 * @param[in]		plainMessage		a buffer holding the message to encrypt
+		 * @param[in]		encryptionPolicy	select how to manage the encryption, see encrypt
+		 * @param[out]		cipherMessage		the cipher message to be routed to all recipients(if one is produced, depends on encryption policy)
+		 *
+		 * @return	true if the message was encrypted, false if it would need to contact the X3DH server or there is no recipient: use encrypt
+		 */
+		virtual bool try_encrypt(const std::string &recipientUserId, std::vector<RecipientData> &recipients, const std::vector<uint8_t> &plainMessage, const lime::EncryptionPolicy encryptionPolicy, std::vector<uint8_t> &cipherMessage) = 0;
+
 		/**
 		 * @brief Decrypt the given message
 		 *
@@ -89,6 +114,58 @@ namespace lime {
 		*/
 		virtual lime::PeerDeviceStatus decrypt(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage, std::vector<uint8_t> &plainMessage) = 0;
 
+		/**
+		 * @brief Encrypt a large message for a given list of recipient devices, processing it as a stream
+		 *
+		 * Produce the same output as encrypt using the cipherMessage policy. The plain message is read and the cipher message written
+		 * before this function returns, the callback is called when the DR messages are ready(it may need to contact the X3DH server).
+		 *
+		 * @param[in]		recipientUserId		the Id of intended recipient, shall be a sip:uri of user or conference, is used as associated data to ensure no-one can mess with intended recipient
+		 * @param[in,out]	recipients		a list of RecipientData, see encrypt
+		 * @param[in]		plainStream		read the message to encrypt
+		 * @param[in]		cipherStream		write the cipher message to be routed to all recipients
+		 * @param[in]		callback		called with the exit status when the DR messages are ready
+		 */
+		virtual void encrypt(std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, const limeStreamReader &plainStream, const limeStreamWriter &cipherStream, const limeCallback &callback) = 0;
+
+		/**
+		 * @brief Decrypt a message using a cipher message, processing the cipher message as a stream
+		 *
+		 * @param[in]	recipientUserId		the Id of intended recipient, see decrypt
+		 * @param[in]	senderDeviceId		the device Id (GRUU) of the message sender
+		 * @param[in]	DRmessage		the Double Ratchet message targeted to current device
+		 * @param[in]	cipherMessageSize	total size of the cipher message
+		 * @param[in]	cipherStream		read the cipher message, its end is read first
+		 * @param[in]	plainStream		write the decrypted message, it must be discarded if the decryption fails
+		 *
+		 * @return	fail if we cannot decrypt the message, the sender device status otherwise
+		*/
+		virtual lime::PeerDeviceStatus decrypt(const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const size_t cipherMessageSize, const limeStreamReader &cipherStream, const limeStreamWriter &plainStream) = 0;
+
+		/**
+		 * @brief Decrypt a batch of messages in order, saving all the sessions modifications in one transaction
+		 *
+		 * @param[in,out]	messages	the incoming messages, get their plain message and their sender device status
+		 */
+		virtual void decrypt_batch(std::vector<DecryptionData> &messages) = 0;
+
+		/**
+		 * @brief Load in cache the Double Ratchet sessions with the given peer devices, optionally create the missing ones
+		 *
+		 * @param[in]	peerDeviceIds		the peer devices Id (GRUU)
+		 * @param[in]	fetchPeerBundles	when true, fetch from the X3DH server the key bundles of devices without session and create their sessions
+		 * @param[in]	callback		called when the sessions are ready(it may need to contact the X3DH server)
+		 */
+		virtual void prefetch_sessions(const std::vector<std::string> &peerDeviceIds, const bool fetchPeerBundles, const limeCallback &callback) = 0;
+
+		/**
+		 * @brief Fetch from the X3DH server the key bundles of peer devices without session and keep them in memory, a later encryption uses them to create the sessions
+		 *
+		 * @param[in]	peerDeviceIds		the peer devices Id (GRUU)
+		 * @param[in]	callback		called when the key bundles are stored
+		 */
+		virtual void prefetch_peerBundles(const std::vector<std::string> &peerDeviceIds, const limeCallback &callback) = 0;
+
 
 
 		// User management
@@ -136,6 +213,18 @@ namespace lime {
 		*/
 		virtual void update_OPk(const limeCallback &callback, uint16_t OPkServerLowLimit, uint16_t OPkBatchSize) = 0;
 
+		/**
+		 * @brief Check if the update of this user can be skipped without contacting the X3DH server
+		 *
+		 * It can when the current SPk is valid and, in predictive OPk update mode, the OPks projected on server are enough.
+		 * When it returns true, the user is accounted as updated: the next update_OPk projection starts from now.
+		 *
+		 * @param[in]	OPkServerLowLimit	the OPk server low limit update_OPk would use
+		 *
+		 * @return true if the caller shall not call update_SPk and update_OPk this time
+		 */
+		virtual bool defer_update(const uint16_t OPkServerLowLimit) = 0;
+
 		/**
 		 * @brief Retrieve self public Identity key
 		 *
@@ -157,6 +246,72 @@ namespace lime {
 		 */
 		virtual std::string get_x3dhServerUrl() = 0;
 
+		/**
+		 * @brief Set the thread pool used to encrypt for several recipients in parallel
+		 *
+		 * @param[in]	threadPool	the pool to use, nullptr to encrypt sequentially in the calling thread
+		 */
+		virtual void set_threadPool(std::shared_ptr<ThreadPool> threadPool) = 0;
+
+		/**
+		 * @brief Enable or disable the predictive OPk update
+		 *
+		 * When enabled, update_OPk queries the X3DH server only when the count of our OPks on it, projected from local storage
+		 * and from the OPks consumed by the received X3DH init messages, is under the server low limit.
+		 * It still queries it every lime::settings::OPk_predictiveResyncUpdates updates.
+		 *
+		 * @param[in]	enabled	true to enable the predictive update
+		 */
+		virtual void set_OPkPredictiveUpdate(const bool enabled) = 0;
+
+		/**
+		 * @brief Set the limits of the DR sessions cache, the least recently used sessions are evicted when they are reached
+		 *
+		 * @param[in]	maxSessions	maximum number of sessions in cache, 0 for no limit
+		 * @param[in]	maxMemory	maximum memory used by the sessions in cache, 0 for no limit
+		 */
+		virtual void set_DRSessionsCacheLimits(const size_t maxSessions, const size_t maxMemory) = 0;
+
+		/**
+		 * @brief Get the DR sessions cache current usage
+		 *
+		 * @param[out]	sessionsCount	number of sessions in cache
+		 * @param[out]	memorySize	estimation of the memory used by these sessions
+		 */
+		virtual void get_DRSessionsCacheUsage(size_t &sessionsCount, size_t &memorySize) = 0;
+
+		/**
+		 * @brief Build an encrypted snapshot of the active sessions held in the DR sessions cache
+		 *
+		 * The key encrypting the snapshot is stored in local storage, it replaces the one of any previous snapshot of this user
+		 *
+		 * @param[out]	snapshot	the snapshot, empty if there is no session to save
+		 */
+		virtual void get_sessionsSnapshot(std::vector<uint8_t> &snapshot) = 0;
+
+		/**
+		 * @brief Restore in the DR sessions cache the sessions of a snapshot still matching local storage
+		 *
+		 * A snapshot can be loaded only once: its key is deleted from local storage
+		 *
+		 * @param[in]	snapshot	a snapshot produced by get_sessionsSnapshot
+		 *
+		 * @return the number of sessions restored in cache
+		 */
+		virtual size_t set_sessionsSnapshot(const std::vector<uint8_t> &snapshot) = 0;
+
+		/**
+		 * @brief Check if the user has no pending operation: no request to the X3DH server waiting for its response and no queued encryption
+		 *
+		 * @return true when the object can be destroyed without loosing any operation
+		 */
+		virtual bool is_idle() = 0;
+
+		/**
+		 * @brief Commit the sessions updates queued by the user local storage write-behind mode, see LimeManager::flush
+		 */
+		virtual void flush() = 0;
+
 		virtual ~LimeGeneric() {};
 	};
 
@@ -165,7 +320,12 @@ namespace lime {
 	std::shared_ptr<LimeGeneric> insert_LimeUser(const std::string &dbFilename, const std::string &deviceId, const std::string &url, const lime::CurveId curve, const uint16_t OPkInitialBatchSize,
 			const limeX3DHServerPostData &X3DH_post_data, const limeCallback &callback, std::shared_ptr<std::recursive_mutex> mutex);
 
+	std::shared_ptr<LimeGeneric> insert_LimeUser(std::shared_ptr<lime::Db> localStorage, const std::string &deviceId, const std::string &url, const lime::CurveId curve, const uint16_t OPkInitialBatchSize,
+			const limeX3DHServerPostData &X3DH_post_data, const limeCallback &callback);
+
 	std::shared_ptr<LimeGeneric> load_LimeUser(const std::string &dbFilename, const std::string &deviceId, const limeX3DHServerPostData &X3DH_post_data, std::shared_ptr<std::recursive_mutex> mutex, const bool allStatus=false);
 
+	std::shared_ptr<LimeGeneric> load_LimeUser(std::shared_ptr<lime::Db> localStorage, const std::string &deviceId, const limeX3DHServerPostData &X3DH_post_data, const bool allStatus=false);
+
 }
 #endif // lime_lime_hpp
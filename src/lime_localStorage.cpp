@@ -19,14 +19,23 @@
 
 #include <bctoolbox/exception.hh>
 #include <soci/soci.h>
+#include <soci/sqlite3/soci-sqlite3.h>
 #include <set>
+#include <map>
+#include <array>
 #include <mutex>
+#include <algorithm>
+#include <thread>
+#include <exception>
+#include <sstream>
 
 #include "lime_log.hpp"
 #include "lime/lime.hpp"
 #include "lime_localStorage.hpp"
 #include "lime_double_ratchet.hpp"
 #include "lime_impl.hpp"
+#include "lime_metrics.hpp"
+#include "lime_trace.hpp"
 
 using namespace::std;
 using namespace::soci;
@@ -34,18 +43,319 @@ using namespace::lime;
 
 namespace lime {
 
+/******************************************************************************/
+/*                                                                            */
+/* Prepared statements                                                        */
+/*                                                                            */
+/******************************************************************************/
+/**
+ * @brief Hold the queries performed by DR sessions at each message encryption/decryption
+ *
+ * Statements are prepared once when the structure is created and then only executed.
+ * Parameters are bound to the data members: set them and execute the statement.
+ *
+ * One instance per curve is held by a Db object as the keys sizes bound in blobs depends on the curve.
+ *
+ * @tparam Curve	The elliptic curve to use: C255 or C448
+ */
+template <typename Curve>
+struct DRStatements {
+	/* bound parameters */
+	long int sessionId; /**< DR_sessions.sessionId */
+	long int Did; /**< DR_sessions.Did */
+	long int Uid; /**< DR_sessions.Uid */
+	int chunk; /**< DR_MSk_MK.chunk */
+	int mask; /**< DR_MSk_MK.mask */
+	int status; /**< DR_sessions.Status */
+	int version; /**< DR_sessions.version */
+	long DHid; /**< DR_MSk_DHr.DHid */
+	soci::blob state; /**< DR_sessions.state */
+	soci::blob DHr; /**< DR_MSk_DHr.DHr or DR_sessions.DHr */
+	soci::blob MK; /**< DR_MSk_MK.MKs */
+	soci::indicator MK_ind; /**< indicator on MKs when fetched */
+	std::array<std::string, lime::settings::DB_inListChunkSize> deviceIds; /**< lime_PeerDevices.DeviceId IN list of the peer devices lookups, see bind_deviceIds */
+	std::string deviceId; /**< lime_PeerDevices.DeviceId when fetched */
+	soci::blob Ik; /**< lime_PeerDevices.Ik when fetched */
+	soci::blob AD; /**< DR_sessions.AD when fetched */
+	soci::blob X3DHInit; /**< DR_sessions.X3DHInit when fetched */
+	soci::indicator X3DHInit_ind; /**< indicator on X3DHInit when fetched */
+	int hasSkippedKeys; /**< the fetched session has skipped message keys chains */
+
+	/* DR_sessions */
+	soci::statement stale_sessions; /**< set to stale all sessions linking a local user and a peer device */
+	soci::statement update_decrypt; /**< update the sessions after a decryption or a ratchet step, only if its version was not modified since it was read */
+	soci::statement update_encrypt; /**< update the sessions after an encryption, only if its version was not modified since it was read */
+	soci::statement select_version; /**< fetch the version and status of a session */
+
+	/* skipped message keys */
+	soci::statement select_MK; /**< fetch the chunk of skipped message keys holding a key */
+	soci::statement select_MK_chunk; /**< fetch a chunk of skipped message keys of a chain */
+	soci::statement update_MK; /**< update a chunk of skipped message keys */
+	soci::statement delete_MK; /**< delete a chunk of skipped message keys, all used */
+	soci::statement insert_MK; /**< insert a chunk of skipped message keys */
+	soci::statement select_MK_any; /**< check if any skipped message key is still linked to a chain */
+	soci::statement select_DHid; /**< fetch the DHid of a chain */
+	soci::statement insert_DHr; /**< insert a new chain */
+	soci::statement reset_DHr_received; /**< reset the received counter of a chain */
+	soci::statement increase_DHr_received; /**< increase the received counter of all the chains of a session */
+	soci::statement delete_DHr; /**< delete a chain */
+
+	/* peer devices lookups, by chunks of DB_inListChunkSize devices */
+	soci::statement select_devicesStatus; /**< fetch the row of the known peer devices */
+	soci::statement select_activeSessions; /**< fetch the whole row of the active sessions with the peer devices */
+
+	explicit DRStatements(soci::session &sql) :
+		sessionId{0}, Did{0}, Uid{0}, chunk{0}, mask{0}, status{0}, version{0}, DHid{0},
+		state(sql), DHr(sql), MK(sql), MK_ind{soci::i_ok},
+		deviceIds{}, deviceId{}, Ik(sql), AD(sql), X3DHInit(sql), X3DHInit_ind{soci::i_ok}, hasSkippedKeys{0},
+		stale_sessions((sql.prepare << "UPDATE DR_sessions SET Status = 0, timeStamp = CURRENT_TIMESTAMP WHERE Did = :Did AND Uid = :Uid", soci::use(Did), soci::use(Uid))),
+		update_decrypt((sql.prepare << "UPDATE DR_sessions SET state= :state, DHr = :DHr, Status = 1, X3DHInit = NULL, version = version + 1 WHERE sessionId = :sessionId AND version = :version;", soci::use(state), soci::use(DHr), soci::use(sessionId), soci::use(version))),
+		update_encrypt((sql.prepare << "UPDATE DR_sessions SET state= :state, Status = :active_status, version = version + 1 WHERE sessionId = :sessionId AND version = :version;", soci::use(state), soci::use(status), soci::use(sessionId), soci::use(version))),
+		select_version((sql.prepare << "SELECT version, Status FROM DR_sessions WHERE sessionId = :sessionId LIMIT 1;", soci::into(version), soci::into(status), soci::use(sessionId))),
+		select_MK((sql.prepare << "SELECT m.MKs, m.mask, m.DHid FROM DR_MSk_MK as m INNER JOIN DR_MSk_DHr as d ON d.DHid=m.DHid WHERE d.sessionId = :sessionId AND d.DHr = :DHr AND m.chunk = :chunk LIMIT 1", soci::into(MK, MK_ind), soci::into(mask), soci::into(DHid), soci::use(sessionId), soci::use(DHr), soci::use(chunk))),
+		select_MK_chunk((sql.prepare << "SELECT MKs, mask FROM DR_MSk_MK WHERE DHid = :DHid AND chunk = :chunk LIMIT 1", soci::into(MK, MK_ind), soci::into(mask), soci::use(DHid), soci::use(chunk))),
+		update_MK((sql.prepare << "UPDATE DR_MSk_MK SET mask = :mask, MKs = :MKs WHERE DHid = :DHid AND chunk = :chunk;", soci::use(mask), soci::use(MK), soci::use(DHid), soci::use(chunk))),
+		delete_MK((sql.prepare << "DELETE from DR_MSk_MK WHERE DHid = :DHid AND chunk = :chunk;", soci::use(DHid), soci::use(chunk))),
+		insert_MK((sql.prepare << "INSERT INTO DR_MSk_MK(DHid,chunk,mask,MKs) VALUES(:DHid,:chunk,:mask,:MKs)", soci::use(DHid), soci::use(chunk), soci::use(mask), soci::use(MK))),
+		select_MK_any((sql.prepare << "SELECT chunk from DR_MSk_MK WHERE DHid = :DHid LIMIT 1;", soci::into(chunk), soci::use(DHid))),
+		select_DHid((sql.prepare << "SELECT DHid FROM DR_MSk_DHr WHERE sessionId = :sessionId AND DHr = :DHr LIMIT 1;", soci::into(DHid), soci::use(sessionId), soci::use(DHr))),
+		insert_DHr((sql.prepare << "INSERT INTO DR_MSk_DHr(sessionId, DHr) VALUES(:sessionId, :DHr)", soci::use(sessionId), soci::use(DHr))),
+		reset_DHr_received((sql.prepare << "UPDATE DR_MSk_DHr SET received = 0 WHERE DHid = :DHid", soci::use(DHid))),
+		increase_DHr_received((sql.prepare << "UPDATE DR_MSk_DHr SET received = received + 1 WHERE sessionId = :sessionId", soci::use(sessionId))),
+		delete_DHr((sql.prepare << "DELETE from DR_MSk_DHr WHERE DHid = :DHid;", soci::use(DHid))),
+		select_devicesStatus(sql), select_activeSessions(sql)
+	{
+		// the IN lists have a fixed number of parameters so the statements are prepared once and the queries texts don't grow with the recipients count
+		std::string inList{};
+		for (size_t i=0; i<deviceIds.size(); i++) {
+			inList.append((i==0)?":d":",:d").append(std::to_string(i));
+		}
+
+		select_devicesStatus.exchange(soci::into(deviceId));
+		select_devicesStatus.exchange(soci::into(Did));
+		select_devicesStatus.exchange(soci::into(Ik));
+		select_devicesStatus.exchange(soci::into(status));
+		for (auto &id : deviceIds) {
+			select_devicesStatus.exchange(soci::use(id));
+		}
+		select_devicesStatus.alloc();
+		select_devicesStatus.prepare("SELECT DeviceId, Did, Ik, Status FROM lime_PeerDevices WHERE DeviceId IN ("+inList+");");
+		select_devicesStatus.define_and_bind();
+
+		select_activeSessions.exchange(soci::into(sessionId));
+		select_activeSessions.exchange(soci::into(deviceId));
+		select_activeSessions.exchange(soci::into(Did));
+		select_activeSessions.exchange(soci::into(state));
+		select_activeSessions.exchange(soci::into(AD));
+		select_activeSessions.exchange(soci::into(X3DHInit, X3DHInit_ind));
+		select_activeSessions.exchange(soci::into(hasSkippedKeys));
+		select_activeSessions.exchange(soci::into(version));
+		select_activeSessions.exchange(soci::use(Uid));
+		for (auto &id : deviceIds) {
+			select_activeSessions.exchange(soci::use(id));
+		}
+		select_activeSessions.alloc();
+		select_activeSessions.prepare("SELECT s.sessionId, d.DeviceId, s.Did, s.state, s.AD, s.X3DHInit, EXISTS(SELECT 1 FROM DR_MSk_DHr as m WHERE m.sessionId = s.sessionId), s.version FROM DR_sessions as s INNER JOIN lime_PeerDevices as d ON s.Did=d.Did WHERE s.Uid = :Uid AND s.Status = 1 AND d.DeviceId IN ("+inList+");");
+		select_activeSessions.define_and_bind();
+	};
+
+	/**
+	 * @brief Set the IN list parameters of the peer devices lookups to a chunk of devices
+	 *
+	 * Parameters beyond the end of the list repeat the first device of the chunk, this does not add any row to the results.
+	 *
+	 * @param[in]	devices	the whole list of devices
+	 * @param[in]	start	index in devices of the first one of this chunk
+	 */
+	void bind_deviceIds(const std::vector<std::string> &devices, const size_t start) {
+		for (size_t i=0; i<deviceIds.size(); i++) {
+			deviceIds[i] = (start+i < devices.size())?devices[start+i]:devices[start];
+		}
+	}
+	DRStatements(DRStatements<Curve> &a) = delete; // statements are bound to the data members, they can't be copied
+	DRStatements<Curve> &operator=(DRStatements<Curve> &a) = delete;
+};
+
+/**
+ * @brief Reset a prepared SELECT statement once its result is read
+ *
+ * soci leaves the statement pending after fetching a row, this would hold a read transaction on the database
+ * until the next execution of the same statement.
+ * WARNING: unportable code, sqlite3 only
+ *
+ * @param[in]	st	the statement to reset
+ */
+static void reset_statement(soci::statement &st) {
+	auto backend = static_cast<soci::sqlite3_statement_backend *>(st.get_backend());
+	if (backend != nullptr && backend->stmt_ != nullptr) {
+		sqlite3_reset(backend->stmt_);
+	}
+}
+
+/**
+ * @brief Get the prepared statements set matching the given curve, prepare it at first call
+ *
+ * @tparam Curve	The elliptic curve to use: C255 or C448
+ *
+ * @return the prepared statements
+ */
+#ifdef EC25519_ENABLED
+template <>
+DRStatements<C255> &Db::get_DRStatements<C255>() {
+	if (m_DRStatements_C255 == nullptr) {
+		m_DRStatements_C255 = std::unique_ptr<DRStatements<C255>>(new DRStatements<C255>(sql));
+	}
+	return *m_DRStatements_C255;
+}
+#endif
+
+#ifdef EC448_ENABLED
+template <>
+DRStatements<C448> &Db::get_DRStatements<C448>() {
+	if (m_DRStatements_C448 == nullptr) {
+		m_DRStatements_C448 = std::unique_ptr<DRStatements<C448>>(new DRStatements<C448>(sql));
+	}
+	return *m_DRStatements_C448;
+}
+#endif
+
+/******************************************************************************/
+/*                                                                            */
+/* Storage options                                                            */
+/*                                                                            */
+/******************************************************************************/
+StorageOptions StorageOptions::mobileDurable() {
+	return StorageOptions{}.set_journalMode(StorageJournalMode::wal).set_synchronous(StorageSynchronous::full).set_mmapSize(0).set_cacheSize(-2048); // 2 MiB of page cache
+}
+
+StorageOptions StorageOptions::serverThroughput() {
+	return StorageOptions{}.set_journalMode(StorageJournalMode::wal).set_synchronous(StorageSynchronous::normal).set_mmapSize(256*1024*1024).set_cacheSize(-65536).set_connectionPerUser(true); // 256 MiB memory mapped, 64 MiB of page cache
+}
+
+std::string StorageOptions::to_string() const {
+	std::ostringstream out;
+	out<<"journal_mode=";
+	switch (journalMode) {
+		case StorageJournalMode::keep: out<<"keep"; break;
+		case StorageJournalMode::rollback: out<<"rollback"; break;
+		case StorageJournalMode::wal: out<<"wal"; break;
+	}
+	out<<" synchronous=";
+	switch (synchronous) {
+		case StorageSynchronous::keep: out<<"keep"; break;
+		case StorageSynchronous::off: out<<"off"; break;
+		case StorageSynchronous::normal: out<<"normal"; break;
+		case StorageSynchronous::full: out<<"full"; break;
+		case StorageSynchronous::extra: out<<"extra"; break;
+	}
+	out<<" mmap_size="<<mmapSize<<" cache_size="<<cacheSize<<" connection_per_user="<<(connectionPerUser?"yes":"no")<<" deferred_cleanup="<<(deferredCleanup?"yes":"no")<<" shards="<<shards<<" write_behind_depth="<<writeBehindDepth
+		<<" multi_process="<<(multiProcess?"yes":"no")<<" busy_timeout="<<busyTimeout<<" busy_retries="<<busyRetries;
+	return out.str();
+}
+
+/**
+ * @brief apply the requested storage options on the connection and read back the ones in effect
+ *
+ * sqlite silently ignores the settings it cannot apply (ie: wal on an in memory database), so only the read back values are reliable
+ *
+ * @param[in]	options		the requested settings, any field set to keep is not modified
+ */
+void Db::apply_storageOptions(const lime::StorageOptions &options) {
+	switch (options.journalMode) {
+		case StorageJournalMode::rollback:
+			sql<<"PRAGMA journal_mode = DELETE;";
+		break;
+		case StorageJournalMode::wal:
+			sql<<"PRAGMA journal_mode = WAL;";
+		break;
+		case StorageJournalMode::keep:
+		default:
+		break;
+	}
+	if (options.synchronous != StorageSynchronous::keep) {
+		sql<<"PRAGMA synchronous = "<<static_cast<int>(options.synchronous)<<";";
+	}
+	if (options.mmapSize >= 0) {
+		sql<<"PRAGMA mmap_size = "<<options.mmapSize<<";";
+	}
+	if (options.cacheSize != 0) {
+		sql<<"PRAGMA cache_size = "<<options.cacheSize<<";";
+	}
+	if (options.busyTimeout > 0) {
+		sql<<"PRAGMA busy_timeout = "<<options.busyTimeout<<";";
+	} else if (options.connectionPerUser || options.multiProcess) { // other connections may hold the database lock: wait for it instead of failing at once
+		sql<<"PRAGMA busy_timeout = "<<lime::settings::DB_busyTimeout_ms<<";";
+	}
+
+	// read back the settings in effect
+	std::string journalMode{};
+	int synchronous=static_cast<int>(StorageSynchronous::full);
+	long long mmapSize=0;
+	long long cacheSize=0;
+	int busyTimeout=0;
+	sql<<"PRAGMA journal_mode;", into(journalMode);
+	sql<<"PRAGMA synchronous;", into(synchronous);
+	sql<<"PRAGMA mmap_size;", into(mmapSize);
+	if (!sql.got_data()) { // mmap_size returns no row when memory mapping is not supported
+		mmapSize = 0;
+	}
+	sql<<"PRAGMA cache_size;", into(cacheSize);
+	sql<<"PRAGMA busy_timeout;", into(busyTimeout);
+
+	m_storageOptions.journalMode = (journalMode == "wal")?StorageJournalMode::wal:StorageJournalMode::rollback;
+	m_storageOptions.synchronous = static_cast<StorageSynchronous>(synchronous);
+	m_storageOptions.mmapSize = mmapSize;
+	m_storageOptions.cacheSize = cacheSize;
+	m_storageOptions.connectionPerUser = options.connectionPerUser;
+	m_storageOptions.deferredCleanup = options.deferredCleanup;
+	m_storageOptions.shards = options.shards;
+	m_storageOptions.multiProcess = options.multiProcess;
+	// the other processes would not see the queued updates
+	m_storageOptions.writeBehindDepth = options.multiProcess?0:options.writeBehindDepth;
+	m_storageOptions.busyTimeout = static_cast<uint32_t>(busyTimeout);
+	m_storageOptions.busyRetries = options.busyRetries;
+
+	if (options.multiProcess && options.writeBehindDepth > 0) {
+		LIME_LOGW<<"Lime local storage write-behind mode is disabled in multi-process mode";
+	}
+
+	if (options.journalMode != StorageJournalMode::keep && options.journalMode != m_storageOptions.journalMode) {
+		LIME_LOGW<<"Lime local storage could not switch to the requested journal mode, current one is "<<journalMode;
+	}
+	LIME_LOGI<<"Lime local storage settings in effect: "<<m_storageOptions.to_string();
+}
+
 /******************************************************************************/
 /*                                                                            */
 /* Db public API                                                              */
 /*                                                                            */
 /******************************************************************************/
-Db::Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mutex) : sql{"sqlite3", filename}, m_db_mutex{db_mutex} {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+Db::Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mutex, const lime::StorageOptions &options) : sql{"sqlite3", filename}, m_db_mutex{db_mutex}, m_metrics{nullptr}, m_tracer{nullptr}, m_peerDevices{std::make_shared<lime::PeerDevicesCache>()}, m_lanes{std::make_shared<lime::WorkLanes>()}, m_keyPairPools{std::make_shared<lime::KeyPairPools>()}, m_storageOptions{}, m_cleanupStage{0}, m_deferredUpdates{}, m_writer{}, m_writer_mutex{}, m_writer_cv{}, m_writer_stop{false}, m_writer_signaled{false} {
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	constexpr int db_module_table_not_holding_lime_row = -1;
 
 	int userVersion=db_module_table_not_holding_lime_row;
 	sql<<"PRAGMA foreign_keys = ON;"; // make sure this connection enable foreign keys
-	transaction tr(sql);
+	apply_storageOptions(options); // journal mode cannot be changed inside a transaction, do it before
+
+	// Most connections are opened on an up to date database(ie: one per user when using connectionPerUser): a single read, outside of any transaction,
+	// is enough to check that. The table does not exist in a new database, the full check below creates it.
+	// Nothing per connection may follow this fast path: a setting each connection needs goes before it(as apply_storageOptions),
+	// below are only the one time database initialisations(auto vacuum mode, tables creation and schema update).
+	try {
+		sql<<"SELECT version FROM db_module_version WHERE name='lime'", into(userVersion);
+		if (sql.got_data() && userVersion == lime::settings::DBuserVersion) {
+			return;
+		}
+	} catch (soci::soci_error const &) { }
+	userVersion=db_module_table_not_holding_lime_row;
+
+	// a new database is created in incremental auto vacuum mode, so it can be compacted by steps(see compact_incremental).
+	// This must be set before any table is created: on an existing database, it just does nothing until a VACUUM
+	sql<<"PRAGMA auto_vacuum = INCREMENTAL;";
+
+	StorageTransaction tr(*this); // in multi-process mode, an other process creating the tables at the same time waits for us
+
 	// CREATE OR INGORE TABLE db_module_version(
 	sql<<"CREATE TABLE IF NOT EXISTS db_module_version("
 		"name VARCHAR(16) PRIMARY KEY,"
@@ -68,15 +378,13 @@ Db::Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mut
 	}
 
 	/* Perform update if needed */
-	// update the schema version in DB
-	if (userVersion == db_module_table_not_holding_lime_row) { // but not any lime row in it
-		sql<<"INSERT INTO db_module_version(name,version) VALUES('lime',:DbVersion)", use(lime::settings::DBuserVersion);
-	} else { // and we had an older version
-		sql<<"UPDATE db_module_version SET version = :DbVersion WHERE name='lime'", use(lime::settings::DBuserVersion);
-		/* Do the update here */
-		tr.commit(); // commit all the previous queries
+	if (userVersion != db_module_table_not_holding_lime_row) { // we had an older version
+		tr.commit(); // the update rebuilds tables referenced by foreign keys, it must disable them and this can't be done inside a transaction
+		update_schema(userVersion);
 		return;
 	}
+	// update the schema version in DB: there was not any lime row in it
+	sql<<"INSERT INTO db_module_version(name,version) VALUES('lime',:DbVersion)", use(lime::settings::DBuserVersion);
 
 	// create the lime DB:
 
@@ -85,33 +393,20 @@ Db::Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mut
 	*  - DId : link to lime_PeerDevices table, identify which peer is associated to this session
 	*  - Uid: link to LocalUsers table, identify which local device is associated to this session
 	*  - SessionId(primary key)
-	*  - Ns, Nr, PN : index for sending, receivind and previous sending chain
-	*  - DHr : peer current public ECDH key
-	*  - DHs : self current ECDH key. (public || private keys)
-	*  - RK, CKs, CKr : Root key, sender and receiver chain keys
+	*  - state : the mutable part of the session in a fixed layout record (see DRStateRecord): DHr || DHs || RK || CKs || CKr || Ns || Nr || PN
+	*  	- DHr : peer current public ECDH key
+	*  	- DHs : self current ECDH key. (public || private keys)
+	*  	- RK, CKs, CKr : Root key, sender and receiver chain keys
+	*  	- Ns, Nr, PN : index for sending, receivind and previous sending chain, 2 bytes big endian
 	*  - AD : Associated data : provided once at session creation by X3DH, is derived from initiator public Ik and id, receiver public Ik and id
 	*  - Status : 0 is for stale and 1 is for active, only one session shall be active for a peer device, by default created as active
 	*  - timeStamp : is updated when session change status and is used to remove stale session after determined time in cleaning operation
 	*  - X3DHInit : when we are initiator, store the generated X3DH init message and keep sending it until we've got at least a reply from peer
+	*  - version : incremented each time the state is updated, a sessions snapshot is valid only if it holds the current version
+	*  - DHr : copy of the peer current public ECDH key held in state, so the sessions matching a message header are found without trying to decrypt with all of them.
+	*  	It is NULL until the session is updated when the DB was created before schema version 0.0.6
 	*/
-	sql<<"CREATE TABLE DR_sessions( \
-				Did INTEGER NOT NULL DEFAULT 0, \
-				Uid INTEGER NOT NULL DEFAULT 0, \
-				sessionId INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, \
-				Ns UNSIGNED INTEGER NOT NULL, \
-				Nr UNSIGNED INTEGER NOT NULL, \
-				PN UNSIGNED INTEGER NOT NULL, \
-				DHr BLOB NOT NULL, \
-				DHs BLOB NOT NULL, \
-				RK BLOB NOT NULL, \
-				CKs BLOB NOT NULL, \
-				CKr BLOB NOT NULL, \
-				AD BLOB NOT NULL, \
-				Status INTEGER NOT NULL DEFAULT 1, \
-				timeStamp DATETIME DEFAULT CURRENT_TIMESTAMP, \
-				X3DHInit BLOB DEFAULT NULL, \
-				FOREIGN KEY(Did) REFERENCES lime_PeerDevices(Did) ON UPDATE CASCADE ON DELETE CASCADE, \
-				FOREIGN KEY(Uid) REFERENCES lime_LocalUsers(Uid) ON UPDATE CASCADE ON DELETE CASCADE);";
+	create_DRSessionsTable("DR_sessions");
 
 	/* DR Message Skipped DH : Store chains of skipped message keys, this table store the DHr identifying the chain
 	*  - DHid (primary key)
@@ -125,19 +420,9 @@ Db::Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mut
 				DHr BLOB NOT NULL, \
 				received UNSIGNED INTEGER NOT NULL DEFAULT 0, \
 				FOREIGN KEY(sessionId) REFERENCES DR_sessions(sessionId) ON UPDATE CASCADE ON DELETE CASCADE);";
+	sql<<"CREATE INDEX DR_MSk_DHr_sessionId_DHr ON DR_MSk_DHr(sessionId, DHr);"; // skipped message keys lookup
 
-	/* DR Message Skipped MK : Store chains of skipped message keys, this table store the message keys with their index in the chain
-	*  - DHid : foreign key, link to the key chain table: DR_Message_Skipped_DH
-	*  - Nr : the id in the key chain
-	*  - MK : the message key stored
-	*  primary key is [DHid,Nr]
-	*/
-	sql<<"CREATE TABLE DR_MSk_MK( \
-				DHid INTEGER NOT NULL, \
-				Nr INTEGER NOT NULL, \
-				MK BLOB NOT NULL, \
-				PRIMARY KEY( DHid , Nr ), \
-				FOREIGN KEY(DHid) REFERENCES DR_MSk_DHr(DHid) ON UPDATE CASCADE ON DELETE CASCADE);";
+	create_DRMSkMKTable("DR_MSk_MK");
 
 	/*** Lime tables : local user identities, peer devices identities ***/
 	/* List each self account enable on device :
@@ -175,6 +460,7 @@ Db::Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mut
 				DeviceId TEXT NOT NULL, \
 				Ik BLOB NOT NULL, \
 				Status UNSIGNED INTEGER DEFAULT 0);";
+	sql<<"CREATE INDEX lime_PeerDevices_DeviceId ON lime_PeerDevices(DeviceId);";
 
 	/*** X3DH tables ***/
 	/* Signed pre-key :
@@ -208,9 +494,501 @@ Db::Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mut
 				timeStamp DATETIME DEFAULT CURRENT_TIMESTAMP, \
 				FOREIGN KEY(Uid) REFERENCES lime_LocalUsers(Uid) ON UPDATE CASCADE ON DELETE CASCADE);";
 
+	create_senderKeyTables();
+	create_snapshotsTable();
+
 	tr.commit(); // commit all the previous queries
 };
 
+/**
+ * @brief Create a DR sessions table and its index
+ *
+ * used at DB creation and when upgrading the schema so the table is built alongside the previous version one
+ *
+ * @param[in]	tableName	name of the table to create
+ */
+void Db::create_DRSessionsTable(const std::string &tableName) {
+	sql<<"CREATE TABLE "<<tableName<<"( \
+				Did INTEGER NOT NULL DEFAULT 0, \
+				Uid INTEGER NOT NULL DEFAULT 0, \
+				sessionId INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, \
+				state BLOB NOT NULL, \
+				AD BLOB NOT NULL, \
+				Status INTEGER NOT NULL DEFAULT 1, \
+				timeStamp DATETIME DEFAULT CURRENT_TIMESTAMP, \
+				X3DHInit BLOB DEFAULT NULL, \
+				version INTEGER NOT NULL DEFAULT 0, \
+				DHr BLOB DEFAULT NULL, \
+				FOREIGN KEY(Did) REFERENCES lime_PeerDevices(Did) ON UPDATE CASCADE ON DELETE CASCADE, \
+				FOREIGN KEY(Uid) REFERENCES lime_LocalUsers(Uid) ON UPDATE CASCADE ON DELETE CASCADE);";
+	// covers the lookup by Uid, Did and Status performed to fetch or stale sessions
+	sql<<"CREATE INDEX "<<tableName<<"_Uid_Did_Status ON "<<tableName<<"(Uid, Did, Status);";
+}
+
+/**
+ * @brief Create a skipped message keys table
+ *
+ * DR Message Skipped MK : Store chains of skipped message keys, this table store the message keys by chunks of lime::settings::DBMSkChunkSize consecutive indexes
+ *  - DHid : foreign key, link to the key chain table: DR_Message_Skipped_DH
+ *  - chunk : the index in the key chain of the first key of the chunk divided by the chunk size
+ *  - mask : bit i is set when the key of index chunk*DBMSkChunkSize + i is stored
+ *  - MKs : the message keys, the one of index chunk*DBMSkChunkSize + i at offset i*(key size). Slots of keys not stored are zeroed,
+ *  the blob ends with the last slot ever stored in this chunk.
+ *  primary key is [DHid,chunk]
+ *
+ * used at DB creation and when upgrading the schema
+ *
+ * @param[in]	tableName	name of the table to create
+ */
+void Db::create_DRMSkMKTable(const std::string &tableName) {
+	sql<<"CREATE TABLE "<<tableName<<"( \
+				DHid INTEGER NOT NULL, \
+				chunk INTEGER NOT NULL, \
+				mask INTEGER NOT NULL DEFAULT 0, \
+				MKs BLOB NOT NULL, \
+				PRIMARY KEY( DHid , chunk ), \
+				FOREIGN KEY(DHid) REFERENCES DR_MSk_DHr(DHid) ON UPDATE CASCADE ON DELETE CASCADE);";
+}
+
+/**
+ * @brief Create the sender key chains tables
+ *
+ * Sender key chains : the chain we use to encrypt to a group(lime::EncryptionPolicy::senderKey), one per local user and group
+ *  - skId : primary key
+ *  - Uid : the local user owning the chain
+ *  - groupId : the recipient user Id of the group
+ *  - chainId : random identifier of the chain
+ *  - CK : chain key, giving the message key of index idx
+ *  - idx : index of the next message key
+ *
+ * Sender key members : the devices holding the sender key chain skId, any other recipient gets it before decrypting
+ *
+ * Receiver key chains : the chains received from peer devices, one per local user, group and sender device
+ *  - Uid : the local user receiving the messages
+ *  - Did : the sender device
+ *  - groupId, chainId, CK and idx : as in lime_SenderKeyChains
+ *
+ * used at DB creation and when upgrading the schema
+ */
+void Db::create_senderKeyTables() {
+	sql<<"CREATE TABLE lime_SenderKeyChains( \
+				skId INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, \
+				Uid INTEGER NOT NULL, \
+				groupId TEXT NOT NULL, \
+				chainId BLOB NOT NULL, \
+				CK BLOB NOT NULL, \
+				idx INTEGER NOT NULL DEFAULT 0, \
+				UNIQUE(Uid, groupId), \
+				FOREIGN KEY(Uid) REFERENCES lime_LocalUsers(Uid) ON UPDATE CASCADE ON DELETE CASCADE);";
+	sql<<"CREATE TABLE lime_SenderKeyMembers( \
+				skId INTEGER NOT NULL, \
+				DeviceId TEXT NOT NULL, \
+				PRIMARY KEY(skId, DeviceId), \
+				FOREIGN KEY(skId) REFERENCES lime_SenderKeyChains(skId) ON UPDATE CASCADE ON DELETE CASCADE);";
+	sql<<"CREATE TABLE lime_ReceiverKeyChains( \
+				Uid INTEGER NOT NULL, \
+				Did INTEGER NOT NULL, \
+				groupId TEXT NOT NULL, \
+				chainId BLOB NOT NULL, \
+				CK BLOB NOT NULL, \
+				idx INTEGER NOT NULL DEFAULT 0, \
+				PRIMARY KEY(Uid, Did, groupId), \
+				FOREIGN KEY(Uid) REFERENCES lime_LocalUsers(Uid) ON UPDATE CASCADE ON DELETE CASCADE, \
+				FOREIGN KEY(Did) REFERENCES lime_PeerDevices(Did) ON UPDATE CASCADE ON DELETE CASCADE);";
+}
+
+/**
+ * @brief Create the sessions snapshots table
+ *
+ * Sessions snapshots : the key encrypting the last sessions snapshot of a local user, it is deleted when the snapshot is loaded
+ *  - Uid : the local user
+ *  - snapshotKey : the AES256-GCM key
+ *
+ * used at DB creation and when upgrading the schema
+ */
+void Db::create_snapshotsTable() {
+	sql<<"CREATE TABLE lime_SessionsSnapshots( \
+				Uid INTEGER PRIMARY KEY NOT NULL, \
+				snapshotKey BLOB NOT NULL, \
+				FOREIGN KEY(Uid) REFERENCES lime_LocalUsers(Uid) ON UPDATE CASCADE ON DELETE CASCADE);";
+}
+
+/**
+ * @brief Upgrade the DB schema from an older version to the current one
+ *
+ * Run in its own transaction with foreign keys disabled as some tables are rebuilt
+ *
+ * @param[in]	userVersion	the schema version found in DB
+ */
+void Db::update_schema(const int userVersion) {
+	LIME_LOGI<<"Lime module database schema update from v "<<userVersion<<" to v "<<static_cast<unsigned int>(lime::settings::DBuserVersion);
+	sql<<"PRAGMA foreign_keys = OFF;"; // dropping a table would otherwise cascade delete all the rows referencing it
+	try {
+		StorageTransaction tr(*this);
+		if (userVersion < 0x000002) {
+			/* 0.0.2: DR_sessions mutable state is stored in a single record */
+			create_DRSessionsTable("DR_sessions_v2");
+			sql<<"INSERT INTO DR_sessions_v2(Did,Uid,sessionId,state,AD,Status,timeStamp,X3DHInit) SELECT Did,Uid,sessionId,x'',AD,Status,timeStamp,X3DHInit FROM DR_sessions;";
+
+			// concatenating blobs in SQL produces text, build the records here
+			std::vector<long int> sessionIds{};
+			rowset<int> rs = (sql.prepare << "SELECT sessionId FROM DR_sessions;");
+			for (const auto &sessionId : rs) {
+				sessionIds.push_back(sessionId);
+			}
+
+			for (const auto sessionId : sessionIds) {
+				uint16_t Ns=0,Nr=0,PN=0;
+				blob DHr(sql), DHs(sql), RK(sql), CKs(sql), CKr(sql);
+				sql<<"SELECT Ns,Nr,PN,DHr,DHs,RK,CKs,CKr FROM DR_sessions WHERE sessionId = :sessionId LIMIT 1;", into(Ns), into(Nr), into(PN), into(DHr), into(DHs), into(RK), into(CKs), into(CKr), use(sessionId);
+				blob state(sql);
+				size_t offset = 0;
+				std::vector<uint8_t> buffer{};
+				for (auto b : {&DHr, &DHs, &RK, &CKs, &CKr}) {
+					buffer.resize(b->get_len());
+					b->read(0, (char *)(buffer.data()), buffer.size());
+					state.write(offset, (char *)(buffer.data()), buffer.size());
+					offset += buffer.size();
+				}
+				cleanBuffer(buffer.data(), buffer.size());
+				for (auto counter : {Ns, Nr, PN}) {
+					uint8_t counterBytes[2] = {static_cast<uint8_t>(counter>>8), static_cast<uint8_t>(counter&0xFF)};
+					state.write(offset, (char *)counterBytes, 2);
+					offset += 2;
+				}
+				sql<<"UPDATE DR_sessions_v2 SET state = :state WHERE sessionId = :sessionId;", use(state), use(sessionId);
+			}
+
+			sql<<"DROP TABLE DR_sessions;";
+			sql<<"ALTER TABLE DR_sessions_v2 RENAME TO DR_sessions;";
+			sql<<"DROP INDEX DR_sessions_v2_Uid_Did_Status;";
+			sql<<"CREATE INDEX DR_sessions_Uid_Did_Status ON DR_sessions(Uid, Did, Status);";
+			sql<<"CREATE INDEX DR_MSk_DHr_sessionId_DHr ON DR_MSk_DHr(sessionId, DHr);";
+			sql<<"CREATE INDEX lime_PeerDevices_DeviceId ON lime_PeerDevices(DeviceId);";
+		}
+		if (userVersion < 0x000003) {
+			/* 0.0.3: skipped message keys are stored by chunks */
+			create_DRMSkMKTable("DR_MSk_MK_v3");
+
+			// soci doesn't allow rowset and blob usage together: get the keys indexes first, then each key
+			std::vector<std::pair<long int, int>> keys{};
+			rowset<row> rs = (sql.prepare << "SELECT DHid, Nr FROM DR_MSk_MK ORDER BY DHid, Nr;");
+			for (const auto &r : rs) {
+				keys.emplace_back(static_cast<long int>(r.get<int>(0)), r.get<int>(1));
+			}
+
+			blob MK(sql);
+			std::vector<uint8_t> MKs{};
+			std::vector<uint8_t> buffer{};
+			int mask = 0;
+			for (size_t i=0; i<keys.size(); i++) {
+				const auto DHid = keys[i].first;
+				const int chunk = keys[i].second/lime::settings::DBMSkChunkSize;
+				const size_t slot = static_cast<size_t>(keys[i].second%lime::settings::DBMSkChunkSize);
+				sql<<"SELECT MK FROM DR_MSk_MK WHERE DHid = :DHid AND Nr = :Nr LIMIT 1;", into(MK), use(DHid), use(keys[i].second);
+				buffer.resize(MK.get_len());
+				MK.read(0, (char *)(buffer.data()), buffer.size());
+				if (MKs.size() < (slot+1)*buffer.size()) {
+					MKs.resize((slot+1)*buffer.size(), 0);
+				}
+				std::copy(buffer.cbegin(), buffer.cend(), MKs.begin()+slot*buffer.size());
+				mask |= 1<<slot;
+
+				// keys are sorted: write the chunk once we reach the last key of it
+				if (i+1 == keys.size() || keys[i+1].first != DHid || keys[i+1].second/lime::settings::DBMSkChunkSize != chunk) {
+					blob MKsBlob(sql);
+					MKsBlob.write(0, (char *)(MKs.data()), MKs.size());
+					sql<<"INSERT INTO DR_MSk_MK_v3(DHid,chunk,mask,MKs) VALUES(:DHid,:chunk,:mask,:MKs);", use(DHid), use(chunk), use(mask), use(MKsBlob);
+					cleanBuffer(MKs.data(), MKs.size());
+					MKs.clear();
+					mask = 0;
+				}
+			}
+			cleanBuffer(buffer.data(), buffer.size());
+
+			sql<<"DROP TABLE DR_MSk_MK;";
+			sql<<"ALTER TABLE DR_MSk_MK_v3 RENAME TO DR_MSk_MK;";
+		}
+		if (userVersion < 0x000004) {
+			/* 0.0.4: sender key chains */
+			create_senderKeyTables();
+		}
+		if (userVersion < 0x000005) {
+			/* 0.0.5: DR sessions row version, sessions snapshots. A DR_sessions table older than 0.0.2 was just rebuilt with it */
+			if (userVersion >= 0x000002) {
+				sql<<"ALTER TABLE DR_sessions ADD COLUMN version INTEGER NOT NULL DEFAULT 0;";
+			}
+			create_snapshotsTable();
+		}
+		if (userVersion < 0x000006) {
+			/* 0.0.6: DR sessions peer current public key, it is set by the next update of each session. A DR_sessions table older than 0.0.2 was just rebuilt with it */
+			if (userVersion >= 0x000002) {
+				sql<<"ALTER TABLE DR_sessions ADD COLUMN DHr BLOB DEFAULT NULL;";
+			}
+		}
+		sql<<"UPDATE db_module_version SET version = :DbVersion WHERE name='lime'", use(lime::settings::DBuserVersion);
+		tr.commit();
+	} catch (...) {
+		sql<<"PRAGMA foreign_keys = ON;";
+		throw;
+	}
+	sql<<"PRAGMA foreign_keys = ON;";
+}
+
+Db::~Db() {
+	// stop the write-behind thread and commit what it did not
+	if (m_writer.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_writer_mutex);
+			m_writer_stop = true;
+		}
+		m_writer_cv.notify_all();
+		m_writer.join();
+	}
+	try {
+		flush_sessionUpdates();
+	} catch (exception const &e) {
+		LIME_LOGE<<"Lime local storage closed with "<<m_deferredUpdates.size()<<" sessions updates not committed: "<<e.what();
+	}
+	// a pending transaction is rolled back, prepared statements must be released before the connection is closed
+	m_transaction = nullptr;
+#ifdef EC25519_ENABLED
+	m_DRStatements_C255 = nullptr;
+#endif
+#ifdef EC448_ENABLED
+	m_DRStatements_C448 = nullptr;
+#endif
+	sql.close();
+}
+
+void Db::start_transaction() {
+	if (m_transaction) {
+		throw BCTBX_EXCEPTION << "Cannot start a transaction on local storage: one is already pending";
+	}
+	// the queued sessions updates are committed on their own, a rollback of this transaction shall not lose them
+	flush_sessionUpdates();
+	m_transaction.reset(new StorageTransaction(*this));
+}
+
+void Db::commit_transaction() {
+	if (m_transaction) {
+		m_transaction->commit();
+		m_transaction = nullptr;
+	}
+}
+
+void Db::rollback_transaction() {
+	if (m_transaction) {
+		m_transaction->rollback();
+		m_transaction = nullptr;
+		m_peerDevices->clear(); // devices may have been cached from rows written in the transaction
+	}
+}
+
+/**
+ * @brief Run an operation using the DR sessions with the database write lock held, in multi-process mode only
+ *
+ * The operation runs in a transaction holding the database mutex: the cached sessions it checks against their local storage version
+ * can't be modified by another process before it saves them. When not in multi-process mode or inside a pending transaction, it just runs.
+ * On exception, the transaction is rolled back and the exception forwarded.
+ *
+ * @param[in]	operation	the operation to run
+ */
+void Db::run_exclusive(const std::function<void()> &operation) {
+	if (!m_storageOptions.multiProcess) {
+		operation();
+		return;
+	}
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	if (in_transaction()) {
+		operation();
+		return;
+	}
+	start_transaction();
+	try {
+		operation();
+		commit_transaction();
+	} catch (...) {
+		rollback_transaction();
+		throw;
+	}
+}
+
+/**
+ * @brief Execute a statement starting or ending a transaction, in multi-process mode it is tried again on busy errors
+ *
+ * The busy timeout already waits for the other connections: a busy error means they held the lock longer or
+ * the lock could not be waited for. Retries are spaced by an exponential backoff.
+ *
+ * @param[in]	db		the local storage
+ * @param[in]	statement	the statement: BEGIN, COMMIT...
+ */
+static void execute_retryOnBusy(Db &db, const char *statement) {
+	const auto &options = db.get_storageOptions();
+	const uint16_t retries = options.multiProcess?options.busyRetries:0;
+	int backoff = lime::settings::DB_busyBackoff_ms;
+	for (uint16_t attempt=0; ; attempt++) {
+		try {
+			db.sql<<statement;
+			return;
+		} catch (soci::sqlite3_soci_error const &e) {
+			const auto result = e.result() & 0xff; // primary result code
+			if ((result != SQLITE_BUSY && result != SQLITE_LOCKED) || attempt >= retries) {
+				throw;
+			}
+			LIME_LOGW<<"Lime local storage is busy, "<<statement<<" is tried again in "<<backoff<<" ms";
+			std::this_thread::sleep_for(std::chrono::milliseconds(backoff));
+			backoff = std::min(2*backoff, lime::settings::DB_busyBackoffMax_ms);
+		}
+	}
+}
+
+StorageTransaction::StorageTransaction(Db &db) : m_db(db), m_handled{false} {
+	execute_retryOnBusy(m_db, m_db.get_storageOptions().multiProcess?"BEGIN IMMEDIATE;":"BEGIN;");
+}
+
+StorageTransaction::~StorageTransaction() {
+	if (!m_handled) {
+		try {
+			rollback();
+		} catch (...) { } // nothing to do about it, the transaction is rolled back when the connection is closed anyway
+	}
+}
+
+/**
+ * @brief Commit the transaction. A busy commit leaves the transaction pending: it is tried again, see execute_retryOnBusy
+ */
+void StorageTransaction::commit() {
+	if (m_handled) {
+		throw BCTBX_EXCEPTION << "Cannot commit a local storage transaction already committed or rolled back";
+	}
+	execute_retryOnBusy(m_db, "COMMIT;");
+	m_handled = true;
+}
+
+void StorageTransaction::rollback() {
+	if (m_handled) {
+		throw BCTBX_EXCEPTION << "Cannot roll back a local storage transaction already committed or rolled back";
+	}
+	m_handled = true;
+	m_db.sql<<"ROLLBACK;";
+}
+
+/**
+ * @brief Queue a DR session update, write-behind mode only
+ *
+ * The update replaces the one already queued for this session, if any. The queue is committed by the writer thread
+ * within lime::settings::writeBehind_maxDelay_ms or at once, by this call, when it holds writeBehindDepth sessions.
+ *
+ * @note the caller must hold the database mutex
+ *
+ * @param[in]	sessionId	the DR_sessions.sessionId of the updated session
+ * @param[in]	update		the new session state
+ */
+void Db::defer_sessionUpdate(const long int sessionId, DeferredSessionUpdate &&update) {
+	auto queued = m_deferredUpdates.find(sessionId);
+	if (queued == m_deferredUpdates.end()) {
+		m_deferredUpdates.emplace(sessionId, std::move(update));
+	} else {
+		cleanBuffer(queued->second.state.data(), queued->second.state.size());
+		queued->second.state = std::move(update.state);
+		if (!update.DHr.empty()) {
+			queued->second.DHr = std::move(update.DHr);
+		}
+		queued->second.status = update.status;
+		queued->second.version = update.version;
+		queued->second.received += update.received;
+	}
+
+	if (m_deferredUpdates.size() >= m_storageOptions.writeBehindDepth) { // the queue is full: commit it now
+		flush_sessionUpdates();
+		return;
+	}
+
+	if (!m_writer.joinable()) {
+		m_writer = std::thread(&Db::writer, this);
+	}
+	std::lock_guard<std::mutex> lock(m_writer_mutex);
+	if (!m_writer_signaled) {
+		m_writer_signaled = true;
+		m_writer_cv.notify_one();
+	}
+}
+
+/**
+ * @brief Commit the sessions updates queued by the write-behind mode, in one transaction
+ *
+ * Called before anything reading the sessions or saving one at once, so the local storage is up to date and updates are committed in order.
+ * On failure the queue is kept as is, to be committed again later
+ */
+void Db::flush_sessionUpdates() {
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	if (m_deferredUpdates.empty()) return;
+
+	MetricsDBTimer DBTimer(m_metrics.get());
+	// join the pending transaction if there is one: there is none unless the updates were queued before it started
+	std::unique_ptr<StorageTransaction> tr{};
+	if (!in_transaction()) {
+		tr.reset(new StorageTransaction(*this));
+	}
+	blob state(sql);
+	blob DHr(sql);
+	long int sessionId = 0;
+	int status = 0;
+	int received = 0;
+	int version = 0;
+	// the version is the one the session got with its last queued update: the sessions in memory and local storage agree on it
+	statement update_decrypt = (sql.prepare << "UPDATE DR_sessions SET state= :state, DHr = :DHr, Status = 1, X3DHInit = NULL, version = :version WHERE sessionId = :sessionId;", use(state), use(DHr), use(version), use(sessionId));
+	statement update_encrypt = (sql.prepare << "UPDATE DR_sessions SET state= :state, Status = :active_status, version = :version WHERE sessionId = :sessionId;", use(state), use(status), use(version), use(sessionId));
+	statement increase_DHr_received = (sql.prepare << "UPDATE DR_MSk_DHr SET received = received + :received WHERE sessionId = :sessionId", use(received), use(sessionId));
+	for (const auto &queued : m_deferredUpdates) {
+		const auto &update = queued.second;
+		sessionId = queued.first;
+		version = update.version;
+		state.trim(0);
+		state.write(0, (const char *)(update.state.data()), update.state.size());
+		if (update.DHr.empty()) { // only encrypted since the last commit
+			status = update.status;
+			update_encrypt.execute(true);
+		} else {
+			DHr.trim(0);
+			DHr.write(0, (const char *)(update.DHr.data()), update.DHr.size());
+			update_decrypt.execute(true);
+		}
+		if (update.received > 0) {
+			received = update.received;
+			increase_DHr_received.execute(true);
+		}
+	}
+	if (tr) tr->commit();
+
+	for (auto &queued : m_deferredUpdates) {
+		cleanBuffer(queued.second.state.data(), queued.second.state.size());
+	}
+	m_deferredUpdates.clear();
+}
+
+/* write-behind thread: once updates are queued, wait for more of them during the grouping delay and commit them together */
+void Db::writer() {
+	std::unique_lock<std::mutex> lock(m_writer_mutex);
+	while (!m_writer_stop) {
+		m_writer_cv.wait(lock, [this]{return m_writer_stop || m_writer_signaled;});
+		if (m_writer_stop) break;
+		m_writer_cv.wait_for(lock, std::chrono::milliseconds(lime::settings::writeBehind_maxDelay_ms), [this]{return m_writer_stop;});
+		m_writer_signaled = false;
+		lock.unlock(); // updates can be queued while we commit, they will signal us again
+		try {
+			flush_sessionUpdates();
+		} catch (exception const &e) {
+			LIME_LOGE<<"Lime local storage failed to commit the queued sessions updates, will retry: "<<e.what();
+			lock.lock();
+			m_writer_signaled = true;
+			continue;
+		}
+		lock.lock();
+	}
+}
+
 /**
  * @brief Check for existence, retrieve Uid for local user based on its userId (GRUU) and curve from table lime_LocalUsers
  *
@@ -223,7 +1001,7 @@ Db::Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mut
  */
 void Db::load_LimeUser(const std::string &deviceId, long int &Uid, lime::CurveId &curveId, std::string &url, const bool allStatus)
 {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	int curve=0;
 	sql<<"SELECT Uid,curveId,server FROM lime_LocalUsers WHERE UserId = :userId LIMIT 1;", into(Uid), into(curve), into(url), use(deviceId);
 
@@ -268,7 +1046,8 @@ void Db::load_LimeUser(const std::string &deviceId, long int &Uid, lime::CurveId
  * 	Once we moved to next chain(as soon as peer got an answer from us and replies), the count won't be reset anymore
  */
 void Db::clean_DRSessions() {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	flush_sessionUpdates(); // the queued session updates refresh the sessions timestamp
 	// WARNING: not sure this code is portable it may work with sqlite3 only
 	// delete stale sessions considered to old
 	sql<<"DELETE FROM DR_sessions WHERE Status=0 AND timeStamp < date('now', '-"<<lime::settings::DRSession_limboTime_days<<" day');";
@@ -283,19 +1062,190 @@ void Db::clean_DRSessions() {
  * SPk in stale status for more than SPK_limboTime_days are deleted
  */
 void Db::clean_SPk() {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	// WARNING: not sure this code is portable it may work with sqlite3 only
 	// delete stale sessions considered to old
 	sql<<"DELETE FROM X3DH_SPK WHERE Status=0 AND timeStamp < date('now', '-"<<lime::settings::SPK_limboTime_days<<" day');";
 }
 
+/**
+ * @brief Delete by batches what clean_DRSessions, clean_SPk and X3DH_updateOPkStatus delete for all users at once
+ *
+ * Each batch deletes at most lime::settings::cleanup_batchSize rows and holds the database mutex on its own.
+ * Before each batch, the encryptions and decryptions in progress on this storage are given time to complete(see WorkLanes).
+ * The skipped message keys are deleted before their chains, the chains before their sessions, so no delete cascades over a large number of rows.
+ * The table being cleaned is kept in m_cleanupStage: the next call resumes there.
+ *
+ * @param[in]	deadline	no batch is started after it
+ * @param[in,out]	rowBudget	maximum number of rows to delete, decreased by the number of deleted ones
+ *
+ * @return true when there is nothing left to delete, false when the deadline or the rows budget was reached first
+ */
+bool Db::clean_incremental(const std::chrono::steady_clock::time_point &deadline, size_t &rowBudget) {
+	// WARNING: not sure this code is portable it may work with sqlite3 only(rowid, LIMIT in sub-queries)
+	const std::string staleDRSession{std::string{"s.Status=0 AND s.timeStamp < date('now', '-"}.append(std::to_string(lime::settings::DRSession_limboTime_days)).append(" day')")};
+	const std::string staleChain{std::string{"(d.received > "}.append(std::to_string(lime::settings::maxMessagesReceivedAfterSkip)).append(" OR (").append(staleDRSession).append("))")};
+	const std::array<std::string, 5> cleanupQueries{{
+		// message keys of the chains to delete
+		std::string{"DELETE FROM DR_MSk_MK WHERE rowid IN (SELECT m.rowid FROM DR_MSk_MK as m INNER JOIN DR_MSk_DHr as d ON m.DHid=d.DHid INNER JOIN DR_sessions as s ON d.sessionId=s.sessionId WHERE "}.append(staleChain).append(" LIMIT :batchSize);"),
+		// the chains
+		std::string{"DELETE FROM DR_MSk_DHr WHERE DHid IN (SELECT d.DHid FROM DR_MSk_DHr as d INNER JOIN DR_sessions as s ON d.sessionId=s.sessionId WHERE "}.append(staleChain).append(" LIMIT :batchSize);"),
+		// the stale sessions
+		std::string{"DELETE FROM DR_sessions WHERE sessionId IN (SELECT s.sessionId FROM DR_sessions as s WHERE "}.append(staleDRSession).append(" LIMIT :batchSize);"),
+		// the stale SPks
+		std::string{"DELETE FROM X3DH_SPK WHERE SPKid IN (SELECT SPKid FROM X3DH_SPK WHERE Status=0 AND timeStamp < date('now', '-"}.append(std::to_string(lime::settings::SPK_limboTime_days)).append(" day') LIMIT :batchSize);"),
+		// the OPks not on the X3DH server anymore, of all users
+		std::string{"DELETE FROM X3DH_OPK WHERE OPKid IN (SELECT OPKid FROM X3DH_OPK WHERE Status=0 AND timeStamp < date('now', '-"}.append(std::to_string(lime::settings::OPk_limboTime_days)).append(" day') LIMIT :batchSize);")
+	}};
+
+	{ // the sessions are selected on their status and timestamp: commit the queued updates first
+		MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+		flush_sessionUpdates();
+	}
+
+	while (rowBudget > 0 && std::chrono::steady_clock::now() < deadline) {
+		// let the encryptions and decryptions in progress go before each batch, within the time budget
+		m_lanes->yield(std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(lime::settings::background_maxYield_ms)));
+		MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+		if (m_cleanupStage >= cleanupQueries.size()) break;
+
+		int batchSize = static_cast<int>(std::min(rowBudget, lime::settings::cleanup_batchSize));
+		statement st = (sql.prepare << cleanupQueries[m_cleanupStage], use(batchSize));
+		st.execute(true);
+		const auto deleted = static_cast<size_t>(st.get_affected_rows());
+		rowBudget -= std::min(deleted, rowBudget);
+		if (deleted < static_cast<size_t>(batchSize)) { // this table is clean
+			m_cleanupStage++;
+		}
+	}
+
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	if (m_cleanupStage >= cleanupQueries.size()) {
+		m_cleanupStage = 0; // next call starts a new cleanup
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Add to usage this database size and the rows of its local users
+ *
+ * @param[in,out]	usage	the sizes are added to it, the local users of this database are appended to its users list
+ */
+void Db::get_storageUsage(lime::StorageUsage &usage) {
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	long long pageSize = 0;
+	long long pageCount = 0;
+	long long freePages = 0;
+	int autoVacuum = 0;
+	sql<<"PRAGMA page_size;", into(pageSize);
+	sql<<"PRAGMA page_count;", into(pageCount);
+	sql<<"PRAGMA freelist_count;", into(freePages);
+	sql<<"PRAGMA auto_vacuum;", into(autoVacuum);
+	usage.fileSize += static_cast<uint64_t>(pageSize*pageCount);
+	usage.freeSize += static_cast<uint64_t>(pageSize*freePages);
+	usage.incrementalCompaction = usage.incrementalCompaction && (autoVacuum == 2); // 2 is incremental auto vacuum
+
+	// index of this database users in the usage list, by Uid
+	std::unordered_map<long int, size_t> users{};
+	rowset<row> rs = (sql.prepare << "SELECT Uid, UserId FROM lime_LocalUsers;");
+	for (const auto &r : rs) {
+		users[static_cast<long int>(r.get<int>(0))] = usage.users.size();
+		usage.users.emplace_back(r.get<std::string>(1));
+	}
+
+	// one query per table, grouped by user. The size is the one of the blobs each row holds
+	const std::array<std::pair<lime::StorageTable, std::string>, lime::storageTablesCount> usageQueries{{
+		{lime::StorageTable::DRSessions, "SELECT Uid, count(*), ifnull(sum(length(state) + length(AD) + ifnull(length(X3DHInit),0) + ifnull(length(DHr),0)),0) FROM DR_sessions GROUP BY Uid;"},
+		{lime::StorageTable::DRSkippedChains, "SELECT s.Uid, count(*), ifnull(sum(length(d.DHr)),0) FROM DR_MSk_DHr as d INNER JOIN DR_sessions as s ON d.sessionId=s.sessionId GROUP BY s.Uid;"},
+		{lime::StorageTable::DRSkippedKeys, "SELECT s.Uid, count(*), ifnull(sum(length(m.MKs)),0) FROM DR_MSk_MK as m INNER JOIN DR_MSk_DHr as d ON m.DHid=d.DHid INNER JOIN DR_sessions as s ON d.sessionId=s.sessionId GROUP BY s.Uid;"},
+		{lime::StorageTable::SPk, "SELECT Uid, count(*), ifnull(sum(length(SPK)),0) FROM X3DH_SPK GROUP BY Uid;"},
+		{lime::StorageTable::OPk, "SELECT Uid, count(*), ifnull(sum(length(OPK)),0) FROM X3DH_OPK GROUP BY Uid;"}
+	}};
+	long int Uid = 0;
+	long long rows = 0;
+	long long bytes = 0;
+	for (const auto &query : usageQueries) {
+		statement st = (sql.prepare << query.second, into(Uid), into(rows), into(bytes));
+		st.execute();
+		while (st.fetch()) {
+			auto user = users.find(Uid);
+			if (user == users.end()) continue;
+			auto &table = usage.users[user->second].tables[static_cast<size_t>(query.first)];
+			table.rows = static_cast<uint64_t>(rows);
+			table.bytes = static_cast<uint64_t>(bytes);
+		}
+	}
+}
+
+/**
+ * @brief Give the free pages of the database file back to the file system, by batches
+ *
+ * Each batch releases at most lime::settings::compaction_batchPages pages and holds the database mutex on its own.
+ * Before each batch, the encryptions and decryptions in progress on this storage are given time to complete(see WorkLanes).
+ * A database not in incremental auto vacuum mode(created by an older version) must be rewritten once to switch to it,
+ * this is done at once, whatever the deadline, only when allowed.
+ *
+ * @param[in]	deadline	no batch is started after it
+ * @param[in]	allowVacuum	rewrite the database if it is not in incremental auto vacuum mode
+ *
+ * @return true when there is no free page left, false when the deadline was reached first or the database was not converted
+ */
+bool Db::compact_incremental(const std::chrono::steady_clock::time_point &deadline, const bool allowVacuum) {
+	{
+		MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+		int autoVacuum = 0;
+		sql<<"PRAGMA auto_vacuum;", into(autoVacuum);
+		if (autoVacuum != 2) { // 2 is incremental
+			if (!allowVacuum) {
+				LIME_LOGI<<"Lime local storage is not in incremental compaction mode, it must be converted first";
+				return false;
+			}
+			if (in_transaction()) {
+				return false;
+			}
+			flush_sessionUpdates();
+			// VACUUM fails while a statement is in progress: release the prepared ones, they are prepared again at next use
+#ifdef EC25519_ENABLED
+			m_DRStatements_C255 = nullptr;
+#endif
+#ifdef EC448_ENABLED
+			m_DRStatements_C448 = nullptr;
+#endif
+			LIME_LOGI<<"Lime local storage conversion to incremental compaction mode";
+			sql<<"PRAGMA auto_vacuum = INCREMENTAL;";
+			sql<<"VACUUM;"; // the file is rewritten without free pages
+			return true;
+		}
+	}
+
+	long long freePages = 0;
+	while (std::chrono::steady_clock::now() < deadline) {
+		// let the encryptions and decryptions in progress go before each batch, within the time budget
+		m_lanes->yield(std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(lime::settings::background_maxYield_ms)));
+		MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+		if (in_transaction()) { // do not make the pages release part of a caller's transaction
+			return false;
+		}
+		sql<<"PRAGMA freelist_count;", into(freePages);
+		if (freePages == 0) {
+			return true;
+		}
+		sql<<"PRAGMA incremental_vacuum("<<lime::settings::compaction_batchPages<<");";
+	}
+
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	sql<<"PRAGMA freelist_count;", into(freePages);
+	return freePages == 0;
+}
+
 /**
  * @brief Get a list of deviceIds of all local users present in localStorage
  *
  * @param[out]	deviceIds	the list of all local users (their device Id)
  */
 void Db::get_allLocalDevices(std::vector<std::string> &deviceIds) {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	deviceIds.clear();
 	rowset<row> rs = (sql.prepare << "SELECT UserId FROM lime_LocalUsers;");
 	for (const auto &r : rs) {
@@ -337,7 +1287,7 @@ void Db::get_allLocalDevices(std::vector<std::string> &deviceIds) {
  *       - insert/update the status. If inserted, insert an invalid Ik
  */
 void Db::set_peerDeviceStatus(const std::string &peerDeviceId, const std::vector<uint8_t> &Ik, lime::PeerDeviceStatus status) {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	// if status is unsafe or untrusted, call the variant without Ik
 	if (status == lime::PeerDeviceStatus::unsafe || status == lime::PeerDeviceStatus::untrusted) {
 		this->set_peerDeviceStatus(peerDeviceId, status);
@@ -378,6 +1328,7 @@ void Db::set_peerDeviceStatus(const std::string &peerDeviceId, const std::vector
 		Ik_insert_blob.write(0, (char *)(Ik.data()), Ik.size());
 		sql<<"INSERT INTO Lime_PeerDevices(DeviceId, Ik, Status) VALUES(:peerDeviceId, :Ik, :Status);", use(peerDeviceId), use(Ik_insert_blob), use(statusInteger);
 	}
+	m_peerDevices->erase(peerDeviceId);
 }
 
 /**
@@ -386,7 +1337,7 @@ void Db::set_peerDeviceStatus(const std::string &peerDeviceId, const std::vector
  * Calls with status unsafe or untrusted are executed by this function as they do not need Ik.
  */
 void Db::set_peerDeviceStatus(const std::string &peerDeviceId, lime::PeerDeviceStatus status) {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	// Check the status flag value, accepted values are: untrusted, unsafe
 	if (status != lime::PeerDeviceStatus::unsafe
 	&& status != lime::PeerDeviceStatus::untrusted) {
@@ -432,6 +1383,60 @@ void Db::set_peerDeviceStatus(const std::string &peerDeviceId, lime::PeerDeviceS
 		Ik_insert_blob.write(0, (char *)(&lime::settings::DBInvalidIk), sizeof(lime::settings::DBInvalidIk));
 		sql<<"INSERT INTO Lime_PeerDevices(DeviceId, Ik, Status) VALUES(:peerDeviceId, :Ik, :Status);", use(peerDeviceId), use(Ik_insert_blob), use(statusInteger);
 	}
+	m_peerDevices->erase(peerDeviceId);
+}
+
+/**
+ * @brief convert a peer device status read from local storage
+ *
+ * @param[in]	peerDeviceId	The device Id, for logging
+ * @param[in]	status		The lime_PeerDevices.Status value
+ *
+ * @throws	BCTBX_EXCEPTION	if the value is not a status that can be stored
+ */
+static lime::PeerDeviceStatus peerDeviceStatus_fromDB(const std::string &peerDeviceId, const int status) {
+	switch (status) {
+		case static_cast<uint8_t>(lime::PeerDeviceStatus::untrusted) :
+			return lime::PeerDeviceStatus::untrusted;
+		case static_cast<uint8_t>(lime::PeerDeviceStatus::trusted) :
+			return lime::PeerDeviceStatus::trusted;
+		case static_cast<uint8_t>(lime::PeerDeviceStatus::unsafe) :
+			return lime::PeerDeviceStatus::unsafe;
+		default:
+			throw BCTBX_EXCEPTION << "Trying to get the status for peer device "<<peerDeviceId<<" but get an unexpected value "<<status<<" from local storage";
+	}
+}
+
+/**
+ * @brief get a peer device row, from the peer devices cache or from local storage
+ *
+ * Rows read from local storage are inserted in the cache.
+ *
+ * @param[in]	peerDeviceId	The device Id of peer, shall be its GRUU
+ * @param[out]	record		The device row
+ *
+ * @return false if the device is not in local storage
+ */
+bool Db::load_peerDevice(const std::string &peerDeviceId, PeerDeviceRecord &record) {
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	const bool useCache = !m_storageOptions.multiProcess; // the cache would not see the other processes writes
+	if (useCache && m_peerDevices->get(peerDeviceId, record)) return true;
+
+	const auto generation = m_peerDevices->generation();
+	blob Ik_blob(sql);
+	long int Did = 0;
+	int status = 0;
+	sql<<"SELECT Did, Ik, Status FROM lime_PeerDevices WHERE DeviceId = :peerDeviceId LIMIT 1;", into(Did), into(Ik_blob), into(status), use(peerDeviceId);
+	if (!sql.got_data()) return false;
+
+	record.Did = Did;
+	record.Ik.resize(Ik_blob.get_len());
+	if (!record.Ik.empty()) {
+		Ik_blob.read(0, (char *)(record.Ik.data()), record.Ik.size());
+	}
+	record.status = peerDeviceStatus_fromDB(peerDeviceId, status);
+	if (useCache) m_peerDevices->put(peerDeviceId, record, generation);
+	return true;
 }
 
 /**
@@ -442,20 +1447,9 @@ void Db::set_peerDeviceStatus(const std::string &peerDeviceId, lime::PeerDeviceS
  * @return unknown if the device is not in localStorage, untrusted, trusted or unsafe according to the stored value of peer device status flag otherwise
  */
 lime::PeerDeviceStatus Db::get_peerDeviceStatus(const std::string &peerDeviceId) {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
-	int status;
-	sql<<"SELECT Status FROM Lime_PeerDevices WHERE DeviceId = :peerDeviceId LIMIT 1;", into(status), use(peerDeviceId);
-	if (sql.got_data()) { // Found it
-		switch (status) {
-			case static_cast<uint8_t>(lime::PeerDeviceStatus::untrusted) :
-				return lime::PeerDeviceStatus::untrusted;
-			case static_cast<uint8_t>(lime::PeerDeviceStatus::trusted) :
-				return lime::PeerDeviceStatus::trusted;
-			case static_cast<uint8_t>(lime::PeerDeviceStatus::unsafe) :
-				return lime::PeerDeviceStatus::unsafe;
-			default:
-				throw BCTBX_EXCEPTION << "Trying to get the status for peer device "<<peerDeviceId<<" but get an unexpected value "<<status<<" from local storage";
-		}
+	PeerDeviceRecord record;
+	if (load_peerDevice(peerDeviceId, record)) { // Found it
+		return record.status;
 	}
 
 	// peerDeviceId not found in local storage
@@ -470,7 +1464,7 @@ lime::PeerDeviceStatus Db::get_peerDeviceStatus(const std::string &peerDeviceId)
  * @return true if it exists, false otherwise
  */
 bool Db::is_localUser(const std::string &deviceId) {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	int count = 0;
 	sql<<"SELECT count(*) FROM Lime_LocalUsers WHERE UserId = :deviceId LIMIT 1;", into(count), use(deviceId);
 	return sql.got_data() && count > 0;
@@ -484,8 +1478,10 @@ bool Db::is_localUser(const std::string &deviceId) {
  * Call is silently ignored if the device is not found in local storage
  */
 void Db::delete_peerDevice(const std::string &peerDeviceId) {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	flush_sessionUpdates(); // do not leave queued updates on deleted sessions
 	sql<<"DELETE FROM lime_peerDevices WHERE DeviceId = :peerDeviceId;", use(peerDeviceId);
+	m_peerDevices->erase(peerDeviceId);
 }
 
 /**
@@ -501,23 +1497,21 @@ void Db::delete_peerDevice(const std::string &peerDeviceId) {
  */
 template <typename Curve>
 long int Db::check_peerDevice(const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, const bool updateInvalid) {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	try {
-		blob Ik_blob(sql);
-		long int Did=0;
+		PeerDeviceRecord record;
 
 		// make sure this device wasn't already here, if it was, check they have the same Ik
-		sql<<"SELECT Ik,Did FROM lime_PeerDevices WHERE DeviceId = :DeviceId LIMIT 1;", into(Ik_blob), into(Did), use(peerDeviceId);
-		if (sql.got_data()) { // Found one
-			const auto stored_Ik_size = Ik_blob.get_len();
+		if (load_peerDevice(peerDeviceId, record)) { // Found one
+			const auto Did = record.Did;
+			const auto stored_Ik_size = record.Ik.size();
 			if (stored_Ik_size == 1) { //Ik seems to be lime::settings::DBInvalidIk, check that
-				uint8_t stored_Invalid_Ik = ~lime::settings::DBInvalidIk; // make sure the initial value is not the one we test against
-				Ik_blob.read(0, (char *)(&stored_Invalid_Ik), 1); // Read it
-				if (stored_Invalid_Ik == lime::settings::DBInvalidIk) { // we stored the invalid Ik
+				if (record.Ik[0] == lime::settings::DBInvalidIk) { // we stored the invalid Ik
 					if (updateInvalid == true) { // We shall update the value with the given Ik and return the Did
 						blob Ik_update_blob(sql);
 						Ik_update_blob.write(0, (char *)(peerIk.data()), peerIk.size());
 						sql<<"UPDATE Lime_PeerDevices SET Ik = :Ik WHERE Did = :id;", use(Ik_update_blob), use(Did);
+						m_peerDevices->erase(peerDeviceId);
 						LIME_LOGW << "Check peer device status updated empty/invalid Ik for peer device "<<peerDeviceId;
 						return Did;
 					} else { // just proceed as the key were not in base
@@ -530,9 +1524,7 @@ long int Db::check_peerDevice(const std::string &peerDeviceId, const DSA<Curve,
 				LIME_LOGE<<"It appears that peer device "<<peerDeviceId<<" was known with an identity key but is trying to use another one now";
 				throw BCTBX_EXCEPTION << "Peer device "<<peerDeviceId<<" changed its Ik";
 			}
-			DSA<Curve, lime::DSAtype::publicKey> stored_Ik;
-			Ik_blob.read(0, (char *)(stored_Ik.data()), stored_Ik.size()); // Read it to compare it to the given one
-			if (stored_Ik == peerIk) { // they match, so we just return the Did
+			if (std::equal(record.Ik.cbegin(), record.Ik.cend(), peerIk.cbegin())) { // they match, so we just return the Did
 				return Did;
 			} else { // Ik are not matching, peer device changed its Ik!?! Reject
 				LIME_LOGE<<"It appears that peer device "<<peerDeviceId<<" was known with an identity key but is trying to use another one now";
@@ -559,7 +1551,7 @@ long int Db::check_peerDevice(const std::string &peerDeviceId, const DSA<Curve,
  */
 template <typename Curve>
 long int Db::store_peerDevice(const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk) {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 
 	try {
 		blob Ik_blob(sql);
@@ -573,6 +1565,7 @@ long int Db::store_peerDevice(const std::string &peerDeviceId, const DSA<Curve,
 			Ik_blob.write(0, (char *)(peerIk.data()), peerIk.size());
 			sql<<"INSERT INTO lime_PeerDevices(DeviceId,Ik) VALUES (:deviceId,:Ik) ", use(peerDeviceId), use(Ik_blob);
 			sql<<"select last_insert_rowid()",into(Did);
+			m_peerDevices->erase(peerDeviceId);
 			LIME_LOGD<<"store peerDevice "<<peerDeviceId<<" with device id "<<Did;
 			return Did;
 		}
@@ -589,7 +1582,8 @@ long int Db::store_peerDevice(const std::string &peerDeviceId, const DSA<Curve,
  */
 void Db::delete_LimeUser(const std::string &deviceId)
 {
-	std::lock_guard<std::recursive_mutex> lock(*m_db_mutex);
+	MetricsLockGuard<std::recursive_mutex> lock(*m_db_mutex, m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	flush_sessionUpdates(); // do not leave queued updates on deleted sessions
 	sql<<"DELETE FROM lime_LocalUsers WHERE UserId = :userId;", use(deviceId);
 }
 
@@ -609,107 +1603,165 @@ void Db::delete_LimeUser(const std::string &deviceId)
 /* Double ratchet member functions                                            */
 /*                                                                            */
 /******************************************************************************/
+/**
+ * @brief Check if the session update can be queued by the write-behind mode of its local storage instead of being saved at once
+ *
+ * Only the updates of a stored session by encryptions or decryptions which did not store nor consume skipped message keys are.
+ * A decryption activating a stale session sets the others stale: it is saved at once too.
+ * Inside a pending transaction(decrypt_batch, run_exclusive) nothing is: the update must be rolled back with the transaction.
+ *
+ * @return true if session_defer can be used
+ */
+template <typename Curve>
+bool DR<Curve>::session_deferrable() const {
+	if (!m_localStorage->writeBehind() || m_localStorage->in_transaction() || m_dbSessionId == 0 || m_usedDHid != 0 || !m_mkskipped.empty()) return false;
+	return m_dirty == DRSessionDbStatus::dirty_encrypt
+		|| ((m_dirty == DRSessionDbStatus::dirty_decrypt || m_dirty == DRSessionDbStatus::dirty_ratchet) && m_active_status);
+}
+
+/**
+ * @brief Queue the session update in the write-behind queue of its local storage, session_deferrable must be checked first
+ *
+ * @note the caller must hold the database mutex
+ */
+template <typename Curve>
+void DR<Curve>::session_defer() {
+	DeferredSessionUpdate update{};
+	DRStateRecord<Curve> record;
+	state_serialize(record);
+	update.state.assign(record.cbegin(), record.cend());
+	if (m_dirty != DRSessionDbStatus::dirty_encrypt) { // a message was decrypted
+		update.DHr.assign(m_DHr.cbegin(), m_DHr.cend());
+		update.received = 1;
+	}
+	update.status = (m_active_status==true)?0x01:0x00;
+	update.version = static_cast<int>(++m_dbVersion); // one version per update, even if several are committed at once
+	m_localStorage->defer_sessionUpdate(m_dbSessionId, std::move(update));
+}
+
+/**
+ * @brief Save the session in local storage: insert it if it is not there yet or update the parts modified according to m_dirty value
+ *
+ * @param[in]	commit	When true(default) the save is performed in its own transaction, unless one was opened with Db::start_transaction.
+ * 			In write-behind mode, the update may be queued instead(see session_deferrable).
+ * 			When false the caller is expected to have opened a transaction on this session local storage and to commit or roll it back
+ *
+ * @return true on success, exception is thrown otherwise
+ */
 template <typename Curve>
-bool DR<Curve>::session_save() {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+bool DR<Curve>::session_save(bool commit) {
+	TraceSpan span(m_localStorage->m_tracer.get(), "lime.session_save");
+	span.add("insert", static_cast<int64_t>(m_dbSessionId==0));
+	MetricsTimer timer(m_localStorage->m_metrics.get(), lime::MetricsOperation::session_save);
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get()); // waiting for the database is accounted as DB time
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+
+	if (commit && session_deferrable()) {
+		span.add("deferred", static_cast<int64_t>(1));
+		session_defer();
+		return true;
+	}
+
+	// open transaction if we are not part of a caller's one, the updates queued by the write-behind mode are committed first so they are in order
+	std::unique_ptr<StorageTransaction> tr{};
+	if (commit && !m_localStorage->in_transaction()) {
+		m_localStorage->flush_sessionUpdates();
+		tr.reset(new StorageTransaction(*m_localStorage));
+	}
 
-	// open transaction
-	transaction tr(m_localStorage->sql);
+	// per message queries are prepared once in local storage
+	auto &st = m_localStorage->get_DRStatements<Curve>();
 
 	// shall we try to insert or update?
 	bool MSk_DHr_Clean = false; // flag use to signal the need for late cleaning in DR_MSk_DHr table
 	if (m_dbSessionId==0) { // We have no id for this session row, we shall insert a new one
 		// Build blobs from DR session
-		blob DHr(m_localStorage->sql);
-		DHr.write(0, (char *)(m_DHr.data()), m_DHr.size());
-		blob DHs(m_localStorage->sql);
-		DHs.write(0, (char *)(m_DHs.publicKey().data()), m_DHs.publicKey().size()); // DHs holds Public || Private keys in the same field
-		DHs.write(m_DHs.publicKey().size(), (char *)(m_DHs.privateKey().data()), m_DHs.privateKey().size());
-		blob RK(m_localStorage->sql);
-		RK.write(0, (char *)(m_RK.data()), m_RK.size());
-		blob CKs(m_localStorage->sql);
-		CKs.write(0, (char *)(m_CKs.data()), m_CKs.size());
-		blob CKr(m_localStorage->sql);
-		CKr.write(0, (char *)(m_CKr.data()), m_CKr.size());
+		DRStateRecord<Curve> record;
+		state_serialize(record);
+		blob state(m_localStorage->sql);
+		state.write(0, (char *)(record.data()), record.size());
 		/* this one is written in base only at creation and never updated again */
 		blob AD(m_localStorage->sql);
 		AD.write(0, (char *)(m_sharedAD.data()), m_sharedAD.size());
+		blob DHr(m_localStorage->sql);
+		DHr.write(0, (char *)(m_DHr.data()), m_DHr.size());
 
 		// Check if we have a peer device already in storage
 		if (m_peerDid == 0) { // no : we must insert it(failure will result in exception being thrown, let it flow up then)
-			m_peerDid = m_localStorage->store_peerDevice(m_peerDeviceId, m_peerIk);
+			if (!m_init) {
+				throw BCTBX_EXCEPTION << "Cannot save a new DR session without its peer device";
+			}
+			m_peerDid = m_localStorage->store_peerDevice(m_init->peerDeviceId, m_init->peerIk);
 		} else {
 			// make sure we have no other session active with this pair local,peer DiD
-			m_localStorage->sql<<"UPDATE DR_sessions SET Status = 0, timeStamp = CURRENT_TIMESTAMP WHERE Did = :Did AND Uid = :Uid", use(m_peerDid), use(m_db_Uid);
+			st.Did = m_peerDid;
+			st.Uid = m_db_Uid;
+			st.stale_sessions.execute(true);
 		}
 
 		if (m_X3DH_initMessage.size()>0) {
 			blob X3DH_initMessage(m_localStorage->sql);
 			X3DH_initMessage.write(0, (char *)(m_X3DH_initMessage.data()), m_X3DH_initMessage.size());
-			m_localStorage->sql<<"INSERT INTO DR_sessions(Ns,Nr,PN,DHr,DHs,RK,CKs,CKr,AD,Did,Uid,X3DHInit) VALUES(:Ns,:Nr,:PN,:DHr,:DHs,:RK,:CKs,:CKr,:AD,:Did,:Uid,:X3DHinit);", use(m_Ns), use(m_Nr), use(m_PN), use(DHr), use(DHs), use(RK), use(CKs), use(CKr), use(AD), use(m_peerDid), use(m_db_Uid), use(X3DH_initMessage);
+			m_localStorage->sql<<"INSERT INTO DR_sessions(state,AD,Did,Uid,X3DHInit,DHr) VALUES(:state,:AD,:Did,:Uid,:X3DHinit,:DHr);", use(state), use(AD), use(m_peerDid), use(m_db_Uid), use(X3DH_initMessage), use(DHr);
 		} else {
-			m_localStorage->sql<<"INSERT INTO DR_sessions(Ns,Nr,PN,DHr,DHs,RK,CKs,CKr,AD,Did,Uid) VALUES(:Ns,:Nr,:PN,:DHr,:DHs,:RK,:CKs,:CKr,:AD,:Did,:Uid);", use(m_Ns), use(m_Nr), use(m_PN), use(DHr), use(DHs), use(RK), use(CKs), use(CKr), use(AD), use(m_peerDid), use(m_db_Uid);
+			m_localStorage->sql<<"INSERT INTO DR_sessions(state,AD,Did,Uid,DHr) VALUES(:state,:AD,:Did,:Uid,:DHr);", use(state), use(AD), use(m_peerDid), use(m_db_Uid), use(DHr);
 		}
 		// if insert went well we shall be able to retrieve the last insert id to save it in the Session object
 		/*** WARNING: unportable section of code, works only with sqlite3 backend ***/
 		m_localStorage->sql<<"select last_insert_rowid()",into(m_dbSessionId);
+		m_dbVersion = 0; // the row default
 		/*** above could should work but it doesn't, consistently return false from .get_last_insert_id... ***/
 		/*if (!(sql.get_last_insert_id("DR_sessions", m_dbSessionId))) {
 			throw;
 		} */
 
 		// At session creation, we may have to delete an OPk from storage
-		if (m_usedOPkId != 0) {
-			m_localStorage->sql<<"DELETE FROM X3DH_OPK WHERE Uid = :Uid AND OPKid = :OPk_id;", use(m_db_Uid), use(m_usedOPkId);
-			m_usedOPkId = 0;
+		if (m_init && m_init->usedOPkId != 0) {
+			m_localStorage->sql<<"DELETE FROM X3DH_OPK WHERE Uid = :Uid AND OPKid = :OPk_id;", use(m_db_Uid), use(m_init->usedOPkId);
 		}
+		// the session is now in local storage, the data needed to insert it are not anymore
+		m_init.reset();
 	} else { // we have an id, it shall already be in the db
 		// Try to update an existing row
-		try{ //TODO: make sure the update was a success, or we shall signal it
+		try{ // the update fails when the row does not hold the version of this session anymore: another process updated it
+			// the whole mutable state is held in one record, write it whatever was modified
+			DRStateRecord<Curve> record;
+			state_serialize(record);
 			switch (m_dirty) {
 				case DRSessionDbStatus::dirty: // dirty case shall actually never occurs as a dirty is set only at creation not loading, first save is processed above
 				case DRSessionDbStatus::dirty_ratchet: // ratchet&decrypt modifies all but also request to delete X3DHInit from storage
-				{
-					// make sure we have no other session active with this pair local,peer DiD
-					if (m_active_status == false) {
-						m_localStorage->sql<<"UPDATE DR_sessions SET Status = 0, timeStamp = CURRENT_TIMESTAMP WHERE Did = :Did AND Uid = :Uid", use(m_peerDid), use(m_db_Uid);
-						m_active_status = true;
-					}
-
-					// Build blobs from DR session
-					blob DHr(m_localStorage->sql);
-					DHr.write(0, (char *)(m_DHr.data()), m_DHr.size());
-					blob DHs(m_localStorage->sql);
-					DHs.write(0, (char *)(m_DHs.publicKey().data()), m_DHs.publicKey().size()); // DHs holds Public || Private keys in the same field
-					DHs.write(m_DHs.publicKey().size(), (char *)(m_DHs.privateKey().data()), m_DHs.privateKey().size());
-					blob RK(m_localStorage->sql);
-					RK.write(0, (char *)(m_RK.data()), m_RK.size());
-					blob CKs(m_localStorage->sql);
-					CKs.write(0, (char *)(m_CKs.data()), m_CKs.size());
-					blob CKr(m_localStorage->sql);
-					CKr.write(0, (char *)(m_CKr.data()), m_CKr.size());
-
-					m_localStorage->sql<<"UPDATE DR_sessions SET Ns= :Ns, Nr= :Nr, PN= :PN, DHr= :DHr,DHs= :DHs, RK= :RK, CKs= :CKs, CKr= :CKr, Status = 1,  X3DHInit = NULL WHERE sessionId = :sessionId;", use(m_Ns), use(m_Nr), use(m_PN), use(DHr), use(DHs), use(RK), use(CKs), use(CKr), use(m_dbSessionId);
-				}
-					break;
 				case DRSessionDbStatus::dirty_decrypt: // decrypt modifies: CKr and Nr. Also set Status to active and clear X3DH init message if there is one(it is actually useless as our first reply from peer shall trigger a ratchet&decrypt)
 				{
 					// make sure we have no other session active with this pair local,peer DiD
 					if (m_active_status == false) {
-						m_localStorage->sql<<"UPDATE DR_sessions SET Status = 0, timeStamp = CURRENT_TIMESTAMP WHERE Did = :Did AND Uid = :Uid", use(m_peerDid), use(m_db_Uid);
+						st.Did = m_peerDid;
+						st.Uid = m_db_Uid;
+						st.stale_sessions.execute(true);
 						m_active_status = true;
 					}
 
-					blob CKr(m_localStorage->sql);
-					CKr.write(0, (char *)(m_CKr.data()), m_CKr.size());
-					m_localStorage->sql<<"UPDATE DR_sessions SET Nr= :Nr, CKr= :CKr, Status = 1, X3DHInit = NULL WHERE sessionId = :sessionId;", use(m_Nr), use(CKr), use(m_dbSessionId);
+					st.state.write(0, (char *)(record.data()), record.size());
+					st.DHr.write(0, (char *)(m_DHr.data()), m_DHr.size());
+					st.sessionId = m_dbSessionId;
+					st.version = static_cast<int>(m_dbVersion);
+					st.update_decrypt.execute(true);
+					if (st.update_decrypt.get_affected_rows() == 0) {
+						throw BCTBX_EXCEPTION << "DR session "<<m_dbSessionId<<" was modified or deleted in local storage since it was loaded";
+					}
+					m_dbVersion++;
 				}
 					break;
 				case DRSessionDbStatus::dirty_encrypt: // encrypt modifies: CKs and Ns
 				{
-					blob CKs(m_localStorage->sql);
-					CKs.write(0, (char *)(m_CKs.data()), m_CKs.size());
-					m_localStorage->sql<<"UPDATE DR_sessions SET Ns= :Ns, CKs= :CKs, Status = :active_status WHERE sessionId = :sessionId;", use(m_Ns), use(CKs), use((m_active_status==true)?0x01:0x00), use(m_dbSessionId);
+					st.state.write(0, (char *)(record.data()), record.size());
+					st.status = (m_active_status==true)?0x01:0x00;
+					st.sessionId = m_dbSessionId;
+					st.version = static_cast<int>(m_dbVersion);
+					st.update_encrypt.execute(true);
+					if (st.update_encrypt.get_affected_rows() == 0) {
+						throw BCTBX_EXCEPTION << "DR session "<<m_dbSessionId<<" was modified or deleted in local storage since it was loaded";
+					}
+					m_dbVersion++;
 				}
 					break;
 				case DRSessionDbStatus::clean: // Session is clean? So why have we been called?
@@ -718,83 +1770,271 @@ bool DR<Curve>::session_save() {
 					break;
 			}
 		} catch (...) {
-			tr.rollback();
+			if (tr) {
+				tr->rollback();
+				m_localStorage->m_peerDevices->clear();
+			}
 			throw;
 		}
 		// updatesert went well, do we have any mkskipped row to modify
 		if (m_usedDHid !=0 ) { // ok, we consumed a key, remove it from db
-			m_localStorage->sql<<"DELETE from DR_MSk_MK WHERE DHid = :DHid AND Nr = :Nr;", use(m_usedDHid), use(m_usedNr);
+			st.DHid = m_usedDHid;
+			st.chunk = m_usedNr/lime::settings::DBMSkChunkSize;
+			auto chunkFound = st.select_MK_chunk.execute(true);
+			reset_statement(st.select_MK_chunk);
+			if (chunkFound) {
+				const size_t slot = m_usedNr%lime::settings::DBMSkChunkSize;
+				st.mask &= ~(1<<slot);
+				if (st.mask == 0) { // it was the last key of this chunk
+					st.delete_MK.execute(true);
+				} else { // wipe the key from the chunk
+					DRMKey zeros;
+					zeros.fill(0);
+					if (st.MK.get_len() >= (slot+1)*zeros.size()) {
+						st.MK.write(slot*zeros.size(), (char *)zeros.data(), zeros.size());
+					}
+					st.update_MK.execute(true);
+				}
+			}
 			MSk_DHr_Clean = true; // flag the cleaning needed in DR_MSk_DH table, we may have to remove a row in it if no more row are linked to it in DR_MSk_MK
 		} else { // we did not consume a key
 			if (m_dirty == DRSessionDbStatus::dirty_decrypt || m_dirty == DRSessionDbStatus::dirty_ratchet) { // if we did a message decrypt :
 				// update the count of posterior messages received in the stored skipped messages keys for this session (all stored chains)
-				m_localStorage->sql<<"UPDATE DR_MSk_DHr SET received = received + 1 WHERE sessionId = :sessionId", use(m_dbSessionId);
+				st.sessionId = m_dbSessionId;
+				st.increase_DHr_received.execute(true);
 			}
 		}
 	}
 
 	// Shall we insert some skipped Message keys?
 	for ( const auto &rChain : m_mkskipped) { // loop all chains of message keys, each one is a DHr associated to an unordered map of MK indexed by Nr to be saved
-		blob DHr(m_localStorage->sql);
-		DHr.write(0, (char *)(rChain.DHr.data()), rChain.DHr.size());
-		long DHid=0;
-		m_localStorage->sql<<"SELECT DHid FROM DR_MSk_DHr WHERE sessionId = :sessionId AND DHr = :DHr LIMIT 1;",into(DHid), use(m_dbSessionId), use(DHr);
-		if (!m_localStorage->sql.got_data()) { // There is no row in DR_MSk_DHr matching this key, we must add it
-			m_localStorage->sql<<"INSERT INTO DR_MSk_DHr(sessionId, DHr) VALUES(:sessionId, :DHr)", use(m_dbSessionId), use(DHr);
-			m_localStorage->sql<<"select last_insert_rowid()",into(DHid); // WARNING: unportable code, sqlite3 only, see above for more details on similar issue
+		st.DHr.write(0, (char *)(rChain.DHr.data()), rChain.DHr.size());
+		st.sessionId = m_dbSessionId;
+		auto DHrFound = st.select_DHid.execute(true);
+		reset_statement(st.select_DHid);
+		if (!DHrFound) { // There is no row in DR_MSk_DHr matching this key, we must add it
+			st.insert_DHr.execute(true);
+			m_localStorage->sql<<"select last_insert_rowid()",into(st.DHid); // WARNING: unportable code, sqlite3 only, see above for more details on similar issue
 		} else { // the chain already exists in storage, just reset its counter of newer message received
-			m_localStorage->sql<<"UPDATE DR_MSk_DHr SET received = 0 WHERE DHid = :DHid", use(DHid);
+			st.reset_DHr_received.execute(true);
 		}
-		// insert all the skipped key in the chain
-		uint16_t Nr;
-		blob MK(m_localStorage->sql);
-		statement st = (m_localStorage->sql.prepare << "INSERT INTO DR_MSk_MK(DHid,Nr,MK) VALUES(:DHid,:Nr,:Mk)", use(DHid), use(Nr), use(MK));
-
+		// keep the in memory index in sync: point it to the chain matching this DHid
+		auto chainIndex = std::find_if(m_mkskipped_index.begin(), m_mkskipped_index.end(), [&st](const ReceiverKeyChainIndex<Curve> &c){return c.DHid == st.DHid;});
+		if (chainIndex == m_mkskipped_index.end()) {
+			m_mkskipped_index.emplace_back(st.DHid, rChain.DHr);
+			chainIndex = m_mkskipped_index.end()-1;
+		}
+		// insert all the skipped key in the chain by chunks, DHid is already set
+		std::map<int, std::vector<uint16_t>> chunks{};
 		for (const auto &kv : rChain.messageKeys) { // messageKeys is an unordered map of MK indexed by Nr.
-			Nr=kv.first;
-			MK.write(0, (char *)kv.second.data(), kv.second.size());
-			st.execute(true);
+			chunks[kv.first/lime::settings::DBMSkChunkSize].push_back(kv.first);
+		}
+		std::vector<uint8_t> MKs{};
+		for (const auto &chunk : chunks) {
+			// when the chain was already stored, this chunk may hold some of its keys: merge with them
+			st.chunk = chunk.first;
+			auto chunkFound = st.select_MK_chunk.execute(true);
+			reset_statement(st.select_MK_chunk);
+			if (chunkFound) {
+				MKs.resize(st.MK.get_len());
+				st.MK.read(0, (char *)(MKs.data()), MKs.size());
+			} else {
+				st.mask = 0;
+			}
+			for (const auto Nr : chunk.second) {
+				const auto &key = rChain.messageKeys.at(Nr);
+				const size_t slot = Nr%lime::settings::DBMSkChunkSize;
+				if (MKs.size() < (slot+1)*key.size()) {
+					MKs.resize((slot+1)*key.size(), 0);
+				}
+				std::copy(key.cbegin(), key.cend(), MKs.begin()+slot*key.size());
+				st.mask |= 1<<slot;
+				chainIndex->Nr.insert(Nr);
+			}
+			st.MK.trim(0);
+			st.MK.write(0, (char *)(MKs.data()), MKs.size());
+			if (chunkFound) {
+				st.update_MK.execute(true);
+			} else {
+				st.insert_MK.execute(true);
+			}
+			cleanBuffer(MKs.data(), MKs.size());
+			MKs.clear();
+		}
+	}
+
+	// Now do the cleaning (remove unused row from DR_MKs_DHr table) if needed
+	if (MSk_DHr_Clean == true) {
+		st.DHid = m_usedDHid;
+		auto MKFound = st.select_MK_any.execute(true);
+		reset_statement(st.select_MK_any);
+		if (!MKFound) { // no more MK with this DHid, remove it
+			st.delete_DHr.execute(true);
+		}
+	}
+
+	if (tr) tr->commit();
+
+	// the consumed key is removed from the index only once it is removed from DB: an index missing a stored key would make it unreachable
+	if (m_usedDHid != 0) {
+		auto chainIndex = std::find_if(m_mkskipped_index.begin(), m_mkskipped_index.end(), [this](const ReceiverKeyChainIndex<Curve> &c){return c.DHid == m_usedDHid;});
+		if (chainIndex != m_mkskipped_index.end()) {
+			chainIndex->Nr.erase(m_usedNr);
+			if (chainIndex->Nr.empty()) {
+				m_mkskipped_index.erase(chainIndex);
+			}
+		}
+	}
+	span.add("dbSessionId", static_cast<int64_t>(m_dbSessionId));
+	return true;
+};
+
+/**
+ * @brief Save a batch of sessions in local storage within one transaction
+ *
+ * Sessions which are not dirty are ignored. If any save or the commit fails, the transaction is rolled back so none of the sessions
+ * is saved and they all stay dirty, the exception is then forwarded to the caller. The local storage bookkeeping of the sessions
+ * saved before the failure is restored: the new ones are inserted again by their next save.
+ * When joining a pending transaction, the caller must roll it back on exception.
+ * In write-behind mode, the updates which can be are queued once the others are saved(see session_deferrable).
+ * Sessions are expected to share the same local storage, any session attached to another one is saved in its own transaction.
+ *
+ * @param[in]	sessions	the sessions to save
+ */
+template <typename Curve>
+void DR<Curve>::sessions_save(const std::vector<std::shared_ptr<DR<Curve>>> &sessions) {
+	if (sessions.empty()) return;
+
+	auto localStorage = sessions.front()->m_localStorage;
+	MetricsLockGuard<std::recursive_mutex> lock(*(localStorage->m_db_mutex), localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+
+	// sort out the sessions to save now from the ones to queue
+	std::vector<bool> deferred(sessions.size(), false);
+	bool saveNow = false;
+	for (size_t i=0; i<sessions.size(); i++) {
+		const auto &session = sessions[i];
+		if (session->m_dirty != DRSessionDbStatus::clean && session->m_localStorage == localStorage) {
+			deferred[i] = session->session_deferrable();
+			saveNow = saveNow || !deferred[i];
+		}
+	}
+
+	if (saveNow) {
+		// join the pending transaction if there is one, the updates queued by the write-behind mode are committed first so they are in order
+		std::unique_ptr<StorageTransaction> tr{};
+		if (!localStorage->in_transaction()) {
+			localStorage->flush_sessionUpdates();
+			tr.reset(new StorageTransaction(*localStorage));
+		}
+		// what a save modifies of a session besides its state, restored if the transaction is rolled back
+		struct SavedBookkeeping {
+			std::shared_ptr<DR<Curve>> session;
+			long int dbSessionId;
+			long int peerDid;
+			uint32_t dbVersion;
+			bool active_status;
+			std::unique_ptr<DRSessionInit<Curve>> init; // released by the insert of a new session
+			std::vector<lime::ReceiverKeyChainIndex<Curve>> mkskipped_index; // copied only when skipped message keys are stored
+		};
+		std::vector<SavedBookkeeping> saved{};
+		try {
+			for (size_t i=0; i<sessions.size(); i++) {
+				const auto &session = sessions[i];
+				if (session->m_dirty != DRSessionDbStatus::clean && session->m_localStorage == localStorage && !deferred[i]) {
+					saved.push_back(SavedBookkeeping{session, session->m_dbSessionId, session->m_peerDid, session->m_dbVersion, session->m_active_status,
+						std::unique_ptr<DRSessionInit<Curve>>(session->m_init?new DRSessionInit<Curve>(*(session->m_init)):nullptr),
+						session->m_mkskipped.empty()?std::vector<lime::ReceiverKeyChainIndex<Curve>>{}:session->m_mkskipped_index});
+					session->session_save(false);
+				}
+			}
+			if (tr) tr->commit(); // a failed commit(ie: busy database, disk full) is handled as a failed save
+		} catch (...) {
+			if (tr) {
+				try {
+					tr->rollback();
+				} catch (...) { } // sqlite may have rolled it back already, the rows written are gone anyway
+				localStorage->m_peerDevices->clear();
+			}
+			// the rows written are gone: a new session would otherwise keep the id of a row that does not exist and never be inserted
+			for (auto &bookkeeping : saved) {
+				auto &session = bookkeeping.session;
+				session->m_dbSessionId = bookkeeping.dbSessionId;
+				session->m_peerDid = bookkeeping.peerDid;
+				session->m_dbVersion = bookkeeping.dbVersion;
+				session->m_active_status = bookkeeping.active_status;
+				if (bookkeeping.init) {
+					session->m_init = std::move(bookkeeping.init);
+				}
+				if (!session->m_mkskipped.empty()) {
+					session->m_mkskipped_index = std::move(bookkeeping.mkskipped_index);
+				}
+			}
+			throw;
 		}
 	}
 
-	// Now do the cleaning (remove unused row from DR_MKs_DHr table) if needed
-	if (MSk_DHr_Clean == true) {
-		uint16_t Nr;
-		m_localStorage->sql<<"SELECT Nr from DR_MSk_MK WHERE DHid = :DHid LIMIT 1;", into(Nr), use(m_usedDHid);
-		if (!m_localStorage->sql.got_data()) { // no more MK with this DHid, remove it
-			m_localStorage->sql<<"DELETE from DR_MSk_DHr WHERE DHid = :DHid;", use(m_usedDHid);
+	// these sessions and local storage are back in sync
+	for (size_t i=0; i<sessions.size(); i++) {
+		const auto &session = sessions[i];
+		if (session->m_localStorage == localStorage) {
+			if (deferred[i]) {
+				session->session_defer();
+			}
+			session->m_dirty = DRSessionDbStatus::clean;
+		} else if (session->m_dirty != DRSessionDbStatus::clean) { // not on the same storage, save it on its own
+			if (session->session_save() == true) {
+				session->m_dirty = DRSessionDbStatus::clean;
+			}
 		}
 	}
+}
 
-	tr.commit();
-	return true;
-};
+/**
+ * @brief Check that the session was not modified in local storage since it was loaded or saved, in multi-process mode only
+ *
+ * Another process may have updated the session(version changed), set it stale or deleted it: a cached session is then out of date.
+ * Whatever the result, it can change as soon as the database write lock is released, see Db::run_exclusive.
+ *
+ * @return true if the session matches its local storage row, always true when not in multi-process mode or for a new session
+ */
+template <typename Curve>
+bool DR<Curve>::isCurrent(void) {
+	if (!m_localStorage->multiProcess() || m_dbSessionId == 0) return true;
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	auto &st = m_localStorage->get_DRStatements<Curve>();
+	st.sessionId = m_dbSessionId;
+	const auto found = st.select_version.execute(true);
+	reset_statement(st.select_version);
+	return found && static_cast<uint32_t>(st.version) == m_dbVersion && (st.status == 1) == m_active_status;
+}
 
 template <typename Curve>
 bool DR<Curve>::session_load() {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsTimer timer(m_localStorage->m_metrics.get(), lime::MetricsOperation::session_load);
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	m_localStorage->flush_sessionUpdates(); // the session may have queued updates
 
 	// blobs to store DR session data
-	blob DHr(m_localStorage->sql);
-	blob DHs(m_localStorage->sql);
-	blob RK(m_localStorage->sql);
-	blob CKs(m_localStorage->sql);
-	blob CKr(m_localStorage->sql);
+	blob state(m_localStorage->sql);
 	blob AD(m_localStorage->sql);
 	blob X3DH_initMessage(m_localStorage->sql);
 
 	// create an empty DR session
 	indicator ind;
 	int status; // retrieve an int from DB, turn it into a bool to store in object
-	m_localStorage->sql<<"SELECT Did,Uid,Ns,Nr,PN,DHr,DHs,RK,CKs,CKr,AD,Status,X3DHInit FROM DR_sessions WHERE sessionId = :sessionId LIMIT 1", into(m_peerDid), into(m_db_Uid), into(m_Ns), into(m_Nr), into(m_PN), into(DHr), into(DHs), into(RK), into(CKs), into(CKr), into(AD), into(status), into(X3DH_initMessage,ind), use(m_dbSessionId);
-
-	if (m_localStorage->sql.got_data()) { // TODO : some more specific checks on length of retrieved data?
-		DHr.read(0, (char *)(m_DHr.data()), m_DHr.size());
-		DHs.read(0, (char *)(m_DHs.publicKey().data()), m_DHs.publicKey().size());
-		DHs.read(m_DHs.publicKey().size(), (char *)(m_DHs.privateKey().data()), m_DHs.privateKey().size());
-		RK.read(0, (char *)(m_RK.data()), m_RK.size());
-		CKs.read(0, (char *)(m_CKs.data()), m_CKs.size());
-		CKr.read(0, (char *)(m_CKr.data()), m_CKr.size());
+	int version = 0;
+	m_localStorage->sql<<"SELECT Did,Uid,state,AD,Status,X3DHInit,version FROM DR_sessions WHERE sessionId = :sessionId LIMIT 1", into(m_peerDid), into(m_db_Uid), into(state), into(AD), into(status), into(X3DH_initMessage,ind), into(version), use(m_dbSessionId);
+
+	if (m_localStorage->sql.got_data()) {
+		DRStateRecord<Curve> record;
+		if (state.get_len() != record.size()) { // the record does not match this curve layout
+			LIME_LOGE<<"Double ratchet session "<<m_dbSessionId<<" state record has an invalid size "<<state.get_len();
+			return false;
+		}
+		state.read(0, (char *)(record.data()), record.size());
+		state_deserialize(record);
 		AD.read(0, (char *)(m_sharedAD.data()), m_sharedAD.size());
 		if (ind == i_ok && X3DH_initMessage.get_len()>0) {
 			m_X3DH_initMessage.resize(X3DH_initMessage.get_len());
@@ -805,43 +2045,162 @@ bool DR<Curve>::session_load() {
 		} else {
 			m_active_status = false;
 		}
+		m_dbVersion = static_cast<uint32_t>(version);
+		mkskipped_index_load();
 		return true;
 	} else { // something went wrong with the DB, we cannot retrieve the session
 		return false;
 	}
 };
 
+/**
+ * @brief Write the mutable part of the session in its fixed layout local storage record
+ *
+ * @param[out]	record	DHr || DHs public || DHs private || RK || CKs || CKr || Ns || Nr || PN
+ */
+template <typename Curve>
+void DR<Curve>::state_serialize(DRStateRecord<Curve> &record) const {
+	auto it = record.begin();
+	it = std::copy(m_DHr.cbegin(), m_DHr.cend(), it);
+	it = std::copy(m_DHs.cpublicKey().cbegin(), m_DHs.cpublicKey().cend(), it);
+	it = std::copy(m_DHs.cprivateKey().cbegin(), m_DHs.cprivateKey().cend(), it);
+	it = std::copy(m_RK.cbegin(), m_RK.cend(), it);
+	it = std::copy(m_CKs.cbegin(), m_CKs.cend(), it);
+	it = std::copy(m_CKr.cbegin(), m_CKr.cend(), it);
+	for (const auto counter : {m_Ns, m_Nr, m_PN}) {
+		*it++ = static_cast<uint8_t>(counter>>8);
+		*it++ = static_cast<uint8_t>(counter&0xFF);
+	}
+}
+
+/**
+ * @brief Read the mutable part of the session from its fixed layout local storage record
+ *
+ * @param[in]	record	DHr || DHs public || DHs private || RK || CKs || CKr || Ns || Nr || PN
+ */
+template <typename Curve>
+void DR<Curve>::state_deserialize(const DRStateRecord<Curve> &record) {
+	auto it = record.cbegin();
+	std::copy_n(it, m_DHr.size(), m_DHr.begin()); it += m_DHr.size();
+	std::copy_n(it, m_DHs.publicKey().size(), m_DHs.publicKey().begin()); it += m_DHs.publicKey().size();
+	std::copy_n(it, m_DHs.privateKey().size(), m_DHs.privateKey().begin()); it += m_DHs.privateKey().size();
+	std::copy_n(it, m_RK.size(), m_RK.begin()); it += m_RK.size();
+	std::copy_n(it, m_CKs.size(), m_CKs.begin()); it += m_CKs.size();
+	std::copy_n(it, m_CKr.size(), m_CKr.begin()); it += m_CKr.size();
+	for (auto counter : {&m_Ns, &m_Nr, &m_PN}) {
+		*counter = static_cast<uint16_t>((static_cast<uint16_t>(*it)<<8) | *(it+1));
+		it += 2;
+	}
+}
+
+/**
+ * @brief Load the index of skipped message keys stored in DB for this session
+ *
+ * Most sessions never skip a message so this query usually returns nothing and
+ * spares the per message key lookup in DB
+ */
+template <typename Curve>
+void DR<Curve>::mkskipped_index_load() {
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	m_mkskipped_index.clear();
+
+	// soci doesn't allow rowset and blob usage together: first get all the DHid and chunks masks, then the DHr of each chain
+	rowset<row> rs = (m_localStorage->sql.prepare << "SELECT d.DHid, m.chunk, m.mask FROM DR_MSk_DHr as d INNER JOIN DR_MSk_MK as m ON d.DHid=m.DHid WHERE d.sessionId = :sessionId ORDER BY d.DHid;", use(m_dbSessionId));
+	for (const auto &r : rs) {
+		auto DHid = static_cast<long>(r.get<int>(0));
+		auto chunk = r.get<int>(1);
+		auto mask = r.get<int>(2);
+		if (m_mkskipped_index.empty() || m_mkskipped_index.back().DHid != DHid) {
+			m_mkskipped_index.emplace_back(DHid, X<Curve, lime::Xtype::publicKey>{});
+		}
+		for (uint16_t slot=0; slot<lime::settings::DBMSkChunkSize; slot++) {
+			if (mask & (1<<slot)) {
+				m_mkskipped_index.back().Nr.insert(static_cast<uint16_t>(chunk*lime::settings::DBMSkChunkSize + slot));
+			}
+		}
+	}
+
+	blob DHr(m_localStorage->sql);
+	for (auto &chainIndex : m_mkskipped_index) {
+		m_localStorage->sql<<"SELECT DHr FROM DR_MSk_DHr WHERE DHid = :DHid LIMIT 1;", into(DHr), use(chainIndex.DHid);
+		DHr.read(0, (char *)(chainIndex.DHr.data()), chainIndex.DHr.size());
+	}
+}
+
+/**
+ * @brief Look for a stored skipped message key, the in memory index is checked before the DB
+ *
+ * A key listed in the index but not found in DB was deleted by the cleanup: its chain is a past one,
+ * the message cannot be decrypted and the session shall not ratchet on it, so this throws.
+ *
+ * @param[in]	Nr	the message index in its chain
+ * @param[in]	DHr	the peer public key of its chain
+ * @param[out]	MK	the message key, when found
+ *
+ * @return true if the key was found, false if it was never stored
+ */
 template <typename Curve>
 bool DR<Curve>::trySkippedMessageKeys(const uint16_t Nr, const X<Curve, lime::Xtype::publicKey> &DHr, DRMKey &MK) {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
-	blob MK_blob(m_localStorage->sql);
-	blob DHr_blob(m_localStorage->sql);
-	DHr_blob.write(0, (char *)(DHr.data()), DHr.size());
+	MetricsTimer timer(m_localStorage->m_metrics.get(), lime::MetricsOperation::trySkippedMessageKeys);
+	// check the in memory index first: if we don't know any stored key matching DHr and Nr there is no need to ask the DB
+	auto chainIndex = std::find_if(m_mkskipped_index.begin(), m_mkskipped_index.end(), [&DHr](const ReceiverKeyChainIndex<Curve> &c){return c.DHr == DHr;});
+	if (chainIndex == m_mkskipped_index.end() || chainIndex->Nr.count(Nr) == 0) {
+		m_usedDHid=0; // make sure the DHid is not set when we didn't find anything as it is later used to remove confirmed used key from DB
+		return false;
+	}
 
-	indicator ind;
-	m_localStorage->sql<<"SELECT m.MK, m.DHid FROM DR_MSk_MK as m INNER JOIN DR_MSk_DHr as d ON d.DHid=m.DHid WHERE d.sessionId = :sessionId AND d.DHr = :DHr AND m.Nr = :Nr LIMIT 1", into(MK_blob,ind), into(m_usedDHid), use(m_dbSessionId), use(DHr_blob), use(Nr);
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	auto &st = m_localStorage->get_DRStatements<Curve>();
+	st.DHr.write(0, (char *)(DHr.data()), DHr.size());
+	st.sessionId = m_dbSessionId;
+	st.chunk = Nr/lime::settings::DBMSkChunkSize;
+	const size_t slot = Nr%lime::settings::DBMSkChunkSize;
+
+	auto MKFound = st.select_MK.execute(true);
+	reset_statement(st.select_MK);
 	// we didn't find anything
-	if (!m_localStorage->sql.got_data() || ind != i_ok || MK_blob.get_len()!=MK.size()) {
+	if (!MKFound || st.MK_ind != i_ok || (st.mask & (1<<slot)) == 0 || st.MK.get_len() < (slot+1)*MK.size()) {
 		m_usedDHid=0; // make sure the DHid is not set when we didn't find anything as it is later used to remove confirmed used key from DB
-		return false;
+		// the key was removed from DB by the cleaning process(too many messages received after it), forget it
+		chainIndex->Nr.erase(Nr);
+		if (chainIndex->Nr.empty()) {
+			m_mkskipped_index.erase(chainIndex);
+		}
+		throw BCTBX_EXCEPTION << "DR Session skipped message key "<<Nr<<" was deleted from local storage, the message is too old to be decrypted";
 	}
-	// record the Nr of extracted to be able to delete it fron base later (if decrypt ends well)
+	// record the DHid and Nr of extracted to be able to delete it fron base later (if decrypt ends well)
+	m_usedDHid=st.DHid;
 	m_usedNr=Nr;
 
-	MK_blob.read(0, (char *)(MK.data()), MK.size());
+	st.MK.read(slot*MK.size(), (char *)(MK.data()), MK.size());
 	return true;
 };
 /* template instanciations for Curves 25519 and 448 */
 #ifdef EC25519_ENABLED
 	template bool DR<C255>::session_load();
-	template bool DR<C255>::session_save();
+	template bool DR<C255>::isCurrent(void);
+	template bool DR<C255>::session_deferrable() const;
+	template void DR<C255>::session_defer();
+	template bool DR<C255>::session_save(bool commit);
+	template void DR<C255>::sessions_save(const std::vector<std::shared_ptr<DR<C255>>> &sessions);
 	template bool DR<C255>::trySkippedMessageKeys(const uint16_t Nr, const X<C255, lime::Xtype::publicKey> &DHr, DRMKey &MK);
+	template void DR<C255>::mkskipped_index_load();
+	template void DR<C255>::state_serialize(DRStateRecord<C255> &record) const;
+	template void DR<C255>::state_deserialize(const DRStateRecord<C255> &record);
 #endif
 
 #ifdef EC448_ENABLED
 	template bool DR<C448>::session_load();
-	template bool DR<C448>::session_save();
+	template bool DR<C448>::isCurrent(void);
+	template bool DR<C448>::session_deferrable() const;
+	template void DR<C448>::session_defer();
+	template bool DR<C448>::session_save(bool commit);
+	template void DR<C448>::sessions_save(const std::vector<std::shared_ptr<DR<C448>>> &sessions);
 	template bool DR<C448>::trySkippedMessageKeys(const uint16_t Nr, const X<C448, lime::Xtype::publicKey> &DHr, DRMKey &MK);
+	template void DR<C448>::mkskipped_index_load();
+	template void DR<C448>::state_serialize(DRStateRecord<C448> &record) const;
+	template void DR<C448>::state_deserialize(const DRStateRecord<C448> &record);
 #endif
 
 /******************************************************************************/
@@ -863,7 +2222,7 @@ bool DR<Curve>::trySkippedMessageKeys(const uint16_t Nr, const X<Curve, lime::Xt
 template <typename Curve>
 bool Lime<Curve>::create_user()
 {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	int Uid;
 	int curve;
 
@@ -890,7 +2249,7 @@ bool Lime<Curve>::create_user()
 	// set the Ik in Lime object?
 	//m_Ik = std::move(KeyPair<ED<Curve>>{EDDSAContext->publicKey, EDDSAContext->secretKey});
 
-	transaction tr(m_localStorage->sql);
+	StorageTransaction tr(*m_localStorage);
 
 	// insert in DB
 	try {
@@ -934,7 +2293,7 @@ bool Lime<Curve>::create_user()
  */
 template <typename Curve>
 bool Lime<Curve>::activate_user() {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	// check if the user is the DB
 	int Uid = 0;
 	int curveId = 0;
@@ -943,7 +2302,7 @@ bool Lime<Curve>::activate_user() {
 		throw BCTBX_EXCEPTION << "Lime user "<<m_selfDeviceId<<" cannot be activated, it is not present in local storage";
 	}
 
-	transaction tr(m_localStorage->sql);
+	StorageTransaction tr(*m_localStorage);
 
 	// update in DB
 	try {
@@ -965,7 +2324,7 @@ bool Lime<Curve>::activate_user() {
 template <typename Curve>
 void Lime<Curve>::get_SelfIdentityKey() {
 	if (m_Ik_loaded == false) {
-		std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+		MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 		blob Ik_blob(m_localStorage->sql);
 		m_localStorage->sql<<"SELECT Ik FROM Lime_LocalUsers WHERE Uid = :UserId LIMIT 1;", into(Ik_blob), use(m_db_Uid);
 		if (m_localStorage->sql.got_data()) { // Found it, it is stored in one buffer Public || Private
@@ -992,7 +2351,7 @@ void Lime<Curve>::X3DH_generate_SPk(X<Curve, lime::Xtype::publicKey> &publicSPk,
 	get_SelfIdentityKey();
 
 	// lock after the get_SelfIdentityKey as it also acquires this lock
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 
 	// if the load flag is on, try to load a existing active key instead of generating it
 	if (load) {
@@ -1020,26 +2379,10 @@ void Lime<Curve>::X3DH_generate_SPk(X<Curve, lime::Xtype::publicKey> &publicSPk,
 	SPkSign->set_secret(m_Ik.privateKey());
 	SPkSign->sign(publicSPk, SPk_sig);
 
-	// Generate a random SPk Id
-	// Sqlite doesn't really support unsigned value, the randomize function makes sure that the MSbit is set to 0 to not fall into strange bugs with that
-	// SPkIds must be random but unique, get one not already in
-	std::set<uint32_t> activeSPkIds{};
-	// fetch existing SPk ids from DB (SPKid is unique on all users, so really get them all, do not restrict with m_db_Uid)
-	rowset<row> rs = (m_localStorage->sql.prepare << "SELECT SPKid FROM X3DH_SPK");
-	for (const auto &r : rs) {
-		auto activeSPkId = static_cast<uint32_t>(r.get<int>(0));
-		activeSPkIds.insert(activeSPkId);
-	}
-
-	SPk_id = m_RNG->randomize();
-	while (activeSPkIds.insert(SPk_id).second == false) { // This one was already in
-		SPk_id = m_RNG->randomize();
-	}
-
 	// insert all this in DB
 	try {
 		// open a transaction as both modification shall be done or none
-		transaction tr(m_localStorage->sql);
+		StorageTransaction tr(*m_localStorage);
 
 		// We must first update potential existing SPK in base from active to stale status
 		m_localStorage->sql<<"UPDATE X3DH_SPK SET Status = 0, timeStamp = CURRENT_TIMESTAMP WHERE Uid = :Uid AND Status = 1;", use(m_db_Uid);
@@ -1047,17 +2390,73 @@ void Lime<Curve>::X3DH_generate_SPk(X<Curve, lime::Xtype::publicKey> &publicSPk,
 		blob SPk_blob(m_localStorage->sql);
 		SPk_blob.write(0, (const char *)publicSPk.data(), publicSPk.size());
 		SPk_blob.write(publicSPk.size(), (const char *)(DH->get_secret().data()), X<Curve, lime::Xtype::privateKey>::ssize());
-		m_localStorage->sql<<"INSERT INTO X3DH_SPK(SPKid,SPK,Uid) VALUES (:SPKid,:SPK,:Uid) ", use(SPk_id), use(SPk_blob), use(m_db_Uid);
+
+		// Generate a random SPk Id
+		// Sqlite doesn't really support unsigned value, the randomize function makes sure that the MSbit is set to 0 to not fall into strange bugs with that
+		// SPkIds must be random but unique(on all users): rely on the primary key constraint and draw another one if this one is already in
+		statement st = (m_localStorage->sql.prepare << "INSERT OR IGNORE INTO X3DH_SPK(SPKid,SPK,Uid) VALUES (:SPKid,:SPK,:Uid) ", use(SPk_id), use(SPk_blob), use(m_db_Uid));
+		do {
+			SPk_id = m_RNG->randomize();
+			st.execute(true);
+		} while (st.get_affected_rows() == 0);
 
 		tr.commit();
+		m_SPk_cache.clear(); // the cached active SPk is now stale
+
 	} catch (exception const &e) {
 		throw BCTBX_EXCEPTION << "SPK insertion in DB failed. DB backend says : "<<e.what();
 	}
 }
 
+/**
+ * @brief Generate a batch of key pairs
+ *
+ * Large batches are split among several threads, key pairs are generated directly in place, the shared RNG draws from each thread own context
+ *
+ * @param[out]	keyPairs	the key pairs to generate, sized by the caller
+ */
+template <typename Curve>
+void Lime<Curve>::X3DH_generate_keyPairs(std::vector<Xpair<Curve>> &keyPairs) {
+	auto generate = [&keyPairs](size_t begin, size_t end, std::shared_ptr<RNG> RNG_context) {
+		for (size_t i=begin; i<end; i++) {
+			X_generateKeyPair<Curve>(keyPairs[i], *RNG_context);
+		}
+	};
+
+	unsigned int threadsCount = std::min(std::max(std::thread::hardware_concurrency(), 1U), lime::settings::OPk_generationMaxThreads);
+	if (keyPairs.size() < lime::settings::OPk_parallelGenerationThreshold || threadsCount < 2) {
+		generate(0, keyPairs.size(), m_RNG);
+		return;
+	}
+
+	std::vector<std::thread> workers{};
+	std::vector<std::exception_ptr> errors(threadsCount);
+	auto sliceSize = (keyPairs.size() + threadsCount - 1)/threadsCount;
+	for (unsigned int t=0; t<threadsCount; t++) {
+		auto begin = std::min(t*sliceSize, keyPairs.size());
+		auto end = std::min(begin+sliceSize, keyPairs.size());
+		workers.emplace_back([&generate, &errors, t, begin, end]() {
+			try {
+				generate(begin, end, shared_RNG());
+			} catch (...) {
+				errors[t] = std::current_exception();
+			}
+		});
+	}
+	for (auto &worker : workers) {
+		worker.join();
+	}
+	for (auto &error : errors) {
+		if (error) std::rethrow_exception(error);
+	}
+}
+
 /**
  * @brief Generate (or load) a batch of OPks, store them in local storage and return their public keys with their ids.
  *
+ * The key pairs are generated without holding the database mutex, then stored by batches of lime::settings::OPk_storageBatchSize:
+ * the mutex is released between them and the encryptions and decryptions in progress go first(see WorkLanes).
+ *
  * @param[out]	publicOPks	A vector of all the generated (or loaded) OPks public keys, length shall be OPk_number unless keys are loaded from storage
  * @param[out]	OPk_ids		A vector of all keys ids, order match the one of the previous vector
  * @param[in]	OPk_number	How many keys shall we generate. This parameter is ignored if the load flag is set and we find some keys to load
@@ -1065,8 +2464,7 @@ void Lime<Curve>::X3DH_generate_SPk(X<Curve, lime::Xtype::publicKey> &publicSPk,
  */
 template <typename Curve>
 void Lime<Curve>::X3DH_generate_OPks(std::vector<X<Curve, lime::Xtype::publicKey>> &publicOPks, std::vector<uint32_t> &OPk_ids, const uint16_t OPk_number, const bool load) {
-
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsTimer timer(m_localStorage->m_metrics.get(), lime::MetricsOperation::OPkGeneration);
 
 	// make room for OPk and OPk ids
 	OPk_ids.clear();
@@ -1074,33 +2472,21 @@ void Lime<Curve>::X3DH_generate_OPks(std::vector<X<Curve, lime::Xtype::publicKey
 	publicOPks.reserve(OPk_number);
 	OPk_ids.reserve(OPk_number);
 
-	// OPkIds must be random but unique, prepare them before insertion
-	std::set<uint32_t> activeOPkIds{};
-
-	// fetch existing OPk ids from DB (OPKid is unique on all users, so really get them all, do not restrict with m_db_Uid)
-	rowset<row> rs = (m_localStorage->sql.prepare << "SELECT OPKid FROM X3DH_OPK");
-	for (const auto &r : rs) {
-		auto OPk_id = static_cast<uint32_t>(r.get<int>(0));
-		activeOPkIds.insert(OPk_id);
-	}
-
 	// Shall we try to just load OPks before generating them?
 	if (load) {
+		MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+		MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
 		blob OPk_blob(m_localStorage->sql);
 		uint32_t OPk_id;
-		// Prepare DB statement: add a filter on current user Id as we'll target all retrieved OPk_ids (soci doesn't allow rowset and blob usage together)
-		// Get Keys matching the currend user and that are not set as dispatched yet (Status = 1)
-		statement st = (m_localStorage->sql.prepare << "SELECT OPk FROM X3DH_OPK WHERE Uid = :Uid AND Status = 1 AND OPKid = :OPkId;", into(OPk_blob), use(m_db_Uid), use(OPk_id));
-
-		for (uint32_t id : activeOPkIds) { // We already have all the active OPK ids, loop on them
-			OPk_id = id; // copy the id into the bind variable
-			st.execute(true);
-			if (m_localStorage->sql.got_data()) {
-				OPk_ids.push_back(OPk_id);
-				X<Curve, lime::Xtype::publicKey> OPk;
-				OPk_blob.read(0, (char *)(OPk.data()), OPk.size()); // Read the public key
-				publicOPks.push_back(OPk);
-			}
+		// Get in one query the keys matching the current user and that are not set as dispatched yet (Status = 1)
+		// soci doesn't allow rowset and blob usage together, so fetch them one by one from the statement
+		statement st = (m_localStorage->sql.prepare << "SELECT OPKid, OPk FROM X3DH_OPK WHERE Uid = :Uid AND Status = 1;", into(OPk_id), into(OPk_blob), use(m_db_Uid));
+		st.execute();
+		while (st.fetch()) {
+			OPk_ids.push_back(OPk_id);
+			X<Curve, lime::Xtype::publicKey> OPk;
+			OPk_blob.read(0, (char *)(OPk.data()), OPk.size()); // Read the public key
+			publicOPks.push_back(OPk);
 		}
 
 		if (OPk_ids.size()>0) { // We found some OPks, all set then
@@ -1108,128 +2494,198 @@ void Lime<Curve>::X3DH_generate_OPks(std::vector<X<Curve, lime::Xtype::publicKey
 		}
 	}
 
-	// we must create OPk_number new Ids
-	while (OPk_ids.size() < OPk_number){
-		// Generate a random OPk Id
-		// Sqlite doesn't really support unsigned value, the randomize function makes sure that the MSbit is set to 0 to not fall into strange bugs with that
-		uint32_t OPk_id = m_RNG->randomize();
-
-		if (activeOPkIds.insert(OPk_id).second) { // if this one wasn't in the set
-			OPk_ids.push_back(OPk_id);
-		}
-	}
-
-	// Prepare DB statement
-	transaction tr(m_localStorage->sql);
-	blob OPk(m_localStorage->sql);
-	uint32_t OPk_id;
-	statement st = (m_localStorage->sql.prepare << "INSERT INTO X3DH_OPK(OPKid, OPK,Uid) VALUES(:OPKid,:OPK,:Uid)", use(OPk_id), use(OPk), use(m_db_Uid));
-
-	// Create an key exchange context to create key pairs
-	auto DH = make_keyExchange<Curve>();
+	// Generate the key pairs, this does not need the local storage
+	std::vector<Xpair<Curve>> OPks(OPk_number);
+	X3DH_generate_keyPairs(OPks);
 
+	size_t stored = 0; // number of OPks committed to local storage
 	try {
-		for (auto id : OPk_ids) { // loop on all ids
-			// Generate a new ECDH Key pair
-			DH->createKeyPair(m_RNG);
-
-			// Insert in DB: store Public Key || Private Key
-			OPk.write(0, (const char *)(DH->get_selfPublic().data()), X<Curve, lime::Xtype::publicKey>::ssize());
-			OPk.write(X<Curve, lime::Xtype::publicKey>::ssize(), (const char *)(DH->get_secret().data()), X<Curve, lime::Xtype::privateKey>::ssize());
-			OPk_id = id; // store also the key id
-			st.execute(true);
-
-			// set in output vector
-			publicOPks.emplace_back(DH->get_selfPublic());
+		while (stored < OPks.size()) {
+			if (stored > 0) { // let the encryptions and decryptions waiting for the local storage go before the next batch
+				m_localStorage->m_lanes->yield();
+			}
+			MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+			MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+			StorageTransaction tr(*m_localStorage);
+			blob OPk(m_localStorage->sql);
+			uint32_t OPk_id;
+			// OPkIds must be random but unique(on all users): rely on the primary key constraint and draw another one if this one is already in
+			statement st = (m_localStorage->sql.prepare << "INSERT OR IGNORE INTO X3DH_OPK(OPKid, OPK,Uid) VALUES(:OPKid,:OPK,:Uid)", use(OPk_id), use(OPk), use(m_db_Uid));
+
+			const auto batchEnd = std::min(OPks.size(), stored + lime::settings::OPk_storageBatchSize);
+			for (size_t i=stored; i<batchEnd; i++) {
+				const auto &OPkPair = OPks[i];
+				// Insert in DB: store Public Key || Private Key
+				OPk.write(0, (const char *)(OPkPair.publicKey().data()), X<Curve, lime::Xtype::publicKey>::ssize());
+				OPk.write(X<Curve, lime::Xtype::publicKey>::ssize(), (const char *)(OPkPair.privateKey().data()), X<Curve, lime::Xtype::privateKey>::ssize());
+				do {
+					// Generate a random OPk Id
+					// Sqlite doesn't really support unsigned value, the randomize function makes sure that the MSbit is set to 0 to not fall into strange bugs with that
+					OPk_id = m_RNG->randomize();
+					st.execute(true);
+				} while (st.get_affected_rows() == 0);
+
+				// set in output vectors
+				OPk_ids.push_back(OPk_id);
+				publicOPks.push_back(OPkPair.publicKey());
+			}
+			// commit this batch to DB
+			tr.commit();
+			stored = batchEnd;
 		}
 	} catch (exception &e) {
+		// the batch in progress is rolled back, delete the ones already committed: they will not be published
+		OPk_ids.resize(stored);
+		try {
+			MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+			for (auto OPk_id : OPk_ids) {
+				m_localStorage->sql<<"DELETE FROM X3DH_OPK WHERE OPKid = :OPKid;", use(OPk_id);
+			}
+		} catch (exception const &) {} // best effort: left over OPks are not on the X3DH server, the next update tags them as dispatched
 		OPk_ids.clear();
 		publicOPks.clear();
-		tr.rollback();
 		throw BCTBX_EXCEPTION << "OPK insertion in DB failed. DB backend says : "<<e.what();
 	}
-	// commit changes to DB
-	tr.commit();
+}
+
+/**
+ * @brief Get the status of peer devices, the devices in the peer devices cache are not queried and the queried ones are added to it
+ *
+ * The caller holds the local storage lock
+ *
+ * @param[in]	peerDeviceIds	the peer devices
+ * @param[out]	devicesStatus	the status of the devices found, indexed by device Id
+ *
+ * @return the number of devices not found in the peer devices cache
+ */
+template <typename Curve>
+size_t Lime<Curve>::fetch_peerDevicesStatus(const std::vector<std::string> &peerDeviceIds, std::unordered_map<std::string, lime::PeerDeviceStatus> &devicesStatus) {
+	// the lookups use prepared statements with a fixed size IN list: query the devices by chunks
+	auto &st = m_localStorage->get_DRStatements<Curve>();
+	auto &peerDevices = *(m_localStorage->m_peerDevices);
+	const bool useCache = !m_localStorage->multiProcess(); // the cache would not see the other processes writes
+
+	std::vector<std::string> uncachedDevices{};
+	for (const auto &deviceId : peerDeviceIds) {
+		PeerDeviceRecord record;
+		if (useCache && peerDevices.get(deviceId, record)) {
+			devicesStatus[deviceId] = record.status;
+		} else {
+			uncachedDevices.push_back(deviceId);
+		}
+	}
+	const auto generation = peerDevices.generation();
+	for (size_t chunkStart=0; chunkStart<uncachedDevices.size(); chunkStart+=lime::settings::DB_inListChunkSize) {
+		st.bind_deviceIds(uncachedDevices, chunkStart);
+		st.select_devicesStatus.execute();
+		while (st.select_devicesStatus.fetch()) {
+			PeerDeviceRecord record;
+			record.Did = st.Did;
+			record.Ik.resize(st.Ik.get_len());
+			if (!record.Ik.empty()) {
+				st.Ik.read(0, (char *)(record.Ik.data()), record.Ik.size());
+			}
+			try {
+				record.status = peerDeviceStatus_fromDB(st.deviceId, st.status);
+			} catch (BctbxException const &) {
+				reset_statement(st.select_devicesStatus);
+				throw;
+			}
+			devicesStatus[st.deviceId] = record.status;
+			if (useCache) peerDevices.put(st.deviceId, record, generation);
+		}
+		reset_statement(st.select_devicesStatus);
+	}
+	return uncachedDevices.size();
 }
 
 template <typename Curve>
 void Lime<Curve>::cache_DR_sessions(std::vector<RecipientInfos<Curve>> &internal_recipients, std::vector<std::string> &missing_devices) {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
-	// build a user list of missing ones : produce a list ready to be sent to SQL query: 'user','user','user',... also build a map to store shared_ptr to sessions
-	// build also a list of all peer devices used to fetch from DB their status: unknown, untrusted or trusted
-	std::string sqlString_requestedDevices{""};
-	std::string sqlString_allDevices{""};
-
-	size_t requestedDevicesCount = 0;
-	size_t allDevicesCount = 0;
+	TraceSpan span(m_localStorage->m_tracer.get(), "lime.cache_DR_sessions");
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	m_localStorage->flush_sessionUpdates(); // the sessions may have queued updates
+	// build the list of the peer devices without DR session and of all peer devices used to fetch from DB their status: unknown, untrusted or trusted
+	std::vector<std::string> requestedDevices{};
+	std::vector<std::string> allDevices{};
+	allDevices.reserve(internal_recipients.size());
 	// internal recipients holds all recipients
 	for (const auto &recipient : internal_recipients) {
 		if (recipient.DRSession == nullptr) { // query the local storage for those without DR session associated
-			sqlString_requestedDevices.append("'").append(recipient.deviceId).append("',");
-			requestedDevicesCount++;
+			requestedDevices.push_back(recipient.deviceId);
 		}
-		sqlString_allDevices.append("'").append(recipient.deviceId).append("',");  // we also build a query for all devices in the list
-		allDevicesCount++;
+		allDevices.push_back(recipient.deviceId); // we also query all devices in the list
 	}
 
-	if (allDevicesCount==0) return; // the device list was empty... this is very strange
+	if (allDevices.empty()) return; // the device list was empty... this is very strange
 
-	sqlString_allDevices.pop_back(); // remove the last ','
 	// Fill the peer device status
-	rowset<row> rs_devices = (m_localStorage->sql.prepare << "SELECT d.DeviceId, d.Status FROM lime_PeerDevices as d WHERE d.DeviceId IN ("<<sqlString_allDevices<<");");
-	std::vector<std::string> knownDevices{}; // vector of known deviceId
-	// loop all the found devices and then find them in the internal_recipient vector by looping it until find, this is not at all efficient but
-	// shall not be a real problem as recipient list won't get massive(and if they do, this part we not be the blocking one)
 	// by default at construction the RecipientInfos object have a peerStatus set to unknown so it will be kept to it for all devices not found in the localStorage
-	for (const auto &r : rs_devices) {
-		auto deviceId = r.get<std::string>(0);
-		auto status = r.get<int>(1);
-		for (auto &recipient : internal_recipients) { //look for it in the list
-			if (recipient.deviceId == deviceId) {
-				switch (status) {
-					case static_cast<uint8_t>(lime::PeerDeviceStatus::trusted) :
-						recipient.peerStatus = lime::PeerDeviceStatus::trusted;
-						break;
-					case static_cast<uint8_t>(lime::PeerDeviceStatus::untrusted) :
-						recipient.peerStatus = lime::PeerDeviceStatus::untrusted;
-						break;
-					case static_cast<uint8_t>(lime::PeerDeviceStatus::unsafe) :
-						recipient.peerStatus = lime::PeerDeviceStatus::unsafe;
-						break;
-					default : // something is wrong with the local storage
-						throw BCTBX_EXCEPTION << "Trying to get the status for peer device "<<deviceId<<" but get an unexpected value "<<status<<" from local storage";
-
-				}
-			}
+	std::unordered_map<std::string, lime::PeerDeviceStatus> devicesStatus{};
+	span.add("uncached", static_cast<int64_t>(fetch_peerDevicesStatus(allDevices, devicesStatus)));
+	for (auto &recipient : internal_recipients) {
+		auto deviceStatus = devicesStatus.find(recipient.deviceId);
+		if (deviceStatus != devicesStatus.end()) {
+			recipient.peerStatus = deviceStatus->second;
 		}
 	}
 
 	// Now do we have sessions to load?
-	if (requestedDevicesCount==0) return; // we already got them all
-
-	sqlString_requestedDevices.pop_back(); // remove the last ','
-
-	// fetch them from DB
-	rowset<row> rs = (m_localStorage->sql.prepare << "SELECT s.sessionId, d.DeviceId FROM DR_sessions as s INNER JOIN lime_PeerDevices as d ON s.Did=d.Did WHERE s.Uid= :Uid AND s.Status=1 AND d.DeviceId IN ("<<sqlString_requestedDevices<<");", use(m_db_Uid));
-
-	std::unordered_map<std::string, std::shared_ptr<DR<Curve>>> requestedDevices; // found session will be loaded and temp stored in this
-	for (const auto &r : rs) {
-		auto sessionId = r.get<int>(0);
-		auto peerDeviceId = r.get<std::string>(1);
+	span.add("requested", static_cast<int64_t>(requestedDevices.size()));
+	if (requestedDevices.empty()) return; // we already got them all
+
+	// fetch them from DB: the whole session rows come with the query, the sessions are built once the statement is reset
+	// as building a session with skipped message keys reads them from local storage
+	// the lookups use prepared statements with a fixed size IN list: query the devices by chunks
+	auto &st = m_localStorage->get_DRStatements<Curve>();
+	struct sessionRow {
+		long int sessionId;
+		long int Did;
+		std::string deviceId;
+		DRStateRecord<Curve> state;
+		SharedADBuffer AD;
+		std::vector<uint8_t> X3DH_initMessage;
+		bool hasSkippedKeys;
+		uint32_t version;
+	};
+	std::vector<sessionRow> rows{};
+	st.Uid = m_db_Uid;
+	for (size_t chunkStart=0; chunkStart<requestedDevices.size(); chunkStart+=lime::settings::DB_inListChunkSize) {
+		st.bind_deviceIds(requestedDevices, chunkStart);
+		st.select_activeSessions.execute();
+		while (st.select_activeSessions.fetch()) {
+			sessionRow row{st.sessionId, st.Did, st.deviceId, {}, {}, {}, st.hasSkippedKeys!=0, static_cast<uint32_t>(st.version)};
+			if (st.state.get_len() != row.state.size()) { // the record does not match this curve layout
+				LIME_LOGE<<"Double ratchet session "<<st.sessionId<<" state record has an invalid size "<<st.state.get_len();
+				continue;
+			}
+			st.state.read(0, (char *)(row.state.data()), row.state.size());
+			st.AD.read(0, (char *)(row.AD.data()), row.AD.size());
+			if (st.X3DHInit_ind == i_ok && st.X3DHInit.get_len()>0) {
+				row.X3DH_initMessage.resize(st.X3DHInit.get_len());
+				st.X3DHInit.read(0, (char *)(row.X3DH_initMessage.data()), row.X3DH_initMessage.size());
+			}
+			rows.push_back(std::move(row));
+		}
+		reset_statement(st.select_activeSessions);
+	}
 
-		auto DRsession = std::make_shared<DR<Curve>>(m_localStorage, sessionId, m_RNG); // load session from local storage
-		requestedDevices[peerDeviceId] = DRsession; // store found session in a our temp container
-		m_DR_sessions_cache[peerDeviceId] = DRsession; // session is also stored in cache
+	std::unordered_map<std::string, std::shared_ptr<DR<Curve>>> requestedSessions; // found session will be loaded and temp stored in this
+	for (auto &row : rows) {
+		auto DRsession = std::make_shared<DR<Curve>>(m_localStorage, row.sessionId, row.Did, m_db_Uid, row.state, row.AD, std::move(row.X3DH_initMessage), row.hasSkippedKeys, row.version, m_RNG);
+		requestedSessions[row.deviceId] = DRsession; // store found session in a our temp container
+		m_DR_sessions_cache.put(row.deviceId, DRsession); // session is also stored in cache
 	}
+	span.add("loaded", static_cast<int64_t>(requestedSessions.size()));
 
 	// loop on internal recipient and fill it with the found ones, store the missing ones in the missing_devices vector
 	for (auto &recipient : internal_recipients) {
 		if (recipient.DRSession == nullptr) { // they are missing
-			auto retrievedElem = requestedDevices.find(recipient.deviceId);
-			if (retrievedElem == requestedDevices.end()) { // we didn't found this one
+			auto retrievedElem = requestedSessions.find(recipient.deviceId);
+			if (retrievedElem == requestedSessions.end()) { // we didn't found this one
 				missing_devices.push_back(recipient.deviceId);
 			} else { // we got this one
-				recipient.DRSession = std::move(retrievedElem->second); // don't need this pointer in tmp comtainer anymore
+				recipient.DRSession = retrievedElem->second; // a device may be listed twice, keep the pointer in tmp container
 			}
 		}
 	}
@@ -1238,7 +2694,9 @@ void Lime<Curve>::cache_DR_sessions(std::vector<RecipientInfos<Curve>> &internal
 // load from local storage in DRSessions all DR session matching the peerDeviceId, ignore the one picked by id in 2nd arg
 template <typename Curve>
 void Lime<Curve>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDRSessionId, std::vector<std::shared_ptr<DR<Curve>>> &DRSessions) {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	m_localStorage->flush_sessionUpdates(); // the sessions may have queued updates
 	rowset<int> rs = (m_localStorage->sql.prepare << "SELECT s.sessionId FROM DR_sessions as s INNER JOIN lime_PeerDevices as d ON s.Did=d.Did WHERE d.DeviceId = :senderDeviceId AND s.Uid = :Uid AND s.sessionId <> :ignoreThisDRSessionId ORDER BY s.Status DESC, timeStamp ASC;", use(senderDeviceId), use (m_db_Uid), use(ignoreThisDRSessionId));
 
 	for (const auto &sessionId : rs) {
@@ -1248,19 +2706,315 @@ void Lime<Curve>::get_DRSessions(const std::string &senderDeviceId, const long i
 };
 
 /**
- * @brief retrieve matching SPk from localStorage, throw an exception if not found
+ * @brief Load from local storage the DR sessions with a peer device which already know a peer ratchet public key
+ *
+ * A session knows it when this is its current peer key or when it holds skipped message keys on this key chain.
+ * The sessions are ordered as in the lookup of all of them: active first, then the oldest stale.
+ *
+ * @param[in]	senderDeviceId		the peer device Id
+ * @param[in]	ignoreThisDRSessionId	do not load this session, 0 to load them all
+ * @param[in]	peerDH			the peer ratchet public key, as given in a message header
+ * @param[out]	DRSessions		the matching sessions are appended to it
+ */
+template <typename Curve>
+void Lime<Curve>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDRSessionId, const X<Curve, lime::Xtype::publicKey> &peerDH, std::vector<std::shared_ptr<DR<Curve>>> &DRSessions) {
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	m_localStorage->flush_sessionUpdates(); // the sessions may have queued updates
+	blob DHr(m_localStorage->sql);
+	DHr.write(0, (char *)(peerDH.data()), peerDH.size());
+
+	// soci doesn't allow rowset and blob usage together, so fetch the ids one by one from the statement
+	std::vector<long int> sessionIds{};
+	long int sessionId = 0;
+	statement st = (m_localStorage->sql.prepare << "SELECT s.sessionId FROM DR_sessions as s INNER JOIN lime_PeerDevices as d ON s.Did=d.Did WHERE d.DeviceId = :senderDeviceId AND s.Uid = :Uid AND s.sessionId <> :ignoreThisDRSessionId \
+			AND (s.DHr = :DHr OR EXISTS(SELECT 1 FROM DR_MSk_DHr as m WHERE m.sessionId = s.sessionId AND m.DHr = :skippedDHr)) ORDER BY s.Status DESC, timeStamp ASC;",
+			into(sessionId), use(senderDeviceId), use(m_db_Uid), use(ignoreThisDRSessionId), use(DHr), use(DHr));
+	st.execute();
+	while (st.fetch()) {
+		sessionIds.push_back(sessionId);
+	}
+
+	for (const auto id : sessionIds) {
+		DRSessions.push_back(make_shared<DR<Curve>>(m_localStorage, id, m_RNG));
+	}
+};
+
+/* sessions snapshot integers are big endian, written on the given number of bytes */
+static void snapshot_write(std::vector<uint8_t> &buffer, const uint32_t value, const size_t size) {
+	for (size_t i=size; i>0; i--) {
+		buffer.push_back(static_cast<uint8_t>((value>>(8*(i-1)))&0xFF));
+	}
+}
+
+static bool snapshot_read(const std::vector<uint8_t> &buffer, size_t &offset, const size_t size, uint32_t &value) {
+	if (buffer.size() < offset + size) return false;
+	value = 0;
+	for (size_t i=0; i<size; i++) {
+		value = (value<<8) | buffer[offset++];
+	}
+	return true;
+}
+
+namespace {
+	/* wipe a plain sessions snapshot, which holds the sessions keys, when leaving the scope */
+	struct snapshotWiper {
+		std::vector<uint8_t> &buffer;
+		~snapshotWiper() {cleanBuffer(buffer.data(), buffer.size());};
+	};
+} // anonymous namespace
+
+/**
+ * @brief Build an encrypted snapshot of the active sessions held in the DR sessions cache
+ *
+ * Only the sessions in sync with local storage are saved, each one with the version of its DR_sessions row.
+ * The snapshot is: deviceId size<2 bytes> || deviceId || curveId<1 byte> || IV<16 bytes> || auth tag<16 bytes> || encrypted sessions\n
+ * The part before the IV is the AEAD associated data. The sessions are, for each of them:
+ * sessionId<4 bytes> || version<4 bytes> || peer deviceId size<2 bytes> || peer deviceId || state record || AD || hasSkippedKeys<1 byte> || X3DH init size<2 bytes> || X3DH init
+ *
+ * @param[out]	snapshot	the snapshot, empty if there is no session to save
+ */
+template <typename Curve>
+void Lime<Curve>::get_sessionsSnapshot(std::vector<uint8_t> &snapshot) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> dbLock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	m_localStorage->flush_sessionUpdates(); // the snapshot records the sessions version
+	snapshot.clear();
+	// any previous snapshot is not valid anymore
+	m_localStorage->sql<<"DELETE FROM lime_SessionsSnapshots WHERE Uid = :Uid;", use(m_db_Uid);
+
+	std::unordered_map<long int, uint32_t> versions{};
+	rowset<row> rs = (m_localStorage->sql.prepare << "SELECT sessionId, version FROM DR_sessions WHERE Uid = :Uid AND Status = 1;", use(m_db_Uid));
+	for (const auto &r : rs) {
+		versions[static_cast<long int>(r.get<int>(0))] = static_cast<uint32_t>(r.get<int>(1));
+	}
+
+	struct snapshotSession {
+		uint32_t sessionId;
+		uint32_t version;
+		const std::string *peerDeviceId; // the cache key, the cache is not modified while the snapshot is built
+		DRStateRecord<Curve> state; // wiped when destroyed, a reallocation of the sessions vector leaves no copy behind
+		SharedADBuffer AD;
+		bool hasSkippedKeys;
+		std::vector<uint8_t> X3DH_initMessage;
+	};
+	std::vector<snapshotSession> sessions{};
+	sessions.reserve(m_DR_sessions_cache.size());
+	size_t plainSize = 0;
+	// least recently used first: restoring them in order gives back the same cache order
+	for (auto sessionElem = m_DR_sessions_cache.end(); sessionElem != m_DR_sessions_cache.begin();) {
+		--sessionElem;
+		sessions.emplace_back();
+		auto &session = sessions.back();
+		session.peerDeviceId = &(sessionElem->first);
+		session.hasSkippedKeys = false;
+		const auto version = versions.find(sessionElem->second->dbSessionId());
+		if (!sessionElem->second->get_snapshot(session.state, session.AD, session.X3DH_initMessage, session.hasSkippedKeys)
+			|| version == versions.end() // stale in local storage
+			|| session.peerDeviceId->size() > 0xFFFF || session.X3DH_initMessage.size() > 0xFFFF) {
+			sessions.pop_back();
+			continue;
+		}
+		session.sessionId = static_cast<uint32_t>(version->first);
+		session.version = version->second;
+		plainSize += 4 + 4 + 2 + session.peerDeviceId->size() + session.state.size() + session.AD.size() + 1 + 2 + session.X3DH_initMessage.size();
+	}
+	if (sessions.empty()) return;
+
+	// allocated once: a reallocation would leave a copy of the sessions keys in freed memory
+	std::vector<uint8_t> plain{};
+	plain.reserve(plainSize);
+	snapshotWiper wipePlain{plain};
+	for (const auto &session : sessions) {
+		snapshot_write(plain, session.sessionId, 4);
+		snapshot_write(plain, session.version, 4);
+		snapshot_write(plain, static_cast<uint32_t>(session.peerDeviceId->size()), 2);
+		plain.insert(plain.end(), session.peerDeviceId->cbegin(), session.peerDeviceId->cend());
+		plain.insert(plain.end(), session.state.cbegin(), session.state.cend());
+		plain.insert(plain.end(), session.AD.cbegin(), session.AD.cend());
+		plain.push_back(session.hasSkippedKeys?0x01:0x00);
+		snapshot_write(plain, static_cast<uint32_t>(session.X3DH_initMessage.size()), 2);
+		plain.insert(plain.end(), session.X3DH_initMessage.cbegin(), session.X3DH_initMessage.cend());
+	}
+
+	// a new random key and nonce for each snapshot
+	lime::sBuffer<lime::settings::DRrandomSeedSize> snapshotKey;
+	m_RNG->randomize(snapshotKey);
+	lime::sBuffer<lime::settings::DRrandomSeedSize> IV;
+	m_RNG->randomize(IV);
+	blob key(m_localStorage->sql);
+	key.write(0, (char *)(snapshotKey.data()), lime::settings::DRMessageKeySize);
+	m_localStorage->sql<<"INSERT INTO lime_SessionsSnapshots(Uid,snapshotKey) VALUES(:Uid,:snapshotKey);", use(m_db_Uid), use(key);
+
+	snapshot_write(snapshot, static_cast<uint32_t>(m_selfDeviceId.size()), 2);
+	snapshot.insert(snapshot.end(), m_selfDeviceId.cbegin(), m_selfDeviceId.cend());
+	snapshot.push_back(static_cast<uint8_t>(Curve::curveId()));
+	const size_t headerSize = snapshot.size();
+	snapshot.insert(snapshot.end(), IV.cbegin(), IV.cbegin()+lime::settings::DRMessageIVSize);
+	snapshot.resize(headerSize + lime::settings::DRMessageIVSize + lime::settings::DRMessageAuthTagSize + plain.size());
+	AEAD_encrypt<AES256GCM>(snapshotKey.data(), lime::settings::DRMessageKeySize,
+		snapshot.data()+headerSize, lime::settings::DRMessageIVSize,
+		plain.data(), plain.size(),
+		snapshot.data(), headerSize,
+		snapshot.data()+headerSize+lime::settings::DRMessageIVSize, lime::settings::DRMessageAuthTagSize,
+		snapshot.data()+headerSize+lime::settings::DRMessageIVSize+lime::settings::DRMessageAuthTagSize);
+}
+
+/**
+ * @brief Restore in the DR sessions cache the sessions of a snapshot still matching local storage
+ *
+ * The snapshot key is deleted from local storage whatever the outcome: a snapshot is loaded once.
+ * The sessions are checked against their DR_sessions row version, the restored ones are built without reading their row
+ * and their peer devices added to the peer devices cache. Sessions already in cache are not replaced.
+ *
+ * @param[in]	snapshot	a snapshot produced by get_sessionsSnapshot
+ *
+ * @return the number of sessions restored in cache
+ */
+template <typename Curve>
+size_t Lime<Curve>::set_sessionsSnapshot(const std::vector<uint8_t> &snapshot) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> dbLock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	m_localStorage->flush_sessionUpdates(); // the snapshot is checked against the sessions version
+
+	// check the header matches this user
+	size_t offset = 0;
+	uint32_t deviceIdSize = 0;
+	if (!snapshot_read(snapshot, offset, 2, deviceIdSize)) return 0;
+	const size_t headerSize = 2 + deviceIdSize + 1;
+	if (snapshot.size() < headerSize + lime::settings::DRMessageIVSize + lime::settings::DRMessageAuthTagSize
+		|| std::string(snapshot.cbegin()+2, snapshot.cbegin()+2+deviceIdSize) != m_selfDeviceId
+		|| snapshot[headerSize-1] != static_cast<uint8_t>(Curve::curveId())) {
+		LIME_LOGE<<"Sessions snapshot does not match user "<<m_selfDeviceId;
+		return 0;
+	}
+
+	blob key(m_localStorage->sql);
+	m_localStorage->sql<<"SELECT snapshotKey FROM lime_SessionsSnapshots WHERE Uid = :Uid LIMIT 1;", into(key), use(m_db_Uid);
+	if (!m_localStorage->sql.got_data() || key.get_len() != lime::settings::DRMessageKeySize) {
+		LIME_LOGW<<"No key for the sessions snapshot of user "<<m_selfDeviceId<<", it was already loaded or replaced";
+		return 0;
+	}
+	lime::sBuffer<lime::settings::DRMessageKeySize> snapshotKey;
+	key.read(0, (char *)(snapshotKey.data()), snapshotKey.size());
+	m_localStorage->sql<<"DELETE FROM lime_SessionsSnapshots WHERE Uid = :Uid;", use(m_db_Uid);
+
+	const size_t cipherOffset = headerSize + lime::settings::DRMessageIVSize + lime::settings::DRMessageAuthTagSize;
+	std::vector<uint8_t> plain(snapshot.size() - cipherOffset);
+	snapshotWiper wipePlain{plain}; // wiped on every exit, the authentication failure one included
+	if (!AEAD_decrypt<AES256GCM>(snapshotKey.data(), lime::settings::DRMessageKeySize,
+		snapshot.data()+headerSize, lime::settings::DRMessageIVSize,
+		snapshot.data()+cipherOffset, plain.size(),
+		snapshot.data(), headerSize,
+		snapshot.data()+headerSize+lime::settings::DRMessageIVSize, lime::settings::DRMessageAuthTagSize,
+		plain.data())) {
+		LIME_LOGE<<"Sessions snapshot of user "<<m_selfDeviceId<<" fails authentication";
+		return 0;
+	}
+
+	struct snapshotSession {
+		long int sessionId;
+		uint32_t version;
+		std::string peerDeviceId;
+		DRStateRecord<Curve> state;
+		SharedADBuffer AD;
+		bool hasSkippedKeys;
+		std::vector<uint8_t> X3DH_initMessage;
+	};
+	std::vector<snapshotSession> sessions{};
+	offset = 0;
+	while (offset < plain.size()) {
+		snapshotSession session{};
+		uint32_t sessionId = 0, size = 0;
+		if (!snapshot_read(plain, offset, 4, sessionId) || !snapshot_read(plain, offset, 4, session.version) || !snapshot_read(plain, offset, 2, size)
+			|| plain.size() < offset + size + session.state.size() + session.AD.size() + 1) {
+			break;
+		}
+		session.sessionId = static_cast<long int>(sessionId);
+		session.peerDeviceId.assign(plain.cbegin()+offset, plain.cbegin()+offset+size);
+		offset += size;
+		std::copy_n(plain.cbegin()+offset, session.state.size(), session.state.begin());
+		offset += session.state.size();
+		std::copy_n(plain.cbegin()+offset, session.AD.size(), session.AD.begin());
+		offset += session.AD.size();
+		session.hasSkippedKeys = (plain[offset++] != 0x00);
+		if (!snapshot_read(plain, offset, 2, size) || plain.size() < offset + size) break;
+		session.X3DH_initMessage.assign(plain.cbegin()+offset, plain.cbegin()+offset+size);
+		offset += size;
+		sessions.push_back(std::move(session));
+	}
+	cleanBuffer(plain.data(), plain.size());
+	if (offset != plain.size()) {
+		LIME_LOGE<<"Sessions snapshot of user "<<m_selfDeviceId<<" is malformed";
+		return 0;
+	}
+
+	// one query gives the current version of all the active sessions of this user
+	struct sessionVersion {
+		uint32_t version;
+		long int Did;
+		std::string peerDeviceId;
+	};
+	std::unordered_map<long int, sessionVersion> versions{};
+	rowset<row> rs = (m_localStorage->sql.prepare << "SELECT s.sessionId, s.version, s.Did, d.DeviceId FROM DR_sessions as s INNER JOIN lime_PeerDevices as d ON s.Did = d.Did WHERE s.Uid = :Uid AND s.Status = 1;", use(m_db_Uid));
+	for (const auto &r : rs) {
+		versions[static_cast<long int>(r.get<int>(0))] = sessionVersion{static_cast<uint32_t>(r.get<int>(1)), static_cast<long int>(r.get<int>(2)), r.get<std::string>(3)};
+	}
+
+	std::vector<std::string> restoredDevices{};
+	for (auto &session : sessions) {
+		const auto version = versions.find(session.sessionId);
+		if (version == versions.end() || version->second.version != session.version || version->second.peerDeviceId != session.peerDeviceId) continue; // modified since the snapshot
+		if (m_DR_sessions_cache.find(session.peerDeviceId) != m_DR_sessions_cache.end()) continue; // already loaded, it may be newer
+		auto DRsession = std::make_shared<DR<Curve>>(m_localStorage, session.sessionId, version->second.Did, m_db_Uid, session.state, session.AD, std::move(session.X3DH_initMessage), session.hasSkippedKeys, session.version, m_RNG);
+		m_DR_sessions_cache.put(session.peerDeviceId, DRsession);
+		restoredDevices.push_back(session.peerDeviceId);
+	}
+
+	// the first message of each restored session then finds its peer device status in cache
+	std::unordered_map<std::string, lime::PeerDeviceStatus> devicesStatus{};
+	fetch_peerDevicesStatus(restoredDevices, devicesStatus);
+	LIME_LOGI<<"Restored "<<restoredDevices.size()<<" sessions out of "<<sessions.size()<<" from the snapshot of user "<<m_selfDeviceId;
+	return restoredDevices.size();
+}
+
+/**
+ * @brief retrieve matching SPk from cache or localStorage, throw an exception if not found
+ *
+ * The SPks read are kept in cache: the active one until a new one is generated, a stale one until it is old enough to be deleted from local storage.
+ * In multi-process mode, another process may rotate and delete the SPks: they are always read from local storage.
  *
  * @param[in]	SPk_id	Id of the SPk we're trying to fetch
  * @param[out]	SPk	The SPk if found
  */
 template <typename Curve>
 void Lime<Curve>::X3DH_get_SPk(uint32_t SPk_id, Xpair<Curve> &SPk) {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	const auto now = std::chrono::steady_clock::now();
+	const bool useCache = !m_localStorage->multiProcess(); // the cache would not see the other processes rotating and deleting the SPks
+	auto cachedElem = m_SPk_cache.find(SPk_id);
+	if (useCache && cachedElem != m_SPk_cache.end()) {
+		if (cachedElem->second.active || now < cachedElem->second.expiry) {
+			SPk = cachedElem->second.SPk;
+			return;
+		}
+		m_SPk_cache.erase(cachedElem); // this one may have been deleted from local storage
+	}
+
 	blob SPk_blob(m_localStorage->sql);
-	m_localStorage->sql<<"SELECT SPk FROM X3DH_SPk WHERE Uid = :Uid AND SPKid = :SPk_id LIMIT 1;", into(SPk_blob), use(m_db_Uid), use(SPk_id);
+	int status = 0;
+	double limboTimeLeft = 0.0; // in days, for a stale SPk
+	m_localStorage->sql<<"SELECT SPk, Status, julianday(timeStamp) + "<<lime::settings::SPK_limboTime_days<<" - julianday('now') FROM X3DH_SPk WHERE Uid = :Uid AND SPKid = :SPk_id LIMIT 1;", into(SPk_blob), into(status), into(limboTimeLeft), use(m_db_Uid), use(SPk_id);
 	if (m_localStorage->sql.got_data()) { // Found it, it is stored in one buffer Public || Private
 		SPk_blob.read(0, (char *)(SPk.publicKey().data()), SPk.publicKey().size()); // Read the public key
 		SPk_blob.read(SPk.publicKey().size(), (char *)(SPk.privateKey().data()), SPk.privateKey().size()); // Read the private key
+		// a stale SPk timeStamp is set when it goes stale, it is deleted once in limbo for SPK_limboTime_days
+		if (useCache && (status == 1 || limboTimeLeft > 0)) {
+			const auto expiry = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::ratio<86400>>(limboTimeLeft));
+			m_SPk_cache[SPk_id] = cachedSPk{SPk, status == 1, expiry};
+		}
 	} else {
 		throw BCTBX_EXCEPTION << "X3DH "<<m_selfDeviceId<<"look up for SPk id "<<SPk_id<<" failed";
 	}
@@ -1271,7 +3025,7 @@ void Lime<Curve>::X3DH_get_SPk(uint32_t SPk_id, Xpair<Curve> &SPk) {
  */
 template <typename Curve>
 bool Lime<Curve>::is_currentSPk_valid(void) {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	// Do we have an active SPk for this user which is younger than SPK_lifeTime_days
 	int dummy;
 	m_localStorage->sql<<"SELECT SPKid FROM X3DH_SPk WHERE Uid = :Uid AND Status = 1 AND timeStamp > date('now', '-"<<lime::settings::SPK_lifeTime_days<<" day') LIMIT 1;", into(dummy), use(m_db_Uid);
@@ -1291,7 +3045,7 @@ bool Lime<Curve>::is_currentSPk_valid(void) {
  */
 template <typename Curve>
 void Lime<Curve>::X3DH_get_OPk(uint32_t OPk_id, Xpair<Curve> &OPk) {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	blob OPk_blob(m_localStorage->sql);
 	m_localStorage->sql<<"SELECT OPk FROM X3DH_OPK WHERE Uid = :Uid AND OPKid = :OPk_id LIMIT 1;", into(OPk_blob), use(m_db_Uid), use(OPk_id);
 	if (m_localStorage->sql.got_data()) { // Found it, it is stored in one buffer Public || Private
@@ -1310,7 +3064,7 @@ void Lime<Curve>::X3DH_get_OPk(uint32_t OPk_id, Xpair<Curve> &OPk) {
  */
 template <typename Curve>
 void Lime<Curve>::X3DH_updateOPkStatus(const std::vector<uint32_t> &OPkIds) {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
 	if (OPkIds.size()>0) { /* we have keys on server */
 		// build a comma-separated list of OPk id on server
 		std::string sqlString_OPkIds{""};
@@ -1326,14 +3080,29 @@ void Lime<Curve>::X3DH_updateOPkStatus(const std::vector<uint32_t> &OPkIds) {
 		m_localStorage->sql << "UPDATE X3DH_OPK SET Status = 0, timeStamp=CURRENT_TIMESTAMP WHERE Status = 1 AND Uid = :Uid;", use(m_db_Uid);
 	}
 
-	// Delete keys not anymore on server since too long
+	// Delete keys not anymore on server since too long, unless the incremental cleanup takes care of it
+	if (m_localStorage->get_storageOptions().deferredCleanup) return;
 	m_localStorage->sql << "DELETE FROM X3DH_OPK WHERE Uid = :Uid AND Status = 0 AND timeStamp < date('now', '-"<<lime::settings::OPk_limboTime_days<<" day');", use(m_db_Uid);
 }
 
+/**
+ * @brief count the OPks with a status telling they are likely to be on the X3DH server
+ *
+ * @return the OPks count
+ */
+template <typename Curve>
+size_t Lime<Curve>::X3DH_get_OPkCount(void) {
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	int count = 0;
+	m_localStorage->sql<<"SELECT count(*) FROM X3DH_OPK WHERE Uid = :Uid AND Status = 1;", into(count), use(m_db_Uid);
+	return static_cast<size_t>(count);
+}
+
 template <typename Curve>
 void Lime<Curve>::set_x3dhServerUrl(const std::string &x3dhServerUrl) {
-	std::lock_guard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex));
-	transaction tr(m_localStorage->sql);
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	StorageTransaction tr(*m_localStorage);
 
 	// update in DB, do not check presence as we're called after a load_user who already ensure that
 	try {
@@ -1348,20 +3117,151 @@ void Lime<Curve>::set_x3dhServerUrl(const std::string &x3dhServerUrl) {
 	tr.commit();
 }
 
+/**
+ * @brief load the sender key chain used to encrypt to a group
+ *
+ * @param[in]	groupId		the recipient user Id of the group
+ * @param[out]	chain		the chain, untouched if not found
+ * @param[out]	skId		its id in local storage, 0 if not found
+ * @param[out]	members		the devices already holding this chain
+ *
+ * @return true if a chain was found
+ */
+template <typename Curve>
+bool Lime<Curve>::load_senderKeyChain(const std::string &groupId, SenderKeyChain &chain, long int &skId, std::unordered_set<std::string> &members) {
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	skId = 0;
+	members.clear();
+	blob chainId(m_localStorage->sql);
+	blob CK(m_localStorage->sql);
+	int index = 0;
+	m_localStorage->sql<<"SELECT skId, chainId, CK, idx FROM lime_SenderKeyChains WHERE Uid = :Uid AND groupId = :groupId LIMIT 1;", into(skId), into(chainId), into(CK), into(index), use(m_db_Uid), use(groupId);
+	if (!m_localStorage->sql.got_data() || chainId.get_len() != chain.chainId.size() || CK.get_len() != chain.CK.size()) {
+		skId = 0;
+		return false;
+	}
+	chainId.read(0, (char *)(chain.chainId.data()), chain.chainId.size());
+	CK.read(0, (char *)(chain.CK.data()), chain.CK.size());
+	chain.index = static_cast<uint16_t>(index);
+
+	rowset<std::string> rs = (m_localStorage->sql.prepare << "SELECT DeviceId FROM lime_SenderKeyMembers WHERE skId = :skId;", use(skId));
+	for (const auto &deviceId : rs) {
+		members.insert(deviceId);
+	}
+	return true;
+}
+
+/**
+ * @brief store the sender key chain used to encrypt to a group
+ *
+ * @param[in]	groupId		the recipient user Id of the group
+ * @param[in]	chain		the chain
+ * @param[in]	skId		its id in local storage as given by load_senderKeyChain, 0 for a new chain: any previous one for this group is replaced
+ * @param[in]	newMembers	devices which got the chain since it was loaded
+ */
+template <typename Curve>
+void Lime<Curve>::store_senderKeyChain(const std::string &groupId, const SenderKeyChain &chain, const long int skId, const std::vector<std::string> &newMembers) {
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	std::unique_ptr<StorageTransaction> tr{};
+	if (!m_localStorage->in_transaction()) {
+		tr.reset(new StorageTransaction(*m_localStorage));
+	}
+	blob CK(m_localStorage->sql);
+	CK.write(0, (char *)(chain.CK.data()), chain.CK.size());
+	const int index = chain.index;
+	long int id = skId;
+	if (id == 0) { // a new chain: the members of the previous one are deleted with it
+		blob chainId(m_localStorage->sql);
+		chainId.write(0, (char *)(chain.chainId.data()), chain.chainId.size());
+		m_localStorage->sql<<"DELETE FROM lime_SenderKeyChains WHERE Uid = :Uid AND groupId = :groupId;", use(m_db_Uid), use(groupId);
+		m_localStorage->sql<<"INSERT INTO lime_SenderKeyChains(Uid,groupId,chainId,CK,idx) VALUES(:Uid,:groupId,:chainId,:CK,:idx);", use(m_db_Uid), use(groupId), use(chainId), use(CK), use(index);
+		m_localStorage->sql<<"select last_insert_rowid()",into(id);
+	} else {
+		m_localStorage->sql<<"UPDATE lime_SenderKeyChains SET CK = :CK, idx = :idx WHERE skId = :skId;", use(CK), use(index), use(id);
+	}
+	for (const auto &member : newMembers) {
+		m_localStorage->sql<<"INSERT OR IGNORE INTO lime_SenderKeyMembers(skId,DeviceId) VALUES(:skId,:DeviceId);", use(id), use(member);
+	}
+	if (tr) tr->commit();
+}
+
+/**
+ * @brief load the sender key chain received from a peer device for a group and the identity key of this device
+ *
+ * @param[in]	groupId		the recipient user Id of the group
+ * @param[in]	senderDeviceId	the device encrypting with this chain
+ * @param[out]	chain		the chain, untouched if not found
+ * @param[out]	senderIk	the sender device identity key
+ *
+ * @return true if a chain was found
+ */
+template <typename Curve>
+bool Lime<Curve>::load_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, SenderKeyChain &chain, DSA<Curve, lime::DSAtype::publicKey> &senderIk) {
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	blob chainId(m_localStorage->sql);
+	blob CK(m_localStorage->sql);
+	blob Ik(m_localStorage->sql);
+	int index = 0;
+	m_localStorage->sql<<"SELECT r.chainId, r.CK, r.idx, d.Ik FROM lime_ReceiverKeyChains as r INNER JOIN lime_PeerDevices as d ON r.Did = d.Did WHERE r.Uid = :Uid AND r.groupId = :groupId AND d.DeviceId = :senderDeviceId LIMIT 1;", into(chainId), into(CK), into(index), into(Ik), use(m_db_Uid), use(groupId), use(senderDeviceId);
+	// an invalid Ik(size 1) is not the size of a key
+	if (!m_localStorage->sql.got_data() || chainId.get_len() != chain.chainId.size() || CK.get_len() != chain.CK.size() || Ik.get_len() != senderIk.size()) {
+		return false;
+	}
+	chainId.read(0, (char *)(chain.chainId.data()), chain.chainId.size());
+	CK.read(0, (char *)(chain.CK.data()), chain.CK.size());
+	Ik.read(0, (char *)(senderIk.data()), senderIk.size());
+	chain.index = static_cast<uint16_t>(index);
+	return true;
+}
+
+/**
+ * @brief store the sender key chain received from a peer device for a group, it replaces any previous one
+ *
+ * The peer device must be in local storage: the chain is distributed over a Double Ratchet session with it
+ *
+ * @param[in]	groupId		the recipient user Id of the group
+ * @param[in]	senderDeviceId	the device encrypting with this chain
+ * @param[in]	chain		the chain
+ */
+template <typename Curve>
+void Lime<Curve>::store_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, const SenderKeyChain &chain) {
+	MetricsDBTimer DBTimer(m_localStorage->m_metrics.get());
+	MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+	blob chainId(m_localStorage->sql);
+	chainId.write(0, (char *)(chain.chainId.data()), chain.chainId.size());
+	blob CK(m_localStorage->sql);
+	CK.write(0, (char *)(chain.CK.data()), chain.CK.size());
+	const int index = chain.index;
+	m_localStorage->sql<<"INSERT OR REPLACE INTO lime_ReceiverKeyChains(Uid,Did,groupId,chainId,CK,idx) SELECT :Uid, Did, :groupId, :chainId, :CK, :idx FROM lime_PeerDevices WHERE DeviceId = :senderDeviceId LIMIT 1;", use(m_db_Uid), use(groupId), use(chainId), use(CK), use(index), use(senderDeviceId);
+}
+
 /* template instanciations for Curves 25519 and 448 */
 #ifdef EC25519_ENABLED
 	template bool Lime<C255>::create_user();
 	template bool Lime<C255>::activate_user();
 	template void Lime<C255>::get_SelfIdentityKey();
 	template void Lime<C255>::X3DH_generate_SPk(X<C255, lime::Xtype::publicKey> &publicSPk, DSA<C255, DSAtype::signature> &SPk_sig, uint32_t &SPk_id, const bool load);
+	template void Lime<C255>::X3DH_generate_keyPairs(std::vector<Xpair<C255>> &keyPairs);
 	template void Lime<C255>::X3DH_generate_OPks(std::vector<X<C255, lime::Xtype::publicKey>> &publicOPks, std::vector<uint32_t> &OPk_ids, const uint16_t OPk_number, const bool load);
+	template size_t Lime<C255>::fetch_peerDevicesStatus(const std::vector<std::string> &peerDeviceIds, std::unordered_map<std::string, lime::PeerDeviceStatus> &devicesStatus);
 	template void Lime<C255>::cache_DR_sessions(std::vector<RecipientInfos<C255>> &internal_recipients, std::vector<std::string> &missing_devices);
 	template void Lime<C255>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDBSessionId, std::vector<std::shared_ptr<DR<C255>>> &DRSessions);
+	template void Lime<C255>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDBSessionId, const X<C255, lime::Xtype::publicKey> &peerDH, std::vector<std::shared_ptr<DR<C255>>> &DRSessions);
+	template void Lime<C255>::get_sessionsSnapshot(std::vector<uint8_t> &snapshot);
+	template size_t Lime<C255>::set_sessionsSnapshot(const std::vector<uint8_t> &snapshot);
 	template void Lime<C255>::X3DH_get_SPk(uint32_t SPk_id, Xpair<C255> &SPk);
 	template bool Lime<C255>::is_currentSPk_valid(void);
 	template void Lime<C255>::X3DH_get_OPk(uint32_t OPk_id, Xpair<C255> &SPk);
 	template void Lime<C255>::X3DH_updateOPkStatus(const std::vector<uint32_t> &OPkIds);
+	template size_t Lime<C255>::X3DH_get_OPkCount(void);
 	template void Lime<C255>::set_x3dhServerUrl(const std::string &x3dhServerUrl);
+	template bool Lime<C255>::load_senderKeyChain(const std::string &groupId, SenderKeyChain &chain, long int &skId, std::unordered_set<std::string> &members);
+	template void Lime<C255>::store_senderKeyChain(const std::string &groupId, const SenderKeyChain &chain, const long int skId, const std::vector<std::string> &newMembers);
+	template bool Lime<C255>::load_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, SenderKeyChain &chain, DSA<C255, lime::DSAtype::publicKey> &senderIk);
+	template void Lime<C255>::store_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, const SenderKeyChain &chain);
 #endif
 
 #ifdef EC448_ENABLED
@@ -1369,14 +3269,24 @@ void Lime<Curve>::set_x3dhServerUrl(const std::string &x3dhServerUrl) {
 	template bool Lime<C448>::activate_user();
 	template void Lime<C448>::get_SelfIdentityKey();
 	template void Lime<C448>::X3DH_generate_SPk(X<C448, lime::Xtype::publicKey> &publicSPk, DSA<C448, DSAtype::signature> &SPk_sig, uint32_t &SPk_id, const bool load);
+	template void Lime<C448>::X3DH_generate_keyPairs(std::vector<Xpair<C448>> &keyPairs);
 	template void Lime<C448>::X3DH_generate_OPks(std::vector<X<C448, lime::Xtype::publicKey>> &publicOPks, std::vector<uint32_t> &OPk_ids, const uint16_t OPk_number, const bool load);
+	template size_t Lime<C448>::fetch_peerDevicesStatus(const std::vector<std::string> &peerDeviceIds, std::unordered_map<std::string, lime::PeerDeviceStatus> &devicesStatus);
 	template void Lime<C448>::cache_DR_sessions(std::vector<RecipientInfos<C448>> &internal_recipients, std::vector<std::string> &missing_devices);
 	template void Lime<C448>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDBSessionId, std::vector<std::shared_ptr<DR<C448>>> &DRSessions);
+	template void Lime<C448>::get_DRSessions(const std::string &senderDeviceId, const long int ignoreThisDBSessionId, const X<C448, lime::Xtype::publicKey> &peerDH, std::vector<std::shared_ptr<DR<C448>>> &DRSessions);
+	template void Lime<C448>::get_sessionsSnapshot(std::vector<uint8_t> &snapshot);
+	template size_t Lime<C448>::set_sessionsSnapshot(const std::vector<uint8_t> &snapshot);
 	template void Lime<C448>::X3DH_get_SPk(uint32_t SPk_id, Xpair<C448> &SPk);
 	template bool Lime<C448>::is_currentSPk_valid(void);
 	template void Lime<C448>::X3DH_get_OPk(uint32_t OPk_id, Xpair<C448> &SPk);
 	template void Lime<C448>::X3DH_updateOPkStatus(const std::vector<uint32_t> &OPkIds);
+	template size_t Lime<C448>::X3DH_get_OPkCount(void);
 	template void Lime<C448>::set_x3dhServerUrl(const std::string &x3dhServerUrl);
+	template bool Lime<C448>::load_senderKeyChain(const std::string &groupId, SenderKeyChain &chain, long int &skId, std::unordered_set<std::string> &members);
+	template void Lime<C448>::store_senderKeyChain(const std::string &groupId, const SenderKeyChain &chain, const long int skId, const std::vector<std::string> &newMembers);
+	template bool Lime<C448>::load_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, SenderKeyChain &chain, DSA<C448, lime::DSAtype::publicKey> &senderIk);
+	template void Lime<C448>::store_receiverKeyChain(const std::string &groupId, const std::string &senderDeviceId, const SenderKeyChain &chain);
 #endif
 
 
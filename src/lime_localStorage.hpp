@@ -22,10 +22,209 @@
 
 #include "soci/soci.h"
 #include "lime_crypto_primitives.hpp"
+#include "lime_settings.hpp"
+#include "lime_lruCache.hpp"
+#include "lime_keyPairPool.hpp"
 #include <mutex>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <functional>
 
 namespace lime {
 
+	template <typename Curve>
+	struct DRStatements; // prepared statements used by DR sessions to save themselves, defined in lime_localStorage.cpp
+
+	/**
+	 * @brief A peer device row of local storage
+	 */
+	struct PeerDeviceRecord {
+		long int Did; /**< lime_PeerDevices.Did */
+		std::vector<uint8_t> Ik; /**< lime_PeerDevices.Ik, lime::settings::DBInvalidIk when the device was inserted without it */
+		lime::PeerDeviceStatus status; /**< lime_PeerDevices.Status */
+		PeerDeviceRecord() : Did{0}, Ik{}, status{lime::PeerDeviceStatus::unknown} {};
+	};
+
+	/**
+	 * @brief Size bounded cache of the peer devices read from local storage
+	 *
+	 * Shared by all the local storage connections of a manager: peer devices are not linked to a local user.
+	 * Devices are inserted when read from local storage and erased on any write to their row, so no query is needed
+	 * to get the status of a known device at each decryption.
+	 * Connections not sharing their mutex may read a row while another one writes it: a row read before an erase is not inserted,
+	 * the reader gets the generation before querying the local storage and gives it back at insertion.
+	 *
+	 * @note this is thread safe, the connections using it do not have to share their mutex
+	 * @note writes to the local storage made by another process are not seen
+	 */
+	class PeerDevicesCache {
+		private:
+			std::mutex m_mutex;
+			LRUCache<std::string, PeerDeviceRecord> m_devices;
+			uint64_t m_generation; // incremented at each erase or clear
+
+		public:
+			/**
+			 * @param[in]	maxDevices	maximum number of devices held, 0 for no limit
+			 */
+			PeerDevicesCache(const size_t maxDevices=lime::settings::peerDevicesCache_maxDevices) : m_mutex{}, m_devices{}, m_generation{0} {
+				m_devices.set_limits(maxDevices, 0);
+			};
+			PeerDevicesCache(const PeerDevicesCache &) = delete;
+			PeerDevicesCache &operator=(const PeerDevicesCache &) = delete;
+
+			/**
+			 * @brief get a device from cache
+			 *
+			 * @param[in]	peerDeviceId	the device Id
+			 * @param[out]	record		the device row, untouched if not found
+			 *
+			 * @return true if the device was found
+			 */
+			bool get(const std::string &peerDeviceId, PeerDeviceRecord &record) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto elem = m_devices.find(peerDeviceId);
+				if (elem == m_devices.end()) return false;
+				record = elem->second;
+				return true;
+			};
+			uint64_t generation() {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return m_generation;
+			};
+			/**
+			 * @brief insert a device read from local storage
+			 *
+			 * @param[in]	peerDeviceId	the device Id
+			 * @param[in]	record		the device row
+			 * @param[in]	generation	the cache generation before the row was read, nothing is inserted if it changed since
+			 */
+			void put(const std::string &peerDeviceId, const PeerDeviceRecord &record, const uint64_t generation) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (generation == m_generation) m_devices.put(peerDeviceId, record);
+			};
+			void erase(const std::string &peerDeviceId) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_generation++;
+				m_devices.erase(peerDeviceId);
+			};
+			void clear() {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_generation++;
+				m_devices.clear();
+			};
+	};
+
+	/**
+	 * @brief Give the interactive operations(encryption, decryption) precedence over the background ones(update, cleanup, OPks storage) on a local storage
+	 *
+	 * Interactive operations register for their whole duration with an InteractiveLane. Background ones split their work in batches
+	 * and call yield between them, without holding the database mutex: it waits for the interactive operations in progress to complete,
+	 * bounded by lime::settings::background_maxYield_ms so the background work is not starved by a steady flow of messages.
+	 *
+	 * @note this is thread safe, one is shared by all the local storage connections of a manager shard
+	 */
+	class WorkLanes {
+		private:
+			std::mutex m_mutex; // protect the wait on m_cv
+			std::condition_variable m_cv; // signal the waiting background operations the last interactive one is done
+			std::atomic<size_t> m_interactive; // interactive operations in progress
+
+		public:
+			WorkLanes() : m_mutex{}, m_cv{}, m_interactive{0} {};
+			WorkLanes(const WorkLanes &) = delete;
+			WorkLanes &operator=(const WorkLanes &) = delete;
+
+			void enter_interactive() noexcept {
+				m_interactive.fetch_add(1, std::memory_order_acq_rel);
+			};
+			void leave_interactive() noexcept {
+				if (m_interactive.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					// take the mutex so a background operation cannot miss the signal between its check and its wait
+					{ std::lock_guard<std::mutex> lock(m_mutex); }
+					m_cv.notify_all();
+				}
+			};
+			/**
+			 * @return true if an interactive operation is in progress
+			 */
+			bool interactive_pending() const noexcept {
+				return m_interactive.load(std::memory_order_acquire) > 0;
+			};
+			/**
+			 * @brief Let the interactive operations in progress complete, called by background operations between two batches
+			 *
+			 * @param[in]	deadline	do not wait after this point, even if interactive operations are still in progress
+			 *
+			 * @return true if an interactive operation was in progress
+			 * @note the caller must not hold the database mutex
+			 */
+			bool yield(const std::chrono::steady_clock::time_point &deadline) {
+				if (!interactive_pending()) return false;
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cv.wait_until(lock, deadline, [this]{return !interactive_pending();});
+				return true;
+			};
+			bool yield() {
+				return yield(std::chrono::steady_clock::now() + std::chrono::milliseconds(lime::settings::background_maxYield_ms));
+			};
+	};
+
+	/**
+	 * @brief Register an interactive operation in a WorkLanes from construction to destruction
+	 */
+	class InteractiveLane {
+		private:
+			WorkLanes &m_lanes;
+
+		public:
+			explicit InteractiveLane(WorkLanes &lanes) noexcept : m_lanes(lanes) {m_lanes.enter_interactive();};
+			~InteractiveLane() {m_lanes.leave_interactive();};
+			InteractiveLane(const InteractiveLane &) = delete;
+			InteractiveLane &operator=(const InteractiveLane &) = delete;
+	};
+
+	/**
+	 * @brief A DR session update queued by the write-behind mode, see lime::StorageOptions::writeBehindDepth
+	 *
+	 * Only the updates of a stored session not storing nor consuming skipped message keys are queued: they overwrite its whole
+	 * mutable state, so a newer update of the same session replaces the queued one.
+	 */
+	struct DeferredSessionUpdate {
+		std::vector<uint8_t> state; /**< DR_sessions.state */
+		std::vector<uint8_t> DHr; /**< DR_sessions.DHr, empty when no message was decrypted by this session since its last commit */
+		int status; /**< DR_sessions.Status, set to active anyway when a message was decrypted */
+		int received; /**< number of messages decrypted since the last commit: added to the received counter of the session stored skipped message keys chains */
+		int version; /**< DR_sessions.version, the one of the session once updated */
+		DeferredSessionUpdate() : state{}, DHr{}, status{0}, received{0}, version{0} {};
+	};
+
+	class Db;
+
+	/**
+	 * @brief A transaction on local storage, rolled back at destruction unless committed
+	 *
+	 * Unlike soci::transaction, in multi-process mode(see lime::StorageOptions::multiProcess) the database write lock is taken when the
+	 * transaction starts(BEGIN IMMEDIATE): a transaction reading before writing would otherwise fail at once, whatever the busy timeout,
+	 * when another process writes meanwhile. Starting and committing are then tried again on busy errors, see lime::StorageOptions::busyRetries.
+	 */
+	class StorageTransaction {
+		private:
+			Db &m_db;
+			bool m_handled; // committed or rolled back
+
+		public:
+			explicit StorageTransaction(Db &db);
+			~StorageTransaction();
+			void commit();
+			void rollback();
+			StorageTransaction(const StorageTransaction &) = delete;
+			StorageTransaction &operator=(const StorageTransaction &) = delete;
+	};
+
 	/**
 	 * @brief Database access class
 	 *
@@ -37,6 +236,50 @@ namespace lime {
 		soci::session	sql;
 		/// mutex on database access
 		std::shared_ptr<std::recursive_mutex> m_db_mutex;
+		/// runtime metrics of the manager using this connection, nullptr when no one collects them
+		std::shared_ptr<lime::MetricsCollector> m_metrics;
+		/// tracing spans emitter of the manager using this connection, nullptr when standalone
+		std::shared_ptr<lime::Tracer> m_tracer;
+		/// peer devices read from local storage, shared by all the connections of a manager, never nullptr
+		std::shared_ptr<lime::PeerDevicesCache> m_peerDevices;
+		/// interactive and background operations scheduling, shared by all the connections of a manager shard, never nullptr
+		std::shared_ptr<lime::WorkLanes> m_lanes;
+		/// pre-generated key exchange key pairs drawn by the DR sessions and X3DH, shared by all the connections of a manager, never nullptr
+		std::shared_ptr<lime::KeyPairPools> m_keyPairPools;
+
+	private:
+		/* storage settings read back from the connection once the requested ones are applied */
+		lime::StorageOptions m_storageOptions;
+		void apply_storageOptions(const lime::StorageOptions &options);
+		void create_DRSessionsTable(const std::string &tableName);
+		void create_DRMSkMKTable(const std::string &tableName);
+		void create_senderKeyTables();
+		void create_snapshotsTable();
+		void update_schema(const int userVersion);
+		bool load_peerDevice(const std::string &peerDeviceId, PeerDeviceRecord &record);
+
+		/* queries performed at each message encryption/decryption are prepared once and kept, one set per curve as the keys sizes differ */
+#ifdef EC25519_ENABLED
+		std::unique_ptr<DRStatements<C255>> m_DRStatements_C255;
+#endif
+#ifdef EC448_ENABLED
+		std::unique_ptr<DRStatements<C448>> m_DRStatements_C448;
+#endif
+		/* transaction opened by start_transaction, sessions saves join it instead of committing on their own */
+		std::unique_ptr<StorageTransaction> m_transaction;
+		/* incremental cleanup: index of the next table to clean, so each call resumes where the previous one stopped */
+		size_t m_cleanupStage;
+		/* write-behind mode: the queued sessions updates by session id, protected by the database mutex */
+		std::unordered_map<long int, DeferredSessionUpdate> m_deferredUpdates;
+		/* write-behind mode: the thread committing the queued updates, started on first use */
+		std::thread m_writer;
+		std::mutex m_writer_mutex; // protect the writer flags
+		std::condition_variable m_writer_cv;
+		bool m_writer_stop;
+		bool m_writer_signaled; // updates were queued since the writer last committed
+		void writer(); // writer thread main loop
+
+	public:
 
 		Db()=delete; // we can't create a new DB holder without DB filename
 
@@ -45,14 +288,50 @@ namespace lime {
 		 *
 		 * @param[in]	filename	The path to DB file
 		 * @param[in]	db_mutex	database access mutex
+		 * @param[in]	options		journal mode, synchronisation, memory mapping and cache settings to apply on this connection
 		 */
-		Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mutex);
-		~Db(){sql.close();};
+		Db(const std::string &filename, std::shared_ptr<std::recursive_mutex> db_mutex, const lime::StorageOptions &options=lime::StorageOptions{});
+		~Db();
+
+		/**
+		 * @brief get the storage settings in effect on this connection
+		 *
+		 * @return the settings read back from the database after the requested ones were applied
+		 */
+		const lime::StorageOptions &get_storageOptions() const {return m_storageOptions;};
+
+		/**
+		 * @brief Open a transaction grouping several operations, DR sessions saves join it until it is committed or rolled back
+		 *
+		 * @note the caller must hold the database mutex from the start of the transaction until its end
+		 */
+		void start_transaction();
+		void commit_transaction();
+		void rollback_transaction();
+		/**
+		 * @return true when a transaction opened by start_transaction is pending
+		 */
+		bool in_transaction() const {return m_transaction != nullptr;};
+
+		/**
+		 * @return true when the sessions updates can be queued by the write-behind mode: it is enabled and no transaction is pending
+		 */
+		bool writeBehind() const {return m_storageOptions.writeBehindDepth > 0 && m_transaction == nullptr;};
+		/**
+		 * @return true when other processes may write to the database, see lime::StorageOptions::multiProcess
+		 */
+		bool multiProcess() const {return m_storageOptions.multiProcess;};
+		void run_exclusive(const std::function<void()> &operation);
+		void defer_sessionUpdate(const long int sessionId, DeferredSessionUpdate &&update);
+		void flush_sessionUpdates();
 
 		void load_LimeUser(const std::string &deviceId, long int &Uid, lime::CurveId &curveId, std::string &url, const bool allStatus=false);
 		void delete_LimeUser(const std::string &deviceId);
 		void clean_DRSessions();
 		void clean_SPk();
+		bool clean_incremental(const std::chrono::steady_clock::time_point &deadline, size_t &rowBudget);
+		void get_storageUsage(lime::StorageUsage &usage);
+		bool compact_incremental(const std::chrono::steady_clock::time_point &deadline, const bool allowVacuum);
 		void get_allLocalDevices(std::vector<std::string> &deviceIds);
 		void set_peerDeviceStatus(const std::string &peerDeviceId, const std::vector<uint8_t> &Ik, lime::PeerDeviceStatus status);
 		void set_peerDeviceStatus(const std::string &peerDeviceId, lime::PeerDeviceStatus status);
@@ -63,6 +342,8 @@ namespace lime {
 		long int check_peerDevice(const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, const bool updateInvalid=false);
 		template <typename Curve>
 		long int store_peerDevice(const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk);
+		template <typename Curve>
+		DRStatements<Curve> &get_DRStatements();
 	};
 
 	/* this templates are instanciated once in the lime_localStorage.cpp file, explicitly tell anyone including this header that there is no need to re-instanciate them */
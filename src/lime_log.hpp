@@ -27,4 +27,16 @@
 #define LIME_LOGW BCTBX_SLOGW
 #define LIME_LOGE BCTBX_SLOGE
 
+/**
+ * @brief true when protocol messages traces (human readable dump of their content) shall be produced
+ *
+ * Traces are produced only when the debug level is enabled on the lime log domain so the dump is not formatted for nothing.
+ * Building with LIME_DISABLE_PROTOCOL_TRACES defined compiles them out.
+ */
+#ifdef LIME_DISABLE_PROTOCOL_TRACES
+#define LIME_PROTOCOL_TRACE_ENABLED false
+#else
+#define LIME_PROTOCOL_TRACE_ENABLED (bctbx_log_level_enabled(BCTBX_LOG_DOMAIN, BCTBX_LOG_DEBUG))
+#endif
+
 #endif //lime_log_hpp
@@ -0,0 +1,185 @@
+/*
+	lime_lruCache.hpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2017  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef lime_lruCache_hpp
+#define lime_lruCache_hpp
+
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <iterator>
+#include <utility>
+
+namespace lime {
+
+	/**
+	 * @brief A map holding a bounded number of elements, the least recently used ones are evicted when a limit is reached
+	 *
+	 * Limits are given on the number of elements and on their memory use, 0 means no limit.
+	 * Elements memory use is given by a caller's function, it is computed when an element is inserted or accessed.
+	 * Elements can be protected from eviction by a caller's function: the limits may then be temporarily exceeded.
+	 *
+	 * @note this is not thread safe, the caller is in charge of locking
+	 *
+	 * @tparam	Key	the key type, must be hashable
+	 * @tparam	Value	the element type, shall be cheap to copy (ie: a shared pointer)
+	 */
+	template <typename Key, typename Value>
+	class LRUCache {
+		public:
+			using element = std::pair<const Key, Value>;
+			using iterator = typename std::list<element>::iterator;
+			/// give the memory use of an element
+			using memorySizeFunction = std::function<size_t(const Value &)>;
+			/// return false if the element shall not be evicted
+			using evictableFunction = std::function<bool(const Value &)>;
+
+		private:
+			struct indexEntry {
+				iterator position; // element in the usage list
+				size_t memorySize; // memory use of the element when it was last inserted or accessed
+			};
+			std::list<element> m_elements; // most recently used first
+			std::unordered_map<Key, indexEntry> m_index;
+			size_t m_maxElements;
+			size_t m_maxMemory;
+			size_t m_memory; // sum of the elements memory size
+			memorySizeFunction m_memorySize;
+			evictableFunction m_evictable;
+
+			// move an element in front of the usage list and refresh its memory size
+			void touch(indexEntry &entry) {
+				m_elements.splice(m_elements.begin(), m_elements, entry.position);
+				if (m_memorySize) {
+					auto memorySize = m_memorySize(entry.position->second);
+					m_memory = m_memory - entry.memorySize + memorySize;
+					entry.memorySize = memorySize;
+				}
+			}
+
+		public:
+			/**
+			 * @param[in]	memorySize	function giving an element memory use, if not set the memory use is not accounted
+			 * @param[in]	evictable	function telling if an element can be evicted, if not set, they all can
+			 */
+			LRUCache(const memorySizeFunction &memorySize=nullptr, const evictableFunction &evictable=nullptr)
+				: m_elements{}, m_index{}, m_maxElements{0}, m_maxMemory{0}, m_memory{0}, m_memorySize{memorySize}, m_evictable{evictable} {};
+
+			/**
+			 * @brief Set the cache limits, elements are evicted if the cache is over them
+			 *
+			 * @param[in]	maxElements	maximum number of elements held, 0 for no limit
+			 * @param[in]	maxMemory	maximum memory used by the elements, 0 for no limit
+			 */
+			void set_limits(const size_t maxElements, const size_t maxMemory) {
+				m_maxElements = maxElements;
+				m_maxMemory = maxMemory;
+				shrink();
+			}
+
+			/**
+			 * @brief Evict the least recently used elements until the cache is back in its limits, the most recent one is never evicted
+			 *
+			 * It is performed at each insertion, call it when protected elements may have become evictable
+			 */
+			void shrink() {
+				auto overLimit = [this]() {
+					return (m_maxElements > 0 && m_index.size() > m_maxElements) || (m_maxMemory > 0 && m_memory > m_maxMemory);
+				};
+				if (m_elements.empty()) return;
+				auto it = std::prev(m_elements.end());
+				while (overLimit() && it != m_elements.begin()) {
+					auto current = it--;
+					if (!m_evictable || m_evictable(current->second)) {
+						erase(current);
+					}
+				}
+			}
+
+			/**
+			 * @brief find an element and mark it as the most recently used
+			 * @return an iterator on the element, end() if not found
+			 */
+			iterator find(const Key &key) {
+				auto entry = m_index.find(key);
+				if (entry == m_index.end()) return m_elements.end();
+				touch(entry->second);
+				return entry->second.position;
+			}
+
+			iterator end() {return m_elements.end();};
+
+			/**
+			 * @brief insert or replace an element, it becomes the most recently used
+			 */
+			void put(const Key &key, Value value) {
+				auto entry = m_index.find(key);
+				if (entry != m_index.end()) {
+					entry->second.position->second = std::move(value);
+					touch(entry->second);
+				} else {
+					m_elements.emplace_front(key, std::move(value));
+					auto memorySize = m_memorySize?m_memorySize(m_elements.front().second):0;
+					m_index.emplace(key, indexEntry{m_elements.begin(), memorySize});
+					m_memory += memorySize;
+				}
+				shrink();
+			}
+
+			/**
+			 * @brief insert an element only if the key is not already present
+			 * @return true if the element was inserted
+			 */
+			bool emplace(const Key &key, Value value) {
+				if (m_index.count(key) > 0) return false;
+				put(key, std::move(value));
+				return true;
+			}
+
+			void erase(iterator position) {
+				auto entry = m_index.find(position->first);
+				m_memory -= entry->second.memorySize;
+				m_index.erase(entry);
+				m_elements.erase(position);
+			}
+
+			void erase(const Key &key) {
+				auto entry = m_index.find(key);
+				if (entry != m_index.end()) {
+					erase(entry->second.position);
+				}
+			}
+
+			void clear() {
+				m_index.clear();
+				m_elements.clear();
+				m_memory = 0;
+			}
+
+			/// iterate on elements from the most to the least recently used, without modifying their order
+			iterator begin() {return m_elements.begin();};
+
+			/// @return the number of elements in cache
+			size_t size() const {return m_index.size();};
+			/// @return the memory used by the elements, as computed when they were last inserted or accessed
+			size_t memorySize() const {return m_memory;};
+	};
+}
+
+#endif /* lime_lruCache_hpp */
@@ -22,28 +22,255 @@
 #include "lime/lime.hpp"
 #include "lime_lime.hpp"
 #include "lime_localStorage.hpp"
+#include "lime_double_ratchet.hpp"
+#include "lime_double_ratchet_protocol.hpp"
 #include "lime_settings.hpp"
+#include "lime_threadpool.hpp"
+#include "lime_lruCache.hpp"
+#include "lime_metrics.hpp"
+#include "lime_trace.hpp"
+#include "lime_keyPairPool.hpp"
+#include "lime_x3dh_protocol.hpp"
 #include <mutex>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <limits>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
 #include "bctoolbox/exception.hh"
 
 using namespace::std;
 
 namespace lime {
+	/* users are unloaded only when no one else holds them and they have no pending operation */
+	static std::unique_ptr<LRUCache<std::string, std::shared_ptr<LimeGeneric>>> make_usersCache() {
+		std::unique_ptr<LRUCache<std::string, std::shared_ptr<LimeGeneric>>> usersCache(new LRUCache<std::string, std::shared_ptr<LimeGeneric>>(nullptr,
+			[](const std::shared_ptr<LimeGeneric> &user) {
+				return user.use_count() == 1 && user->is_idle();
+			}));
+		usersCache->set_limits(lime::settings::usersCache_maxUsers, 0);
+		return usersCache;
+	}
+
+	/* users post to the X3DH server through the batcher: it forwards the requests right away unless a batch is held */
+	static limeX3DHServerPostData make_X3DHPost(std::shared_ptr<lime::X3DHBatcher> batcher) {
+		return [batcher](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess) {
+			batcher->post(url, from, message, responseProcess);
+		};
+	}
+
+	namespace {
+		/* One LimeManager::update run: at most a given number of users are updated at once, the next one starts when one completes */
+		class UpdatePipeline : public std::enable_shared_from_this<UpdatePipeline> {
+			private:
+				std::mutex m_mutex; // protect the queue, the counters and the return code
+				std::deque<std::string> m_pending; // users not started yet
+				size_t m_users; // users not completed yet
+				size_t m_slots; // users which can be started, picked by the thread in start_next
+				bool m_starting; // a thread is starting users
+				lime::CallbackReturn m_returnCode; // fail if one user update failed
+				const limeCallback m_callback; // called once all users are completed
+				const std::function<void(std::shared_ptr<LimeGeneric> &, const std::string &)> m_loadUser;
+				const limeExecutor m_executor; // run the users update, starting them in the calling thread when nullptr
+				const uint16_t m_OPkServerLowLimit;
+				const uint16_t m_OPkBatchSize;
+				const bool m_deferFreshUsers;
+
+				// update one user, complete it when its SPk and OPk updates are both done
+				void run(const std::string &deviceId) {
+					std::shared_ptr<LimeGeneric> user;
+					try {
+						m_loadUser(user, deviceId);
+						if (m_deferFreshUsers && user->defer_update(m_OPkServerLowLimit)) {
+							LIME_LOGI<<"Lime update user "<<deviceId<<" deferred";
+							complete(lime::CallbackReturn::success);
+							return;
+						}
+						LIME_LOGI<<"Lime update user "<<deviceId;
+						// expect two callbacks: one for update SPk, one for get OPk number on server
+						auto self = shared_from_this();
+						auto remaining = std::make_shared<std::atomic<unsigned int>>(2);
+						auto failed = std::make_shared<std::atomic<bool>>(false);
+						limeCallback userCallback([self, remaining, failed](lime::CallbackReturn returnCode, std::string errorMessage) {
+							if (returnCode == lime::CallbackReturn::fail) {
+								failed->store(true);
+							}
+							if (remaining->fetch_sub(1) == 1) {
+								self->complete(failed->load()?lime::CallbackReturn::fail:lime::CallbackReturn::success);
+							}
+						});
+
+						// send a request to X3DH server to check how many OPk are left on server, upload more if needed
+						user->update_OPk(userCallback, m_OPkServerLowLimit, m_OPkBatchSize);
+
+						// update the SPk(if needed)
+						user->update_SPk(userCallback);
+					} catch (BctbxException const &e) {
+						LIME_LOGE<<"Lime update user "<<deviceId<<" failed: "<<e.str();
+						complete(lime::CallbackReturn::fail);
+					}
+				}
+
+				void complete(const lime::CallbackReturn returnCode) {
+					bool done = false;
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						if (returnCode == lime::CallbackReturn::fail) {
+							m_returnCode = lime::CallbackReturn::fail; // if one fail, return fail at the end of it
+						}
+						m_users--;
+						done = (m_users == 0);
+					}
+					if (done) {
+						if (m_callback) m_callback(m_returnCode, "");
+					} else {
+						start_next(1);
+					}
+				}
+
+			public:
+				UpdatePipeline(std::vector<std::string> &&deviceIds, const limeCallback &callback, const std::function<void(std::shared_ptr<LimeGeneric> &, const std::string &)> &loadUser,
+						const limeExecutor &executor, const uint16_t OPkServerLowLimit, const uint16_t OPkBatchSize, const bool deferFreshUsers)
+					: m_mutex{}, m_pending(std::make_move_iterator(deviceIds.begin()), std::make_move_iterator(deviceIds.end())), m_users{deviceIds.size()}, m_slots{0}, m_starting{false},
+					m_returnCode{lime::CallbackReturn::success}, m_callback{callback}, m_loadUser{loadUser}, m_executor{executor},
+					m_OPkServerLowLimit{OPkServerLowLimit}, m_OPkBatchSize{OPkBatchSize}, m_deferFreshUsers{deferFreshUsers} {};
+
+				/**
+				 * @brief start users, as many as given if enough are pending
+				 *
+				 * Users completing while a thread is starting others give it their slot instead of starting the next one themselves:
+				 * a transport calling back before the post returns or a run of deferred users does not nest the users update in each other.
+				 */
+				void start_next(const size_t count) {
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_slots += count;
+					if (m_starting) return;
+					m_starting = true;
+					while (m_slots > 0 && !m_pending.empty()) {
+						auto deviceId = std::move(m_pending.front());
+						m_pending.pop_front();
+						m_slots--;
+						lock.unlock();
+						if (m_executor) {
+							auto self = shared_from_this();
+							m_executor([self, deviceId]() {
+								self->run(deviceId);
+							});
+						} else {
+							run(deviceId);
+						}
+						lock.lock();
+					}
+					if (m_pending.empty()) m_slots = 0;
+					m_starting = false;
+				}
+		};
+	} // anonymous namespace
+
+	LimeManager::LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data, std::shared_ptr<std::recursive_mutex> db_mutex, const lime::StorageOptions &storageOptions)
+		: m_users_cache{make_usersCache()}, m_db_access{db_access}, m_db_mutex{db_mutex}, m_storageOptions{storageOptions}, m_shards_mutex{}, m_localStorage{}, m_cleanup_mutex{}, m_cleanupShard{0}, m_X3DHBatcher{std::make_shared<lime::X3DHBatcher>(X3DH_post_data)}, m_X3DH_post_data{make_X3DHPost(m_X3DHBatcher)}, m_threadPool{nullptr}, m_OPkPredictiveUpdate{false},
+		m_updateConcurrency{0}, m_updateExecutor{nullptr}, m_updateDeferFreshUsers{false},
+		m_DRSessionsCache_maxSessions{lime::settings::DRSessionsCache_maxSessions}, m_DRSessionsCache_maxMemory{lime::settings::DRSessionsCache_maxMemory},
+		m_metrics{std::make_shared<lime::MetricsCollector>()}, m_tracer{std::make_shared<lime::Tracer>()}, m_peerDevices{}, m_workLanes{}, m_keyPairPools{std::make_shared<lime::KeyPairPools>()}, m_decryption_mutex{}, m_decryptionDispatcher{nullptr} {
+		init_shards();
+	}
+
 	LimeManager::LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data, std::shared_ptr<std::recursive_mutex> db_mutex)
-		: m_users_cache{}, m_db_access{db_access}, m_db_mutex{db_mutex}, m_X3DH_post_data{X3DH_post_data} { }
+		: LimeManager(db_access, X3DH_post_data, db_mutex, lime::StorageOptions{}) {}
 
 	// When no mutex is provided for database access, create one
 	LimeManager::LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data)
-		: m_users_cache{}, m_db_access{db_access}, m_db_mutex{std::make_shared<std::recursive_mutex>()}, m_X3DH_post_data{X3DH_post_data} { }
+		: LimeManager(db_access, X3DH_post_data, std::make_shared<std::recursive_mutex>(), lime::StorageOptions{}) {}
+
+	LimeManager::LimeManager(const std::string &db_access, const limeX3DHServerPostData &X3DH_post_data, const lime::StorageOptions &storageOptions)
+		: LimeManager(db_access, X3DH_post_data, std::make_shared<std::recursive_mutex>(), storageOptions) {}
+
+	LimeManager::~LimeManager() = default;
+
+	/* the built-in executor: a thread pool held by the dispatcher through the executor closure */
+	static limeExecutor make_decryptionExecutor() {
+		auto threadPool = std::make_shared<lime::ThreadPool>(lime::settings::asyncDecryption_threads);
+		return [threadPool](const std::function<void()> &job) {
+			threadPool->post(job);
+		};
+	}
+
+	// The shards do not share anything: each one gets its own mutex and peer devices cache, the first one uses the mutex given to the manager
+	void LimeManager::init_shards() {
+		const size_t shardsCount = std::max<size_t>(1, m_storageOptions.shards);
+		m_shards_mutex.clear();
+		m_shards_mutex.push_back(m_db_mutex);
+		while (m_shards_mutex.size() < shardsCount) {
+			m_shards_mutex.push_back(std::make_shared<std::recursive_mutex>());
+		}
+		m_localStorage.assign(shardsCount, nullptr);
+		m_peerDevices.clear();
+		m_workLanes.clear();
+		for (size_t i=0; i<shardsCount; i++) {
+			m_peerDevices.push_back(std::make_shared<lime::PeerDevicesCache>());
+			m_workLanes.push_back(std::make_shared<lime::WorkLanes>());
+		}
+	}
+
+	// FNV-1a hash of the device Id: users shall stay in the same shard from one run to another, std::hash does not guarantee it
+	size_t LimeManager::get_shard(const std::string &localDeviceId) const {
+		if (m_localStorage.size() == 1) return 0;
+		uint32_t hash = 2166136261U;
+		for (const auto c : localDeviceId) {
+			hash ^= static_cast<uint8_t>(c);
+			hash *= 16777619U;
+		}
+		return hash%m_localStorage.size();
+	}
+
+	static std::string shard_dbAccess(const std::string &db_access, const size_t shardsCount, const size_t shard) {
+		return (shardsCount == 1)?db_access:std::string(db_access).append(".").append(std::to_string(shard));
+	}
+
+	// The connection is opened on first use and then kept open for the whole manager life: it is shared by
+	// the manager level operations and all the users loaded in cache, so they all benefit from the same connection
+	std::shared_ptr<lime::Db> LimeManager::get_localStorage(const size_t shard) {
+		std::lock_guard<std::recursive_mutex> lock(*m_shards_mutex[shard]);
+		if (m_localStorage[shard] == nullptr) {
+			auto localStorage = std::make_shared<lime::Db>(shard_dbAccess(m_db_access, m_localStorage.size(), shard), m_shards_mutex[shard], m_storageOptions);
+			localStorage->m_metrics = m_metrics;
+			localStorage->m_tracer = m_tracer;
+			localStorage->m_peerDevices = m_peerDevices[shard];
+			localStorage->m_lanes = m_workLanes[shard];
+			localStorage->m_keyPairPools = m_keyPairPools;
+			m_localStorage[shard] = localStorage;
+		}
+		return m_localStorage[shard];
+	}
+
+	// With one connection per user, each user gets its own connection and mutex: users operations do not wait for each other,
+	// sqlite locking keeps the shared tables(ie: peer devices) consistent between connections
+	std::shared_ptr<lime::Db> LimeManager::get_userStorage(const size_t shard) {
+		if (m_storageOptions.connectionPerUser) {
+			auto userStorage = std::make_shared<lime::Db>(shard_dbAccess(m_db_access, m_localStorage.size(), shard), std::make_shared<std::recursive_mutex>(), m_storageOptions);
+			userStorage->m_metrics = m_metrics;
+			userStorage->m_tracer = m_tracer;
+			userStorage->m_peerDevices = m_peerDevices[shard];
+			userStorage->m_lanes = m_workLanes[shard];
+			userStorage->m_keyPairPools = m_keyPairPools;
+			return userStorage;
+		}
+		return get_localStorage(shard);
+	}
 
 	void LimeManager::load_user(std::shared_ptr<LimeGeneric> &user, const std::string &localDeviceId, const bool allStatus) {
 		// get the Lime manager lock
-		std::lock_guard<std::mutex> lock(m_users_mutex);
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
 		// Load user object
-		auto userElem = m_users_cache.find(localDeviceId);
-		if (userElem == m_users_cache.end()) { // not in cache, load it from DB
-			user = load_LimeUser(m_db_access, localDeviceId, m_X3DH_post_data, m_db_mutex, allStatus);
-			m_users_cache[localDeviceId]=user;
+		auto userElem = m_users_cache->find(localDeviceId);
+		if (userElem == m_users_cache->end()) { // not in cache, load it from DB
+			user = load_LimeUser(get_userStorage(get_shard(localDeviceId)), localDeviceId, m_X3DH_post_data, allStatus);
+			user->set_threadPool(m_threadPool);
+			user->set_OPkPredictiveUpdate(m_OPkPredictiveUpdate);
+			user->set_DRSessionsCacheLimits(m_DRSessionsCache_maxSessions, m_DRSessionsCache_maxMemory);
+			m_users_cache->put(localDeviceId, user);
 		} else {
 			user = userElem->second;
 		}
@@ -65,19 +292,21 @@ namespace lime {
 
 			// then check if it went well, if not delete the user from localDB
 			if (returnCode != lime::CallbackReturn::success) {
-				auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(thiz->m_db_access, thiz->m_db_mutex));
-
-				localStorage->delete_LimeUser(localDeviceId);
+				thiz->get_localStorage(thiz->get_shard(localDeviceId))->delete_LimeUser(localDeviceId);
 
 				// Failure can occur only on X3DH server response(local failure generate an exception so we would never
 				// arrive in this callback)), so the lock acquired by create_user has already expired when we arrive here
-				std::lock_guard<std::mutex> lock(thiz->m_users_mutex);
-				thiz->m_users_cache.erase(localDeviceId);
+				MetricsLockGuard<std::mutex> lock(thiz->m_users_mutex, thiz->m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+				thiz->m_users_cache->erase(localDeviceId);
 			}
 		});
 
-		std::lock_guard<std::mutex> lock(m_users_mutex);
-		m_users_cache.insert({localDeviceId, insert_LimeUser(m_db_access, localDeviceId, x3dhServerUrl, curve, OPkInitialBatchSize, m_X3DH_post_data, managerCreateCallback, m_db_mutex)});
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+		auto user = insert_LimeUser(get_userStorage(get_shard(localDeviceId)), localDeviceId, x3dhServerUrl, curve, OPkInitialBatchSize, m_X3DH_post_data, managerCreateCallback);
+		user->set_threadPool(m_threadPool);
+		user->set_OPkPredictiveUpdate(m_OPkPredictiveUpdate);
+		user->set_DRSessionsCacheLimits(m_DRSessionsCache_maxSessions, m_DRSessionsCache_maxMemory);
+		m_users_cache->put(localDeviceId, user);
 	}
 
 	void LimeManager::delete_user(const std::string &localDeviceId, const limeCallback &callback) {
@@ -88,7 +317,7 @@ namespace lime {
 
 			// then remove the user from cache(it will trigger destruction of the lime generic object so do it last
 			// as it will also destroy the instance of this callback)
-			thiz->m_users_cache.erase(localDeviceId);
+			thiz->m_users_cache->erase(localDeviceId);
 		});
 
 		// Load user object
@@ -121,6 +350,55 @@ namespace lime {
 		user->encrypt(recipientUserId, recipients, plainMessage, encryptionPolicy, cipherMessage, callback);
 	}
 
+	void LimeManager::encrypt(const std::string &localDeviceId, std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, std::shared_ptr<const std::vector<uint8_t>> plainMessage, std::shared_ptr<std::vector<uint8_t>> cipherMessage,
+			std::shared_ptr<DRMessagesArena> DRmessages, const limeCallback &callback, const lime::EncryptionPolicy encryptionPolicy) {
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
+
+		// call the encryption function
+		user->encrypt(recipientUserId, recipients, plainMessage, encryptionPolicy, cipherMessage, DRmessages, callback);
+	}
+
+	bool LimeManager::try_encrypt(const std::string &localDeviceId, const std::string &recipientUserId, std::vector<RecipientData> &recipients, const std::vector<uint8_t> &plainMessage, std::vector<uint8_t> &cipherMessage, const lime::EncryptionPolicy encryptionPolicy) {
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
+
+		return user->try_encrypt(recipientUserId, recipients, plainMessage, encryptionPolicy, cipherMessage);
+	}
+
+	template <typename Curve>
+	static void curveEncryptOutBuffersMaximumSize(const size_t plainMessageSize, size_t &DRmessageSize, size_t &cipherMessageSize) {
+		/* cipherMessage maximum size is the sender key one: sender key header + plain message size + auth tag size + signature */
+		cipherMessageSize = lime::settings::senderKeyChainIdSize + 2 + plainMessageSize + lime::settings::DRMessageAuthTagSize + DSA<Curve, lime::DSAtype::signature>::ssize();
+
+		/* DRmessage maximum size is :
+		 * DRmessage header size + X3DH init size + MAX(plain message size, random seed size, sender key distribution size) + auth tag size */
+		const size_t payloadSize = std::max({plainMessageSize, lime::settings::DRrandomSeedSize, lime::settings::senderKeyChainIdSize + 2 + lime::settings::DRChainKeySize});
+		DRmessageSize = double_ratchet_protocol::headerSize<Curve>() + double_ratchet_protocol::X3DHinitSize<Curve>(true) + payloadSize + lime::settings::DRMessageAuthTagSize;
+	}
+
+	void LimeManager::encryptOutBuffersMaximumSize(const size_t plainMessageSize, const lime::CurveId curve, size_t &DRmessageSize, size_t &cipherMessageSize) {
+		switch (curve) {
+			case lime::CurveId::c25519:
+#ifdef EC25519_ENABLED
+				curveEncryptOutBuffersMaximumSize<C255>(plainMessageSize, DRmessageSize, cipherMessageSize);
+				return;
+#endif
+				break;
+			case lime::CurveId::c448:
+#ifdef EC448_ENABLED
+				curveEncryptOutBuffersMaximumSize<C448>(plainMessageSize, DRmessageSize, cipherMessageSize);
+				return;
+#endif
+				break;
+			default:
+				break;
+		}
+		throw BCTBX_EXCEPTION << "Unsupported curve "<<static_cast<unsigned int>(curve)<<" to compute the encrypt output sizes";
+	}
+
 	lime::PeerDeviceStatus LimeManager::decrypt(const std::string &localDeviceId, const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage, std::vector<uint8_t> &plainMessage) {
 		// Load user object
 		std::shared_ptr<LimeGeneric> user;
@@ -143,54 +421,208 @@ namespace lime {
 		return user->decrypt(recipientUserId, senderDeviceId, DRmessage, emptyCipherMessage, plainMessage);
 	}
 
+	void LimeManager::encrypt(const std::string &localDeviceId, std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, const limeStreamReader &plainStream, const limeStreamWriter &cipherStream, const limeCallback &callback) {
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
+
+		// call the encryption function
+		user->encrypt(recipientUserId, recipients, plainStream, cipherStream, callback);
+	}
+
+	lime::PeerDeviceStatus LimeManager::decrypt(const std::string &localDeviceId, const std::string &recipientUserId, const std::string &senderDeviceId, const std::vector<uint8_t> &DRmessage, const size_t cipherMessageSize, const limeStreamReader &cipherStream, const limeStreamWriter &plainStream) {
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
 
-	/* This version use default settings */
-	void LimeManager::update(const limeCallback &callback) {
-		update(callback, lime::settings::OPk_serverLowLimit, lime::settings::OPk_batchSize);
+		// call the decryption function
+		return user->decrypt(recipientUserId, senderDeviceId, DRmessage, cipherMessageSize, cipherStream, plainStream);
 	}
-	void LimeManager::update(const limeCallback &callback, uint16_t OPkServerLowLimit, uint16_t OPkBatchSize) {
-		// open local DB
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(m_db_access, m_db_mutex));
 
-		/* DR sessions and old stale SPk cleaning */
-		localStorage->clean_DRSessions();
-		localStorage->clean_SPk();
+	void LimeManager::decrypt_batch(const std::string &localDeviceId, std::vector<DecryptionData> &messages) {
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
 
-		// get all users from localStorage
-		std::vector<std::string> deviceIds{};
-		localStorage->get_allLocalDevices(deviceIds);
-
-		//This counter will trace number of callbacks, to trace how many operation did end.
-		// we expect two callback per local user account: one for update SPk, one for get OPk number on server
-		auto callbackCount = make_shared<size_t>(deviceIds.size()*2);
-		auto globalReturnCode = make_shared<lime::CallbackReturn>(lime::CallbackReturn::success);
-
-		// this callback will get all callbacks from update OPk and SPk on all users, when everyone is done, call the callback given to LimeManager::update
-		limeCallback managerUpdateCallback([callbackCount, globalReturnCode, callback](lime::CallbackReturn returnCode, std::string errorMessage) {
-			(*callbackCount)--;
-			if (returnCode == lime::CallbackReturn::fail) {
-				*globalReturnCode = lime::CallbackReturn::fail; // if one fail, return fail at the end of it
+		// call the decryption function
+		user->decrypt_batch(messages);
+	}
+
+	void LimeManager::decrypt_async(const std::string &localDeviceId, std::shared_ptr<const std::string> recipientUserId, std::shared_ptr<const std::string> senderDeviceId,
+			std::shared_ptr<const std::vector<uint8_t>> DRmessage, std::shared_ptr<const std::vector<uint8_t>> cipherMessage, std::shared_ptr<std::vector<uint8_t>> plainMessage,
+			const limeDecryptCallback &callback) {
+		{
+			std::lock_guard<std::mutex> lock(m_decryption_mutex);
+			if (m_decryptionDispatcher == nullptr) {
+				m_decryptionDispatcher = std::unique_ptr<lime::SerialDispatcher>(new lime::SerialDispatcher(make_decryptionExecutor()));
 			}
+		}
 
-			if (*callbackCount == 0) {
-				if (callback) callback(*globalReturnCode, "");
+		// messages from a sender to a local device are decrypted in order
+		std::string key{localDeviceId};
+		key.push_back('\0');
+		key.append(*senderDeviceId);
+		m_decryptionDispatcher->dispatch(key, [this, localDeviceId, recipientUserId, senderDeviceId, DRmessage, cipherMessage, plainMessage, callback]() {
+			auto peerStatus = lime::PeerDeviceStatus::fail;
+			std::string errorMessage{};
+			try {
+				const std::vector<uint8_t> emptyCipherMessage(0);
+				peerStatus = decrypt(localDeviceId, *recipientUserId, *senderDeviceId, *DRmessage, (cipherMessage!=nullptr)?*cipherMessage:emptyCipherMessage, *plainMessage);
+			} catch (BctbxException const &e) {
+				errorMessage = e.str();
+			} catch (std::exception const &e) {
+				errorMessage = e.what();
 			}
+			if (callback) callback(peerStatus, errorMessage);
 		});
+	}
+
+	void LimeManager::set_decryptionExecutor(const limeExecutor &executor) {
+		std::lock_guard<std::mutex> lock(m_decryption_mutex);
+		if (m_decryptionDispatcher == nullptr) {
+			m_decryptionDispatcher = std::unique_ptr<lime::SerialDispatcher>(new lime::SerialDispatcher((executor!=nullptr)?executor:make_decryptionExecutor()));
+		} else {
+			m_decryptionDispatcher->set_executor((executor!=nullptr)?executor:make_decryptionExecutor());
+		}
+	}
 
+	void LimeManager::prefetch_sessions(const std::string &localDeviceId, const std::vector<std::string> &peerDeviceIds, const limeCallback &callback, const bool fetchPeerBundles) {
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
 
-		// for each user
-		for (auto deviceId : deviceIds) {
-			LIME_LOGI<<"Lime update user "<<deviceId;
-			//load user
-			std::shared_ptr<LimeGeneric> user;
-			LimeManager::load_user(user, deviceId);
+		user->prefetch_sessions(peerDeviceIds, fetchPeerBundles, callback);
+	}
+
+	void LimeManager::prefetch_peerBundles(const std::string &localDeviceId, const std::vector<std::string> &peerDeviceIds, const limeCallback &callback) {
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
+
+		user->prefetch_peerBundles(peerDeviceIds, callback);
+	}
 
-			// send a request to X3DH server to check how many OPk are left on server, upload more if needed
-			user->update_OPk(managerUpdateCallback, OPkServerLowLimit, OPkBatchSize);
+	void LimeManager::encrypt(const std::string &localDeviceId, const std::string &recipientUserId, std::shared_ptr<std::vector<RecipientData>> recipients, const uint8_t *const plainMessage, const size_t plainMessageSize,
+			uint8_t *const cipherMessage, const size_t cipherMessageMaxSize, size_t &cipherMessageSize, const limeCallback &callback, lime::EncryptionPolicy encryptionPolicy) {
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
 
-			// update the SPk(if needed)
-			user->update_SPk(managerUpdateCallback);
+		// resolve the encryption policy now: if we go for the cipher message it is produced right away from the caller's buffers
+		auto recipientsCount = std::count_if(recipients->cbegin(), recipients->cend(), [](const RecipientData &recipient){return recipient.peerStatus != lime::PeerDeviceStatus::fail;});
+		if (selectPayloadDirectEncryption(encryptionPolicy, plainMessageSize, recipientsCount)) {
+			// the payload is encrypted in each DR message, we must keep a copy of it until they are all built
+			cipherMessageSize = 0;
+			user->encrypt(std::make_shared<const std::string>(recipientUserId), recipients, std::make_shared<const std::vector<uint8_t>>(plainMessage, plainMessage+plainMessageSize), lime::EncryptionPolicy::DRMessage, std::make_shared<std::vector<uint8_t>>(), callback);
+			return;
 		}
+
+		if (cipherMessageMaxSize < plainMessageSize + lime::settings::DRMessageAuthTagSize) {
+			throw BCTBX_EXCEPTION << "Cipher message buffer is too small: "<<cipherMessageMaxSize<<" bytes when "<<(plainMessageSize + lime::settings::DRMessageAuthTagSize)<<" are needed";
+		}
+		size_t written = 0;
+		user->encrypt(std::make_shared<const std::string>(recipientUserId), recipients,
+			[plainMessage, plainMessageSize](const size_t offset, uint8_t *buffer, const size_t size) {
+				auto readSize = (offset < plainMessageSize)?std::min(size, plainMessageSize-offset):0;
+				std::copy_n(plainMessage+offset, readSize, buffer);
+				return readSize;
+			},
+			[cipherMessage, &written](const uint8_t *buffer, const size_t size) {
+				std::copy_n(buffer, size, cipherMessage+written);
+				written += size;
+			},
+			callback);
+		cipherMessageSize = written;
+	}
+
+	lime::PeerDeviceStatus LimeManager::decrypt(const std::string &localDeviceId, const std::string &recipientUserId, const std::string &senderDeviceId, const uint8_t *const DRmessage, const size_t DRmessageSize,
+			const uint8_t *const cipherMessage, const size_t cipherMessageSize, uint8_t *const plainMessage, const size_t plainMessageMaxSize, size_t &plainMessageSize) {
+		// check the output buffer first: a failure after the DR message is decrypted would lose the message key
+		if (plainMessageMaxSize < ((cipherMessageSize>0)?(cipherMessageSize - std::min(cipherMessageSize, lime::settings::DRMessageAuthTagSize)):DRmessageSize)) {
+			throw BCTBX_EXCEPTION << "Plain message buffer is too small";
+		}
+
+		// Load user object
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
+
+		// the DR message is small when the payload is in the cipher message, just copy it
+		const std::vector<uint8_t> DRmessageBuffer(DRmessage, DRmessage+DRmessageSize);
+		plainMessageSize = 0;
+
+		if (cipherMessageSize == 0) { // payload is in the DR message, it is decrypted in an internal buffer
+			std::vector<uint8_t> plainBuffer{};
+			const std::vector<uint8_t> emptyCipherMessage(0);
+			auto status = user->decrypt(recipientUserId, senderDeviceId, DRmessageBuffer, emptyCipherMessage, plainBuffer);
+			if (status != lime::PeerDeviceStatus::fail) {
+				std::copy(plainBuffer.cbegin(), plainBuffer.cend(), plainMessage);
+				plainMessageSize = plainBuffer.size();
+			}
+			cleanBuffer(plainBuffer.data(), plainBuffer.size());
+			return status;
+		}
+
+		// payload is in the cipher message: decrypt it directly from and to the caller's buffers
+		return user->decrypt(recipientUserId, senderDeviceId, DRmessageBuffer, cipherMessageSize,
+			[cipherMessage, cipherMessageSize](const size_t offset, uint8_t *buffer, const size_t size) {
+				auto readSize = (offset < cipherMessageSize)?std::min(size, cipherMessageSize-offset):0;
+				std::copy_n(cipherMessage+offset, readSize, buffer);
+				return readSize;
+			},
+			[plainMessage, &plainMessageSize](const uint8_t *buffer, const size_t size) {
+				std::copy_n(buffer, size, plainMessage+plainMessageSize);
+				plainMessageSize += size;
+			});
+	}
+
+
+	/* This version use default settings */
+	void LimeManager::update(const limeCallback &callback) {
+		update(callback, lime::settings::OPk_serverLowLimit, lime::settings::OPk_batchSize);
+	}
+	void LimeManager::update(const limeCallback &callback, uint16_t OPkServerLowLimit, uint16_t OPkBatchSize) {
+		std::vector<std::string> deviceIds{};
+		for (size_t shard=0; shard<m_localStorage.size(); shard++) {
+			// get the shared local DB connection
+			auto localStorage = get_localStorage(shard);
+
+			/* DR sessions and old stale SPk cleaning, unless it is done by cleanup(). It holds the database mutex: let the encryptions and decryptions in progress go first */
+			if (!m_storageOptions.deferredCleanup) {
+				localStorage->m_lanes->yield();
+				localStorage->clean_DRSessions();
+				localStorage->m_lanes->yield();
+				localStorage->clean_SPk();
+			}
+
+			// get all users from localStorage
+			std::vector<std::string> shardDeviceIds{};
+			localStorage->get_allLocalDevices(shardDeviceIds);
+			deviceIds.insert(deviceIds.end(), shardDeviceIds.cbegin(), shardDeviceIds.cend());
+		}
+
+		if (deviceIds.empty()) {
+			if (callback) callback(lime::CallbackReturn::success, "");
+			return;
+		}
+
+		size_t concurrency = 0;
+		limeExecutor executor{nullptr};
+		bool deferFreshUsers = false;
+		{
+			MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+			concurrency = (m_updateConcurrency == 0)?deviceIds.size():m_updateConcurrency;
+			executor = m_updateExecutor;
+			deferFreshUsers = m_updateDeferFreshUsers;
+		}
+
+		// users are loaded when their update starts, the pipeline calls the callback given to LimeManager::update once they are all done
+		auto pipeline = std::make_shared<UpdatePipeline>(std::move(deviceIds), callback, [this](std::shared_ptr<LimeGeneric> &user, const std::string &deviceId) {
+				LimeManager::load_user(user, deviceId);
+			}, executor, OPkServerLowLimit, OPkBatchSize, deferFreshUsers);
+		// the requests of the users started now are sent in batches when enabled
+		m_X3DHBatcher->hold();
+		pipeline->start_next(concurrency);
+		m_X3DHBatcher->release();
 	}
 
 	void LimeManager::get_selfIdentityKey(const std::string &localDeviceId, std::vector<uint8_t> &Ik) {
@@ -200,45 +632,264 @@ namespace lime {
 		user->get_Ik(Ik);
 	}
 
+	// peer devices are known by each shard on its own: the status is set in all of them
 	void LimeManager::set_peerDeviceStatus(const std::string &peerDeviceId, const std::vector<uint8_t> &Ik, lime::PeerDeviceStatus status) {
-		// open local DB
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(m_db_access, m_db_mutex));
+		for (size_t shard=0; shard<m_localStorage.size(); shard++) {
+			// get the shared local DB connection
+			auto localStorage = get_localStorage(shard);
 
-		localStorage->set_peerDeviceStatus(peerDeviceId, Ik, status);
+			localStorage->set_peerDeviceStatus(peerDeviceId, Ik, status);
+		}
 	}
 
 	void LimeManager::set_peerDeviceStatus(const std::string &peerDeviceId, lime::PeerDeviceStatus status) {
-		// open local DB
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(m_db_access, m_db_mutex));
+		for (size_t shard=0; shard<m_localStorage.size(); shard++) {
+			// get the shared local DB connection
+			auto localStorage = get_localStorage(shard);
 
-		localStorage->set_peerDeviceStatus(peerDeviceId, status);
+			localStorage->set_peerDeviceStatus(peerDeviceId, status);
+		}
 	}
 
+	// a shard may not know a device known by another one: return the most significant status, unsafe first
 	lime::PeerDeviceStatus LimeManager::get_peerDeviceStatus(const std::string &peerDeviceId) {
-		// open local DB
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(m_db_access, m_db_mutex));
-
-		return localStorage->get_peerDeviceStatus(peerDeviceId);
+		const auto statusRank = [](const lime::PeerDeviceStatus status) {
+			switch (status) {
+				case lime::PeerDeviceStatus::unsafe: return 3;
+				case lime::PeerDeviceStatus::trusted: return 2;
+				case lime::PeerDeviceStatus::untrusted: return 1;
+				default: return 0;
+			}
+		};
+		auto status = lime::PeerDeviceStatus::unknown;
+		for (size_t shard=0; shard<m_localStorage.size(); shard++) {
+			// get the shared local DB connection
+			auto localStorage = get_localStorage(shard);
+
+			const auto shardStatus = localStorage->get_peerDeviceStatus(peerDeviceId);
+			if (statusRank(shardStatus) > statusRank(status)) {
+				status = shardStatus;
+			}
+		}
+		return status;
 	}
 
 	bool LimeManager::is_localUser(const std::string &deviceId) {
-		// open local DB
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(m_db_access, m_db_mutex));
+		// get the shared local DB connection of the shard holding this device if it is a local one
+		auto localStorage = get_localStorage(get_shard(deviceId));
 
 		return localStorage->is_localUser(deviceId);
 	}
 
 	void LimeManager::delete_peerDevice(const std::string &peerDeviceId) {
-		std::lock_guard<std::mutex> lock(m_users_mutex);
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
 		// loop on all local users in cache to destroy any cached session linked to that user
-		for (auto userElem : m_users_cache) {
+		for (auto userElem : *m_users_cache) {
 			userElem.second->delete_peerDevice(peerDeviceId);
 		}
 
-		// open local DB
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(m_db_access, m_db_mutex));
+		for (size_t shard=0; shard<m_localStorage.size(); shard++) {
+			// get the shared local DB connection
+			auto localStorage = get_localStorage(shard);
+
+			localStorage->delete_peerDevice(peerDeviceId);
+		}
+	}
+
+	lime::StorageOptions LimeManager::get_storageOptions() {
+		return get_localStorage()->get_storageOptions();
+	}
+
+	void LimeManager::set_encryptionThreads(const unsigned int threadsCount) {
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+		// users already holding the previous pool keep it alive until they switch to the new one, so an ongoing encryption is not disturbed
+		m_threadPool = (threadsCount>0)?std::make_shared<lime::ThreadPool>(threadsCount):nullptr;
+		for (auto &userElem : *m_users_cache) {
+			userElem.second->set_threadPool(m_threadPool);
+		}
+	}
+
+	void LimeManager::set_OPkPredictiveUpdate(const bool enabled) {
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+		m_OPkPredictiveUpdate = enabled;
+		for (auto &userElem : *m_users_cache) {
+			userElem.second->set_OPkPredictiveUpdate(enabled);
+		}
+	}
+
+	void LimeManager::set_keyPairPoolDepth(const size_t depth) {
+		m_keyPairPools->set_depth(depth);
+	}
+
+	void LimeManager::set_updatePipeline(const size_t maxUsers, const limeExecutor &executor, const bool deferFreshUsers) {
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+		m_updateConcurrency = maxUsers;
+		m_updateExecutor = executor;
+		m_updateDeferFreshUsers = deferFreshUsers;
+	}
+
+	void LimeManager::set_X3DHBatching(const bool enabled, const bool sharedCredential) {
+		m_X3DHBatcher->set_enabled(enabled, sharedCredential);
+	}
+
+	void LimeManager::begin_X3DHBatch() {
+		m_X3DHBatcher->hold();
+	}
+
+	void LimeManager::end_X3DHBatch() {
+		m_X3DHBatcher->release();
+	}
 
-		localStorage->delete_peerDevice(peerDeviceId);
+	void LimeManager::set_DRSessionsCacheLimits(const size_t maxSessions, const size_t maxMemory) {
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+		m_DRSessionsCache_maxSessions = maxSessions;
+		m_DRSessionsCache_maxMemory = maxMemory;
+		for (auto &userElem : *m_users_cache) {
+			userElem.second->set_DRSessionsCacheLimits(maxSessions, maxMemory);
+		}
+	}
+
+	void LimeManager::set_usersCacheLimit(const size_t maxUsers) {
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+		m_users_cache->set_limits(maxUsers, 0);
+	}
+
+	size_t LimeManager::get_usersCacheSize() {
+		MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+		return m_users_cache->size();
+	}
+
+	void LimeManager::get_DRSessionsCacheUsage(const std::string &localDeviceId, size_t &sessionsCount, size_t &memorySize) {
+		// load user (generate an exception if not found, let it flow up)
+		std::shared_ptr<LimeGeneric> user;
+		LimeManager::load_user(user, localDeviceId);
+
+		user->get_DRSessionsCacheUsage(sessionsCount, memorySize);
+	}
+
+	// snapshot file is: magic string || format version<1 byte> || for each user: snapshot size<4 bytes> || user snapshot, see Lime::get_sessionsSnapshot
+	void LimeManager::save_sessionsSnapshot(const std::string &filename) {
+		std::vector<uint8_t> content(lime::settings::sessionsSnapshotMagic.cbegin(), lime::settings::sessionsSnapshotMagic.cend());
+		content.push_back(lime::settings::sessionsSnapshotVersion);
+		{
+			MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+			for (auto &userElem : *m_users_cache) {
+				std::vector<uint8_t> userSnapshot{};
+				userElem.second->get_sessionsSnapshot(userSnapshot);
+				if (userSnapshot.empty()) continue;
+				const auto size = static_cast<uint32_t>(userSnapshot.size());
+				for (size_t i=4; i>0; i--) {
+					content.push_back(static_cast<uint8_t>((size>>(8*(i-1)))&0xFF));
+				}
+				content.insert(content.end(), userSnapshot.cbegin(), userSnapshot.cend());
+			}
+		}
+		std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char *>(content.data()), static_cast<std::streamsize>(content.size()));
+		if (!file) {
+			throw BCTBX_EXCEPTION << "Cannot write the sessions snapshot file "<<filename;
+		}
+	}
+
+	size_t LimeManager::load_sessionsSnapshot(const std::string &filename) {
+		std::vector<uint8_t> content{};
+		{
+			std::ifstream file(filename, std::ios::binary);
+			if (!file) return 0;
+			content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		}
+		std::remove(filename.data());
+
+		const auto &magic = lime::settings::sessionsSnapshotMagic;
+		if (content.size() < magic.size()+1 || !std::equal(magic.cbegin(), magic.cend(), content.cbegin()) || content[magic.size()] != lime::settings::sessionsSnapshotVersion) {
+			LIME_LOGE<<"Invalid sessions snapshot file "<<filename;
+			return 0;
+		}
+
+		size_t restored = 0;
+		size_t offset = magic.size()+1;
+		while (offset + 4 <= content.size()) {
+			const size_t size = (static_cast<size_t>(content[offset])<<24) | (static_cast<size_t>(content[offset+1])<<16) | (static_cast<size_t>(content[offset+2])<<8) | static_cast<size_t>(content[offset+3]);
+			offset += 4;
+			// the user snapshot starts with its device Id size<2 bytes> || device Id
+			if (size < 2 || offset + size > content.size()) break;
+			const size_t deviceIdSize = (static_cast<size_t>(content[offset])<<8) | static_cast<size_t>(content[offset+1]);
+			if (deviceIdSize + 2 > size) break;
+			const std::string localDeviceId(content.cbegin()+offset+2, content.cbegin()+offset+2+deviceIdSize);
+			const std::vector<uint8_t> userSnapshot(content.cbegin()+offset, content.cbegin()+offset+size);
+			offset += size;
+			try {
+				std::shared_ptr<LimeGeneric> user;
+				LimeManager::load_user(user, localDeviceId);
+				restored += user->set_sessionsSnapshot(userSnapshot);
+			} catch (BctbxException const &e) { // the user may have been deleted since the snapshot
+				LIME_LOGW<<"Cannot restore the sessions snapshot of user "<<localDeviceId<<": "<<e.str();
+			}
+		}
+		return restored;
+	}
+
+	void LimeManager::set_metricsEnabled(const bool enabled) {
+		m_metrics->set_enabled(enabled);
+	}
+
+	void LimeManager::get_metrics(lime::Metrics &metrics) {
+		m_metrics->get(metrics);
+	}
+
+	void LimeManager::reset_metrics() {
+		m_metrics->reset();
+	}
+
+	void LimeManager::set_traceCallback(const limeTraceCallback &callback) {
+		m_tracer->set_callback(callback);
+	}
+
+	// the shards are cleaned one after the other, the budgets are shared by all of them
+	bool LimeManager::cleanup(const std::chrono::milliseconds timeBudget, const size_t rowBudget) {
+		std::lock_guard<std::mutex> lock(m_cleanup_mutex);
+		const auto deadline = std::chrono::steady_clock::now() + timeBudget;
+		size_t remainingRows = (rowBudget == 0)?std::numeric_limits<size_t>::max():rowBudget;
+		while (m_cleanupShard < m_localStorage.size()) {
+			auto localStorage = get_localStorage(m_cleanupShard);
+			if (!localStorage->clean_incremental(deadline, remainingRows)) {
+				return false;
+			}
+			m_cleanupShard++;
+		}
+		m_cleanupShard = 0; // next call starts a new cleanup
+		return true;
+	}
+
+	void LimeManager::get_storageUsage(lime::StorageUsage &usage) {
+		usage = lime::StorageUsage{};
+		for (size_t shard=0; shard<m_localStorage.size(); shard++) {
+			get_localStorage(shard)->get_storageUsage(usage);
+		}
+	}
+
+	bool LimeManager::compact(const std::chrono::milliseconds timeBudget, const bool allowVacuum) {
+		// never interleaved with the incremental cleanup, which frees pages while we release them
+		std::lock_guard<std::mutex> lock(m_cleanup_mutex);
+		const auto deadline = std::chrono::steady_clock::now() + timeBudget;
+		bool compacted = true;
+		for (size_t shard=0; shard<m_localStorage.size(); shard++) {
+			compacted = get_localStorage(shard)->compact_incremental(deadline, allowVacuum) && compacted;
+		}
+		return compacted;
+	}
+
+	void LimeManager::flush() {
+		{
+			// users with their own connection queue their updates on it
+			MetricsLockGuard<std::mutex> lock(m_users_mutex, m_metrics.get(), lime::MetricsCounter::usersMutexWait);
+			for (auto &userElem : *m_users_cache) {
+				userElem.second->flush();
+			}
+		}
+		for (size_t shard=0; shard<m_localStorage.size(); shard++) {
+			get_localStorage(shard)->flush_sessionUpdates();
+		}
 	}
 
 	void LimeManager::set_x3dhServerUrl(const std::string &localDeviceId, const std::string &x3dhServerUrl) {
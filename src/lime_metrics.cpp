@@ -0,0 +1,133 @@
+/*
+	lime_metrics.cpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lime_metrics.hpp"
+#include <algorithm>
+
+namespace lime {
+	namespace {
+		// local storage access time of the current thread, in ns
+		thread_local uint64_t threadDBTime = 0;
+
+		uint64_t elapsed_ns(const std::chrono::steady_clock::time_point start) {
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		}
+
+		// bucket 0 is < 1us, bucket n is [2^(n-1), 2^n[ us
+		size_t histogramBucket(const uint64_t duration_ns) {
+			uint64_t us = duration_ns/1000;
+			size_t bucket = 0;
+			while (us > 0 && bucket < lime::metricsHistogramBuckets-1) {
+				us >>= 1;
+				bucket++;
+			}
+			return bucket;
+		}
+	}
+
+	MetricsCollector::MetricsCollector() : m_enabled{false} {
+		reset();
+	}
+
+	void MetricsCollector::record(const lime::MetricsOperation op, const uint64_t totalTime, const uint64_t DBTime, const uint64_t cryptoTime) noexcept {
+		auto &counters = m_operations[static_cast<size_t>(op)];
+		counters.calls.fetch_add(1, std::memory_order_relaxed);
+		counters.totalTime.fetch_add(totalTime, std::memory_order_relaxed);
+		counters.DBTime.fetch_add(DBTime, std::memory_order_relaxed);
+		counters.cryptoTime.fetch_add(cryptoTime, std::memory_order_relaxed);
+		counters.latencyHistogram[histogramBucket(totalTime)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void MetricsCollector::get(lime::Metrics &metrics) const noexcept {
+		for (size_t i=0; i<lime::metricsOperationsCount; i++) {
+			const auto &counters = m_operations[i];
+			auto &operation = metrics.operations[i];
+			operation.calls = counters.calls.load(std::memory_order_relaxed);
+			operation.totalTime = counters.totalTime.load(std::memory_order_relaxed);
+			operation.DBTime = counters.DBTime.load(std::memory_order_relaxed);
+			operation.cryptoTime = counters.cryptoTime.load(std::memory_order_relaxed);
+			for (size_t j=0; j<lime::metricsHistogramBuckets; j++) {
+				operation.latencyHistogram[j] = counters.latencyHistogram[j].load(std::memory_order_relaxed);
+			}
+		}
+		metrics.DRSessionsCacheHits = m_counters[static_cast<size_t>(lime::MetricsCounter::DRSessionsCacheHit)].load(std::memory_order_relaxed);
+		metrics.DRSessionsCacheMisses = m_counters[static_cast<size_t>(lime::MetricsCounter::DRSessionsCacheMiss)].load(std::memory_order_relaxed);
+		metrics.staleSessionDecrypts = m_counters[static_cast<size_t>(lime::MetricsCounter::staleSessionDecrypt)].load(std::memory_order_relaxed);
+		metrics.skippedKeysDerived = m_counters[static_cast<size_t>(lime::MetricsCounter::skippedKeyDerived)].load(std::memory_order_relaxed);
+		metrics.DBMutexWaitTime = m_counters[static_cast<size_t>(lime::MetricsCounter::DBMutexWait)].load(std::memory_order_relaxed);
+		metrics.usersMutexWaitTime = m_counters[static_cast<size_t>(lime::MetricsCounter::usersMutexWait)].load(std::memory_order_relaxed);
+	}
+
+	void MetricsCollector::reset() noexcept {
+		for (auto &counters : m_operations) {
+			counters.calls.store(0, std::memory_order_relaxed);
+			counters.totalTime.store(0, std::memory_order_relaxed);
+			counters.DBTime.store(0, std::memory_order_relaxed);
+			counters.cryptoTime.store(0, std::memory_order_relaxed);
+			for (auto &bucket : counters.latencyHistogram) {
+				bucket.store(0, std::memory_order_relaxed);
+			}
+		}
+		for (auto &counter : m_counters) {
+			counter.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	MetricsTimer::MetricsTimer(MetricsCollector *collector, const lime::MetricsOperation op, const bool splitDBTime) noexcept
+		: m_collector{(collector != nullptr && collector->enabled())?collector:nullptr}, m_op{op}, m_start{}, m_DBTimeAtStart{0}, m_splitDBTime{splitDBTime} {
+		if (m_collector != nullptr) {
+			m_DBTimeAtStart = threadDBTime;
+			m_start = std::chrono::steady_clock::now();
+		}
+	}
+
+	MetricsTimer::~MetricsTimer() {
+		stop();
+	}
+
+	void MetricsTimer::stop() noexcept {
+		if (m_collector == nullptr) return;
+		auto collector = m_collector;
+		m_collector = nullptr; // record only once
+		const auto totalTime = elapsed_ns(m_start);
+		if (!m_splitDBTime) {
+			collector->record(m_op, totalTime, 0, 0);
+			return;
+		}
+		// the DB time measured in this thread since we started, bounded by the operation time as the clock is read at different points
+		const auto DBTime = std::min(threadDBTime - m_DBTimeAtStart, totalTime);
+		collector->record(m_op, totalTime, DBTime, totalTime - DBTime);
+	}
+
+	MetricsDBTimer::MetricsDBTimer(const MetricsCollector *collector) noexcept : m_active{collector != nullptr && collector->enabled()}, m_start{}, m_DBTimeAtStart{0} {
+		if (m_active) {
+			m_DBTimeAtStart = threadDBTime;
+			m_start = std::chrono::steady_clock::now();
+		}
+	}
+
+	MetricsDBTimer::~MetricsDBTimer() {
+		if (!m_active) return;
+		// nested accesses already added their time: add only ours so each access is counted once
+		// and the operations timed inside this access still get their own DB time
+		const auto elapsed = elapsed_ns(m_start);
+		const auto nested = threadDBTime - m_DBTimeAtStart;
+		if (elapsed > nested) threadDBTime += elapsed - nested;
+	}
+} // namespace lime
@@ -0,0 +1,158 @@
+/*
+	lime_metrics.hpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef lime_metrics_hpp
+#define lime_metrics_hpp
+
+#include "lime/lime.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+
+namespace lime {
+	/** Counters of lime::Metrics which are not operations */
+	enum class MetricsCounter : uint8_t {
+		DRSessionsCacheHit=0,
+		DRSessionsCacheMiss=1,
+		staleSessionDecrypt=2,
+		skippedKeyDerived=3,
+		DBMutexWait=4, // in ns
+		usersMutexWait=5 // in ns
+	};
+	constexpr size_t metricsCountersCount = 6;
+
+	/**
+	 * @brief Runtime metrics of a LimeManager
+	 *
+	 * Owned by the manager and referenced by its local storage connections so the operations reach it through their Db.
+	 * All counters are relaxed atomics: they are updated from any thread and read only when the metrics are queried.
+	 */
+	class MetricsCollector {
+		private:
+			struct operationCounters {
+				std::atomic<uint64_t> calls;
+				std::atomic<uint64_t> totalTime;
+				std::atomic<uint64_t> DBTime;
+				std::atomic<uint64_t> cryptoTime;
+				std::array<std::atomic<uint64_t>, lime::metricsHistogramBuckets> latencyHistogram;
+			};
+			std::atomic<bool> m_enabled;
+			std::array<operationCounters, lime::metricsOperationsCount> m_operations;
+			std::array<std::atomic<uint64_t>, metricsCountersCount> m_counters;
+
+		public:
+			MetricsCollector();
+			MetricsCollector(const MetricsCollector &) = delete;
+			MetricsCollector &operator=(const MetricsCollector &) = delete;
+
+			bool enabled() const noexcept {return m_enabled.load(std::memory_order_relaxed);};
+			void set_enabled(const bool enabled) noexcept {m_enabled.store(enabled, std::memory_order_relaxed);};
+
+			/**
+			 * @brief account one completed operation
+			 *
+			 * @param[in]	op		the operation
+			 * @param[in]	totalTime	its duration in ns
+			 * @param[in]	DBTime		the part of it spent in local storage accesses, in ns
+			 * @param[in]	cryptoTime	the rest of it, in ns
+			 */
+			void record(const lime::MetricsOperation op, const uint64_t totalTime, const uint64_t DBTime, const uint64_t cryptoTime) noexcept;
+			void increment(const lime::MetricsCounter counter, const uint64_t count=1) noexcept {
+				if (enabled()) m_counters[static_cast<size_t>(counter)].fetch_add(count, std::memory_order_relaxed);
+			};
+
+			void get(lime::Metrics &metrics) const noexcept;
+			void reset() noexcept;
+	};
+
+	/**
+	 * @brief Time an operation from construction to destruction, the local storage accesses timed meanwhile by MetricsDBTimer
+	 * in the same thread are accounted as its DB time
+	 *
+	 * Does nothing when the collector is nullptr or disabled
+	 */
+	class MetricsTimer {
+		private:
+			MetricsCollector *m_collector; // nullptr when not timing
+			lime::MetricsOperation m_op;
+			std::chrono::steady_clock::time_point m_start;
+			uint64_t m_DBTimeAtStart;
+			bool m_splitDBTime;
+
+		public:
+			/**
+			 * @param[in]	collector	where to record the operation, may be nullptr
+			 * @param[in]	op		the timed operation
+			 * @param[in]	splitDBTime	when false, the DB and crypto time are not recorded (ie: server round trip)
+			 */
+			MetricsTimer(MetricsCollector *collector, const lime::MetricsOperation op, const bool splitDBTime=true) noexcept;
+			~MetricsTimer();
+			/// @brief record the operation now instead of at destruction
+			void stop() noexcept;
+			MetricsTimer(const MetricsTimer &) = delete;
+			MetricsTimer &operator=(const MetricsTimer &) = delete;
+	};
+
+	/**
+	 * @brief Time a local storage access, from construction to destruction
+	 *
+	 * The time is added to a per thread accumulator read by the MetricsTimer of the enclosing operations, nested accesses are not counted twice.
+	 * Accesses may nest and enclose timed operations(ie: a sessions query loading each session).
+	 * Does nothing when the collector is nullptr or disabled
+	 */
+	class MetricsDBTimer {
+		private:
+			bool m_active; // the collector was enabled at construction
+			std::chrono::steady_clock::time_point m_start;
+			uint64_t m_DBTimeAtStart;
+
+		public:
+			MetricsDBTimer(const MetricsCollector *collector) noexcept;
+			~MetricsDBTimer();
+			MetricsDBTimer(const MetricsDBTimer &) = delete;
+			MetricsDBTimer &operator=(const MetricsDBTimer &) = delete;
+	};
+
+	/**
+	 * @brief Lock a mutex like std::lock_guard, the time spent waiting for it is added to a counter
+	 *
+	 * Only an already locked mutex is timed: it is first tried without blocking.
+	 * Does nothing more than std::lock_guard when the collector is nullptr or disabled
+	 */
+	template <typename Mutex>
+	class MetricsLockGuard {
+		private:
+			Mutex &m_mutex;
+
+		public:
+			MetricsLockGuard(Mutex &mutex, MetricsCollector *collector, const lime::MetricsCounter counter) : m_mutex(mutex) {
+				if (collector == nullptr || !collector->enabled()) {
+					m_mutex.lock();
+				} else if (!m_mutex.try_lock()) {
+					const auto start = std::chrono::steady_clock::now();
+					m_mutex.lock();
+					collector->increment(counter, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+				}
+			};
+			~MetricsLockGuard() {m_mutex.unlock();};
+			MetricsLockGuard(const MetricsLockGuard &) = delete;
+			MetricsLockGuard &operator=(const MetricsLockGuard &) = delete;
+	};
+} // namespace lime
+
+#endif /* lime_metrics_hpp */
@@ -0,0 +1,288 @@
+/*
+	lime_sender_key.cpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lime_log.hpp"
+#include "lime_sender_key.hpp"
+#include "lime_double_ratchet_protocol.hpp"
+
+#include "bctoolbox/exception.hh"
+
+#include <algorithm> //copy_n, equal
+#include <limits>
+#include <array>
+
+using namespace::std;
+using namespace::lime;
+
+namespace lime {
+namespace sender_key {
+	namespace {
+		/// size of chain Id || index at the beginning of the cipher message
+		constexpr size_t cipherMessageHeaderSize = lime::settings::senderKeyChainIdSize + 2;
+
+		/** constants used as input of the sender key chain symmetric ratchet, see KDF_CK in lime_double_ratchet.cpp */
+		const std::array<std::uint8_t,1> hkdf_ck_info{{0x02}};
+		const std::array<std::uint8_t,1> hkdf_mk_info{{0x01}};
+
+		using senderKeyMK = lime::sBuffer<lime::settings::DRMessageKeySize+lime::settings::DRMessageIVSize>;
+
+		/**
+		 * @brief Symmetric ratchet step of a sender key chain, same as the Double Ratchet one:
+		 *	MK = HMAC-SHA512(CK, 0x01) // 32 bytes key and 16 bytes IV
+		 *	CK = HMAC-SHA512(CK, 0x02)
+		 *
+		 * @param[in,out]	CK	the chain key, get the next one
+		 * @param[out]		MK	message key and IV
+		 */
+		void KDF_CK(lime::sBuffer<lime::settings::DRChainKeySize> &CK, senderKeyMK &MK) noexcept {
+			lime::sBuffer<lime::settings::DRChainKeySize> tmp;
+			const std::array<HMACJob, 2> jobs{{
+				HMACJob{CK.data(), CK.size(), hkdf_mk_info.data(), hkdf_mk_info.size(), MK.data(), MK.size()},
+				HMACJob{CK.data(), CK.size(), hkdf_ck_info.data(), hkdf_ck_info.size(), tmp.data(), tmp.size()}}};
+			HMAC_batch<SHA512>(jobs.data(), jobs.size());
+			CK = tmp;
+		}
+
+		/**
+		 * @brief associated data of the cipher message AEAD: source Device Id || recipient User Id || chain Id || index
+		 */
+		void cipherMessage_AD(const std::string &sourceDeviceId, const std::string &recipientUserId, const uint8_t *const header, std::vector<uint8_t> &AD) {
+			AD.assign(sourceDeviceId.cbegin(), sourceDeviceId.cend());
+			AD.insert(AD.end(), recipientUserId.cbegin(), recipientUserId.cend());
+			AD.insert(AD.end(), header, header+cipherMessageHeaderSize);
+		}
+	}
+
+	/**
+	 * @brief Generate a new sender key chain: random id and chain key, index 0
+	 *
+	 * @param[in]	RNG_context	the Random Number Generator to use
+	 * @param[out]	chain		the new chain
+	 */
+	void newChain(std::shared_ptr<RNG> RNG_context, SenderKeyChain &chain) {
+		static_assert(lime::settings::DRrandomSeedSize >= lime::settings::DRChainKeySize && lime::settings::DRrandomSeedSize >= lime::settings::senderKeyChainIdSize, "Sender key chains are drawn from random seeds");
+		lime::sBuffer<lime::settings::DRrandomSeedSize> seed;
+		RNG_context->randomize(seed);
+		std::copy_n(seed.cbegin(), chain.CK.size(), chain.CK.begin());
+		RNG_context->randomize(seed);
+		std::copy_n(seed.cbegin(), chain.chainId.size(), chain.chainId.begin());
+		chain.index = 0;
+	}
+
+	/**
+	 * @brief Build the payload of the Double Ratchet message giving a sender key chain to a device
+	 *
+	 * @param[in]	chain		the chain, at the index of the message it is sent with
+	 * @param[out]	distribution	chain Id<16 bytes> || index<2 bytes> || chain key<32 bytes>
+	 */
+	void buildMessage_distribution(const SenderKeyChain &chain, std::vector<uint8_t> &distribution) {
+		distribution.assign(chain.chainId.cbegin(), chain.chainId.cend());
+		distribution.push_back(static_cast<uint8_t>((chain.index>>8)&0xFF));
+		distribution.push_back(static_cast<uint8_t>(chain.index&0xFF));
+		distribution.insert(distribution.end(), chain.CK.cbegin(), chain.CK.cend());
+	}
+
+	/**
+	 * @brief Parse the payload of a Double Ratchet message giving a sender key chain
+	 *
+	 * @param[in]	distribution	the decrypted payload
+	 * @param[out]	chain		the chain given
+	 *
+	 * @return false if the payload is not a valid sender key chain
+	 */
+	bool parseMessage_distribution(const std::vector<uint8_t> &distribution, SenderKeyChain &chain) noexcept {
+		if (distribution.size() != lime::settings::senderKeyChainIdSize + 2 + lime::settings::DRChainKeySize) {
+			return false;
+		}
+		std::copy_n(distribution.cbegin(), chain.chainId.size(), chain.chainId.begin());
+		chain.index = static_cast<uint16_t>(distribution[lime::settings::senderKeyChainIdSize]<<8 | distribution[lime::settings::senderKeyChainIdSize+1]);
+		std::copy_n(distribution.cbegin()+lime::settings::senderKeyChainIdSize+2, chain.CK.size(), chain.CK.begin());
+		return true;
+	}
+
+	/**
+	 * @brief Build the DR message of the devices already holding the sender key chain
+	 *
+	 * @param[out]	DRmessage	Protocol Version Number<1 byte> || Message Type<1 byte> || curveId<1 byte>
+	 */
+	template <typename Curve>
+	void buildMessage_senderKey(std::vector<uint8_t> &DRmessage) noexcept {
+		DRmessage.assign({double_ratchet_protocol::DR_v01, static_cast<uint8_t>(double_ratchet_protocol::DR_message_type::sender_key_flag), static_cast<uint8_t>(Curve::curveId())});
+	}
+
+	/**
+	 * @brief Tell if a message is encrypted with a sender key chain
+	 *
+	 * @param[in]	DRmessage	the Double Ratchet message
+	 * @param[in]	cipherMessage	the cipher message
+	 *
+	 * @return message when the DR message only flags the sender key mode, distribution when it is a Double Ratchet packet with the payload
+	 * 	in it while there is a cipher message, none otherwise
+	 */
+	template <typename Curve>
+	SenderKeyMessageType get_messageType(const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage) noexcept {
+		if (DRmessage.size() == 3 && DRmessage[0] == double_ratchet_protocol::DR_v01
+				&& DRmessage[1] == static_cast<uint8_t>(double_ratchet_protocol::DR_message_type::sender_key_flag)
+				&& DRmessage[2] == static_cast<uint8_t>(Curve::curveId())) {
+			return SenderKeyMessageType::message;
+		}
+		// the other policies never produce a cipher message with a DR message holding the payload
+		if (cipherMessage.empty()) {
+			return SenderKeyMessageType::none;
+		}
+		double_ratchet_protocol::DRHeader<Curve> header{DRmessage};
+		if (header.valid() && header.payloadDirectEncryption()) {
+			return SenderKeyMessageType::distribution;
+		}
+		return SenderKeyMessageType::none;
+	}
+
+	/**
+	 * @brief Encrypt a message with a sender key chain and sign it
+	 *
+	 * @param[in,out]	chain			the sender chain, its next message key is used and its index increased
+	 * @param[in]		Ik			the sender identity key pair
+	 * @param[in]		plaintext		data to be encrypted
+	 * @param[in]		recipientUserId		the recipient ID, identifies the group
+	 * @param[in]		sourceDeviceId		the Id of sender device(gruu)
+	 * @param[out]		cipherMessage		chain Id || index || cipher text || auth tag || signature
+	 */
+	template <typename Curve>
+	void encryptMessage(SenderKeyChain &chain, DSApair<Curve> &Ik, const std::vector<uint8_t> &plaintext, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &cipherMessage) {
+		if (chain.index == std::numeric_limits<uint16_t>::max()) {
+			throw BCTBX_EXCEPTION << "Sender key chain index reached its maximum value";
+		}
+		cipherMessage.assign(chain.chainId.cbegin(), chain.chainId.cend());
+		cipherMessage.push_back(static_cast<uint8_t>((chain.index>>8)&0xFF));
+		cipherMessage.push_back(static_cast<uint8_t>(chain.index&0xFF));
+
+		senderKeyMK MK;
+		KDF_CK(chain.CK, MK);
+
+		std::vector<uint8_t> AD{};
+		cipherMessage_AD(sourceDeviceId, recipientUserId, cipherMessage.data(), AD);
+
+		// resize cipherMessage vector as it is adressed directly by C library: header || cipher text || auth tag || signature
+		cipherMessage.resize(cipherMessageHeaderSize + plaintext.size() + lime::settings::DRMessageAuthTagSize + DSA<Curve, lime::DSAtype::signature>::ssize());
+		AEAD_encrypt<AES256GCM>(MK.data(), lime::settings::DRMessageKeySize, // key buffer also hold the IV
+			MK.data()+lime::settings::DRMessageKeySize, lime::settings::DRMessageIVSize, // IV is stored in the same buffer as key, after it
+			plaintext.data(), plaintext.size(),
+			AD.data(), AD.size(),
+			cipherMessage.data()+cipherMessageHeaderSize+plaintext.size(), lime::settings::DRMessageAuthTagSize, // directly store tag after cipher text in the output buffer
+			cipherMessage.data()+cipherMessageHeaderSize);
+
+		// any device holding the chain could encrypt with it: the signature authenticates the sender
+		const std::vector<uint8_t> signedPart(cipherMessage.cbegin(), cipherMessage.cend()-DSA<Curve, lime::DSAtype::signature>::ssize());
+		DSA<Curve, lime::DSAtype::signature> signature;
+		auto signer = make_Signature<Curve>();
+		signer->set_public(Ik.publicKey());
+		signer->set_secret(Ik.privateKey());
+		signer->sign(signedPart, signature);
+		std::copy_n(signature.cbegin(), signature.size(), cipherMessage.end()-signature.size());
+
+		chain.index++;
+	}
+
+	/**
+	 * @brief Verify and decrypt a message encrypted with a sender key chain
+	 *
+	 * Only the keys following the chain index are reachable: messages older than the last one decrypted are rejected,
+	 * the keys of the skipped ones are discarded.
+	 *
+	 * @param[in,out]	chain			the chain received from this sender for this group, moved after the message on success
+	 * @param[in]		senderIk		the sender public identity key
+	 * @param[in]		cipherMessage		chain Id || index || cipher text || auth tag || signature
+	 * @param[in]		recipientUserId		the recipient ID, identifies the group
+	 * @param[in]		sourceDeviceId		the device Id of sender(gruu)
+	 * @param[out]		plaintext		decrypted message
+	 *
+	 * @return true on success
+	 */
+	template <typename Curve>
+	bool decryptMessage(SenderKeyChain &chain, const DSA<Curve, lime::DSAtype::publicKey> &senderIk, const std::vector<uint8_t> &cipherMessage, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &plaintext) {
+		constexpr size_t overhead = cipherMessageHeaderSize + lime::settings::DRMessageAuthTagSize + DSA<Curve, lime::DSAtype::signature>::ssize();
+		if (cipherMessage.size() < overhead) {
+			LIME_LOGE<<"Invalid sender key cipher message - too short";
+			return false;
+		}
+		if (!std::equal(chain.chainId.cbegin(), chain.chainId.cend(), cipherMessage.cbegin())) {
+			LIME_LOGE<<"Sender key cipher message from "<<sourceDeviceId<<" is not encrypted with the chain we hold";
+			return false;
+		}
+		const uint16_t index = static_cast<uint16_t>(cipherMessage[lime::settings::senderKeyChainIdSize]<<8 | cipherMessage[lime::settings::senderKeyChainIdSize+1]);
+		if (index < chain.index || index - chain.index > lime::settings::maxMessageSkip || index == std::numeric_limits<uint16_t>::max()) {
+			LIME_LOGE<<"Sender key cipher message from "<<sourceDeviceId<<" index "<<index<<" is out of reach, chain index is "<<chain.index;
+			return false;
+		}
+
+		// check the signature before any derivation
+		const std::vector<uint8_t> signedPart(cipherMessage.cbegin(), cipherMessage.cend()-DSA<Curve, lime::DSAtype::signature>::ssize());
+		DSA<Curve, lime::DSAtype::signature> signature;
+		std::copy_n(cipherMessage.cend()-signature.size(), signature.size(), signature.begin());
+		auto verifier = make_Signature<Curve>();
+		verifier->set_public(senderIk);
+		if (!verifier->verify(signedPart, signature)) {
+			LIME_LOGE<<"Sender key cipher message from "<<sourceDeviceId<<" has an invalid signature";
+			return false;
+		}
+
+		// derive on a copy: the chain moves only if the message decrypts
+		lime::sBuffer<lime::settings::DRChainKeySize> CK;
+		CK = chain.CK;
+		senderKeyMK MK;
+		for (auto i=chain.index; i<index; i++) {
+			KDF_CK(CK, MK); // these keys are skipped and discarded
+		}
+		KDF_CK(CK, MK);
+
+		std::vector<uint8_t> AD{};
+		cipherMessage_AD(sourceDeviceId, recipientUserId, cipherMessage.data(), AD);
+		const size_t cipherTextSize = cipherMessage.size() - overhead;
+		plaintext.resize(cipherTextSize);
+		if (!AEAD_decrypt<AES256GCM>(MK.data(), lime::settings::DRMessageKeySize,
+				MK.data()+lime::settings::DRMessageKeySize, lime::settings::DRMessageIVSize,
+				cipherMessage.data()+cipherMessageHeaderSize, cipherTextSize,
+				AD.data(), AD.size(),
+				cipherMessage.data()+cipherMessageHeaderSize+cipherTextSize, lime::settings::DRMessageAuthTagSize,
+				plaintext.data())) {
+			cleanBuffer(plaintext.data(), plaintext.size());
+			plaintext.clear();
+			LIME_LOGE<<"Sender key cipher message from "<<sourceDeviceId<<" failed to decrypt";
+			return false;
+		}
+		chain.CK = CK;
+		chain.index = static_cast<uint16_t>(index+1);
+		return true;
+	}
+
+	/* template instanciations for Curves 25519 and 448 */
+#ifdef EC25519_ENABLED
+	template void buildMessage_senderKey<C255>(std::vector<uint8_t> &DRmessage) noexcept;
+	template SenderKeyMessageType get_messageType<C255>(const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage) noexcept;
+	template void encryptMessage<C255>(SenderKeyChain &chain, DSApair<C255> &Ik, const std::vector<uint8_t> &plaintext, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &cipherMessage);
+	template bool decryptMessage<C255>(SenderKeyChain &chain, const DSA<C255, lime::DSAtype::publicKey> &senderIk, const std::vector<uint8_t> &cipherMessage, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &plaintext);
+#endif
+#ifdef EC448_ENABLED
+	template void buildMessage_senderKey<C448>(std::vector<uint8_t> &DRmessage) noexcept;
+	template SenderKeyMessageType get_messageType<C448>(const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage) noexcept;
+	template void encryptMessage<C448>(SenderKeyChain &chain, DSApair<C448> &Ik, const std::vector<uint8_t> &plaintext, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &cipherMessage);
+	template bool decryptMessage<C448>(SenderKeyChain &chain, const DSA<C448, lime::DSAtype::publicKey> &senderIk, const std::vector<uint8_t> &cipherMessage, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &plaintext);
+#endif
+} // namespace sender_key
+} // namespace lime
@@ -0,0 +1,91 @@
+/*
+	lime_sender_key.hpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef lime_sender_key_hpp
+#define lime_sender_key_hpp
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "lime/lime.hpp"
+#include "lime_settings.hpp"
+#include "lime_defines.hpp"
+#include "lime_crypto_primitives.hpp"
+
+namespace lime {
+	/**
+	 * @brief A sender key chain: symmetric ratchet shared by a sender with all the devices of a group
+	 *
+	 * Used by the lime::EncryptionPolicy::senderKey: the sender holds one per group, each recipient one per group and sender device
+	 */
+	struct SenderKeyChain {
+		lime::sBuffer<lime::settings::senderKeyChainIdSize> chainId; /**< random identifier of the chain */
+		lime::sBuffer<lime::settings::DRChainKeySize> CK; /**< chain key, gives the message key of index */
+		uint16_t index; /**< index of the next message key in the chain */
+		SenderKeyChain() : chainId{}, CK{}, index{0} {};
+	};
+
+	/** @brief how a message is encrypted when using a sender key chain */
+	enum class SenderKeyMessageType : uint8_t {
+		none, /**< not encrypted with a sender key chain */
+		message, /**< the DR message only flags the sender key mode: the recipient already holds the chain */
+		distribution /**< the DR message is a Double Ratchet packet holding the sender key chain */
+	};
+
+	/** @brief Group in this namespace the sender key chains messages building, parsing, encryption and decryption
+	 *
+	 * - the DR message sent to devices already holding the chain is: Protocol Version Number<1 byte> || Message Type<1 byte, sender key flag set> || curveId<1 byte>
+	 * - the DR message sent to devices getting the chain is a Double Ratchet packet, payload direct encryption flag set, while there is a cipher message.
+	 *   Its payload is: chain Id<16 bytes> || index<2 bytes> || chain key<32 bytes>
+	 * - the cipher message is: chain Id<16 bytes> || index<2 bytes> || cipher text<...> || auth tag<16 bytes> || signature<DSA signature size>\n
+	 *   The AEAD associated data are: source Device Id || recipient User Id || chain Id || index.
+	 *   The signature, made with the sender identity key, covers all the cipher message before it.
+	 */
+	namespace sender_key {
+		void newChain(std::shared_ptr<RNG> RNG_context, SenderKeyChain &chain);
+		void buildMessage_distribution(const SenderKeyChain &chain, std::vector<uint8_t> &distribution);
+		bool parseMessage_distribution(const std::vector<uint8_t> &distribution, SenderKeyChain &chain) noexcept;
+
+		template <typename Curve>
+		void buildMessage_senderKey(std::vector<uint8_t> &DRmessage) noexcept;
+		template <typename Curve>
+		SenderKeyMessageType get_messageType(const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage) noexcept;
+
+		template <typename Curve>
+		void encryptMessage(SenderKeyChain &chain, DSApair<Curve> &Ik, const std::vector<uint8_t> &plaintext, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &cipherMessage);
+		template <typename Curve>
+		bool decryptMessage(SenderKeyChain &chain, const DSA<Curve, lime::DSAtype::publicKey> &senderIk, const std::vector<uint8_t> &cipherMessage, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &plaintext);
+
+		/* this templates are instanciated in lime_sender_key.cpp, do not re-instanciate it anywhere else */
+#ifdef EC25519_ENABLED
+		extern template void buildMessage_senderKey<C255>(std::vector<uint8_t> &DRmessage) noexcept;
+		extern template SenderKeyMessageType get_messageType<C255>(const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage) noexcept;
+		extern template void encryptMessage<C255>(SenderKeyChain &chain, DSApair<C255> &Ik, const std::vector<uint8_t> &plaintext, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &cipherMessage);
+		extern template bool decryptMessage<C255>(SenderKeyChain &chain, const DSA<C255, lime::DSAtype::publicKey> &senderIk, const std::vector<uint8_t> &cipherMessage, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &plaintext);
+#endif
+#ifdef EC448_ENABLED
+		extern template void buildMessage_senderKey<C448>(std::vector<uint8_t> &DRmessage) noexcept;
+		extern template SenderKeyMessageType get_messageType<C448>(const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage) noexcept;
+		extern template void encryptMessage<C448>(SenderKeyChain &chain, DSApair<C448> &Ik, const std::vector<uint8_t> &plaintext, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &cipherMessage);
+		extern template bool decryptMessage<C448>(SenderKeyChain &chain, const DSA<C448, lime::DSAtype::publicKey> &senderIk, const std::vector<uint8_t> &cipherMessage, const std::string &recipientUserId, const std::string &sourceDeviceId, std::vector<uint8_t> &plaintext);
+#endif
+	} // namespace sender_key
+} // namespace lime
+
+#endif /* lime_sender_key_hpp */
@@ -64,6 +64,59 @@ namespace settings {
 	/** Lifetime of a session once not active anymore, unit is day */
 	constexpr unsigned int DRSession_limboTime_days=30;
 
+	/** number of messages encrypted with a sender key chain before a new one is generated and distributed to the group
+	 * Can't be more than 2^16 as message index is send on 2 bytes
+	 */
+	constexpr std::uint16_t senderKeyChain_maxMessages=1000;
+
+	/** when a thread pool is available, encrypt in parallel only if there is at least this number of recipient devices\n
+	 * under it, dispatching the work costs more than it saves
+	 */
+	constexpr size_t parallelEncryption_minRecipients=4;
+
+	/** number of threads of the built-in executor running the asynchronous decryptions */
+	constexpr size_t asyncDecryption_threads=2;
+
+	/** when streaming a cipher message, read and process it by chunks of this size */
+	constexpr size_t cipherStream_chunkSize=64*1024;
+
+	/** default limits of the DR sessions cache held by each local user, 0 means no limit
+
+	 * least recently used sessions are evicted once a limit is reached, they are reloaded from local storage when needed again
+	 */
+	constexpr size_t DRSessionsCache_maxSessions=0;
+	constexpr size_t DRSessionsCache_maxMemory=0;
+
+	/** default limit of the number of local users kept loaded by a LimeManager, 0 means no limit
+
+	 * least recently used idle users are unloaded once it is reached, they are loaded again from local storage when needed
+	 */
+	constexpr size_t usersCache_maxUsers=0;
+
+/******************************************************************************/
+/*                                                                            */
+/* Local storage related definitions                                          */
+/*                                                                            */
+/******************************************************************************/
+	/// in milliseconds, when each user has its own database connection or several processes share it, how long a connection waits for the others to release the database lock
+	constexpr int DB_busyTimeout_ms=5000;
+	/// in milliseconds, in multi-process mode, first delay before trying again a busy transaction start or commit, doubled at each retry
+	constexpr int DB_busyBackoff_ms=10;
+	/// in milliseconds, in multi-process mode, maximum delay between two tries of a busy transaction start or commit
+	constexpr int DB_busyBackoffMax_ms=500;
+	/// maximum number of rows deleted by each statement of the incremental cleanup(see LimeManager::cleanup), the database mutex is released between them
+	constexpr size_t cleanup_batchSize=256;
+	/// maximum number of free pages released by each step of the incremental compaction(see LimeManager::compact), the database mutex is released between them
+	constexpr int compaction_batchPages=64;
+	/// number of bound parameters of the peer devices lookups IN lists: longer lists are queried by chunks of this size, the last one padded
+	constexpr size_t DB_inListChunkSize=64;
+	/// maximum number of peer devices(Did, Ik and status) kept in memory by a manager to spare their lookups in local storage
+	constexpr size_t peerDevicesCache_maxDevices=4096;
+	/// in milliseconds, in write-behind mode(see StorageOptions::writeBehindDepth), the sessions updates queued within this delay are committed together
+	constexpr int writeBehind_maxDelay_ms=10;
+	/// in milliseconds, maximum time a background operation(update, cleanup, OPks storage) waits between two of its batches for the encryptions and decryptions in progress
+	constexpr int background_maxYield_ms=50;
+
 /******************************************************************************/
 /*                                                                            */
 /* X3DH related definitions                                                   */
@@ -81,8 +134,34 @@ namespace settings {
 	constexpr uint16_t OPk_initialBatchSize = 4*OPk_batchSize;
 	/// default limit for keys on server to trigger generation/upload of a new batch of OPks
 	constexpr uint16_t OPk_serverLowLimit = 100;
+	/// in predictive OPk update mode, the X3DH server is queried for our OPks at least once every this number of updates
+	constexpr unsigned int OPk_predictiveResyncUpdates = 10;
+	/// in predictive OPk update mode, maximum size of a batch grown to match the OPks consumption
+	constexpr uint16_t OPk_predictiveMaxBatchSize = 200;
 	/// in days, How long shall we keep an OPk in localStorage once we've noticed X3DH server dispatched it
 	constexpr unsigned int OPk_limboTime_days=SPK_lifeTime_days+SPK_limboTime_days;
+	/// when generating at least this number of OPks, the key pairs are generated by several threads
+	constexpr uint16_t OPk_parallelGenerationThreshold = 64;
+	/// maximum number of threads used to generate OPks key pairs
+	constexpr unsigned int OPk_generationMaxThreads = 4;
+	/// maximum number of OPks stored in local storage in one transaction, the database mutex is released between them
+	constexpr size_t OPk_storageBatchSize = 32;
+	/// in seconds, how long a prefetched peer key bundle is kept in memory waiting to be used
+	constexpr unsigned int peerBundle_cacheLifeTime_seconds = 3600;
+	/// when a thread pool is available, initiate the sessions from the key bundles in parallel only if there are at least this number of bundles
+	constexpr size_t X3DH_parallelInit_minBundles = 4;
+	/// maximum number of requests grouped in one X3DH batch message, a batch reaching it is sent without waiting for its release
+	constexpr size_t X3DH_batchMaxRequests = 64;
+
+/******************************************************************************/
+/*                                                                            */
+/* Crypto primitives related definitions                                      */
+/*                                                                            */
+/******************************************************************************/
+	/// maximum number of unused key exchange or signature contexts kept for reuse by each thread, for each curve
+	constexpr size_t cryptoContextPool_maxSize = 8;
+	/// number of uses of a thread RNG context after which it is replaced by a newly seeded one
+	constexpr size_t threadRNG_reseedInterval = 4096;
 
 } // namespace settings
 
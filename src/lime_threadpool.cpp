@@ -0,0 +1,209 @@
+/*
+	lime_threadpool.cpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lime_threadpool.hpp"
+#include "lime_log.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace lime {
+	/**
+	 * @brief Start the worker threads
+	 *
+	 * @param[in]	threadsCount	number of worker threads
+	 */
+	ThreadPool::ThreadPool(const size_t threadsCount) : m_workers{}, m_jobs{}, m_mutex{}, m_cv{}, m_stop{false} {
+		m_workers.reserve(threadsCount);
+		for (size_t i=0; i<threadsCount; i++) {
+			m_workers.emplace_back(&ThreadPool::worker, this);
+		}
+	}
+
+	/**
+	 * @brief Stop the worker threads once the pending jobs are done
+	 */
+	ThreadPool::~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		for (auto &worker : m_workers) {
+			worker.join();
+		}
+	}
+
+	void ThreadPool::worker() {
+		while (true) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cv.wait(lock, [this]{return m_stop || !m_jobs.empty();});
+				if (m_jobs.empty()) { // stopping and nothing left to do
+					return;
+				}
+				job = std::move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+			job();
+		}
+	}
+
+	/**
+	 * @brief Queue a job, it is run by the first available worker
+	 *
+	 * @param[in]	job	the function to run, it shall not throw
+	 */
+	void ThreadPool::post(std::function<void()> job) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_jobs.push_back(std::move(job));
+		}
+		m_cv.notify_one();
+	}
+
+	/**
+	 * @brief Run task(i) for every i in [0, count) and return when they are all done
+	 *
+	 * The calling thread takes its part of the work so the tasks are completed even if all the workers are busy.
+	 * If any task throws an exception, the remaining ones are still run and the first exception is rethrown to the caller.
+	 *
+	 * @param[in]	count	number of tasks
+	 * @param[in]	task	the function to run, given the task index
+	 */
+	void ThreadPool::parallel_for(const size_t count, const std::function<void(const size_t)> &task) {
+		struct sharedState {
+			std::atomic<size_t> next{0}; // index of the next task to run
+			std::mutex mutex; // protect pendingHelpers and error
+			std::condition_variable cv; // signal the caller when a helper is done
+			size_t pendingHelpers{0};
+			std::exception_ptr error{nullptr};
+		};
+		auto state = std::make_shared<sharedState>();
+
+		// run tasks until every one is taken
+		auto runTasks = [state, count, &task]() {
+			for (size_t i = state->next++; i < count; i = state->next++) {
+				try {
+					task(i);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(state->mutex);
+					if (!state->error) state->error = std::current_exception();
+				}
+			}
+		};
+
+		// no need for more helpers than there are tasks left once the caller takes one
+		size_t helpers = (count>0)?std::min(m_workers.size(), count-1):0;
+		if (helpers > 0) {
+			state->pendingHelpers = helpers;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				for (size_t i=0; i<helpers; i++) {
+					m_jobs.emplace_back([state, runTasks]() {
+						runTasks();
+						std::lock_guard<std::mutex> lock(state->mutex);
+						if (--state->pendingHelpers == 0) {
+							state->cv.notify_one();
+						}
+					});
+				}
+			}
+			m_cv.notify_all();
+		}
+
+		runTasks();
+
+		// task is owned by the caller, wait for every helper to be done before returning
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->cv.wait(lock, [state]{return state->pendingHelpers == 0;});
+		if (state->error) {
+			std::rethrow_exception(state->error);
+		}
+	}
+
+	/**
+	 * @param[in]	executor	run the dispatched jobs
+	 */
+	SerialDispatcher::SerialDispatcher(const limeExecutor &executor) : m_executor{executor}, m_mutex{}, m_cv{}, m_queues{} {}
+
+	/**
+	 * @brief Wait for all the dispatched jobs to be done
+	 */
+	SerialDispatcher::~SerialDispatcher() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cv.wait(lock, [this]{return m_queues.empty();});
+	}
+
+	/**
+	 * @brief Replace the executor, it is used for the queues started after this call
+	 */
+	void SerialDispatcher::set_executor(const limeExecutor &executor) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_executor = executor;
+	}
+
+	/**
+	 * @brief Queue a job, it runs once all the jobs previously dispatched with the same key are done
+	 *
+	 * @param[in]	key	jobs with the same key are run sequentially
+	 * @param[in]	job	the function to run
+	 */
+	void SerialDispatcher::dispatch(const std::string &key, std::function<void()> job) {
+		limeExecutor executor{nullptr};
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto &queue = m_queues[key];
+			queue.push_back(std::move(job));
+			if (queue.size() > 1) { // a job is already running for this key, it will run this one when it is done
+				return;
+			}
+			executor = m_executor;
+		}
+		executor([this, key]() {
+			run(key);
+		});
+	}
+
+	void SerialDispatcher::run(const std::string &key) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true) {
+			auto queue = m_queues.find(key);
+			auto job = queue->second.front(); // the job stays in queue while running so the ones dispatched meanwhile wait for it
+			lock.unlock();
+			try {
+				job();
+			} catch (std::exception const &e) {
+				LIME_LOGE<<"Asynchronous job raised an exception: "<<e.what();
+			} catch (...) {
+				LIME_LOGE<<"Asynchronous job raised an unknown exception";
+			}
+			lock.lock();
+			queue = m_queues.find(key); // the map may have been modified while the lock was released
+			queue->second.pop_front();
+			if (queue->second.empty()) {
+				m_queues.erase(queue);
+				m_cv.notify_all();
+				return;
+			}
+		}
+	}
+}
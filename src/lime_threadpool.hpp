@@ -0,0 +1,89 @@
+/*
+	lime_threadpool.hpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef lime_threadpool_hpp
+#define lime_threadpool_hpp
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+#include "lime/lime.hpp"
+
+namespace lime {
+
+	/**
+	 * @brief A bounded pool of worker threads
+	 *
+	 * Used to spread independent computations (ie: per recipient encryption) over several cores.
+	 * The pool is shared by all the users of a LimeManager, any number of callers can use it concurrently.
+	 */
+	class ThreadPool {
+		private:
+			std::vector<std::thread> m_workers; // the worker threads
+			std::deque<std::function<void()>> m_jobs; // jobs waiting for a worker
+			std::mutex m_mutex; // protect the job queue
+			std::condition_variable m_cv; // signal workers a job is available or the pool is stopping
+			bool m_stop; // set when the pool is being destroyed
+			void worker(); // worker thread main loop
+
+		public:
+			ThreadPool() = delete;
+			explicit ThreadPool(const size_t threadsCount);
+			ThreadPool(const ThreadPool &) = delete; // threads are not copyable
+			ThreadPool &operator=(const ThreadPool &) = delete;
+			~ThreadPool();
+
+			/// return the number of worker threads
+			size_t size() const {return m_workers.size();};
+
+			void parallel_for(const size_t count, const std::function<void(const size_t)> &task);
+			void post(std::function<void()> job);
+	};
+
+	/**
+	 * @brief Run jobs through an executor, the jobs given the same key run one after the other, in the order they were dispatched
+	 *
+	 * Used to run asynchronous decryptions in parallel while the messages from one sender are processed in order.
+	 */
+	class SerialDispatcher {
+		private:
+			limeExecutor m_executor; // run the jobs
+			std::mutex m_mutex; // protect the queues and the executor
+			std::condition_variable m_cv; // signal the destructor a queue is done
+			std::unordered_map<std::string, std::deque<std::function<void()>>> m_queues; // jobs by key, the front one is running or about to
+			void run(const std::string &key); // run the jobs of a queue until it is empty
+
+		public:
+			SerialDispatcher() = delete;
+			explicit SerialDispatcher(const limeExecutor &executor);
+			SerialDispatcher(const SerialDispatcher &) = delete;
+			SerialDispatcher &operator=(const SerialDispatcher &) = delete;
+			~SerialDispatcher();
+
+			void set_executor(const limeExecutor &executor);
+			void dispatch(const std::string &key, std::function<void()> job);
+	};
+}
+
+#endif //lime_threadpool_hpp
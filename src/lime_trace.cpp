@@ -0,0 +1,71 @@
+/*
+	lime_trace.cpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lime_trace.hpp"
+#include "lime_log.hpp"
+#include <chrono>
+
+namespace lime {
+	namespace {
+		// the innermost scoped span running in this thread, 0 if none
+		thread_local uint64_t threadCurrentSpanId = 0;
+
+		uint64_t now_ns() {
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		void emit(const limeTraceCallback &callback, const TraceEvent &event) noexcept {
+			try {
+				callback(event);
+			} catch (std::exception const &e) { // a tracing failure shall not break the traced operation
+				LIME_LOGE<<"Trace callback failed on "<<event.name<<": "<<e.what();
+			} catch (...) {
+				LIME_LOGE<<"Trace callback failed on "<<event.name;
+			}
+		}
+	}
+
+	void Tracer::set_callback(const limeTraceCallback &callback) {
+		std::atomic_store(&m_callback, callback?std::make_shared<const limeTraceCallback>(callback):std::shared_ptr<const limeTraceCallback>{});
+	}
+
+	TraceSpan::TraceSpan(Tracer *tracer, const char *name, const uint64_t parentId, const bool scoped)
+		: m_callback{(tracer!=nullptr)?tracer->callback():nullptr}, m_name{name}, m_id{0}, m_parentId{parentId}, m_previousCurrentId{threadCurrentSpanId}, m_scoped{scoped}, m_attributes{} {
+		if (m_callback == nullptr) return;
+		m_id = tracer->newSpanId();
+		if (m_scoped) threadCurrentSpanId = m_id;
+		emit(*m_callback, TraceEvent{lime::TraceEventType::spanBegin, m_name, m_id, m_parentId, now_ns(), {}});
+	}
+
+	TraceSpan::TraceSpan(Tracer *tracer, const char *name, const bool scoped) : TraceSpan(tracer, name, threadCurrentSpanId, scoped) {}
+
+	TraceSpan::TraceSpan(Tracer *tracer, const char *name, const uint64_t parentId) : TraceSpan(tracer, name, parentId, true) {}
+
+	TraceSpan::~TraceSpan() {
+		end();
+	}
+
+	void TraceSpan::end() noexcept {
+		if (m_callback == nullptr) return;
+		auto callback = std::move(m_callback);
+		m_callback = nullptr; // emit only once
+		if (m_scoped) threadCurrentSpanId = m_previousCurrentId;
+		emit(*callback, TraceEvent{lime::TraceEventType::spanEnd, m_name, m_id, m_parentId, now_ns(), std::move(m_attributes)});
+	}
+} // namespace lime
@@ -0,0 +1,91 @@
+/*
+	lime_trace.hpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef lime_trace_hpp
+#define lime_trace_hpp
+
+#include "lime/lime.hpp"
+#include <atomic>
+
+namespace lime {
+	/**
+	 * @brief Emit the tracing spans of a LimeManager
+	 *
+	 * Owned by the manager and referenced by its local storage connections so the operations reach it through their Db.
+	 * The callback can be changed at any time: spans already started end on the callback they started with.
+	 */
+	class Tracer {
+		private:
+			std::shared_ptr<const limeTraceCallback> m_callback; // accessed with atomic_load/store only, nullptr when not tracing
+			std::atomic<uint64_t> m_nextSpanId;
+
+		public:
+			Tracer() : m_callback{nullptr}, m_nextSpanId{1} {};
+			Tracer(const Tracer &) = delete;
+			Tracer &operator=(const Tracer &) = delete;
+
+			void set_callback(const limeTraceCallback &callback);
+			std::shared_ptr<const limeTraceCallback> callback() const noexcept {return std::atomic_load(&m_callback);};
+			uint64_t newSpanId() noexcept {return m_nextSpanId.fetch_add(1, std::memory_order_relaxed);};
+	};
+
+	/**
+	 * @brief A traced operation, from construction to end() or destruction
+	 *
+	 * A scoped span is the parent of the spans started in the same thread until it ends, so scoped spans must end in the thread
+	 * and in the reverse order they started: keep them on the stack.
+	 * Does nothing when the tracer is nullptr or has no callback, check it before computing the attributes
+	 */
+	class TraceSpan {
+		private:
+			std::shared_ptr<const limeTraceCallback> m_callback; // nullptr when not tracing or ended
+			const char *m_name;
+			uint64_t m_id;
+			uint64_t m_parentId;
+			uint64_t m_previousCurrentId; // the thread current span when a scoped span started
+			bool m_scoped;
+			std::vector<TraceAttribute> m_attributes;
+			TraceSpan(Tracer *tracer, const char *name, const uint64_t parentId, const bool scoped);
+
+		public:
+			/**
+			 * @param[in]	tracer		where to emit the events, may be nullptr
+			 * @param[in]	name		span name, a static string
+			 * @param[in]	scoped		when false, this span is not the parent of the next ones and may end in any thread
+			 */
+			TraceSpan(Tracer *tracer, const char *name, const bool scoped=true);
+			/**
+			 * @brief start a scoped span with an explicit parent, used when the parent ran in another thread
+			 */
+			TraceSpan(Tracer *tracer, const char *name, const uint64_t parentId);
+			~TraceSpan();
+			TraceSpan(const TraceSpan &) = delete;
+			TraceSpan &operator=(const TraceSpan &) = delete;
+
+			/// @return true when the span is traced
+			explicit operator bool() const noexcept {return m_callback != nullptr;};
+			/// @return the span Id, 0 when not traced
+			uint64_t id() const noexcept {return m_id;};
+			void add(const char *key, const int64_t value) {if (m_callback) m_attributes.emplace_back(key, value);};
+			void add(const char *key, const std::string &value) {if (m_callback) m_attributes.emplace_back(key, value);};
+			/// @brief emit the end event now instead of at destruction
+			void end() noexcept;
+	};
+} // namespace lime
+
+#endif /* lime_trace_hpp */
@@ -23,113 +23,276 @@
 #include "lime_double_ratchet_protocol.hpp"
 #include "bctoolbox/exception.hh"
 #include "lime_crypto_primitives.hpp"
+#include "lime_threadpool.hpp"
+#include "lime_trace.hpp"
+#include "lime_metrics.hpp"
+#include "lime_keyPairPool.hpp"
 
 using namespace::std;
 using namespace::lime;
 
 namespace lime {
+	/**
+	 * @brief Verify the peer bundle SPk signature, throw an exception if it fails
+	 */
+	template <typename Curve>
+	static void X3DH_verify_peerBundle(const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, const X<Curve, lime::Xtype::publicKey> &peerSPk, const DSA<Curve, lime::DSAtype::signature> &peerSPk_sig) {
+		if (!DSA_verify<Curve>(peerIk, peerSPk, peerSPk_sig)) {
+			LIME_LOGE<<"X3DH: SPk signature verification failed for device "<<peerDeviceId;
+			throw BCTBX_EXCEPTION << "Verify signature on SPk failed for deviceId "<<peerDeviceId;
+		}
+	}
+
+	/**
+	 * @brief Get the prefetched peer bundles from a server response, verify and store them in cache until an encryption needs them
+	 *  invalid bundles are discarded
+	 */
+	template <typename Curve>
+	void Lime<Curve>::X3DH_cache_peerBundles(const X3DH_peerBundles<Curve> &peersBundle) {
+		auto expiry = std::chrono::steady_clock::now() + std::chrono::seconds(lime::settings::peerBundle_cacheLifeTime_seconds);
+		for (const auto &peerBundleView : peersBundle) {
+			if (peerBundleView.bundleFlag() == lime::X3DHKeyBundleFlag::noBundle) {
+				continue;
+			}
+			// the cache outlives the server response: copy the bundle out of it
+			X3DH_peerBundle<Curve> peerBundle{peerBundleView};
+			try {
+				X3DH_verify_peerBundle(peerBundle.deviceId, peerBundle.Ik, peerBundle.SPk, peerBundle.SPk_sig);
+			} catch (BctbxException const &) { // already logged, just ignore this bundle
+				continue;
+			}
+			m_peerBundles_cache.erase(peerBundle.deviceId);
+			m_peerBundles_cache.emplace(peerBundle.deviceId, cachedPeerBundle{peerBundle, expiry});
+		}
+	}
+
+	/**
+	 * @brief The secrets computed by the sender from a peer key bundle, as decribed in X3DH reference section 3.3
+	 */
+	template <typename Curve>
+	struct X3DH_senderSecrets {
+		DRChainKey SK; // the shared secret, seeds the DR session
+		SharedADBuffer AD; // the DR session shared associated data
+		std::vector<uint8_t> X3DH_initMessage; // the X3DH init packet, sent along the first messages of the session
+
+		X3DH_senderSecrets() : SK{}, AD{}, X3DH_initMessage{} {};
+	};
+
+	/**
+	 * @brief Compute the sender secrets from a verified peer key bundle
+	 *
+	 * It is pure computation, no local storage or Lime object access: it can run on any thread given its own RNG
+	 *
+	 * @param[in]	selfIk		self identity key pair
+	 * @param[in]	selfDeviceId	self device id
+	 * @param[in]	peerDeviceId	the peer device Id
+	 * @param[in]	peerIk		peer public identity key
+	 * @param[in]	peerSPk		peer public signed pre-key, its signature was verified
+	 * @param[in]	peerSPk_id	peer signed pre-key id
+	 * @param[in]	peerOPk		peer one time pre-key, nullptr if the bundle has none
+	 * @param[in]	peerOPk_id	peer one time pre-key id, ignored if there is no OPk
+	 * @param[in]	RNG_context	random source used to generate the ephemeral key when the key pair pool is empty
+	 * @param[in]	keyPairPool	the ephemeral key is drawn from it
+	 * @param[out]	secrets		the computed secrets and X3DH init message
+	 */
+	template <typename Curve>
+	static void X3DH_compute_senderSecrets(const DSApair<Curve> &selfIk, const std::string &selfDeviceId, const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, const X<Curve, lime::Xtype::publicKey> &peerSPk, const uint32_t peerSPk_id, const X<Curve, lime::Xtype::publicKey> *peerOPk, const uint32_t peerOPk_id, std::shared_ptr<RNG> RNG_context, KeyPairPool<Curve> &keyPairPool, X3DH_senderSecrets<Curve> &secrets) {
+		// Initiate HKDF input : We will compute HKDF with a concat of F and all DH computed, see X3DH spec section 2.2 for what is F
+		// use sBuffer of size able to hold also DH$ even if we may not use it
+		sBuffer<DSA<Curve, lime::DSAtype::publicKey>::ssize() + X<Curve, lime::Xtype::sharedSecret>::ssize()*4> HKDF_input;
+		HKDF_input.fill(0xFF); // HKDF_input holds F
+		size_t HKDF_input_index = DSA<Curve, lime::DSAtype::publicKey>::ssize(); // F is of DSA public key size
+
+		// Compute DH1 = DH(self Ik, peer SPk)
+		X<Curve, lime::Xtype::sharedSecret> DH_out;
+		{
+			X<Curve, lime::Xtype::privateKey> selfIkX;
+			X_fromDSA<Curve>(selfIk.privateKey(), selfIkX); // Ik Signature key is converted to keyExchange format
+			X_computeSharedSecret<Curve>(selfIkX, peerSPk, DH_out);
+		}
+		std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1
+		HKDF_input_index += DH_out.size();
+
+		// Generate Ephemeral key Exchange key pair: Ek
+		Xpair<Curve> Ek;
+		keyPairPool.draw(Ek, *RNG_context);
+
+		// Compute DH3 = DH(Ek, peer SPk)
+		X_computeSharedSecret<Curve>(Ek.privateKey(), peerSPk, DH_out);
+		std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index + DH_out.size()); // HKDF_input holds F || DH1 || empty slot || DH3
+
+		// Compute DH2 = DH(Ek, peer Ik)
+		{
+			X<Curve, lime::Xtype::publicKey> peerIkX;
+			X_fromDSA<Curve>(peerIk, peerIkX); // peer Ik Signature key is converted to keyExchange format
+			X_computeSharedSecret<Curve>(Ek.privateKey(), peerIkX, DH_out);
+		}
+		std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1 || DH2 || DH3
+		HKDF_input_index += 2*DH_out.size();
+
+		// Compute DH4 = DH(Ek, peer OPk) (if any OPk in bundle)
+		if (peerOPk != nullptr) {
+			X_computeSharedSecret<Curve>(Ek.privateKey(), *peerOPk, DH_out);
+			std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1 || DH2 || DH3 || DH4
+			HKDF_input_index += DH_out.size();
+		}
+
+		// Compute SK = HKDF(F || DH1 || DH2 || DH3 || DH4)
+		/* as specified in X3DH spec section 2.2, use a as salt a 0 filled buffer long as the hash function output */
+		std::vector<uint8_t> salt(SHA512::ssize(), 0);
+		HMAC_KDF<SHA512>(salt.data(), salt.size(), HKDF_input.data(), HKDF_input_index, lime::settings::X3DH_SK_info, secrets.SK.data(), secrets.SK.size());
+
+		// Generate X3DH init message: as in X3DH spec section 3.3:
+		secrets.X3DH_initMessage.clear();
+		double_ratchet_protocol::buildMessage_X3DHinit(secrets.X3DH_initMessage, selfIk.publicKey(), Ek.publicKey(), peerSPk_id, peerOPk_id, (peerOPk != nullptr));
+
+		// Generate the shared AD used in DR session
+		// AD is HKDF(session Initiator Ik || session receiver Ik || session Initiator device Id || session receiver device Id)
+		std::vector<uint8_t>AD_input{selfIk.publicKey().cbegin(), selfIk.publicKey().cend()};
+		AD_input.insert(AD_input.end(), peerIk.cbegin(), peerIk.cend());
+		AD_input.insert(AD_input.end(), selfDeviceId.cbegin(), selfDeviceId.cend());
+		AD_input.insert(AD_input.end(), peerDeviceId.cbegin(), peerDeviceId.cend());
+		HMAC_KDF<SHA512>(salt, AD_input, lime::settings::X3DH_AD_info, secrets.AD.data(), secrets.AD.size()); // use the same salt as for SK computation but a different info string
+	}
+
 	/**
 	 * @brief Get a vector of peer bundle and initiate a DR Session with it. Created sessions are stored in lime cache and db along the X3DH init packet
 	 *  as decribed in X3DH reference section 3.3
+	 *
+	 *  When a thread pool is set and there are enough bundles, the signatures verifications and secrets computations are spread over the pool,
+	 *  the peer devices checks in local storage and the sessions creations are then performed in one batch by the calling thread.
 	 */
 	template <typename Curve>
 	void Lime<Curve>::X3DH_init_sender_session(const std::vector<X3DH_peerBundle<Curve>> &peersBundle) {
-		for (const auto &peerBundle : peersBundle) {
-			// do we have a key bundle to build this message from ?
+		TraceSpan span(m_localStorage->m_tracer.get(), "lime.X3DH_init_sender_session");
+		span.add("bundles", static_cast<int64_t>(peersBundle.size()));
+		get_SelfIdentityKey(); // make sure it is in context
+
+		if (m_threadPool == nullptr || m_threadPool->size() == 0 || peersBundle.size() < lime::settings::X3DH_parallelInit_minBundles) {
+			X3DH_senderSecrets<Curve> secrets{};
+			for (const auto &peerBundle : peersBundle) {
+				// do we have a key bundle to build this message from ?
+				if (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::noBundle) {
+					continue;
+				}
+				// Verifify SPk_signature, throw an exception if it fails
+				X3DH_verify_peerBundle(peerBundle.deviceId, peerBundle.Ik, peerBundle.SPk, peerBundle.SPk_sig);
+
+				// before going on, check if peer informations are ok, if the returned Id is 0, it means this peer was not in storage yet
+				// throw an exception in case of failure, just let it flow up
+				auto peerDid = m_localStorage->check_peerDevice(peerBundle.deviceId, peerBundle.Ik);
+
+				const bool haveOPk = (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::OPk);
+				X3DH_compute_senderSecrets(m_Ik, m_selfDeviceId, peerBundle.deviceId, peerBundle.Ik, peerBundle.SPk, peerBundle.SPk_id, haveOPk?&(peerBundle.OPk):nullptr, peerBundle.OPk_id, m_RNG, m_localStorage->m_keyPairPools->get<Curve>(), secrets);
+				X3DH_create_sender_session(peerBundle.deviceId, peerBundle.Ik, peerBundle.SPk, peerDid, haveOPk, secrets);
+			}
+			return;
+		}
+
+		// verify the signatures and compute the secrets in parallel, if any verification fails the exception is rethrown here and no session is created
+		std::vector<X3DH_senderSecrets<Curve>> secrets(peersBundle.size());
+		const auto &selfIk = m_Ik;
+		const auto &selfDeviceId = m_selfDeviceId;
+		auto &keyPairPool = m_localStorage->m_keyPairPools->get<Curve>();
+		m_threadPool->parallel_for(peersBundle.size(), [&peersBundle, &secrets, &selfIk, &selfDeviceId, &keyPairPool](const size_t i) {
+			const auto &peerBundle = peersBundle[i];
+			if (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::noBundle) {
+				return;
+			}
+			X3DH_verify_peerBundle(peerBundle.deviceId, peerBundle.Ik, peerBundle.SPk, peerBundle.SPk_sig);
+			const bool haveOPk = (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::OPk);
+			X3DH_compute_senderSecrets(selfIk, selfDeviceId, peerBundle.deviceId, peerBundle.Ik, peerBundle.SPk, peerBundle.SPk_id, haveOPk?&(peerBundle.OPk):nullptr, peerBundle.OPk_id, shared_RNG(), keyPairPool, secrets[i]);
+		});
+
+		// then check the peer devices and create the sessions in one batch
+		MetricsLockGuard<std::recursive_mutex> lock(*(m_localStorage->m_db_mutex), m_localStorage->m_metrics.get(), lime::MetricsCounter::DBMutexWait);
+		for (size_t i=0; i<peersBundle.size(); i++) {
+			const auto &peerBundle = peersBundle[i];
 			if (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::noBundle) {
 				continue;
 			}
-			// Verifify SPk_signature, throw an exception if it fails
-			auto SPkVerify = make_Signature<Curve>();
-			SPkVerify->set_public(peerBundle.Ik);
+			auto peerDid = m_localStorage->check_peerDevice(peerBundle.deviceId, peerBundle.Ik);
+			X3DH_create_sender_session(peerBundle.deviceId, peerBundle.Ik, peerBundle.SPk, peerDid, (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::OPk), secrets[i]);
+		}
+	}
 
-			if (!SPkVerify->verify(peerBundle.SPk, peerBundle.SPk_sig)) {
-				LIME_LOGE<<"X3DH: SPk signature verification failed for device "<<peerBundle.deviceId;
-				throw BCTBX_EXCEPTION << "Verify signature on SPk failed for deviceId "<<peerBundle.deviceId;
+	/**
+	 * @overload
+	 * Get the peer bundles directly from the server response, keys are read from it without building an intermediate bundles vector
+	 * unless they are processed in parallel
+	 */
+	template <typename Curve>
+	void Lime<Curve>::X3DH_init_sender_session(const X3DH_peerBundles<Curve> &peersBundle) {
+		if (m_threadPool != nullptr && m_threadPool->size() > 0 && peersBundle.size() >= lime::settings::X3DH_parallelInit_minBundles) {
+			std::vector<X3DH_peerBundle<Curve>> bundles{};
+			bundles.reserve(peersBundle.size());
+			for (const auto &peerBundle : peersBundle) {
+				if (peerBundle.bundleFlag() != lime::X3DHKeyBundleFlag::noBundle) {
+					bundles.emplace_back(peerBundle);
+				}
 			}
+			X3DH_init_sender_session(bundles);
+			return;
+		}
+
+		TraceSpan span(m_localStorage->m_tracer.get(), "lime.X3DH_init_sender_session");
+		span.add("bundles", static_cast<int64_t>(peersBundle.size()));
+		get_SelfIdentityKey(); // make sure it is in context
+		X3DH_senderSecrets<Curve> secrets{};
+		for (const auto &peerBundle : peersBundle) {
+			// do we have a key bundle to build this message from ?
+			if (peerBundle.bundleFlag() == lime::X3DHKeyBundleFlag::noBundle) {
+				continue;
+			}
+			const auto peerDeviceId = peerBundle.deviceId();
+			const DSA<Curve, lime::DSAtype::publicKey> peerIk{peerBundle.Ik()};
+			const X<Curve, lime::Xtype::publicKey> peerSPk{peerBundle.SPk()};
+
+			// Verifify SPk_signature, throw an exception if it fails
+			X3DH_verify_peerBundle(peerDeviceId, peerIk, peerSPk, DSA<Curve, lime::DSAtype::signature>{peerBundle.SPk_sig()});
 
 			// before going on, check if peer informations are ok, if the returned Id is 0, it means this peer was not in storage yet
 			// throw an exception in case of failure, just let it flow up
-			auto peerDid = m_localStorage->check_peerDevice(peerBundle.deviceId, peerBundle.Ik);
-
-			// Initiate HKDF input : We will compute HKDF with a concat of F and all DH computed, see X3DH spec section 2.2 for what is F
-			// use sBuffer of size able to hold also DH$ even if we may not use it
-			sBuffer<DSA<Curve, lime::DSAtype::publicKey>::ssize() + X<Curve, lime::Xtype::sharedSecret>::ssize()*4> HKDF_input;
-			HKDF_input.fill(0xFF); // HKDF_input holds F
-			size_t HKDF_input_index = DSA<Curve, lime::DSAtype::publicKey>::ssize(); // F is of DSA public key size
-
-			// Compute DH1 = DH(self Ik, peer SPk) - selfIk context already holds selfIk.
-			get_SelfIdentityKey(); // make sure it is in context
-			auto DH = make_keyExchange<Curve>();
-			DH->set_secret(m_Ik.privateKey()); // Ik Signature key is converted to keyExchange format
-			DH->set_selfPublic(m_Ik.publicKey());
-			DH->set_peerPublic(peerBundle.SPk);
-			DH->computeSharedSecret();
-			auto DH_out = DH->get_sharedSecret();
-			std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1
-			HKDF_input_index += DH_out.size();
+			auto peerDid = m_localStorage->check_peerDevice(peerDeviceId, peerIk);
 
-			// Generate Ephemeral key Exchange key pair: Ek, from now DH will hold Ek as private and self public key
-			DH->createKeyPair(m_RNG);
-
-			// Compute DH3 = DH(Ek, peer SPk) - peer SPk was already set as peer Public
-			DH->computeSharedSecret();
-			DH_out = DH->get_sharedSecret();
-			std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index + DH_out.size()); // HKDF_input holds F || DH1 || empty slot || DH3
-
-			// Compute DH2 = DH(Ek, peer Ik)
-			DH->set_peerPublic(peerBundle.Ik); // peer Ik Signature key is converted to keyExchange format
-			DH->computeSharedSecret();
-			DH_out = DH->get_sharedSecret();
-			std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1 || DH2 || DH3
-			HKDF_input_index += 2*DH_out.size();
-
-			// Compute DH4 = DH(Ek, peer OPk) (if any OPk in bundle)
-			if (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::OPk) {
-				DH->set_peerPublic(peerBundle.OPk);
-				DH->computeSharedSecret();
-				DH_out = DH->get_sharedSecret();
-				std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1 || DH2 || DH3 || DH4
-				HKDF_input_index += DH_out.size();
+			if (peerBundle.bundleFlag() == lime::X3DHKeyBundleFlag::OPk) {
+				const X<Curve, lime::Xtype::publicKey> peerOPk{peerBundle.OPk()};
+				X3DH_compute_senderSecrets(m_Ik, m_selfDeviceId, peerDeviceId, peerIk, peerSPk, peerBundle.SPk_id(), &peerOPk, peerBundle.OPk_id(), m_RNG, m_localStorage->m_keyPairPools->get<Curve>(), secrets);
+			} else {
+				X3DH_compute_senderSecrets(m_Ik, m_selfDeviceId, peerDeviceId, peerIk, peerSPk, peerBundle.SPk_id(), nullptr, 0, m_RNG, m_localStorage->m_keyPairPools->get<Curve>(), secrets);
 			}
+			X3DH_create_sender_session(peerDeviceId, peerIk, peerSPk, peerDid, (peerBundle.bundleFlag() == lime::X3DHKeyBundleFlag::OPk), secrets);
+		}
+	}
 
-			// Compute SK = HKDF(F || DH1 || DH2 || DH3 || DH4)
-			DRChainKey SK;
-			/* as specified in X3DH spec section 2.2, use a as salt a 0 filled buffer long as the hash function output */
-			std::vector<uint8_t> salt(SHA512::ssize(), 0);
-			HMAC_KDF<SHA512>(salt.data(), salt.size(), HKDF_input.data(), HKDF_input_index, lime::settings::X3DH_SK_info, SK.data(), SK.size());
-
-			// Generate X3DH init message: as in X3DH spec section 3.3:
-			std::vector<uint8_t> X3DH_initMessage{};
-			double_ratchet_protocol::buildMessage_X3DHinit(X3DH_initMessage, m_Ik.publicKey(), DH->get_selfPublic(), peerBundle.SPk_id, peerBundle.OPk_id, (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::OPk));
-
-			DH = nullptr; // be sure to destroy and clean the keyExchange object as soon as we do not need it anymore
-
-			// Generate the shared AD used in DR session
-			SharedADBuffer AD; // AD is HKDF(session Initiator Ik || session receiver Ik || session Initiator device Id || session receiver device Id)
-			std::vector<uint8_t>AD_input{m_Ik.publicKey().cbegin(), m_Ik.publicKey().cend()};
-			AD_input.insert(AD_input.end(), peerBundle.Ik.cbegin(), peerBundle.Ik.cend());
-			AD_input.insert(AD_input.end(), m_selfDeviceId.cbegin(), m_selfDeviceId.cend());
-			AD_input.insert(AD_input.end(), peerBundle.deviceId.cbegin(), peerBundle.deviceId.cend());
-			HMAC_KDF<SHA512>(salt, AD_input, lime::settings::X3DH_AD_info, AD.data(), AD.size()); // use the same salt as for SK computation but a different info string
-
-			// Generate DR_Session and put it in cache(but not in localStorage yet, that would be done when first message generation will be complete)
-			// it could happend that we eventually already have a session for this peer device if we received an initial message from it while fetching its key bundle(very unlikely but...)
-			// in that case just keep on building our new session so the peer device knows it must get rid of the OPk, sessions will eventually converge into only one when messages
-			// stop crossing themselves on the network.
-			// If the fetch bundle doesn't hold OPk, just ignore our newly built session, and use existing one
-			if (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::OPk) {
-				m_DR_sessions_cache.erase(peerBundle.deviceId); // will just do nothing if this peerDeviceId is not in cache
-			}
+	/**
+	 * @brief Create a DR Session from the secrets computed with a peer key bundle and put it in cache
+	 *
+	 * @param[in]	peerDeviceId	the peer device Id
+	 * @param[in]	peerIk		peer public identity key
+	 * @param[in]	peerSPk		peer public signed pre-key
+	 * @param[in]	peerDid		peer device id in local storage, 0 if it is not there yet
+	 * @param[in]	haveOPk		true if the peer bundle held an OPk
+	 * @param[in]	secrets		the secrets computed from this bundle
+	 */
+	template <typename Curve>
+	void Lime<Curve>::X3DH_create_sender_session(const std::string &peerDeviceId, const DSA<Curve, lime::DSAtype::publicKey> &peerIk, const X<Curve, lime::Xtype::publicKey> &peerSPk, const long int peerDid, const bool haveOPk, const X3DH_senderSecrets<Curve> &secrets) {
+		// Generate DR_Session and put it in cache(but not in localStorage yet, that would be done when first message generation will be complete)
+		// it could happend that we eventually already have a session for this peer device if we received an initial message from it while fetching its key bundle(very unlikely but...)
+		// in that case just keep on building our new session so the peer device knows it must get rid of the OPk, sessions will eventually converge into only one when messages
+		// stop crossing themselves on the network.
+		// If the fetch bundle doesn't hold OPk, just ignore our newly built session, and use existing one
+		if (haveOPk) {
+			m_DR_sessions_cache.erase(peerDeviceId); // will just do nothing if this peerDeviceId is not in cache
+		}
 
-			m_DR_sessions_cache.emplace(peerBundle.deviceId, make_shared<DR<Curve>>(m_localStorage, SK, AD, peerBundle.SPk, peerDid, peerBundle.deviceId, peerBundle.Ik, m_db_Uid, X3DH_initMessage, m_RNG)); // will just do nothing if this peerDeviceId is already in cache
+		m_DR_sessions_cache.emplace(peerDeviceId, make_shared<DR<Curve>>(m_localStorage, secrets.SK, secrets.AD, peerSPk, peerDid, peerDeviceId, peerIk, m_db_Uid, secrets.X3DH_initMessage, m_RNG)); // will just do nothing if this peerDeviceId is already in cache
 
-			LIME_LOGI<<"X3DH created session with device "<<peerBundle.deviceId;
-		}
+		LIME_LOGI<<"X3DH created session with device "<<peerDeviceId;
 	}
 
 	template <typename Curve>
-	std::shared_ptr<DR<Curve>> Lime<Curve>::X3DH_init_receiver_session(const std::vector<uint8_t> X3DH_initMessage, const std::string &senderDeviceId) {
+	std::shared_ptr<DR<Curve>> Lime<Curve>::X3DH_init_receiver_session(const std::vector<uint8_t> &X3DH_initMessage, const std::string &senderDeviceId) {
 		DSA<Curve, lime::DSAtype::publicKey> peerIk{};
 		X<Curve, lime::Xtype::publicKey> Ek{};
 		bool OPk_flag = false;
@@ -143,6 +306,7 @@ namespace lime {
 		Xpair<Curve> OPk{};
 		if (OPk_flag) { // there is an OPk id
 			X3DH_get_OPk(OPk_id, OPk); // this one will throw an exception if the OPk is not found in local storage, let it flow up
+			m_OPkConsumed++; // the decryption holds m_mutex
 		}
 
 		// Compute 	DH1 = DH(SPk, peer Ik)
@@ -156,45 +320,38 @@ namespace lime {
 		HKDF_input.fill(0xFF); // HKDF_input holds F
 		size_t HKDF_input_index = DSA<Curve, lime::DSAtype::publicKey>::ssize(); // F is of DSA public key size
 
-		auto DH = make_keyExchange<Curve>();
-
 		// DH1 (SPk, peerIk)
-		DH->set_secret(SPk.privateKey());
-		DH->set_selfPublic(SPk.publicKey());
-		DH->set_peerPublic(peerIk); // peer Ik key is converted from Signature to key exchange format
-		DH->computeSharedSecret();
-		auto DH_out = DH->get_sharedSecret();
+		X<Curve, lime::Xtype::sharedSecret> DH_out;
+		{
+			X<Curve, lime::Xtype::publicKey> peerIkX;
+			X_fromDSA<Curve>(peerIk, peerIkX); // peer Ik key is converted from Signature to key exchange format
+			X_computeSharedSecret<Curve>(SPk.privateKey(), peerIkX, DH_out);
+		}
 		std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1
 		HKDF_input_index += DH_out.size();
 
-		// Then DH3 = DH(SPk, Ek) as we already have SPk in the key Exchange context, we will go back for DH2 after this one
-		DH->set_peerPublic(Ek);
-		DH->computeSharedSecret();
-		DH_out = DH->get_sharedSecret();
+		// Then DH3 = DH(SPk, Ek), we will go back for DH2 after this one
+		X_computeSharedSecret<Curve>(SPk.privateKey(), Ek, DH_out);
 		std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index + DH_out.size()); // HKDF_input holds F || DH1 || empty slot || DH3
 
-		// DH2 = DH(self Ik, Ek), Ek is already DH context
+		// DH2 = DH(self Ik, Ek)
 		// convert self ED Ik pair into X keys
 		get_SelfIdentityKey(); // make sure self IK is in context
-		DH->set_secret(m_Ik.privateKey()); // self Ik key is converted from Signature to key exchange format
-		DH->set_selfPublic(m_Ik.publicKey());
-		DH->computeSharedSecret();
-		DH_out = DH->get_sharedSecret();
+		{
+			X<Curve, lime::Xtype::privateKey> selfIkX;
+			X_fromDSA<Curve>(m_Ik.privateKey(), selfIkX); // self Ik key is converted from Signature to key exchange format
+			X_computeSharedSecret<Curve>(selfIkX, Ek, DH_out);
+		}
 		std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1 || DH2 || DH3
 		HKDF_input_index += 2*DH_out.size();
 
 		if (OPk_flag) { // there is an OPk id
-			// DH4 = DH(OPk, Ek) Ek is already in context
-			DH->set_secret(OPk.privateKey());
-			DH->set_selfPublic(OPk.publicKey());
-			DH->computeSharedSecret();
-			DH_out = DH->get_sharedSecret();
+			// DH4 = DH(OPk, Ek)
+			X_computeSharedSecret<Curve>(OPk.privateKey(), Ek, DH_out);
 			std::copy_n(DH_out.cbegin(), DH_out.size(), HKDF_input.begin()+HKDF_input_index); // HKDF_input holds F || DH1 || DH2 || DH3 DH4
 			HKDF_input_index += DH_out.size();
 		}
 
-		DH = nullptr; // be sure to destroy and clean the keyExchange object as soon as we do not need it anymore
-
 		// Compute SK = HKDF(F || DH1 || DH2 || DH3 || DH4) (DH4 optionnal)
 		DRChainKey SK;
 		/* as specified in X3DH spec section 2.2, use a as salt a 0 filled buffer long as the hash function output */
@@ -219,12 +376,16 @@ namespace lime {
 	/* Instanciate templated member functions */
 #ifdef EC25519_ENABLED
 	template void Lime<C255>::X3DH_init_sender_session(const std::vector<X3DH_peerBundle<C255>> &peerBundle);
-	template std::shared_ptr<DR<C255>> Lime<C255>::X3DH_init_receiver_session(const std::vector<uint8_t> X3DH_initMessage, const std::string &peerDeviceId);
+	template void Lime<C255>::X3DH_init_sender_session(const X3DH_peerBundles<C255> &peerBundle);
+	template void Lime<C255>::X3DH_cache_peerBundles(const X3DH_peerBundles<C255> &peerBundle);
+	template std::shared_ptr<DR<C255>> Lime<C255>::X3DH_init_receiver_session(const std::vector<uint8_t> &X3DH_initMessage, const std::string &peerDeviceId);
 #endif
 
 #ifdef EC448_ENABLED
 	template void Lime<C448>::X3DH_init_sender_session(const std::vector<X3DH_peerBundle<C448>> &peerBundle);
-	template std::shared_ptr<DR<C448>> Lime<C448>::X3DH_init_receiver_session(const std::vector<uint8_t> X3DH_initMessage, const std::string &peerDeviceId);
+	template void Lime<C448>::X3DH_init_sender_session(const X3DH_peerBundles<C448> &peerBundle);
+	template void Lime<C448>::X3DH_cache_peerBundles(const X3DH_peerBundles<C448> &peerBundle);
+	template std::shared_ptr<DR<C448>> Lime<C448>::X3DH_init_receiver_session(const std::vector<uint8_t> &X3DH_initMessage, const std::string &peerDeviceId);
 #endif
 
 }
@@ -22,6 +22,8 @@
 #include "lime_x3dh_protocol.hpp"
 #include "lime_settings.hpp"
 #include "lime_impl.hpp"
+#include "lime_metrics.hpp"
+#include "lime_trace.hpp"
 
 #include "bctoolbox/exception.hh"
 
@@ -77,6 +79,13 @@ namespace lime {
 	 *				(OPk id <4 bytes uint32_t big endian>){OPk Count}
 	 *
 	 *		- error :	errorCode<1 byte> || (errorMessage<...>){0,1}
+	 *
+	 *		- batch :	request Count <2 bytes unsigned Big Endian> ||\n
+	 *				(from Size <2 bytes unsigned Big Endian> || from <...> (the local device Id posting this request) ||
+	 *				 message Size <4 bytes unsigned Big Endian> || message <...> (a complete X3DH message, header included)) {request Count}\n
+	 *				The header curve Id is the one of all the requests. The server answers with a batch message holding the responses:\n
+	 *				response Count <2 bytes unsigned Big Endian> || (message Size <4 bytes unsigned Big Endian> || message <...>) {response Count}\n
+	 *				in the requests order. A server responding an error message to a batch processed none of its requests.
 	 */
 	namespace x3dh_protocol {
 
@@ -95,6 +104,7 @@ namespace lime {
 							getSelfOPks=0x07,
 							selfOPks=0x08,
 							registerUser=0x09,
+							batch=0x0a,
 							error=0xff};
 
 		/**
@@ -142,6 +152,8 @@ namespace lime {
 					return "getSelfOPks";
 				case x3dh_message_type::selfOPks :
 					return "selfOPks";
+				case x3dh_message_type::batch :
+					return "batch";
 				case x3dh_message_type::error :
 					return "error";
 			}
@@ -158,7 +170,7 @@ namespace lime {
 		 * @return	a vector holding the well formed header ready to be expanded to include the message body
 		 */
 		static std::vector<uint8_t> X3DH_makeHeader(const x3dh_message_type message_type, const lime::CurveId curve) noexcept{
-			LIME_LOGD<<hex<<setfill('0')<<"Build outgoing X3DH message:"<<endl
+			if (LIME_PROTOCOL_TRACE_ENABLED) LIME_LOGD<<hex<<setfill('0')<<"Build outgoing X3DH message:"<<endl
 				<<"    Protocol Version is 0x"<<setw(2)<<static_cast<unsigned int>(X3DH_protocolVersion)<<endl
 				<<"    Message Type is "<<x3dh_messageTypeString(message_type)<<" (0x"<<setw(2)<<static_cast<unsigned int>(message_type)<<")"<<endl
 				<<"    CurveId is 0x"<<setw(2)<<static_cast<unsigned int>(curve);
@@ -201,7 +213,16 @@ namespace lime {
 			message.push_back(static_cast<uint8_t>(((OPkCount)>>8)&0xFF));
 			message.push_back(static_cast<uint8_t>((OPkCount)&0xFF));
 
+			for (decltype(OPkCount) i=0; i<OPkCount; i++) {
+				message.insert(message.end(), OPks[i].cbegin(), OPks[i].cend());
+				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>24)&0xFF));
+				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>16)&0xFF));
+				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>8)&0xFF));
+				message.push_back(static_cast<uint8_t>((OPk_ids[i])&0xFF));
+			}
+
 			// debug trace
+			if (!LIME_PROTOCOL_TRACE_ENABLED) return;
 			ostringstream message_trace;
 			message_trace << hex << setfill('0') << "Outgoing X3DH registerUser message holds:"<<endl<<"    Ik:";
 			std::for_each(Ik.cbegin(), Ik.cend(), [&message_trace] (unsigned int i) {
@@ -221,13 +242,6 @@ namespace lime {
 			message_trace << endl << dec << setfill('0') << "    " << static_cast<unsigned int>(OPkCount)<<" OPks."<< hex;
 
 			for (decltype(OPkCount) i=0; i<OPkCount; i++) {
-				message.insert(message.end(), OPks[i].cbegin(), OPks[i].cend());
-				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>24)&0xFF));
-				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>16)&0xFF));
-				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>8)&0xFF));
-				message.push_back(static_cast<uint8_t>((OPk_ids[i])&0xFF));
-
-				// debug trace
 				message_trace << endl <<"        OPk id: 0x"<< setw(8) << static_cast<unsigned int>(OPk_ids[i]) <<"        OPk:";
 				std::for_each(OPks[i].cbegin(), OPks[i].cend(), [&message_trace] (unsigned int i) {
 					message_trace << setw(2) << i << ", ";
@@ -276,6 +290,7 @@ namespace lime {
 			message.push_back(static_cast<uint8_t>((SPk_id)&0xFF));
 
 			// debug trace
+			if (!LIME_PROTOCOL_TRACE_ENABLED) return;
 			ostringstream message_trace;
 			message_trace << hex << setfill('0') << "Outgoing X3DH postSPk message holds:"<<endl<<"    SPk:";
 			std::for_each(SPk.cbegin(), SPk.cend(), [&message_trace] (unsigned int i) {
@@ -317,18 +332,20 @@ namespace lime {
 			message.push_back(static_cast<uint8_t>(((OPkCount)>>8)&0xFF));
 			message.push_back(static_cast<uint8_t>((OPkCount)&0xFF));
 
-			// debug trace
-			ostringstream message_trace;
-			message_trace << dec << setfill('0') << "Outgoing X3DH postOPks message holds "<< static_cast<unsigned int>(OPkCount)<<" OPks."<< hex;
-
 			for (decltype(OPkCount) i=0; i<OPkCount; i++) {
 				message.insert(message.end(), OPks[i].cbegin(), OPks[i].cend());
 				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>24)&0xFF));
 				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>16)&0xFF));
 				message.push_back(static_cast<uint8_t>((OPk_ids[i]>>8)&0xFF));
 				message.push_back(static_cast<uint8_t>((OPk_ids[i])&0xFF));
+			}
 
-				// debug trace
+			// debug trace
+			if (!LIME_PROTOCOL_TRACE_ENABLED) return;
+			ostringstream message_trace;
+			message_trace << dec << setfill('0') << "Outgoing X3DH postOPks message holds "<< static_cast<unsigned int>(OPkCount)<<" OPks."<< hex;
+
+			for (decltype(OPkCount) i=0; i<OPkCount; i++) {
 				message_trace << endl <<"    OPk id: 0x"<< setw(8) << static_cast<unsigned int>(OPk_ids[i]) <<"    OPk:";
 				std::for_each(OPks[i].cbegin(), OPks[i].cend(), [&message_trace] (unsigned int i) {
 					message_trace << setw(2) << i << ", ";
@@ -364,8 +381,9 @@ namespace lime {
 			}
 
 			// debug trace
+			const bool trace = LIME_PROTOCOL_TRACE_ENABLED;
 			ostringstream message_trace;
-			message_trace << dec << setfill('0') << "Outgoing X3DH getPeerBundles message holds "<< static_cast<unsigned int>(peer_device_ids.size())<<" devices id."<< hex;
+			if (trace) message_trace << dec << setfill('0') << "Outgoing X3DH getPeerBundles message holds "<< static_cast<unsigned int>(peer_device_ids.size())<<" devices id."<< hex;
 
 			// append a sequence of peer device Id size(on 2 bytes) || device id
 			for (const auto &peer_device_id : peer_device_ids) {
@@ -375,14 +393,16 @@ namespace lime {
 				LIME_LOGI<<"Request X3DH keys for device "<<peer_device_id;
 
 				// debug trace
-				message_trace << endl << dec <<"    Device id("<< static_cast<unsigned int>(peer_device_id.size())<<"bytes): "<<peer_device_id<<" HEX:"<<hex;
-				std::for_each(peer_device_id.cbegin(), peer_device_id.cend(), [&message_trace] (unsigned int i) {
-					message_trace << setw(2) << i << ", ";
-				});
+				if (trace) {
+					message_trace << endl << dec <<"    Device id("<< static_cast<unsigned int>(peer_device_id.size())<<"bytes): "<<peer_device_id<<" HEX:"<<hex;
+					std::for_each(peer_device_id.cbegin(), peer_device_id.cend(), [&message_trace] (unsigned int i) {
+						message_trace << setw(2) << i << ", ";
+					});
+				}
 			}
 
 			//debug trace
-			LIME_LOGD<<message_trace.str();
+			if (trace) LIME_LOGD<<message_trace.str();
 		}
 
 		/**
@@ -412,15 +432,21 @@ namespace lime {
 		template <typename Curve>
 		bool parseMessage_getType(const std::vector<uint8_t> &body, x3dh_message_type &message_type, x3dh_error_code &error_code, const limeCallback callback) noexcept {
 			// Trace incoming message parsing their content to display human readable trace
+			// when debug traces are off, the message is dumped only if we are about to log an error
+			const bool trace = LIME_PROTOCOL_TRACE_ENABLED;
 			ostringstream message_trace;
-			message_trace << hex << setfill('0') << "Incoming X3DH message: "<<endl;
-			// first display the whole message in hexa
-			std::for_each(body.cbegin(), body.cend(), [&message_trace] (unsigned int i) {
-				message_trace << setw(2) << i << ", ";
-			});
+			auto dumpMessage = [&body, &message_trace]() {
+				message_trace << hex << setfill('0') << "Incoming X3DH message: "<<endl;
+				// first display the whole message in hexa
+				std::for_each(body.cbegin(), body.cend(), [&message_trace] (unsigned int i) {
+					message_trace << setw(2) << i << ", ";
+				});
+			};
+			if (trace) dumpMessage();
 
 			// check message holds at leat a header before trying to read it
 			if (body.size()<X3DH_headerSize) {
+				if (!trace) dumpMessage();
 				LIME_LOGE<<"Got an invalid response from X3DH server"<<endl<< message_trace.str()<<endl<<"    Invalid Incoming X3DH message";
 				if (callback) callback(lime::CallbackReturn::fail, "Got an invalid response from X3DH server");
 				LIME_LOGE<<message_trace.str()<<endl;
@@ -429,6 +455,7 @@ namespace lime {
 
 			// check X3DH protocol version
 			if (body[0] != static_cast<uint8_t>(X3DH_protocolVersion)) {
+				if (!trace) dumpMessage();
 				LIME_LOGE<<"X3DH server runs an other version of X3DH protocol(server "<<static_cast<unsigned int>(body[0])<<" - local "<<static_cast<unsigned int>(X3DH_protocolVersion)<<")"<<endl<<message_trace.str()<<endl<<"    Invalid Incoming X3DH message";
 				if (callback) callback(lime::CallbackReturn::fail, "X3DH server and client protocol version mismatch");
 				LIME_LOGE<<message_trace.str()<<endl;
@@ -437,64 +464,67 @@ namespace lime {
 
 			// check curve id
 			if (body[2] != static_cast<uint8_t>(Curve::curveId())) {
+				if (!trace) dumpMessage();
 				LIME_LOGE<<"X3DH server runs curve Id "<<static_cast<unsigned int>(body[2])<<" while local is set to "<<static_cast<unsigned int>(Curve::curveId())<<" for this server)"<<endl<<message_trace.str()<<endl<<"    Invalid Incoming X3DH message";
 				if (callback) callback(lime::CallbackReturn::fail, "X3DH server and client curve Id mismatch");
 				return false;
 			}
 
 			// message trace: add the protocol version, message type is appended in the switch
-			message_trace<<endl<<"    Protocol Version is 0x"<<setw(2)<<static_cast<unsigned int>(body[0])<<endl;
+			if (trace) message_trace<<endl<<"    Protocol Version is 0x"<<setw(2)<<static_cast<unsigned int>(body[0])<<endl;
 
 			// retrieve message_type from body[1]
 			switch (static_cast<uint8_t>(body[1])) {
 				case static_cast<uint8_t>(x3dh_message_type::registerUser) :
 					message_type = x3dh_message_type::registerUser;
-					message_trace<<"    Message Type is registerUser (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::registerUser)<<")";
+					if (trace) message_trace<<"    Message Type is registerUser (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::registerUser)<<")";
 					break;
 				case static_cast<uint8_t>(x3dh_message_type::deleteUser) :
 					message_type = x3dh_message_type::deleteUser;
-					message_trace<<"    Message Type is deleteUser (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::deleteUser)<<")";
+					if (trace) message_trace<<"    Message Type is deleteUser (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::deleteUser)<<")";
 					break;
 				case static_cast<uint8_t>(x3dh_message_type::postSPk) :
 					message_type = x3dh_message_type::postSPk;
-					message_trace<<"    Message Type is postSPk (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::postSPk)<<")";
+					if (trace) message_trace<<"    Message Type is postSPk (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::postSPk)<<")";
 					break;
 				case static_cast<uint8_t>(x3dh_message_type::postOPks) :
 					message_type = x3dh_message_type::postOPks;
-					message_trace<<"    Message Type is postOPks (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::postOPks)<<")";
+					if (trace) message_trace<<"    Message Type is postOPks (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::postOPks)<<")";
 					break;
 				case static_cast<uint8_t>(x3dh_message_type::getPeerBundle) :
 					message_type = x3dh_message_type::getPeerBundle;
-					message_trace<<"    Message Type is getPeerBundle (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::getPeerBundle)<<")";
+					if (trace) message_trace<<"    Message Type is getPeerBundle (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::getPeerBundle)<<")";
 					break;
 				case static_cast<uint8_t>(x3dh_message_type::peerBundle) :
 					message_type = x3dh_message_type::peerBundle;
-					message_trace<<"    Message Type is peerBundle (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::peerBundle)<<")";
+					if (trace) message_trace<<"    Message Type is peerBundle (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::peerBundle)<<")";
 					break;
 				case static_cast<uint8_t>(x3dh_message_type::getSelfOPks) :
 					message_type = x3dh_message_type::getSelfOPks;
-					message_trace<<"    Message Type is getSelfOPks (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::getSelfOPks)<<")";
+					if (trace) message_trace<<"    Message Type is getSelfOPks (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::getSelfOPks)<<")";
 					break;
 				case static_cast<uint8_t>(x3dh_message_type::selfOPks) :
 					message_type = x3dh_message_type::selfOPks;
-					message_trace<<"    Message Type is selfOPks (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::selfOPks)<<")";
+					if (trace) message_trace<<"    Message Type is selfOPks (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::selfOPks)<<")";
 					break;
 				case static_cast<uint8_t>(x3dh_message_type::error) :
 					message_type = x3dh_message_type::error;
-					message_trace<<"    Message Type is error (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::error)<<")";
+					if (trace) message_trace<<"    Message Type is error (0x"<<setw(2)<<static_cast<unsigned int>(x3dh_message_type::error)<<")";
 					break;
 				default: // unknown message type: invalid packet
+					if (!trace) dumpMessage();
 					message_trace<<"    Message Type is Unknown (0x"<<setw(2)<<static_cast<unsigned int>(body[1])<<")"<<endl<<"    Invalid Incoming X3DH message";
 					LIME_LOGE<<message_trace.str()<<endl;
 					return false;
 			}
 
 			// message trace : display also the curve Id so we identify the 3 bytes of message header
-			message_trace<<endl<<"    CurveId is 0x"<<setw(2)<<static_cast<unsigned int>(body[2])<<endl;
+			if (trace) message_trace<<endl<<"    CurveId is 0x"<<setw(2)<<static_cast<unsigned int>(body[2])<<endl;
 
 			// retrieve the error code if needed
 			if (message_type == x3dh_message_type::error) {
 				if (body.size()<X3DH_headerSize+1) { // error message contains at least 1 byte of error code + possible message
+					if (!trace) dumpMessage();
 					LIME_LOGE<<message_trace.str()<<endl;
 					return false;
 				}
@@ -544,13 +574,13 @@ namespace lime {
 						error_code = x3dh_error_code::unknown_error_code;
 				}
 			}
-			LIME_LOGD<<message_trace.str()<<endl<<"    Valid Incoming X3DH message";
+			if (trace) LIME_LOGD<<message_trace.str()<<endl<<"    Valid Incoming X3DH message";
 
 			return true;
 		}
 
 		/**
-		 * @brief Parse a peerBundles message and populate a vector of peerBundles
+		 * @brief Validate a peerBundles message and give access to the key bundles it holds
 		 *
 		 * Warning: no checks are done on message type, they are performed before calling this function
 		 *
@@ -563,14 +593,16 @@ namespace lime {
 		 *		   (OPk < ECDH Public Key Length > || OPk id <4 bytes>){0,1 in accordance to flag}
 		 *	) { bundle Count}
 		 *
-		 * @param[in]	body		a buffer holding the message
-		 * @param[out]	peersBundle	a vector to be populated from message content, is empty if none found
+		 * The whole message is validated once, the bundles are not copied: peersBundle gives views into the message buffer
+		 *
+		 * @param[in]	body		a buffer holding the message, it must outlive peersBundle
+		 * @param[out]	peersBundle	the bundles held by the message, is empty if none found
 		 *
 		 * @return true if all went ok, false and empty peersBundle otherwise
 		 */
 		template <typename Curve>
-		bool parseMessage_getPeerBundles(const std::vector<uint8_t> &body, std::vector<X3DH_peerBundle<Curve>> &peersBundle) noexcept {
-			peersBundle.clear();
+		bool parseMessage_getPeerBundles(const std::vector<uint8_t> &body, X3DH_peerBundles<Curve> &peersBundle) noexcept {
+			peersBundle = X3DH_peerBundles<Curve>{};
 			if (body.size() < X3DH_headerSize+2) { // we must be able to at least have a count of bundles
 				LIME_LOGE<<"Unable to parse content of X3DH peer Bundles message, body size is only "<<static_cast<unsigned int>(body.size());
 				return false;
@@ -586,120 +618,91 @@ namespace lime {
 			// -        Ik
 			// -        SPkid, SPk, SPk signature
 			// -        OPkid OPk if any
+			const bool trace = LIME_PROTOCOL_TRACE_ENABLED;
 			ostringstream message_trace;
-			message_trace << dec << "X3DH Peer Bundles message holds "<<static_cast<unsigned int>(peersBundleCount)<<" key bundles"<<setfill('0');
+			if (trace) message_trace << dec << "X3DH Peer Bundles message holds "<<static_cast<unsigned int>(peersBundleCount)<<" key bundles"<<setfill('0');
 
 			// loop on all expected bundles
 			for (auto i=0; i<peersBundleCount; i++) {
 				if (body.size() < index + 2) { // check we have at least a device size to read
-					peersBundle.clear();
 					LIME_LOGE<<"Invalid message: size is not what expected, cannot read device size, discard without parsing";
-					LIME_LOGD<<"message_trace so far: "<<message_trace.str();
+					if (trace) LIME_LOGD<<"message_trace so far: "<<message_trace.str();
 					return false;
 				}
 
-				// get device id (ASCII string)
+				// get device id size
 				uint16_t deviceIdSize = (static_cast<uint16_t>(body[index]))<<8|body[index+1];
-				index += 2;
 
-				if (body.size() < index + deviceIdSize + 1) { // check we have at enough data to read: device size and the following flag
-					peersBundle.clear();
+				if (body.size() < index + 2 + deviceIdSize + 1) { // check we have at enough data to read: device size and the following flag
 					LIME_LOGE<<"Invalid message: size is not what expected, cannot read device id(size is"<<int(deviceIdSize)<<"), discard without parsing";
-					LIME_LOGD<<"message_trace so far: "<<message_trace.str();
+					if (trace) LIME_LOGD<<"message_trace so far: "<<message_trace.str();
 					return false;
 				}
-				std::string deviceId{body.cbegin()+index, body.cbegin()+index+deviceIdSize};
-				index += deviceIdSize;
 
-				// check if we have a key bundle and an OPk. Possible flag values: 0 no OPk, 1 OPk, 2 no key bundle at all
-				// parse the key bundle flag
-				lime::X3DHKeyBundleFlag keyBundleFlag = lime::X3DHKeyBundleFlag::noBundle;
-				switch (body[index]) {
+				// check the key bundle flag. Possible flag values: 0 no OPk, 1 OPk, 2 no key bundle at all
+				switch (body[index + 2 + deviceIdSize]) {
 					case static_cast<uint8_t>(lime::X3DHKeyBundleFlag::noBundle):
-						keyBundleFlag = lime::X3DHKeyBundleFlag::noBundle;
-						break;
 					case static_cast<uint8_t>(lime::X3DHKeyBundleFlag::noOPk):
-						keyBundleFlag = lime::X3DHKeyBundleFlag::noOPk;
-						break;
 					case static_cast<uint8_t>(lime::X3DHKeyBundleFlag::OPk):
-						keyBundleFlag = lime::X3DHKeyBundleFlag::OPk;
 						break;
 					default:
-						LIME_LOGE<<"Invalid X3DH message: unexpected flag value "<<body[index]<<" in "<<deviceId<<" key bundle";
-						LIME_LOGD<<"message_trace so far: "<<message_trace.str();
-						peersBundle.clear();
+						LIME_LOGE<<"Invalid X3DH message: unexpected flag value "<<body[index + 2 + deviceIdSize]<<" in "<<std::string(body.cbegin()+index+2, body.cbegin()+index+2+deviceIdSize)<<" key bundle";
+						if (trace) LIME_LOGD<<"message_trace so far: "<<message_trace.str();
 						return false;
 				}
 
+				// from now on the view can read this bundle device Id and flag
+				X3DH_peerBundleView<Curve> peerBundle{body.cbegin()+index};
+
 				// if there is no bundle, just skip to the next one
-				if (keyBundleFlag == lime::X3DHKeyBundleFlag::noBundle) {
+				if (peerBundle.bundleFlag() == lime::X3DHKeyBundleFlag::noBundle) {
 					// add device Id (and its size) to the trace
-					message_trace << endl << dec << "    Device Id ("<<static_cast<unsigned int>(deviceIdSize)<<" bytes): "<<deviceId<<" has no key bundle"<<endl;
-					peersBundle.emplace_back(std::move(deviceId));
-					index += 1;
+					if (trace) message_trace << endl << dec << "    Device Id ("<<static_cast<unsigned int>(deviceIdSize)<<" bytes): "<<peerBundle.deviceId()<<" has no key bundle"<<endl;
+					index += peerBundle.size();
 					continue; // skip to next one
 				}
 
-				bool haveOPk = (keyBundleFlag == lime::X3DHKeyBundleFlag::OPk);
-				index += 1;
-
-				// add device Id (and its size) and flag to the trace
-				message_trace << endl << dec << "    Device Id ("<<static_cast<unsigned int>(deviceIdSize)<<" bytes): "<<deviceId<<(haveOPk?" has ":" does not have ")<<"OPk"<<endl<<"        Ik: ";
+				bool haveOPk = (peerBundle.bundleFlag() == lime::X3DHKeyBundleFlag::OPk);
 
-				if (body.size() < index + DSA<Curve, lime::DSAtype::publicKey>::ssize() + X<Curve, lime::Xtype::publicKey>::ssize() + DSA<Curve, lime::DSAtype::signature>::ssize() + 4 + (haveOPk?(X<Curve, lime::Xtype::publicKey>::ssize()+4):0) ) {
-					peersBundle.clear();
+				if (body.size() < index + peerBundle.size()) {
 					LIME_LOGE<<"Invalid message: size is not what expected, not enough buffer to hold keys bundle, discard without parsing";
-					LIME_LOGD<<"message_trace so far: "<<message_trace.str();
+					if (trace) LIME_LOGD<<"message_trace so far: "<<message_trace.str();
 					return false;
 				}
+				index += peerBundle.size();
 
-				// retrieve simple pointers to all keys and signature, the X3DH_peerBundle constructor will construct the keys out of them
-				const auto Ik = body.cbegin()+index; index += DSA<Curve, lime::DSAtype::publicKey>::ssize();
-
-				// add Ik to message trace
-				message_trace << hex << setfill('0');
-				std::for_each(Ik, Ik + DSA<Curve, lime::DSAtype::publicKey>::ssize(), [&message_trace] (unsigned int i) {
-					message_trace << setw(2) << i << ", ";
-				});
-
-				const auto SPk = body.cbegin()+index; index += X<Curve, lime::Xtype::publicKey>::ssize();
-				uint32_t SPk_id = static_cast<uint32_t>(body[index])<<24 |
-						static_cast<uint32_t>(body[index+1])<<16 |
-						static_cast<uint32_t>(body[index+2])<<8 |
-						static_cast<uint32_t>(body[index+3]);
-				index += 4;
-				const auto SPk_sig = body.cbegin()+index; index += DSA<Curve, lime::DSAtype::signature>::ssize();
+				if (trace) {
+					// add device Id (and its size) and flag to the trace
+					message_trace << endl << dec << "    Device Id ("<<static_cast<unsigned int>(deviceIdSize)<<" bytes): "<<peerBundle.deviceId()<<(haveOPk?" has ":" does not have ")<<"OPk"<<endl<<"        Ik: ";
 
-				// add SPk Id, SPk and SPk signature to the trace
-				message_trace <<endl<<"        SPk Id: 0x"<< setw(8) << static_cast<unsigned int>(SPk_id)<<endl<<"        SPk: ";
-				std::for_each(SPk, SPk + X<Curve, lime::Xtype::publicKey>::ssize(), [&message_trace] (unsigned int i) {
-					message_trace << setw(2) << i << ", ";
-				});
-				message_trace <<endl<<"        SPk Signature: ";
-				std::for_each(SPk_sig, SPk_sig + DSA<Curve, lime::DSAtype::signature>::ssize(), [&message_trace] (unsigned int i) {
-					message_trace << setw(2) << i << ", ";
-				});
-
-				if (haveOPk) {
-					const auto OPk = body.cbegin()+index; index += X<Curve, lime::Xtype::publicKey>::ssize();
-					uint32_t OPk_id = static_cast<uint32_t>(body[index])<<24 |
-						static_cast<uint32_t>(body[index+1])<<16 |
-						static_cast<uint32_t>(body[index+2])<<8 |
-						static_cast<uint32_t>(body[index+3]);
-					index += 4;
+					// add Ik to message trace
+					message_trace << hex << setfill('0');
+					std::for_each(peerBundle.Ik(), peerBundle.Ik() + DSA<Curve, lime::DSAtype::publicKey>::ssize(), [&message_trace] (unsigned int i) {
+						message_trace << setw(2) << i << ", ";
+					});
 
-					// add OPk Id and OPk to the trace
-					message_trace <<endl<<"        OPk Id: 0x" << setw(8) << static_cast<unsigned int>(OPk_id)<<endl<<"        OPk: ";
-					std::for_each(OPk, OPk + X<Curve, lime::Xtype::publicKey>::ssize(), [&message_trace] (unsigned int i) {
+					// add SPk Id, SPk and SPk signature to the trace
+					message_trace <<endl<<"        SPk Id: 0x"<< setw(8) << static_cast<unsigned int>(peerBundle.SPk_id())<<endl<<"        SPk: ";
+					std::for_each(peerBundle.SPk(), peerBundle.SPk() + X<Curve, lime::Xtype::publicKey>::ssize(), [&message_trace] (unsigned int i) {
+						message_trace << setw(2) << i << ", ";
+					});
+					message_trace <<endl<<"        SPk Signature: ";
+					std::for_each(peerBundle.SPk_sig(), peerBundle.SPk_sig() + DSA<Curve, lime::DSAtype::signature>::ssize(), [&message_trace] (unsigned int i) {
 						message_trace << setw(2) << i << ", ";
 					});
 
-					peersBundle.emplace_back(std::move(deviceId), Ik, SPk, SPk_id, SPk_sig, OPk, OPk_id);
-				} else {
-					peersBundle.emplace_back(std::move(deviceId), Ik, SPk, SPk_id, SPk_sig);
+					// add OPk Id and OPk to the trace
+					if (haveOPk) {
+						message_trace <<endl<<"        OPk Id: 0x" << setw(8) << static_cast<unsigned int>(peerBundle.OPk_id())<<endl<<"        OPk: ";
+						std::for_each(peerBundle.OPk(), peerBundle.OPk() + X<Curve, lime::Xtype::publicKey>::ssize(), [&message_trace] (unsigned int i) {
+							message_trace << setw(2) << i << ", ";
+						});
+					}
 				}
 			}
-			LIME_LOGD<<message_trace.str();
+			if (trace) LIME_LOGD<<message_trace.str();
+
+			peersBundle = X3DH_peerBundles<Curve>{body.cbegin()+X3DH_headerSize+2, body.cbegin()+index, peersBundleCount};
 			return true;
 		}
 
@@ -733,9 +736,9 @@ namespace lime {
 			// message trace, display the incoming self OPks in human readable format:
 			// - number of OPks in the message
 			// -        OPkid
+			const bool trace = LIME_PROTOCOL_TRACE_ENABLED;
 			ostringstream message_trace;
-			message_trace << dec << "X3DH self OPks message holds "<<static_cast<unsigned int>(selfOPkIdsCount)<<" OPk Ids"<<endl;
-			message_trace << hex;
+			if (trace) message_trace << dec << "X3DH self OPks message holds "<<static_cast<unsigned int>(selfOPkIdsCount)<<" OPk Ids"<<endl<<hex;
 
 			// loop on all OPk Ids
 			for (auto i=0; i<selfOPkIdsCount; i++) { // they are in big endian
@@ -745,13 +748,81 @@ namespace lime {
 						static_cast<uint32_t>(body[index+3]);
 				index+=4;
 				selfOPkIds.push_back(OPk_id);
-				message_trace <<"    OPk Id: 0x"<< setw(8) << static_cast<unsigned int>(OPk_id)<<endl;
+				if (trace) message_trace <<"    OPk Id: 0x"<< setw(8) << static_cast<unsigned int>(OPk_id)<<endl;
 			}
-			LIME_LOGD<<message_trace.str();
+			if (trace) LIME_LOGD<<message_trace.str();
 			return true;
 		}
 
 
+		/**
+		 * @brief build a batch message
+		 *
+		 * 	request Count <2 bytes unsigned Big Endian> ||\n
+		 * 	(from Size <2 bytes> || from || message Size <4 bytes> || message) {request Count}
+		 *
+		 * @param[in,out]	message		an empty buffer to store the message
+		 * @param[in]		curveId		the curve of all the requests
+		 * @param[in]		requests	the local device Id posting each request and the request itself, at most 2^16
+		 */
+		static void buildMessage_batch(std::vector<uint8_t> &message, const uint8_t curveId, const std::vector<std::pair<const std::string *, const std::vector<uint8_t> *>> &requests) noexcept {
+			message = X3DH_makeHeader(x3dh_message_type::batch, static_cast<lime::CurveId>(curveId));
+			message.push_back(static_cast<uint8_t>(((requests.size())>>8)&0xFF));
+			message.push_back(static_cast<uint8_t>((requests.size())&0xFF));
+			for (const auto &request : requests) {
+				const auto &from = *(request.first);
+				const auto &requestMessage = *(request.second);
+				message.push_back(static_cast<uint8_t>(((from.size())>>8)&0xFF));
+				message.push_back(static_cast<uint8_t>((from.size())&0xFF));
+				message.insert(message.end(), from.cbegin(), from.cend());
+				message.push_back(static_cast<uint8_t>((requestMessage.size()>>24)&0xFF));
+				message.push_back(static_cast<uint8_t>((requestMessage.size()>>16)&0xFF));
+				message.push_back(static_cast<uint8_t>((requestMessage.size()>>8)&0xFF));
+				message.push_back(static_cast<uint8_t>((requestMessage.size())&0xFF));
+				message.insert(message.end(), requestMessage.cbegin(), requestMessage.cend());
+			}
+			if (LIME_PROTOCOL_TRACE_ENABLED) LIME_LOGD<<"Outgoing X3DH batch message holds "<<requests.size()<<" requests";
+		}
+
+		/**
+		 * @brief Parse the server response to a batch message
+		 *
+		 * @param[in]	body		the response
+		 * @param[in]	curveId		the curve of the batch
+		 * @param[in]	count		the number of requests in the batch
+		 * @param[out]	responses	the response to each request, in the batch order
+		 *
+		 * @return true if this is a well formed batch response holding count responses
+		 */
+		static bool parseMessage_batch(const std::vector<uint8_t> &body, const uint8_t curveId, const size_t count, std::vector<std::vector<uint8_t>> &responses) noexcept {
+			if (body.size() < X3DH_headerSize+2 || body[0] != X3DH_protocolVersion || body[1] != static_cast<uint8_t>(x3dh_message_type::batch) || body[2] != curveId) {
+				return false;
+			}
+			if ((static_cast<size_t>(body[X3DH_headerSize])<<8 | body[X3DH_headerSize+1]) != count) {
+				LIME_LOGE<<"X3DH batch response does not hold the "<<count<<" expected responses";
+				return false;
+			}
+			responses.clear();
+			responses.reserve(count);
+			size_t index = X3DH_headerSize+2;
+			for (size_t i=0; i<count; i++) {
+				if (body.size() < index+4) return false;
+				const size_t responseSize = static_cast<size_t>(body[index])<<24 | static_cast<size_t>(body[index+1])<<16 | static_cast<size_t>(body[index+2])<<8 | static_cast<size_t>(body[index+3]);
+				index += 4;
+				if (body.size() < index + responseSize) return false;
+				responses.emplace_back(body.cbegin()+index, body.cbegin()+index+responseSize);
+				index += responseSize;
+			}
+			return index == body.size();
+		}
+
+		/**
+		 * @return true if the message is an X3DH error message
+		 */
+		static bool is_errorMessage(const std::vector<uint8_t> &body) noexcept {
+			return body.size() >= X3DH_headerSize+1 && body[0] == X3DH_protocolVersion && body[1] == static_cast<uint8_t>(x3dh_message_type::error);
+		}
+
 		/* Instanciate templated functions */
 #ifdef EC25519_ENABLED
 		template void buildMessage_registerUser<C255>(std::vector<uint8_t> &message, const DSA<C255, lime::DSAtype::publicKey> &Ik, const X<C255, lime::Xtype::publicKey> &SPk, const DSA<C255, lime::DSAtype::signature> &Sig, const uint32_t SPk_id, const std::vector<X<C255, lime::Xtype::publicKey>> &OPks, const std::vector<uint32_t> &OPk_ids) noexcept;
@@ -772,6 +843,113 @@ namespace lime {
 #endif
 	} //namespace x3dh_protocol
 
+	void X3DHBatcher::set_enabled(const bool enabled, const bool sharedCredential) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_enabled = enabled;
+		m_sharedCredential = sharedCredential;
+	}
+
+	void X3DHBatcher::post(const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess) {
+		std::vector<request> full{};
+		const uint8_t curveId = (message.size() >= x3dh_protocol::X3DH_headerSize)?message[2]:0;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_enabled && m_holds > 0 && message.size() >= x3dh_protocol::X3DH_headerSize && m_unsupported.count(url) == 0) {
+				// a batch holds the requests of one local device, unless they all share the transport credential
+				const auto queueKey = std::make_tuple(url, curveId, m_sharedCredential?std::string{}:from);
+				auto &queue = m_queued[queueKey];
+				queue.emplace_back(from, message, responseProcess);
+				if (queue.size() < lime::settings::X3DH_batchMaxRequests) return;
+				// this batch is big enough: send it now
+				std::swap(full, queue);
+				m_queued.erase(queueKey);
+			}
+		}
+		if (full.empty()) {
+			m_post(url, from, message, responseProcess);
+		} else {
+			send(url, curveId, std::move(full));
+		}
+	}
+
+	void X3DHBatcher::hold() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_holds++;
+	}
+
+	void X3DHBatcher::release() {
+		std::map<std::tuple<std::string, uint8_t, std::string>, std::vector<request>> queued{};
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_holds > 0) m_holds--;
+			if (m_holds > 0) return;
+			std::swap(queued, m_queued);
+		}
+		for (auto &queue : queued) {
+			send(std::get<0>(queue.first), std::get<1>(queue.first), std::move(queue.second));
+		}
+	}
+
+	void X3DHBatcher::send(const std::string &url, const uint8_t curveId, std::vector<request> &&requests) {
+		if (requests.size() == 1) { // no need to wrap it
+			m_post(url, requests[0].from, requests[0].message, requests[0].responseProcess);
+			return;
+		}
+		std::vector<std::pair<const std::string *, const std::vector<uint8_t> *>> batchedRequests{};
+		batchedRequests.reserve(requests.size());
+		for (const auto &batchedRequest : requests) {
+			batchedRequests.emplace_back(&(batchedRequest.from), &(batchedRequest.message));
+		}
+		std::vector<uint8_t> message{};
+		x3dh_protocol::buildMessage_batch(message, curveId, batchedRequests);
+		LIME_LOGD<<"Post a batch of "<<requests.size()<<" X3DH messages to "<<url;
+
+		// the batch is posted on behalf of its requests local device, the first one's with a shared credential
+		auto self = shared_from_this();
+		auto batch = std::make_shared<std::vector<request>>(std::move(requests));
+		m_post(url, (*batch)[0].from, message, [self, url, curveId, batch](int responseCode, const std::vector<uint8_t> &responseBody) {
+				self->process_response(url, curveId, *batch, responseCode, responseBody);
+			});
+	}
+
+	void X3DHBatcher::process_response(const std::string &url, const uint8_t curveId, std::vector<request> &requests, int responseCode, const std::vector<uint8_t> &responseBody) {
+		if (responseCode != 200) { // each request gets the transport failure
+			for (auto &batchedRequest : requests) {
+				batchedRequest.responseProcess(responseCode, responseBody);
+			}
+			return;
+		}
+
+		if (x3dh_protocol::is_errorMessage(responseBody)) { // none of the requests was processed: post them one by one
+			LIME_LOGW<<"X3DH server "<<url<<" rejected a batch message, post the requests to it one by one";
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_unsupported.insert(url);
+			}
+			for (auto &batchedRequest : requests) {
+				m_post(url, batchedRequest.from, batchedRequest.message, batchedRequest.responseProcess);
+			}
+			return;
+		}
+
+		std::vector<std::vector<uint8_t>> responses{};
+		if (!x3dh_protocol::parseMessage_batch(responseBody, curveId, requests.size(), responses)) {
+			LIME_LOGE<<"Got an invalid batch response from X3DH server "<<url;
+			const std::vector<uint8_t> emptyResponse{};
+			for (auto &batchedRequest : requests) {
+				batchedRequest.responseProcess(200, emptyResponse); // each request reports an invalid response
+			}
+			return;
+		}
+
+		// the requests posted while processing the responses are batched together
+		hold();
+		for (size_t i=0; i<requests.size(); i++) {
+			requests[i].responseProcess(200, responses[i]);
+		}
+		release();
+	}
+
 	/**
 	 * @brief Clean user data in case of problem or when we're done, it also process the asynchronous encryption queue
 	 *
@@ -779,14 +957,36 @@ namespace lime {
 	 */
 	template <typename Curve>
 	void Lime<Curve>::cleanUserData(std::shared_ptr<callbackUserData<Curve>> userData) {
-		if (userData->plainMessage!=nullptr) { // only encryption request for X3DH bundle would populate the plainMessage field of user data structure
-			// userData is actually a part of the Lime Object and allocated as a shared pointer, just set it to nullptr it will cleanly destroy it
-			m_ongoing_encryption = nullptr;
-			// check if others encryptions are in queue and call them if needed
-			if (!m_encryption_queue.empty()) {
-				auto userData = m_encryption_queue.front();
-				m_encryption_queue.pop(); // remove it from queue and do it, as there is no more ongoing it shall be processed even if the queue still holds elements
-				encrypt(userData->recipientUserId, userData->recipients, userData->plainMessage, userData->encryptionPolicy, userData->cipherMessage, userData->callback);
+		if (userData->recipients!=nullptr || !userData->peerDevices.empty()) { // only encryption request(or sessions prefetch) for X3DH bundle would populate the recipients field of user data structure, key bundles prefetch populate only the peerDevices one
+			std::queue<std::shared_ptr<callbackUserData<Curve>>> encryption_queue{};
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				// the key bundles fetched by this request are not pending anymore
+				for (const auto &peerDevice : userData->peerDevices) {
+					m_fetching_bundles.erase(peerDevice);
+				}
+				std::swap(encryption_queue, m_encryption_queue);
+				m_coalescing_fetches++;
+			}
+			// retry all the queued encryptions: the ones waiting for these key bundles can proceed, the ones waiting for an other ongoing fetch are queued again
+			// the ones missing other key bundles get them in one request to the X3DH server
+			while (!encryption_queue.empty()) {
+				auto queuedUserData = encryption_queue.front();
+				encryption_queue.pop();
+				encrypt(queuedUserData->recipientUserId, queuedUserData->recipients, queuedUserData->plainMessage, queuedUserData->encryptionPolicy, queuedUserData->cipherMessage, queuedUserData->cipherStreamKey, queuedUserData->DRmessages, queuedUserData->callback);
+			}
+			std::shared_ptr<callbackUserData<Curve>> coalesced_fetch{nullptr};
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_coalescing_fetches--;
+				if (m_coalescing_fetches == 0) {
+					std::swap(coalesced_fetch, m_coalesced_fetch);
+				}
+			}
+			if (coalesced_fetch != nullptr) {
+				std::vector<uint8_t> X3DHmessage{};
+				x3dh_protocol::buildMessage_getPeerBundles<Curve>(X3DHmessage, coalesced_fetch->peerDevices);
+				postToX3DHServer(coalesced_fetch, X3DHmessage);
 			}
 		} else { // its not an encryption, just set userData to null it shall destroy it
 			userData = nullptr;
@@ -846,7 +1046,7 @@ namespace lime {
 
 				case x3dh_protocol::x3dh_message_type::peerBundle: {
 					// server response to a getPeerBundle packet
-					std::vector<X3DH_peerBundle<Curve>> peersBundle;
+					X3DH_peerBundles<Curve> peersBundle; // views into responseBody
 					if (!x3dh_protocol::parseMessage_getPeerBundles(responseBody, peersBundle)) { // parsing went wrong
 						LIME_LOGE<<"Got an invalid peerBundle packet from X3DH server";
 						if (callback) callback(lime::CallbackReturn::fail, "Got an invalid peerBundle packet from X3DH server");
@@ -854,6 +1054,17 @@ namespace lime {
 						return;
 					}
 
+					// key bundles prefetch: keep them until an encryption needs them
+					if (userData->recipients == nullptr) {
+						{
+							std::lock_guard<std::mutex> lock(m_mutex);
+							X3DH_cache_peerBundles(peersBundle);
+						}
+						if (callback) callback(lime::CallbackReturn::success, "");
+						cleanUserData(userData);
+						return;
+					}
+
 					// generate X3DH init packets, create a store DR Sessions(in Lime obj cache, they'll be stored in DB when the first encryption will occurs)
 					try {
 						//Note: if while we were waiting for the peer bundle we did get an init message from him and created a session
@@ -874,18 +1085,18 @@ namespace lime {
 					// tweak the userData->recipients to set to fail those wo didn't get a key bundle
 					for (const auto &peerBundle:peersBundle) {
 						// get all the bundless peer Devices
-						if (peerBundle.bundleFlag == lime::X3DHKeyBundleFlag::noBundle) {
+						if (peerBundle.bundleFlag() == lime::X3DHKeyBundleFlag::noBundle) {
 							for (auto &recipient:*(userData->recipients)) {
 								// and set their recipient status to fail so the encrypt function would ignore them
-								if (recipient.deviceId == peerBundle.deviceId) {
+								if (peerBundle.is_deviceId(recipient.deviceId)) {
 									recipient.peerStatus = lime::PeerDeviceStatus::fail;
 								}
 							}
 						}
 					}
 
-					// call the encrypt function again, it will call the callback when done, encryption queue won't be processed as still locked by the m_ongoing_encryption member
-					encrypt(userData->recipientUserId, userData->recipients, userData->plainMessage, userData->encryptionPolicy, userData->cipherMessage, callback);
+					// call the encrypt function again, it will call the callback when done, encryptions queued behind this one are processed by cleanUserData
+					encrypt(userData->recipientUserId, userData->recipients, userData->plainMessage, userData->encryptionPolicy, userData->cipherMessage, userData->cipherStreamKey, userData->DRmessages, callback);
 
 					// now we can safely delete the user data, note that this may trigger an other encryption if there is one in queue
 					cleanUserData(userData);
@@ -975,14 +1186,27 @@ namespace lime {
 	void Lime<Curve>::postToX3DHServer(std::shared_ptr<callbackUserData<Curve>> userData, const std::vector<uint8_t> &message) {
 		LIME_LOGD<<"Post outgoing X3DH message from user "<<this->m_selfDeviceId;
 
-		// copy capture the shared_ptr to userData
-		m_X3DH_post_data(m_X3DH_Server_URL, m_selfDeviceId, message, [userData](int responseCode, const std::vector<uint8_t> &responseBody) {
+		// copy capture the shared_ptr to userData, and the requests tracker so this user is not considered idle until the response is processed
+		auto X3DHRequests = m_X3DHRequests;
+		// the round trip timer holds the collector too as the response may arrive after the manager is gone
+		auto metrics = m_localStorage->m_metrics;
+		auto roundTrip = (metrics && metrics->enabled())?std::make_shared<MetricsTimer>(metrics.get(), lime::MetricsOperation::X3DHRoundTrip, false):nullptr;
+		// the round trip span is not scoped: it ends in the thread delivering the response
+		auto tracer = m_localStorage->m_tracer;
+		auto roundTripSpan = std::make_shared<TraceSpan>(tracer.get(), "lime.X3DHRoundTrip", false);
+		roundTripSpan->add("requestSize", static_cast<int64_t>(message.size()));
+		m_X3DH_post_data(m_X3DH_Server_URL, m_selfDeviceId, message, [userData, X3DHRequests, metrics, roundTrip, tracer, roundTripSpan](int responseCode, const std::vector<uint8_t> &responseBody) {
+				if (roundTrip) roundTrip->stop();
+				roundTripSpan->add("responseCode", static_cast<int64_t>(responseCode));
+				roundTripSpan->add("responseSize", static_cast<int64_t>(responseBody.size()));
+				roundTripSpan->end();
 				auto thiz = userData->limeObj.lock(); // get a shared pointer to Lime Object from the weak pointer stored in userData
 				// check it is valid (lock() returns nullptr)
 				if (!thiz) { // our Lime caller object doesn't exists anymore
 					LIME_LOGE<<"Got response from X3DH server but our Lime Object has been destroyed";
 					return; // the captured shared_ptr on userData will be freed when this capture will be destroyed
 				}
+				TraceSpan span(tracer.get(), "lime.X3DHProcessResponse", roundTripSpan->id());
 				thiz->process_response(userData, responseCode, responseBody);
 			});
 	}
@@ -20,7 +20,15 @@
 #ifndef lime_x3dh_protocol_hpp
 #define lime_x3dh_protocol_hpp
 
+#include "lime/lime.hpp"
 #include "lime_crypto_primitives.hpp"
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <mutex>
+#include <map>
+#include <set>
+#include <tuple>
 
 namespace lime {
 
@@ -33,6 +41,108 @@ namespace lime {
 		OPk=1, /**< This bundle contains an OPk */
 		noBundle=2}; /**< This bundle is empty(just a deviceId) as this user was not found on X3DH server */
 
+	/**
+	 * @brief A view on a key bundle inside a peerBundles message received from X3DH server
+	 *
+	 * Nothing is copied when the view is created: the data is read from the message buffer when accessed.
+	 * The message must have been validated by x3dh_protocol::parseMessage_getPeerBundles and kept alive as long as the view is used.
+	 *
+	 * @note keys, ids and signature accessors are valid only if the bundle flag is not noBundle, OPk accessors only if it is OPk
+	 */
+	template <typename Curve>
+	class X3DH_peerBundleView {
+		private:
+			std::vector<uint8_t>::const_iterator m_bundle; // points to the device Id size field of this bundle in the message
+
+			uint16_t deviceIdSize() const {return static_cast<uint16_t>(static_cast<uint16_t>(m_bundle[0])<<8 | m_bundle[1]);}
+			std::vector<uint8_t>::const_iterator keys() const {return m_bundle + 2 + deviceIdSize() + 1;} // keys are after device Id size, device Id and flag
+			static uint32_t readId(std::vector<uint8_t>::const_iterator id) {
+				return static_cast<uint32_t>(id[0])<<24 | static_cast<uint32_t>(id[1])<<16 | static_cast<uint32_t>(id[2])<<8 | static_cast<uint32_t>(id[3]);
+			}
+
+		public:
+			/// @param[in]	bundle	points on the device Id size field of a bundle in a validated message
+			explicit X3DH_peerBundleView(std::vector<uint8_t>::const_iterator bundle) : m_bundle{bundle} {};
+
+			/// @return the peer device Id (this one is copied)
+			std::string deviceId() const {return std::string{m_bundle + 2, m_bundle + 2 + deviceIdSize()};}
+			/// @return true if this bundle belongs to the given device, no copy performed
+			bool is_deviceId(const std::string &peerDeviceId) const {
+				return peerDeviceId.size() == deviceIdSize() && std::equal(peerDeviceId.cbegin(), peerDeviceId.cend(), m_bundle + 2);
+			}
+			/// @return the bundle flag: noBundle, noOPk or OPk
+			lime::X3DHKeyBundleFlag bundleFlag() const {return static_cast<lime::X3DHKeyBundleFlag>(m_bundle[2 + deviceIdSize()]);}
+
+			/* accessors to the key bundle content, they point into the message buffer */
+			std::vector<uint8_t>::const_iterator Ik() const {return keys();}
+			std::vector<uint8_t>::const_iterator SPk() const {return keys() + DSA<Curve, lime::DSAtype::publicKey>::ssize();}
+			uint32_t SPk_id() const {return readId(SPk() + X<Curve, lime::Xtype::publicKey>::ssize());}
+			std::vector<uint8_t>::const_iterator SPk_sig() const {return SPk() + X<Curve, lime::Xtype::publicKey>::ssize() + 4;}
+			std::vector<uint8_t>::const_iterator OPk() const {return SPk_sig() + DSA<Curve, lime::DSAtype::signature>::ssize();}
+			uint32_t OPk_id() const {return readId(OPk() + X<Curve, lime::Xtype::publicKey>::ssize());}
+
+			/// @return the size in bytes of this bundle in the message
+			size_t size() const {
+				size_t bundleSize = 2 + deviceIdSize() + 1;
+				const auto flag = bundleFlag();
+				if (flag == lime::X3DHKeyBundleFlag::noBundle) return bundleSize;
+				bundleSize += DSA<Curve, lime::DSAtype::publicKey>::ssize() + X<Curve, lime::Xtype::publicKey>::ssize() + 4 + DSA<Curve, lime::DSAtype::signature>::ssize();
+				if (flag == lime::X3DHKeyBundleFlag::OPk) bundleSize += X<Curve, lime::Xtype::publicKey>::ssize() + 4;
+				return bundleSize;
+			}
+
+			/// @return the position of this bundle in the message
+			std::vector<uint8_t>::const_iterator position() const {return m_bundle;}
+	};
+
+	/**
+	 * @brief The key bundles held by a validated peerBundles message
+	 *
+	 * Iterate on it to get a X3DH_peerBundleView on each key bundle, the message buffer is not copied and must outlive this object.
+	 */
+	template <typename Curve>
+	class X3DH_peerBundles {
+		private:
+			std::vector<uint8_t>::const_iterator m_begin; // first bundle in the message
+			std::vector<uint8_t>::const_iterator m_end; // position after the last bundle
+			size_t m_count; // number of bundles
+
+		public:
+			/// forward iterator on the bundles views
+			class const_iterator {
+				private:
+					X3DH_peerBundleView<Curve> m_view;
+				public:
+					using iterator_category = std::forward_iterator_tag;
+					using value_type = X3DH_peerBundleView<Curve>;
+					using difference_type = std::ptrdiff_t;
+					using pointer = const X3DH_peerBundleView<Curve> *;
+					using reference = const X3DH_peerBundleView<Curve> &;
+
+					explicit const_iterator(std::vector<uint8_t>::const_iterator position) : m_view{position} {};
+					reference operator*() const {return m_view;}
+					pointer operator->() const {return &m_view;}
+					const_iterator &operator++() {m_view = X3DH_peerBundleView<Curve>{m_view.position() + m_view.size()}; return *this;}
+					const_iterator operator++(int) {auto previous = *this; ++(*this); return previous;}
+					bool operator==(const const_iterator &other) const {return m_view.position() == other.m_view.position();}
+					bool operator!=(const const_iterator &other) const {return !(*this == other);}
+			};
+
+			/// an empty bundles list
+			X3DH_peerBundles() : m_begin{}, m_end{}, m_count{0} {};
+			/**
+			 * @param[in]	begin	first bundle position in a validated message
+			 * @param[in]	end	position after the last bundle
+			 * @param[in]	count	number of bundles between begin and end
+			 */
+			X3DH_peerBundles(std::vector<uint8_t>::const_iterator begin, std::vector<uint8_t>::const_iterator end, size_t count) : m_begin{begin}, m_end{end}, m_count{count} {};
+
+			const_iterator begin() const {return const_iterator{m_begin};}
+			const_iterator end() const {return const_iterator{m_end};}
+			size_t size() const {return m_count;}
+			bool empty() const {return m_count == 0;}
+	};
+
 	/**
 	 * @brief Holds everything found in a key bundle received from X3DH server
 	 * @note Data members are set once by constructor and then the object is used to pass this data around, so they all are const
@@ -73,6 +183,59 @@ namespace lime {
 		 */
 		X3DH_peerBundle(std::string &&deviceId) :
 		deviceId{deviceId}, Ik{}, SPk{}, SPk_id{0}, SPk_sig{}, bundleFlag{lime::X3DHKeyBundleFlag::noBundle}, OPk{}, OPk_id{0} {};
+		/**
+		 * @overload
+		 * copy a key bundle out of a message: the view must hold a bundle(flag is not noBundle)
+		 */
+		X3DH_peerBundle(const X3DH_peerBundleView<Curve> &view) :
+		deviceId{view.deviceId()}, Ik{view.Ik()}, SPk{view.SPk()}, SPk_id{view.SPk_id()}, SPk_sig{view.SPk_sig()}, bundleFlag{view.bundleFlag()},
+		OPk{(view.bundleFlag() == lime::X3DHKeyBundleFlag::OPk)?X<Curve, lime::Xtype::publicKey>{view.OPk()}:X<Curve, lime::Xtype::publicKey>{}},
+		OPk_id{(view.bundleFlag() == lime::X3DHKeyBundleFlag::OPk)?view.OPk_id():0} {};
+	};
+
+	/**
+	 * @brief Group the requests posted to the X3DH servers in batch messages
+	 *
+	 * Stands between the Lime users and the X3DH server post function given to the LimeManager.
+	 * While a batch is held, the requests are queued by server, curve and local device, each queue is sent in one batch message once the last hold is released.
+	 * A batch is posted on behalf of the local device of its requests, so the server trusts the devices it names only as it does for a single request.
+	 * With a shared credential, the requests of all the local devices go in the same queue.
+	 * The sub-responses are given to the response processing of each request, the requests posted meanwhile are batched too.
+	 * A server answering a batch with an error message does not support it: the requests are posted again one by one, as are the next ones to this server.
+	 */
+	class X3DHBatcher : public std::enable_shared_from_this<X3DHBatcher> {
+		private:
+			/// a request waiting to be sent
+			struct request {
+				std::string from;
+				std::vector<uint8_t> message;
+				limeX3DHServerResponseProcess responseProcess;
+				request(const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess) : from{from}, message{message}, responseProcess{responseProcess} {};
+			};
+
+			const limeX3DHServerPostData m_post; // the X3DH server post function
+			std::mutex m_mutex; // protect the members below
+			bool m_enabled; // when disabled, requests are always posted right away
+			bool m_sharedCredential; // all the local devices requests to a server go in the same batch
+			size_t m_holds; // requests are queued while it is not 0
+			std::map<std::tuple<std::string, uint8_t, std::string>, std::vector<request>> m_queued; // requests queued by server url, curve id and local device(empty with a shared credential)
+			std::set<std::string> m_unsupported; // url of the servers which do not support the batch message
+
+			void send(const std::string &url, const uint8_t curveId, std::vector<request> &&requests);
+			void process_response(const std::string &url, const uint8_t curveId, std::vector<request> &requests, int responseCode, const std::vector<uint8_t> &responseBody);
+
+		public:
+			explicit X3DHBatcher(const limeX3DHServerPostData &post) : m_post{post}, m_mutex{}, m_enabled{false}, m_sharedCredential{false}, m_holds{0}, m_queued{}, m_unsupported{} {};
+			X3DHBatcher(const X3DHBatcher &) = delete;
+			X3DHBatcher &operator=(const X3DHBatcher &) = delete;
+
+			void set_enabled(const bool enabled, const bool sharedCredential);
+			/// @brief same signature as limeX3DHServerPostData: post the request or queue it while a batch is held
+			void post(const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess);
+			/// @brief start queuing the requests, holds may nest
+			void hold();
+			/// @brief send the queued requests if this is the last hold
+			void release();
 	};
 
 	namespace x3dh_protocol {
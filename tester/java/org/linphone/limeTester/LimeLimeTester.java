@@ -22,6 +22,7 @@ import org.linphone.lime.*;
 import java.util.UUID;
 import java.io.File;
 import java.util.Arrays;
+import java.nio.ByteBuffer;
 
 public class LimeLimeTester {
 	/* Test Scenario:
@@ -1465,4 +1466,126 @@ public class LimeLimeTester {
 		file = new File(bobDbFilename);
 		file.delete();
 	}
+
+	/* Test Scenario:
+	 * - Alice and Bob register themselves on X3DH server
+	 * - Alice encrypts to Bob using direct ByteBuffers and the cipherMessage policy: the cipher message is in the buffer when encrypt returns
+	 * - Bob decrypts it using direct ByteBuffers, the DR message being copied in a direct buffer too
+	 * - Alice encrypts to Bob using direct ByteBuffers and the DRMessage policy: nothing is written in the cipher buffer
+	 * - Bob decrypts it with no cipher buffer
+	 * - encrypt with a non direct buffer must throw an exception
+	 * - Delete Alice and Bob devices to leave distant server base clean
+	 */
+	public static void directBuffers(LimeCurveId curveId, String dbBasename, String x3dhServerUrl, LimePostToX3DH postObj) {
+		int expected_success = 0;
+		int expected_fail = 0;
+
+		// Create a callback, this one will be used for all operations
+		LimeStatusCallbackImpl statusCallback = new LimeStatusCallbackImpl();
+
+		// Create db filenames and delete potential existing ones
+		String curveIdString;
+		if (curveId == LimeCurveId.C25519) {
+			curveIdString = ".C25519";
+		} else {
+			curveIdString = ".C448";
+		}
+		String aliceDbFilename = "alice."+dbBasename+curveIdString+".sqlite3";
+		String bobDbFilename = "bob."+dbBasename+curveIdString+".sqlite3";
+		File file = new File(aliceDbFilename);
+		file.delete();
+		file = new File(bobDbFilename);
+		file.delete();
+
+		try {
+			// Create random device ids
+			String aliceDeviceId = "alice."+UUID.randomUUID().toString();
+			String bobDeviceId = "bob."+UUID.randomUUID().toString();
+
+			// create Manager and devices
+			LimeManager aliceManager = new LimeManager(aliceDbFilename, postObj);
+			aliceManager.create_user(aliceDeviceId, x3dhServerUrl, curveId, 10, statusCallback);
+			LimeManager bobManager = new LimeManager(bobDbFilename, postObj);
+			bobManager.create_user(bobDeviceId, x3dhServerUrl, curveId, 10, statusCallback);
+			expected_success+=2;
+			assert (statusCallback.wait_for_success(expected_success));
+
+			byte[] pattern = LimeTesterUtils.patterns[0].getBytes();
+			ByteBuffer plainMessage = ByteBuffer.allocateDirect(pattern.length);
+			ByteBuffer cipherMessage = ByteBuffer.allocateDirect(pattern.length + 64);
+			ByteBuffer decodedMessage = ByteBuffer.allocateDirect(pattern.length + 64);
+
+			// cipher message policy: the cipher message is written in our buffer before encrypt returns
+			RecipientData[] recipients = new RecipientData[1];
+			recipients[0] = new RecipientData(bobDeviceId);
+			plainMessage.put(pattern);
+			plainMessage.flip();
+			aliceManager.encrypt(aliceDeviceId, "bob", recipients, plainMessage, cipherMessage, statusCallback, LimeEncryptionPolicy.CIPHERMESSAGE);
+			assert (plainMessage.remaining() == 0);
+			assert (cipherMessage.position() == pattern.length + 16):"cipher message is plain message size + auth tag";
+			expected_success+= 1;
+			assert (statusCallback.wait_for_success(expected_success));
+
+			ByteBuffer DRmessage = ByteBuffer.allocateDirect(recipients[0].DRmessage.length);
+			DRmessage.put(recipients[0].DRmessage);
+			DRmessage.flip();
+			cipherMessage.flip();
+			assert (bobManager.decrypt(bobDeviceId, "bob", aliceDeviceId, DRmessage, cipherMessage, decodedMessage) == LimePeerDeviceStatus.UNKNOWN);
+			decodedMessage.flip();
+			byte[] decoded = new byte[decodedMessage.remaining()];
+			decodedMessage.get(decoded);
+			assert (Arrays.equals(decoded, pattern)):"Decoded message is not the encoded one";
+
+			// DR message policy: nothing is written in the cipher buffer
+			recipients[0] = new RecipientData(bobDeviceId);
+			plainMessage.rewind();
+			cipherMessage.clear();
+			aliceManager.encrypt(aliceDeviceId, "bob", recipients, plainMessage, cipherMessage, statusCallback, LimeEncryptionPolicy.DRMESSAGE);
+			assert (cipherMessage.position() == 0);
+			expected_success+= 1;
+			assert (statusCallback.wait_for_success(expected_success));
+
+			DRmessage = ByteBuffer.allocateDirect(recipients[0].DRmessage.length);
+			DRmessage.put(recipients[0].DRmessage);
+			DRmessage.flip();
+			decodedMessage.clear();
+			assert (bobManager.decrypt(bobDeviceId, "bob", aliceDeviceId, DRmessage, null, decodedMessage) == LimePeerDeviceStatus.UNTRUSTED);
+			decodedMessage.flip();
+			decoded = new byte[decodedMessage.remaining()];
+			decodedMessage.get(decoded);
+			assert (Arrays.equals(decoded, pattern)):"Decoded message is not the encoded one";
+
+			// a heap buffer is refused
+			boolean gotException = false;
+			try {
+				recipients[0] = new RecipientData(bobDeviceId);
+				aliceManager.encrypt(aliceDeviceId, "bob", recipients, ByteBuffer.wrap(pattern), cipherMessage, statusCallback);
+			} catch (LimeException e) {
+				gotException = true;
+			}
+			assert (gotException):"encrypt shall refuse a non direct buffer";
+
+			// Cleaning
+			expected_success+= 2;
+			aliceManager.delete_user(aliceDeviceId, statusCallback);
+			bobManager.delete_user(bobDeviceId, statusCallback);
+			assert (statusCallback.wait_for_success(expected_success));
+			assert (statusCallback.fail == expected_fail);
+
+			// Do not forget do deallocate the native ressources
+			aliceManager.nativeDestructor();
+			bobManager.nativeDestructor();
+			aliceManager = null;
+			bobManager = null;
+		}
+		catch (LimeException e) {
+			assert(false):"Got an unexpected exception during direct buffers test : "+e.getMessage();
+		}
+
+		// Remove database files
+		file = new File(aliceDbFilename);
+		file.delete();
+		file = new File(bobDbFilename);
+		file.delete();
+	}
 }
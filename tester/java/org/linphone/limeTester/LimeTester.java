@@ -139,6 +139,12 @@ public class LimeTester {
 		if (enableC25519) LimeLimeTester.identityVerifiedStatus(LimeCurveId.C25519, "lime_identityVerifiedStatus", "https://localhost:25519", async_postObj);
 		if (enableC448) LimeLimeTester.identityVerifiedStatus(LimeCurveId.C448, "lime_identityVerifiedStatus", "https://localhost:25520", async_postObj);
 
+		/*
+		 * Lime direct ByteBuffers encrypt and decrypt
+		 */
+		if (enableC25519) LimeLimeTester.directBuffers(LimeCurveId.C25519, "lime_directBuffers", "https://localhost:25519", async_postObj);
+		if (enableC448) LimeLimeTester.directBuffers(LimeCurveId.C448, "lime_directBuffers", "https://localhost:25520", async_postObj);
+
 		System.exit(0);
 	}
 }
@@ -0,0 +1,729 @@
+/*
+	lime-bench.cpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Micro benchmarks of the lime core operations: unlike the massive group tester benchs, they do not need a X3DH server
+ * and each operation is timed on its own, setup work (building the messages to decrypt, dirtying the session to save...) is not accounted.
+ *
+ * Each operation is run a number of times, the statistics on the single run durations are written as a text table, CSV or JSON.
+ * The scalability bench runs the LimeManager operations from several threads at once, it also reports the time spent waiting on its mutexes.
+ */
+
+#include "lime_log.hpp"
+#include "lime-tester-utils.hpp"
+#include "lime_impl.hpp"
+#include "lime_double_ratchet_protocol.hpp"
+#include "lime_x3dh_protocol.hpp"
+
+#include <bctoolbox/exception.hh>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace::std;
+using namespace::lime;
+
+namespace lime {
+	/**
+	 * @brief Benchmark settings given on command line
+	 */
+	struct benchOptions {
+		size_t iterations; // number of timed runs of each operation, multi-recipients and batch operations use less
+		size_t messageSize; // plaintext size in bytes
+		uint16_t OPkBatchSize; // number of OPks generated in one batch
+		std::string filter; // run only the operations which name holds this string
+		bool keepDb; // do not delete the local storage files
+		std::chrono::milliseconds x3dhDelay; // delay applied by the in-process X3DH server to each response
+		size_t threadsMax; // the scalability bench runs with 1, 2, 4... threads up to this number
+		size_t users; // number of local users of the scalability bench
+		benchOptions() : iterations{200}, messageSize{256}, OPkBatchSize{100}, filter{}, keepDb{false}, x3dhDelay{0}, threadsMax{16}, users{8} {};
+	};
+
+	/**
+	 * @brief Statistics on the timed runs of one operation, durations are in nanoseconds per operation
+	 */
+	struct benchResult {
+		std::string curve;
+		std::string name;
+		size_t iterations;
+		double min;
+		double median;
+		double mean;
+		double p95;
+		double p99;
+		double max;
+		double stddev;
+		double throughput; // operations per second
+		double usersMutexWait; // time waiting for the LimeManager users cache mutex, only measured by the scalability bench
+		double DBMutexWait; // time waiting for the local storage mutex, only measured by the scalability bench
+	};
+
+	/**
+	 * @brief compute the statistics on the durations of the timed runs, throughput is the one of a single thread running them
+	 *
+	 * @param[in]		curve		curve name, to label the result
+	 * @param[in]		name		operation name, to label the result
+	 * @param[in,out]	durations	the runs durations in ns, sorted by this function
+	 */
+	static benchResult statistics(const std::string &curve, const std::string &name, std::vector<double> &durations) {
+		const size_t iterations = durations.size();
+		std::sort(durations.begin(), durations.end());
+		benchResult result{curve, name, iterations, durations.front(), 0, 0, 0, 0, durations.back(), 0, 0, 0, 0};
+		result.median = (iterations%2 == 1)?durations[iterations/2]:(durations[iterations/2 - 1] + durations[iterations/2])/2;
+		result.p95 = durations[std::min(iterations - 1, static_cast<size_t>(std::ceil(0.95*iterations)) - 1)];
+		result.p99 = durations[std::min(iterations - 1, static_cast<size_t>(std::ceil(0.99*iterations)) - 1)];
+		for (const auto d : durations) result.mean += d;
+		result.mean /= iterations;
+		for (const auto d : durations) result.stddev += (d - result.mean)*(d - result.mean);
+		result.stddev = std::sqrt(result.stddev/iterations);
+		result.throughput = (result.mean > 0)?1e9/result.mean:0;
+		return result;
+	}
+
+	/**
+	 * @brief Time each run of an operation, the prepare function is called before each run and is not accounted
+	 *
+	 * A tenth of the iterations (at least one) are run first as warm up and discarded
+	 *
+	 * @param[in]	curve		curve name, to label the result
+	 * @param[in]	name		operation name, to label the result
+	 * @param[in]	options		benchmark options, the operation is skipped if its name does not match the filter
+	 * @param[in]	iterations	number of timed runs
+	 * @param[in]	prepare		called before each run, gets the run index
+	 * @param[in]	operation	the timed operation, gets the run index
+	 * @param[out]	results		the statistics are appended to it
+	 */
+	template <typename Prepare, typename Operation>
+	static void measure(const std::string &curve, const std::string &name, const benchOptions &options, const size_t iterations, Prepare &&prepare, Operation &&operation, std::vector<benchResult> &results) {
+		if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+			return;
+		}
+
+		const size_t warmUp = std::max<size_t>(iterations/10, 1);
+		std::vector<double> durations(iterations);
+		for (size_t i=0; i<warmUp+iterations; i++) {
+			prepare(i);
+			auto start = std::chrono::steady_clock::now();
+			operation(i);
+			auto span = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+			if (i >= warmUp) {
+				durations[i-warmUp] = span;
+			}
+		}
+
+		auto result = statistics(curve, name, durations);
+		LIME_LOGI<<"Bench "<<curve<<" "<<name<<" median "<<result.median<<" ns";
+		results.push_back(std::move(result));
+	}
+
+	/// @overload without prepare function
+	template <typename Operation>
+	static void measure(const std::string &curve, const std::string &name, const benchOptions &options, const size_t iterations, Operation &&operation, std::vector<benchResult> &results) {
+		measure(curve, name, options, iterations, [](size_t){}, std::forward<Operation>(operation), results);
+	}
+
+	/**
+	 * @brief build the local storage file name for a benchmark and make sure it does not exist yet
+	 */
+	static std::string benchDbFilename(const std::string &curve, const std::string &name, std::vector<std::string> &createdDbFiles) {
+		std::string filename{"lime-bench."};
+		filename.append(curve).append(".").append(name).append(".sqlite3");
+		remove(filename.data());
+		createdDbFiles.push_back(filename);
+		return filename;
+	}
+
+	static const char *policyName(const lime::EncryptionPolicy policy) {
+		switch (policy) {
+			case lime::EncryptionPolicy::DRMessage: return "DRMessage";
+			case lime::EncryptionPolicy::cipherMessage: return "cipherMessage";
+			case lime::EncryptionPolicy::optimizeUploadSize: return "optimizeUploadSize";
+			case lime::EncryptionPolicy::optimizeGlobalBandwidth: return "optimizeGlobalBandwidth";
+		}
+		return "unknown";
+	}
+
+	/**
+	 * @brief Double Ratchet session operations between two devices: ratchetEncrypt, ratchetDecrypt, skipped message key decrypt, session save and load
+	 *
+	 * The decryptions save the session as they always do, the encryption does not
+	 */
+	template <typename Curve>
+	static void bench_DR(const std::string &curve, const benchOptions &options, std::vector<benchResult> &results, std::vector<std::string> &createdDbFiles) {
+		auto RNG_context = make_RNG();
+		std::shared_ptr<DR<Curve>> alice{}, bob{};
+		std::shared_ptr<lime::Db> aliceStorage{}, bobStorage{};
+		lime_tester::dr_sessionsInit(alice, bob, aliceStorage, bobStorage,
+				benchDbFilename(curve, "DR.alice", createdDbFiles), std::make_shared<std::recursive_mutex>(),
+				benchDbFilename(curve, "DR.bob", createdDbFiles), std::make_shared<std::recursive_mutex>(), true, RNG_context);
+
+		std::vector<uint8_t> AD(32);
+		std::vector<uint8_t> plaintext(options.messageSize);
+		lime_tester::randomize(AD.data(), AD.size());
+		lime_tester::randomize(plaintext.data(), plaintext.size());
+		std::vector<uint8_t> ciphertext{};
+		std::vector<uint8_t> decrypted{};
+
+		auto decrypt = [&AD, &decrypted](std::shared_ptr<DR<Curve>> &session, const std::vector<uint8_t> &message) {
+			if (session->ratchetDecrypt(message, AD, decrypted, true) == false) {
+				throw BCTBX_EXCEPTION << "lime-bench: DR decryption failed";
+			}
+		};
+
+		// complete the sessions init: one message each way
+		alice->ratchetEncrypt(plaintext, AD, ciphertext, true);
+		decrypt(bob, ciphertext);
+		bob->ratchetEncrypt(plaintext, AD, ciphertext, true);
+		decrypt(alice, ciphertext);
+
+		// in order decryption, the messages are produced in the same sending chain
+		measure(curve, "ratchetDecrypt", options, options.iterations,
+			[&](size_t) {alice->ratchetEncrypt(plaintext, AD, ciphertext, true, false);},
+			[&](size_t) {decrypt(bob, ciphertext);},
+			results);
+
+		// decryption with a skipped message key: a batch of messages is produced, the last one is decrypted first so the others are found in the skipped keys
+		constexpr size_t skippedBatchSize = 16;
+		std::vector<std::vector<uint8_t>> skipped(skippedBatchSize + 1);
+		measure(curve, "skipped key decrypt", options, options.iterations,
+			[&](size_t i) {
+				if (i%skippedBatchSize == 0) {
+					for (auto &message : skipped) {
+						alice->ratchetEncrypt(plaintext, AD, message, true, false);
+					}
+					decrypt(bob, skipped.back());
+				}
+			},
+			[&](size_t i) {decrypt(bob, skipped[i%skippedBatchSize]);},
+			results);
+
+		// session save: a message is encrypted without saving, then the session is saved
+		std::vector<std::shared_ptr<DR<Curve>>> sessions{alice};
+		measure(curve, "session_save", options, options.iterations,
+			[&](size_t) {alice->ratchetEncrypt(plaintext, AD, ciphertext, true, false);},
+			[&](size_t) {DR<Curve>::sessions_save(sessions);},
+			results);
+
+		const auto sessionId = alice->dbSessionId();
+		measure(curve, "session_load", options, options.iterations,
+			[&](size_t) {auto loaded = std::make_shared<DR<Curve>>(aliceStorage, sessionId, RNG_context);},
+			results);
+
+		// this one runs last as it moves alice sending chain without bob decrypting
+		measure(curve, "ratchetEncrypt", options, options.iterations,
+			[&](size_t) {alice->ratchetEncrypt(plaintext, AD, ciphertext, true, false);},
+			results);
+	}
+
+	/**
+	 * @brief Message encryption to 1, 10, 100 and 1000 recipient devices, with each encryption policy
+	 *
+	 * The sender sessions are created with random keys: the recipients never decrypt. encryptMessage saves the sessions.
+	 */
+	template <typename Curve>
+	static void bench_encryptMessage(const std::string &curve, const benchOptions &options, std::vector<benchResult> &results, std::vector<std::string> &createdDbFiles) {
+		auto RNG_context = make_RNG();
+		const std::string recipientUserId{"sip:bench-group@example.org"};
+		const std::string sourceDeviceId{"sip:bench-sender@example.org"};
+		std::vector<uint8_t> plaintext(options.messageSize);
+		lime_tester::randomize(plaintext.data(), plaintext.size());
+		std::vector<uint8_t> cipherMessage{};
+		const lime::EncryptionPolicy policies[] = {lime::EncryptionPolicy::DRMessage, lime::EncryptionPolicy::cipherMessage, lime::EncryptionPolicy::optimizeUploadSize, lime::EncryptionPolicy::optimizeGlobalBandwidth};
+
+		for (const size_t recipientsCount : {1, 10, 100, 1000}) {
+			auto localStorage = std::make_shared<lime::Db>(benchDbFilename(curve, "encryptMessage."+std::to_string(recipientsCount), createdDbFiles), std::make_shared<std::recursive_mutex>());
+
+			// a local user, its peer devices and a sender session with each of them
+			long int Uid = 0;
+			localStorage->sql<<"INSERT INTO lime_LocalUsers(UserId, Ik, server) VALUES ('bench', 1, 'bench')";
+			localStorage->sql<<"select last_insert_rowid()",soci::into(Uid);
+			std::vector<std::string> deviceIds{};
+			std::vector<std::shared_ptr<DR<Curve>>> sessions{};
+			const std::vector<uint8_t> X3DH_initMessage{};
+			const DSA<Curve, lime::DSAtype::publicKey> dummyPeerIk{};
+			{
+				soci::transaction tr(localStorage->sql);
+				for (size_t i=0; i<recipientsCount; i++) {
+					deviceIds.push_back("sip:bench-recipient@example.org;gr=" + std::to_string(i));
+					long int Did = 0;
+					localStorage->sql<<"INSERT INTO lime_PeerDevices(DeviceId, Ik) VALUES (:deviceId, 1)", soci::use(deviceIds.back());
+					localStorage->sql<<"select last_insert_rowid()",soci::into(Did);
+
+					Xpair<Curve> peerKeyPair{};
+					X_generateKeyPair<Curve>(peerKeyPair, *RNG_context);
+					DRChainKey SK{};
+					SharedADBuffer AD{};
+					lime_tester::randomize(SK.data(), SK.size());
+					lime_tester::randomize(AD.data(), AD.size());
+					sessions.push_back(std::make_shared<DR<Curve>>(localStorage, SK, AD, peerKeyPair.publicKey(), Did, deviceIds.back(), dummyPeerIk, Uid, X3DH_initMessage, RNG_context));
+				}
+				tr.commit();
+			}
+
+			std::vector<RecipientInfos<Curve>> recipients{};
+			const size_t iterations = std::max<size_t>(options.iterations/recipientsCount, 10);
+			for (const auto policy : policies) {
+				measure(curve, "encryptMessage/" + std::to_string(recipientsCount) + "/" + policyName(policy), options, iterations,
+					[&](size_t) {
+						recipients.clear();
+						for (size_t i=0; i<recipientsCount; i++) {
+							recipients.emplace_back(deviceIds[i], sessions[i]);
+						}
+					},
+					[&](size_t) {encryptMessage(recipients, plaintext, recipientUserId, sourceDeviceId, cipherMessage, policy);},
+					results);
+			}
+		}
+	}
+
+	/**
+	 * @brief X3DH session init on sender and receiver side, OPk batch generation
+	 *
+	 * Nothing is published: the peer bundle is built directly from the receiver local storage
+	 */
+	template <typename Curve>
+	struct LimeBench {
+		static void run(const std::string &curve, const benchOptions &options, std::vector<benchResult> &results, std::vector<std::string> &createdDbFiles) {
+			const std::string aliceDeviceId{"sip:bench-alice@example.org;gr=alice"};
+			const std::string bobDeviceId{"sip:bench-bob@example.org;gr=bob"};
+			limeX3DHServerPostData X3DHServerPost([](const std::string &, const std::string &, const std::vector<uint8_t> &, const limeX3DHServerResponseProcess &) {
+				throw BCTBX_EXCEPTION << "lime-bench does not use any X3DH server";
+			});
+			auto alice = std::make_shared<Lime<Curve>>(std::make_shared<lime::Db>(benchDbFilename(curve, "X3DH.alice", createdDbFiles), std::make_shared<std::recursive_mutex>()), aliceDeviceId, "https://bench.invalid", X3DHServerPost);
+			auto bob = std::make_shared<Lime<Curve>>(std::make_shared<lime::Db>(benchDbFilename(curve, "X3DH.bob", createdDbFiles), std::make_shared<std::recursive_mutex>()), bobDeviceId, "https://bench.invalid", X3DHServerPost);
+
+			// bob key bundle
+			X<Curve, lime::Xtype::publicKey> SPk{};
+			DSA<Curve, lime::DSAtype::signature> SPk_sig{};
+			uint32_t SPk_id = 0;
+			bob->X3DH_generate_SPk(SPk, SPk_sig, SPk_id);
+			std::vector<X<Curve, lime::Xtype::publicKey>> OPks{};
+			std::vector<uint32_t> OPk_ids{};
+			bob->X3DH_generate_OPks(OPks, OPk_ids, 1);
+			std::vector<uint8_t> Ik{};
+			bob->get_Ik(Ik);
+			const std::vector<uint8_t> SPkBuffer{SPk.cbegin(), SPk.cend()};
+			const std::vector<uint8_t> SPk_sigBuffer{SPk_sig.cbegin(), SPk_sig.cend()};
+			const std::vector<uint8_t> OPkBuffer{OPks[0].cbegin(), OPks[0].cend()};
+			std::vector<X3DH_peerBundle<Curve>> peerBundles{};
+			peerBundles.emplace_back(std::string{bobDeviceId}, Ik.cbegin(), SPkBuffer.cbegin(), SPk_id, SPk_sigBuffer.cbegin(), OPkBuffer.cbegin(), OPk_ids[0]);
+
+			// each run replaces the previous session in cache
+			measure(curve, "X3DH sender init", options, options.iterations,
+				[&](size_t) {alice->X3DH_init_sender_session(peerBundles);},
+				results);
+
+			// get a X3DH init message from a sender session
+			auto session = alice->m_DR_sessions_cache.find(bobDeviceId);
+			if (session == alice->m_DR_sessions_cache.end()) { // the sender init was filtered out
+				alice->X3DH_init_sender_session(peerBundles);
+				session = alice->m_DR_sessions_cache.find(bobDeviceId);
+			}
+			std::vector<uint8_t> DRmessage{};
+			std::vector<uint8_t> X3DH_initMessage{};
+			session->second->ratchetEncrypt(Ik, Ik, DRmessage, true, false);
+			if (lime_tester::DR_message_extractX3DHInit(DRmessage, X3DH_initMessage) == false) {
+				throw BCTBX_EXCEPTION << "lime-bench: sender session message does not hold a X3DH init";
+			}
+
+			// the session is never saved so the OPk stays in local storage
+			measure(curve, "X3DH receiver init", options, options.iterations,
+				[&](size_t) {auto receiverSession = bob->X3DH_init_receiver_session(X3DH_initMessage, aliceDeviceId);},
+				results);
+
+			measure(curve, "OPk batch generation/" + std::to_string(options.OPkBatchSize), options, std::max<size_t>(options.iterations/10, 5),
+				[&](size_t) {bob->X3DH_generate_OPks(OPks, OPk_ids, options.OPkBatchSize);},
+				results);
+		}
+	};
+
+	/**
+	 * @brief LimeManager operations end to end, the X3DH server is the in-process one
+	 *
+	 * The timings include the X3DH server round trips and the local storage accesses
+	 */
+	template <typename Curve>
+	static void bench_manager(const std::string &curve, const benchOptions &options, std::vector<benchResult> &results, std::vector<std::string> &createdDbFiles) {
+		auto server = std::make_shared<lime_tester::X3DHLoopbackServer>(options.x3dhDelay);
+		limeX3DHServerPostData X3DHServerPost([server](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess) {
+			server->post(url, from, message, responseProcess);
+		});
+		const std::string x3dh_server_url{"https://loopback.invalid"};
+		size_t callbacks = 0;
+		std::string failure{};
+		limeCallback callback([&callbacks, &failure](lime::CallbackReturn returnCode, std::string anythingToSay) {
+			if (returnCode != lime::CallbackReturn::success) {
+				failure = anythingToSay;
+			}
+			callbacks++;
+		});
+		// deliver the server responses until the pending operation completes
+		auto complete = [&server, &callbacks, &failure]() {
+			const auto expected = callbacks + 1;
+			while (callbacks < expected) {
+				if (server->process() == 0) std::this_thread::yield();
+			}
+			if (!failure.empty()) {
+				throw BCTBX_EXCEPTION << "lime-bench: LimeManager operation failed : "<<failure;
+			}
+		};
+
+		std::unique_ptr<LimeManager> aliceManager(new LimeManager(benchDbFilename(curve, "manager.alice", createdDbFiles), X3DHServerPost));
+		std::unique_ptr<LimeManager> bobManager(new LimeManager(benchDbFilename(curve, "manager.bob", createdDbFiles), X3DHServerPost));
+		const std::string aliceDeviceId{"sip:bench-alice@example.org;gr=alice"};
+		const uint16_t OPkBatchSize = std::min<uint16_t>(options.OPkBatchSize, 100);
+		aliceManager->create_user(aliceDeviceId, x3dh_server_url, Curve::curveId(), OPkBatchSize, callback);
+		complete();
+
+		// each run, warm up included, registers a new device
+		std::vector<std::string> bobDeviceIds{};
+		const size_t iterations = std::max<size_t>(options.iterations/10, 5);
+		auto createBob = [&](size_t i) {
+			bobDeviceIds.push_back("sip:bench-bob@example.org;gr=" + std::to_string(i));
+			bobManager->create_user(bobDeviceIds.back(), x3dh_server_url, Curve::curveId(), OPkBatchSize, callback);
+			complete();
+		};
+		measure(curve, "LimeManager create_user", options, iterations, createBob, results);
+		if (bobDeviceIds.empty()) { // create user was filtered out
+			for (size_t i=0; i<iterations + std::max<size_t>(iterations/10, 1); i++) {
+				createBob(i);
+			}
+		}
+
+		std::vector<uint8_t> plaintext(options.messageSize);
+		lime_tester::randomize(plaintext.data(), plaintext.size());
+		auto message = std::make_shared<const std::vector<uint8_t>>(plaintext);
+		auto recipientUserId = std::make_shared<const std::string>("sip:bench-bob@example.org");
+		std::shared_ptr<std::vector<RecipientData>> recipients{};
+		auto cipherMessage = std::make_shared<std::vector<uint8_t>>();
+
+		// first message to each bob device: fetch its key bundle and build the session. Same number of runs as create_user so each one targets a new device
+		measure(curve, "LimeManager encrypt/first contact", options, iterations,
+			[&](size_t i) {
+				recipients = std::make_shared<std::vector<RecipientData>>();
+				recipients->emplace_back(bobDeviceIds[i]);
+			},
+			[&](size_t) {
+				aliceManager->encrypt(aliceDeviceId, recipientUserId, recipients, message, cipherMessage, callback);
+				complete();
+			},
+			results);
+
+		// the sessions with all bob devices are now in place
+		measure(curve, "LimeManager encrypt/" + std::to_string(bobDeviceIds.size()) + " recipients", options, options.iterations,
+			[&](size_t) {
+				recipients = std::make_shared<std::vector<RecipientData>>();
+				for (const auto &bobDeviceId : bobDeviceIds) {
+					recipients->emplace_back(bobDeviceId);
+				}
+			},
+			[&](size_t) {
+				aliceManager->encrypt(aliceDeviceId, recipientUserId, recipients, message, cipherMessage, callback);
+				complete();
+			},
+			results);
+	}
+
+	/**
+	 * @brief One LimeManager driven by 1, 2, 4... threads, each running encryptions and decryptions between the manager local users
+	 *
+	 * The sessions between the users are in place before the timed runs so the operations never wait for the X3DH server.
+	 * The throughput is the one of all the threads together, the mutexes waiting time is given by the manager metrics(enabled during the runs)
+	 * and is averaged per operation.
+	 */
+	template <typename Curve>
+	static void bench_scalability(const std::string &curve, const benchOptions &options, std::vector<benchResult> &results, std::vector<std::string> &createdDbFiles) {
+		const std::string benchName{"LimeManager scalability"};
+		if (!options.filter.empty() && benchName.find(options.filter) == std::string::npos) {
+			return;
+		}
+
+		auto server = std::make_shared<lime_tester::X3DHLoopbackServer>(options.x3dhDelay);
+		limeX3DHServerPostData X3DHServerPost([server](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess) {
+			server->post(url, from, message, responseProcess);
+		});
+		const std::string x3dh_server_url{"https://loopback.invalid"};
+		size_t callbacks = 0;
+		std::string failure{};
+		limeCallback callback([&callbacks, &failure](lime::CallbackReturn returnCode, std::string anythingToSay) {
+			if (returnCode != lime::CallbackReturn::success) {
+				failure = anythingToSay;
+			}
+			callbacks++;
+		});
+		// deliver the server responses until the pending operation completes
+		auto complete = [&server, &callbacks, &failure]() {
+			const auto expected = callbacks + 1;
+			while (callbacks < expected) {
+				if (server->process() == 0) std::this_thread::yield();
+			}
+			if (!failure.empty()) {
+				throw BCTBX_EXCEPTION << "lime-bench: LimeManager operation failed : "<<failure;
+			}
+		};
+
+		std::unique_ptr<LimeManager> manager(new LimeManager(benchDbFilename(curve, "scalability", createdDbFiles), X3DHServerPost));
+		const size_t usersCount = std::max<size_t>(options.users, 2);
+		const uint16_t OPkBatchSize = std::min<uint16_t>(options.OPkBatchSize, 10);
+		std::vector<std::string> deviceIds{};
+		for (size_t i=0; i<usersCount; i++) {
+			deviceIds.push_back("sip:bench-user@example.org;gr=" + std::to_string(i));
+			manager->create_user(deviceIds.back(), x3dh_server_url, Curve::curveId(), OPkBatchSize, callback);
+			complete();
+		}
+
+		std::vector<uint8_t> plaintext(options.messageSize);
+		lime_tester::randomize(plaintext.data(), plaintext.size());
+		auto message = std::make_shared<const std::vector<uint8_t>>(plaintext);
+		auto recipientUserId = std::make_shared<const std::string>("sip:bench-user@example.org");
+
+		// each user sends to the next one: establish these sessions
+		for (size_t i=0; i<usersCount; i++) {
+			auto recipients = std::make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(deviceIds[(i+1)%usersCount]);
+			auto cipherMessage = std::make_shared<std::vector<uint8_t>>();
+			manager->encrypt(deviceIds[i], recipientUserId, recipients, message, cipherMessage, callback);
+			complete();
+			std::vector<uint8_t> decrypted{};
+			if (manager->decrypt(deviceIds[(i+1)%usersCount], *recipientUserId, deviceIds[i], (*recipients)[0].DRmessage, *cipherMessage, decrypted) == lime::PeerDeviceStatus::fail) {
+				throw BCTBX_EXCEPTION << "lime-bench: scalability session setup failed";
+			}
+		}
+
+		for (size_t threadsCount=1; threadsCount<=options.threadsMax; threadsCount*=2) {
+			// each thread times its operations, the first error met stops all of them
+			std::vector<std::vector<double>> durations(threadsCount);
+			std::atomic<bool> failed{false};
+			std::string threadFailure{};
+			std::mutex failureMutex{};
+			auto run = [&](const size_t t) {
+				try {
+					auto &threadDurations = durations[t];
+					threadDurations.reserve(2*options.iterations);
+					for (size_t k=0; k<options.iterations && !failed.load(); k++) {
+						const auto sender = (t + k)%usersCount;
+						const auto recipient = (sender + 1)%usersCount;
+						auto recipients = std::make_shared<std::vector<RecipientData>>();
+						recipients->emplace_back(deviceIds[recipient]);
+						auto cipherMessage = std::make_shared<std::vector<uint8_t>>();
+						bool encrypted = false;
+						auto start = std::chrono::steady_clock::now();
+						// the session exists: the callback is called before encrypt returns
+						manager->encrypt(deviceIds[sender], recipientUserId, recipients, message, cipherMessage, [&encrypted](lime::CallbackReturn returnCode, std::string) {
+							encrypted = (returnCode == lime::CallbackReturn::success);
+						});
+						threadDurations.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+						if (!encrypted) {
+							throw BCTBX_EXCEPTION << "lime-bench: scalability encryption did not complete synchronously";
+						}
+
+						std::vector<uint8_t> decrypted{};
+						start = std::chrono::steady_clock::now();
+						const auto status = manager->decrypt(deviceIds[recipient], *recipientUserId, deviceIds[sender], (*recipients)[0].DRmessage, *cipherMessage, decrypted);
+						threadDurations.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+						if (status == lime::PeerDeviceStatus::fail) {
+							throw BCTBX_EXCEPTION << "lime-bench: scalability decryption failed";
+						}
+					}
+				} catch (BctbxException const &e) {
+					std::lock_guard<std::mutex> lock(failureMutex);
+					if (!failed.exchange(true)) threadFailure = e.str();
+				}
+			};
+
+			manager->reset_metrics();
+			manager->set_metricsEnabled(true);
+			std::vector<std::thread> threads{};
+			const auto start = std::chrono::steady_clock::now();
+			for (size_t t=0; t<threadsCount; t++) {
+				threads.emplace_back(run, t);
+			}
+			for (auto &thread : threads) {
+				thread.join();
+			}
+			const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+			manager->set_metricsEnabled(false);
+			if (failed.load()) {
+				throw BCTBX_EXCEPTION << threadFailure;
+			}
+
+			std::vector<double> allDurations{};
+			for (const auto &threadDurations : durations) {
+				allDurations.insert(allDurations.end(), threadDurations.cbegin(), threadDurations.cend());
+			}
+			lime::Metrics metrics{};
+			manager->get_metrics(metrics);
+			auto result = statistics(curve, benchName + "/" + std::to_string(usersCount) + " users/" + std::to_string(threadsCount) + " threads", allDurations);
+			result.throughput = (elapsed > 0)?1e9*result.iterations/elapsed:0;
+			result.usersMutexWait = static_cast<double>(metrics.usersMutexWaitTime)/result.iterations;
+			result.DBMutexWait = static_cast<double>(metrics.DBMutexWaitTime)/result.iterations;
+			LIME_LOGI<<"Bench "<<curve<<" "<<result.name<<" "<<result.throughput<<" ops/s";
+			results.push_back(std::move(result));
+		}
+	}
+
+	template <typename Curve>
+	static void bench_curve(const std::string &curve, const benchOptions &options, std::vector<benchResult> &results, std::vector<std::string> &createdDbFiles) {
+		bench_DR<Curve>(curve, options, results, createdDbFiles);
+		bench_encryptMessage<Curve>(curve, options, results, createdDbFiles);
+		LimeBench<Curve>::run(curve, options, results, createdDbFiles);
+		bench_manager<Curve>(curve, options, results, createdDbFiles);
+		bench_scalability<Curve>(curve, options, results, createdDbFiles);
+	}
+
+	static void write_results(std::ostream &out, const std::string &format, const std::vector<benchResult> &results) {
+		if (format == "json") {
+			out<<"["<<endl;
+			for (size_t i=0; i<results.size(); i++) {
+				const auto &r = results[i];
+				out<<"  {\"curve\": \""<<r.curve<<"\", \"operation\": \""<<r.name<<"\", \"iterations\": "<<r.iterations
+					<<", \"min_ns\": "<<r.min<<", \"median_ns\": "<<r.median<<", \"mean_ns\": "<<r.mean<<", \"p95_ns\": "<<r.p95<<", \"p99_ns\": "<<r.p99
+					<<", \"max_ns\": "<<r.max<<", \"stddev_ns\": "<<r.stddev<<", \"ops_per_s\": "<<r.throughput
+					<<", \"users_mutex_wait_ns\": "<<r.usersMutexWait<<", \"db_mutex_wait_ns\": "<<r.DBMutexWait<<"}"<<((i+1<results.size())?",":"")<<endl;
+			}
+			out<<"]"<<endl;
+		} else if (format == "csv") {
+			out<<"curve,operation,iterations,min_ns,median_ns,mean_ns,p95_ns,p99_ns,max_ns,stddev_ns,ops_per_s,users_mutex_wait_ns,db_mutex_wait_ns"<<endl;
+			for (const auto &r : results) {
+				out<<r.curve<<","<<r.name<<","<<r.iterations<<","<<r.min<<","<<r.median<<","<<r.mean<<","<<r.p95<<","<<r.p99<<","<<r.max<<","<<r.stddev
+					<<","<<r.throughput<<","<<r.usersMutexWait<<","<<r.DBMutexWait<<endl;
+			}
+		} else {
+			out<<std::left<<std::setw(6)<<"curve"<<std::setw(48)<<"operation"<<std::right<<std::setw(8)<<"runs"
+				<<std::setw(12)<<"min us"<<std::setw(12)<<"median us"<<std::setw(12)<<"mean us"<<std::setw(12)<<"p95 us"<<std::setw(12)<<"p99 us"<<std::setw(12)<<"max us"<<std::setw(12)<<"stddev us"
+				<<std::setw(12)<<"ops/s"<<std::setw(14)<<"users wait us"<<std::setw(12)<<"db wait us"<<endl;
+			out<<std::fixed<<std::setprecision(2);
+			for (const auto &r : results) {
+				out<<std::left<<std::setw(6)<<r.curve<<std::setw(48)<<r.name<<std::right<<std::setw(8)<<r.iterations
+					<<std::setw(12)<<r.min/1000<<std::setw(12)<<r.median/1000<<std::setw(12)<<r.mean/1000<<std::setw(12)<<r.p95/1000<<std::setw(12)<<r.p99/1000<<std::setw(12)<<r.max/1000<<std::setw(12)<<r.stddev/1000
+					<<std::setw(12)<<r.throughput<<std::setw(14)<<r.usersMutexWait/1000<<std::setw(12)<<r.DBMutexWait/1000<<endl;
+			}
+		}
+	}
+} // namespace lime
+
+static const char *bench_helper =
+		"\t\t\t--iterations <timed runs of each operation>, default : 200\n"
+		"\t\t\t--message-size <plaintext size in bytes>, default : 256\n"
+		"\t\t\t--OPk-batch-size <OPks generated in one batch>, default : 100\n"
+#if defined(EC25519_ENABLED) && defined(EC448_ENABLED)
+		"\t\t\t--curve <c25519|c448>, default : both\n"
+#endif
+		"\t\t\t--filter <run only the operations which name holds this string>\n"
+		"\t\t\t--format <text|csv|json>, default : text\n"
+		"\t\t\t--output <results file path>, default : standard output\n"
+		"\t\t\t--x3dh-delay <delay in ms applied to each response of the in-process X3DH server>, default : 0\n"
+		"\t\t\t--threads-max <the scalability bench runs with 1, 2, 4... threads up to this number>, default : 16\n"
+		"\t\t\t--users <local users of the scalability bench>, default : 8\n"
+		"\t\t\t--keep-tmp-db, when set don't delete temporary db files created by the benchmarks\n"
+		"\t\t\t--verbose";
+
+int main(int argc, char *argv[]) {
+	lime::benchOptions options{};
+	std::string curve{};
+	std::string format{"text"};
+	std::string outputFile{};
+
+	// do not slow down the benchmarks with the lime logs
+	bctbx_set_log_level(BCTBX_LOG_DOMAIN, BCTBX_LOG_WARNING);
+
+	for (int i = 1; i < argc; ++i) {
+		auto nextArg = [&i, argc, argv]() {
+			if (++i >= argc) {
+				std::cerr<<"Missing argument for "<<argv[i-1]<<endl;
+				exit(-1);
+			}
+			return std::string{argv[i]};
+		};
+		if (strcmp(argv[i],"--iterations")==0) {
+			options.iterations = std::max(std::stoul(nextArg()), 1UL);
+		} else if (strcmp(argv[i],"--message-size")==0) {
+			options.messageSize = std::stoul(nextArg());
+		} else if (strcmp(argv[i],"--OPk-batch-size")==0) {
+			options.OPkBatchSize = static_cast<uint16_t>(std::stoul(nextArg()));
+		} else if (strcmp(argv[i],"--curve")==0) {
+			curve = nextArg();
+		} else if (strcmp(argv[i],"--filter")==0) {
+			options.filter = nextArg();
+		} else if (strcmp(argv[i],"--format")==0) {
+			format = nextArg();
+		} else if (strcmp(argv[i],"--output")==0) {
+			outputFile = nextArg();
+		} else if (strcmp(argv[i],"--x3dh-delay")==0) {
+			options.x3dhDelay = std::chrono::milliseconds{std::stoul(nextArg())};
+		} else if (strcmp(argv[i],"--threads-max")==0) {
+			options.threadsMax = std::max(std::stoul(nextArg()), 1UL);
+		} else if (strcmp(argv[i],"--users")==0) {
+			options.users = std::stoul(nextArg());
+		} else if (strcmp(argv[i],"--keep-tmp-db")==0) {
+			options.keepDb = true;
+		} else if (strcmp(argv[i],"--verbose")==0) {
+			bctbx_set_log_level(BCTBX_LOG_DOMAIN, BCTBX_LOG_DEBUG);
+		} else {
+			std::cerr<<"Usage: "<<argv[0]<<endl<<bench_helper<<endl;
+			return (strcmp(argv[i],"--help")==0)?0:-1;
+		}
+	}
+	if (format != "text" && format != "csv" && format != "json") {
+		std::cerr<<"Unknown output format "<<format<<endl;
+		return -1;
+	}
+
+	std::vector<lime::benchResult> results{};
+	std::vector<std::string> createdDbFiles{};
+	try {
+#ifdef EC25519_ENABLED
+		if (curve.empty() || curve == "c25519") {
+			lime::bench_curve<C255>("C255", options, results, createdDbFiles);
+		}
+#endif
+#ifdef EC448_ENABLED
+		if (curve.empty() || curve == "c448") {
+			lime::bench_curve<C448>("C448", options, results, createdDbFiles);
+		}
+#endif
+	} catch (BctbxException const &e) {
+		LIME_LOGE<<"lime-bench failed: "<<e;
+		return -1;
+	}
+
+	if (!options.keepDb) {
+		for (const auto &filename : createdDbFiles) {
+			remove(filename.data());
+		}
+	}
+
+	if (outputFile.empty()) {
+		lime::write_results(std::cout, format, results);
+	} else {
+		std::ofstream out(outputFile);
+		lime::write_results(out, format, results);
+	}
+	return 0;
+}
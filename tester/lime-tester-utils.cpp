@@ -21,11 +21,14 @@
 #include <vector>
 #include <string>
 #include <mutex>
+#include <tuple>
+#include <set>
 #include "lime_settings.hpp"
 #include "lime/lime.hpp"
 #include "lime_keys.hpp"
 #include "lime_crypto_primitives.hpp"
 #include "lime_double_ratchet_protocol.hpp"
+#include "lime_x3dh_protocol.hpp"
 #include "lime-tester-utils.hpp"
 
 #include <bctoolbox/exception.hh>
@@ -48,9 +51,17 @@ std::uniform_int_distribution<int> uniform_dist(0,255);
 // default value for the timeout
 int wait_for_timeout=4000;
 
+// in-process X3DH server, used instead of the nodejs one when set
+std::shared_ptr<X3DHLoopbackServer> x3dhLoopbackServer{nullptr};
+
 // default value for initial OPk batch size, keep it small so not too many OPks generated
 uint16_t OPkInitialBatchSize=3;
 
+// group scale bench settings
+int groupScaleMaxDevices=5000;
+std::string groupScaleFormat{"csv"};
+std::string groupScaleReport{};
+
 // messages with calibrated length to test the optimize encryption policies
 // with a short one, any optimize policy shall go for the DRmessage encryption
 std::string shortMessage{"Short Message"};
@@ -430,12 +441,14 @@ unsigned int get_StoredMessageKeyCount(const std::string &dbFilename, const std:
 	try {
 		soci::session sql("sqlite3", dbFilename); // open the DB
 		unsigned int mkCount=0;
-		sql<< "SELECT count(m.MK) FROM DR_sessions as s INNER JOIN lime_PeerDevices as d on s.Did = d.Did INNER JOIN lime_LocalUsers as u on u.Uid = s.Uid INNER JOIN DR_MSk_DHr as c on c.sessionId = s.sessionId INNER JOIN DR_MSk_Mk as m ON m.DHid=c.DHid WHERE u.UserId = :selfId AND d.DeviceId = :peerId ORDER BY s.Status DESC, s.Did;", into(mkCount), use(selfDeviceId), use(peerDeviceId);
-		if (sql.got_data()) {
-			return mkCount;
-		} else {
-			return 0;
+		// keys are stored by chunks, each one holding a mask of the keys it stores
+		rowset<int> rs = (sql.prepare << "SELECT m.mask FROM DR_sessions as s INNER JOIN lime_PeerDevices as d on s.Did = d.Did INNER JOIN lime_LocalUsers as u on u.Uid = s.Uid INNER JOIN DR_MSk_DHr as c on c.sessionId = s.sessionId INNER JOIN DR_MSk_MK as m ON m.DHid=c.DHid WHERE u.UserId = :selfId AND d.DeviceId = :peerId;", use(selfDeviceId), use(peerDeviceId));
+		for (auto mask : rs) {
+			for (; mask != 0; mask >>= 1) {
+				mkCount += mask & 1;
+			}
 		}
+		return mkCount;
 
 	} catch (exception &e) { // swallow any error on DB
 		LIME_LOGE<<"Got an error while getting the MK count in DB: "<<e.what();
@@ -443,6 +456,18 @@ unsigned int get_StoredMessageKeyCount(const std::string &dbFilename, const std:
 	}
 }
 
+unsigned int get_DRsessionsWithoutDHr(const std::string &dbFilename, const std::string &selfDeviceId, const std::string &peerDeviceId) noexcept{
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		int count=0;
+		sql<<"SELECT count(*) FROM DR_sessions as s INNER JOIN lime_PeerDevices as d on s.Did = d.Did INNER JOIN lime_LocalUsers as u on u.Uid = s.Uid WHERE u.UserId = :selfId AND d.DeviceId = :peerId AND s.DHr IS NULL;", into(count), use(selfDeviceId), use(peerDeviceId);
+		return static_cast<unsigned int>(count);
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while counting the sessions without DHr in DB: "<<e.what();
+		return 0;
+	}
+}
+
 /* For the given deviceId, count the number of associated SPk and return the Id of the active one(if any)
  * return true if an active one was found
  */
@@ -468,6 +493,17 @@ bool get_SPks(const std::string &dbFilename, const std::string &selfDeviceId, si
 	}
 }
 
+/* For the given deviceId, delete all the SPks from local storage
+ */
+void delete_SPks(const std::string &dbFilename, const std::string &selfDeviceId) noexcept {
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		sql<<"DELETE FROM X3DH_SPK WHERE Uid IN (SELECT Uid FROM lime_LocalUsers WHERE UserId = :selfId);", use(selfDeviceId);
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while deleting the SPks in DB: "<<e.what();
+	}
+}
+
 /* For the given deviceId, count the number of associated OPk
  */
 size_t get_OPks(const std::string &dbFilename, const std::string &selfDeviceId) noexcept {
@@ -487,6 +523,76 @@ size_t get_OPks(const std::string &dbFilename, const std::string &selfDeviceId)
 
 }
 
+template <typename Curve>
+bool check_OPks(const std::string &dbFilename, const std::string &selfDeviceId) noexcept {
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		blob OPk_blob(sql);
+		// soci doesn't allow rowset and blob usage together, so fetch them one by one from the statement
+		statement st = (sql.prepare << "SELECT o.OPK FROM X3DH_OPK as o INNER JOIN lime_LocalUsers as u on u.Uid = o.Uid WHERE u.UserId = :selfId;", into(OPk_blob), use(selfDeviceId));
+		st.execute();
+		auto DH = make_keyExchange<Curve>();
+		std::set<std::vector<uint8_t>> publicKeys{};
+		size_t count = 0;
+		while (st.fetch()) {
+			count++;
+			if (OPk_blob.get_len() != X<Curve, lime::Xtype::publicKey>::ssize() + X<Curve, lime::Xtype::privateKey>::ssize()) return false;
+			X<Curve, lime::Xtype::publicKey> publicKey;
+			X<Curve, lime::Xtype::privateKey> privateKey;
+			OPk_blob.read(0, (char *)(publicKey.data()), publicKey.size());
+			OPk_blob.read(publicKey.size(), (char *)(privateKey.data()), privateKey.size());
+			DH->set_secret(privateKey);
+			DH->deriveSelfPublic();
+			if (DH->get_selfPublic() != publicKey) return false;
+			publicKeys.emplace(publicKey.cbegin(), publicKey.cend());
+		}
+		return count > 0 && publicKeys.size() == count;
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while checking the OPks in DB: "<<e.what();
+		return false;
+	}
+}
+
+void inject_OPkIdCollisions(const std::string &dbFilename, const int count) noexcept {
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		sql<<"CREATE TABLE lime_tester_collisions(remaining INTEGER NOT NULL);";
+		sql<<"INSERT INTO lime_tester_collisions(remaining) VALUES(:count);", use(count);
+		// the decoy takes the Id of the inserted OPk: the insertion hits the primary key constraint and is ignored as a real collision would be
+		sql<<"CREATE TRIGGER lime_tester_collision BEFORE INSERT ON X3DH_OPK WHEN NEW.OPK <> x'00' AND (SELECT remaining FROM lime_tester_collisions) > 0 \
+			BEGIN UPDATE lime_tester_collisions SET remaining = remaining - 1; \
+			INSERT INTO X3DH_OPK(OPKid, OPK, Uid, Status) VALUES(NEW.OPKid, x'00', NEW.Uid, 0); END;";
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while injecting OPk Id collisions in DB: "<<e.what();
+	}
+}
+
+std::vector<uint32_t> clear_OPkIdCollisions(const std::string &dbFilename) noexcept {
+	std::vector<uint32_t> decoyIds{};
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		sql<<"DROP TRIGGER IF EXISTS lime_tester_collision;";
+		sql<<"DROP TABLE IF EXISTS lime_tester_collisions;";
+		rowset<int> rs = (sql.prepare << "SELECT OPKid FROM X3DH_OPK WHERE OPK = x'00';");
+		for (const auto &OPkId : rs) {
+			decoyIds.push_back(static_cast<uint32_t>(OPkId));
+		}
+		sql<<"DELETE FROM X3DH_OPK WHERE OPK = x'00';";
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while clearing the OPk Id collisions injected in DB: "<<e.what();
+	}
+	return decoyIds;
+}
+
+void create_legacyDatabase(const std::string &dbFilename) noexcept {
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		sql<<"CREATE TABLE legacy(a INTEGER);";
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while creating a legacy DB: "<<e.what();
+	}
+}
+
 /* Move back in time all timeStamps by the given amout of days
  * DB holds timeStamps in DR_sessions and X3DH_SPK tables
  */
@@ -502,6 +608,170 @@ void forwardTime(const std::string &dbFilename, int days) noexcept {
 	}
 }
 
+void inject_storageFailure(const std::string &dbFilename, const std::string &table, const std::string &condition) noexcept {
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		sql<<"CREATE TRIGGER lime_tester_failure BEFORE INSERT ON "<<table<<" "<<(condition.empty()?"":"WHEN ")<<condition
+			<<" BEGIN SELECT RAISE(ABORT, 'injected failure'); END;";
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while injecting a failure in DB: "<<e.what();
+	}
+}
+
+void clear_storageFailure(const std::string &dbFilename) noexcept {
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		sql<<"DROP TRIGGER IF EXISTS lime_tester_failure;";
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while clearing the failure injected in DB: "<<e.what();
+	}
+}
+
+std::shared_ptr<soci::session> hold_storageReadLock(const std::string &dbFilename) noexcept {
+	try {
+		auto sql = std::make_shared<soci::session>("sqlite3", dbFilename); // open the DB
+		int count = 0;
+		*sql<<"BEGIN;";
+		*sql<<"SELECT count(*) FROM lime_LocalUsers;", into(count); // the shared lock is taken by the first read
+		return sql;
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while locking the DB: "<<e.what();
+		return nullptr;
+	}
+}
+
+bool downgrade_database(const std::string &dbFilename, const int version, const lime::CurveId curve) noexcept {
+	try {
+		soci::session sql("sqlite3", dbFilename); // open the DB
+		sql<<"PRAGMA foreign_keys = OFF;"; // dropping a table would otherwise cascade delete all the rows referencing it
+		soci::transaction tr(sql);
+
+		if (version < 0x000006 && version >= 0x000002) {
+			/* 0.0.5 has no DHr column, versions older than 0.0.5 no version column either */
+			sql<<"CREATE TABLE DR_sessions_old( \
+						Did INTEGER NOT NULL DEFAULT 0, \
+						Uid INTEGER NOT NULL DEFAULT 0, \
+						sessionId INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, \
+						state BLOB NOT NULL, \
+						AD BLOB NOT NULL, \
+						Status INTEGER NOT NULL DEFAULT 1, \
+						timeStamp DATETIME DEFAULT CURRENT_TIMESTAMP, \
+						X3DHInit BLOB DEFAULT NULL, "<<((version == 0x000005)?"version INTEGER NOT NULL DEFAULT 0, ":"")<<" \
+						FOREIGN KEY(Did) REFERENCES lime_PeerDevices(Did) ON UPDATE CASCADE ON DELETE CASCADE, \
+						FOREIGN KEY(Uid) REFERENCES lime_LocalUsers(Uid) ON UPDATE CASCADE ON DELETE CASCADE);";
+			sql<<"INSERT INTO DR_sessions_old SELECT Did,Uid,sessionId,state,AD,Status,timeStamp,X3DHInit"<<((version == 0x000005)?",version":"")<<" FROM DR_sessions;";
+			sql<<"DROP TABLE DR_sessions;";
+			sql<<"ALTER TABLE DR_sessions_old RENAME TO DR_sessions;";
+			sql<<"CREATE INDEX DR_sessions_Uid_Did_Status ON DR_sessions(Uid, Did, Status);";
+		}
+		if (version < 0x000005) {
+			sql<<"DROP TABLE lime_SessionsSnapshots;";
+		}
+		if (version < 0x000004) {
+			sql<<"DROP TABLE lime_SenderKeyMembers;";
+			sql<<"DROP TABLE lime_SenderKeyChains;";
+			sql<<"DROP TABLE lime_ReceiverKeyChains;";
+		}
+		if (version < 0x000003) {
+			/* 0.0.2 stores one skipped message key per row */
+			sql<<"CREATE TABLE DR_MSk_MK_old( \
+						DHid INTEGER NOT NULL, \
+						Nr INTEGER NOT NULL, \
+						MK BLOB NOT NULL, \
+						PRIMARY KEY( DHid , Nr ), \
+						FOREIGN KEY(DHid) REFERENCES DR_MSk_DHr(DHid) ON UPDATE CASCADE ON DELETE CASCADE);";
+
+			// soci doesn't allow rowset and blob usage together: get the chunks first, then each keys blob
+			std::vector<std::tuple<long int, int, int>> chunks{};
+			rowset<row> rs = (sql.prepare << "SELECT DHid, chunk, mask FROM DR_MSk_MK;");
+			for (const auto &r : rs) {
+				chunks.emplace_back(static_cast<long int>(r.get<int>(0)), r.get<int>(1), r.get<int>(2));
+			}
+			constexpr size_t MKSize = lime::settings::DRMessageKeySize + lime::settings::DRMessageIVSize;
+			for (const auto &chunk : chunks) {
+				const auto DHid = std::get<0>(chunk);
+				blob MKs(sql);
+				sql<<"SELECT MKs FROM DR_MSk_MK WHERE DHid = :DHid AND chunk = :chunk LIMIT 1;", into(MKs), use(DHid), use(std::get<1>(chunk));
+				std::vector<uint8_t> buffer(MKs.get_len());
+				MKs.read(0, (char *)(buffer.data()), buffer.size());
+				for (size_t slot=0; slot<lime::settings::DBMSkChunkSize; slot++) {
+					if ((std::get<2>(chunk) & (1<<slot)) == 0) continue;
+					const int Nr = std::get<1>(chunk)*lime::settings::DBMSkChunkSize + static_cast<int>(slot);
+					blob MK(sql);
+					MK.write(0, (char *)(buffer.data()+slot*MKSize), MKSize);
+					sql<<"INSERT INTO DR_MSk_MK_old(DHid,Nr,MK) VALUES(:DHid,:Nr,:MK);", use(DHid), use(Nr), use(MK);
+				}
+			}
+			sql<<"DROP TABLE DR_MSk_MK;";
+			sql<<"ALTER TABLE DR_MSk_MK_old RENAME TO DR_MSk_MK;";
+		}
+		if (version < 0x000002) {
+			/* 0.0.1 stores the DR sessions state in separate columns and has no index */
+			sql<<"CREATE TABLE DR_sessions_old( \
+						Did INTEGER NOT NULL DEFAULT 0, \
+						Uid INTEGER NOT NULL DEFAULT 0, \
+						sessionId INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, \
+						Ns UNSIGNED INTEGER NOT NULL, \
+						Nr UNSIGNED INTEGER NOT NULL, \
+						PN UNSIGNED INTEGER NOT NULL, \
+						DHr BLOB NOT NULL, \
+						DHs BLOB NOT NULL, \
+						RK BLOB NOT NULL, \
+						CKs BLOB NOT NULL, \
+						CKr BLOB NOT NULL, \
+						AD BLOB NOT NULL, \
+						Status INTEGER NOT NULL DEFAULT 1, \
+						timeStamp DATETIME DEFAULT CURRENT_TIMESTAMP, \
+						X3DHInit BLOB DEFAULT NULL, \
+						FOREIGN KEY(Did) REFERENCES lime_PeerDevices(Did) ON UPDATE CASCADE ON DELETE CASCADE, \
+						FOREIGN KEY(Uid) REFERENCES lime_LocalUsers(Uid) ON UPDATE CASCADE ON DELETE CASCADE);";
+			sql<<"INSERT INTO DR_sessions_old(Did,Uid,sessionId,Ns,Nr,PN,DHr,DHs,RK,CKs,CKr,AD,Status,timeStamp,X3DHInit) \
+						SELECT Did,Uid,sessionId,0,0,0,x'',x'',x'',x'',x'',AD,Status,timeStamp,X3DHInit FROM DR_sessions;";
+
+			std::vector<long int> sessionIds{};
+			rowset<int> rs = (sql.prepare << "SELECT sessionId FROM DR_sessions;");
+			for (const auto &sessionId : rs) {
+				sessionIds.push_back(sessionId);
+			}
+
+			// state is DHr || DHs || RK || CKs || CKr || Ns || Nr || PN
+			const size_t XpublicSize = (curve == lime::CurveId::c25519)?C255::Xsize(lime::Xtype::publicKey):C448::Xsize(lime::Xtype::publicKey);
+			const size_t XprivateSize = (curve == lime::CurveId::c25519)?C255::Xsize(lime::Xtype::privateKey):C448::Xsize(lime::Xtype::privateKey);
+			const std::array<size_t, 5> sizes{{XpublicSize, XpublicSize+XprivateSize, lime::settings::DRChainKeySize, lime::settings::DRChainKeySize, lime::settings::DRChainKeySize}};
+			for (const auto sessionId : sessionIds) {
+				blob state(sql);
+				sql<<"SELECT state FROM DR_sessions WHERE sessionId = :sessionId LIMIT 1;", into(state), use(sessionId);
+				std::vector<uint8_t> buffer(state.get_len());
+				state.read(0, (char *)(buffer.data()), buffer.size());
+				blob DHr(sql), DHs(sql), RK(sql), CKs(sql), CKr(sql);
+				size_t offset = 0;
+				std::array<blob *, 5> columns{{&DHr, &DHs, &RK, &CKs, &CKr}};
+				for (size_t i=0; i<columns.size(); i++) {
+					columns[i]->write(0, (char *)(buffer.data()+offset), sizes[i]);
+					offset += sizes[i];
+				}
+				const int Ns = (buffer[offset]<<8) | buffer[offset+1];
+				const int Nr = (buffer[offset+2]<<8) | buffer[offset+3];
+				const int PN = (buffer[offset+4]<<8) | buffer[offset+5];
+				sql<<"UPDATE DR_sessions_old SET Ns = :Ns, Nr = :Nr, PN = :PN, DHr = :DHr, DHs = :DHs, RK = :RK, CKs = :CKs, CKr = :CKr WHERE sessionId = :sessionId;",
+					use(Ns), use(Nr), use(PN), use(DHr), use(DHs), use(RK), use(CKs), use(CKr), use(sessionId);
+			}
+
+			sql<<"DROP TABLE DR_sessions;";
+			sql<<"ALTER TABLE DR_sessions_old RENAME TO DR_sessions;";
+			sql<<"DROP INDEX DR_MSk_DHr_sessionId_DHr;";
+			sql<<"DROP INDEX lime_PeerDevices_DeviceId;";
+		}
+
+		sql<<"UPDATE db_module_version SET version = :version WHERE name='lime';", use(version);
+		tr.commit();
+		return true;
+	} catch (exception &e) { // swallow any error on DB
+		LIME_LOGE<<"Got an error while downgrading the DB to version "<<version<<": "<<e.what();
+		return false;
+	}
+}
+
 const char charset[] =
         "0123456789"
         "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
@@ -528,6 +798,10 @@ int wait_for(belle_sip_stack_t*s1,int* counter,int value,int timeout) {
 	int retry=0;
 #define SLEEP_TIME 50
 	while (*counter!=value && retry++ <(timeout/SLEEP_TIME)) {
+		if (x3dhLoopbackServer) {
+			x3dhLoopbackServer->process();
+			if (*counter==value) break;
+		}
 		if (s1) belle_sip_stack_sleep(s1,SLEEP_TIME);
 	}
 	if (*counter!=value) return FALSE;
@@ -540,6 +814,7 @@ int wait_for_mutex(belle_sip_stack_t*s1,int* counter,int value,int timeout, std:
 #define SLEEP_TIME 50
 	while (*counter!=value && retry++ <(timeout/SLEEP_TIME)) {
 		std::unique_lock<std::recursive_mutex> lock(*mutex);
+		if (x3dhLoopbackServer) x3dhLoopbackServer->process();
 		if (s1) belle_sip_stack_sleep(s1,SLEEP_TIME);
 		lock.unlock();
 	}
@@ -547,14 +822,363 @@ int wait_for_mutex(belle_sip_stack_t*s1,int* counter,int value,int timeout, std:
 	else return TRUE;
 }
 
+/* In-process X3DH server: protocol constants and message processing match tester/server/nodejs/x3dh.js */
+namespace {
+	constexpr uint8_t X3DH_protocolVersion = 0x01;
+	constexpr size_t X3DH_headerSize = 3;
+	constexpr size_t lime_max_opk_per_device = 200;
+
+	enum class x3dhMessageType : uint8_t {
+		deleteUser = 0x02,
+		postSPk = 0x03,
+		postOPks = 0x04,
+		getPeerBundle = 0x05,
+		peerBundle = 0x06,
+		getSelfOPks = 0x07,
+		selfOPks = 0x08,
+		registerUser = 0x09,
+		batch = 0x0a,
+		error = 0xff
+	};
+
+	enum class x3dhErrorCode : uint8_t {
+		bad_curve = 0x01,
+		missing_senderId = 0x02,
+		bad_x3dh_protocol_version = 0x03,
+		bad_size = 0x04,
+		user_already_in = 0x05,
+		user_not_found = 0x06,
+		bad_request = 0x08,
+		resource_limit_reached = 0x0a
+	};
+
+	/// public keys and signature sizes for a curve id, all 0 if the curve is not supported
+	struct keySizes {
+		size_t X_pub;
+		size_t ED_pub;
+		size_t Sig;
+		keySizes(uint8_t curveId) : X_pub{0}, ED_pub{0}, Sig{0} {
+#ifdef EC25519_ENABLED
+			if (curveId == static_cast<uint8_t>(lime::CurveId::c25519)) {
+				X_pub = X<C255, lime::Xtype::publicKey>::ssize();
+				ED_pub = DSA<C255, lime::DSAtype::publicKey>::ssize();
+				Sig = DSA<C255, lime::DSAtype::signature>::ssize();
+			}
+#endif
+#ifdef EC448_ENABLED
+			if (curveId == static_cast<uint8_t>(lime::CurveId::c448)) {
+				X_pub = X<C448, lime::Xtype::publicKey>::ssize();
+				ED_pub = DSA<C448, lime::DSAtype::publicKey>::ssize();
+				Sig = DSA<C448, lime::DSAtype::signature>::ssize();
+			}
+#endif
+		}
+	};
+
+	uint16_t readU16(const std::vector<uint8_t> &buffer, size_t index) {
+		return static_cast<uint16_t>((buffer[index]<<8)|buffer[index+1]);
+	}
+	uint32_t readU32(const std::vector<uint8_t> &buffer, size_t index) {
+		return (static_cast<uint32_t>(buffer[index])<<24)|(static_cast<uint32_t>(buffer[index+1])<<16)|(static_cast<uint32_t>(buffer[index+2])<<8)|static_cast<uint32_t>(buffer[index+3]);
+	}
+	void appendU16(std::vector<uint8_t> &buffer, size_t value) {
+		buffer.push_back(static_cast<uint8_t>((value>>8)&0xFF));
+		buffer.push_back(static_cast<uint8_t>(value&0xFF));
+	}
+	void appendU32(std::vector<uint8_t> &buffer, uint32_t value) {
+		buffer.push_back(static_cast<uint8_t>((value>>24)&0xFF));
+		buffer.push_back(static_cast<uint8_t>((value>>16)&0xFF));
+		buffer.push_back(static_cast<uint8_t>((value>>8)&0xFF));
+		buffer.push_back(static_cast<uint8_t>(value&0xFF));
+	}
+	std::vector<uint8_t> makeHeader(x3dhMessageType type, uint8_t curveId) {
+		return std::vector<uint8_t>{X3DH_protocolVersion, static_cast<uint8_t>(type), curveId};
+	}
+	std::vector<uint8_t> makeError(uint8_t curveId, x3dhErrorCode code, const std::string &errorMessage) {
+		LIME_LOGI<<"X3DH loopback server returns error "<<static_cast<unsigned int>(code)<<" : "<<errorMessage;
+		auto response = makeHeader(x3dhMessageType::error, curveId);
+		response.push_back(static_cast<uint8_t>(code));
+		response.insert(response.end(), errorMessage.cbegin(), errorMessage.cend());
+		return response;
+	}
+} // anonymous namespace
+
+std::vector<uint8_t> X3DHLoopbackServer::processMessage(const std::string &from, const std::vector<uint8_t> &message) {
+	if (message.size() < X3DH_headerSize) {
+		return makeError(0, x3dhErrorCode::bad_size, "Packet is not even holding a header. Size "+std::to_string(message.size()));
+	}
+	const uint8_t curveId = message[2];
+	if (message[0] != X3DH_protocolVersion) {
+		return makeError(curveId, x3dhErrorCode::bad_x3dh_protocol_version, "Server running X3DH procotol version "+std::to_string(X3DH_protocolVersion)+". Can't process packet with version "+std::to_string(message[0]));
+	}
+	const keySizes sizes{curveId};
+	if (sizes.X_pub == 0) {
+		return makeError(curveId, x3dhErrorCode::bad_curve, "Server does not support curve id "+std::to_string(curveId));
+	}
+	if (from.empty()) {
+		return makeError(curveId, x3dhErrorCode::missing_senderId, "From field must be set");
+	}
+
+	/* batch: request count <2 bytes> | (from size <2 bytes> | from | message size <4 bytes> | message){request count} */
+	if (message[1] == static_cast<uint8_t>(x3dhMessageType::batch)) {
+		if (!m_batchSupport) {
+			return makeError(curveId, x3dhErrorCode::bad_request, "Unknown message type "+std::to_string(message[1]));
+		}
+		return processBatch(curveId, message);
+	}
+
+	// all ok responses start with the request header
+	std::vector<uint8_t> response{message.cbegin(), message.cbegin()+X3DH_headerSize};
+	const auto key = std::make_pair(curveId, from);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto device = m_devices.find(key);
+	size_t index = X3DH_headerSize;
+
+	switch (static_cast<x3dhMessageType>(message[1])) {
+		/* registerUser: Ik | SPk | SPk_sig | SPk_id <4 bytes> | OPk count <2 bytes> | (OPk | OPk_id <4 bytes>){OPk count} */
+		case x3dhMessageType::registerUser: {
+			const size_t bodySize = sizes.ED_pub + sizes.X_pub + sizes.Sig + 4 + 2;
+			if (message.size() < X3DH_headerSize + bodySize) {
+				return makeError(curveId, x3dhErrorCode::bad_size, "Register User packet is expected to be at least(without OPk) "+std::to_string(X3DH_headerSize+bodySize)+" bytes, but we got "+std::to_string(message.size())+" bytes");
+			}
+			const size_t OPkCount = readU16(message, X3DH_headerSize + bodySize - 2);
+			if (OPkCount > lime_max_opk_per_device) {
+				return makeError(curveId, x3dhErrorCode::resource_limit_reached, from+" is trying to register itself with "+std::to_string(OPkCount)+" OPks but server has a limit of "+std::to_string(lime_max_opk_per_device));
+			}
+			if (message.size() != X3DH_headerSize + bodySize + OPkCount*(sizes.X_pub + 4)) {
+				return makeError(curveId, x3dhErrorCode::bad_size, "Register User packet is expected to be (with "+std::to_string(OPkCount)+" OPks) "+std::to_string(X3DH_headerSize+bodySize+OPkCount*(sizes.X_pub+4))+" bytes, but we got "+std::to_string(message.size())+" bytes");
+			}
+			deviceKeys keys{};
+			keys.Ik.assign(message.cbegin()+index, message.cbegin()+index+sizes.ED_pub);
+			index += sizes.ED_pub;
+			keys.SPk.assign(message.cbegin()+index, message.cbegin()+index+sizes.X_pub);
+			index += sizes.X_pub;
+			keys.SPk_sig.assign(message.cbegin()+index, message.cbegin()+index+sizes.Sig);
+			index += sizes.Sig;
+			keys.SPk_id = readU32(message, index);
+			index += 6; // SPk id and OPk count
+			if (device != m_devices.end()) { // re-registration is accepted only with the same keys
+				if (device->second.Ik == keys.Ik && device->second.SPk == keys.SPk && device->second.SPk_sig == keys.SPk_sig && device->second.SPk_id == keys.SPk_id) {
+					return response;
+				}
+				return makeError(curveId, x3dhErrorCode::user_already_in, "Can't insert user "+from+" - is already present in base and we try to insert a new one with differents Keys");
+			}
+			for (size_t i=0; i<OPkCount; i++) {
+				keys.OPks.emplace_back(std::vector<uint8_t>{message.cbegin()+index, message.cbegin()+index+sizes.X_pub}, readU32(message, index+sizes.X_pub));
+				index += sizes.X_pub + 4;
+			}
+			m_devices.emplace(key, std::move(keys));
+			return response;
+		}
+
+		case x3dhMessageType::deleteUser:
+			if (device != m_devices.end()) m_devices.erase(device);
+			return response;
+
+		/* postSPk: SPk | SPk_sig | SPk_id <4 bytes> */
+		case x3dhMessageType::postSPk: {
+			const size_t bodySize = sizes.X_pub + sizes.Sig + 4;
+			if (message.size() != X3DH_headerSize + bodySize) {
+				return makeError(curveId, x3dhErrorCode::bad_size, "post SPK packet is expexted to be "+std::to_string(X3DH_headerSize+bodySize)+" bytes, but we got "+std::to_string(message.size())+" bytes");
+			}
+			if (device == m_devices.end()) {
+				return makeError(curveId, x3dhErrorCode::user_not_found, "Post SPk but "+from+" not found in db");
+			}
+			device->second.SPk.assign(message.cbegin()+index, message.cbegin()+index+sizes.X_pub);
+			index += sizes.X_pub;
+			device->second.SPk_sig.assign(message.cbegin()+index, message.cbegin()+index+sizes.Sig);
+			index += sizes.Sig;
+			device->second.SPk_id = readU32(message, index);
+			return response;
+		}
+
+		/* postOPks: OPk count <2 bytes> | (OPk | OPk_id <4 bytes>){OPk count} */
+		case x3dhMessageType::postOPks: {
+			if (message.size() < X3DH_headerSize + 2) {
+				return makeError(curveId, x3dhErrorCode::bad_size, "post OPKs packet is expected to be at least "+std::to_string(X3DH_headerSize+2)+" bytes, but we got "+std::to_string(message.size())+" bytes");
+			}
+			const size_t OPkCount = readU16(message, index);
+			index += 2;
+			if (message.size() != X3DH_headerSize + 2 + OPkCount*(sizes.X_pub + 4)) {
+				return makeError(curveId, x3dhErrorCode::bad_size, "post OPK packet is expexted to be "+std::to_string(X3DH_headerSize+2+OPkCount*(sizes.X_pub+4))+" bytes, but we got "+std::to_string(message.size())+" bytes");
+			}
+			if (device == m_devices.end()) {
+				return makeError(curveId, x3dhErrorCode::user_not_found, "Post OPks but "+from+" not found in db");
+			}
+			if (device->second.OPks.size() + OPkCount > lime_max_opk_per_device) {
+				return makeError(curveId, x3dhErrorCode::resource_limit_reached, from+" is trying to insert "+std::to_string(OPkCount)+" OPks but server has a limit of "+std::to_string(lime_max_opk_per_device)+" and it already holds "+std::to_string(device->second.OPks.size()));
+			}
+			for (size_t i=0; i<OPkCount; i++) {
+				device->second.OPks.emplace_back(std::vector<uint8_t>{message.cbegin()+index, message.cbegin()+index+sizes.X_pub}, readU32(message, index+sizes.X_pub));
+				index += sizes.X_pub + 4;
+			}
+			return response;
+		}
+
+		/* getPeerBundle: count <2 bytes> | (device id size <2 bytes> | device id){count}
+		 * the response gives one OPk per device and removes it from the store */
+		case x3dhMessageType::getPeerBundle: {
+			if (message.size() < X3DH_headerSize + 2) {
+				return makeError(curveId, x3dhErrorCode::bad_size, "Get peer bundle packet is too short");
+			}
+			const size_t peersCount = readU16(message, index);
+			index += 2;
+			if (peersCount == 0) {
+				return makeError(curveId, x3dhErrorCode::bad_request, "Ask for peer Bundles but no device id given");
+			}
+			response = makeHeader(x3dhMessageType::peerBundle, curveId);
+			appendU16(response, peersCount);
+			for (size_t i=0; i<peersCount; i++) {
+				if (message.size() < index + 2 || message.size() < index + 2 + readU16(message, index)) {
+					return makeError(curveId, x3dhErrorCode::bad_size, "Get peer bundle packet is too short to hold "+std::to_string(peersCount)+" device ids");
+				}
+				const size_t idSize = readU16(message, index);
+				const std::string peerDeviceId{message.cbegin()+index+2, message.cbegin()+index+2+idSize};
+				index += 2 + idSize;
+
+				appendU16(response, idSize);
+				response.insert(response.end(), peerDeviceId.cbegin(), peerDeviceId.cend());
+				auto peer = m_devices.find(std::make_pair(curveId, peerDeviceId));
+				if (peer == m_devices.end() || peer->second.SPk.empty()) {
+					response.push_back(static_cast<uint8_t>(lime::X3DHKeyBundleFlag::noBundle));
+					continue;
+				}
+				const bool haveOPk = !peer->second.OPks.empty();
+				response.push_back(static_cast<uint8_t>(haveOPk?lime::X3DHKeyBundleFlag::OPk:lime::X3DHKeyBundleFlag::noOPk));
+				response.insert(response.end(), peer->second.Ik.cbegin(), peer->second.Ik.cend());
+				response.insert(response.end(), peer->second.SPk.cbegin(), peer->second.SPk.cend());
+				appendU32(response, peer->second.SPk_id);
+				response.insert(response.end(), peer->second.SPk_sig.cbegin(), peer->second.SPk_sig.cend());
+				if (haveOPk) {
+					const auto &OPk = peer->second.OPks.front();
+					response.insert(response.end(), OPk.first.cbegin(), OPk.first.cend());
+					appendU32(response, OPk.second);
+					peer->second.OPks.pop_front();
+				}
+			}
+			return response;
+		}
+
+		/* selfOPks response: OPk count <2 bytes> | (OPk_id <4 bytes>){OPk count} */
+		case x3dhMessageType::getSelfOPks: {
+			if (device == m_devices.end()) {
+				return makeError(curveId, x3dhErrorCode::user_not_found, "Get Self OPks but "+from+" not found in db");
+			}
+			response = makeHeader(x3dhMessageType::selfOPks, curveId);
+			appendU16(response, device->second.OPks.size());
+			for (const auto &OPk : device->second.OPks) {
+				appendU32(response, OPk.second);
+			}
+			return response;
+		}
+
+		default:
+			return makeError(curveId, x3dhErrorCode::bad_request, "Unknown message type "+std::to_string(message[1]));
+	}
+}
+
+/* batch response: response count <2 bytes> | (message size <4 bytes> | message){response count} */
+std::vector<uint8_t> X3DHLoopbackServer::processBatch(const uint8_t curveId, const std::vector<uint8_t> &message) {
+	if (message.size() < X3DH_headerSize + 2) {
+		return makeError(curveId, x3dhErrorCode::bad_size, "Batch packet is too short to hold a request count");
+	}
+	const size_t requestsCount = readU16(message, X3DH_headerSize);
+	size_t index = X3DH_headerSize + 2;
+	// parse all the requests before processing any of them
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> requests{};
+	for (size_t i=0; i<requestsCount; i++) {
+		if (message.size() < index + 2 || message.size() < index + 2 + readU16(message, index) + 4) {
+			return makeError(curveId, x3dhErrorCode::bad_size, "Batch packet is too short to hold "+std::to_string(requestsCount)+" requests");
+		}
+		const size_t fromSize = readU16(message, index);
+		std::string from{message.cbegin()+index+2, message.cbegin()+index+2+fromSize};
+		index += 2 + fromSize;
+		const size_t requestSize = readU32(message, index);
+		index += 4;
+		if (message.size() < index + requestSize) {
+			return makeError(curveId, x3dhErrorCode::bad_size, "Batch packet is too short to hold "+std::to_string(requestsCount)+" requests");
+		}
+		std::vector<uint8_t> request{message.cbegin()+index, message.cbegin()+index+requestSize};
+		index += requestSize;
+		if (request.size() < X3DH_headerSize || request[1] == static_cast<uint8_t>(x3dhMessageType::batch)) {
+			return makeError(curveId, x3dhErrorCode::bad_request, "Batch packet holds an invalid request");
+		}
+		requests.emplace_back(std::move(from), std::move(request));
+	}
+	if (index != message.size()) {
+		return makeError(curveId, x3dhErrorCode::bad_size, "Batch packet holds trailing bytes");
+	}
+
+	auto response = makeHeader(x3dhMessageType::batch, curveId);
+	appendU16(response, requestsCount);
+	for (const auto &request : requests) {
+		const auto requestResponse = processMessage(request.first, request.second);
+		appendU32(response, static_cast<uint32_t>(requestResponse.size()));
+		response.insert(response.end(), requestResponse.cbegin(), requestResponse.cend());
+	}
+	return response;
+}
+
+void X3DHLoopbackServer::setBatchSupport(const bool enabled) {
+	m_batchSupport = enabled;
+}
+
+void X3DHLoopbackServer::post(const std::string &, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess) {
+	auto response = processMessage(from, message);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_responses.emplace_back(std::chrono::steady_clock::now() + m_delay, responseProcess, std::move(response));
+}
+
+size_t X3DHLoopbackServer::process() {
+	// pick the due responses and release the lock before calling back: the response processing may post again
+	std::vector<pendingResponse> due{};
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto now = std::chrono::steady_clock::now();
+		while (!m_responses.empty() && m_responses.front().due <= now) {
+			due.push_back(std::move(m_responses.front()));
+			m_responses.pop_front();
+		}
+	}
+	for (auto &response : due) {
+		response.responseProcess(200, response.body);
+	}
+	return due.size();
+}
+
+void X3DHLoopbackServer::setDelay(std::chrono::milliseconds delay) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_delay = delay;
+}
+
+size_t X3DHLoopbackServer::OPkCount(const lime::CurveId curve, const std::string &deviceId) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto device = m_devices.find(std::make_pair(static_cast<uint8_t>(curve), deviceId));
+	return (device == m_devices.end())?0:device->second.OPks.size();
+}
+
+std::vector<uint32_t> X3DHLoopbackServer::OPkIds(const lime::CurveId curve, const std::string &deviceId) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<uint32_t> OPkIds{};
+	auto device = m_devices.find(std::make_pair(static_cast<uint8_t>(curve), deviceId));
+	if (device != m_devices.end()) {
+		for (const auto &OPk : device->second.OPks) {
+			OPkIds.push_back(OPk.second);
+		}
+	}
+	return OPkIds;
+}
+
 // template instanciation
 #ifdef EC25519_ENABLED
 	template void dr_sessionsInit<C255>(std::shared_ptr<DR<C255>> &alice, std::shared_ptr<DR<C255>> &bob, std::shared_ptr<lime::Db> &localStorageAlice, std::shared_ptr<lime::Db> &localStorageBob, std::string dbFilenameAlice, std::shared_ptr<std::recursive_mutex> db_mutex_alice, std::string dbFilenameBob, std::shared_ptr<std::recursive_mutex> db_mutex_bob, bool initStorage, std::shared_ptr<RNG> RNG_context);
 	template void dr_devicesInit<C255>(std::string dbBaseFilename, std::vector<std::vector<std::vector<std::vector<sessionDetails<C255>>>>> &users, std::vector<std::string> &usernames, std::vector<std::string> &createdDBfiles, std::shared_ptr<RNG> RNG_context);
+	template bool check_OPks<C255>(const std::string &dbFilename, const std::string &selfDeviceId) noexcept;
 #endif
 #ifdef EC448_ENABLED
 	template void dr_sessionsInit<C448>(std::shared_ptr<DR<C448>> &alice, std::shared_ptr<DR<C448>> &bob, std::shared_ptr<lime::Db> &localStorageAlice, std::shared_ptr<lime::Db> &localStorageBob, std::string dbFilenameAlice, std::shared_ptr<std::recursive_mutex> db_mutex_alice, std::string dbFilenameBob, std::shared_ptr<std::recursive_mutex> db_mutex_bob, bool initStorage, std::shared_ptr<RNG> RNG_context);
 	template void dr_devicesInit<C448>(std::string dbBaseFilename, std::vector<std::vector<std::vector<std::vector<sessionDetails<C448>>>>> &users, std::vector<std::string> &usernames, std::vector<std::string> &createdDBfiles, std::shared_ptr<RNG> RNG_context);
+	template bool check_OPks<C448>(const std::string &dbFilename, const std::string &selfDeviceId) noexcept;
 #endif
 
 
@@ -28,7 +28,11 @@
 
 #include "soci/sqlite3/soci-sqlite3.h"
 #include <random>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <mutex>
+#include <atomic>
 
 using namespace::lime;
 
@@ -51,6 +55,11 @@ extern int wait_for_timeout;
 // default value for initial OPk batch size, keep it small so not too many OPks generated
 extern uint16_t OPkInitialBatchSize;
 
+// group scale bench: biggest group benched, report format(csv or json) and file, the report is logged when no file is given
+extern int groupScaleMaxDevices;
+extern std::string groupScaleFormat;
+extern std::string groupScaleReport;
+
 /**
  * @brief Simple RNG function, used to generate random values for testing purpose, they do not need to be real random
  * so use directly std::random_device
@@ -120,20 +129,68 @@ long int get_DRsessionsId(const std::string &dbFilename, const std::string &self
  */
 unsigned int get_StoredMessageKeyCount(const std::string &dbFilename, const std::string &selfDeviceId, const std::string &peerDeviceId) noexcept;
 
+/* Open provided DB, count the DRSessions established between selfDevice and peerDevice not holding a copy of the peer current public key:
+ * they were stored before schema version 0.0.6 and not updated since
+ */
+unsigned int get_DRsessionsWithoutDHr(const std::string &dbFilename, const std::string &selfDeviceId, const std::string &peerDeviceId) noexcept;
+
 /* For the given deviceId, count the number of associated SPk and return the Id of the active one(if any)
  * return true if an active one was found
  */
 bool get_SPks(const std::string &dbFilename, const std::string &selfDeviceId, size_t &count, uint32_t &activeId) noexcept;
 
+/* For the given deviceId, delete all the SPks from local storage
+ */
+void delete_SPks(const std::string &dbFilename, const std::string &selfDeviceId) noexcept;
+
 /* For the given deviceId, count the number of associated OPk
  */
 size_t get_OPks(const std::string &dbFilename, const std::string &selfDeviceId) noexcept;
 
+/* For the given deviceId, check each stored OPk public key is derived from its private key and no two OPks are the same
+ * return false if one check failed or no OPk was found
+ */
+template <typename Curve>
+bool check_OPks(const std::string &dbFilename, const std::string &selfDeviceId) noexcept;
+
+/* Make the next count OPk insertions collide with an already stored OPk Id: a decoy OPk is stored first with the Id about to be inserted
+ */
+void inject_OPkIdCollisions(const std::string &dbFilename, const int count) noexcept;
+
+/* Remove the collisions set by inject_OPkIdCollisions and delete the decoy OPks
+ * return the Ids of the decoy OPks
+ */
+std::vector<uint32_t> clear_OPkIdCollisions(const std::string &dbFilename) noexcept;
+
+/* Create a database file holding a table, as one created before the incremental auto vacuum mode was set
+ */
+void create_legacyDatabase(const std::string &dbFilename) noexcept;
+
 /* Move back in time all timeStamps by the given amout of days
  * DB holds timeStamps in DR_sessions and X3DH_SPK tables
  */
 void forwardTime(const std::string &dbFilename, int days) noexcept;
 
+/* Make the rows insertions in the given table fail until clear_storageFailure is called
+ * condition, when not empty, is a SQL expression on the NEW row restricting the failure to the rows matching it
+ */
+void inject_storageFailure(const std::string &dbFilename, const std::string &table, const std::string &condition="") noexcept;
+
+/* Remove the failure set by inject_storageFailure
+ */
+void clear_storageFailure(const std::string &dbFilename) noexcept;
+
+/* Open a read transaction on the given database and keep it open until the returned connection is destroyed:
+ * in rollback journal mode, the commits of the other connections then fail with a busy error unless they wait for it
+ */
+std::shared_ptr<soci::session> hold_storageReadLock(const std::string &dbFilename) noexcept;
+
+/* Convert a database holding the current schema to the layout written by an older lime: version is the lime module version, 0x000001 to 0x000005
+ * The DR sessions states are split in columns for a version older than 0.0.2, curve gives the size of the keys they hold
+ * return false if the conversion failed
+ */
+bool downgrade_database(const std::string &dbFilename, const int version, const lime::CurveId curve) noexcept;
+
 /**
  * @brief append a random suffix to user name to avoid collision if test server is user by several tests runs
  *
@@ -153,6 +210,78 @@ struct events_counters_t {
 	bool operator==(const events_counters_t &b) const {return this->operation_success==b.operation_success && this->operation_failed==b.operation_failed;}
 };
 
+/**
+ * @brief In-process X3DH server
+ *
+ * Implements the X3DH server side of the protocol(registerUser, deleteUser, postSPk, postOPks, getPeerBundle and getSelfOPks)
+ * on an in-memory store, following the behavior of the nodejs test server in tester/server/nodejs.
+ * It works with any curve: the keys are stored per curve id and device id, the url given to post is ignored.
+ *
+ * Responses are never delivered within the post call: lime may post while holding locks its response processing needs so
+ * they are queued and delivered by process(), after the optional delay. wait_for and wait_for_mutex call it.
+ */
+class X3DHLoopbackServer {
+	private:
+		/// keys published by a device
+		struct deviceKeys {
+			std::vector<uint8_t> Ik;
+			std::vector<uint8_t> SPk; // SPk and its signature, empty when device has no SPk
+			std::vector<uint8_t> SPk_sig;
+			uint32_t SPk_id;
+			std::deque<std::pair<std::vector<uint8_t>, uint32_t>> OPks; // OPk and its Id
+			deviceKeys() : Ik{}, SPk{}, SPk_sig{}, SPk_id{0}, OPks{} {};
+		};
+		/// a response waiting to be delivered
+		struct pendingResponse {
+			std::chrono::steady_clock::time_point due;
+			limeX3DHServerResponseProcess responseProcess;
+			std::vector<uint8_t> body;
+			pendingResponse(std::chrono::steady_clock::time_point due, const limeX3DHServerResponseProcess &responseProcess, std::vector<uint8_t> &&body) : due{due}, responseProcess(responseProcess), body{std::move(body)} {};
+		};
+
+		std::mutex m_mutex; // protects the store and the response queue
+		std::map<std::pair<uint8_t, std::string>, deviceKeys> m_devices; // curve id, device id
+		std::deque<pendingResponse> m_responses;
+		std::chrono::milliseconds m_delay;
+		std::atomic<bool> m_batchSupport; // process the batch messages, answer them with an error if not
+
+		std::vector<uint8_t> processMessage(const std::string &from, const std::vector<uint8_t> &message);
+		std::vector<uint8_t> processBatch(const uint8_t curveId, const std::vector<uint8_t> &message);
+
+	public:
+		/**
+		 * @param[in]	delay	delay applied to each response, default to none
+		 */
+		X3DHLoopbackServer(std::chrono::milliseconds delay = std::chrono::milliseconds{0}) : m_mutex{}, m_devices{}, m_responses{}, m_delay{delay}, m_batchSupport{true} {};
+
+		/**
+		 * @brief Process a message from a lime client and queue the response, signature matches limeX3DHServerPostData
+		 */
+		void post(const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess);
+
+		/**
+		 * @brief Deliver all the responses which delay expired
+		 *
+		 * @return the number of responses delivered
+		 */
+		size_t process();
+
+		/// @brief set the delay applied to the responses queued from now
+		void setDelay(std::chrono::milliseconds delay);
+
+		/// @brief when disabled, batch messages are answered with an error as a server not supporting them does
+		void setBatchSupport(const bool enabled);
+
+		/// @brief number of OPks held for a device, 0 if the device is not registered
+		size_t OPkCount(const lime::CurveId curve, const std::string &deviceId);
+
+		/// @brief Ids of the OPks held for a device, empty if the device is not registered
+		std::vector<uint32_t> OPkIds(const lime::CurveId curve, const std::string &deviceId);
+};
+
+// when set, the testers and benchmarks post to this server instead of the nodejs one
+extern std::shared_ptr<X3DHLoopbackServer> x3dhLoopbackServer;
+
 // wait for a counter to reach a value or timeout to occur, gives ticks to the belle-sip stack every SLEEP_TIME
 int wait_for(belle_sip_stack_t*s1,int* counter,int value,int timeout);
 int wait_for_mutex(belle_sip_stack_t*s1,int* counter,int value,int timeout, std::shared_ptr<std::recursive_mutex> mutex);
@@ -161,10 +290,12 @@ int wait_for_mutex(belle_sip_stack_t*s1,int* counter,int value,int timeout, std:
 #ifdef EC25519_ENABLED
 	extern template void dr_sessionsInit<C255>(std::shared_ptr<DR<C255>> &alice, std::shared_ptr<DR<C255>> &bob, std::shared_ptr<lime::Db> &localStorageAlice, std::shared_ptr<lime::Db> &localStorageBob, std::string dbFilenameAlice, std::shared_ptr<std::recursive_mutex> db_mutex_alice, std::string dbFilenameBob, std::shared_ptr<std::recursive_mutex> db_mutex_bob, bool initStorage, std::shared_ptr<RNG> RNG_context);
 	extern template void dr_devicesInit<C255>(std::string dbBaseFilename, std::vector<std::vector<std::vector<std::vector<sessionDetails<C255>>>>> &users, std::vector<std::string> &usernames, std::vector<std::string> &createdDBfiles,  std::shared_ptr<RNG> RNG_context);
+	extern template bool check_OPks<C255>(const std::string &dbFilename, const std::string &selfDeviceId) noexcept;
 #endif
 #ifdef EC448_ENABLED
 	extern template void dr_sessionsInit<C448>(std::shared_ptr<DR<C448>> &alice, std::shared_ptr<DR<C448>> &bob, std::shared_ptr<lime::Db> &localStorageAlice, std::shared_ptr<lime::Db> &localStorageBob, std::string dbFilenameAlice, std::shared_ptr<std::recursive_mutex> db_mutex_alice, std::string dbFilenameBob, std::shared_ptr<std::recursive_mutex> db_mutex_bob, bool initStorage,  std::shared_ptr<RNG> RNG_context);
 	extern template void dr_devicesInit<C448>(std::string dbBaseFilename, std::vector<std::vector<std::vector<std::vector<sessionDetails<C448>>>>> &users, std::vector<std::string> &usernames, std::vector<std::string> &createdDBfiles,  std::shared_ptr<RNG> RNG_context);
+	extern template bool check_OPks<C448>(const std::string &dbFilename, const std::string &selfDeviceId) noexcept;
 #endif
 } // namespace lime_tester
 
@@ -60,6 +60,9 @@ void lime_tester_init(void(*ftester_printf)(int level, const char *fmt, va_list
 #ifdef FFI_ENABLED
 	bc_tester_add_suite(&lime_ffi_test_suite);
 #endif
+#ifdef LIME_COROUTINES_ENABLED
+	bc_tester_add_suite(&lime_coroutine_test_suite);
+#endif
 }
 
 void lime_tester_uninit(void) {
@@ -99,9 +102,14 @@ static const char* lime_helper =
 #endif
 		"\t\t\t--operation-timeout <delay in ms to complete basic operations involving server>, default : 4000\n\t\t\t                    you may want to increase this value if you are not using a local X3DH server and experience tests failures\n"
 		"\t\t\t--keep-tmp-db, when set don't delete temporary db files created by tests, useful for debug\n"
+		"\t\t\t--x3dh-loopback-server, when set use an in-process X3DH server instead of the nodejs one(FFI tests still need it)\n"
+		"\t\t\t--x3dh-loopback-delay <delay in ms applied to each response of the in-process X3DH server>, default : 0\n"
 
 		"\t\t\t--log-file <output log file path>\n"
-		"\t\t\t--bench run benchmarks when set";
+		"\t\t\t--bench run benchmarks when set\n"
+		"\t\t\t--group-scale-max-devices <biggest group run by the massive group scale bench>, default : 5000\n"
+		"\t\t\t--group-scale-format <csv|json>, format of the massive group scale bench report, default : csv\n"
+		"\t\t\t--group-scale-report <output file of the massive group scale bench report>, default : written in the logs";
 
 int main(int argc, char *argv[]) {
 	int i;
@@ -158,8 +166,27 @@ int main(int argc, char *argv[]) {
 #ifdef FFI_ENABLED
 			ffi_cleanDatabase=0;
 #endif
+		} else if (strcmp(argv[i],"--x3dh-loopback-server")==0){
+			if (!lime_tester::x3dhLoopbackServer) lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>();
+		} else if (strcmp(argv[i],"--x3dh-loopback-delay")==0){
+			CHECK_ARG("--x3dh-loopback-delay", ++i, argc);
+			if (!lime_tester::x3dhLoopbackServer) lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>();
+			lime_tester::x3dhLoopbackServer->setDelay(std::chrono::milliseconds{std::atoi(argv[i])});
 		} else if (strcmp(argv[i],"--bench")==0){
 			bench=true;
+		} else if (strcmp(argv[i],"--group-scale-max-devices")==0){
+			CHECK_ARG("--group-scale-max-devices", ++i, argc);
+			lime_tester::groupScaleMaxDevices=std::atoi(argv[i]);
+		} else if (strcmp(argv[i],"--group-scale-format")==0){
+			CHECK_ARG("--group-scale-format", ++i, argc);
+			lime_tester::groupScaleFormat=std::string(argv[i]);
+			if (lime_tester::groupScaleFormat != "csv" && lime_tester::groupScaleFormat != "json") {
+				bc_tester_helper(argv[0], lime_helper);
+				return -1;
+			}
+		} else if (strcmp(argv[i],"--group-scale-report")==0){
+			CHECK_ARG("--group-scale-report", ++i, argc);
+			lime_tester::groupScaleReport=std::string(argv[i]);
 		}else {
 			int ret = bc_tester_parse_args(argc, argv, i);
 			if (ret>0) {
@@ -38,6 +38,9 @@ extern test_suite_t lime_massive_group_test_suite;
 #ifdef FFI_ENABLED
 extern test_suite_t lime_ffi_test_suite;
 #endif
+#ifdef LIME_COROUTINES_ENABLED
+extern test_suite_t lime_coroutine_test_suite;
+#endif
 
 void lime_tester_init(void(*ftester_printf)(int level, const char *fmt, va_list args));
 void lime_tester_uninit(void);
@@ -0,0 +1,235 @@
+/*
+	lime_coroutine-tester.cpp
+	@author Johan Pascal
+	@copyright 	Copyright (C) 2018  Belledonne Communications SARL
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lime_log.hpp"
+#include "lime/lime.hpp"
+#include "lime/lime_coroutine.hpp"
+#include "lime-tester.hpp"
+#include "lime-tester-utils.hpp"
+
+#include <bctoolbox/tester.h>
+#include <bctoolbox/exception.hh>
+#include <belle-sip/belle-sip.h>
+
+#include <coroutine>
+#include <stdexcept>
+
+using namespace::std;
+using namespace::lime;
+
+static belle_sip_stack_t *bc_stack=NULL;
+
+static int coroutine_before_all(void) {
+	bc_stack=belle_sip_stack_new(NULL);
+	return 0;
+}
+
+static int coroutine_after_all(void) {
+	belle_sip_object_unref(bc_stack);
+	return 0;
+}
+
+// number of messages posted to the X3DH server through the awaitable transport
+static int postedMessages = 0;
+
+/**
+ * @brief Awaitable transport to the loopback X3DH server
+ *
+ * The loopback server delivers its responses from lime_tester::wait_for, they resume the coroutine awaiting them.
+ * When failing, the response is dropped and an exception is thrown instead, as a transport losing the connection would do.
+ */
+struct LoopbackPost {
+	bool failing;
+
+	struct Awaiter {
+		const std::string &url;
+		const std::string &from;
+		const std::vector<uint8_t> &message;
+		bool failing;
+		lime::awaitable::X3DHServerResponse response;
+
+		bool await_ready() const noexcept {return false;};
+		void await_suspend(std::coroutine_handle<> handle) {
+			postedMessages++;
+			lime_tester::x3dhLoopbackServer->post(url, from, message, [this, handle](int responseCode, const std::vector<uint8_t> &responseBody) {
+				response.code = responseCode;
+				response.body = responseBody;
+				handle.resume();
+			});
+		};
+		lime::awaitable::X3DHServerResponse await_resume() {
+			if (failing) throw std::runtime_error("connection lost");
+			return std::move(response);
+		};
+	};
+
+	Awaiter operator()(const std::string &url, const std::string &from, const std::vector<uint8_t> &message) const {
+		return Awaiter{url, from, message, failing, {0, {}}};
+	};
+};
+
+/**
+ * @brief Coroutine running a test scenario, started by the test and running until its end
+ */
+struct ScenarioTask {
+	struct promise_type {
+		ScenarioTask get_return_object() noexcept {return {};};
+		std::suspend_never initial_suspend() noexcept {return {};};
+		std::suspend_never final_suspend() noexcept {return {};};
+		void return_void() noexcept {};
+		void unhandled_exception() noexcept {
+			BC_FAIL("Unhandled exception in test scenario");
+		};
+	};
+};
+
+/* alice and bob register, alice encrypts to bob twice, both update and unregister, all through the awaitable interface */
+static ScenarioTask coroutine_basic_scenario(LimeManager &aliceManager, LimeManager &bobManager, std::shared_ptr<std::string> aliceDeviceId, std::shared_ptr<std::string> bobDeviceId,
+		const lime::CurveId curve, const std::string x3dh_server_url, int &done) {
+	try {
+		auto result = co_await lime::awaitable::create_user(aliceManager, *aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::success);
+		result = co_await lime::awaitable::create_user(bobManager, *bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::success);
+
+		// first encryption: the coroutine is suspended while bob key bundle is fetched
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		recipients->emplace_back(*bobDeviceId);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		auto posted = postedMessages;
+		result = co_await lime::awaitable::encrypt(aliceManager, *aliceDeviceId, make_shared<const std::string>("bob"), recipients, message, cipherMessage);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::success);
+		BC_ASSERT_TRUE(postedMessages > posted);
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(bobManager.decrypt(*bobDeviceId, "bob", *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[0]);
+
+		// the session is now ready: the second encryption completes without the X3DH server
+		recipients = make_shared<std::vector<RecipientData>>();
+		recipients->emplace_back(*bobDeviceId);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+		cipherMessage = make_shared<std::vector<uint8_t>>();
+		posted = postedMessages;
+		result = co_await lime::awaitable::encrypt(aliceManager, *aliceDeviceId, make_shared<const std::string>("bob"), recipients, message, cipherMessage);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::success);
+		BC_ASSERT_EQUAL(postedMessages, posted, int, "%d");
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(bobManager.decrypt(*bobDeviceId, "bob", *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[1]);
+
+		result = co_await lime::awaitable::update(aliceManager);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::success);
+		result = co_await lime::awaitable::update(bobManager, 2, lime_tester::OPkInitialBatchSize);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::success);
+
+		result = co_await lime::awaitable::delete_user(aliceManager, *aliceDeviceId);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::success);
+		result = co_await lime::awaitable::delete_user(bobManager, *bobDeviceId);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::success);
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+	done = 1;
+}
+
+/* a user registration failing in the transport is reported as a failure by co_await */
+static ScenarioTask coroutine_transportFailure_scenario(LimeManager &aliceManager, std::shared_ptr<std::string> aliceDeviceId, const lime::CurveId curve, const std::string x3dh_server_url, int &done) {
+	try {
+		auto result = co_await lime::awaitable::create_user(aliceManager, *aliceDeviceId, x3dh_server_url, curve);
+		BC_ASSERT_TRUE(result.status == lime::CallbackReturn::fail);
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+	done = 1;
+}
+
+/**
+ * Scenario: the LimeManagers post to the X3DH server through an awaitable transport and the operations are awaited
+ * - the first encryption suspends until bob key bundle is fetched, the second one completes without suspension
+ * - a transport failure is reported as a failed operation
+ */
+static void lime_coroutine_basic_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	try {
+		// the managers outlive the scenarios: they end resumed from one of their callbacks
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, lime::awaitable::make_X3DHServerPost(LoopbackPost{false})));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, lime::awaitable::make_X3DHServerPost(LoopbackPost{false})));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		int done = 0;
+		coroutine_basic_scenario(*aliceManager, *bobManager, aliceDeviceId, bobDeviceId, curve, x3dh_server_url, done);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack, &done, 1, lime_tester::wait_for_timeout));
+		BC_ASSERT_FALSE(aliceManager->is_user(*aliceDeviceId));
+		BC_ASSERT_FALSE(bobManager->is_user(*bobDeviceId));
+
+		auto failingManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, lime::awaitable::make_X3DHServerPost(LoopbackPost{true})));
+		auto failingDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		done = 0;
+		coroutine_transportFailure_scenario(*failingManager, failingDeviceId, curve, x3dh_server_url, done);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack, &done, 1, lime_tester::wait_for_timeout));
+		BC_ASSERT_FALSE(failingManager->is_user(*failingDeviceId)); // removed from local storage once the failure is forwarded
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
+}
+
+static void lime_coroutine_basic() {
+#ifdef EC25519_ENABLED
+	lime_coroutine_basic_test(lime::CurveId::c25519, "lime_coroutine_basic");
+#endif
+#ifdef EC448_ENABLED
+	lime_coroutine_basic_test(lime::CurveId::c448, "lime_coroutine_basic");
+#endif
+}
+
+static test_t tests[] = {
+	TEST_NO_TAG("Basic", lime_coroutine_basic),
+};
+
+test_suite_t lime_coroutine_test_suite = {
+	"Coroutine",
+	coroutine_before_all,
+	coroutine_after_all,
+	NULL,
+	NULL,
+	sizeof(tests) / sizeof(tests[0]),
+	tests
+};
@@ -30,6 +30,8 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <set>
 #include <stdio.h>
 #include <string.h>
 
@@ -89,6 +91,19 @@ void keyExchange_test(void) {
 
 	/* Compare them */
 	BC_ASSERT_TRUE(Alice->get_sharedSecret()==Bob->get_sharedSecret());
+
+	/* Direct operations must match the keyExchange interface */
+	Xpair<Curve> Carol;
+	X_generateKeyPair<Curve>(Carol, *rng);
+	X<Curve, lime::Xtype::sharedSecret> CarolAlice, AliceCarol, CarolBob;
+	Alice->set_peerPublic(Carol.publicKey());
+	Alice->computeSharedSecret();
+	X_computeSharedSecret<Curve>(Carol.privateKey(), Alice->get_selfPublic(), CarolAlice);
+	BC_ASSERT_TRUE(Alice->get_sharedSecret()==CarolAlice);
+	X_computeSharedSecret<Curve>(Alice->get_secret(), Carol.publicKey(), AliceCarol);
+	BC_ASSERT_TRUE(CarolAlice==AliceCarol);
+	X_computeSharedSecret<Curve>(Carol.privateKey(), Bob->get_selfPublic(), CarolBob);
+	BC_ASSERT_FALSE(CarolAlice==CarolBob);
 }
 
 template <typename Curve>
@@ -148,14 +163,14 @@ static void exchange(void) {
 #ifdef EC25519_ENABLED
 	keyExchange_test<C255>();
 	if (bench) {
-		LIME_LOGI<<"Bench for Curve 25519:"<<endl;
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for Curve 25519:"<<endl;
 		keyExchange_bench<C255>(BENCH_TIMING_MS);
 	}
 #endif
 #ifdef EC448_ENABLED
 	keyExchange_test<C448>();
 	if (bench) {
-		LIME_LOGI<<"Bench for Curve 448:"<<endl;
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for Curve 448:"<<endl;
 		keyExchange_bench<C448>(BENCH_TIMING_MS);
 	}
 #endif
@@ -221,6 +236,23 @@ void signAndVerify_test(void) {
 
 	/* Compare them */
 	BC_ASSERT_TRUE(AliceKeyExchange->get_sharedSecret()==BobKeyExchange->get_sharedSecret());
+
+	/* Direct conversions and computation must match the keyExchange interface */
+	X<Curve, lime::Xtype::privateKey> AliceX;
+	X<Curve, lime::Xtype::publicKey> BobX;
+	X<Curve, lime::Xtype::sharedSecret> directSharedSecret;
+	X_fromDSA<Curve>(AliceDSA->get_secret(), AliceX);
+	X_fromDSA<Curve>(BobDSA->get_public(), BobX);
+	BC_ASSERT_TRUE(AliceX==AliceKeyExchange->get_secret());
+	BC_ASSERT_TRUE(BobX==BobKeyExchange->get_selfPublic());
+	X_computeSharedSecret<Curve>(AliceX, BobX, directSharedSecret);
+	BC_ASSERT_TRUE(directSharedSecret==AliceKeyExchange->get_sharedSecret());
+
+	/* Direct verify of a key exchange public key signature */
+	DSA<Curve, lime::DSAtype::signature> XSignature;
+	AliceDSA->sign(BobX, XSignature);
+	BC_ASSERT_TRUE(DSA_verify<Curve>(AliceDSA->get_public(), BobX, XSignature));
+	BC_ASSERT_FALSE(DSA_verify<Curve>(BobDSA->get_public(), BobX, XSignature));
 }
 
 template <typename Curve>
@@ -302,19 +334,142 @@ static void signAndVerify(void) {
 #ifdef EC25519_ENABLED
 	signAndVerify_test<C255>();
 	if (bench) {
-		LIME_LOGI<<"Bench for Curve 25519:"<<endl;
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for Curve 25519:"<<endl;
 		signAndVerify_bench<C255>(BENCH_TIMING_MS);
 	}
 #endif
 #ifdef EC448_ENABLED
 	signAndVerify_test<C448>();
 	if (bench) {
-		LIME_LOGI<<"Bench for Curve 448:"<<endl;
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for Curve 448:"<<endl;
 		signAndVerify_bench<C448>(BENCH_TIMING_MS);
 	}
 #endif
 }
 
+/**
+ * Key exchange and signature contexts are reused once their object is destroyed
+ * Scenario:
+ * - create and use key exchange and signature objects then destroy them
+ * - create new ones: they shall hold no key
+ * - use them to check they still work
+ */
+template <typename Curve>
+void contextsReuse_test(void) {
+	auto rng = make_RNG();
+
+	{
+		auto DH = make_keyExchange<Curve>();
+		DH->createKeyPair(rng);
+		DH->set_peerPublic(DH->get_selfPublic());
+		DH->computeSharedSecret();
+		auto signature = make_Signature<Curve>();
+		signature->createKeyPair(rng);
+		DH->set_secret(signature->get_secret()); // uses a temporary signature context
+	}
+
+	// reused contexts shall not hold any key
+	auto DH = make_keyExchange<Curve>();
+	auto signature = make_Signature<Curve>();
+	bool gotException = false;
+	try {
+		DH->get_secret();
+	} catch (BctbxException &) {
+		gotException = true;
+	}
+	BC_ASSERT_TRUE(gotException);
+	gotException = false;
+	try {
+		DH->get_sharedSecret();
+	} catch (BctbxException &) {
+		gotException = true;
+	}
+	BC_ASSERT_TRUE(gotException);
+	gotException = false;
+	try {
+		signature->get_secret();
+	} catch (BctbxException &) {
+		gotException = true;
+	}
+	BC_ASSERT_TRUE(gotException);
+
+	// and still work
+	signature->createKeyPair(rng);
+	std::vector<uint8_t> message{0x01, 0x02, 0x03, 0x04};
+	DSA<Curve, lime::DSAtype::signature> sig;
+	signature->sign(message, sig);
+	BC_ASSERT_TRUE(signature->verify(message, sig));
+	auto peerDH = make_keyExchange<Curve>();
+	peerDH->createKeyPair(rng);
+	DH->set_secret(signature->get_secret());
+	DH->set_selfPublic(signature->get_public());
+	DH->set_peerPublic(peerDH->get_selfPublic());
+	peerDH->set_peerPublic(signature->get_public());
+	DH->computeSharedSecret();
+	peerDH->computeSharedSecret();
+	BC_ASSERT_TRUE(DH->get_sharedSecret()==peerDH->get_sharedSecret());
+}
+
+/* measure the X3DH sender operations on a peer key bundle: each one creates its own signature and key exchange objects */
+template <typename Curve>
+void contextsReuse_bench(uint64_t runTime_ms) {
+	constexpr size_t batch_size = 100;
+
+	auto rng = make_RNG();
+	// a peer bundle: Ik and a signed SPk
+	auto peerIk = make_Signature<Curve>();
+	peerIk->createKeyPair(rng);
+	auto peerSPk = make_keyExchange<Curve>();
+	peerSPk->createKeyPair(rng);
+	DSA<Curve, lime::DSAtype::signature> SPk_sig;
+	peerIk->sign(peerSPk->get_selfPublic(), SPk_sig);
+	auto Ik_public = peerIk->get_public();
+	auto SPk_public = peerSPk->get_selfPublic();
+
+	auto start = bctbx_get_cur_time_ms();
+	uint64_t span=0;
+	size_t runCount = 0;
+
+	while (span<runTime_ms) {
+		for (size_t i=0; i<batch_size; i++) {
+			auto SPkVerify = make_Signature<Curve>();
+			SPkVerify->set_public(Ik_public);
+			SPkVerify->verify(SPk_public, SPk_sig);
+			auto DH = make_keyExchange<Curve>();
+			DH->createKeyPair(rng);
+			DH->set_peerPublic(SPk_public);
+			DH->computeSharedSecret();
+			DH->set_peerPublic(Ik_public);
+			DH->computeSharedSecret();
+		}
+		span = bctbx_get_cur_time_ms() - start;
+		runCount += batch_size;
+	}
+
+	auto freq = 1000*runCount/static_cast<double>(span);
+	std::string freq_unit, period_unit;
+	snprintSI(freq_unit, freq, "bundles/s");
+	snprintSI(period_unit, 1/freq, "s/bundle");
+	LIME_LOGI<<"Process "<<int(runCount)<<" peer bundles in "<<int(span)<<" ms : "<<period_unit<<" "<<freq_unit<<endl<<endl;
+}
+
+static void contextsReuse(void) {
+#ifdef EC25519_ENABLED
+	contextsReuse_test<C255>();
+	if (bench) {
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for Curve 25519:"<<endl;
+		contextsReuse_bench<C255>(BENCH_TIMING_MS);
+	}
+#endif
+#ifdef EC448_ENABLED
+	contextsReuse_test<C448>();
+	if (bench) {
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for Curve 448:"<<endl;
+		contextsReuse_bench<C448>(BENCH_TIMING_MS);
+	}
+#endif
+}
+
 static void hashMac_KDF_bench(uint64_t runTime_ms, size_t IKMsize) {
 	size_t batch_size = 500;
 	/* input lenght is the same used by X3DH */
@@ -393,23 +548,87 @@ static void hashMac_KDF(void) {
 	HMAC_KDF<SHA512>(salt, IKM, info, output.data(), output.size());
 	BC_ASSERT_TRUE(OKM==output);
 
+	/* HMAC batch gives the same outputs than individual HMAC: use chain key sized keys and several input and output sizes */
+	constexpr size_t jobsCount = 7;
+	std::vector<std::vector<uint8_t>> keys(jobsCount), inputs(jobsCount), batchOutputs(jobsCount), outputs(jobsCount);
+	std::vector<HMACJob> jobs{};
+	for (size_t i=0; i<jobsCount; i++) {
+		keys[i].resize(lime::settings::DRChainKeySize);
+		lime_tester::randomize(keys[i].data(), keys[i].size());
+		inputs[i].resize(i*20);
+		lime_tester::randomize(inputs[i].data(), inputs[i].size());
+		batchOutputs[i].resize(16+i*8);
+		outputs[i].resize(batchOutputs[i].size());
+		HMAC<SHA512>(keys[i].data(), keys[i].size(), inputs[i].data(), inputs[i].size(), outputs[i].data(), outputs[i].size());
+		jobs.push_back(HMACJob{keys[i].data(), keys[i].size(), inputs[i].data(), inputs[i].size(), batchOutputs[i].data(), batchOutputs[i].size()});
+	}
+	HMAC_batch<SHA512>(jobs.data(), jobs.size());
+	BC_ASSERT_TRUE(batchOutputs==outputs);
+
 
 	/* Run benchmarks */
 	if (bench) {
 		size_t IKMsize = 0;
 	#ifdef EC25519_ENABLED
 		IKMsize = DSA<C255, lime::DSAtype::publicKey>::ssize()+4*X<C255, lime::Xtype::sharedSecret>::ssize();
-		LIME_LOGI<<"Bench for SHA512 on Curve 25519 X3DH sized IKM("<<IKMsize<<" bytes)"<<endl;
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for SHA512 on Curve 25519 X3DH sized IKM("<<IKMsize<<" bytes)"<<endl;
 		hashMac_KDF_bench(BENCH_TIMING_MS, IKMsize);
 	#endif
 	#ifdef EC448_ENABLED
 		IKMsize = DSA<C448, lime::DSAtype::publicKey>::ssize()+4*X<C448, lime::Xtype::sharedSecret>::ssize();
-		LIME_LOGI<<"Bench for SHA512 on Curve 448 X3DH sized IKM("<<IKMsize<<" bytes)"<<endl;
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for SHA512 on Curve 448 X3DH sized IKM("<<IKMsize<<" bytes)"<<endl;
 		hashMac_KDF_bench(BENCH_TIMING_MS, IKMsize);
 	#endif
 	}
 }
 
+/**
+ * @brief Bench the AEAD encryption, one by one and in batches of DR messages
+ *
+ * @param[in]	runTime_ms	minimum duration of each bench
+ * @param[in]	plainSize	size of the encrypted messages
+ */
+static void AEAD_bench(uint64_t runTime_ms, size_t plainSize) {
+	constexpr size_t batch_size = 100;
+	std::vector<uint8_t> key(AES256GCM::keySize());
+	lime_tester::randomize(key.data(), key.size());
+	std::vector<uint8_t> IV(lime::settings::DRMessageIVSize);
+	lime_tester::randomize(IV.data(), IV.size());
+	std::vector<uint8_t> AD(100); // DR messages AD are around this size
+	lime_tester::randomize(AD.data(), AD.size());
+	std::vector<uint8_t> plain(plainSize);
+	lime_tester::randomize(plain.data(), plain.size());
+	std::vector<std::vector<uint8_t>> ciphers(batch_size, std::vector<uint8_t>(plainSize));
+	std::vector<std::vector<uint8_t>> tags(batch_size, std::vector<uint8_t>(AES256GCM::tagSize()));
+	std::vector<AEADJob> jobs{};
+	for (size_t i=0; i<batch_size; i++) {
+		jobs.push_back(AEADJob{key.data(), key.size(), IV.data(), IV.size(), plain.data(), plain.size(), AD.data(), AD.size(), tags[i].data(), tags[i].size(), ciphers[i].data()});
+	}
+
+	for (const bool batch : {false, true}) {
+		auto start = bctbx_get_cur_time_ms();
+		uint64_t span=0;
+		size_t runCount = 0;
+		while (span<runTime_ms) {
+			if (batch) {
+				AEAD_encrypt_batch<AES256GCM>(jobs.data(), jobs.size());
+			} else {
+				for (size_t i=0; i<batch_size; i++) {
+					AEAD_encrypt<AES256GCM>(key.data(), key.size(), IV.data(), IV.size(), plain.data(), plain.size(), AD.data(), AD.size(), tags[i].data(), tags[i].size(), ciphers[i].data());
+				}
+			}
+			span = bctbx_get_cur_time_ms() - start;
+			runCount += batch_size;
+		}
+
+		auto freq = 1000*runCount/static_cast<double>(span);
+		std::string freq_unit, period_unit;
+		snprintSI(freq_unit, freq, "encryptions/s");
+		snprintSI(period_unit, 1/freq, "s/encryption");
+		LIME_LOGI<<"Encrypt "<<int(runCount)<<" "<<plainSize<<" bytes messages"<<(batch?" in batches":"")<<" in "<<int(span)<<" ms : "<<period_unit<<" "<<freq_unit<<endl<<endl;
+	}
+}
+
 static void AEAD(void) {
 	std::vector<uint8_t> cipher{};
 	std::vector<uint8_t> tag{};
@@ -607,6 +826,55 @@ static void AEAD(void) {
 	BC_ASSERT_TRUE(tag==pattern_tag);
 	BC_ASSERT_TRUE(AEAD_decrypt<AES256GCM>(key.data(), key.size(), IV.data(), IV.size(), pattern_cipher.data(), pattern_cipher.size(), AD.data(), AD.size(), pattern_tag.data(), pattern_tag.size(), plain.data()));
 	BC_ASSERT_TRUE(plain==pattern_plain);
+
+	/* Encryption batch: the same 32 bytes seed sealed under different keys, IV and AD as done by the double ratchet, outputs must match the individual encryptions */
+	constexpr size_t jobsCount = 5;
+	std::vector<uint8_t> seed(32);
+	lime_tester::randomize(seed.data(), seed.size());
+	std::vector<std::vector<uint8_t>> keys(jobsCount), IVs(jobsCount), ADs(jobsCount), batchCiphers(jobsCount), batchTags(jobsCount);
+	std::vector<AEADJob> jobs{};
+	for (size_t i=0; i<jobsCount; i++) {
+		keys[i].resize(AES256GCM::keySize());
+		lime_tester::randomize(keys[i].data(), keys[i].size());
+		IVs[i].resize(lime::settings::DRMessageIVSize);
+		lime_tester::randomize(IVs[i].data(), IVs[i].size());
+		ADs[i].resize(40+i*10);
+		lime_tester::randomize(ADs[i].data(), ADs[i].size());
+		batchCiphers[i].resize(seed.size());
+		batchTags[i].resize(AES256GCM::tagSize());
+		jobs.push_back(AEADJob{keys[i].data(), keys[i].size(), IVs[i].data(), IVs[i].size(), seed.data(), seed.size(), ADs[i].data(), ADs[i].size(), batchTags[i].data(), batchTags[i].size(), batchCiphers[i].data()});
+	}
+	AEAD_encrypt_batch<AES256GCM>(jobs.data(), jobs.size());
+	cipher.resize(seed.size());
+	plain.resize(seed.size());
+	for (size_t i=0; i<jobsCount; i++) {
+		AEAD_encrypt<AES256GCM>(keys[i].data(), keys[i].size(), IVs[i].data(), IVs[i].size(), seed.data(), seed.size(), ADs[i].data(), ADs[i].size(), tag.data(), tag.size(), cipher.data());
+		BC_ASSERT_TRUE(cipher==batchCiphers[i]);
+		BC_ASSERT_TRUE(tag==batchTags[i]);
+		BC_ASSERT_TRUE(AEAD_decrypt<AES256GCM>(keys[i].data(), keys[i].size(), IVs[i].data(), IVs[i].size(), batchCiphers[i].data(), batchCiphers[i].size(), ADs[i].data(), ADs[i].size(), batchTags[i].data(), batchTags[i].size(), plain.data()));
+		BC_ASSERT_TRUE(plain==seed);
+	}
+
+	/* an invalid job makes the whole batch fail before any encryption */
+	std::fill(batchCiphers[0].begin(), batchCiphers[0].end(), 0);
+	std::vector<uint8_t> zeroCipher(seed.size(), 0);
+	jobs.back().tagSize = 8;
+	bool thrown = false;
+	try {
+		AEAD_encrypt_batch<AES256GCM>(jobs.data(), jobs.size());
+	} catch (BctbxException &) {
+		thrown = true;
+	}
+	BC_ASSERT_TRUE(thrown);
+	BC_ASSERT_TRUE(batchCiphers[0]==zeroCipher);
+
+	/* Run benchmarks */
+	if (bench) {
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for AES256-GCM on random seed sized messages"<<endl;
+		AEAD_bench(BENCH_TIMING_MS, lime::settings::DRrandomSeedSize);
+		LIME_LOGI<<"["<<crypto_backend()<<"] Bench for AES256-GCM on 1024 bytes messages"<<endl;
+		AEAD_bench(BENCH_TIMING_MS, 1024);
+	}
 }
 
 /**
@@ -619,12 +887,11 @@ static void AEAD(void) {
  * To get an more readable perspective, mean and sqrt are divided by 0x7FFFFFFF
  * and result are tested agains 0.5 and 1/sqrt(12)
  *
+ * @param[in]	rng_source	the RNG to test
  */
-static void RNG_test(void) {
-	constexpr size_t NB_INT31_TESTED=10000;
+static void RNG_stats_test(std::shared_ptr<RNG> rng_source) {
+	constexpr size_t NB_INT31_TESTED=10000; // more than lime::settings::threadRNG_reseedInterval: the shared RNG thread context is replaced during the test
 
-	/* init the RNG */
-	auto rng_source = make_RNG();
 	uint32_t random_uint31 = rng_source->randomize();
 
 	long double m0=static_cast<long double>(random_uint31),
@@ -661,9 +928,71 @@ static void RNG_test(void) {
 	LIME_LOGD << NB_INT31_TESTED << " 31 bits unsigned integers generated Mean " << m0 << " Sigma "<<s0<<std::endl;
 }
 
+/**
+ * @brief Use the shared RNG from several threads at once: they shall all get different random seeds and key pairs
+ */
+template <typename Curve>
+static void RNG_shared_test(void) {
+	constexpr size_t threadsCount = 4;
+	constexpr size_t drawsPerThread = 200;
+	std::vector<std::vector<std::vector<uint8_t>>> draws(threadsCount);
+
+	std::vector<std::thread> threads{};
+	for (size_t t=0; t<threadsCount; t++) {
+		threads.emplace_back([&draws, t]() {
+			auto rng = shared_RNG();
+			auto DH = make_keyExchange<Curve>();
+			for (size_t i=0; i<drawsPerThread; i++) {
+				lime::sBuffer<lime::settings::DRrandomSeedSize> seed;
+				rng->randomize(seed);
+				draws[t].emplace_back(seed.cbegin(), seed.cend());
+				DH->createKeyPair(rng);
+				auto publicKey = DH->get_selfPublic();
+				draws[t].emplace_back(publicKey.cbegin(), publicKey.cend());
+			}
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	std::set<std::vector<uint8_t>> uniqueDraws{};
+	for (const auto &threadDraws : draws) {
+		uniqueDraws.insert(threadDraws.cbegin(), threadDraws.cend());
+	}
+	BC_ASSERT_EQUAL((int)uniqueDraws.size(), (int)(threadsCount*drawsPerThread*2), int, "%d");
+	// this is always the same object
+	BC_ASSERT_TRUE(shared_RNG() == shared_RNG());
+}
+
+static void RNG_test(void) {
+	/* a RNG with its own context */
+	RNG_stats_test(make_RNG());
+	/* the shared one using the thread contexts */
+	RNG_stats_test(shared_RNG());
+
+#ifdef EC25519_ENABLED
+	RNG_shared_test<C255>();
+#endif
+#ifdef EC448_ENABLED
+	RNG_shared_test<C448>();
+#endif
+}
+
+/**
+ * @brief The tests in this suite are the crypto backend conformance tests: log which one is tested
+ */
+static void backend(void) {
+	std::string backendName{crypto_backend()};
+	LIME_LOGI<<"Crypto backend: "<<backendName<<endl;
+	BC_ASSERT_FALSE(backendName.empty());
+}
+
 static test_t tests[] = {
+	TEST_NO_TAG("Backend", backend),
 	TEST_NO_TAG("Key Exchange", exchange),
 	TEST_NO_TAG("Signature", signAndVerify),
+	TEST_NO_TAG("Contexts reuse", contextsReuse),
 	TEST_NO_TAG("HKDF", hashMac_KDF),
 	TEST_NO_TAG("AEAD", AEAD),
 	TEST_NO_TAG("RNG", RNG_test),
@@ -21,6 +21,7 @@
 #include "lime-tester.hpp"
 #include "lime-tester-utils.hpp"
 #include "lime_localStorage.hpp"
+#include "lime_double_ratchet_protocol.hpp"
 
 #include <bctoolbox/tester.h>
 #include <bctoolbox/exception.hh>
@@ -656,6 +657,97 @@ static void dr_skip_too_much(void) {
 #endif
 }
 
+/**
+ * Skipped message keys deleted by the cleanup
+ * - bob stores skipped message keys, then receives enough messages in their chain for the cleanup to delete it
+ * - the late messages throw as their keys are listed in the index but not found in local storage anymore, or already used
+ * - the session is not modified by them: the next message decrypts
+ */
+template <typename Curve>
+static void dr_skippedKeysCleanup_test(std::string db_filename) {
+	std::shared_ptr<DR<Curve>> alice, bob;
+	std::shared_ptr<lime::Db> localStorageAlice, localStorageBob;
+	std::string aliceFilename(db_filename);
+	std::string bobFilename(db_filename);
+	aliceFilename.append(".alice.sqlite3");
+	bobFilename.append(".bob.sqlite3");
+
+	// remove temporary db file if they are here
+	remove(aliceFilename.data());
+	remove(bobFilename.data());
+
+	// fully establish session
+	dr_simple_exchange(alice, bob, localStorageAlice, localStorageBob, aliceFilename, bobFilename);
+
+	std::vector<std::vector<uint8_t>> DRmessages{};
+	std::vector<std::vector<uint8_t>> cipherMessages{};
+	auto aliceEncrypt = [&]() {
+		std::vector<RecipientInfos<Curve>> recipients;
+		recipients.emplace_back("bob",alice);
+		const auto &pattern = lime_tester::messages_pattern[DRmessages.size()%lime_tester::messages_pattern.size()];
+		std::vector<uint8_t> plaintext{pattern.begin(), pattern.end()};
+		std::vector<uint8_t> cipher{};
+		encryptMessage(recipients, plaintext, "bob", "alice", cipher, lime::EncryptionPolicy::DRMessage);
+		DRmessages.push_back(recipients[0].DRmessage);
+		cipherMessages.push_back(cipher);
+	};
+	auto bobDecrypt = [&](const size_t i) {
+		std::vector<shared_ptr<DR<Curve>>> recipientDRSessions{bob};
+		std::vector<uint8_t> plainBuffer{};
+		return decryptMessage("alice", "bob", "bob", recipientDRSessions, DRmessages[i], cipherMessages[i], plainBuffer) != nullptr
+			&& std::string{plainBuffer.begin(), plainBuffer.end()} == lime_tester::messages_pattern[i%lime_tester::messages_pattern.size()];
+	};
+
+	// bob gets the third message first: the keys of the first two are stored
+	for (size_t i=0; i<3; i++) {
+		aliceEncrypt();
+	}
+	BC_ASSERT_TRUE(bobDecrypt(2));
+
+	// enough messages are received after them for the cleanup to delete their chain
+	for (size_t i=0; i<lime::settings::maxMessagesReceivedAfterSkip+1; i++) {
+		aliceEncrypt();
+		BC_ASSERT_TRUE(bobDecrypt(DRmessages.size()-1));
+	}
+	bool cleaned = false;
+	for (size_t i=0; i<16 && !cleaned; i++) { // a single row per call: the chain is deleted after its keys
+		size_t rowBudget = 1;
+		cleaned = localStorageBob->clean_incremental(std::chrono::steady_clock::now() + std::chrono::seconds(10), rowBudget);
+	}
+	BC_ASSERT_TRUE(cleaned);
+
+	// the first message key is in the bob session index but not in local storage anymore: it throws, then the key is not indexed and it still throws
+	for (size_t i=0; i<2; i++) {
+		std::vector<uint8_t> plainBuffer{};
+		bool thrown = false;
+		try {
+			bob->ratchetDecrypt(DRmessages[0], std::vector<uint8_t>{}, plainBuffer, true);
+		} catch (BctbxException const &) {
+			thrown = true;
+		}
+		BC_ASSERT_TRUE(thrown);
+	}
+	BC_ASSERT_FALSE(bobDecrypt(1));
+
+	// the session was not modified by the late messages
+	aliceEncrypt();
+	BC_ASSERT_TRUE(bobDecrypt(DRmessages.size()-1));
+
+	if (cleanDatabase) {
+		remove(aliceFilename.data());
+		remove(bobFilename.data());
+	}
+}
+
+static void dr_skippedKeysCleanup(void) {
+#ifdef EC25519_ENABLED
+	dr_skippedKeysCleanup_test<C255>("dr_skippedKeysCleanup_C25519");
+#endif
+#ifdef EC448_ENABLED
+	dr_skippedKeysCleanup_test<C448>("dr_skippedKeysCleanup_C448");
+#endif
+}
+
 /* alice send a message to bob, and he replies */
 template <typename Curve>
 static void dr_encryptionPolicy_basic_test(std::string db_filename) {
@@ -841,6 +933,83 @@ static void dr_encryptionPolicy_error(void) {
 #endif
 }
 
+/**
+ * Build and parse the DR message header with and without OPk in the X3DH init message
+ * the header is parsed in place from a buffer holding it followed by a payload
+ */
+template <typename Curve>
+static void dr_header_codec_test(void) {
+	for (const bool haveOPk : {false, true}) {
+		DSA<Curve, lime::DSAtype::publicKey> Ik{};
+		X<Curve, lime::Xtype::publicKey> Ek{};
+		X<Curve, lime::Xtype::publicKey> DHs{};
+		lime_tester::randomize(Ik.data(), Ik.size());
+		lime_tester::randomize(Ek.data(), Ek.size());
+		lime_tester::randomize(DHs.data(), DHs.size());
+
+		// X3DH init message
+		std::vector<uint8_t> X3DH_initMessage{};
+		double_ratchet_protocol::buildMessage_X3DHinit<Curve>(X3DH_initMessage, Ik, Ek, 0x01020304, 0x05060708, haveOPk);
+		BC_ASSERT_EQUAL((int)X3DH_initMessage.size(), (int)double_ratchet_protocol::X3DHinitSize<Curve>(haveOPk), int, "%d");
+		DSA<Curve, lime::DSAtype::publicKey> parsedIk{};
+		X<Curve, lime::Xtype::publicKey> parsedEk{};
+		uint32_t SPk_id=0, OPk_id=0;
+		bool OPk_flag = !haveOPk;
+		double_ratchet_protocol::parseMessage_X3DHinit<Curve>(X3DH_initMessage, parsedIk, parsedEk, SPk_id, OPk_id, OPk_flag);
+		BC_ASSERT_TRUE(std::equal(Ik.cbegin(), Ik.cend(), parsedIk.cbegin()));
+		BC_ASSERT_TRUE(std::equal(Ek.cbegin(), Ek.cend(), parsedEk.cbegin()));
+		BC_ASSERT_EQUAL(SPk_id, 0x01020304, uint32_t, "%x");
+		BC_ASSERT_TRUE(OPk_flag == haveOPk);
+		if (haveOPk) BC_ASSERT_EQUAL(OPk_id, 0x05060708, uint32_t, "%x");
+
+		// header followed by a payload
+		std::vector<uint8_t> message(double_ratchet_protocol::headerSize<Curve>() + X3DH_initMessage.size() + 48, 0xaa);
+		const auto headerSize = double_ratchet_protocol::buildMessage_header<Curve>(message.data(), 0x1234, 0x5678, DHs, X3DH_initMessage, true);
+		BC_ASSERT_EQUAL((int)headerSize, (int)(double_ratchet_protocol::headerSize<Curve>() + X3DH_initMessage.size()), int, "%d");
+		BC_ASSERT_EQUAL(message[headerSize], 0xaa, uint8_t, "%x"); // the payload is untouched
+
+		double_ratchet_protocol::DRHeader<Curve> header{message.data(), message.size()};
+		BC_ASSERT_TRUE(header.valid());
+		BC_ASSERT_EQUAL(header.Ns(), 0x1234, uint16_t, "%x");
+		BC_ASSERT_EQUAL(header.PN(), 0x5678, uint16_t, "%x");
+		BC_ASSERT_TRUE(header.DHs() == DHs);
+		BC_ASSERT_TRUE(header.payloadDirectEncryption());
+		BC_ASSERT_EQUAL((int)header.size(), (int)headerSize, int, "%d");
+
+		std::vector<uint8_t> parsedX3DH_initMessage{};
+		BC_ASSERT_TRUE(double_ratchet_protocol::parseMessage_get_X3DHinit<Curve>(message, parsedX3DH_initMessage));
+		BC_ASSERT_TRUE(parsedX3DH_initMessage == X3DH_initMessage);
+
+		// a truncated header is invalid
+		double_ratchet_protocol::DRHeader<Curve> truncated{message.data(), headerSize-1};
+		BC_ASSERT_FALSE(truncated.valid());
+	}
+
+	// no X3DH init message
+	X<Curve, lime::Xtype::publicKey> DHs{};
+	lime_tester::randomize(DHs.data(), DHs.size());
+	std::vector<uint8_t> message{};
+	double_ratchet_protocol::buildMessage_header<Curve>(message, 7, 3, DHs, std::vector<uint8_t>{}, false);
+	BC_ASSERT_EQUAL((int)message.size(), (int)double_ratchet_protocol::headerSize<Curve>(), int, "%d");
+	double_ratchet_protocol::DRHeader<Curve> header{message};
+	BC_ASSERT_TRUE(header.valid());
+	BC_ASSERT_EQUAL(header.Ns(), 7, uint16_t, "%d");
+	BC_ASSERT_EQUAL(header.PN(), 3, uint16_t, "%d");
+	BC_ASSERT_TRUE(header.DHs() == DHs);
+	BC_ASSERT_FALSE(header.payloadDirectEncryption());
+	std::vector<uint8_t> X3DH_initMessage{};
+	BC_ASSERT_FALSE(double_ratchet_protocol::parseMessage_get_X3DHinit<Curve>(message, X3DH_initMessage));
+}
+
+static void dr_header_codec(void) {
+#ifdef EC25519_ENABLED
+	dr_header_codec_test<C255>();
+#endif
+#ifdef EC448_ENABLED
+	dr_header_codec_test<C448>();
+#endif
+}
+
 static test_t tests[] = {
 	TEST_NO_TAG("Basic", dr_basic),
 	TEST_NO_TAG("Long Exchange 1", dr_long_exchange1),
@@ -849,9 +1018,11 @@ static test_t tests[] = {
 	TEST_NO_TAG("Skip message", dr_skippedMessages_basic),
 	TEST_NO_TAG("Multidevices", dr_multidevice_basic),
 	TEST_NO_TAG("Skip more messages than limit", dr_skip_too_much),
+	TEST_NO_TAG("Skipped keys cleanup", dr_skippedKeysCleanup),
 	TEST_NO_TAG("Encryption Policy basic", dr_encryptionPolicy_basic),
 	TEST_NO_TAG("Encryption Policy multidevice", dr_encryptionPolicy_multidevice),
 	TEST_NO_TAG("Wrong Encryption Policy", dr_encryptionPolicy_error),
+	TEST_NO_TAG("Header codec", dr_header_codec),
 };
 
 test_suite_t lime_double_ratchet_test_suite = {
@@ -814,9 +814,136 @@ static void ffi_basic(void) {
 
 
 
+/* Scenario
+ * - create alice.d1 and bob.d1
+ * - alice encrypts to bob using the direct API and the cipher message policy: the cipher message is written before encrypt returns
+ * - bob decrypts using the direct API
+ * - alice encrypts to bob using the direct API and the DR message policy: no cipher message is written
+ * - bob decrypts using the direct API, without cipher message
+ * - bob decrypt fails with a too small plain message buffer, then succeeds with a large enough one
+ * - alice encrypts to bob using the direct API with a too small DR message buffer: the callback reports a failure
+ */
+static void ffi_direct_test(const enum lime_ffi_CurveId curve, const char *dbBaseFilename, const char *x3dh_server_url) {
+	/* users databases names: baseFilename.<alice/bob>.<curve id>.sqlite3 */
+	char dbFilenameAlice[512];
+	char dbFilenameBob[512];
+	sprintf(dbFilenameAlice, "%s.alice.%s.sqlite3", dbBaseFilename, (curve == lime_ffi_CurveId_c25519)?"C25519":"C448");
+	sprintf(dbFilenameBob, "%s.bob.%s.sqlite3", dbBaseFilename, (curve == lime_ffi_CurveId_c25519)?"C25519":"C448");
+
+	remove(dbFilenameAlice); /* delete the database file if already exists */
+	remove(dbFilenameBob); /* delete the database file if already exists */
+
+	/* reset counters */
+	success_counter = 0;
+	failure_counter = 0;
+	int expected_success=0;
+
+	char *aliceDeviceId = makeRandomDeviceName("alice.");
+	char *bobDeviceId = makeRandomDeviceName("bob.");
+
+	lime_manager_t aliceManager, bobManager;
+	lime_ffi_manager_init(&aliceManager, dbFilenameAlice, X3DHServerPost, NULL);
+	lime_ffi_manager_init(&bobManager, dbFilenameBob, X3DHServerPost, NULL);
+
+	/*** create users ***/
+	lime_ffi_create_user(aliceManager, aliceDeviceId, x3dh_server_url, curve, ffi_defaultInitialOPkBatchSize, statusCallback, NULL);
+	lime_ffi_create_user(bobManager, bobDeviceId, x3dh_server_url, curve, ffi_defaultInitialOPkBatchSize, statusCallback, NULL);
+	expected_success +=2;
+	BC_ASSERT_TRUE(wait_for(stack, &success_counter, expected_success, ffi_wait_for_timeout));
+
+	/*** encrypt using the cipher message policy ***/
+	size_t DRmessageSize = 0;
+	size_t cipherMessageSize = 0;
+	size_t message_patternSize = strlen(message_pattern[0])+1; /* get the NULL termination char too */
+	lime_ffi_encryptOutBuffersMaximumSize(message_patternSize, curve, &DRmessageSize, &cipherMessageSize);
+	char *recipientsDeviceId[] = {bobDeviceId};
+	lime_ffi_RecipientData_t *recipients = allocatedRecipientBuffers(DRmessageSize, recipientsDeviceId, 1);
+	uint8_t *cipherMessage = malloc(cipherMessageSize);
+
+	BC_ASSERT_EQUAL(lime_ffi_encryptDirect(aliceManager, aliceDeviceId, "bob", recipients, 1, (const uint8_t *const)message_pattern[0], message_patternSize, cipherMessage, &cipherMessageSize, statusCallback, NULL, lime_ffi_EncryptionPolicy_cipherMessage), LIME_FFI_SUCCESS, int, "%d");
+	/* the cipher message is already there: plain message size + auth tag */
+	BC_ASSERT_EQUAL(cipherMessageSize, message_patternSize+16, int, "%d");
+	BC_ASSERT_TRUE(wait_for(stack, &success_counter, ++expected_success, ffi_wait_for_timeout));
+	BC_ASSERT_EQUAL(recipients[0].peerStatus, lime_ffi_PeerDeviceStatus_unknown, int, "%d" );
+
+	/* bob decrypts */
+	size_t decryptedMessageSize = cipherMessageSize;
+	uint8_t *decryptedMessage = malloc(decryptedMessageSize);
+	BC_ASSERT_TRUE(lime_ffi_decryptDirect(bobManager, bobDeviceId, "bob", aliceDeviceId, recipients[0].DRmessage, recipients[0].DRmessageSize, cipherMessage, cipherMessageSize, decryptedMessage, &decryptedMessageSize) == lime_ffi_PeerDeviceStatus_unknown);
+	BC_ASSERT_EQUAL(message_patternSize, decryptedMessageSize, int, "%d");
+	BC_ASSERT_TRUE(strncmp(message_pattern[0], (char *)decryptedMessage, (message_patternSize<decryptedMessageSize)?message_patternSize:decryptedMessageSize)==0);
+	free(decryptedMessage);
+	freeRecipientBuffers(recipients, 1);
+	free(cipherMessage);
+
+	/*** encrypt using the DR message policy ***/
+	message_patternSize = strlen(message_pattern[1])+1;
+	lime_ffi_encryptOutBuffersMaximumSize(message_patternSize, curve, &DRmessageSize, &cipherMessageSize);
+	recipients = allocatedRecipientBuffers(DRmessageSize, recipientsDeviceId, 1);
+	cipherMessage = malloc(cipherMessageSize);
+
+	BC_ASSERT_EQUAL(lime_ffi_encryptDirect(aliceManager, aliceDeviceId, "bob", recipients, 1, (const uint8_t *const)message_pattern[1], message_patternSize, cipherMessage, &cipherMessageSize, statusCallback, NULL, lime_ffi_EncryptionPolicy_DRMessage), LIME_FFI_SUCCESS, int, "%d");
+	BC_ASSERT_EQUAL(cipherMessageSize, 0, int, "%d");
+	BC_ASSERT_TRUE(wait_for(stack, &success_counter, ++expected_success, ffi_wait_for_timeout));
+	BC_ASSERT_EQUAL(recipients[0].peerStatus, lime_ffi_PeerDeviceStatus_untrusted, int, "%d" );
+
+	/* bob decrypts: a too small buffer is detected before the decryption */
+	decryptedMessageSize = message_patternSize - 1;
+	decryptedMessage = malloc(recipients[0].DRmessageSize);
+	BC_ASSERT_TRUE(lime_ffi_decryptDirect(bobManager, bobDeviceId, "bob", aliceDeviceId, recipients[0].DRmessage, recipients[0].DRmessageSize, NULL, 0, decryptedMessage, &decryptedMessageSize) == lime_ffi_PeerDeviceStatus_fail);
+	decryptedMessageSize = recipients[0].DRmessageSize;
+	BC_ASSERT_TRUE(lime_ffi_decryptDirect(bobManager, bobDeviceId, "bob", aliceDeviceId, recipients[0].DRmessage, recipients[0].DRmessageSize, NULL, 0, decryptedMessage, &decryptedMessageSize) == lime_ffi_PeerDeviceStatus_untrusted);
+	BC_ASSERT_EQUAL(message_patternSize, decryptedMessageSize, int, "%d");
+	BC_ASSERT_TRUE(strncmp(message_pattern[1], (char *)decryptedMessage, (message_patternSize<decryptedMessageSize)?message_patternSize:decryptedMessageSize)==0);
+	free(decryptedMessage);
+	freeRecipientBuffers(recipients, 1);
+	free(cipherMessage);
+
+	/*** a too small DR message buffer gives a failure in the callback ***/
+	message_patternSize = strlen(message_pattern[0])+1;
+	lime_ffi_encryptOutBuffersMaximumSize(message_patternSize, curve, &DRmessageSize, &cipherMessageSize);
+	recipients = allocatedRecipientBuffers(8, recipientsDeviceId, 1);
+	cipherMessage = malloc(cipherMessageSize);
+	BC_ASSERT_EQUAL(lime_ffi_encryptDirect(aliceManager, aliceDeviceId, "bob", recipients, 1, (const uint8_t *const)message_pattern[0], message_patternSize, cipherMessage, &cipherMessageSize, statusCallback, NULL, lime_ffi_EncryptionPolicy_DRMessage), LIME_FFI_SUCCESS, int, "%d");
+	BC_ASSERT_TRUE(wait_for(stack, &failure_counter, 1, ffi_wait_for_timeout));
+	BC_ASSERT_EQUAL(success_counter, expected_success, int, "%d");
+	freeRecipientBuffers(recipients, 1);
+	free(cipherMessage);
+
+	/******* cleaning                   *************************/
+	if (ffi_cleanDatabase != 0) {
+		lime_ffi_delete_user(aliceManager, aliceDeviceId, statusCallback, NULL);
+		lime_ffi_delete_user(bobManager, bobDeviceId, statusCallback, NULL);
+		expected_success += 2;
+		BC_ASSERT_TRUE(wait_for(stack, &success_counter, expected_success, ffi_wait_for_timeout));
+		remove(dbFilenameAlice);
+		remove(dbFilenameBob);
+	}
+
+	lime_ffi_manager_destroy(aliceManager);
+	lime_ffi_manager_destroy(bobManager);
+
+	free(aliceDeviceId);
+	free(bobDeviceId);
+}
+
+static void ffi_direct(void) {
+	char serverURL[1024];
+	sprintf(serverURL, "https://%s:%s", ffi_test_x3dh_server_url, ffi_test_x3dh_c25519_server_port);
+	/* run the test on Curve25519 and Curve448 based encryption if available */
+#ifdef EC25519_ENABLED
+	ffi_direct_test(lime_ffi_CurveId_c25519, "ffi_direct", serverURL);
+#endif
+#ifdef EC448_ENABLED
+	sprintf(serverURL, "https://%s:%s", ffi_test_x3dh_server_url, ffi_test_x3dh_c448_server_port);
+	ffi_direct_test(lime_ffi_CurveId_c448, "ffi_direct", serverURL);
+#endif
+}
+
 static test_t tests[] = {
 	TEST_NO_TAG("FFI Hello World", ffi_helloworld),
-	TEST_NO_TAG("FFI Basic", ffi_basic)
+	TEST_NO_TAG("FFI Basic", ffi_basic),
+	TEST_NO_TAG("FFI Direct buffers", ffi_direct)
 };
 
 test_suite_t lime_ffi_test_suite = {
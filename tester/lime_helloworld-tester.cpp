@@ -128,6 +128,11 @@ static void process_response(void *data, const belle_http_response_event_t *even
  * @param[in] responseProcess	The function to be called when response from server arrives. Function prototype is defined in lime.hpp: (void)(int responseCode, std::vector<uint8_t>response)
  */
 static limeX3DHServerPostData X3DHServerPost([](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+	if (lime_tester::x3dhLoopbackServer) { // the in-process server is in use, no network involved
+		lime_tester::x3dhLoopbackServer->post(url, from, message, responseProcess);
+		return;
+	}
+
 	belle_http_request_listener_callbacks_t cbs;
 	belle_http_request_listener_t *l;
 	belle_generic_uri_t *uri;
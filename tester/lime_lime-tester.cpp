@@ -38,6 +38,9 @@
 #include <deque>
 #include <mutex>
 #include <list>
+#include <atomic>
+#include <map>
+#include <algorithm>
 
 using namespace::std;
 using namespace::lime;
@@ -115,6 +118,11 @@ static void process_response(void *data, const belle_http_response_event_t *even
  * @param[in] responseProcess	The function to be called when response from server arrives. Function prototype is defined in lime.hpp: (void)(int responseCode, std::vector<uint8_t>response)
  */
 static limeX3DHServerPostData X3DHServerPost([](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+	if (lime_tester::x3dhLoopbackServer) { // the in-process server is in use, no network involved
+		lime_tester::x3dhLoopbackServer->post(url, from, message, responseProcess);
+		return;
+	}
+
 	belle_http_request_listener_callbacks_t cbs;
 	belle_http_request_listener_t *l;
 	belle_generic_uri_t *uri;
@@ -1344,6 +1352,48 @@ static void lime_getSelfIk() {
 #endif
 }
 
+/**
+ * Scenario:
+ * - Open a manager with the server throughput preset and check the settings in effect
+ * - Open again the same base without storage options: journal mode is persistent so it shall still be wal, other settings are back to sqlite defaults
+ * - Open it with the mobile durable preset and check the settings in effect
+ */
+static void lime_storageOptions() {
+	std::string dbFilename{"lime_storageOptions.sqlite3"};
+	remove(dbFilename.data()); // delete the database file if already exists
+
+	try {
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost, lime::StorageOptions::serverThroughput()));
+		auto options = manager->get_storageOptions();
+		BC_ASSERT_TRUE(options.journalMode == lime::StorageJournalMode::wal);
+		BC_ASSERT_TRUE(options.synchronous == lime::StorageSynchronous::normal);
+		BC_ASSERT_TRUE(options.cacheSize == lime::StorageOptions::serverThroughput().cacheSize);
+		BC_ASSERT_TRUE(options.connectionPerUser);
+		manager = nullptr;
+
+		manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost));
+		options = manager->get_storageOptions();
+		BC_ASSERT_TRUE(options.journalMode == lime::StorageJournalMode::wal);
+		BC_ASSERT_TRUE(options.synchronous == lime::StorageSynchronous::full);
+		manager = nullptr;
+
+		manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost, lime::StorageOptions::mobileDurable()));
+		options = manager->get_storageOptions();
+		BC_ASSERT_TRUE(options.journalMode == lime::StorageJournalMode::wal);
+		BC_ASSERT_TRUE(options.synchronous == lime::StorageSynchronous::full);
+		BC_ASSERT_TRUE(options.mmapSize == 0);
+		BC_ASSERT_TRUE(options.cacheSize == lime::StorageOptions::mobileDurable().cacheSize);
+		manager = nullptr;
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	if (cleanDatabase) {
+		remove(dbFilename.data());
+	}
+}
+
 /**
  * Scenario:
  * - Create a user alice
@@ -2524,15 +2574,13 @@ static void x3dh_multidev_operation_queue(void) {
 }
 
 
-/* test scenario:
- * - create alice.d1 and bob.d1
- * - alice ask for a burst encryption of several message to bob.d1, first one shall trigger a X3DH init, the other ones shall be queued, if not we will initiate several X3DH init
- * - bob.d1 decrypt messages, check decryption is Ok and that they encapsulate the same X3DH init message
- * - Delete Alice and Bob devices to leave distant server base clean
- *
- * if continuousSession is set to false, delete and recreate LimeManager before each new operation to force relying on local Storage
+/*
+ * alice.d1 enable parallel encryption and encrypt to bob.d1 to bob.d6
+ * - messages are sent in bursts alternating DR message and cipher message policies, the first one sets up the sessions (X3DH), also in parallel
+ * - alice manager is destroyed and reloaded between bursts so we check all the sessions were correctly saved after a parallel encryption
+ * - bob decrypt everything on all devices
  */
-static void x3dh_operation_queue_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url, bool continuousSession=true) {
+static void lime_parallelEncryption_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
 	// create DB
 	std::string dbFilenameAlice{dbBaseFilename};
 	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
@@ -2555,74 +2603,66 @@ static void x3dh_operation_queue_test(const lime::CurveId curve, const std::stri
 				});
 
 	try {
-		// create Manager
+		// create Manager, alice uses 2 threads to encrypt
 		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
 		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		aliceManager->set_encryptionThreads(2);
 
-		// create Random devices names
+		// create users alice.d1 and bob.d1 to d6
 		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
-		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
-
-		// create users alice.d1 and bob.d1
 		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		expected_success +=2; // we have two asynchronous operation on going
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout)); // we must get callback saying all went well
-		if (counters.operation_failed == 1) return; // skip the end of the test if we can't do this
-
-		/* destroy and reload the Managers(tests everything is correctly saved/load from local Storage) */
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
-
-		// alice send a burst of messages to bob without waiting for callback before asking encryption of a new one
-		constexpr size_t messageBurstSize = 8;
-		std::array<std::shared_ptr<const std::vector<uint8_t>>, messageBurstSize> messages;
-		std::array<std::shared_ptr<std::vector<RecipientData>>, messageBurstSize> recipients;
-		std::array<std::shared_ptr<std::vector<uint8_t>>, messageBurstSize> cipherMessage;
-
-		for (size_t i=0; i<messages.size(); i++) {
-			cipherMessage[i] = make_shared<std::vector<uint8_t>>();
-			recipients[i] = make_shared<std::vector<RecipientData>>();
-			recipients[i]->emplace_back(*bobDevice1);
-			messages[i] = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
-		}
-
-		for (size_t i=0; i<messages.size(); i++) {
-			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients[i], messages[i], cipherMessage[i], callback);
-			expected_success++;
+		constexpr size_t bobDevicesCount = 6; // must be at least settings::parallelEncryption_minRecipients and settings::X3DH_parallelInit_minBundles
+		std::vector<std::shared_ptr<std::string>> bobDevices{};
+		for (size_t i=0; i<bobDevicesCount; i++) {
+			bobDevices.push_back(lime_tester::makeRandomDeviceName(std::string("bob.d").append(std::to_string(i+1)).append(".").data()));
+			bobManager->create_user(*(bobDevices.back()), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
 		}
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
-
-		/* destroy and reload the Managers(tests everything is correctly saved/load from local Storage) */
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+		expected_success += 1+bobDevicesCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		for (size_t burst=0; burst<2; burst++) {
+			// alternate the encryption policies so the payload is sometime in the DR message, sometime in the cipher message
+			constexpr size_t messageBurstSize = 4;
+			std::array<std::shared_ptr<std::vector<RecipientData>>, messageBurstSize> recipients;
+			std::array<std::shared_ptr<std::vector<uint8_t>>, messageBurstSize> cipherMessage;
+			for (size_t i=0; i<messageBurstSize; i++) {
+				recipients[i] = make_shared<std::vector<RecipientData>>();
+				for (const auto &bobDevice : bobDevices) {
+					recipients[i]->emplace_back(*bobDevice);
+				}
+				cipherMessage[i] = make_shared<std::vector<uint8_t>>();
+				auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[burst*messageBurstSize+i].begin(), lime_tester::messages_pattern[burst*messageBurstSize+i].end());
+				aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients[i], message, cipherMessage[i], callback, (i%2==0)?lime::EncryptionPolicy::DRMessage:lime::EncryptionPolicy::cipherMessage);
+				BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			}
 
-		// bob.d1 decrypt the messages
-		std::vector<uint8_t> X3DH_initMessageBuffer{}; // store the X3DH init message extracted from first message of the burst to be able to compare it to the following one, they must be the same.
-		// loop on cipher message and decrypt them bob Manager
-		for (size_t i=0; i<messages.size(); i++) {
-			for (auto &recipient : *(recipients[i])) {
-				std::vector<uint8_t> receivedMessage{};
-				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // new sessions created, they must convey X3DH init message
-				if (i==0) { // first message of the burst, extract and store the X3DH init message
-					lime_tester::DR_message_extractX3DHInit(recipient.DRmessage, X3DH_initMessageBuffer);
-				} else { // following message of the burst, extract X3DH init message and compare it to the first one, they must be the same, we shall not create new sessions
-					std::vector<uint8_t> X3DH_initMessageBuffer_next{};
-					lime_tester::DR_message_extractX3DHInit(recipient.DRmessage, X3DH_initMessageBuffer_next);
-					BC_ASSERT_TRUE(X3DH_initMessageBuffer == X3DH_initMessageBuffer_next);
+			// bob decrypts everything, in order
+			for (size_t i=0; i<messageBurstSize; i++) {
+				BC_ASSERT_EQUAL((int)recipients[i]->size(), (int)bobDevicesCount, int, "%d");
+				for (const auto &recipient : *(recipients[i])) {
+					std::vector<uint8_t> receivedMessage{};
+					BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *(cipherMessage[i]), receivedMessage) != lime::PeerDeviceStatus::fail);
+					std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+					BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[burst*messageBurstSize+i]);
 				}
-				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *(cipherMessage[i]), receivedMessage) != lime::PeerDeviceStatus::fail);
-				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[i]);
 			}
+
+			// destroy and reload alice manager: the sessions state must have been saved correctly
+			aliceManager = nullptr;
+			aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+			aliceManager->set_encryptionThreads(3);
 		}
 
+		// delete the users and db
 		if (cleanDatabase) {
-
-			// delete the users
 			aliceManager->delete_user(*aliceDevice1, callback);
-			bobManager->delete_user(*bobDevice1, callback);
-			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+2,lime_tester::wait_for_timeout));
-			remove(dbFilenameAlice.data()); // delete the database file if already exists
-			remove(dbFilenameBob.data()); // delete the database file if already exists
+			for (const auto &bobDevice : bobDevices) {
+				bobManager->delete_user(*bobDevice, callback);
+			}
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1+bobDevicesCount,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
 		}
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
@@ -2630,24 +2670,23 @@ static void x3dh_operation_queue_test(const lime::CurveId curve, const std::stri
 	}
 }
 
-static void x3dh_operation_queue(void) {
+static void lime_parallelEncryption(void) {
 #ifdef EC25519_ENABLED
-	x3dh_operation_queue_test(lime::CurveId::c25519, "lime_x3dh_operation_queue", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
-	x3dh_operation_queue_test(lime::CurveId::c25519, "lime_x3dh_operation_queue", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data(), false);
+	lime_parallelEncryption_test(lime::CurveId::c25519, "lime_parallelEncryption", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
 #endif
 #ifdef EC448_ENABLED
-	x3dh_operation_queue_test(lime::CurveId::c448, "lime_x3dh_operation_queue", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
-	x3dh_operation_queue_test(lime::CurveId::c448, "lime_x3dh_operation_queue", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data(), false);
+	lime_parallelEncryption_test(lime::CurveId::c448, "lime_parallelEncryption", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
 #endif
 }
- /* Test Scenario
- * - Alice and Bob register themselves on X3DH server
- * - Alice send message to Bob
- * - Bob deletes himself and create a user with the same DeviceId (but different Ik)
- * - Bob encrypts a message to Alice
- * - Alice tries to decrypt it, it shall fail
+
+/* test scenario:
+ * - create alice.d1, bob.d1 and bob.d2
+ * - alice stream encrypts a message larger than the stream chunk size to bob.d1 and bob.d2
+ * - bob.d1 decrypts it using the buffer API, bob.d2 using the stream API
+ * - alice stream encrypts an other message, bob.d1 fails to decrypt a tampered version of the cipher message, bob.d2 decrypts the genuine one
+ * - Delete Alice and Bob devices to leave distant server base clean
  */
-static void lime_identity_theft_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+static void lime_streamedCipherMessage_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
 	// create DB
 	std::string dbFilenameAlice{dbBaseFilename};
 	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
@@ -2669,84 +2708,80 @@ static void lime_identity_theft_test(const lime::CurveId curve, const std::strin
 					}
 				});
 
-	try {
-		auto recipients = make_shared<std::vector<RecipientData>>();
-		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+	// streams on memory buffers
+	auto bufferReader = [](const std::vector<uint8_t> &buffer) {
+		return limeStreamReader([&buffer](const size_t offset, uint8_t *output, const size_t size) {
+			if (offset >= buffer.size()) return (size_t)0;
+			auto readSize = std::min(size, buffer.size()-offset);
+			std::copy_n(buffer.cbegin()+offset, readSize, output);
+			return readSize;
+		});
+	};
+	auto bufferWriter = [](std::vector<uint8_t> &buffer) {
+		return limeStreamWriter([&buffer](const uint8_t *input, const size_t size) {
+			buffer.insert(buffer.end(), input, input+size);
+		});
+	};
 
-		// create Manager
+	try {
 		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
 		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
 
-		// create Random devices names
-		auto aliceDevice = lime_tester::makeRandomDeviceName("alice.");
-		auto bobDevice = lime_tester::makeRandomDeviceName("bob.");
-
-		// create users
-		aliceManager->create_user(*aliceDevice, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		bobManager->create_user(*bobDevice, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		if (counters.operation_failed > 0) return; // skip the end of the test if we can't do this
-
-		// alice encrypts a message to bob
-		recipients->emplace_back(*bobDevice);
-		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
-
-		aliceManager->encrypt(*aliceDevice, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-
-		// we don't need to decrypt, it only matters that Alice registered Bob's device Ik
-		// Bob deletes its user and create it again (with the same deviceId)
-		bobManager->delete_user(*bobDevice, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		bobManager->create_user(*bobDevice, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-
-		// Bob encrypts a message to Alice
-		recipients->emplace_back(*aliceDevice);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
-
-		bobManager->encrypt(*bobDevice, make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-
-		// alice tries decrypt it, it shall fail as Bob changed Ik!
-		std::vector<uint8_t> receivedMessage{};
-		BC_ASSERT(aliceManager->decrypt(*aliceDevice, "alice", *bobDevice, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::fail);
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		auto bobDevice2 = lime_tester::makeRandomDeviceName("bob.d2.");
+		bobManager->create_user(*bobDevice2, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		// cleaning
-		recipients->clear();
-		cipherMessage->clear();
+		for (size_t i=0; i<2; i++) {
+			// a message spanning a few stream chunks and not aligned on the chunk size
+			std::vector<uint8_t> plainMessage{};
+			while (plainMessage.size() < 3*64*1024) {
+				plainMessage.insert(plainMessage.end(), lime_tester::messages_pattern[i].cbegin(), lime_tester::messages_pattern[i].cend());
+			}
 
-		// Alice encrypts maxSendingChain messages to bob, she does it with its old Ik
-		for (auto i=0; i<lime::settings::maxSendingChain-1; i++) { // -1 as we already encrypted one message to bob
-			// alice encrypt
-			cipherMessage->clear();
-			recipients->clear();
-			recipients->emplace_back(*bobDevice);
-			aliceManager->encrypt(*aliceDevice, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(*bobDevice1);
+			recipients->emplace_back(*bobDevice2);
+			std::vector<uint8_t> cipherMessage{};
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, bufferReader(plainMessage), bufferWriter(cipherMessage), callback);
+			// the cipher message is produced before encrypt returns
+			BC_ASSERT_EQUAL((int)cipherMessage.size(), (int)(plainMessage.size()+lime::settings::DRMessageAuthTagSize), int, "%d");
 			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-			BC_ASSERT_TRUE((*recipients)[0].peerStatus == lime::PeerDeviceStatus::untrusted);
-		}
 
-		// update belle-sip stack processing possible incoming messages from server
-		belle_sip_stack_sleep(bc_stack,0);
+			if (i==0) { // bob.d1 uses the buffer API
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(bobManager->decrypt((*recipients)[0].deviceId, "bob", *aliceDevice1, (*recipients)[0].DRmessage, cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				BC_ASSERT_TRUE(receivedMessage == plainMessage);
+			} else { // bob.d1 gets a tampered cipher message: the DR message is fine so it shall throw an exception once the whole cipher message is processed
+				auto tamperedCipherMessage = cipherMessage;
+				tamperedCipherMessage[tamperedCipherMessage.size()/2] ^= 0x01;
+				std::vector<uint8_t> receivedMessage{};
+				bool gotException = false;
+				try {
+					bobManager->decrypt((*recipients)[0].deviceId, "bob", *aliceDevice1, (*recipients)[0].DRmessage, tamperedCipherMessage.size(), bufferReader(tamperedCipherMessage), bufferWriter(receivedMessage));
+				} catch (BctbxException &) {
+					gotException = true;
+				}
+				BC_ASSERT_TRUE(gotException);
+			}
 
-		// now we've ran the maximum number of messages, Alice shall ask for a new key bundle for bob, but it will fail because it will come with a new Ik
-		recipients->clear();
-		recipients->emplace_back(*bobDevice);
-		aliceManager->encrypt(*aliceDevice, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,1,lime_tester::wait_for_timeout));
+			// bob.d2 uses the stream API
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(bobManager->decrypt((*recipients)[1].deviceId, "bob", *aliceDevice1, (*recipients)[1].DRmessage, cipherMessage.size(), bufferReader(cipherMessage), bufferWriter(receivedMessage)) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(receivedMessage == plainMessage);
+		}
 
-		// delete the users
+		// delete the users and db
 		if (cleanDatabase) {
-			aliceManager->delete_user(*aliceDevice, callback);
-			bobManager->delete_user(*bobDevice, callback);
-			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+2,lime_tester::wait_for_timeout));
+			aliceManager->delete_user(*aliceDevice1, callback);
+			bobManager->delete_user(*bobDevice1, callback);
+			bobManager->delete_user(*bobDevice2, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+3,lime_tester::wait_for_timeout));
 			remove(dbFilenameAlice.data());
 			remove(dbFilenameBob.data());
 		}
@@ -2756,28 +2791,22 @@ static void lime_identity_theft_test(const lime::CurveId curve, const std::strin
 	}
 }
 
-static void lime_identity_theft(void) {
+static void lime_streamedCipherMessage(void) {
 #ifdef EC25519_ENABLED
-	lime_identity_theft_test(lime::CurveId::c25519, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+	lime_streamedCipherMessage_test(lime::CurveId::c25519, "lime_streamedCipherMessage", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
 #endif
 #ifdef EC448_ENABLED
-	lime_identity_theft_test(lime::CurveId::c448, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+	lime_streamedCipherMessage_test(lime::CurveId::c448, "lime_streamedCipherMessage", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
 #endif
 }
- /* A simple test with alice having 1 device and bob 2
- * - Alice and Bob(d1 and d2) register themselves on X3DH server
- * - Alice send message to Bob (d1 and d2)
- * - Alice send another message to Bob (d1 and d2)
- * - Bob d1 respond to Alice(with bob d2 in copy)
- * - Bob d2 respond to Alice(with bob d1 in copy)
- * - Alice send another message to Bob(d1 and d2)
+
+/* test scenario:
+ * - create alice.d1 and bob.d1
+ * - alice encrypts to bob.d1 from her buffers, alternating DR message and cipher message policies
+ * - bob.d1 fails to decrypt in a too small buffer, then decrypts in his buffer
  * - Delete Alice and Bob devices to leave distant server base clean
- *
- * At each message check that the X3DH init is present or not in the DR header
- * if continuousSession is set to false, delete and recreate LimeManager before each new operation to force relying on local Storage
- * Note: no asynchronous operation will start before the previous is over(callback returns)
  */
-static void x3dh_basic_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url, bool continuousSession=true) {
+static void lime_callerBuffers_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
 	// create DB
 	std::string dbFilenameAlice{dbBaseFilename};
 	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
@@ -2800,158 +2829,269 @@ static void x3dh_basic_test(const lime::CurveId curve, const std::string &dbBase
 				});
 
 	try {
-		// create Manager
 		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
 		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
 
-		// create Random devices names
 		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
-		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
-		auto bobDevice2 = lime_tester::makeRandomDeviceName("bob.d2.");
-
-		// create users
 		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
 		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		bobManager->create_user(*bobDevice2, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		if (counters.operation_failed == 1) return; // skip the end of the test if we can't do this
-
-		/* destroy and reload the Managers(tests everything is correctly saved/load from local Storage) */
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		// alice send a message to bob
-		auto recipients = make_shared<std::vector<RecipientData>>();
-		recipients->emplace_back(*bobDevice1);
-		recipients->emplace_back(*bobDevice2);
-		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
-		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		for (size_t i=0; i<4; i++) {
+			const auto &message = lime_tester::messages_pattern[i];
+			const auto policy = (i%2==0)?lime::EncryptionPolicy::DRMessage:lime::EncryptionPolicy::cipherMessage;
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(*bobDevice1);
+			std::vector<uint8_t> cipherMessage(message.size()+lime::settings::DRMessageAuthTagSize);
+			size_t cipherMessageSize = 0;
+			aliceManager->encrypt(*aliceDevice1, "bob", recipients, reinterpret_cast<const uint8_t *>(message.data()), message.size(), cipherMessage.data(), cipherMessage.size(), cipherMessageSize, callback, policy);
+			BC_ASSERT_EQUAL((int)cipherMessageSize, (policy==lime::EncryptionPolicy::DRMessage)?0:(int)cipherMessage.size(), int, "%d");
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			const auto &DRmessage = (*recipients)[0].DRmessage;
+			std::vector<uint8_t> plainMessage(std::max(DRmessage.size(), cipherMessageSize));
+			size_t plainMessageSize = 0;
+			// a buffer too small is rejected before trying to decrypt
+			bool gotException = false;
+			try {
+				bobManager->decrypt(*bobDevice1, "bob", *aliceDevice1, DRmessage.data(), DRmessage.size(), cipherMessage.data(), cipherMessageSize, plainMessage.data(), message.size()-1, plainMessageSize);
+			} catch (BctbxException &) {
+				gotException = true;
+			}
+			BC_ASSERT_TRUE(gotException);
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			std::vector<uint8_t> receivedMessage{};
-			BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // new sessions created, they must convey X3DH init message
-			BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+			BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "bob", *aliceDevice1, DRmessage.data(), DRmessage.size(), cipherMessage.data(), cipherMessageSize, plainMessage.data(), plainMessage.size(), plainMessageSize) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(std::string(plainMessage.cbegin(), plainMessage.cbegin()+plainMessageSize) == message);
 		}
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
-
-		// encrypt another one, same recipients(we shall have no new X3DH session but still the X3DH init message)
-		recipients->emplace_back(*bobDevice1);
-		recipients->emplace_back(*bobDevice2);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+		// delete the users and db
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			bobManager->delete_user(*bobDevice1, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+2,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+static void lime_callerBuffers(void) {
+#ifdef EC25519_ENABLED
+	lime_callerBuffers_test(lime::CurveId::c25519, "lime_callerBuffers", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_callerBuffers_test(lime::CurveId::c448, "lime_callerBuffers", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			std::vector<uint8_t> receivedMessage{};
-			BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // again X3DH message as no one ever responded to alice.d1
-			BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[1]);
-		}
+/* test scenario:
+ * - create alice.d1 and bob.d1
+ * - alice encrypts several messages to bob.d1 while he is offline, alternating DR message and cipher message policies
+ * - bob.d1 decrypts all of them in one batch, one of them being corrupted
+ * - check the messages are all decrypted but the corrupted one, the first one reports an unknown sender and the other ones an untrusted one
+ * - reload bob manager and check his session was saved: bob replies to alice
+ * - Delete Alice and Bob devices to leave distant server base clean
+ */
+static void lime_decryptBatch_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
 
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
 
-		// bob.d1 reply to alice and copy bob.d2
-		recipients->emplace_back(*aliceDevice1);
-		recipients->emplace_back(*bobDevice2);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[2].begin(), lime_tester::messages_pattern[2].end());
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		// alice encrypts a burst of messages
+		constexpr size_t messagesCount = 6;
+		constexpr size_t corruptedMessage = 3;
+		std::vector<DecryptionData> messages{};
+		for (size_t i=0; i<messagesCount; i++) {
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(*bobDevice1);
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback, (i%2==0)?lime::EncryptionPolicy::DRMessage:lime::EncryptionPolicy::cipherMessage);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			auto DRmessage = (*recipients)[0].DRmessage;
+			if (i == corruptedMessage) {
+				DRmessage.back() ^= 0x01; // corrupt the auth tag of the DR message
+			}
+			messages.emplace_back("bob", *aliceDevice1, DRmessage, *cipherMessage);
+		}
 
+		// bob decrypts them all at once
+		bobManager->decrypt_batch(*bobDevice1, messages);
+		for (size_t i=0; i<messagesCount; i++) {
+			if (i == corruptedMessage) {
+				BC_ASSERT_TRUE(messages[i].peerStatus == lime::PeerDeviceStatus::fail);
+				continue;
+			}
+			BC_ASSERT_TRUE(messages[i].peerStatus == ((i==0)?lime::PeerDeviceStatus::unknown:lime::PeerDeviceStatus::untrusted));
+			std::string receivedMessageString{messages[i].plainMessage.begin(), messages[i].plainMessage.end()};
+			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[i]);
+		}
+
+		// reload bob manager: the sessions shall have been committed to local storage, so he can reply
+		bobManager = nullptr;
+		bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		recipients->emplace_back(*aliceDevice1);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[messagesCount].begin(), lime_tester::messages_pattern[messagesCount].end());
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
 		bobManager->encrypt(*bobDevice1, make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
 		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-
-		// decrypt it
+		// bob is replying in the session opened by alice: no X3DH init in his message
+		BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit((*recipients)[0].DRmessage));
 		std::vector<uint8_t> receivedMessage{};
-		BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit((*recipients)[0].DRmessage)); // alice.d1 to bob.d1 already set up the DR Session, we shall not have any  X3DH message here
 		BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDevice1, "alice", *bobDevice1, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::untrusted);
-		std::string receivedMessageStringAlice{receivedMessage.begin(), receivedMessage.end()};
-		BC_ASSERT_TRUE(receivedMessageStringAlice == lime_tester::messages_pattern[2]);
+		std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[messagesCount]);
 
-		receivedMessage.clear();
-		BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit((*recipients)[1].DRmessage)); // bob.d1 to bob.d2 is a new session, we must have a X3DH message here
-		BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice2, "alice", *bobDevice1, (*recipients)[1].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-		std::string receivedMessageStringBob{receivedMessage.begin(), receivedMessage.end()};
-		BC_ASSERT_TRUE(receivedMessageStringBob == lime_tester::messages_pattern[2]);
+		// delete the users and db
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			bobManager->delete_user(*bobDevice1, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+2,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+static void lime_decryptBatch(void) {
+#ifdef EC25519_ENABLED
+	lime_decryptBatch_test(lime::CurveId::c25519, "lime_decryptBatch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_decryptBatch_test(lime::CurveId::c448, "lime_decryptBatch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
 
-		// Now do bob.d2 to alice and bob.d1 every one has an open session towards everyone
-		recipients->emplace_back(*aliceDevice1);
-		recipients->emplace_back(*bobDevice1);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[3].begin(), lime_tester::messages_pattern[3].end());
+/* test scenario:
+ * - create alice.d1 and bob.d1 to bob.d4, limit alice DR sessions cache to 2 sessions
+ * - alice encrypts to all bob devices: check her cache holds 2 sessions
+ * - alice encrypts again to all bob devices, the evicted sessions are reloaded from local storage
+ * - bob devices decrypt both messages
+ * - limit alice cache memory use under one session footprint: only the most recently used session is kept, remove the limits
+ * - Delete Alice and Bob devices to leave distant server base clean
+ */
+static void lime_DRSessionsCacheLimits_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
-		bobManager->encrypt(*bobDevice2, make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
 
-		// decrypt it
-		receivedMessage.clear();
-		BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit((*recipients)[0].DRmessage)); // alice.d1 to bob.d2 already set up the DR Session, we shall not have any  X3DH message here
-		BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDevice1, "alice", *bobDevice2, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::untrusted);
-		receivedMessageStringAlice = std::string{receivedMessage.begin(), receivedMessage.end()};
-		BC_ASSERT_TRUE(receivedMessageStringAlice == lime_tester::messages_pattern[3]);
-		receivedMessage.clear();
-		BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit((*recipients)[1].DRmessage)); // bob.d1 to bob.d2 already set up the DR Session, we shall not have any  X3DH message here
-		BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "alice", *bobDevice2, (*recipients)[1].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::untrusted);
-		receivedMessageStringBob = std::string{receivedMessage.begin(), receivedMessage.end()};
-		BC_ASSERT_TRUE(receivedMessageStringBob == lime_tester::messages_pattern[3]);
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
 
-		// encrypt another one from alice to bob.d1 and .d2, it must not send X3DH init anymore
-		recipients->emplace_back(*bobDevice1);
-		recipients->emplace_back(*bobDevice2);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[4].begin(), lime_tester::messages_pattern[4].end());
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		aliceManager->set_DRSessionsCacheLimits(2, 0);
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		constexpr size_t bobDevicesCount = 4;
+		std::vector<std::shared_ptr<std::string>> bobDevices{};
+		for (size_t i=0; i<bobDevicesCount; i++) {
+			bobDevices.push_back(lime_tester::makeRandomDeviceName(std::string("bob.d").append(std::to_string(i+1)).append(".").data()));
+			bobManager->create_user(*(bobDevices.back()), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += 1+bobDevicesCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			std::vector<uint8_t> receivedMessage{};
-			BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // bob.d1 and d2 both responded, so no more X3DH message shall be sent
-			BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::untrusted);
-			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[4]);
+		std::array<std::shared_ptr<std::vector<RecipientData>>, 2> recipients;
+		std::array<std::shared_ptr<std::vector<uint8_t>>, 2> cipherMessage;
+		for (size_t i=0; i<2; i++) {
+			recipients[i] = make_shared<std::vector<RecipientData>>();
+			for (const auto &bobDevice : bobDevices) {
+				recipients[i]->emplace_back(*bobDevice);
+			}
+			cipherMessage[i] = make_shared<std::vector<uint8_t>>();
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients[i], message, cipherMessage[i], callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+			size_t sessionsCount = 0;
+			size_t memorySize = 0;
+			aliceManager->get_DRSessionsCacheUsage(*aliceDevice1, sessionsCount, memorySize);
+			BC_ASSERT_EQUAL((int)sessionsCount, 2, int, "%d");
+			BC_ASSERT_TRUE(memorySize > 0);
 		}
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+		// bob devices decrypt both messages
+		for (size_t i=0; i<2; i++) {
+			for (const auto &recipient : *(recipients[i])) {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *(cipherMessage[i]), receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[i]);
+			}
+		}
 
-		// delete the users
+		// a memory limit under a session footprint keeps only the most recently used one
+		aliceManager->set_DRSessionsCacheLimits(0, 1);
+		size_t sessionsCount = 0;
+		size_t memorySize = 0;
+		aliceManager->get_DRSessionsCacheUsage(*aliceDevice1, sessionsCount, memorySize);
+		BC_ASSERT_EQUAL((int)sessionsCount, 1, int, "%d");
+		aliceManager->set_DRSessionsCacheLimits(0, 0);
+
+		// delete the users and db
 		if (cleanDatabase) {
 			aliceManager->delete_user(*aliceDevice1, callback);
-			bobManager->delete_user(*bobDevice1, callback);
-			bobManager->delete_user(*bobDevice2, callback);
-			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+3,lime_tester::wait_for_timeout));
+			for (const auto &bobDevice : bobDevices) {
+				bobManager->delete_user(*bobDevice, callback);
+			}
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1+bobDevicesCount,lime_tester::wait_for_timeout));
 			remove(dbFilenameAlice.data());
 			remove(dbFilenameBob.data());
 		}
@@ -2961,29 +3101,24 @@ static void x3dh_basic_test(const lime::CurveId curve, const std::string &dbBase
 	}
 }
 
-static void x3dh_basic(void) {
+static void lime_DRSessionsCacheLimits(void) {
 #ifdef EC25519_ENABLED
-	x3dh_basic_test(lime::CurveId::c25519, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
-	x3dh_basic_test(lime::CurveId::c25519, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data(), false);
+	lime_DRSessionsCacheLimits_test(lime::CurveId::c25519, "lime_DRSessionsCacheLimits", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
 #endif
 #ifdef EC448_ENABLED
-	x3dh_basic_test(lime::CurveId::c448, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
-	x3dh_basic_test(lime::CurveId::c448, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data(), false);
+	lime_DRSessionsCacheLimits_test(lime::CurveId::c448, "lime_DRSessionsCacheLimits", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
 #endif
 }
 
- /* A simple test with alice having 1 device and bob 2
- * - Alice and Bob(d1 and d2) register themselves on X3DH server
- * - Alice send another message to Bob non existing device d3, it shall fail without exception
- * - Alice send another message to Bob (d1 and d2) and try to send to an non existing device d3, d1 and d2 shall work
- * - repeat with the unknown device at the begining and in the middle of the recipients list
+/* test scenario:
+ * - create alice.d1 and bob.d1 to bob.d4, limit bob manager users cache to 2 users
+ * - alice encrypts two messages to all bob devices
+ * - bob devices decrypt the first message: they are loaded in turn, check the cache holds no more than 2 users
+ * - bob devices decrypt the second message: evicted users are reloaded from local storage
+ * - remove the limit
  * - Delete Alice and Bob devices to leave distant server base clean
- *
- * At each message check that the X3DH init is present or not in the DR header
- * if continuousSession is set to false, delete and recreate LimeManager before each new operation to force relying on local Storage
- * Note: no asynchronous operation will start before the previous is over(callback returns)
  */
-static void x3dh_user_not_found_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url, bool continuousSession=true) {
+static void lime_usersCacheLimit_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
 	// create DB
 	std::string dbFilenameAlice{dbBaseFilename};
 	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
@@ -2995,7 +3130,6 @@ static void x3dh_user_not_found_test(const lime::CurveId curve, const std::strin
 
 	lime_tester::events_counters_t counters={};
 	int expected_success=0;
-	int expected_fail=0;
 
 	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
 					if (returnCode == lime::CallbackReturn::success) {
@@ -3007,280 +3141,4376 @@ static void x3dh_user_not_found_test(const lime::CurveId curve, const std::strin
 				});
 
 	try {
-		// create Manager
 		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
 		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		bobManager->set_usersCacheLimit(2);
 
-		// create Random devices names
 		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
-		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
-		auto bobDevice2 = lime_tester::makeRandomDeviceName("bob.d2.");
-		auto bobDevice3 = lime_tester::makeRandomDeviceName("bob.d3."); // for this one we won't create the user nor register it on the X3DH server
-
-		// create users
 		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		bobManager->create_user(*bobDevice2, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		if (counters.operation_failed == 1) return; // skip the end of the test if we can't do this
+		constexpr size_t bobDevicesCount = 4;
+		std::vector<std::shared_ptr<std::string>> bobDevices{};
+		for (size_t i=0; i<bobDevicesCount; i++) {
+			bobDevices.push_back(lime_tester::makeRandomDeviceName(std::string("bob.d").append(std::to_string(i+1)).append(".").data()));
+			bobManager->create_user(*(bobDevices.back()), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += 1+bobDevicesCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		/* destroy and reload the Managers(tests everything is correctly saved/load from local Storage) */
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+		std::array<std::shared_ptr<std::vector<RecipientData>>, 2> recipients;
+		std::array<std::shared_ptr<std::vector<uint8_t>>, 2> cipherMessage;
+		for (size_t i=0; i<2; i++) {
+			recipients[i] = make_shared<std::vector<RecipientData>>();
+			for (const auto &bobDevice : bobDevices) {
+				recipients[i]->emplace_back(*bobDevice);
+			}
+			cipherMessage[i] = make_shared<std::vector<uint8_t>>();
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients[i], message, cipherMessage[i], callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		}
 
-		// alice send a message to bob d3
-		auto recipients = make_shared<std::vector<RecipientData>>();
-		recipients->emplace_back(*bobDevice3);
-		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
-		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		// bob devices decrypt both messages, each decryption loads the user if it was evicted
+		for (size_t i=0; i<2; i++) {
+			for (const auto &recipient : *(recipients[i])) {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *(cipherMessage[i]), receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[i]);
+				BC_ASSERT_TRUE(bobManager->get_usersCacheSize() <= 2);
+			}
+		}
+		bobManager->set_usersCacheLimit(0);
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		// The encryption shall return an error: no recipient device could get a key
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,++expected_fail,lime_tester::wait_for_timeout));
-		// but the status of the recipient disclose the failure on that one
-		BC_ASSERT_TRUE((*recipients)[0].peerStatus == lime::PeerDeviceStatus::fail);
+		// delete the users and db
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			for (const auto &bobDevice : bobDevices) {
+				bobManager->delete_user(*bobDevice, callback);
+			}
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1+bobDevicesCount,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+static void lime_usersCacheLimit(void) {
+#ifdef EC25519_ENABLED
+	lime_usersCacheLimit_test(lime::CurveId::c25519, "lime_usersCacheLimit", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_usersCacheLimit_test(lime::CurveId::c448, "lime_usersCacheLimit", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
 
-		// encrypt another one, for d1, d2 and d3. The first two shall be ok and d3 shall have a failed status
-		recipients->emplace_back(*bobDevice1);
-		recipients->emplace_back(*bobDevice2);
-		recipients->emplace_back(*bobDevice3);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+/* test scenario:
+ * - create alice.d1 and bob.d1 to bob.d3
+ * - alice prefetches the sessions with all bob devices, fetching the key bundles
+ * - alice encrypts to all bob devices: no X3DH server request is needed so the callback is called before encrypt returns
+ * - bob devices decrypt the message
+ * - reload alice from local storage and prefetch the sessions again without fetching key bundles: they are all loaded in cache
+ * - Delete Alice and Bob devices to leave distant server base clean
+ */
+static void lime_sessionsPrefetch_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			if (recipient.deviceId == *bobDevice3) {
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
-			} else {
-				std::vector<uint8_t> receivedMessage{};
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::unknown); // it is the first time alice has contact with bob's d1 and d2 devices
-				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
-				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[1]);
-			}
-		}
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
 
-		// encrypt another one, for d3, d2 and d1.
-		recipients->emplace_back(*bobDevice3);
-		recipients->emplace_back(*bobDevice2);
-		recipients->emplace_back(*bobDevice1);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[2].begin(), lime_tester::messages_pattern[2].end());
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		constexpr size_t bobDevicesCount = 3;
+		std::vector<std::string> bobDevices{};
+		for (size_t i=0; i<bobDevicesCount; i++) {
+			bobDevices.push_back(*lime_tester::makeRandomDeviceName(std::string("bob.d").append(std::to_string(i+1)).append(".").data()));
+			bobManager->create_user(bobDevices.back(), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += 1+bobDevicesCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		// prefetch and create the sessions
+		aliceManager->prefetch_sessions(*aliceDevice1, bobDevices, callback, true);
 		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		size_t sessionsCount = 0;
+		size_t memorySize = 0;
+		aliceManager->get_DRSessionsCacheUsage(*aliceDevice1, sessionsCount, memorySize);
+		BC_ASSERT_EQUAL((int)sessionsCount, (int)bobDevicesCount, int, "%d");
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			if (recipient.deviceId == *bobDevice3) {
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
-			} else {
-				std::vector<uint8_t> receivedMessage{};
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::untrusted);
-				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
-				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[2]);
-			}
+		// encrypt: sessions are ready, the callback is called synchronously
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		for (const auto &bobDevice : bobDevices) {
+			recipients->emplace_back(bobDevice);
 		}
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		expected_success++;
+		BC_ASSERT_EQUAL(counters.operation_success, expected_success, int, "%d");
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
-
-		// encrypt another one, for d2, d3 and d1.
-		recipients->emplace_back(*bobDevice2);
-		recipients->emplace_back(*bobDevice3);
-		recipients->emplace_back(*bobDevice1);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[3].begin(), lime_tester::messages_pattern[3].end());
+		// bob devices decrypt
+		for (const auto &recipient : *recipients) {
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+		}
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		// reload alice, prefetch the existing sessions only: no X3DH server request, callback is called synchronously
+		aliceManager = nullptr;
+		aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		aliceManager->prefetch_sessions(*aliceDevice1, bobDevices, callback);
+		expected_success++;
+		BC_ASSERT_EQUAL(counters.operation_success, expected_success, int, "%d");
+		aliceManager->get_DRSessionsCacheUsage(*aliceDevice1, sessionsCount, memorySize);
+		BC_ASSERT_EQUAL((int)sessionsCount, (int)bobDevicesCount, int, "%d");
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			if (recipient.deviceId == *bobDevice3) {
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
-			} else {
-				std::vector<uint8_t> receivedMessage{};
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::untrusted);
-				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
-				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[3]);
+		// delete the users and db
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			for (const auto &bobDevice : bobDevices) {
+				bobManager->delete_user(bobDevice, callback);
 			}
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1+bobDevicesCount,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
 		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+static void lime_sessionsPrefetch(void) {
+#ifdef EC25519_ENABLED
+	lime_sessionsPrefetch_test(lime::CurveId::c25519, "lime_sessionsPrefetch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_sessionsPrefetch_test(lime::CurveId::c448, "lime_sessionsPrefetch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
 
-		// Repeat the 3 previous encrypt/decrypt but each time delete bob's devices from alice's cache so it will force
-		// request to the X3DH server to ask for the 3 devices
-		aliceManager->delete_peerDevice(*bobDevice1);
-		aliceManager->delete_peerDevice(*bobDevice2);
-		aliceManager->delete_peerDevice(*bobDevice3);
+/* test scenario:
+ * - create alice.d1, bob.d1 and carol.d1
+ * - alice encrypts to bob.d1: the key bundle request to the X3DH server is held
+ * - alice encrypts to carol.d1: the key bundle is fetched and the encryption completes while bob's key bundle is still pending
+ * - alice encrypts again to bob.d1: it is queued behind the pending key bundle fetch, no request is sent to the X3DH server
+ * - release the held request: both encryptions to bob.d1 complete
+ * - bob and carol decrypt
+ * - Delete Alice, Bob and Carol devices to leave distant server base clean
+ */
+static void lime_concurrentBundleFetch_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameCarol{dbBaseFilename};
+	dbFilenameCarol.append(".carol.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
-		// encrypt another one, for d1, d2 and d3. The first two shall be ok and d3 shall have a failed status
-		recipients->emplace_back(*bobDevice1);
-		recipients->emplace_back(*bobDevice2);
-		recipients->emplace_back(*bobDevice3);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+	remove(dbFilenameCarol.data()); // delete the database file if already exists
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			if (recipient.deviceId == *bobDevice3) {
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
-			} else {
-				std::vector<uint8_t> receivedMessage{};
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::unknown); // it is the first time alice has contact with bob's d1 and d2 devices
-				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
-				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[1]);
-			}
-		}
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		aliceManager->delete_peerDevice(*bobDevice1);
-		aliceManager->delete_peerDevice(*bobDevice2);
-		aliceManager->delete_peerDevice(*bobDevice3);
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+	// alice posts to the X3DH server can be held and released later
+	bool holdPost = false;
+	int postCount = 0;
+	std::function<void()> releasePost{nullptr};
+	limeX3DHServerPostData X3DHServerPost_Holding([&holdPost, &postCount, &releasePost](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+		postCount++;
+		if (holdPost) {
+			releasePost = [url, from, message, responseProcess]() {
+				X3DHServerPost(url, from, message, responseProcess);
+			};
+		} else {
+			X3DHServerPost(url, from, message, responseProcess);
+		}
+	});
 
-		// encrypt another one, for d3, d2 and d1.
-		recipients->emplace_back(*bobDevice3);
-		recipients->emplace_back(*bobDevice2);
-		recipients->emplace_back(*bobDevice1);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[2].begin(), lime_tester::messages_pattern[2].end());
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Holding));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto carolManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameCarol, X3DHServerPost));
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		auto carolDevice1 = lime_tester::makeRandomDeviceName("carol.d1.");
+		carolManager->create_user(*carolDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			if (recipient.deviceId == *bobDevice3) {
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
-			} else {
-				std::vector<uint8_t> receivedMessage{};
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::unknown);
-				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
-				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[2]);
-			}
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		std::array<std::shared_ptr<std::vector<RecipientData>>, 2> bobRecipients;
+		std::array<std::shared_ptr<std::vector<uint8_t>>, 2> bobCipherMessage;
+		for (size_t i=0; i<2; i++) {
+			bobRecipients[i] = make_shared<std::vector<RecipientData>>();
+			bobRecipients[i]->emplace_back(*bobDevice1);
+			bobCipherMessage[i] = make_shared<std::vector<uint8_t>>();
 		}
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		aliceManager->delete_peerDevice(*bobDevice1);
-		aliceManager->delete_peerDevice(*bobDevice2);
-		aliceManager->delete_peerDevice(*bobDevice3);
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+		// alice encrypts to bob, hold the key bundle request
+		holdPost = true;
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), bobRecipients[0], message, bobCipherMessage[0], callback);
+		holdPost = false;
+		BC_ASSERT_TRUE(releasePost != nullptr);
+		if (releasePost == nullptr) return;
+
+		// encryption to carol does not wait for bob's key bundle
+		auto carolRecipients = make_shared<std::vector<RecipientData>>();
+		carolRecipients->emplace_back(*carolDevice1);
+		auto carolCipherMessage = make_shared<std::vector<uint8_t>>();
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("carol"), carolRecipients, message, carolCipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
 
-		// encrypt another one, for d2, d3 and d1.
-		recipients->emplace_back(*bobDevice2);
-		recipients->emplace_back(*bobDevice3);
-		recipients->emplace_back(*bobDevice1);
-		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[3].begin(), lime_tester::messages_pattern[3].end());
+		// a second encryption to bob waits for the pending key bundle
+		auto postCountBefore = postCount;
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), bobRecipients[1], message, bobCipherMessage[1], callback);
+		BC_ASSERT_EQUAL(postCount, postCountBefore, int, "%d");
+		BC_ASSERT_EQUAL(counters.operation_success, expected_success, int, "%d");
 
-		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		// release bob's key bundle request, both encryptions complete
+		releasePost();
+		releasePost = nullptr;
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 
-		// loop on cipher message and decrypt with bob Manager
-		for (auto &recipient : *recipients) {
-			if (recipient.deviceId == *bobDevice3) {
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
-			} else {
+		// decrypt
+		for (size_t i=0; i<2; i++) {
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "bob", *aliceDevice1, (*bobRecipients[i])[0].DRmessage, *bobCipherMessage[i], receivedMessage) != lime::PeerDeviceStatus::fail);
+			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+		}
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(carolManager->decrypt(*carolDevice1, "carol", *aliceDevice1, (*carolRecipients)[0].DRmessage, *carolCipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+
+		// delete the users and db
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			bobManager->delete_user(*bobDevice1, callback);
+			carolManager->delete_user(*carolDevice1, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+3,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+			remove(dbFilenameCarol.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void lime_concurrentBundleFetch(void) {
+#ifdef EC25519_ENABLED
+	lime_concurrentBundleFetch_test(lime::CurveId::c25519, "lime_concurrentBundleFetch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_concurrentBundleFetch_test(lime::CurveId::c448, "lime_concurrentBundleFetch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+
+/* test scenario:
+ * - create alice.d1, bob.d1, carol.d1 and dave.d1
+ * - alice encrypts to bob.d1: the key bundle request to the X3DH server is held
+ * - alice encrypts to bob.d1 and carol.d1, then to bob.d1 and dave.d1: they are both queued behind bob.d1 key bundle fetch
+ * - release the held request: carol.d1 and dave.d1 key bundles are fetched in one request to the X3DH server
+ * - all encryptions complete, bob, carol and dave decrypt
+ * - Delete all devices to leave distant server base clean
+ */
+static void lime_coalescedBundleFetch_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenamePeers{dbBaseFilename};
+	dbFilenamePeers.append(".peers.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenamePeers.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	// alice posts to the X3DH server can be held and released later
+	bool holdPost = false;
+	int postCount = 0;
+	std::function<void()> releasePost{nullptr};
+	limeX3DHServerPostData X3DHServerPost_Holding([&holdPost, &postCount, &releasePost](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+		postCount++;
+		if (holdPost) {
+			releasePost = [url, from, message, responseProcess]() {
+				X3DHServerPost(url, from, message, responseProcess);
+			};
+		} else {
+			X3DHServerPost(url, from, message, responseProcess);
+		}
+	});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Holding));
+		auto peersManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenamePeers, X3DHServerPost));
+
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		std::vector<std::string> peerDevices{};
+		for (const auto &peerName : {"bob.d1.", "carol.d1.", "dave.d1."}) {
+			peerDevices.push_back(*lime_tester::makeRandomDeviceName(peerName));
+			peersManager->create_user(peerDevices.back(), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += 4;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		// first message to bob only, then to bob and carol, then to bob and dave
+		std::array<std::shared_ptr<std::vector<RecipientData>>, 3> recipients;
+		std::array<std::shared_ptr<std::vector<uint8_t>>, 3> cipherMessage;
+		for (size_t i=0; i<3; i++) {
+			recipients[i] = make_shared<std::vector<RecipientData>>();
+			recipients[i]->emplace_back(peerDevices[0]);
+			if (i>0) {
+				recipients[i]->emplace_back(peerDevices[i]);
+			}
+			cipherMessage[i] = make_shared<std::vector<uint8_t>>();
+		}
+
+		// hold the key bundle request for bob
+		holdPost = true;
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("group"), recipients[0], message, cipherMessage[0], callback);
+		holdPost = false;
+		BC_ASSERT_TRUE(releasePost != nullptr);
+		if (releasePost == nullptr) return;
+
+		// these ones wait for bob's key bundle
+		auto postCountBefore = postCount;
+		for (size_t i=1; i<3; i++) {
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("group"), recipients[i], message, cipherMessage[i], callback);
+		}
+		BC_ASSERT_EQUAL(postCount, postCountBefore, int, "%d");
+
+		// release bob's key bundle request: the first encryption completes, carol and dave key bundles are fetched at once
+		releasePost();
+		releasePost = nullptr;
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL(postCount, postCountBefore+1, int, "%d");
+
+		// decrypt
+		for (size_t i=0; i<3; i++) {
+			for (const auto &recipient : *(recipients[i])) {
 				std::vector<uint8_t> receivedMessage{};
-				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::unknown);
-				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
-				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				BC_ASSERT_TRUE(peersManager->decrypt(recipient.deviceId, "group", *aliceDevice1, recipient.DRmessage, *(cipherMessage[i]), receivedMessage) != lime::PeerDeviceStatus::fail);
 				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[3]);
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+			}
+		}
+
+		// delete the users and db
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			for (const auto &peerDevice : peerDevices) {
+				peersManager->delete_user(peerDevice, callback);
+			}
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+4,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenamePeers.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void lime_coalescedBundleFetch(void) {
+#ifdef EC25519_ENABLED
+	lime_coalescedBundleFetch_test(lime::CurveId::c25519, "lime_coalescedBundleFetch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_coalescedBundleFetch_test(lime::CurveId::c448, "lime_coalescedBundleFetch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+
+/* test scenario:
+ * - create alice.d1 and bob.d1 to bob.d3
+ * - alice prefetches the key bundles of all bob devices
+ * - alice encrypts to all bob devices: sessions are created from the prefetched bundles so the callback is called before encrypt returns
+ * - prefetching again the key bundles does not contact the X3DH server as sessions exist
+ * - bob devices decrypt the message
+ * - Delete Alice and Bob devices to leave distant server base clean
+ */
+static void lime_peerBundlesPrefetch_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		constexpr size_t bobDevicesCount = 3;
+		std::vector<std::string> bobDevices{};
+		for (size_t i=0; i<bobDevicesCount; i++) {
+			bobDevices.push_back(*lime_tester::makeRandomDeviceName(std::string("bob.d").append(std::to_string(i+1)).append(".").data()));
+			bobManager->create_user(bobDevices.back(), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += 1+bobDevicesCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		// prefetch the key bundles
+		aliceManager->prefetch_peerBundles(*aliceDevice1, bobDevices, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// encrypt: sessions are created locally, the callback is called synchronously
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		for (const auto &bobDevice : bobDevices) {
+			recipients->emplace_back(bobDevice);
+		}
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		expected_success++;
+		BC_ASSERT_EQUAL(counters.operation_success, expected_success, int, "%d");
+
+		// sessions exist: nothing to fetch
+		aliceManager->prefetch_peerBundles(*aliceDevice1, bobDevices, callback);
+		expected_success++;
+		BC_ASSERT_EQUAL(counters.operation_success, expected_success, int, "%d");
+
+		// bob devices decrypt
+		for (const auto &recipient : *recipients) {
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+		}
+
+		// delete the users and db
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			for (const auto &bobDevice : bobDevices) {
+				bobManager->delete_user(bobDevice, callback);
+			}
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1+bobDevicesCount,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void lime_peerBundlesPrefetch(void) {
+#ifdef EC25519_ENABLED
+	lime_peerBundlesPrefetch_test(lime::CurveId::c25519, "lime_peerBundlesPrefetch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_peerBundlesPrefetch_test(lime::CurveId::c448, "lime_peerBundlesPrefetch", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+
+/* test scenario:
+ * - create alice.d1 and bob.d1 in the same manager, using one connection per user
+ * - alice encrypts some messages to bob and bob some to alice
+ * - alice and bob decrypt them in parallel, on two threads
+ * - the manager is reloaded on the now existing database, alice and bob exchange messages again
+ * - Delete Alice and Bob devices to leave distant server base clean
+ */
+static void lime_connectionPerUser_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilename{dbBaseFilename};
+	dbFilename.append(".").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilename.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost, lime::StorageOptions::serverThroughput()));
+
+		std::array<std::shared_ptr<std::string>, 2> devices{{lime_tester::makeRandomDeviceName("alice.d1."), lime_tester::makeRandomDeviceName("bob.d1.")}};
+		for (const auto &device : devices) {
+			manager->create_user(*device, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		// each device encrypts some messages to the other one
+		constexpr size_t messagesCount = 10;
+		std::array<std::vector<std::shared_ptr<std::vector<RecipientData>>>, 2> recipients;
+		std::array<std::vector<std::shared_ptr<std::vector<uint8_t>>>, 2> cipherMessages;
+		for (size_t sender=0; sender<2; sender++) {
+			for (size_t i=0; i<messagesCount; i++) {
+				recipients[sender].push_back(make_shared<std::vector<RecipientData>>());
+				recipients[sender].back()->emplace_back(*devices[1-sender]);
+				cipherMessages[sender].push_back(make_shared<std::vector<uint8_t>>());
+				auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+				manager->encrypt(*devices[sender], make_shared<const std::string>("group"), recipients[sender].back(), message, cipherMessages[sender].back(), callback);
+				BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			}
+		}
+
+		// decrypt in parallel: each thread decrypts for one local user
+		std::array<int, 2> decrypted{{0, 0}};
+		auto decryptAll = [&](size_t recipient) {
+			size_t sender = 1-recipient;
+			for (size_t i=0; i<messagesCount; i++) {
+				std::vector<uint8_t> receivedMessage{};
+				if (manager->decrypt(*devices[recipient], "group", *devices[sender], (*recipients[sender][i])[0].DRmessage, *cipherMessages[sender][i], receivedMessage) != lime::PeerDeviceStatus::fail
+					&& std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[i]) {
+					decrypted[recipient]++;
+				}
+			}
+		};
+		std::thread aliceThread(decryptAll, 0);
+		std::thread bobThread(decryptAll, 1);
+		aliceThread.join();
+		bobThread.join();
+		BC_ASSERT_EQUAL(decrypted[0], (int)messagesCount, int, "%d");
+		BC_ASSERT_EQUAL(decrypted[1], (int)messagesCount, int, "%d");
+
+		// the new database is in incremental compaction mode: the users connections opened after its creation took the fast path
+		lime::StorageUsage usage{};
+		manager->get_storageUsage(usage);
+		BC_ASSERT_TRUE(usage.incrementalCompaction);
+
+		// open the existing up to date database: all the connections take the fast path, the users and their sessions are there
+		manager = nullptr;
+		manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost, lime::StorageOptions::serverThroughput()));
+		for (size_t sender=0; sender<2; sender++) {
+			BC_ASSERT_TRUE(manager->is_user(*devices[sender]));
+			auto recipient = make_shared<std::vector<RecipientData>>();
+			recipient->emplace_back(*devices[1-sender]);
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[messagesCount].begin(), lime_tester::messages_pattern[messagesCount].end());
+			manager->encrypt(*devices[sender], make_shared<const std::string>("group"), recipient, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit((*recipient)[0].DRmessage)); // the session was loaded from local storage
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(manager->decrypt(*devices[1-sender], "group", *devices[sender], (*recipient)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[messagesCount]);
+		}
+		usage = lime::StorageUsage{};
+		manager->get_storageUsage(usage);
+		BC_ASSERT_TRUE(usage.incrementalCompaction);
+
+		// delete the users and db
+		if (cleanDatabase) {
+			for (const auto &device : devices) {
+				manager->delete_user(*device, callback);
 			}
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+2,lime_tester::wait_for_timeout));
+			manager = nullptr;
+			remove(dbFilename.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void lime_connectionPerUser(void) {
+#ifdef EC25519_ENABLED
+	lime_connectionPerUser_test(lime::CurveId::c25519, "lime_connectionPerUser", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_connectionPerUser_test(lime::CurveId::c448, "lime_connectionPerUser", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+
+/* test scenario:
+ * - create alice.d1 and bob.d1
+ * - alice encrypts some messages to bob
+ * - bob decrypts them asynchronously using an executor holding the jobs: only one job is given to the executor for the messages of one sender,
+ *   run it and check the messages are decrypted in order
+ * - alice encrypts some more messages, bob decrypts them asynchronously using the built-in executor
+ * - Delete Alice and Bob devices to leave distant server base clean
+ */
+static void lime_asyncDecryption_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		constexpr size_t messagesCount = 10;
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> recipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> cipherMessages{};
+		for (size_t i=0; i<2*messagesCount; i++) {
+			recipients.push_back(make_shared<std::vector<RecipientData>>());
+			recipients.back()->emplace_back(*bobDevice1);
+			cipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients.back(), message, cipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		}
+
+		// an executor holding the jobs until we run them
+		std::vector<std::function<void()>> jobs{};
+		bobManager->set_decryptionExecutor([&jobs](const std::function<void()> &job) {
+			jobs.push_back(job);
+		});
+
+		std::mutex decryptedMutex;
+		std::vector<size_t> decryptedOrder{};
+		std::atomic<int> decryptedCount{0};
+		auto senderDeviceId = make_shared<const std::string>(*aliceDevice1);
+		auto recipientUserId = make_shared<const std::string>("bob");
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> plainMessages{};
+		auto decryptAsync = [&](size_t i) {
+			plainMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto plainMessage = plainMessages.back();
+			bobManager->decrypt_async(*bobDevice1, recipientUserId, senderDeviceId, make_shared<const std::vector<uint8_t>>((*recipients[i])[0].DRmessage), cipherMessages[i], plainMessage,
+				[i, plainMessage, &decryptedMutex, &decryptedOrder, &decryptedCount](const lime::PeerDeviceStatus peerStatus, const std::string message) {
+					if (peerStatus != lime::PeerDeviceStatus::fail && std::string{plainMessage->begin(), plainMessage->end()} == lime_tester::messages_pattern[i]) {
+						std::lock_guard<std::mutex> lock(decryptedMutex);
+						decryptedOrder.push_back(i);
+						decryptedCount++;
+					} else {
+						LIME_LOGE<<"Asynchronous decryption failed : "<<message;
+					}
+				});
+		};
+
+		for (size_t i=0; i<messagesCount; i++) {
+			decryptAsync(i);
+		}
+		// messages from the same sender are chained in one job
+		BC_ASSERT_EQUAL((int)jobs.size(), 1, int, "%d");
+		for (const auto &job : jobs) {
+			job();
+		}
+		jobs.clear();
+		BC_ASSERT_EQUAL(decryptedCount.load(), (int)messagesCount, int, "%d");
+		for (size_t i=0; i<decryptedOrder.size(); i++) {
+			BC_ASSERT_EQUAL((int)decryptedOrder[i], (int)i, int, "%d");
+		}
+
+		// built-in executor
+		bobManager->set_decryptionExecutor(nullptr);
+		for (size_t i=messagesCount; i<2*messagesCount; i++) {
+			decryptAsync(i);
+		}
+		for (int waited=0; decryptedCount.load() < (int)(2*messagesCount) && waited < lime_tester::wait_for_timeout; waited += 10) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		BC_ASSERT_EQUAL(decryptedCount.load(), (int)(2*messagesCount), int, "%d");
+		{
+			std::lock_guard<std::mutex> lock(decryptedMutex);
+			for (size_t i=0; i<decryptedOrder.size(); i++) {
+				BC_ASSERT_EQUAL((int)decryptedOrder[i], (int)i, int, "%d");
+			}
+		}
+
+		// delete the users and db
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			bobManager->delete_user(*bobDevice1, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+2,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void lime_asyncDecryption(void) {
+#ifdef EC25519_ENABLED
+	lime_asyncDecryption_test(lime::CurveId::c25519, "lime_asyncDecryption", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_asyncDecryption_test(lime::CurveId::c448, "lime_asyncDecryption", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+
+/* test scenario:
+ * - create alice.d1 and bob.d1
+ * - alice ask for a burst encryption of several message to bob.d1, first one shall trigger a X3DH init, the other ones shall be queued, if not we will initiate several X3DH init
+ * - bob.d1 decrypt messages, check decryption is Ok and that they encapsulate the same X3DH init message
+ * - Delete Alice and Bob devices to leave distant server base clean
+ *
+ * if continuousSession is set to false, delete and recreate LimeManager before each new operation to force relying on local Storage
+ */
+static void x3dh_operation_queue_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url, bool continuousSession=true) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		// create Manager
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+
+		// create Random devices names
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+
+		// create users alice.d1 and bob.d1
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success +=2; // we have two asynchronous operation on going
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout)); // we must get callback saying all went well
+		if (counters.operation_failed == 1) return; // skip the end of the test if we can't do this
+
+		/* destroy and reload the Managers(tests everything is correctly saved/load from local Storage) */
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// alice send a burst of messages to bob without waiting for callback before asking encryption of a new one
+		constexpr size_t messageBurstSize = 8;
+		std::array<std::shared_ptr<const std::vector<uint8_t>>, messageBurstSize> messages;
+		std::array<std::shared_ptr<std::vector<RecipientData>>, messageBurstSize> recipients;
+		std::array<std::shared_ptr<std::vector<uint8_t>>, messageBurstSize> cipherMessage;
+
+		for (size_t i=0; i<messages.size(); i++) {
+			cipherMessage[i] = make_shared<std::vector<uint8_t>>();
+			recipients[i] = make_shared<std::vector<RecipientData>>();
+			recipients[i]->emplace_back(*bobDevice1);
+			messages[i] = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+		}
+
+		for (size_t i=0; i<messages.size(); i++) {
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients[i], messages[i], cipherMessage[i], callback);
+			expected_success++;
+		}
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+
+		/* destroy and reload the Managers(tests everything is correctly saved/load from local Storage) */
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// bob.d1 decrypt the messages
+		std::vector<uint8_t> X3DH_initMessageBuffer{}; // store the X3DH init message extracted from first message of the burst to be able to compare it to the following one, they must be the same.
+		// loop on cipher message and decrypt them bob Manager
+		for (size_t i=0; i<messages.size(); i++) {
+			for (auto &recipient : *(recipients[i])) {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // new sessions created, they must convey X3DH init message
+				if (i==0) { // first message of the burst, extract and store the X3DH init message
+					lime_tester::DR_message_extractX3DHInit(recipient.DRmessage, X3DH_initMessageBuffer);
+				} else { // following message of the burst, extract X3DH init message and compare it to the first one, they must be the same, we shall not create new sessions
+					std::vector<uint8_t> X3DH_initMessageBuffer_next{};
+					lime_tester::DR_message_extractX3DHInit(recipient.DRmessage, X3DH_initMessageBuffer_next);
+					BC_ASSERT_TRUE(X3DH_initMessageBuffer == X3DH_initMessageBuffer_next);
+				}
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *(cipherMessage[i]), receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[i]);
+			}
+		}
+
+		if (cleanDatabase) {
+
+			// delete the users
+			aliceManager->delete_user(*aliceDevice1, callback);
+			bobManager->delete_user(*bobDevice1, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+2,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data()); // delete the database file if already exists
+			remove(dbFilenameBob.data()); // delete the database file if already exists
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void x3dh_operation_queue(void) {
+#ifdef EC25519_ENABLED
+	x3dh_operation_queue_test(lime::CurveId::c25519, "lime_x3dh_operation_queue", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+	x3dh_operation_queue_test(lime::CurveId::c25519, "lime_x3dh_operation_queue", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data(), false);
+#endif
+#ifdef EC448_ENABLED
+	x3dh_operation_queue_test(lime::CurveId::c448, "lime_x3dh_operation_queue", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+	x3dh_operation_queue_test(lime::CurveId::c448, "lime_x3dh_operation_queue", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data(), false);
+#endif
+}
+ /* Test Scenario
+ * - Alice and Bob register themselves on X3DH server
+ * - Alice send message to Bob
+ * - Bob deletes himself and create a user with the same DeviceId (but different Ik)
+ * - Bob encrypts a message to Alice
+ * - Alice tries to decrypt it, it shall fail
+ */
+static void lime_identity_theft_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+
+		// create Manager
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+
+		// create Random devices names
+		auto aliceDevice = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDevice = lime_tester::makeRandomDeviceName("bob.");
+
+		// create users
+		aliceManager->create_user(*aliceDevice, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobManager->create_user(*bobDevice, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed > 0) return; // skip the end of the test if we can't do this
+
+		// alice encrypts a message to bob
+		recipients->emplace_back(*bobDevice);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+
+		aliceManager->encrypt(*aliceDevice, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// we don't need to decrypt, it only matters that Alice registered Bob's device Ik
+		// Bob deletes its user and create it again (with the same deviceId)
+		bobManager->delete_user(*bobDevice, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobManager->create_user(*bobDevice, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+
+		// Bob encrypts a message to Alice
+		recipients->emplace_back(*aliceDevice);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+
+		bobManager->encrypt(*bobDevice, make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// alice tries decrypt it, it shall fail as Bob changed Ik!
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT(aliceManager->decrypt(*aliceDevice, "alice", *bobDevice, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::fail);
+
+		// cleaning
+		recipients->clear();
+		cipherMessage->clear();
+
+		// Alice encrypts maxSendingChain messages to bob, she does it with its old Ik
+		for (auto i=0; i<lime::settings::maxSendingChain-1; i++) { // -1 as we already encrypted one message to bob
+			// alice encrypt
+			cipherMessage->clear();
+			recipients->clear();
+			recipients->emplace_back(*bobDevice);
+			aliceManager->encrypt(*aliceDevice, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			BC_ASSERT_TRUE((*recipients)[0].peerStatus == lime::PeerDeviceStatus::untrusted);
+		}
+
+		// update belle-sip stack processing possible incoming messages from server
+		belle_sip_stack_sleep(bc_stack,0);
+
+		// now we've ran the maximum number of messages, Alice shall ask for a new key bundle for bob, but it will fail because it will come with a new Ik
+		recipients->clear();
+		recipients->emplace_back(*bobDevice);
+		aliceManager->encrypt(*aliceDevice, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,1,lime_tester::wait_for_timeout));
+
+		// delete the users
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice, callback);
+			bobManager->delete_user(*bobDevice, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+2,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void lime_identity_theft(void) {
+#ifdef EC25519_ENABLED
+	lime_identity_theft_test(lime::CurveId::c25519, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_identity_theft_test(lime::CurveId::c448, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+ /* A simple test with alice having 1 device and bob 2
+ * - Alice and Bob(d1 and d2) register themselves on X3DH server
+ * - Alice send message to Bob (d1 and d2)
+ * - Alice send another message to Bob (d1 and d2)
+ * - Bob d1 respond to Alice(with bob d2 in copy)
+ * - Bob d2 respond to Alice(with bob d1 in copy)
+ * - Alice send another message to Bob(d1 and d2)
+ * - Delete Alice and Bob devices to leave distant server base clean
+ *
+ * At each message check that the X3DH init is present or not in the DR header
+ * if continuousSession is set to false, delete and recreate LimeManager before each new operation to force relying on local Storage
+ * Note: no asynchronous operation will start before the previous is over(callback returns)
+ */
+static void x3dh_basic_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url, bool continuousSession=true) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		// create Manager
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+
+		// create Random devices names
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		auto bobDevice2 = lime_tester::makeRandomDeviceName("bob.d2.");
+
+		// create users
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobManager->create_user(*bobDevice2, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed == 1) return; // skip the end of the test if we can't do this
+
+		/* destroy and reload the Managers(tests everything is correctly saved/load from local Storage) */
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// alice send a message to bob
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		recipients->emplace_back(*bobDevice1);
+		recipients->emplace_back(*bobDevice2);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // new sessions created, they must convey X3DH init message
+			BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// encrypt another one, same recipients(we shall have no new X3DH session but still the X3DH init message)
+		recipients->emplace_back(*bobDevice1);
+		recipients->emplace_back(*bobDevice2);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // again X3DH message as no one ever responded to alice.d1
+			BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[1]);
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+
+		// bob.d1 reply to alice and copy bob.d2
+		recipients->emplace_back(*aliceDevice1);
+		recipients->emplace_back(*bobDevice2);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[2].begin(), lime_tester::messages_pattern[2].end());
+
+		bobManager->encrypt(*bobDevice1, make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// decrypt it
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit((*recipients)[0].DRmessage)); // alice.d1 to bob.d1 already set up the DR Session, we shall not have any  X3DH message here
+		BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDevice1, "alice", *bobDevice1, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::untrusted);
+		std::string receivedMessageStringAlice{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageStringAlice == lime_tester::messages_pattern[2]);
+
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit((*recipients)[1].DRmessage)); // bob.d1 to bob.d2 is a new session, we must have a X3DH message here
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice2, "alice", *bobDevice1, (*recipients)[1].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		std::string receivedMessageStringBob{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageStringBob == lime_tester::messages_pattern[2]);
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// Now do bob.d2 to alice and bob.d1 every one has an open session towards everyone
+		recipients->emplace_back(*aliceDevice1);
+		recipients->emplace_back(*bobDevice1);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[3].begin(), lime_tester::messages_pattern[3].end());
+
+		bobManager->encrypt(*bobDevice2, make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// decrypt it
+		receivedMessage.clear();
+		BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit((*recipients)[0].DRmessage)); // alice.d1 to bob.d2 already set up the DR Session, we shall not have any  X3DH message here
+		BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDevice1, "alice", *bobDevice2, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::untrusted);
+		receivedMessageStringAlice = std::string{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageStringAlice == lime_tester::messages_pattern[3]);
+		receivedMessage.clear();
+		BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit((*recipients)[1].DRmessage)); // bob.d1 to bob.d2 already set up the DR Session, we shall not have any  X3DH message here
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "alice", *bobDevice2, (*recipients)[1].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::untrusted);
+		receivedMessageStringBob = std::string{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageStringBob == lime_tester::messages_pattern[3]);
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// encrypt another one from alice to bob.d1 and .d2, it must not send X3DH init anymore
+		recipients->emplace_back(*bobDevice1);
+		recipients->emplace_back(*bobDevice2);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[4].begin(), lime_tester::messages_pattern[4].end());
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_FALSE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // bob.d1 and d2 both responded, so no more X3DH message shall be sent
+			BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::untrusted);
+			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[4]);
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// delete the users
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			bobManager->delete_user(*bobDevice1, callback);
+			bobManager->delete_user(*bobDevice2, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+3,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void x3dh_basic(void) {
+#ifdef EC25519_ENABLED
+	x3dh_basic_test(lime::CurveId::c25519, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+	x3dh_basic_test(lime::CurveId::c25519, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data(), false);
+#endif
+#ifdef EC448_ENABLED
+	x3dh_basic_test(lime::CurveId::c448, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+	x3dh_basic_test(lime::CurveId::c448, "lime_x3dh_basic", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data(), false);
+#endif
+}
+
+ /* A simple test with alice having 1 device and bob 2
+ * - Alice and Bob(d1 and d2) register themselves on X3DH server
+ * - Alice send another message to Bob non existing device d3, it shall fail without exception
+ * - Alice send another message to Bob (d1 and d2) and try to send to an non existing device d3, d1 and d2 shall work
+ * - repeat with the unknown device at the begining and in the middle of the recipients list
+ * - Delete Alice and Bob devices to leave distant server base clean
+ *
+ * At each message check that the X3DH init is present or not in the DR header
+ * if continuousSession is set to false, delete and recreate LimeManager before each new operation to force relying on local Storage
+ * Note: no asynchronous operation will start before the previous is over(callback returns)
+ */
+static void x3dh_user_not_found_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url, bool continuousSession=true) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+	int expected_fail=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		// create Manager
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+
+		// create Random devices names
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		auto bobDevice2 = lime_tester::makeRandomDeviceName("bob.d2.");
+		auto bobDevice3 = lime_tester::makeRandomDeviceName("bob.d3."); // for this one we won't create the user nor register it on the X3DH server
+
+		// create users
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobManager->create_user(*bobDevice2, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed == 1) return; // skip the end of the test if we can't do this
+
+		/* destroy and reload the Managers(tests everything is correctly saved/load from local Storage) */
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// alice send a message to bob d3
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		recipients->emplace_back(*bobDevice3);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		// The encryption shall return an error: no recipient device could get a key
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,++expected_fail,lime_tester::wait_for_timeout));
+		// but the status of the recipient disclose the failure on that one
+		BC_ASSERT_TRUE((*recipients)[0].peerStatus == lime::PeerDeviceStatus::fail);
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// encrypt another one, for d1, d2 and d3. The first two shall be ok and d3 shall have a failed status
+		recipients->emplace_back(*bobDevice1);
+		recipients->emplace_back(*bobDevice2);
+		recipients->emplace_back(*bobDevice3);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			if (recipient.deviceId == *bobDevice3) {
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
+			} else {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::unknown); // it is the first time alice has contact with bob's d1 and d2 devices
+				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[1]);
+			}
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// encrypt another one, for d3, d2 and d1.
+		recipients->emplace_back(*bobDevice3);
+		recipients->emplace_back(*bobDevice2);
+		recipients->emplace_back(*bobDevice1);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[2].begin(), lime_tester::messages_pattern[2].end());
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			if (recipient.deviceId == *bobDevice3) {
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
+			} else {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::untrusted);
+				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[2]);
+			}
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// encrypt another one, for d2, d3 and d1.
+		recipients->emplace_back(*bobDevice2);
+		recipients->emplace_back(*bobDevice3);
+		recipients->emplace_back(*bobDevice1);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[3].begin(), lime_tester::messages_pattern[3].end());
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			if (recipient.deviceId == *bobDevice3) {
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
+			} else {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::untrusted);
+				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[3]);
+			}
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// Repeat the 3 previous encrypt/decrypt but each time delete bob's devices from alice's cache so it will force
+		// request to the X3DH server to ask for the 3 devices
+		aliceManager->delete_peerDevice(*bobDevice1);
+		aliceManager->delete_peerDevice(*bobDevice2);
+		aliceManager->delete_peerDevice(*bobDevice3);
+
+		// encrypt another one, for d1, d2 and d3. The first two shall be ok and d3 shall have a failed status
+		recipients->emplace_back(*bobDevice1);
+		recipients->emplace_back(*bobDevice2);
+		recipients->emplace_back(*bobDevice3);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			if (recipient.deviceId == *bobDevice3) {
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
+			} else {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::unknown); // it is the first time alice has contact with bob's d1 and d2 devices
+				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[1]);
+			}
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		aliceManager->delete_peerDevice(*bobDevice1);
+		aliceManager->delete_peerDevice(*bobDevice2);
+		aliceManager->delete_peerDevice(*bobDevice3);
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// encrypt another one, for d3, d2 and d1.
+		recipients->emplace_back(*bobDevice3);
+		recipients->emplace_back(*bobDevice2);
+		recipients->emplace_back(*bobDevice1);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[2].begin(), lime_tester::messages_pattern[2].end());
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			if (recipient.deviceId == *bobDevice3) {
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
+			} else {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::unknown);
+				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[2]);
+			}
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		aliceManager->delete_peerDevice(*bobDevice1);
+		aliceManager->delete_peerDevice(*bobDevice2);
+		aliceManager->delete_peerDevice(*bobDevice3);
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// encrypt another one, for d2, d3 and d1.
+		recipients->emplace_back(*bobDevice2);
+		recipients->emplace_back(*bobDevice3);
+		recipients->emplace_back(*bobDevice1);
+		message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[3].begin(), lime_tester::messages_pattern[3].end());
+
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// loop on cipher message and decrypt with bob Manager
+		for (auto &recipient : *recipients) {
+			if (recipient.deviceId == *bobDevice3) {
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::fail);
+			} else {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(recipient.peerStatus == lime::PeerDeviceStatus::unknown);
+				BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit(recipient.DRmessage)); // first communication holds a X3DH message
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDevice1, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[3]);
+			}
+		}
+
+		// cleaning
+		recipients->clear();
+		message = nullptr;
+		cipherMessage->clear();
+		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+
+		// delete the users
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDevice1, callback);
+			bobManager->delete_user(*bobDevice1, callback);
+			bobManager->delete_user(*bobDevice2, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+3,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+			remove(dbFilenameBob.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void x3dh_user_not_found(void) {
+#ifdef EC25519_ENABLED
+	x3dh_user_not_found_test(lime::CurveId::c25519, "lime_x3dh_user_not_found", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+	x3dh_user_not_found_test(lime::CurveId::c25519, "lime_x3dh_user_not_found", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data(), false);
+#endif
+#ifdef EC448_ENABLED
+	x3dh_user_not_found_test(lime::CurveId::c448, "lime_x3dh_user_not_found", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+	x3dh_user_not_found_test(lime::CurveId::c448, "lime_x3dh_user_not_found", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data(), false);
+#endif
+}
+
+/**
+ * NOTE: this test uses low level user management functions which are not available to lib user which have access to
+ * LimeManager functions only. Do not consider this test code as an example as it is not the way users shall
+ * be managed by library end users.
+ *
+ * - Create alice using LimeManager
+ * - Load alice directly using load_limeUser (it's for test only, this is not really available to lib user)
+ * - Fail at creating alice again in the same DB
+ * - Fail at loading an unknown user
+ * - Delete Alice through LimeManager
+ * - Fail at deleting an unknown user
+ * - Create Alice again
+ * - using an other DB, create alice, success on local Storage but shall get a callback error
+ * - clean DB by deleting alice
+ *
+ */
+static void user_management_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url ) {
+
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGI <<"Insert Lime user failed : "<< anythingToSay.data() ;
+					}
+				});
+	// we need a LimeManager
+	auto Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+	auto aliceDeviceName = lime_tester::makeRandomDeviceName("alice.");
+
+	// a mutex to feed internal functions
+	auto m_mutex = std::make_shared<std::recursive_mutex>();
+
+	try {
+		/*Check if Alice exists in the database */
+		BC_ASSERT_FALSE(Manager->is_user(*aliceDeviceName));
+
+		/* create a user in a fresh database */
+		Manager->create_user(*aliceDeviceName, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed == 1) return; // skip the end of the test if we can't do this
+
+		/*Check if Alice exists in the database */
+		BC_ASSERT_TRUE(Manager->is_user(*aliceDeviceName));
+
+		/* load alice from from DB */
+		auto alice = load_LimeUser(dbFilenameAlice, *aliceDeviceName, X3DHServerPost, m_mutex);
+		/* no need to wait here, it shall load alice immediately */
+
+		// Get alice x3dh server url
+		BC_ASSERT_TRUE(Manager->get_x3dhServerUrl(*aliceDeviceName) == x3dh_server_url);
+
+		// Set the X3DH URL server to something else and check it worked
+		Manager->set_x3dhServerUrl(*aliceDeviceName, "https://testing.testing:12345");
+		BC_ASSERT_TRUE(Manager->get_x3dhServerUrl(*aliceDeviceName) == "https://testing.testing:12345");
+		// Force a reload of data from local storage just to be sure the modification was perform correctly
+		Manager = nullptr;
+		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		BC_ASSERT_TRUE(Manager->is_user(*aliceDeviceName)); // Check again just after LimeManager reload that Alice is in local storage
+		BC_ASSERT_TRUE(Manager->get_x3dhServerUrl(*aliceDeviceName) == "https://testing.testing:12345");
+		// Set it back to the regular one to be able to complete the test
+		Manager->set_x3dhServerUrl(*aliceDeviceName, x3dh_server_url);
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	bool gotExpectedException = false;
+	/* Try to create the same user in the same data base, it must fail with exception raised */
+	try {
+		auto alice = insert_LimeUser(dbFilenameAlice, *aliceDeviceName, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, X3DHServerPost, callback, m_mutex);
+		/* no need to wait here, it must fail immediately */
+	} catch (BctbxException &) {
+		gotExpectedException = true;
+	}
+	if (!gotExpectedException) {
+		// we didn't got any exception on trying to insert alice again in DB
+		BC_FAIL("Insert twice the same userID in a DB without getting any exception");
+		return;
+	}
+
+	/* Try to load a user which is not in DB, it must fail with exception raised */
+	gotExpectedException = false;
+	try {
+		auto alice = load_LimeUser(dbFilenameAlice, "bob", X3DHServerPost, m_mutex);
+		/* no need to wait here, it must fail immediately */
+	} catch (BctbxException &) {
+		gotExpectedException = true;
+	}
+	if (!gotExpectedException) {
+		// we didn't got any exception on trying to load bob from DB
+		BC_FAIL("No exception arised when loading inexistent user from DB");
+		return;
+	}
+
+	/* Delete users from base */
+	try {
+		// delete Alice, wait for callback confirmation from x3dh server
+		Manager->delete_user(*aliceDeviceName, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE <<e;
+		BC_FAIL("Delete Lime user raised exception");
+		return;
+	}
+	gotExpectedException = false;
+	auto savedCounters = counters;
+	try {
+		// delete bob which is not there, it shall raise an exception and never get to the callback
+		Manager->delete_user("bob", callback);
+	} catch (BctbxException &) {
+		gotExpectedException = true;
+	}
+	if (!gotExpectedException) {
+		// we didn't got any exception on trying to delete bob from DB while he isn't theee
+		BC_FAIL("No exception arised when deleting inexistent user from DB");
+		return;
+	}
+	BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_failed,savedCounters.operation_failed+1,lime_tester::wait_for_timeout/2)); // give we few seconds to possible call to the callback(it shall not occurs
+	// check we didn't land into callback as any call to it will modify the counters
+	BC_ASSERT_TRUE(counters == savedCounters);
+
+
+	/* Create Alice again */
+	try {
+		std::shared_ptr<LimeGeneric> alice = insert_LimeUser(dbFilenameAlice, *aliceDeviceName, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, X3DHServerPost, callback, m_mutex);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// create another manager with a fresh DB
+		std::string dbFilenameAliceTmp{dbFilenameAlice};
+		dbFilenameAliceTmp.append(".tmp.sqlite3");
+
+		// create a manager and try to create alice again, it shall pass local creation(db is empty) but server shall reject it
+		auto ManagerTmp = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAliceTmp, X3DHServerPost));
+
+		ManagerTmp->create_user(*aliceDeviceName, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,counters.operation_failed+1,lime_tester::wait_for_timeout)); // wait on this one but we shall get a fail from server
+
+		/* Clean DB */
+		if (cleanDatabase) {
+			// delete Alice, wait for callback confirmation from server
+			Manager->delete_user(*aliceDeviceName, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data()); // delete the database file
+			remove(dbFilenameAliceTmp.data()); // delete the database file
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void user_management(void) {
+#ifdef EC25519_ENABLED
+	user_management_test(lime::CurveId::c25519, "lime_user_management", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	user_management_test(lime::CurveId::c448, "lime_user_management", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+
+/**
+ * Scenario:
+ *  - Create a user in local DB but do not send any message to the X3DH server
+ *  - Check the user is there and inactive then delete it from local only
+ *  - Create the same user with different keys on both local and server to check server didn't get it in the first place
+ *  - Clean DBs (local and remote)
+ *  - Repeat the previous 3 steps but let the message reach the server this time. At the second creation we shall get a fail from server as we are creating again a user but with different keys
+ *  - Clean DBs (local and remote)
+ *  - Create a local user but do not send anything to the server
+ *  - Create it again letting the message go, it shall be a success
+ *  - Clean DBs (local and remote)
+ *  - Create a user but discard the response from server (so it is stored as inactive)
+ *  - Create it again with normal connectivity, server is happy as we get the same Ik and SPk, user is activated on local base
+ */
+static void user_registration_failure_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url ) {
+
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	auto alice_db_mutex = make_shared<std::recursive_mutex>();
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+	int expected_failed=0;
+	// reset the global setting for Http Link
+	httpLink = HttpLinkStatus::ok;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGI <<"Insert Lime user failed : "<< anythingToSay.data() ;
+					}
+				});
+	// we need a LimeManager
+	auto Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation));
+	auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+
+	try {
+		/* create a user in a fresh database but discard the message to server */
+		httpLink = HttpLinkStatus::sending_fail;
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
+		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
+		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	bool gotExpectedException = false;
+	long int Uid=0;
+	try {
+		/* now we have the user in local base but not active and not in remote, lets check that */
+		/* load alice from DB(using insider functions) : user is not active, we shall get an exception */
+		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(dbFilenameAlice, alice_db_mutex));
+		auto curve = CurveId::unset;
+		std::string x3dh_server_url;
+
+		localStorage->load_LimeUser(*aliceDeviceId, Uid, curve, x3dh_server_url); // this one will throw an exception if user is not found, just let it rise
+	} catch (BctbxException &) {
+		gotExpectedException = true;
+	}
+	BC_ASSERT(Uid == -1); // when user is not active, the db::load_LimeUser set the Uid to -1 before generating the exception
+	BC_ASSERT(gotExpectedException == true);
+
+	try {
+		// Delete local user from base and create it letting it flow to the server
+		httpLink = HttpLinkStatus::sending_fail; // make sure our delete never reach the server
+		Manager->delete_user(*aliceDeviceId, callback);
+		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
+		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
+		BC_ASSERT_TRUE(counters.operation_failed == expected_failed);
+		httpLink = HttpLinkStatus::ok; // restore htpp link
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback); // This one has different keys but the same user Id
+		// if this userId was already registered on server(with the old Ik) we would have an error
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		// and delete it again
+		Manager->delete_user(*aliceDeviceId, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+
+		// Start again but this time let the message flow to the server, just block the answer
+		httpLink = HttpLinkStatus::reception_fail;
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
+		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
+		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
+
+		// Now we have the user inactive in local but set on server. Delete the local one
+		httpLink = HttpLinkStatus::sending_fail; // make sure our delete never reach the server
+		Manager->delete_user(*aliceDeviceId, callback);
+		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
+		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
+		httpLink = HttpLinkStatus::ok; // restore htpp link
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback); // This one has different keys but the same user Id
+		// this userId is already registered on server(with the old Ik) we shall have an error -> the error is deleted from local base
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,++expected_failed,lime_tester::wait_for_timeout));
+		// Now the user is on the server but no more in local, to delete it from server, we must create it in local only and then delete
+		httpLink = HttpLinkStatus::sending_fail; // make sure our delete never reach the server
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
+		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
+		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
+		httpLink = HttpLinkStatus::ok; // restore htpp link
+		Manager->delete_user(*aliceDeviceId, callback); // delete from local and remote
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// Create again on local only, and then call the create_user again with the same id, with restored connectivity to get an active user
+		httpLink = HttpLinkStatus::sending_fail; // make sure our delete never reach the server
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
+		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
+		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
+		// create one more time, it shall this time publish on the server without error
+		httpLink = HttpLinkStatus::ok; // restore htpp link
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// Clean
+		Manager->delete_user(*aliceDeviceId, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// Same than previous but this time we block the server answer and then call again create
+		httpLink = HttpLinkStatus::reception_fail; // make sure our delete never reach the server
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
+		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
+		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
+		// create one more time, it shall this time publish on the server without error
+		httpLink = HttpLinkStatus::ok; // restore htpp link
+		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	try {
+		if (cleanDatabase) {
+			// delete Alice, wait for callback confirmation from server
+			httpLink = HttpLinkStatus::ok; // restore http link functionality
+			Manager->delete_user(*aliceDeviceId, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data()); // delete the database file
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void user_registration_failure(void) {
+#ifdef EC25519_ENABLED
+	user_registration_failure_test(lime::CurveId::c25519, "lime_user_management", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	user_registration_failure_test(lime::CurveId::c448, "lime_user_management", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+
+// For multithread test : a mailbox system to post and fetch messages
+struct mth_message {
+	std::vector<uint8_t> DRmessage;
+	std::vector<uint8_t> cipherMessage;
+	std::string plainMessage; // to check after decryption if we're good
+	std::string senderId;
+
+	mth_message() {};
+	mth_message(const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage, const std::string &plainMessage, const std::string senderId) :
+		DRmessage{DRmessage}, cipherMessage{cipherMessage}, plainMessage{plainMessage}, senderId{senderId} {};
+};
+
+struct mth_mailbox {
+	std::mutex b_mutex;
+	std::deque<mth_message> box;
+	std::string owner;
+	const int expectedMessageCount; // set at creation, expected message number to transit
+	int messageCount; // number of message fetched
+
+	bool fetch(mth_message &m) {
+		std::lock_guard<std::mutex> lock(b_mutex);
+		if (box.size()>0) {
+			m = box.back();
+			box.pop_back();
+			messageCount++;
+			return true;
+		}
+		return false;
+	}
+
+	void post(mth_message m) {
+		std::lock_guard<std::mutex> lock(b_mutex);
+		box.push_front(m);
+	}
+
+	bool done() { // return true if we already processed the expected number of messages
+		std::lock_guard<std::mutex> lock(b_mutex);
+		return (messageCount>=expectedMessageCount);
+	}
+
+	mth_mailbox(std::string &owner, int expectedMessageCount) : owner{owner}, expectedMessageCount{expectedMessageCount}, messageCount{0} {}
+};
+
+
+struct manager_thread_arg {
+	std::shared_ptr<LimeManager> manager;
+	size_t userIndex; // index of self user in the user lists
+	std::array<std::string,4> userlist; // list of all users
+	std::string x3dh_server_url;
+	lime::CurveId curve;
+	std::shared_ptr<std::recursive_mutex> belle_sip_mutex; // A mutex to manage belle_sip http stack access
+	std::shared_ptr<std::map<std::string, std::shared_ptr<mth_mailbox>>> mailbox; // mailbox system to post and fetch messages
+
+	manager_thread_arg(std::shared_ptr<LimeManager> manager, const uint8_t userIndex, const std::array<std::string, 4> &userlist, const std::string &x3dh_server_url, const lime::CurveId curve, std::shared_ptr<std::recursive_mutex> belle_sip_mutex, std::shared_ptr<std::map<std::string, std::shared_ptr<mth_mailbox>>> mailbox)
+		: manager{manager}, userIndex{userIndex}, userlist(userlist),
+		x3dh_server_url{x3dh_server_url}, curve{curve}, belle_sip_mutex{belle_sip_mutex},
+		mailbox(mailbox)	{};
+};
+
+static constexpr size_t test_multithread_message_number = 10;
+
+static void lime_multithread_decrypt_thread(manager_thread_arg thread_arg) {
+
+	auto pool = belle_sip_object_pool_push();
+
+	// RNG uniform between 0 and 400 ms
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::uniform_int_distribution<> dis(0, 400);
+
+	try {
+		auto localDeviceId = thread_arg.userlist[thread_arg.userIndex];
+		auto box = thread_arg.mailbox->find(localDeviceId)->second;
+
+		// loop on all patterns available
+		while (box->done() == false) {
+			// wait for a random period betwwen 0 and 400 ms
+			std::this_thread::sleep_for(std::chrono::milliseconds(dis(gen)));
+			// Fetch mailbox
+			mth_message m{};
+			int fetchMax = 1+dis(gen)/200;
+			int fetched=0;
+			while (box->fetch(m) && fetched<fetchMax) {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(thread_arg.manager->decrypt(localDeviceId, "friends", m.senderId, m.DRmessage, m.cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+				BC_ASSERT_TRUE(receivedMessageString == m.plainMessage);
+				fetched++;
+			}
+		}
+
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	belle_sip_object_unref(pool);
+}
+
+static void lime_multithread_encrypt_thread(manager_thread_arg thread_arg) {
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+		if (returnCode == lime::CallbackReturn::success) {
+			counters.operation_success++;
+		} else {
+			counters.operation_failed++;
+			LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+		}
+	});
+
+	auto pool = belle_sip_object_pool_push();
+	// RNG uniform between 1 and 20 ms
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::uniform_int_distribution<> dis(1000, 20000);
+
+	try {
+		// loop on all patterns available
+		for (auto message=lime_tester::messages_pattern.cbegin(); message != lime_tester::messages_pattern.cbegin()+test_multithread_message_number; message++) {
+			// wait for a random period betwwen 1 and 20 ms
+			std::this_thread::sleep_for(std::chrono::microseconds(dis(gen)));
+			// Encrypt to all but me
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			for (size_t i=0; i<thread_arg.userlist.size(); i++) {
+				if (i != thread_arg.userIndex) { // do not encrypt to myself
+					recipients->emplace_back(thread_arg.userlist[i]);
+				}
+			}
+
+			auto messagePtr = make_shared<const std::vector<uint8_t>>(message->begin(), message->end());
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			auto localDeviceId = thread_arg.userlist[thread_arg.userIndex];
+			auto mailbox = thread_arg.mailbox;
+			// encrypt to all, use a generic "friends" id as recipient user id
+			thread_arg.manager->encrypt(localDeviceId, make_shared<const std::string>("friends"), recipients, messagePtr, cipherMessage,
+					([&counters, message, localDeviceId, mailbox, recipients, cipherMessage](lime::CallbackReturn returnCode, std::string anythingToSay) {
+						if (returnCode == lime::CallbackReturn::success) {
+							// Post the messages
+							for (auto &recipient : *recipients) {
+								mth_message m(recipient.DRmessage, *cipherMessage, *message, localDeviceId);
+								auto search = mailbox->find(recipient.deviceId);
+								if (search != mailbox->end()) {
+									auto box = search->second;
+									box->post(m);
+								}
+							}
+							counters.operation_success++;
+						} else {
+							counters.operation_failed++;
+							LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+						}
+					}));
+			expected_success++;
+			// make sure we process possible message incoming from X3DH server
+			std::unique_lock<std::recursive_mutex> lock(*(thread_arg.belle_sip_mutex));
+			belle_sip_stack_sleep(bc_stack,0);
+			lock.unlock();
+		}
+		BC_ASSERT_TRUE(lime_tester::wait_for_mutex(bc_stack,&counters.operation_success, expected_success, lime_tester::wait_for_timeout, thread_arg.belle_sip_mutex));
+
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	belle_sip_object_unref(pool);	
+}
+
+static void lime_multithread_create_thread(manager_thread_arg thread_arg) {
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+		if (returnCode == lime::CallbackReturn::success) {
+			counters.operation_success++;
+		} else {
+			counters.operation_failed++;
+			LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+		}
+	});
+
+	auto pool = belle_sip_object_pool_push();
+
+	try {
+		// Create the device
+		auto deviceId = thread_arg.userlist[thread_arg.userIndex];
+		thread_arg.manager->create_user(deviceId, thread_arg.x3dh_server_url, thread_arg.curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for_mutex(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout, thread_arg.belle_sip_mutex));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	belle_sip_object_unref(pool);	
+}
+
+static void lime_multithread_delete_thread(manager_thread_arg thread_arg) {
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+		if (returnCode == lime::CallbackReturn::success) {
+			counters.operation_success++;
+		} else {
+			counters.operation_failed++;
+			LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+		}
+	});
+
+	auto pool = belle_sip_object_pool_push();
+
+	try {
+		// Delete the device
+		thread_arg.manager->delete_user(thread_arg.userlist[thread_arg.userIndex], callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for_mutex(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout, thread_arg.belle_sip_mutex));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	belle_sip_object_unref(pool);	
+}
+
+static void lime_multithread_update_thread(manager_thread_arg thread_arg) {
+	auto pool = belle_sip_object_pool_push();
+
+	// RNG uniform between 25 and 100 ms
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::uniform_int_distribution<> dis(25, 100);
+	std::uniform_int_distribution<> rnd_serverLimit(0, 4);
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+		if (returnCode == lime::CallbackReturn::success) {
+			counters.operation_success++;
+		} else {
+			counters.operation_failed++;
+			LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+		}
+	});
+
+	try {
+		auto localDeviceId = thread_arg.userlist[thread_arg.userIndex];
+		auto box = thread_arg.mailbox->find(localDeviceId)->second;
+
+		uint16_t serverLimit = 2;
+		uint16_t batchSize = 2;
+
+		while (box->done() == false) { // use the mailbox to synchronise to the end of the decryption threads
+			// wait for a random period betwwen 25 and 100 ms
+			std::this_thread::sleep_for(std::chrono::milliseconds(dis(gen)));
+			// Update
+			thread_arg.manager->update(callback, serverLimit, batchSize);
+			expected_success++;
+			serverLimit+=rnd_serverLimit(gen); // improver server limit by a random 0 to 4
+			// make sure we process possible message incoming from X3DH server
+			std::unique_lock<std::recursive_mutex> lock(*(thread_arg.belle_sip_mutex));
+			belle_sip_stack_sleep(bc_stack,0);
+			lock.unlock();
+		}
+		BC_ASSERT_TRUE(lime_tester::wait_for_mutex(bc_stack,&counters.operation_success, expected_success, lime_tester::wait_for_timeout, thread_arg.belle_sip_mutex));
+
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	belle_sip_object_unref(pool);
+}
+
+
+
+/*
+ * Scenario:
+ * - Create 2 managers
+ * - In separated threads, each manager create 2 devices
+ * - each device gets several threads to encrypt/decrypt/update
+ */
+static void lime_multithread_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url ) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto belle_sip_mutex = make_shared<std::recursive_mutex>(); // a mutex for belle-sip operations, must be recursive a stack processing may trigger response reception wich may trigger message sending
+
+	limeX3DHServerPostData X3DHServerPost_mutex([belle_sip_mutex](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+			std::lock_guard<std::recursive_mutex> lock(*belle_sip_mutex); // belle_sip_mutex is recursive so a thread can acquire the lock there even if it already got it from a stack processing
+			X3DHServerPost(url, from, message, responseProcess);
+			});
+
+
+	try {
+		// Generate the 4 devices Id we will use
+		std::array<std::string,4> deviceList;
+		deviceList[0] = *lime_tester::makeRandomDeviceName("alice.d1.");
+		deviceList[1] = *lime_tester::makeRandomDeviceName("alice.d2.");
+		deviceList[2] = *lime_tester::makeRandomDeviceName("bob.d1.");
+		deviceList[3] = *lime_tester::makeRandomDeviceName("bob.d2.");
+		std::deque<std::thread> activeThreads{};
+
+		// get a mailbox for each of them, same index
+		auto mailbox = make_shared<std::map<std::string, std::shared_ptr<mth_mailbox>>>();
+		auto expectedMessageCount = 9*test_multithread_message_number; // each recipient shall get 9 times the number of expedited messages by each encryption thread
+		mailbox->emplace(std::make_pair(deviceList[0], make_shared<mth_mailbox>(deviceList[0], expectedMessageCount)));
+		mailbox->emplace(std::make_pair(deviceList[1], make_shared<mth_mailbox>(deviceList[1], expectedMessageCount)));
+		mailbox->emplace(std::make_pair(deviceList[2], make_shared<mth_mailbox>(deviceList[2], expectedMessageCount)));
+		mailbox->emplace(std::make_pair(deviceList[3], make_shared<mth_mailbox>(deviceList[3], expectedMessageCount)));
+
+		// create Manager
+		auto aliceManager = std::make_shared<LimeManager>(dbFilenameAlice, X3DHServerPost_mutex);
+		auto bobManager = std::make_shared<LimeManager>(dbFilenameBob, X3DHServerPost_mutex);
+
+		// Create arguments to thread, as local variable, they are copy passed to threads
+		std::list<manager_thread_arg> devArg;
+		devArg.emplace_back(aliceManager, 0, deviceList, x3dh_server_url, curve, belle_sip_mutex, mailbox);
+		devArg.emplace_back(aliceManager, 1, deviceList, x3dh_server_url, curve, belle_sip_mutex, mailbox);
+		devArg.emplace_back(bobManager, 2, deviceList, x3dh_server_url, curve, belle_sip_mutex, mailbox);
+		devArg.emplace_back(bobManager, 3, deviceList, x3dh_server_url, curve, belle_sip_mutex, mailbox);
+		
+		// create device
+		for (const auto &arg : devArg) {
+			activeThreads.emplace_back(lime_multithread_create_thread, arg);
+		}
+
+		// wait for the threads to complete
+		for (auto &t : activeThreads) {
+			t.join();
+		}
+		activeThreads.clear();
+
+		// encrypt, three encryotion threads per user
+		for (auto i=0; i<3; i++) {
+			for (const auto &arg : devArg) {
+				activeThreads.emplace_back(lime_multithread_encrypt_thread, arg);
+			}
+		}
+
+		// decrypt, two decryption threads per user
+		for (auto i=0; i<2; i++) {
+			for (const auto &arg : devArg) {
+				activeThreads.emplace_back(lime_multithread_decrypt_thread, arg);
+			}
+		}
+
+		//update, two threads per user
+		for (auto i=0; i<2; i++) {
+			for (const auto &arg : devArg) {
+				activeThreads.emplace_back(lime_multithread_update_thread, arg);
+			}
+		}
+		// wait for the threads to complete
+		for (auto &t : activeThreads) {
+			t.join();
+		}
+		activeThreads.clear();
+
+		// delete devices
+		for (const auto &arg : devArg) {
+			activeThreads.emplace_back(lime_multithread_delete_thread, arg);
+		}
+
+		// wait for the threads to complete
+		for (auto &t : activeThreads) {
+			t.join();
+		}
+		activeThreads.clear();
+
+		if (cleanDatabase) {
+			remove(dbFilenameAlice.data()); // delete the database file if already exists
+			remove(dbFilenameBob.data()); // delete the database file if already exists
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void lime_multithread(void) {
+	for (size_t i=0; i<3; i++) { // loop several times as the first messages sending/receiving are the most susceptible to bump into problems
+#ifdef EC25519_ENABLED
+	lime_multithread_test(lime::CurveId::c25519, "lime_multithread", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_multithread_test(lime::CurveId::c448, "lime_multithread", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+	}
+}
+
+/**
+ * Scenario: Server is set to accept 200 OPks per device
+ * - Create user alice with 500 OPks -> it shall fail
+ * - Create user alice with 100 OPks -> it shall pass
+ * - Add 100 OPks to alice -> it shall pass
+ * - Add 100 OPks to alice -> is shall fail
+ */
+static void lime_server_resource_limit_reached_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+	int expected_failure=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+	try {
+		// create Manager and device for alice
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, 500, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed, ++expected_failure,lime_tester::wait_for_timeout));
+
+		// Try again to create the device, with 100 OPks, it shall pass
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, 100, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
+
+		// call the update, set the serverLimit 200 and upload an other 100
+		aliceManager->update(callback, 200, 100);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDeviceId), 200, int, "%d");
+
+		// call the update, set the serverLimit 300 and upload an other 100 -> it shall fail but we have 300 OPks in DB
+		aliceManager->update(callback, 300, 100);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed, ++expected_failure,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDeviceId), 300, int, "%d");
+
+		// update again, with correct values, server already holds 200 keys, so the only effect would be to set the failed 100 OPks status to dispatched as they are not on server 
+		aliceManager->update(callback, 125, 25);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDeviceId), 300, int, "%d");
+
+		// forward time by OPK_limboTime_days
+		aliceManager=nullptr; // destroy manager before modifying DB
+		lime_tester::forwardTime(dbFilenameAlice, lime::settings::OPk_limboTime_days+1);
+		aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+
+		// update one last time, with correct values, server already holds 200 keys
+		// so the only effect would be to remove the OPk keys status was set to dispatch before we forward the time
+		// We now hold 200 keys
+		aliceManager->update(callback, 125, 25);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDeviceId), 200, int, "%d");
+
+		if (cleanDatabase) {
+			aliceManager->delete_user(*aliceDeviceId, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			remove(dbFilenameAlice.data());
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+}
+
+static void lime_server_resource_limit_reached() {
+#ifdef EC25519_ENABLED
+	lime_server_resource_limit_reached_test(lime::CurveId::c25519, "lime_server_resource_limit_reached", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+#endif
+#ifdef EC448_ENABLED
+	lime_server_resource_limit_reached_test(lime::CurveId::c448, "lime_server_resource_limit_reached", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+#endif
+}
+
+/**
+ * Scenario: run against the in-process X3DH server, with a delay on its responses
+ * - alice and bob register, server holds bob's OPks
+ * - alice encrypts to bob: the server gives out one of bob OPk
+ * - bob decrypts
+ * - bob is deleted: alice cannot get a key bundle for him anymore
+ */
+static void lime_x3dhLoopbackServer_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	// install a server for this test only, wait_for gives it ticks
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	auto server = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{20});
+	lime_tester::x3dhLoopbackServer = server;
+	const std::string x3dh_server_url{"https://loopback.invalid"}; // not used by the loopback server
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+	int expected_failure=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		// the response is delayed: nothing delivered within the post
+		BC_ASSERT_EQUAL(counters.operation_success, 0, int, "%d");
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		bobManager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL((int)server->OPkCount(curve, *bobDeviceId), lime_tester::OPkInitialBatchSize, int, "%d");
+
+		// alice encrypts to bob
+		auto aliceRecipients = make_shared<std::vector<RecipientData>>();
+		aliceRecipients->emplace_back(*bobDeviceId);
+		auto aliceMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto aliceCipherMessage = make_shared<std::vector<uint8_t>>();
+		aliceManager->encrypt(*aliceDeviceId, make_shared<const std::string>("bob"), aliceRecipients, aliceMessage, aliceCipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL((int)server->OPkCount(curve, *bobDeviceId), lime_tester::OPkInitialBatchSize-1, int, "%d");
+
+		// bob decrypts
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, "bob", *aliceDeviceId, (*aliceRecipients)[0].DRmessage, *aliceCipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+
+		// delete bob, alice cannot start a session with a new bob device
+		bobManager->delete_user(*bobDeviceId, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL((int)server->OPkCount(curve, *bobDeviceId), 0, int, "%d");
+		auto unknownDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		aliceRecipients = make_shared<std::vector<RecipientData>>();
+		aliceRecipients->emplace_back(*unknownDeviceId);
+		aliceCipherMessage = make_shared<std::vector<uint8_t>>();
+		aliceManager->encrypt(*aliceDeviceId, make_shared<const std::string>("bob"), aliceRecipients, aliceMessage, aliceCipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,++expected_failure,lime_tester::wait_for_timeout));
+
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
+}
+
+static void lime_x3dhLoopbackServer() {
+#ifdef EC25519_ENABLED
+	lime_x3dhLoopbackServer_test(lime::CurveId::c25519, "lime_x3dhLoopbackServer");
+#endif
+#ifdef EC448_ENABLED
+	lime_x3dhLoopbackServer_test(lime::CurveId::c448, "lime_x3dhLoopbackServer");
+#endif
+}
+
+static void lime_metrics_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	// use a loopback server so the X3DH round trip is timed in this process
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	auto server = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{5});
+	lime_tester::x3dhLoopbackServer = server;
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+
+		// metrics are disabled by default: nothing collected during alice creation
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		lime::Metrics metrics{};
+		aliceManager->get_metrics(metrics);
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::OPkGeneration).calls, 0, int, "%d");
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::X3DHRoundTrip).calls, 0, int, "%d");
+
+		aliceManager->set_metricsEnabled(true);
+		bobManager->set_metricsEnabled(true);
+		bobManager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobManager->get_metrics(metrics);
+		const auto &OPkGeneration = metrics.operation(lime::MetricsOperation::OPkGeneration);
+		BC_ASSERT_EQUAL((int)OPkGeneration.calls, 1, int, "%d");
+		BC_ASSERT_TRUE(OPkGeneration.DBTime + OPkGeneration.cryptoTime == OPkGeneration.totalTime);
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::X3DHRoundTrip).calls, 1, int, "%d");
+		// the loopback server delays its responses
+		BC_ASSERT_TRUE(metrics.operation(lime::MetricsOperation::X3DHRoundTrip).totalTime >= 5000000);
+
+		// alice encrypts two messages to bob
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> aliceRecipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> aliceCipherMessages{};
+		for (size_t i=0; i<2; i++) {
+			aliceRecipients.push_back(make_shared<std::vector<RecipientData>>());
+			aliceRecipients.back()->emplace_back(*bobDeviceId);
+			aliceCipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto aliceMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			aliceManager->encrypt(*aliceDeviceId, make_shared<const std::string>("bob"), aliceRecipients.back(), aliceMessage, aliceCipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		}
+		aliceManager->get_metrics(metrics);
+		// the first contact encryption runs again once the key bundle is fetched
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::encrypt).calls, 3, int, "%d");
+		BC_ASSERT_TRUE(metrics.operation(lime::MetricsOperation::session_save).calls >= 2);
+		BC_ASSERT_EQUAL((int)metrics.DRSessionsCacheMisses, 1, int, "%d");
+		BC_ASSERT_EQUAL((int)metrics.DRSessionsCacheHits, 2, int, "%d");
+
+		// bob decrypts them out of order
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, "bob", *aliceDeviceId, (*aliceRecipients[1])[0].DRmessage, *aliceCipherMessages[1], receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, "bob", *aliceDeviceId, (*aliceRecipients[0])[0].DRmessage, *aliceCipherMessages[0], receivedMessage) != lime::PeerDeviceStatus::fail);
+		std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
+		bobManager->get_metrics(metrics);
+		const auto &decrypt = metrics.operation(lime::MetricsOperation::decrypt);
+		BC_ASSERT_EQUAL((int)decrypt.calls, 2, int, "%d");
+		uint64_t histogramCount = 0;
+		for (const auto bucket : decrypt.latencyHistogram) histogramCount += bucket;
+		BC_ASSERT_EQUAL((int)histogramCount, 2, int, "%d");
+		BC_ASSERT_EQUAL((int)metrics.skippedKeysDerived, 1, int, "%d");
+		BC_ASSERT_TRUE(metrics.operation(lime::MetricsOperation::trySkippedMessageKeys).calls >= 1);
+
+		// reset and disable
+		bobManager->reset_metrics();
+		bobManager->set_metricsEnabled(false);
+		bobManager->get_metrics(metrics);
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::decrypt).calls, 0, int, "%d");
+		BC_ASSERT_EQUAL((int)metrics.skippedKeysDerived, 0, int, "%d");
+
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobManager->delete_user(*bobDeviceId, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		// bob metrics are disabled
+		bobManager->get_metrics(metrics);
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::X3DHRoundTrip).calls, 0, int, "%d");
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
+}
+
+static void lime_metrics() {
+#ifdef EC25519_ENABLED
+	lime_metrics_test(lime::CurveId::c25519, "lime_metrics");
+#endif
+#ifdef EC448_ENABLED
+	lime_metrics_test(lime::CurveId::c448, "lime_metrics");
+#endif
+}
+
+static void lime_incrementalCleanup_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+	lime::StorageOptions deferredCleanup{};
+	deferredCleanup.deferredCleanup = true;
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, deferredCleanup));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost, deferredCleanup));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+
+		// alice and bob messages cross on the network: each of them ends up with two sessions, one of them stale
+		auto aliceRecipients = make_shared<std::vector<RecipientData>>();
+		aliceRecipients->emplace_back(*bobDeviceId);
+		auto bobRecipients = make_shared<std::vector<RecipientData>>();
+		bobRecipients->emplace_back(*aliceDeviceId);
+		auto aliceMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto bobMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+		auto aliceCipherMessage = make_shared<std::vector<uint8_t>>();
+		auto bobCipherMessage = make_shared<std::vector<uint8_t>>();
+		aliceManager->encrypt(*aliceDeviceId, make_shared<const std::string>("bob"), aliceRecipients, aliceMessage, aliceCipherMessage, callback);
+		bobManager->encrypt(*bobDeviceId, make_shared<const std::string>("alice"), bobRecipients, bobMessage, bobCipherMessage, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, "bob", *aliceDeviceId, (*aliceRecipients)[0].DRmessage, *aliceCipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDeviceId, "alice", *bobDeviceId, (*bobRecipients)[0].DRmessage, *bobCipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		std::vector<long int> sessionsId{};
+		lime_tester::get_DRsessionsId(dbFilenameAlice, *aliceDeviceId, *bobDeviceId, sessionsId);
+		BC_ASSERT_EQUAL((int)sessionsId.size(), 2, int, "%d");
+
+		// get the stale session old enough to be deleted
+		aliceManager = nullptr;
+		lime_tester::forwardTime(dbFilenameAlice, lime::settings::DRSession_limboTime_days+1);
+		aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, deferredCleanup));
+
+		// update does not clean anymore
+		aliceManager->update(callback, 0, lime_tester::OPkInitialBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		sessionsId.clear();
+		lime_tester::get_DRsessionsId(dbFilenameAlice, *aliceDeviceId, *bobDeviceId, sessionsId);
+		BC_ASSERT_EQUAL((int)sessionsId.size(), 2, int, "%d");
+
+		// An exhausted budget stops the cleanup before it is complete
+		BC_ASSERT_FALSE(aliceManager->cleanup(std::chrono::milliseconds{0}));
+		BC_ASSERT_FALSE(aliceManager->cleanup(std::chrono::seconds{10}, 1));
+		sessionsId.clear();
+		lime_tester::get_DRsessionsId(dbFilenameAlice, *aliceDeviceId, *bobDeviceId, sessionsId);
+		BC_ASSERT_EQUAL((int)sessionsId.size(), 1, int, "%d");
+
+		// next call resumes and completes it, the active session is still there
+		BC_ASSERT_TRUE(aliceManager->cleanup(std::chrono::seconds{10}));
+		sessionsId.clear();
+		auto activeSessionId = lime_tester::get_DRsessionsId(dbFilenameAlice, *aliceDeviceId, *bobDeviceId, sessionsId);
+		BC_ASSERT_EQUAL((int)sessionsId.size(), 1, int, "%d");
+		BC_ASSERT_TRUE(activeSessionId > 0);
+		BC_ASSERT_TRUE(aliceManager->cleanup(std::chrono::seconds{10}));
+
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		bobManager->delete_user(*bobDeviceId, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
+}
+
+static void lime_incrementalCleanup() {
+#ifdef EC25519_ENABLED
+	lime_incrementalCleanup_test(lime::CurveId::c25519, "lime_incrementalCleanup");
+#endif
+#ifdef EC448_ENABLED
+	lime_incrementalCleanup_test(lime::CurveId::c448, "lime_incrementalCleanup");
+#endif
+}
+
+static void lime_tracing_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	std::mutex eventsMutex{};
+	std::vector<lime::TraceEvent> events{};
+	limeTraceCallback traceCallback([&events, &eventsMutex](const lime::TraceEvent &event) {
+					std::lock_guard<std::mutex> lock(eventsMutex);
+					events.push_back(event);
+				});
+	// find the end event of the first span with the given name, nullptr if none
+	auto findEnd = [&events](const std::string &name) -> const lime::TraceEvent * {
+		for (const auto &event : events) {
+			if (event.type == lime::TraceEventType::spanEnd && name == event.name) return &event;
+		}
+		return nullptr;
+	};
+	auto attribute = [](const lime::TraceEvent *event, const std::string &key) -> int64_t {
+		for (const auto &a : event->attributes) {
+			if (key == a.key && !a.isString) return a.intValue;
+		}
+		return -1;
+	};
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		bobManager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+
+		// trace a first contact encryption
+		aliceManager->set_traceCallback(traceCallback);
+		auto aliceRecipients = make_shared<std::vector<RecipientData>>();
+		aliceRecipients->emplace_back(*bobDeviceId);
+		auto aliceMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto aliceCipherMessage = make_shared<std::vector<uint8_t>>();
+		aliceManager->encrypt(*aliceDeviceId, make_shared<const std::string>("bob"), aliceRecipients, aliceMessage, aliceCipherMessage, callback, lime::EncryptionPolicy::DRMessage);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		{
+			std::lock_guard<std::mutex> lock(eventsMutex);
+			// every span begins and ends once, ids are unique
+			std::map<uint64_t, int> spans{};
+			for (const auto &event : events) {
+				BC_ASSERT_TRUE(event.spanId != 0);
+				spans[event.spanId] += (event.type == lime::TraceEventType::spanBegin)?1:2;
+			}
+			for (const auto &span : spans) {
+				BC_ASSERT_EQUAL(span.second, 3, int, "%d");
+			}
+
+			// first encryption pass waits for the key bundle
+			auto encrypt = findEnd("lime.encrypt");
+			BC_ASSERT_PTR_NOT_NULL(encrypt);
+			if (encrypt != nullptr) {
+				BC_ASSERT_EQUAL((int)attribute(encrypt, "recipients"), 1, int, "%d");
+				BC_ASSERT_EQUAL((int)attribute(encrypt, "missingDevices"), 1, int, "%d");
+				BC_ASSERT_EQUAL((int)attribute(encrypt, "fetchKeyBundles"), 1, int, "%d");
+				bool policyFound = false;
+				for (const auto &a : encrypt->attributes) {
+					if (std::string("policy") == a.key) policyFound = a.isString && a.stringValue == "DRMessage";
+				}
+				BC_ASSERT_TRUE(policyFound);
+			}
+			auto cacheSessions = findEnd("lime.cache_DR_sessions");
+			BC_ASSERT_PTR_NOT_NULL(cacheSessions);
+			if (cacheSessions != nullptr && encrypt != nullptr) {
+				BC_ASSERT_TRUE(cacheSessions->parentSpanId == encrypt->spanId);
+				BC_ASSERT_EQUAL((int)attribute(cacheSessions, "requested"), 1, int, "%d");
+			}
+			auto roundTrip = findEnd("lime.X3DHRoundTrip");
+			BC_ASSERT_PTR_NOT_NULL(roundTrip);
+			if (roundTrip != nullptr) {
+				BC_ASSERT_EQUAL((int)attribute(roundTrip, "responseCode"), 200, int, "%d");
+				BC_ASSERT_TRUE(attribute(roundTrip, "requestSize") > 0);
+				auto processResponse = findEnd("lime.X3DHProcessResponse");
+				BC_ASSERT_PTR_NOT_NULL(processResponse);
+				if (processResponse != nullptr) {
+					BC_ASSERT_TRUE(processResponse->parentSpanId == roundTrip->spanId);
+				}
+			}
+			auto initSession = findEnd("lime.X3DH_init_sender_session");
+			BC_ASSERT_PTR_NOT_NULL(initSession);
+			if (initSession != nullptr) {
+				BC_ASSERT_EQUAL((int)attribute(initSession, "bundles"), 1, int, "%d");
+			}
+			auto sessionSave = findEnd("lime.session_save");
+			BC_ASSERT_PTR_NOT_NULL(sessionSave);
+			if (sessionSave != nullptr) {
+				BC_ASSERT_EQUAL((int)attribute(sessionSave, "insert"), 1, int, "%d");
+				BC_ASSERT_TRUE(attribute(sessionSave, "dbSessionId") > 0);
+			}
+			events.clear();
+		}
+
+		// stop tracing
+		aliceManager->set_traceCallback(nullptr);
+		aliceCipherMessage = make_shared<std::vector<uint8_t>>();
+		aliceManager->encrypt(*aliceDeviceId, make_shared<const std::string>("bob"), aliceRecipients, aliceMessage, aliceCipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		{
+			std::lock_guard<std::mutex> lock(eventsMutex);
+			BC_ASSERT_EQUAL((int)events.size(), 0, int, "%d");
+		}
+
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		bobManager->delete_user(*bobDeviceId, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
+}
+
+static void lime_tracing() {
+#ifdef EC25519_ENABLED
+	lime_tracing_test(lime::CurveId::c25519, "lime_tracing");
+#endif
+#ifdef EC448_ENABLED
+	lime_tracing_test(lime::CurveId::c448, "lime_tracing");
+#endif
+}
+
+static void lime_senderKey_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameCarol{dbBaseFilename};
+	dbFilenameCarol.append(".carol.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+	remove(dbFilenameCarol.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto carolManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameCarol, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		auto carolDeviceId = lime_tester::makeRandomDeviceName("carol.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		carolManager->create_user(*carolDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+
+		auto groupId = make_shared<const std::string>("friends");
+		auto encryptToGroup = [&](const std::vector<std::string> &devices, const size_t patternIndex, std::shared_ptr<std::vector<RecipientData>> &recipients, std::shared_ptr<std::vector<uint8_t>> &cipherMessage) {
+			recipients = make_shared<std::vector<RecipientData>>();
+			for (const auto &device : devices) {
+				recipients->emplace_back(device);
+			}
+			cipherMessage = make_shared<std::vector<uint8_t>>();
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[patternIndex].begin(), lime_tester::messages_pattern[patternIndex].end());
+			aliceManager->encrypt(*aliceDeviceId, groupId, recipients, message, cipherMessage, callback, lime::EncryptionPolicy::senderKey);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		};
+
+		// first message: bob and carol get the chain in their DR message
+		std::shared_ptr<std::vector<RecipientData>> recipients{};
+		std::shared_ptr<std::vector<uint8_t>> cipherMessage{};
+		encryptToGroup({*bobDeviceId, *carolDeviceId}, 0, recipients, cipherMessage);
+		BC_ASSERT_TRUE((*recipients)[0].DRmessage.size() > 3);
+		BC_ASSERT_TRUE((*recipients)[1].DRmessage.size() > 3);
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, *groupId, *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[0]);
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(carolManager->decrypt(*carolDeviceId, *groupId, *aliceDeviceId, (*recipients)[1].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[0]);
+
+		// next message: they already hold the chain, the DR messages only flag the sender key mode
+		encryptToGroup({*bobDeviceId, *carolDeviceId}, 1, recipients, cipherMessage);
+		BC_ASSERT_EQUAL((int)(*recipients)[0].DRmessage.size(), 3, int, "%d");
+		BC_ASSERT_EQUAL((int)(*recipients)[1].DRmessage.size(), 3, int, "%d");
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, *groupId, *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[1]);
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(carolManager->decrypt(*carolDeviceId, *groupId, *aliceDeviceId, (*recipients)[1].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[1]);
+		// a replayed message is rejected
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, *groupId, *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::fail);
+		// so is a tampered one
+		auto tamperedCipherMessage = *cipherMessage;
+		tamperedCipherMessage[lime::settings::senderKeyChainIdSize+2] ^= 0x01;
+		BC_ASSERT_TRUE(carolManager->decrypt(*carolDeviceId, *groupId, *aliceDeviceId, (*recipients)[1].DRmessage, tamperedCipherMessage, receivedMessage) == lime::PeerDeviceStatus::fail);
+		auto senderKeyDRmessage = (*recipients)[1].DRmessage;
+
+		// carol leaves the group: a new chain is distributed to bob, carol can't decrypt with the one she holds
+		encryptToGroup({*bobDeviceId}, 2, recipients, cipherMessage);
+		BC_ASSERT_TRUE((*recipients)[0].DRmessage.size() > 3);
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, *groupId, *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[2]);
+		BC_ASSERT_TRUE(carolManager->decrypt(*carolDeviceId, *groupId, *aliceDeviceId, senderKeyDRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::fail);
+
+		// a device joining the group gets the current chain, the others keep using it
+		encryptToGroup({*bobDeviceId, *carolDeviceId}, 3, recipients, cipherMessage);
+		BC_ASSERT_EQUAL((int)(*recipients)[0].DRmessage.size(), 3, int, "%d");
+		BC_ASSERT_TRUE((*recipients)[1].DRmessage.size() > 3);
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDeviceId, *groupId, *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[3]);
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(carolManager->decrypt(*carolDeviceId, *groupId, *aliceDeviceId, (*recipients)[1].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[3]);
+
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		bobManager->delete_user(*bobDeviceId, callback);
+		carolManager->delete_user(*carolDeviceId, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+		remove(dbFilenameCarol.data());
+	}
+}
+
+static void lime_senderKey() {
+#ifdef EC25519_ENABLED
+	lime_senderKey_test(lime::CurveId::c25519, "lime_senderKey");
+#endif
+#ifdef EC448_ENABLED
+	lime_senderKey_test(lime::CurveId::c448, "lime_senderKey");
+#endif
+}
+
+/**
+ * Sender key chain distribution lost or late
+ * - alice encrypts three messages to the group with the senderKey policy, the first one distributes the chain
+ * - bob gets the first message after the second one: the second fails, then both and the third decrypt in order
+ * - carol never gets the first message: she fails to decrypt all the messages of this chain
+ * - alice encrypts to bob only: a new chain is started, carol gets it with the next message and decrypts again
+ */
+static void lime_senderKeyLostDistribution_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameCarol{dbBaseFilename};
+	dbFilenameCarol.append(".carol.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+	remove(dbFilenameCarol.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto carolManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameCarol, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		auto carolDeviceId = lime_tester::makeRandomDeviceName("carol.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		carolManager->create_user(*carolDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		// encrypt a message to the group, its index gives the message pattern
+		auto groupId = make_shared<const std::string>("friends");
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> recipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> cipherMessages{};
+		auto encryptToGroup = [&](const std::vector<std::string> &devices) {
+			recipients.push_back(make_shared<std::vector<RecipientData>>());
+			for (const auto &device : devices) {
+				recipients.back()->emplace_back(device);
+			}
+			cipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[recipients.size()-1].begin(), lime_tester::messages_pattern[recipients.size()-1].end());
+			aliceManager->encrypt(*aliceDeviceId, groupId, recipients.back(), message, cipherMessages.back(), callback, lime::EncryptionPolicy::senderKey);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		};
+		// decrypt the message of given index, recipient is the index of the device in its recipients
+		auto decrypt = [&](LimeManager &manager, const std::string &deviceId, const size_t index, const size_t recipient) {
+			std::vector<uint8_t> receivedMessage{};
+			if (manager.decrypt(deviceId, *groupId, *aliceDeviceId, (*recipients[index])[recipient].DRmessage, *cipherMessages[index], receivedMessage) == lime::PeerDeviceStatus::fail) {
+				return false;
+			}
+			return std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[index];
+		};
+
+		for (size_t i=0; i<3; i++) {
+			encryptToGroup({*bobDeviceId, *carolDeviceId});
+		}
+		BC_ASSERT_TRUE((*recipients[0])[1].DRmessage.size() > 3); // the first message distributes the chain
+		BC_ASSERT_EQUAL((int)(*recipients[1])[1].DRmessage.size(), 3, int, "%d");
+
+		// the distribution is late: only the messages tried before it fail
+		BC_ASSERT_FALSE(decrypt(*bobManager, *bobDeviceId, 1, 0));
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, 0, 0));
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, 1, 0));
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, 2, 0));
+
+		// the distribution is lost: no message of the chain decrypts
+		BC_ASSERT_FALSE(decrypt(*carolManager, *carolDeviceId, 1, 1));
+		BC_ASSERT_FALSE(decrypt(*carolManager, *carolDeviceId, 2, 1));
+		encryptToGroup({*bobDeviceId, *carolDeviceId});
+		BC_ASSERT_EQUAL((int)(*recipients[3])[1].DRmessage.size(), 3, int, "%d"); // alice is not aware of it
+		BC_ASSERT_FALSE(decrypt(*carolManager, *carolDeviceId, 3, 1));
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, 3, 0));
+
+		// carol missing from the recipients starts a new chain, she gets it with the next message
+		encryptToGroup({*bobDeviceId});
+		BC_ASSERT_TRUE((*recipients[4])[0].DRmessage.size() > 3);
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, 4, 0));
+		encryptToGroup({*bobDeviceId, *carolDeviceId});
+		BC_ASSERT_EQUAL((int)(*recipients[5])[0].DRmessage.size(), 3, int, "%d");
+		BC_ASSERT_TRUE((*recipients[5])[1].DRmessage.size() > 3);
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, 5, 0));
+		BC_ASSERT_TRUE(decrypt(*carolManager, *carolDeviceId, 5, 1));
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		bobManager->delete_user(*bobDeviceId, callback);
+		carolManager->delete_user(*carolDeviceId, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+		remove(dbFilenameCarol.data());
+	}
+}
+
+static void lime_senderKeyLostDistribution() {
+#ifdef EC25519_ENABLED
+	lime_senderKeyLostDistribution_test(lime::CurveId::c25519, "lime_senderKeyLostDistribution");
+#endif
+#ifdef EC448_ENABLED
+	lime_senderKeyLostDistribution_test(lime::CurveId::c448, "lime_senderKeyLostDistribution");
+#endif
+}
+
+/**
+ * Encrypt with all the DR messages written in one buffer:
+ * - the buffer reserved to the maximum sizes is not reallocated
+ * - each slice decrypts on its recipient, the recipient set to fail gets an empty one
+ * - all the encryption policies fill it the same way
+ */
+static void lime_DRmessagesArena_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameCarol{dbBaseFilename};
+	dbFilenameCarol.append(".carol.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+	remove(dbFilenameCarol.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto carolManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameCarol, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		auto carolDeviceId = lime_tester::makeRandomDeviceName("carol.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		carolManager->create_user(*carolDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+
+		auto recipientUserId = make_shared<const std::string>("friends");
+		const std::vector<lime::EncryptionPolicy> policies{lime::EncryptionPolicy::DRMessage, lime::EncryptionPolicy::cipherMessage, lime::EncryptionPolicy::senderKey, lime::EncryptionPolicy::DRMessage};
+		for (size_t i=0; i<policies.size(); i++) {
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			size_t DRmessageMaxSize = 0;
+			size_t cipherMessageMaxSize = 0;
+			LimeManager::encryptOutBuffersMaximumSize(message->size(), curve, DRmessageMaxSize, cipherMessageMaxSize);
+
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(*bobDeviceId);
+			recipients->emplace_back("sip:nobody@sip.example.org;gr=ignored");
+			recipients->back().peerStatus = lime::PeerDeviceStatus::fail; // ignored by encrypt
+			recipients->emplace_back(*carolDeviceId);
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			cipherMessage->reserve(cipherMessageMaxSize);
+			auto DRmessages = make_shared<DRMessagesArena>();
+			DRmessages->buffer.reserve(2*DRmessageMaxSize);
+			const auto arenaBuffer = DRmessages->buffer.data();
+
+			aliceManager->encrypt(*aliceDeviceId, recipientUserId, recipients, message, cipherMessage, DRmessages, callback, policies[i]);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+			BC_ASSERT_TRUE(DRmessages->buffer.data() == arenaBuffer); // the reserved buffer was large enough
+			BC_ASSERT_TRUE(cipherMessage->size() <= cipherMessageMaxSize);
+			BC_ASSERT_EQUAL((int)DRmessages->messages.size(), 3, int, "%d");
+			if (DRmessages->messages.size() != 3) break;
+			BC_ASSERT_EQUAL((int)DRmessages->messages[1].second, 0, int, "%d");
+			BC_ASSERT_EQUAL((int)(DRmessages->messages[0].second + DRmessages->messages[2].second), (int)DRmessages->buffer.size(), int, "%d");
+			for (size_t j=0; j<recipients->size(); j++) {
+				BC_ASSERT_TRUE((*recipients)[j].DRmessage.empty()); // the DR messages are only in the arena
+				BC_ASSERT_TRUE(DRmessages->messages[j].second <= DRmessageMaxSize);
+			}
+
+			const std::vector<std::pair<LimeManager *, std::shared_ptr<std::string>>> receivers{{bobManager.get(), bobDeviceId}, {nullptr, nullptr}, {carolManager.get(), carolDeviceId}};
+			for (size_t j=0; j<receivers.size(); j++) {
+				if (receivers[j].first == nullptr) continue;
+				const auto slice = DRmessages->messages[j];
+				const std::vector<uint8_t> DRmessage(DRmessages->buffer.cbegin()+slice.first, DRmessages->buffer.cbegin()+slice.first+slice.second);
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(receivers[j].first->decrypt(*receivers[j].second, *recipientUserId, *aliceDeviceId, DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[i]);
+			}
+		}
+
+		// unsupported curve
+		size_t DRmessageMaxSize = 0;
+		size_t cipherMessageMaxSize = 0;
+		bool unsupportedCurveThrows = false;
+		try {
+			LimeManager::encryptOutBuffersMaximumSize(16, lime::CurveId::unset, DRmessageMaxSize, cipherMessageMaxSize);
+		} catch (BctbxException &) {
+			unsupportedCurveThrows = true;
+		}
+		BC_ASSERT_TRUE(unsupportedCurveThrows);
+
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		bobManager->delete_user(*bobDeviceId, callback);
+		carolManager->delete_user(*carolDeviceId, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+		remove(dbFilenameCarol.data());
+	}
+}
+
+static void lime_DRmessagesArena() {
+#ifdef EC25519_ENABLED
+	lime_DRmessagesArena_test(lime::CurveId::c25519, "lime_DRmessagesArena");
+#endif
+#ifdef EC448_ENABLED
+	lime_DRmessagesArena_test(lime::CurveId::c448, "lime_DRmessagesArena");
+#endif
+}
+
+/**
+ * Encrypt to more peer devices than a chunk of the local storage lookups:
+ * - alice encrypts a first message to all bob devices, creating the sessions
+ * - alice manager is reloaded, its sessions cache is empty
+ * - the next encryption finds all the sessions and devices status in local storage: it completes without contacting the X3DH server
+ */
+static void lime_chunkedDevicesLookup_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		const size_t bobDevicesCount = lime::settings::DB_inListChunkSize + 3; // the last chunk is padded
+		std::vector<std::shared_ptr<std::string>> bobDevices{};
+		for (size_t i=0; i<bobDevicesCount; i++) {
+			bobDevices.push_back(lime_tester::makeRandomDeviceName(std::string("bob.d").append(std::to_string(i+1)).append(".").data()));
+			bobManager->create_user(*(bobDevices.back()), x3dh_server_url, curve, 2, callback);
+		}
+		expected_success += 1+static_cast<int>(bobDevicesCount);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+
+		for (size_t messageIndex=0; messageIndex<2; messageIndex++) {
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			for (const auto &bobDevice : bobDevices) {
+				recipients->emplace_back(*bobDevice);
+			}
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[messageIndex].begin(), lime_tester::messages_pattern[messageIndex].end());
+			aliceManager->encrypt(*aliceDeviceId, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback, lime::EncryptionPolicy::cipherMessage);
+			if (messageIndex == 0) { // sessions are created from the key bundles fetched on the X3DH server
+				BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			} else { // everything is in local storage: the callback is called before encrypt returns
+				BC_ASSERT_EQUAL(counters.operation_success, ++expected_success, int, "%d");
+			}
+
+			for (const auto &recipient : *recipients) {
+				// the devices were unknown before the first message
+				BC_ASSERT_TRUE(recipient.peerStatus == ((messageIndex==0)?lime::PeerDeviceStatus::unknown:lime::PeerDeviceStatus::untrusted));
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(bobManager->decrypt(recipient.deviceId, "bob", *aliceDeviceId, recipient.DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[messageIndex]);
+			}
+
+			// reload alice manager so the sessions are not in cache anymore
+			aliceManager = nullptr;
+			aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		}
+
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		for (const auto &bobDevice : bobDevices) {
+			bobManager->delete_user(*bobDevice, callback);
+		}
+		expected_success += 1+static_cast<int>(bobDevicesCount);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
+}
+
+static void lime_chunkedDevicesLookup() {
+#ifdef EC25519_ENABLED
+	lime_chunkedDevicesLookup_test(lime::CurveId::c25519, "lime_chunkedDevicesLookup");
+#endif
+#ifdef EC448_ENABLED
+	lime_chunkedDevicesLookup_test(lime::CurveId::c448, "lime_chunkedDevicesLookup");
+#endif
+}
+
+/**
+ * Peer devices status are cached by the manager: check the changes made through one connection are seen by the users' ones
+ * - alice and bob are in the same manager, with one connection per user
+ * - each status change is checked at decryption by bob and encryption by alice, after the device was cached
+ */
+static void lime_peerDevicesCache_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilename{dbBaseFilename};
+	dbFilename.append(".").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilename.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost, lime::StorageOptions::serverThroughput()));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		manager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+
+		std::vector<uint8_t> aliceIk{};
+		std::vector<uint8_t> bobIk{};
+		manager->get_selfIdentityKey(*aliceDeviceId, aliceIk);
+		manager->get_selfIdentityKey(*bobDeviceId, bobIk);
+
+		// peer status expected by alice encrypting to bob and by bob decrypting, after each step
+		const std::array<lime::PeerDeviceStatus, 4> expectedStatus{{lime::PeerDeviceStatus::untrusted, lime::PeerDeviceStatus::trusted, lime::PeerDeviceStatus::untrusted, lime::PeerDeviceStatus::unsafe}};
+		for (size_t step=0; step<expectedStatus.size(); step++) {
+			switch (step) {
+				case 1: // set the devices trusted
+					manager->set_peerDeviceStatus(*aliceDeviceId, aliceIk, lime::PeerDeviceStatus::trusted);
+					manager->set_peerDeviceStatus(*bobDeviceId, bobIk, lime::PeerDeviceStatus::trusted);
+					break;
+				case 2: // back to untrusted
+					manager->set_peerDeviceStatus(*aliceDeviceId, lime::PeerDeviceStatus::untrusted);
+					manager->set_peerDeviceStatus(*bobDeviceId, lime::PeerDeviceStatus::untrusted);
+					break;
+				case 3: // unsafe
+					manager->set_peerDeviceStatus(*aliceDeviceId, lime::PeerDeviceStatus::unsafe);
+					manager->set_peerDeviceStatus(*bobDeviceId, lime::PeerDeviceStatus::unsafe);
+					break;
+				default:
+					break;
+			}
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(*bobDeviceId);
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[step].begin(), lime_tester::messages_pattern[step].end());
+			manager->encrypt(*aliceDeviceId, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			// at first message, the devices are unknown until the decryption inserts them in local storage
+			const auto messageStatus = (step==0)?lime::PeerDeviceStatus::unknown:expectedStatus[step];
+			BC_ASSERT_TRUE((*recipients)[0].peerStatus == messageStatus);
+
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(manager->decrypt(*bobDeviceId, "bob", *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) == messageStatus);
+			BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[step]);
+			BC_ASSERT_TRUE(manager->get_peerDeviceStatus(*aliceDeviceId) == expectedStatus[step]);
+		}
+
+		// a deleted device is not known anymore
+		manager->delete_peerDevice(*aliceDeviceId);
+		BC_ASSERT_TRUE(manager->get_peerDeviceStatus(*aliceDeviceId) == lime::PeerDeviceStatus::unknown);
+		BC_ASSERT_TRUE(manager->get_peerDeviceStatus(*bobDeviceId) == lime::PeerDeviceStatus::unsafe);
+
+		manager->delete_user(*aliceDeviceId, callback);
+		manager->delete_user(*bobDeviceId, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilename.data());
+	}
+}
+
+static void lime_peerDevicesCache() {
+#ifdef EC25519_ENABLED
+	lime_peerDevicesCache_test(lime::CurveId::c25519, "lime_peerDevicesCache");
+#endif
+#ifdef EC448_ENABLED
+	lime_peerDevicesCache_test(lime::CurveId::c448, "lime_peerDevicesCache");
+#endif
+}
+
+/**
+ * Local users spread on several database files
+ * - create users in a manager using 3 shards, each user shall be in one and only one shard
+ * - encrypt between them, update and set a peer device status through the manager
+ * - open the shards again with a new manager and decrypt
+ */
+static void lime_storageShards_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	constexpr uint16_t shardsCount = 3;
+	std::string dbFilename{dbBaseFilename};
+	dbFilename.append(".").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::vector<std::string> shardFilenames{};
+	for (size_t i=0; i<shardsCount; i++) {
+		shardFilenames.push_back(std::string(dbFilename).append(".").append(std::to_string(i)));
+		remove(shardFilenames.back().data()); // delete the database file if already exists
+	}
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		lime::StorageOptions options{};
+		options.shards = shardsCount;
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost, options));
+		std::vector<std::shared_ptr<std::string>> devices{};
+		for (size_t i=0; i<8; i++) {
+			devices.push_back(lime_tester::makeRandomDeviceName(std::string("user").append(std::to_string(i)).append(".").data()));
+			manager->create_user(*(devices.back()), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += static_cast<int>(devices.size());
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL(manager->get_storageOptions().shards, shardsCount, int, "%d");
+
+		// each user is in one shard file only
+		for (const auto &device : devices) {
+			BC_ASSERT_TRUE(manager->is_localUser(*device));
+			int found = 0;
+			for (const auto &shardFilename : shardFilenames) {
+				auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(shardFilename, std::make_shared<std::recursive_mutex>()));
+				if (localStorage->is_localUser(*device)) found++;
+			}
+			BC_ASSERT_EQUAL(found, 1, int, "%d");
+		}
+
+		// the first user encrypts to all the others
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		for (size_t i=1; i<devices.size(); i++) {
+			recipients->emplace_back(*(devices[i]));
+		}
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		manager->encrypt(*(devices[0]), make_shared<const std::string>("group"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// update runs on the users of all shards: two callbacks per user, one global callback
+		manager->update(callback, 0, lime_tester::OPkInitialBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// the status of the sender is set in all shards
+		manager->set_peerDeviceStatus(*(devices[0]), lime::PeerDeviceStatus::unsafe);
+		BC_ASSERT_TRUE(manager->get_peerDeviceStatus(*(devices[0])) == lime::PeerDeviceStatus::unsafe);
+
+		// reload the manager: users are found again in their shard
+		manager = nullptr;
+		manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost, options));
+		for (const auto &recipient : *recipients) {
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(manager->decrypt(recipient.deviceId, "group", *(devices[0]), recipient.DRmessage, *cipherMessage, receivedMessage) == lime::PeerDeviceStatus::unsafe);
+			BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[0]);
+		}
+		BC_ASSERT_TRUE(manager->cleanup(std::chrono::milliseconds{1000}));
+
+		for (const auto &device : devices) {
+			manager->delete_user(*device, callback);
+		}
+		expected_success += static_cast<int>(devices.size());
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		for (const auto &shardFilename : shardFilenames) {
+			remove(shardFilename.data());
+		}
+	}
+}
+
+static void lime_storageShards() {
+#ifdef EC25519_ENABLED
+	lime_storageShards_test(lime::CurveId::c25519, "lime_storageShards");
+#endif
+#ifdef EC448_ENABLED
+	lime_storageShards_test(lime::CurveId::c448, "lime_storageShards");
+#endif
+}
+
+/**
+ * Sessions snapshot
+ * - alice and bob exchange messages, save the sessions snapshot
+ * - reload the manager and the snapshot: the sessions are found in cache at next encryption and decryption
+ * - a snapshot is loaded only once
+ * - a session modified after the snapshot was taken is not restored
+ */
+static void lime_sessionsSnapshot_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilename{dbBaseFilename};
+	dbFilename.append(".").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string snapshotFilename{dbFilename};
+	snapshotFilename.append(".snapshot");
+
+	remove(dbFilename.data()); // delete the database file if already exists
+	remove(snapshotFilename.data());
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		manager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+
+		// encrypt a message from one device to the other and decrypt it
+		size_t patternIndex = 0;
+		auto exchange = [&](const std::string &senderDeviceId, const std::string &recipientDeviceId) {
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(recipientDeviceId);
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[patternIndex].begin(), lime_tester::messages_pattern[patternIndex].end());
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			manager->encrypt(senderDeviceId, make_shared<const std::string>("friends"), recipients, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(manager->decrypt(recipientDeviceId, "friends", senderDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[patternIndex]);
+			patternIndex++;
+		};
+		exchange(*aliceDeviceId, *bobDeviceId);
+		exchange(*bobDeviceId, *aliceDeviceId);
+
+		manager->save_sessionsSnapshot(snapshotFilename);
+
+		// restart: both sessions are restored and found in cache
+		manager = nullptr;
+		manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost));
+		BC_ASSERT_EQUAL((int)manager->load_sessionsSnapshot(snapshotFilename), 2, int, "%d");
+		manager->set_metricsEnabled(true);
+		exchange(*aliceDeviceId, *bobDeviceId);
+		lime::Metrics metrics{};
+		manager->get_metrics(metrics);
+		BC_ASSERT_EQUAL((int)metrics.DRSessionsCacheHits, 2, int, "%d");
+		BC_ASSERT_EQUAL((int)metrics.DRSessionsCacheMisses, 0, int, "%d");
+		manager->set_metricsEnabled(false);
+
+		// the file is consumed by the load
+		BC_ASSERT_EQUAL((int)manager->load_sessionsSnapshot(snapshotFilename), 0, int, "%d");
+
+		// alice session is modified after the snapshot: only bob's one is restored
+		manager->save_sessionsSnapshot(snapshotFilename);
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		recipients->emplace_back(*bobDeviceId);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[patternIndex].begin(), lime_tester::messages_pattern[patternIndex].end());
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		manager->encrypt(*aliceDeviceId, make_shared<const std::string>("friends"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		manager = nullptr;
+		manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost));
+		BC_ASSERT_EQUAL((int)manager->load_sessionsSnapshot(snapshotFilename), 1, int, "%d");
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(manager->decrypt(*bobDeviceId, "friends", *aliceDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[patternIndex]);
+		patternIndex++;
+		exchange(*bobDeviceId, *aliceDeviceId);
+
+		manager->delete_user(*aliceDeviceId, callback);
+		manager->delete_user(*bobDeviceId, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	remove(snapshotFilename.data());
+	if (cleanDatabase) {
+		remove(dbFilename.data());
+	}
+}
+
+static void lime_sessionsSnapshot() {
+#ifdef EC25519_ENABLED
+	lime_sessionsSnapshot_test(lime::CurveId::c25519, "lime_sessionsSnapshot");
+#endif
+#ifdef EC448_ENABLED
+	lime_sessionsSnapshot_test(lime::CurveId::c448, "lime_sessionsSnapshot");
+#endif
+}
+
+/**
+ * Predictive OPk update
+ * - alice and bob in predictive mode, update does not query the X3DH server while the projected OPk count is enough
+ * - bob session creation consumes an alice OPk: her next update queries the server and uploads a batch, bob's does not
+ */
+static void lime_OPkPredictiveUpdate_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilename{dbBaseFilename};
+	dbFilename.append(".").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilename.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		const uint16_t OPkServerLowLimit = lime_tester::OPkInitialBatchSize;
+		const uint16_t OPkBatchSize = 5;
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		manager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		manager->set_OPkPredictiveUpdate(true);
+		manager->set_metricsEnabled(true);
+
+		// the projected count is the initial batch: no server query
+		manager->update(callback, OPkServerLowLimit, OPkBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		lime::Metrics metrics{};
+		manager->get_metrics(metrics);
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::X3DHRoundTrip).calls, 0, int, "%d");
+
+		// bob starts a session with alice using one of her OPks
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		recipients->emplace_back(*aliceDeviceId);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		manager->encrypt(*bobDeviceId, make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(manager->decrypt(*aliceDeviceId, "alice", *bobDeviceId, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_EQUAL((int)lime_tester::x3dhLoopbackServer->OPkCount(curve, *aliceDeviceId), lime_tester::OPkInitialBatchSize-1, int, "%d");
+
+		// alice projection is now under the low limit: get her OPks list from server and upload a batch
+		manager->reset_metrics();
+		manager->update(callback, OPkServerLowLimit, OPkBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		manager->get_metrics(metrics);
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::X3DHRoundTrip).calls, 2, int, "%d");
+		BC_ASSERT_EQUAL((int)lime_tester::x3dhLoopbackServer->OPkCount(curve, *aliceDeviceId), lime_tester::OPkInitialBatchSize-1+OPkBatchSize, int, "%d");
+		BC_ASSERT_EQUAL((int)lime_tester::x3dhLoopbackServer->OPkCount(curve, *bobDeviceId), lime_tester::OPkInitialBatchSize, int, "%d");
+
+		// nothing consumed since: no query
+		manager->reset_metrics();
+		manager->update(callback, OPkServerLowLimit, OPkBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		manager->get_metrics(metrics);
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::X3DHRoundTrip).calls, 0, int, "%d");
+		manager->set_metricsEnabled(false);
+
+		manager->delete_user(*aliceDeviceId, callback);
+		manager->delete_user(*bobDeviceId, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilename.data());
+	}
+}
+
+static void lime_OPkPredictiveUpdate() {
+#ifdef EC25519_ENABLED
+	lime_OPkPredictiveUpdate_test(lime::CurveId::c25519, "lime_OPkPredictiveUpdate");
+#endif
+#ifdef EC448_ENABLED
+	lime_OPkPredictiveUpdate_test(lime::CurveId::c448, "lime_OPkPredictiveUpdate");
+#endif
+}
+
+static void lime_updatePipeline_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilename{dbBaseFilename};
+	dbFilename.append(".").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilename.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	// count the messages posted to the X3DH server
+	int posts = 0;
+	limeX3DHServerPostData X3DHServerPost_counting([&posts](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+		posts++;
+		X3DHServerPost(url, from, message, responseProcess);
+	});
+
+	try {
+		// the users have enough OPks on server: updating one is a single getSelfOPks request
+		const uint16_t OPkServerLowLimit = lime_tester::OPkInitialBatchSize;
+		const uint16_t OPkBatchSize = 5;
+		const int usersCount = 5;
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost_counting));
+		std::vector<std::shared_ptr<std::string>> deviceIds{};
+		for (int i=0; i<usersCount; i++) {
+			deviceIds.push_back(lime_tester::makeRandomDeviceName("alice."));
+			manager->create_user(*deviceIds.back(), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += usersCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+
+		// no limit: every user request is posted by update
+		posts = 0;
+		manager->update(callback, OPkServerLowLimit, OPkBatchSize);
+		BC_ASSERT_EQUAL(posts, usersCount, int, "%d");
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+		// two users at a time, run by our executor: the next users start only when the server responded to the previous ones
+		std::deque<std::function<void()>> jobs{};
+		manager->set_updatePipeline(2, [&jobs](const std::function<void()> &job) {
+				jobs.push_back(job);
+			}, false);
+		posts = 0;
+		manager->update(callback, OPkServerLowLimit, OPkBatchSize);
+		BC_ASSERT_EQUAL((int)jobs.size(), 2, int, "%d");
+		BC_ASSERT_EQUAL(posts, 0, int, "%d");
+		int maxInFlight = 0;
+		while (!jobs.empty()) {
+			auto started = std::move(jobs);
+			jobs.clear();
+			for (auto &job : started) {
+				job();
+			}
+			maxInFlight = std::max(maxInFlight, (int)started.size());
+			lime_tester::x3dhLoopbackServer->process();
+		}
+		BC_ASSERT_EQUAL(maxInFlight, 2, int, "%d");
+		BC_ASSERT_EQUAL(posts, usersCount, int, "%d");
+		BC_ASSERT_EQUAL(counters.operation_success, ++expected_success, int, "%d");
+
+		// in predictive OPk mode, deferred users are not sent to the server
+		manager->set_OPkPredictiveUpdate(true);
+		manager->set_updatePipeline(2, nullptr, true);
+		posts = 0;
+		manager->update(callback, OPkServerLowLimit, OPkBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL(posts, 0, int, "%d");
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		manager->set_updatePipeline(0, nullptr, false);
+		for (const auto &deviceId : deviceIds) {
+			manager->delete_user(*deviceId, callback);
+		}
+		expected_success += usersCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilename.data());
+	}
+}
+
+static void lime_updatePipeline() {
+#ifdef EC25519_ENABLED
+	lime_updatePipeline_test(lime::CurveId::c25519, "lime_updatePipeline");
+#endif
+#ifdef EC448_ENABLED
+	lime_updatePipeline_test(lime::CurveId::c448, "lime_updatePipeline");
+#endif
+}
+
+static void lime_X3DHBatch_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilename{dbBaseFilename};
+	dbFilename.append(".").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilename.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	// count the messages posted to the X3DH server and the batch messages among them, keep the device posting the last batch
+	int posts = 0;
+	int batches = 0;
+	std::string batchFrom{};
+	limeX3DHServerPostData X3DHServerPost_counting([&posts, &batches, &batchFrom](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+		posts++;
+		if (message.size() > 1 && message[1] == 0x0a) { // batch message type
+			batches++;
+			batchFrom = from;
+		}
+		X3DHServerPost(url, from, message, responseProcess);
+	});
+
+	try {
+		const int usersCount = 3;
+		const uint16_t OPkBatchSize = 5;
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost_counting));
+		std::vector<std::shared_ptr<std::string>> deviceIds{};
+		for (int i=0; i<usersCount; i++) {
+			deviceIds.push_back(lime_tester::makeRandomDeviceName("alice."));
+			manager->create_user(*deviceIds.back(), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		expected_success += usersCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		manager->set_X3DHBatching(true, true);
+
+		// with a shared credential, the users getSelfOPks requests go in one batch, so do the postOPks requests sent when processing its response
+		posts = 0;
+		manager->update(callback, lime_tester::OPkInitialBatchSize+1, OPkBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL(posts, 2, int, "%d");
+		BC_ASSERT_EQUAL(batches, 2, int, "%d");
+		for (const auto &deviceId : deviceIds) {
+			BC_ASSERT_EQUAL((int)lime_tester::x3dhLoopbackServer->OPkCount(curve, *deviceId), lime_tester::OPkInitialBatchSize+OPkBatchSize, int, "%d");
+		}
+
+		// without a shared credential, a batch holds the requests of a single device and is posted on its behalf
+		manager->set_X3DHBatching(true);
+		posts = 0;
+		batches = 0;
+		{
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end());
+			std::vector<std::pair<size_t, size_t>> encryptions{{0, 1}, {0, 2}, {1, 2}}; // sender and recipient index
+			std::vector<std::shared_ptr<std::vector<RecipientData>>> recipients{};
+			std::vector<std::shared_ptr<std::vector<uint8_t>>> cipherMessages{};
+			manager->begin_X3DHBatch();
+			for (const auto &encryption : encryptions) {
+				recipients.push_back(make_shared<std::vector<RecipientData>>());
+				recipients.back()->emplace_back(*deviceIds[encryption.second]);
+				cipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+				manager->encrypt(*deviceIds[encryption.first], make_shared<const std::string>("alice"), recipients.back(), message, cipherMessages.back(), callback);
+			}
+			BC_ASSERT_EQUAL(posts, 0, int, "%d");
+			manager->end_X3DHBatch();
+			expected_success += (int)encryptions.size();
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+			BC_ASSERT_EQUAL(posts, 2, int, "%d"); // one batch for the first device requests, the second device one is posted alone
+			BC_ASSERT_EQUAL(batches, 1, int, "%d");
+			BC_ASSERT_TRUE(batchFrom == *deviceIds[0]);
+			// the messages are not decrypted: the recipients do not get sessions with the first device, used by the encryptions below
+		}
+		manager->set_X3DHBatching(true, true);
+
+		// key bundles requested by several encryptions between begin and end of a batch
+		posts = 0;
+		batches = 0;
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto recipients1 = make_shared<std::vector<RecipientData>>();
+		recipients1->emplace_back(*deviceIds[0]);
+		auto cipherMessage1 = make_shared<std::vector<uint8_t>>();
+		auto recipients2 = make_shared<std::vector<RecipientData>>();
+		recipients2->emplace_back(*deviceIds[0]);
+		auto cipherMessage2 = make_shared<std::vector<uint8_t>>();
+		manager->begin_X3DHBatch();
+		manager->encrypt(*deviceIds[1], make_shared<const std::string>("alice"), recipients1, message, cipherMessage1, callback);
+		manager->encrypt(*deviceIds[2], make_shared<const std::string>("alice"), recipients2, message, cipherMessage2, callback);
+		BC_ASSERT_EQUAL(posts, 0, int, "%d");
+		manager->end_X3DHBatch();
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL(posts, 1, int, "%d");
+		BC_ASSERT_EQUAL(batches, 1, int, "%d");
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(manager->decrypt(*deviceIds[0], "alice", *deviceIds[1], (*recipients1)[0].DRmessage, *cipherMessage1, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(receivedMessage == *message);
+		BC_ASSERT_TRUE(manager->decrypt(*deviceIds[0], "alice", *deviceIds[2], (*recipients2)[0].DRmessage, *cipherMessage2, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(receivedMessage == *message);
+
+		// a server without batch support rejects it: the requests are posted one by one
+		lime_tester::x3dhLoopbackServer->setBatchSupport(false);
+		posts = 0;
+		batches = 0;
+		manager->update(callback, lime_tester::OPkInitialBatchSize+OPkBatchSize+1, OPkBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_EQUAL(posts, 1+2*usersCount, int, "%d");
+		BC_ASSERT_EQUAL(batches, 1, int, "%d");
+		BC_ASSERT_EQUAL((int)lime_tester::x3dhLoopbackServer->OPkCount(curve, *deviceIds[0]), lime_tester::OPkInitialBatchSize-2+2*OPkBatchSize, int, "%d");
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		for (const auto &deviceId : deviceIds) {
+			manager->delete_user(*deviceId, callback);
+		}
+		expected_success += usersCount;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilename.data());
+	}
+}
+
+static void lime_X3DHBatch() {
+#ifdef EC25519_ENABLED
+	lime_X3DHBatch_test(lime::CurveId::c25519, "lime_X3DHBatch");
+#endif
+#ifdef EC448_ENABLED
+	lime_X3DHBatch_test(lime::CurveId::c448, "lime_X3DHBatch");
+#endif
+}
+
+/* test scenario:
+ * - create alice.d1, bob.d1 and bob.d2 on the loopback X3DH server
+ * - alice try_encrypt to bob.d1: no session yet, nothing is encrypted
+ * - alice encrypts to bob.d1 asynchronously, bob.d1 decrypts
+ * - alice try_encrypt to bob.d1: encrypted without posting to the X3DH server, bob.d1 decrypts
+ * - alice try_encrypt to bob.d1 and bob.d2: bob.d2 has no session, nothing is encrypted
+ */
+static void lime_tryEncrypt_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilename{dbBaseFilename};
+	dbFilename.append(".").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilename.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	// count the messages posted to the X3DH server
+	int posts = 0;
+	limeX3DHServerPostData X3DHServerPost_counting([&posts](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+		posts++;
+		X3DHServerPost(url, from, message, responseProcess);
+	});
+
+	try {
+		auto manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilename, X3DHServerPost_counting));
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		auto bobDevice2 = lime_tester::makeRandomDeviceName("bob.d2.");
+		manager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		manager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		manager->create_user(*bobDevice2, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+
+		// no session with bob.d1: it would need a key bundle from the X3DH server
+		posts = 0;
+		const std::vector<uint8_t> message{lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end()};
+		std::vector<RecipientData> recipients{};
+		recipients.emplace_back(*bobDevice1);
+		std::vector<uint8_t> cipherMessage{};
+		BC_ASSERT_FALSE(manager->try_encrypt(*aliceDevice1, "bob", recipients, message, cipherMessage));
+		BC_ASSERT_TRUE(recipients[0].DRmessage.empty());
+		BC_ASSERT_TRUE(cipherMessage.empty());
+		BC_ASSERT_EQUAL(posts, 0, int, "%d");
+
+		// fall back on the asynchronous encrypt to create the session
+		auto asyncRecipients = make_shared<std::vector<RecipientData>>();
+		asyncRecipients->emplace_back(*bobDevice1);
+		auto asyncCipherMessage = make_shared<std::vector<uint8_t>>();
+		manager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), asyncRecipients, make_shared<const std::vector<uint8_t>>(message), asyncCipherMessage, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(manager->decrypt(*bobDevice1, "bob", *aliceDevice1, (*asyncRecipients)[0].DRmessage, *asyncCipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(receivedMessage == message);
+
+		// the session exists: encrypt synchronously, for each policy
+		posts = 0;
+		for (const auto policy : {lime::EncryptionPolicy::optimizeUploadSize, lime::EncryptionPolicy::DRMessage, lime::EncryptionPolicy::cipherMessage}) {
+			const std::vector<uint8_t> syncMessage{lime_tester::messages_pattern[1].begin(), lime_tester::messages_pattern[1].end()};
+			std::vector<RecipientData> syncRecipients{};
+			syncRecipients.emplace_back(*bobDevice1);
+			std::vector<uint8_t> syncCipherMessage{};
+			BC_ASSERT_TRUE(manager->try_encrypt(*aliceDevice1, "bob", syncRecipients, syncMessage, syncCipherMessage, policy));
+			BC_ASSERT_FALSE(syncRecipients[0].DRmessage.empty());
+			BC_ASSERT_TRUE(syncRecipients[0].peerStatus != lime::PeerDeviceStatus::fail);
+			receivedMessage.clear();
+			BC_ASSERT_TRUE(manager->decrypt(*bobDevice1, "bob", *aliceDevice1, syncRecipients[0].DRmessage, syncCipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(receivedMessage == syncMessage);
+		}
+		BC_ASSERT_EQUAL(posts, 0, int, "%d");
+
+		// bob.d2 has no session: nothing is encrypted, not even for bob.d1
+		recipients.clear();
+		recipients.emplace_back(*bobDevice1);
+		recipients.emplace_back(*bobDevice2);
+		cipherMessage.clear();
+		BC_ASSERT_FALSE(manager->try_encrypt(*aliceDevice1, "bob", recipients, message, cipherMessage));
+		BC_ASSERT_TRUE(recipients[0].DRmessage.empty());
+		BC_ASSERT_TRUE(recipients[1].DRmessage.empty());
+		BC_ASSERT_EQUAL(posts, 0, int, "%d");
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		manager->delete_user(*aliceDevice1, callback);
+		manager->delete_user(*bobDevice1, callback);
+		manager->delete_user(*bobDevice2, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilename.data());
+	}
+}
+
+static void lime_tryEncrypt() {
+#ifdef EC25519_ENABLED
+	lime_tryEncrypt_test(lime::CurveId::c25519, "lime_tryEncrypt");
+#endif
+#ifdef EC448_ENABLED
+	lime_tryEncrypt_test(lime::CurveId::c448, "lime_tryEncrypt");
+#endif
+}
+
+/* test scenario:
+ * - create alice.d1 and bob.d1 on the loopback X3DH server
+ * - alice encrypts two messages to bob.d1, bob.d1 decrypts the first one
+ * - twice: alice forgets bob.d1 device and encrypts to it on a new session, bob.d1 decrypts, it now holds two stale sessions
+ * - bob.d1 decrypts the second message: only the stale session which already knows alice ratchet key is loaded from local storage
+ */
+static void lime_directSessionSelection_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+
+		// alice encrypts messages_pattern[i] to bob.d1
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> aliceRecipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> aliceCipherMessages{};
+		auto aliceEncrypt = [&](const size_t i) {
+			aliceRecipients.push_back(make_shared<std::vector<RecipientData>>());
+			aliceRecipients.back()->emplace_back(*bobDevice1);
+			aliceCipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto aliceMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), aliceRecipients.back(), aliceMessage, aliceCipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		};
+		// bob.d1 decrypts the message i
+		auto bobDecrypt = [&](const size_t i) {
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "bob", *aliceDevice1, (*aliceRecipients[i])[0].DRmessage, *aliceCipherMessages[i], receivedMessage) != lime::PeerDeviceStatus::fail);
+			std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+			BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[i]);
+		};
+
+		// two messages on the first session, bob.d1 receives only the first one
+		aliceEncrypt(0);
+		aliceEncrypt(1);
+		bobDecrypt(0);
+
+		// alice creates new sessions with bob.d1, the previous one is stale for bob.d1
+		for (size_t i=2; i<4; i++) {
+			aliceManager->delete_peerDevice(*bobDevice1);
+			aliceEncrypt(i);
+			bobDecrypt(i);
+		}
+		std::vector<long int> bobSessionsId{};
+		lime_tester::get_DRsessionsId(dbFilenameBob, *bobDevice1, *aliceDevice1, bobSessionsId);
+		BC_ASSERT_EQUAL((int)bobSessionsId.size(), 3, int, "%d");
+
+		// the second message: the active session in cache fails, then only the first session is loaded and decrypts it
+		bobManager->set_metricsEnabled(true);
+		bobDecrypt(1);
+		lime::Metrics metrics{};
+		bobManager->get_metrics(metrics);
+		BC_ASSERT_EQUAL((int)metrics.operation(lime::MetricsOperation::session_load).calls, 1, int, "%d");
+		BC_ASSERT_EQUAL((int)metrics.staleSessionDecrypts, 1, int, "%d");
+		bobManager->set_metricsEnabled(false);
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		aliceManager->delete_user(*aliceDevice1, callback);
+		bobManager->delete_user(*bobDevice1, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
+}
+
+static void lime_directSessionSelection() {
+#ifdef EC25519_ENABLED
+	lime_directSessionSelection_test(lime::CurveId::c25519, "lime_directSessionSelection");
+#endif
+#ifdef EC448_ENABLED
+	lime_directSessionSelection_test(lime::CurveId::c448, "lime_directSessionSelection");
+#endif
+}
+
+/* test scenario:
+ * - create alice.d1, alice.d2, alice.d3 and bob.d1 on the loopback X3DH server
+ * - each alice device encrypts to bob.d1: the three X3DH init messages refer to the same bob.d1 SPk
+ * - bob.d1 decrypts alice.d1 message, then its SPks are deleted from local storage
+ * - bob.d1 decrypts alice.d2 message, using the SPk held in cache
+ * - bob.d1 manager is reloaded: alice.d3 message cannot be decrypted anymore
+ */
+static void lime_SPkCache_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		std::vector<std::shared_ptr<std::string>> aliceDevices{};
+		for (size_t i=0; i<3; i++) {
+			aliceDevices.push_back(lime_tester::makeRandomDeviceName("alice.d."));
+			aliceManager->create_user(*aliceDevices.back(), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		}
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 4;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+
+		// each alice device encrypts messages_pattern[i] to bob.d1
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> aliceRecipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> aliceCipherMessages{};
+		for (size_t i=0; i<aliceDevices.size(); i++) {
+			aliceRecipients.push_back(make_shared<std::vector<RecipientData>>());
+			aliceRecipients.back()->emplace_back(*bobDevice1);
+			aliceCipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto aliceMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			aliceManager->encrypt(*aliceDevices[i], make_shared<const std::string>("bob"), aliceRecipients.back(), aliceMessage, aliceCipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		}
+		uint32_t SPkId = 0, messageSPkId = 0;
+		size_t SPkCount = 0;
+		BC_ASSERT_TRUE(lime_tester::get_SPks(dbFilenameBob, *bobDevice1, SPkCount, SPkId));
+		for (const auto &recipients : aliceRecipients) {
+			BC_ASSERT_TRUE(lime_tester::DR_message_extractX3DHInit_SPkId((*recipients)[0].DRmessage, messageSPkId));
+			BC_ASSERT_EQUAL(messageSPkId, SPkId, uint32_t, "%x");
 		}
 
-		// cleaning
-		recipients->clear();
-		message = nullptr;
-		cipherMessage->clear();
-		if (!continuousSession) { managersClean (aliceManager, bobManager, dbFilenameAlice, dbFilenameBob);}
+		// bob.d1 decrypts the first message: its SPk is read from local storage
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "bob", *aliceDevices[0], (*aliceRecipients[0])[0].DRmessage, *aliceCipherMessages[0], receivedMessage) != lime::PeerDeviceStatus::fail);
+		std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[0]);
 
-		// delete the users
-		if (cleanDatabase) {
-			aliceManager->delete_user(*aliceDevice1, callback);
-			bobManager->delete_user(*bobDevice1, callback);
-			bobManager->delete_user(*bobDevice2, callback);
-			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+3,lime_tester::wait_for_timeout));
-			remove(dbFilenameAlice.data());
-			remove(dbFilenameBob.data());
+		// the next one uses the cached SPk
+		lime_tester::delete_SPks(dbFilenameBob, *bobDevice1);
+		BC_ASSERT_FALSE(lime_tester::get_SPks(dbFilenameBob, *bobDevice1, SPkCount, SPkId));
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "bob", *aliceDevices[1], (*aliceRecipients[1])[0].DRmessage, *aliceCipherMessages[1], receivedMessage) != lime::PeerDeviceStatus::fail);
+		receivedMessageString = std::string{receivedMessage.begin(), receivedMessage.end()};
+		BC_ASSERT_TRUE(receivedMessageString == lime_tester::messages_pattern[1]);
+
+		// without the cache, the SPk is not found
+		bobManager = nullptr;
+		bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "bob", *aliceDevices[2], (*aliceRecipients[2])[0].DRmessage, *aliceCipherMessages[2], receivedMessage) == lime::PeerDeviceStatus::fail);
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		for (const auto &aliceDevice : aliceDevices) {
+			aliceManager->delete_user(*aliceDevice, callback);
 		}
+		bobManager->delete_user(*bobDevice1, callback);
+		expected_success += 4;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
 }
 
-static void x3dh_user_not_found(void) {
+static void lime_SPkCache() {
 #ifdef EC25519_ENABLED
-	x3dh_user_not_found_test(lime::CurveId::c25519, "lime_x3dh_user_not_found", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
-	x3dh_user_not_found_test(lime::CurveId::c25519, "lime_x3dh_user_not_found", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data(), false);
+	lime_SPkCache_test(lime::CurveId::c25519, "lime_SPkCache");
 #endif
 #ifdef EC448_ENABLED
-	x3dh_user_not_found_test(lime::CurveId::c448, "lime_x3dh_user_not_found", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
-	x3dh_user_not_found_test(lime::CurveId::c448, "lime_x3dh_user_not_found", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data(), false);
+	lime_SPkCache_test(lime::CurveId::c448, "lime_SPkCache");
 #endif
 }
 
 /**
- * NOTE: this test uses low level user management functions which are not available to lib user which have access to
- * LimeManager functions only. Do not consider this test code as an example as it is not the way users shall
- * be managed by library end users.
- *
- * - Create alice using LimeManager
- * - Load alice directly using load_limeUser (it's for test only, this is not really available to lib user)
- * - Fail at creating alice again in the same DB
- * - Fail at loading an unknown user
- * - Delete Alice through LimeManager
- * - Fail at deleting an unknown user
- * - Create Alice again
- * - using an other DB, create alice, success on local Storage but shall get a callback error
- * - clean DB by deleting alice
- *
+ * Interactive operations precedence over the background ones
+ * - a background operation yielding while no interactive operation is in progress does not wait
+ * - it waits for the interactive operation in progress to complete, but not longer than its deadline
+ * - alice decrypts messages from bob while an update generates and stores a large batch of OPks by chunks:
+ *   all messages are decrypted and all the OPks stored
  */
-static void user_management_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url ) {
-
+static void lime_workLanes_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
 	std::string dbFilenameAlice{dbBaseFilename};
 	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
 	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
 
 	lime_tester::events_counters_t counters={};
 	int expected_success=0;
@@ -3290,719 +7520,1138 @@ static void user_management_test(const lime::CurveId curve, const std::string &d
 						counters.operation_success++;
 					} else {
 						counters.operation_failed++;
-						LIME_LOGI <<"Insert Lime user failed : "<< anythingToSay.data() ;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
 					}
 				});
-	// we need a LimeManager
-	auto Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
-	auto aliceDeviceName = lime_tester::makeRandomDeviceName("alice.");
-
-	// a mutex to feed internal functions
-	auto m_mutex = std::make_shared<std::recursive_mutex>();
 
 	try {
-		/*Check if Alice exists in the database */
-		BC_ASSERT_FALSE(Manager->is_user(*aliceDeviceName));
-
-		/* create a user in a fresh database */
-		Manager->create_user(*aliceDeviceName, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		if (counters.operation_failed == 1) return; // skip the end of the test if we can't do this
-
-		/*Check if Alice exists in the database */
-		BC_ASSERT_TRUE(Manager->is_user(*aliceDeviceName));
+		// nothing in progress: do not wait
+		lime::WorkLanes lanes{};
+		BC_ASSERT_FALSE(lanes.interactive_pending());
+		BC_ASSERT_FALSE(lanes.yield());
+
+		// wait for the interactive operation in progress
+		std::atomic<bool> interactiveDone{false};
+		std::atomic<bool> interactiveStarted{false};
+		std::thread interactive([&lanes, &interactiveDone, &interactiveStarted]() {
+			lime::InteractiveLane lane(lanes);
+			interactiveStarted = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds{20});
+			interactiveDone = true;
+		});
+		while (!interactiveStarted) std::this_thread::yield();
+		BC_ASSERT_TRUE(lanes.yield(std::chrono::steady_clock::now() + std::chrono::seconds{10}));
+		BC_ASSERT_TRUE(interactiveDone);
+		interactive.join();
+		BC_ASSERT_FALSE(lanes.interactive_pending());
+
+		// but not after the deadline
+		{
+			lime::InteractiveLane lane(lanes);
+			const auto start = std::chrono::steady_clock::now();
+			BC_ASSERT_TRUE(lanes.yield(start + std::chrono::milliseconds{10}));
+			BC_ASSERT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds{5});
+		}
 
-		/* load alice from from DB */
-		auto alice = load_LimeUser(dbFilenameAlice, *aliceDeviceName, X3DHServerPost, m_mutex);
-		/* no need to wait here, it shall load alice immediately */
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		// Get alice x3dh server url
-		BC_ASSERT_TRUE(Manager->get_x3dhServerUrl(*aliceDeviceName) == x3dh_server_url);
+		// bob encrypts some messages to alice, the first one uses one of alice OPks
+		constexpr size_t messagesCount = 10;
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> bobRecipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> bobCipherMessages{};
+		for (size_t i=0; i<messagesCount; i++) {
+			bobRecipients.push_back(make_shared<std::vector<RecipientData>>());
+			bobRecipients.back()->emplace_back(*aliceDevice1);
+			bobCipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto bobMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			bobManager->encrypt(*bobDevice1, make_shared<const std::string>("alice"), bobRecipients.back(), bobMessage, bobCipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		}
 
-		// Set the X3DH URL server to something else and check it worked
-		Manager->set_x3dhServerUrl(*aliceDeviceName, "https://testing.testing:12345");
-		BC_ASSERT_TRUE(Manager->get_x3dhServerUrl(*aliceDeviceName) == "https://testing.testing:12345");
-		// Force a reload of data from local storage just to be sure the modification was perform correctly
-		Manager = nullptr;
-		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
-		BC_ASSERT_TRUE(Manager->is_user(*aliceDeviceName)); // Check again just after LimeManager reload that Alice is in local storage
-		BC_ASSERT_TRUE(Manager->get_x3dhServerUrl(*aliceDeviceName) == "https://testing.testing:12345");
-		// Set it back to the regular one to be able to complete the test
-		Manager->set_x3dhServerUrl(*aliceDeviceName, x3dh_server_url);
+		// alice decrypts them while an update stores several chunks of OPks
+		const uint16_t OPkBatchSize = static_cast<uint16_t>(4*lime::settings::OPk_storageBatchSize + 1);
+		int decrypted = 0;
+		std::thread decryptor([&]() {
+			for (size_t i=0; i<messagesCount; i++) {
+				std::vector<uint8_t> receivedMessage{};
+				if (aliceManager->decrypt(*aliceDevice1, "alice", *bobDevice1, (*bobRecipients[i])[0].DRmessage, *bobCipherMessages[i], receivedMessage) != lime::PeerDeviceStatus::fail
+					&& std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[i]) {
+					decrypted++;
+				}
+			}
+		});
+		aliceManager->update(callback, OPkBatchSize, OPkBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		decryptor.join();
+		BC_ASSERT_EQUAL(decrypted, (int)messagesCount, int, "%d");
+		// the dispatched OPk is kept in limbo
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDevice1), lime_tester::OPkInitialBatchSize + OPkBatchSize, int, "%d");
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		aliceManager->delete_user(*aliceDevice1, callback);
+		bobManager->delete_user(*bobDevice1, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
 
-	bool gotExpectedException = false;
-	/* Try to create the same user in the same data base, it must fail with exception raised */
-	try {
-		auto alice = insert_LimeUser(dbFilenameAlice, *aliceDeviceName, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, X3DHServerPost, callback, m_mutex);
-		/* no need to wait here, it must fail immediately */
-	} catch (BctbxException &) {
-		gotExpectedException = true;
-	}
-	if (!gotExpectedException) {
-		// we didn't got any exception on trying to insert alice again in DB
-		BC_FAIL("Insert twice the same userID in a DB without getting any exception");
-		return;
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
 	}
+}
 
-	/* Try to load a user which is not in DB, it must fail with exception raised */
-	gotExpectedException = false;
-	try {
-		auto alice = load_LimeUser(dbFilenameAlice, "bob", X3DHServerPost, m_mutex);
-		/* no need to wait here, it must fail immediately */
-	} catch (BctbxException &) {
-		gotExpectedException = true;
-	}
-	if (!gotExpectedException) {
-		// we didn't got any exception on trying to load bob from DB
-		BC_FAIL("No exception arised when loading inexistent user from DB");
-		return;
-	}
+static void lime_workLanes() {
+#ifdef EC25519_ENABLED
+	lime_workLanes_test(lime::CurveId::c25519, "lime_workLanes");
+#endif
+#ifdef EC448_ENABLED
+	lime_workLanes_test(lime::CurveId::c448, "lime_workLanes");
+#endif
+}
 
-	/* Delete users from base */
-	try {
-		// delete Alice, wait for callback confirmation from x3dh server
-		Manager->delete_user(*aliceDeviceName, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-	} catch (BctbxException &e) {
-		LIME_LOGE <<e;
-		BC_FAIL("Delete Lime user raised exception");
-		return;
-	}
-	gotExpectedException = false;
-	auto savedCounters = counters;
-	try {
-		// delete bob which is not there, it shall raise an exception and never get to the callback
-		Manager->delete_user("bob", callback);
-	} catch (BctbxException &) {
-		gotExpectedException = true;
-	}
-	if (!gotExpectedException) {
-		// we didn't got any exception on trying to delete bob from DB while he isn't theee
-		BC_FAIL("No exception arised when deleting inexistent user from DB");
-		return;
-	}
-	BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_failed,savedCounters.operation_failed+1,lime_tester::wait_for_timeout/2)); // give we few seconds to possible call to the callback(it shall not occurs
-	// check we didn't land into callback as any call to it will modify the counters
-	BC_ASSERT_TRUE(counters == savedCounters);
+/**
+ * Write-behind sessions persistence
+ * - alice and bob queue their sessions updates, messages are exchanged in order and out of order
+ * - once flushed, and after the managers are reloaded: the sessions state is the one of the last message, a replayed message is rejected
+ * - the updates queued when the managers are destroyed are committed too
+ * - a decrypt batch failing partway is rolled back without leaving any of its sessions updates queued
+ */
+static void lime_writeBehind_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
 
-	/* Create Alice again */
-	try {
-		std::shared_ptr<LimeGeneric> alice = insert_LimeUser(dbFilenameAlice, *aliceDeviceName, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, X3DHServerPost, callback, m_mutex);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
 
-		// create another manager with a fresh DB
-		std::string dbFilenameAliceTmp{dbFilenameAlice};
-		dbFilenameAliceTmp.append(".tmp.sqlite3");
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
 
-		// create a manager and try to create alice again, it shall pass local creation(db is empty) but server shall reject it
-		auto ManagerTmp = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAliceTmp, X3DHServerPost));
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
 
-		ManagerTmp->create_user(*aliceDeviceName, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,counters.operation_failed+1,lime_tester::wait_for_timeout)); // wait on this one but we shall get a fail from server
+	try {
+		lime::StorageOptions options{};
+		options.writeBehindDepth = 16;
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, options));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost, options));
+		BC_ASSERT_EQUAL(aliceManager->get_storageOptions().writeBehindDepth, 16, int, "%d");
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		/* Clean DB */
-		if (cleanDatabase) {
-			// delete Alice, wait for callback confirmation from server
-			Manager->delete_user(*aliceDeviceName, callback);
+		// encrypt messages_pattern[pattern] from a device to another one
+		auto encrypt = [&](LimeManager &manager, const std::string &sender, const std::string &recipient, const size_t pattern, std::vector<uint8_t> &DRmessage, std::vector<uint8_t> &cipherMessage) {
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(recipient);
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[pattern].begin(), lime_tester::messages_pattern[pattern].end());
+			auto cipher = make_shared<std::vector<uint8_t>>();
+			manager.encrypt(sender, make_shared<const std::string>("group"), recipients, message, cipher, callback);
 			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-			remove(dbFilenameAlice.data()); // delete the database file
-			remove(dbFilenameAliceTmp.data()); // delete the database file
+			DRmessage = (*recipients)[0].DRmessage;
+			cipherMessage = *cipher;
+		};
+		auto decrypt = [](LimeManager &manager, const std::string &recipient, const std::string &sender, const size_t pattern, const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage) {
+			std::vector<uint8_t> receivedMessage{};
+			return manager.decrypt(recipient, "group", sender, DRmessage, cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail
+				&& std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[pattern];
+		};
+
+		// session creation, the reply updates are queued
+		std::vector<uint8_t> DRmessage{};
+		std::vector<uint8_t> cipherMessage{};
+		encrypt(*bobManager, *bobDevice1, *aliceDevice1, 0, DRmessage, cipherMessage);
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, 0, DRmessage, cipherMessage));
+		encrypt(*aliceManager, *aliceDevice1, *bobDevice1, 1, DRmessage, cipherMessage);
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDevice1, *aliceDevice1, 1, DRmessage, cipherMessage));
+
+		// out of order messages store and consume skipped message keys, they are saved at once after the queued updates
+		std::vector<std::vector<uint8_t>> DRmessages(3);
+		std::vector<std::vector<uint8_t>> cipherMessages(3);
+		for (size_t i=0; i<3; i++) {
+			encrypt(*bobManager, *bobDevice1, *aliceDevice1, 2+i, DRmessages[i], cipherMessages[i]);
+		}
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, 4, DRmessages[2], cipherMessages[2]));
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, 2, DRmessages[0], cipherMessages[0]));
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, 3, DRmessages[1], cipherMessages[1]));
+
+		// in order messages, more than the queue depth on each side
+		for (size_t i=0; i<20; i++) {
+			encrypt(*aliceManager, *aliceDevice1, *bobDevice1, i%10, DRmessage, cipherMessage);
+			BC_ASSERT_TRUE(decrypt(*bobManager, *bobDevice1, *aliceDevice1, i%10, DRmessage, cipherMessage));
+			encrypt(*bobManager, *bobDevice1, *aliceDevice1, (i+1)%10, DRmessage, cipherMessage);
+			BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, (i+1)%10, DRmessage, cipherMessage));
+		}
+		aliceManager->flush();
+		bobManager->flush();
+
+		// reload: the last decrypted message is rejected, the sessions go on
+		aliceManager = nullptr;
+		bobManager = nullptr;
+		aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, options));
+		bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost, options));
+		BC_ASSERT_FALSE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, 0, DRmessage, cipherMessage));
+		encrypt(*aliceManager, *aliceDevice1, *bobDevice1, 5, DRmessage, cipherMessage);
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDevice1, *aliceDevice1, 5, DRmessage, cipherMessage));
+		encrypt(*bobManager, *bobDevice1, *aliceDevice1, 6, DRmessage, cipherMessage);
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, 6, DRmessage, cipherMessage));
+
+		// no flush: the managers destruction commits the queued updates
+		aliceManager = nullptr;
+		bobManager = nullptr;
+		aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, options));
+		bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost, options));
+		BC_ASSERT_FALSE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, 6, DRmessage, cipherMessage));
+		encrypt(*bobManager, *bobDevice1, *aliceDevice1, 7, DRmessage, cipherMessage);
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDevice1, *bobDevice1, 7, DRmessage, cipherMessage));
+		encrypt(*aliceManager, *aliceDevice1, *bobDevice1, 8, DRmessage, cipherMessage);
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDevice1, *aliceDevice1, 8, DRmessage, cipherMessage));
+
+		// a batch failing in local storage is rolled back: the updates of the sessions it decrypted with were not queued meanwhile
+		auto aliceDevice2 = lime_tester::makeRandomDeviceName("alice.d2.");
+		aliceManager->create_user(*aliceDevice2, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		std::vector<DecryptionData> batch{};
+		encrypt(*aliceManager, *aliceDevice1, *bobDevice1, 9, DRmessage, cipherMessage); // in order on the established session: would be queued
+		batch.emplace_back("group", *aliceDevice1, DRmessage, cipherMessage);
+		encrypt(*aliceManager, *aliceDevice2, *bobDevice1, 0, DRmessage, cipherMessage); // opens a new session
+		batch.emplace_back("group", *aliceDevice2, DRmessage, cipherMessage);
+		lime_tester::inject_storageFailure(dbFilenameBob, "DR_sessions"); // the new session cannot be saved
+		bool batchFailed = false;
+		try {
+			bobManager->decrypt_batch(*bobDevice1, batch);
+		} catch (std::exception const &) {
+			batchFailed = true;
 		}
+		BC_ASSERT_TRUE(batchFailed);
+		lime_tester::clear_storageFailure(dbFilenameBob);
+		// the manager destruction commits the queued updates: none comes from the batch, so both messages decrypt again
+		bobManager = nullptr;
+		bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost, options));
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDevice1, *aliceDevice1, 9, batch[0].DRmessage, batch[0].cipherMessage));
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDevice1, *aliceDevice2, 0, batch[1].DRmessage, batch[1].cipherMessage));
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		aliceManager->delete_user(*aliceDevice1, callback);
+		aliceManager->delete_user(*aliceDevice2, callback);
+		bobManager->delete_user(*bobDevice1, callback);
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
-}
-
-static void user_management(void) {
-#ifdef EC25519_ENABLED
-	user_management_test(lime::CurveId::c25519, "lime_user_management", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
-#endif
-#ifdef EC448_ENABLED
-	user_management_test(lime::CurveId::c448, "lime_user_management", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
-#endif
-}
 
-/**
- * Scenario:
- *  - Create a user in local DB but do not send any message to the X3DH server
- *  - Check the user is there and inactive then delete it from local only
- *  - Create the same user with different keys on both local and server to check server didn't get it in the first place
- *  - Clean DBs (local and remote)
- *  - Repeat the previous 3 steps but let the message reach the server this time. At the second creation we shall get a fail from server as we are creating again a user but with different keys
- *  - Clean DBs (local and remote)
- *  - Create a local user but do not send anything to the server
- *  - Create it again letting the message go, it shall be a success
- *  - Clean DBs (local and remote)
- *  - Create a user but discard the response from server (so it is stored as inactive)
- *  - Create it again with normal connectivity, server is happy as we get the same Ik and SPk, user is activated on local base
- */
-static void user_registration_failure_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url ) {
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
+}
+
+static void lime_writeBehind() {
+#ifdef EC25519_ENABLED
+	lime_writeBehind_test(lime::CurveId::c25519, "lime_writeBehind");
+#endif
+#ifdef EC448_ENABLED
+	lime_writeBehind_test(lime::CurveId::c448, "lime_writeBehind");
+#endif
+}
 
+/**
+ * Key pair pool
+ * - a pool is filled in background up to its depth, the key pairs drawn from it are all different and usable
+ * - an empty or disabled pool still gives key pairs
+ * - alice and bob managers using a pool exchange messages, each reply performs a DR ratchet step
+ */
+template <typename Curve>
+static void lime_keyPairPool_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
 	std::string dbFilenameAlice{dbBaseFilename};
 	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
 	remove(dbFilenameAlice.data()); // delete the database file if already exists
-	auto alice_db_mutex = make_shared<std::recursive_mutex>();
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
 
 	lime_tester::events_counters_t counters={};
 	int expected_success=0;
-	int expected_failed=0;
-	// reset the global setting for Http Link
-	httpLink = HttpLinkStatus::ok;
 
 	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
 					if (returnCode == lime::CallbackReturn::success) {
 						counters.operation_success++;
 					} else {
 						counters.operation_failed++;
-						LIME_LOGI <<"Insert Lime user failed : "<< anythingToSay.data() ;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
 					}
 				});
-	// we need a LimeManager
-	auto Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation));
-	auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
-
-	try {
-		/* create a user in a fresh database but discard the message to server */
-		httpLink = HttpLinkStatus::sending_fail;
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
-		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
-		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
-	} catch (BctbxException &e) {
-		LIME_LOGE << e;
-		BC_FAIL("");
-	}
-
-	bool gotExpectedException = false;
-	long int Uid=0;
-	try {
-		/* now we have the user in local base but not active and not in remote, lets check that */
-		/* load alice from DB(using insider functions) : user is not active, we shall get an exception */
-		auto localStorage = std::unique_ptr<lime::Db>(new lime::Db(dbFilenameAlice, alice_db_mutex));
-		auto curve = CurveId::unset;
-		std::string x3dh_server_url;
-
-		localStorage->load_LimeUser(*aliceDeviceId, Uid, curve, x3dh_server_url); // this one will throw an exception if user is not found, just let it rise
-	} catch (BctbxException &) {
-		gotExpectedException = true;
-	}
-	BC_ASSERT(Uid == -1); // when user is not active, the db::load_LimeUser set the Uid to -1 before generating the exception
-	BC_ASSERT(gotExpectedException == true);
 
 	try {
-		// Delete local user from base and create it letting it flow to the server
-		httpLink = HttpLinkStatus::sending_fail; // make sure our delete never reach the server
-		Manager->delete_user(*aliceDeviceId, callback);
-		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
-		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
-		BC_ASSERT_TRUE(counters.operation_failed == expected_failed);
-		httpLink = HttpLinkStatus::ok; // restore htpp link
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback); // This one has different keys but the same user Id
-		// if this userId was already registered on server(with the old Ik) we would have an error
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-		// and delete it again
-		Manager->delete_user(*aliceDeviceId, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-
+		auto RNG_context = make_RNG();
+		{
+			lime::KeyPairPool<Curve> pool{};
+			constexpr size_t depth = 8;
+			pool.set_depth(depth);
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+			while (pool.size() < depth && std::chrono::steady_clock::now() < deadline) {
+				std::this_thread::sleep_for(std::chrono::milliseconds{1});
+			}
+			BC_ASSERT_EQUAL((int)pool.size(), (int)depth, int, "%d");
+
+			// drawn key pairs are different and match: DH(a, B) == DH(b, A)
+			Xpair<Curve> a{}, b{};
+			pool.draw(a, *RNG_context);
+			pool.draw(b, *RNG_context);
+			BC_ASSERT_TRUE(a.cpublicKey() != b.cpublicKey());
+			X<Curve, lime::Xtype::sharedSecret> ab{}, ba{};
+			X_computeSharedSecret<Curve>(a.cprivateKey(), b.cpublicKey(), ab);
+			X_computeSharedSecret<Curve>(b.cprivateKey(), a.cpublicKey(), ba);
+			BC_ASSERT_TRUE(ab == ba);
+			BC_ASSERT_TRUE(pool.size() <= depth - 2);
+
+			// an empty pool generates the key pairs inline
+			for (size_t i=0; i<2*depth; i++) {
+				pool.draw(a, *RNG_context);
+			}
+			pool.draw(b, *RNG_context);
+			BC_ASSERT_TRUE(a.cpublicKey() != b.cpublicKey());
+
+			// disabled: the pool is emptied and still gives key pairs
+			pool.set_depth(0);
+			BC_ASSERT_EQUAL((int)pool.size(), 0, int, "%d");
+			pool.draw(a, *RNG_context);
+			BC_ASSERT_TRUE(a.cpublicKey() != b.cpublicKey());
+		}
 
-		// Start again but this time let the message flow to the server, just block the answer
-		httpLink = HttpLinkStatus::reception_fail;
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
-		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
-		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		aliceManager->set_keyPairPoolDepth(4);
+		bobManager->set_keyPairPoolDepth(4);
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		// Now we have the user inactive in local but set on server. Delete the local one
-		httpLink = HttpLinkStatus::sending_fail; // make sure our delete never reach the server
-		Manager->delete_user(*aliceDeviceId, callback);
-		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
-		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
-		httpLink = HttpLinkStatus::ok; // restore htpp link
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback); // This one has different keys but the same user Id
-		// this userId is already registered on server(with the old Ik) we shall have an error -> the error is deleted from local base
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed,++expected_failed,lime_tester::wait_for_timeout));
-		// Now the user is on the server but no more in local, to delete it from server, we must create it in local only and then delete
-		httpLink = HttpLinkStatus::sending_fail; // make sure our delete never reach the server
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
-		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
-		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
-		httpLink = HttpLinkStatus::ok; // restore htpp link
-		Manager->delete_user(*aliceDeviceId, callback); // delete from local and remote
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		// more replies than the pools depth: they are drawn from the pool and from inline generation
+		for (size_t i=0; i<10; i++) {
+			const bool fromBob = (i%2 == 0);
+			auto &sender = fromBob?bobManager:aliceManager;
+			auto &receiver = fromBob?aliceManager:bobManager;
+			const auto &senderDevice = fromBob?bobDevice1:aliceDevice1;
+			const auto &receiverDevice = fromBob?aliceDevice1:bobDevice1;
 
-		// Create again on local only, and then call the create_user again with the same id, with restored connectivity to get an active user
-		httpLink = HttpLinkStatus::sending_fail; // make sure our delete never reach the server
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
-		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
-		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
-		// create one more time, it shall this time publish on the server without error
-		httpLink = HttpLinkStatus::ok; // restore htpp link
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(*receiverDevice);
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			sender->encrypt(*senderDevice, make_shared<const std::string>("group"), recipients, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
 
-		// Clean
-		Manager->delete_user(*aliceDeviceId, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(receiver->decrypt(*receiverDevice, "group", *senderDevice, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[i]);
+		}
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
 
-		// Same than previous but this time we block the server answer and then call again create
-		httpLink = HttpLinkStatus::reception_fail; // make sure our delete never reach the server
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_FALSE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success+1,lime_tester::wait_for_timeout));
-		BC_ASSERT_TRUE(counters.operation_failed == expected_failed); // We shall have no failure either, the server never answer so the callback is never called (in a real situation the timeout on answer may be forwarded to the lime engine)
-		Manager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost_Failing_Simulation)); // reload manager from db after the timeout
-		// create one more time, it shall this time publish on the server without error
-		httpLink = HttpLinkStatus::ok; // restore htpp link
-		Manager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		// disabling the pools does not disturb the sessions
+		aliceManager->set_keyPairPoolDepth(0);
+		auto recipients = make_shared<std::vector<RecipientData>>();
+		recipients->emplace_back(*bobDevice1);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		auto cipherMessage = make_shared<std::vector<uint8_t>>();
+		aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("group"), recipients, message, cipherMessage, callback);
 		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "group", *aliceDevice1, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
 
+		aliceManager->delete_user(*aliceDevice1, callback);
+		bobManager->delete_user(*bobDevice1, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
 
-	try {
-		if (cleanDatabase) {
-			// delete Alice, wait for callback confirmation from server
-			httpLink = HttpLinkStatus::ok; // restore http link functionality
-			Manager->delete_user(*aliceDeviceId, callback);
-			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-			remove(dbFilenameAlice.data()); // delete the database file
-		}
-	} catch (BctbxException &e) {
-		LIME_LOGE << e;
-		BC_FAIL("");
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
 	}
 }
 
-static void user_registration_failure(void) {
+static void lime_keyPairPool() {
 #ifdef EC25519_ENABLED
-	user_registration_failure_test(lime::CurveId::c25519, "lime_user_management", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+	lime_keyPairPool_test<C255>(lime::CurveId::c25519, "lime_keyPairPool");
 #endif
 #ifdef EC448_ENABLED
-	user_registration_failure_test(lime::CurveId::c448, "lime_user_management", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+	lime_keyPairPool_test<C448>(lime::CurveId::c448, "lime_keyPairPool");
 #endif
 }
 
-// For multithread test : a mailbox system to post and fetch messages
-struct mth_message {
-	std::vector<uint8_t> DRmessage;
-	std::vector<uint8_t> cipherMessage;
-	std::string plainMessage; // to check after decryption if we're good
-	std::string senderId;
-
-	mth_message() {};
-	mth_message(const std::vector<uint8_t> &DRmessage, const std::vector<uint8_t> &cipherMessage, const std::string &plainMessage, const std::string senderId) :
-		DRmessage{DRmessage}, cipherMessage{cipherMessage}, plainMessage{plainMessage}, senderId{senderId} {};
-};
-
-struct mth_mailbox {
-	std::mutex b_mutex;
-	std::deque<mth_message> box;
-	std::string owner;
-	const int expectedMessageCount; // set at creation, expected message number to transit
-	int messageCount; // number of message fetched
-
-	bool fetch(mth_message &m) {
-		std::lock_guard<std::mutex> lock(b_mutex);
-		if (box.size()>0) {
-			m = box.back();
-			box.pop_back();
-			messageCount++;
-			return true;
-		}
-		return false;
-	}
-
-	void post(mth_message m) {
-		std::lock_guard<std::mutex> lock(b_mutex);
-		box.push_front(m);
-	}
-
-	bool done() { // return true if we already processed the expected number of messages
-		std::lock_guard<std::mutex> lock(b_mutex);
-		return (messageCount>=expectedMessageCount);
-	}
-
-	mth_mailbox(std::string &owner, int expectedMessageCount) : owner{owner}, expectedMessageCount{expectedMessageCount}, messageCount{0} {}
-};
-
-
-struct manager_thread_arg {
-	std::shared_ptr<LimeManager> manager;
-	size_t userIndex; // index of self user in the user lists
-	std::array<std::string,4> userlist; // list of all users
-	std::string x3dh_server_url;
-	lime::CurveId curve;
-	std::shared_ptr<std::recursive_mutex> belle_sip_mutex; // A mutex to manage belle_sip http stack access
-	std::shared_ptr<std::map<std::string, std::shared_ptr<mth_mailbox>>> mailbox; // mailbox system to post and fetch messages
-
-	manager_thread_arg(std::shared_ptr<LimeManager> manager, const uint8_t userIndex, const std::array<std::string, 4> &userlist, const std::string &x3dh_server_url, const lime::CurveId curve, std::shared_ptr<std::recursive_mutex> belle_sip_mutex, std::shared_ptr<std::map<std::string, std::shared_ptr<mth_mailbox>>> mailbox)
-		: manager{manager}, userIndex{userIndex}, userlist(userlist),
-		x3dh_server_url{x3dh_server_url}, curve{curve}, belle_sip_mutex{belle_sip_mutex},
-		mailbox(mailbox)	{};
-};
+/**
+ * Storage usage and compaction
+ * - alice receives out of order messages from bob: her sessions, skipped keys, SPk and OPks are reported
+ * - users with a lot of OPks are created and deleted: the free pages are reported and given back by compaction
+ * - a database created before the incremental compaction mode is compacted only once converted
+ */
+static void lime_storageCompaction_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
-static constexpr size_t test_multithread_message_number = 10;
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
 
-static void lime_multithread_decrypt_thread(manager_thread_arg thread_arg) {
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
 
-	auto pool = belle_sip_object_pool_push();
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
 
-	// RNG uniform between 0 and 400 ms
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(0, 400);
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
 
 	try {
-		auto localDeviceId = thread_arg.userlist[thread_arg.userIndex];
-		auto box = thread_arg.mailbox->find(localDeviceId)->second;
+		// bob database was created by an older version: it holds tables before we set the incremental mode
+		lime_tester::create_legacyDatabase(dbFilenameBob);
 
-		// loop on all patterns available
-		while (box->done() == false) {
-			// wait for a random period betwwen 0 and 400 ms
-			std::this_thread::sleep_for(std::chrono::milliseconds(dis(gen)));
-			// Fetch mailbox
-			mth_message m{};
-			int fetchMax = 1+dis(gen)/200;
-			int fetched=0;
-			while (box->fetch(m) && fetched<fetchMax) {
-				std::vector<uint8_t> receivedMessage{};
-				BC_ASSERT_TRUE(thread_arg.manager->decrypt(localDeviceId, "friends", m.senderId, m.DRmessage, m.cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
-				std::string receivedMessageString{receivedMessage.begin(), receivedMessage.end()};
-				BC_ASSERT_TRUE(receivedMessageString == m.plainMessage);
-				fetched++;
-			}
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		// bob encrypts some messages, alice decrypts the last one first
+		constexpr size_t messagesCount = 10;
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> recipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> cipherMessages{};
+		for (size_t i=0; i<messagesCount; i++) {
+			recipients.push_back(make_shared<std::vector<RecipientData>>());
+			recipients.back()->emplace_back(*aliceDevice1);
+			cipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			bobManager->encrypt(*bobDevice1, make_shared<const std::string>("alice"), recipients.back(), message, cipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
 		}
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDevice1, "alice", *bobDevice1, (*recipients.back())[0].DRmessage, *cipherMessages.back(), receivedMessage) != lime::PeerDeviceStatus::fail);
+
+		lime::StorageUsage usage{};
+		aliceManager->get_storageUsage(usage);
+		BC_ASSERT_TRUE(usage.incrementalCompaction);
+		BC_ASSERT_TRUE(usage.fileSize > 0);
+		BC_ASSERT_TRUE(usage.fileSize >= usage.freeSize);
+		BC_ASSERT_EQUAL((int)usage.users.size(), 1, int, "%d");
+		if (usage.users.size() == 1) {
+			const auto &user = usage.users[0];
+			BC_ASSERT_TRUE(user.deviceId == *aliceDevice1);
+			BC_ASSERT_EQUAL((int)user.table(lime::StorageTable::DRSessions).rows, 1, int, "%d");
+			BC_ASSERT_TRUE(user.table(lime::StorageTable::DRSessions).bytes > 0);
+			BC_ASSERT_EQUAL((int)user.table(lime::StorageTable::DRSkippedChains).rows, 1, int, "%d");
+			BC_ASSERT_TRUE(user.table(lime::StorageTable::DRSkippedKeys).rows > 0);
+			BC_ASSERT_TRUE(user.table(lime::StorageTable::DRSkippedKeys).bytes > 0);
+			BC_ASSERT_EQUAL((int)user.table(lime::StorageTable::SPk).rows, 1, int, "%d");
+			BC_ASSERT_EQUAL((int)user.table(lime::StorageTable::OPk).rows, (int)lime_tester::get_OPks(dbFilenameAlice, *aliceDevice1), int, "%d");
+		}
+
+		// the skipped keys are consumed
+		for (size_t i=0; i<messagesCount-1; i++) {
+			BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDevice1, "alice", *bobDevice1, (*recipients[i])[0].DRmessage, *cipherMessages[i], receivedMessage) != lime::PeerDeviceStatus::fail);
+		}
+		aliceManager->get_storageUsage(usage);
+		BC_ASSERT_EQUAL((int)usage.users[0].table(lime::StorageTable::DRSkippedKeys).rows, 0, int, "%d");
+
+		// create and delete users holding a lot of OPks: their pages are free and given back by compaction
+		std::vector<std::shared_ptr<std::string>> tmpDevices{};
+		for (size_t i=0; i<4; i++) {
+			tmpDevices.push_back(lime_tester::makeRandomDeviceName("tmp."));
+			aliceManager->create_user(*(tmpDevices.back()), x3dh_server_url, curve, 200, callback);
+		}
+		expected_success += static_cast<int>(tmpDevices.size());
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		for (const auto &device : tmpDevices) {
+			aliceManager->delete_user(*device, callback);
+		}
+		expected_success += static_cast<int>(tmpDevices.size());
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		aliceManager->get_storageUsage(usage);
+		BC_ASSERT_EQUAL((int)usage.users.size(), 1, int, "%d");
+		BC_ASSERT_TRUE(usage.freeSize > 0);
+		const auto bloatedSize = usage.fileSize;
+
+		BC_ASSERT_TRUE(aliceManager->compact(std::chrono::milliseconds{10000}));
+		aliceManager->get_storageUsage(usage);
+		BC_ASSERT_EQUAL((int)usage.freeSize, 0, int, "%d");
+		BC_ASSERT_TRUE(usage.fileSize < bloatedSize);
+
+		// bob database must be converted first
+		bobManager->get_storageUsage(usage);
+		BC_ASSERT_FALSE(usage.incrementalCompaction);
+		BC_ASSERT_FALSE(bobManager->compact(std::chrono::milliseconds{1000}));
+		BC_ASSERT_TRUE(bobManager->compact(std::chrono::milliseconds{1000}, true));
+		bobManager->get_storageUsage(usage);
+		BC_ASSERT_TRUE(usage.incrementalCompaction);
+		BC_ASSERT_EQUAL((int)usage.freeSize, 0, int, "%d");
+
+		// the sessions work as before the compaction
+		recipients[0] = make_shared<std::vector<RecipientData>>();
+		recipients[0]->emplace_back(*aliceDevice1);
+		auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[0].begin(), lime_tester::messages_pattern[0].end());
+		bobManager->encrypt(*bobDevice1, make_shared<const std::string>("alice"), recipients[0], message, cipherMessages[0], callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDevice1, "alice", *bobDevice1, (*recipients[0])[0].DRmessage, *cipherMessages[0], receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
 
+		aliceManager->delete_user(*aliceDevice1, callback);
+		bobManager->delete_user(*bobDevice1, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
 
-	belle_sip_object_unref(pool);
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
 }
 
-static void lime_multithread_encrypt_thread(manager_thread_arg thread_arg) {
+static void lime_storageCompaction() {
+#ifdef EC25519_ENABLED
+	lime_storageCompaction_test(lime::CurveId::c25519, "lime_storageCompaction");
+#endif
+#ifdef EC448_ENABLED
+	lime_storageCompaction_test(lime::CurveId::c448, "lime_storageCompaction");
+#endif
+}
+
+/**
+ * Multi-process access to a database
+ * - alice database is opened by two managers in multi-process mode, they do not share any connection, mutex or cache as two processes would not
+ * - both managers decrypt and encrypt alternately with the same sessions: each one loads again the sessions the other modified since it cached them
+ * - a peer device status set by one manager is read by the other
+ */
+static void lime_multiProcess_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
+
 	lime_tester::events_counters_t counters={};
 	int expected_success=0;
-	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
-		if (returnCode == lime::CallbackReturn::success) {
-			counters.operation_success++;
-		} else {
-			counters.operation_failed++;
-			LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
-		}
-	});
 
-	auto pool = belle_sip_object_pool_push();
-	// RNG uniform between 1 and 20 ms
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(1000, 20000);
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
 
 	try {
-		// loop on all patterns available
-		for (auto message=lime_tester::messages_pattern.cbegin(); message != lime_tester::messages_pattern.cbegin()+test_multithread_message_number; message++) {
-			// wait for a random period betwwen 1 and 20 ms
-			std::this_thread::sleep_for(std::chrono::microseconds(dis(gen)));
-			// Encrypt to all but me
+		lime::StorageOptions options{};
+		options.journalMode = lime::StorageJournalMode::wal;
+		options.multiProcess = true;
+		options.writeBehindDepth = 16; // not compatible with the multi-process mode
+		auto aliceManager1 = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, options));
+		auto aliceManager2 = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, options));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		const auto inEffect = aliceManager1->get_storageOptions();
+		BC_ASSERT_TRUE(inEffect.multiProcess);
+		BC_ASSERT_EQUAL(inEffect.writeBehindDepth, 0, int, "%d");
+		BC_ASSERT_TRUE(inEffect.busyTimeout > 0);
+
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto bobDevice1 = lime_tester::makeRandomDeviceName("bob.d1.");
+		aliceManager1->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		std::array<LimeManager *, 2> aliceManagers{aliceManager1.get(), aliceManager2.get()};
+		constexpr size_t messagesCount = 6;
+		// bob encrypts, alice managers take turns to decrypt
+		for (size_t i=0; i<messagesCount; i++) {
 			auto recipients = make_shared<std::vector<RecipientData>>();
-			for (size_t i=0; i<thread_arg.userlist.size(); i++) {
-				if (i != thread_arg.userIndex) { // do not encrypt to myself
-					recipients->emplace_back(thread_arg.userlist[i]);
-				}
-			}
+			recipients->emplace_back(*aliceDevice1);
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			bobManager->encrypt(*bobDevice1, make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
 
-			auto messagePtr = make_shared<const std::vector<uint8_t>>(message->begin(), message->end());
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(aliceManagers[i%2]->decrypt(*aliceDevice1, "alice", *bobDevice1, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[i]);
+		}
+
+		// alice managers take turns to encrypt: a manager encrypting with its cached session would reuse the message keys of the other one
+		for (size_t i=0; i<messagesCount; i++) {
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(*bobDevice1);
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
 			auto cipherMessage = make_shared<std::vector<uint8_t>>();
-			auto localDeviceId = thread_arg.userlist[thread_arg.userIndex];
-			auto mailbox = thread_arg.mailbox;
-			// encrypt to all, use a generic "friends" id as recipient user id
-			thread_arg.manager->encrypt(localDeviceId, make_shared<const std::string>("friends"), recipients, messagePtr, cipherMessage,
-					([&counters, message, localDeviceId, mailbox, recipients, cipherMessage](lime::CallbackReturn returnCode, std::string anythingToSay) {
-						if (returnCode == lime::CallbackReturn::success) {
-							// Post the messages
-							for (auto &recipient : *recipients) {
-								mth_message m(recipient.DRmessage, *cipherMessage, *message, localDeviceId);
-								auto search = mailbox->find(recipient.deviceId);
-								if (search != mailbox->end()) {
-									auto box = search->second;
-									box->post(m);
-								}
-							}
-							counters.operation_success++;
-						} else {
-							counters.operation_failed++;
-							LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
-						}
-					}));
-			expected_success++;
-			// make sure we process possible message incoming from X3DH server
-			std::unique_lock<std::recursive_mutex> lock(*(thread_arg.belle_sip_mutex));
-			belle_sip_stack_sleep(bc_stack,0);
-			lock.unlock();
+			aliceManagers[i%2]->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(bobManager->decrypt(*bobDevice1, "bob", *aliceDevice1, (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[i]);
 		}
-		BC_ASSERT_TRUE(lime_tester::wait_for_mutex(bc_stack,&counters.operation_success, expected_success, lime_tester::wait_for_timeout, thread_arg.belle_sip_mutex));
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
 
+		// a status set by one manager is seen by the other, which already read this device
+		BC_ASSERT_TRUE(aliceManager2->get_peerDeviceStatus(*bobDevice1) != lime::PeerDeviceStatus::unsafe);
+		aliceManager1->set_peerDeviceStatus(*bobDevice1, lime::PeerDeviceStatus::unsafe);
+		BC_ASSERT_TRUE(aliceManager2->get_peerDeviceStatus(*bobDevice1) == lime::PeerDeviceStatus::unsafe);
+
+		aliceManager2 = nullptr;
+		aliceManager1->delete_user(*aliceDevice1, callback);
+		bobManager->delete_user(*bobDevice1, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
 
-	belle_sip_object_unref(pool);	
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
 }
 
-static void lime_multithread_create_thread(manager_thread_arg thread_arg) {
-	lime_tester::events_counters_t counters={};
-	int expected_success=0;
-	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
-		if (returnCode == lime::CallbackReturn::success) {
-			counters.operation_success++;
-		} else {
-			counters.operation_failed++;
-			LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
-		}
-	});
+static void lime_multiProcess() {
+#ifdef EC25519_ENABLED
+	lime_multiProcess_test(lime::CurveId::c25519, "lime_multiProcess");
+#endif
+#ifdef EC448_ENABLED
+	lime_multiProcess_test(lime::CurveId::c448, "lime_multiProcess");
+#endif
+}
 
-	auto pool = belle_sip_object_pool_push();
+/**
+ * SPk rotation in multi-process mode
+ * - alice database is opened by two managers in multi-process mode, bob.d1 and bob.d2 encrypt to alice using the same SPk,
+ *   alice has a single OPk: bob.d2 message relies on the SPk only
+ * - the first manager decrypts bob.d1 message, reading this SPk
+ * - the second manager rotates the SPk twice with time forwarded in between: the one used by bob devices is deleted from local storage
+ * - the first manager cannot decrypt bob.d2 message anymore: it does not keep the deleted SPk in memory
+ */
+static void lime_multiProcessSPkRotation_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
-	try {
-		// Create the device
-		auto deviceId = thread_arg.userlist[thread_arg.userIndex];
-		thread_arg.manager->create_user(deviceId, thread_arg.x3dh_server_url, thread_arg.curve, lime_tester::OPkInitialBatchSize, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for_mutex(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout, thread_arg.belle_sip_mutex));
-	} catch (BctbxException &e) {
-		LIME_LOGE << e;
-		BC_FAIL("");
-	}
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
 
-	belle_sip_object_unref(pool);	
-}
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
 
-static void lime_multithread_delete_thread(manager_thread_arg thread_arg) {
 	lime_tester::events_counters_t counters={};
 	int expected_success=0;
+
 	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
-		if (returnCode == lime::CallbackReturn::success) {
-			counters.operation_success++;
-		} else {
-			counters.operation_failed++;
-			LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		lime::StorageOptions options{};
+		options.journalMode = lime::StorageJournalMode::wal;
+		options.multiProcess = true;
+		auto aliceManager1 = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, options));
+		auto aliceManager2 = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost, options));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		std::vector<std::shared_ptr<std::string>> bobDevices{lime_tester::makeRandomDeviceName("bob.d1."), lime_tester::makeRandomDeviceName("bob.d2.")};
+		aliceManager1->create_user(*aliceDevice1, x3dh_server_url, curve, 1, callback);
+		for (const auto &bobDevice : bobDevices) {
+			bobManager->create_user(*bobDevice, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
 		}
-	});
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-	auto pool = belle_sip_object_pool_push();
+		// each bob device encrypts messages_pattern[i] to alice, with the same alice SPk
+		uint32_t SPkId = 0, messageSPkId = 0;
+		size_t SPkCount = 0;
+		BC_ASSERT_TRUE(lime_tester::get_SPks(dbFilenameAlice, *aliceDevice1, SPkCount, SPkId));
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> bobRecipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> bobCipherMessages{};
+		for (size_t i=0; i<bobDevices.size(); i++) {
+			bobRecipients.push_back(make_shared<std::vector<RecipientData>>());
+			bobRecipients.back()->emplace_back(*aliceDevice1);
+			bobCipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			auto bobMessage = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			bobManager->encrypt(*bobDevices[i], make_shared<const std::string>("alice"), bobRecipients.back(), bobMessage, bobCipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			BC_ASSERT_TRUE(lime_tester::DR_message_extractX3DHInit_SPkId((*bobRecipients.back())[0].DRmessage, messageSPkId));
+			BC_ASSERT_EQUAL(messageSPkId, SPkId, uint32_t, "%x");
+			bool haveOPk = false;
+			BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit((*bobRecipients.back())[0].DRmessage, haveOPk));
+			BC_ASSERT_TRUE(haveOPk == (i == 0));
+		}
 
-	try {
-		// Delete the device
-		thread_arg.manager->delete_user(thread_arg.userlist[thread_arg.userIndex], callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for_mutex(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout, thread_arg.belle_sip_mutex));
+		// the first manager decrypts bob.d1 message: it reads the SPk
+		std::vector<uint8_t> receivedMessage{};
+		BC_ASSERT_TRUE(aliceManager1->decrypt(*aliceDevice1, "alice", *bobDevices[0], (*bobRecipients[0])[0].DRmessage, *bobCipherMessages[0], receivedMessage) != lime::PeerDeviceStatus::fail);
+		BC_ASSERT_TRUE(std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[0]);
+
+		// the second manager rotates the SPk, it goes stale, then rotates it again once the stale one is out of limbo: it is deleted
+		lime_tester::forwardTime(dbFilenameAlice, lime::settings::SPK_lifeTime_days);
+		aliceManager2->update(callback, 0, lime_tester::OPkInitialBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		lime_tester::forwardTime(dbFilenameAlice, lime::settings::SPK_limboTime_days+1);
+		aliceManager2->update(callback, 0, lime_tester::OPkInitialBatchSize);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		uint32_t activeSPkId = 0;
+		BC_ASSERT_TRUE(lime_tester::get_SPks(dbFilenameAlice, *aliceDevice1, SPkCount, activeSPkId));
+		BC_ASSERT_EQUAL((int)SPkCount, 2, int, "%d"); // the first one is deleted, the second one is stale
+		BC_ASSERT_NOT_EQUAL(activeSPkId, SPkId, uint32_t, "%x");
+
+		// the first manager does not find the deleted SPk: bob.d2 message cannot be decrypted
+		receivedMessage.clear();
+		BC_ASSERT_TRUE(aliceManager1->decrypt(*aliceDevice1, "alice", *bobDevices[1], (*bobRecipients[1])[0].DRmessage, *bobCipherMessages[1], receivedMessage) == lime::PeerDeviceStatus::fail);
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		aliceManager2 = nullptr;
+		aliceManager1->delete_user(*aliceDevice1, callback);
+		for (const auto &bobDevice : bobDevices) {
+			bobManager->delete_user(*bobDevice, callback);
+		}
+		expected_success += 3;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
 
-	belle_sip_object_unref(pool);	
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
 }
 
-static void lime_multithread_update_thread(manager_thread_arg thread_arg) {
-	auto pool = belle_sip_object_pool_push();
+static void lime_multiProcessSPkRotation() {
+#ifdef EC25519_ENABLED
+	lime_multiProcessSPkRotation_test(lime::CurveId::c25519, "lime_multiProcessSPkRotation");
+#endif
+#ifdef EC448_ENABLED
+	lime_multiProcessSPkRotation_test(lime::CurveId::c448, "lime_multiProcessSPkRotation");
+#endif
+}
 
-	// RNG uniform between 25 and 100 ms
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(25, 100);
-	std::uniform_int_distribution<> rnd_serverLimit(0, 4);
+/**
+ * Sessions save failure
+ * - alice creates sessions with bob two devices, their first save fails on the second one: the encryption throws
+ * - the new sessions were not inserted, the next encryption does: both bob devices decrypt and alice local storage holds one session with each
+ * - alice creates a session with a third bob device, the commit of the encryption to the three devices fails as the database is busy:
+ *   the new session is inserted by the next encryption
+ */
+static void lime_sessionsSaveFailure_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
+	// create DB
+	std::string dbFilenameAlice{dbBaseFilename};
+	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+
+	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
 
 	lime_tester::events_counters_t counters={};
 	int expected_success=0;
+
 	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
-		if (returnCode == lime::CallbackReturn::success) {
-			counters.operation_success++;
-		} else {
-			counters.operation_failed++;
-			LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	try {
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		std::vector<std::shared_ptr<std::string>> bobDevices{lime_tester::makeRandomDeviceName("bob.d1."), lime_tester::makeRandomDeviceName("bob.d2.")};
+		auto bobDevice3 = lime_tester::makeRandomDeviceName("bob.d3.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		for (const auto &bobDevice : bobDevices) {
+			bobManager->create_user(*bobDevice, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
 		}
-	});
+		bobManager->create_user(*bobDevice3, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 4;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-	try {
-		auto localDeviceId = thread_arg.userlist[thread_arg.userIndex];
-		auto box = thread_arg.mailbox->find(localDeviceId)->second;
+		// create the sessions, they are saved by the first encryption
+		aliceManager->prefetch_sessions(*aliceDevice1, std::vector<std::string>{*bobDevices[0], *bobDevices[1]}, callback, true);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
 
-		uint16_t serverLimit = 2;
-		uint16_t batchSize = 2;
+		// the first session is inserted, then the second one fails
+		lime_tester::inject_storageFailure(dbFilenameAlice, "DR_sessions", std::string{"NEW.Did IN (SELECT Did FROM lime_PeerDevices WHERE DeviceId = '"}.append(*bobDevices[1]).append("')"));
+		auto encryptToBob = [&](const size_t pattern) {
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			for (const auto &bobDevice : bobDevices) {
+				recipients->emplace_back(*bobDevice);
+			}
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[pattern].begin(), lime_tester::messages_pattern[pattern].end());
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			aliceManager->encrypt(*aliceDevice1, make_shared<const std::string>("bob"), recipients, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			for (size_t i=0; i<bobDevices.size(); i++) {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(bobManager->decrypt(*bobDevices[i], "bob", *aliceDevice1, (*recipients)[i].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+				BC_ASSERT_TRUE(std::string{receivedMessage.begin(), receivedMessage.end()} == lime_tester::messages_pattern[pattern]);
+			}
+		};
+		bool encryptionFailed = false;
+		try {
+			encryptToBob(0);
+		} catch (std::exception const &) {
+			encryptionFailed = true; // thrown by the encrypt call: the callback is not called
+		}
+		BC_ASSERT_TRUE(encryptionFailed);
+		for (const auto &bobDevice : bobDevices) {
+			std::vector<long int> sessionsId{};
+			BC_ASSERT_EQUAL((int)lime_tester::get_DRsessionsId(dbFilenameAlice, *aliceDevice1, *bobDevice, sessionsId), 0, int, "%d");
+		}
 
-		while (box->done() == false) { // use the mailbox to synchronise to the end of the decryption threads
-			// wait for a random period betwwen 25 and 100 ms
-			std::this_thread::sleep_for(std::chrono::milliseconds(dis(gen)));
-			// Update
-			thread_arg.manager->update(callback, serverLimit, batchSize);
-			expected_success++;
-			serverLimit+=rnd_serverLimit(gen); // improver server limit by a random 0 to 4
-			// make sure we process possible message incoming from X3DH server
-			std::unique_lock<std::recursive_mutex> lock(*(thread_arg.belle_sip_mutex));
-			belle_sip_stack_sleep(bc_stack,0);
-			lock.unlock();
+		// the sessions are inserted by the next encryption, the first one included: it does not update the row rolled back
+		lime_tester::clear_storageFailure(dbFilenameAlice);
+		encryptToBob(1);
+		encryptToBob(2);
+		for (const auto &bobDevice : bobDevices) {
+			std::vector<long int> sessionsId{};
+			BC_ASSERT_TRUE(lime_tester::get_DRsessionsId(dbFilenameAlice, *aliceDevice1, *bobDevice, sessionsId) > 0);
+			BC_ASSERT_EQUAL((int)sessionsId.size(), 1, int, "%d");
 		}
-		BC_ASSERT_TRUE(lime_tester::wait_for_mutex(bc_stack,&counters.operation_success, expected_success, lime_tester::wait_for_timeout, thread_arg.belle_sip_mutex));
 
+		// the sessions are saved, the third bob device one inserted, but the commit fails: another connection holds a read lock on the database
+		aliceManager->prefetch_sessions(*aliceDevice1, std::vector<std::string>{*bobDevice3}, callback, true);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+		bobDevices.push_back(bobDevice3);
+		auto readLock = lime_tester::hold_storageReadLock(dbFilenameAlice);
+		BC_ASSERT_PTR_NOT_NULL(readLock.get());
+		encryptionFailed = false;
+		try {
+			encryptToBob(3);
+		} catch (std::exception const &) {
+			encryptionFailed = true;
+		}
+		BC_ASSERT_TRUE(encryptionFailed);
+		readLock = nullptr;
+		std::vector<long int> bobDevice3SessionsId{};
+		BC_ASSERT_EQUAL((int)lime_tester::get_DRsessionsId(dbFilenameAlice, *aliceDevice1, *bobDevice3, bobDevice3SessionsId), 0, int, "%d");
+
+		// the commit failure is handled as a failed save: the new session is inserted by the next encryption
+		encryptToBob(4);
+		encryptToBob(5);
+		for (const auto &bobDevice : bobDevices) {
+			std::vector<long int> sessionsId{};
+			BC_ASSERT_TRUE(lime_tester::get_DRsessionsId(dbFilenameAlice, *aliceDevice1, *bobDevice, sessionsId) > 0);
+			BC_ASSERT_EQUAL((int)sessionsId.size(), 1, int, "%d");
+		}
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		aliceManager->delete_user(*aliceDevice1, callback);
+		for (const auto &bobDevice : bobDevices) {
+			bobManager->delete_user(*bobDevice, callback);
+		}
+		expected_success += 4;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
 
-	belle_sip_object_unref(pool);
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
 }
 
+static void lime_sessionsSaveFailure() {
+#ifdef EC25519_ENABLED
+	lime_sessionsSaveFailure_test(lime::CurveId::c25519, "lime_sessionsSaveFailure");
+#endif
+#ifdef EC448_ENABLED
+	lime_sessionsSaveFailure_test(lime::CurveId::c448, "lime_sessionsSaveFailure");
+#endif
+}
 
-
-/*
- * Scenario:
- * - Create 2 managers
- * - In separated threads, each manager create 2 devices
- * - each device gets several threads to encrypt/decrypt/update
+/**
+ * Local storage schema migration
+ * - bob gets only the last of the messages alice sends on a chain: the skipped keys fill more than one chunk
+ * - alice performs a DH ratchet step, bob current receiving chain holds no skipped key
+ * - bob database is converted to the layout written by the given older lime version, it is migrated when opened
+ * - the migrated session does not hold the peer public key: an in order message on the current receiving chain is decrypted by the fallback on all sessions
+ *   and sets it, then each skipped message decrypts once and its key is removed after use
+ * - the session works both ways after the migration, its version is kept in the sessions snapshot
  */
-static void lime_multithread_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url ) {
+static void lime_schemaMigration_test(const lime::CurveId curve, const std::string &dbBaseFilename, const int version) {
 	// create DB
 	std::string dbFilenameAlice{dbBaseFilename};
 	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 	std::string dbFilenameBob{dbBaseFilename};
 	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string snapshotFilename{dbFilenameBob};
+	snapshotFilename.append(".snapshot");
 
 	remove(dbFilenameAlice.data()); // delete the database file if already exists
 	remove(dbFilenameBob.data()); // delete the database file if already exists
+	remove(snapshotFilename.data());
 
-	auto belle_sip_mutex = make_shared<std::recursive_mutex>(); // a mutex for belle-sip operations, must be recursive a stack processing may trigger response reception wich may trigger message sending
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
 
-	limeX3DHServerPostData X3DHServerPost_mutex([belle_sip_mutex](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
-			std::lock_guard<std::recursive_mutex> lock(*belle_sip_mutex); // belle_sip_mutex is recursive so a thread can acquire the lock there even if it already got it from a stack processing
-			X3DHServerPost(url, from, message, responseProcess);
-			});
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
 
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
 
 	try {
-		// Generate the 4 devices Id we will use
-		std::array<std::string,4> deviceList;
-		deviceList[0] = *lime_tester::makeRandomDeviceName("alice.d1.");
-		deviceList[1] = *lime_tester::makeRandomDeviceName("alice.d2.");
-		deviceList[2] = *lime_tester::makeRandomDeviceName("bob.d1.");
-		deviceList[3] = *lime_tester::makeRandomDeviceName("bob.d2.");
-		std::deque<std::thread> activeThreads{};
-
-		// get a mailbox for each of them, same index
-		auto mailbox = make_shared<std::map<std::string, std::shared_ptr<mth_mailbox>>>();
-		auto expectedMessageCount = 9*test_multithread_message_number; // each recipient shall get 9 times the number of expedited messages by each encryption thread
-		mailbox->emplace(std::make_pair(deviceList[0], make_shared<mth_mailbox>(deviceList[0], expectedMessageCount)));
-		mailbox->emplace(std::make_pair(deviceList[1], make_shared<mth_mailbox>(deviceList[1], expectedMessageCount)));
-		mailbox->emplace(std::make_pair(deviceList[2], make_shared<mth_mailbox>(deviceList[2], expectedMessageCount)));
-		mailbox->emplace(std::make_pair(deviceList[3], make_shared<mth_mailbox>(deviceList[3], expectedMessageCount)));
-
-		// create Manager
-		auto aliceManager = std::make_shared<LimeManager>(dbFilenameAlice, X3DHServerPost_mutex);
-		auto bobManager = std::make_shared<LimeManager>(dbFilenameBob, X3DHServerPost_mutex);
-
-		// Create arguments to thread, as local variable, they are copy passed to threads
-		std::list<manager_thread_arg> devArg;
-		devArg.emplace_back(aliceManager, 0, deviceList, x3dh_server_url, curve, belle_sip_mutex, mailbox);
-		devArg.emplace_back(aliceManager, 1, deviceList, x3dh_server_url, curve, belle_sip_mutex, mailbox);
-		devArg.emplace_back(bobManager, 2, deviceList, x3dh_server_url, curve, belle_sip_mutex, mailbox);
-		devArg.emplace_back(bobManager, 3, deviceList, x3dh_server_url, curve, belle_sip_mutex, mailbox);
-		
-		// create device
-		for (const auto &arg : devArg) {
-			activeThreads.emplace_back(lime_multithread_create_thread, arg);
-		}
+		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
+		auto bobDeviceId = lime_tester::makeRandomDeviceName("bob.");
+		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		bobManager->create_user(*bobDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, expected_success,lime_tester::wait_for_timeout));
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+
+		// encrypt a message to one device, return its index: the message pattern used is given by this index
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> recipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> cipherMessages{};
+		auto encrypt = [&](LimeManager &manager, const std::string &senderDeviceId, const std::string &recipientDeviceId) {
+			const size_t index = recipients.size();
+			recipients.push_back(make_shared<std::vector<RecipientData>>());
+			recipients.back()->emplace_back(recipientDeviceId);
+			cipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			const auto &pattern = lime_tester::messages_pattern[index%lime_tester::messages_pattern.size()];
+			auto message = make_shared<const std::vector<uint8_t>>(pattern.begin(), pattern.end());
+			manager.encrypt(senderDeviceId, make_shared<const std::string>("friends"), recipients.back(), message, cipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			return index;
+		};
+		auto decrypt = [&](LimeManager &manager, const std::string &recipientDeviceId, const std::string &senderDeviceId, const size_t index) {
+			std::vector<uint8_t> receivedMessage{};
+			if (manager.decrypt(recipientDeviceId, "friends", senderDeviceId, (*recipients[index])[0].DRmessage, *cipherMessages[index], receivedMessage) == lime::PeerDeviceStatus::fail) {
+				return false;
+			}
+			return std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[index%lime_tester::messages_pattern.size()];
+		};
 
-		// wait for the threads to complete
-		for (auto &t : activeThreads) {
-			t.join();
-		}
-		activeThreads.clear();
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, *aliceDeviceId, encrypt(*aliceManager, *aliceDeviceId, *bobDeviceId)));
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDeviceId, *bobDeviceId, encrypt(*bobManager, *bobDeviceId, *aliceDeviceId)));
 
-		// encrypt, three encryotion threads per user
-		for (auto i=0; i<3; i++) {
-			for (const auto &arg : devArg) {
-				activeThreads.emplace_back(lime_multithread_encrypt_thread, arg);
-			}
+		// bob gets only the last message of alice next sending chain
+		constexpr size_t skippedCount = lime::settings::DBMSkChunkSize + 3;
+		std::vector<size_t> skipped{};
+		for (size_t i=0; i<skippedCount; i++) {
+			skipped.push_back(encrypt(*aliceManager, *aliceDeviceId, *bobDeviceId));
 		}
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, *aliceDeviceId, encrypt(*aliceManager, *aliceDeviceId, *bobDeviceId)));
+		BC_ASSERT_EQUAL((int)lime_tester::get_StoredMessageKeyCount(dbFilenameBob, *bobDeviceId, *aliceDeviceId), (int)skippedCount, int, "%d");
 
-		// decrypt, two decryption threads per user
-		for (auto i=0; i<2; i++) {
-			for (const auto &arg : devArg) {
-				activeThreads.emplace_back(lime_multithread_decrypt_thread, arg);
-			}
-		}
+		// bob answers and alice performs a DH ratchet step
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDeviceId, *bobDeviceId, encrypt(*bobManager, *bobDeviceId, *aliceDeviceId)));
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, *aliceDeviceId, encrypt(*aliceManager, *aliceDeviceId, *bobDeviceId)));
+		const auto inOrder = encrypt(*aliceManager, *aliceDeviceId, *bobDeviceId);
 
-		//update, two threads per user
-		for (auto i=0; i<2; i++) {
-			for (const auto &arg : devArg) {
-				activeThreads.emplace_back(lime_multithread_update_thread, arg);
-			}
-		}
-		// wait for the threads to complete
-		for (auto &t : activeThreads) {
-			t.join();
+		// bob database was written by an older version
+		bobManager = nullptr;
+		BC_ASSERT_TRUE(lime_tester::downgrade_database(dbFilenameBob, version, curve));
+		bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		BC_ASSERT_TRUE(bobManager->is_user(*bobDeviceId));
+		BC_ASSERT_EQUAL((int)lime_tester::get_StoredMessageKeyCount(dbFilenameBob, *bobDeviceId, *aliceDeviceId), (int)skippedCount, int, "%d");
+
+		// bob session is not found by the peer public key in the message header until its first update
+		BC_ASSERT_EQUAL((int)lime_tester::get_DRsessionsWithoutDHr(dbFilenameBob, *bobDeviceId, *aliceDeviceId), 1, int, "%d");
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, *aliceDeviceId, inOrder));
+		BC_ASSERT_EQUAL((int)lime_tester::get_DRsessionsWithoutDHr(dbFilenameBob, *bobDeviceId, *aliceDeviceId), 0, int, "%d");
+		for (size_t i=0; i<skipped.size(); i++) {
+			BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, *aliceDeviceId, skipped[i]));
+			BC_ASSERT_EQUAL((int)lime_tester::get_StoredMessageKeyCount(dbFilenameBob, *bobDeviceId, *aliceDeviceId), (int)(skippedCount-1-i), int, "%d");
 		}
-		activeThreads.clear();
+		BC_ASSERT_FALSE(decrypt(*bobManager, *bobDeviceId, *aliceDeviceId, skipped[0]));
 
-		// delete devices
-		for (const auto &arg : devArg) {
-			activeThreads.emplace_back(lime_multithread_delete_thread, arg);
-		}
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDeviceId, *bobDeviceId, encrypt(*bobManager, *bobDeviceId, *aliceDeviceId)));
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, *aliceDeviceId, encrypt(*aliceManager, *aliceDeviceId, *bobDeviceId)));
 
-		// wait for the threads to complete
-		for (auto &t : activeThreads) {
-			t.join();
-		}
-		activeThreads.clear();
+		// the migrated session is restored from a snapshot: it holds the version of its row
+		bobManager->save_sessionsSnapshot(snapshotFilename);
+		bobManager = nullptr;
+		bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		BC_ASSERT_EQUAL((int)bobManager->load_sessionsSnapshot(snapshotFilename), 1, int, "%d");
+		BC_ASSERT_TRUE(decrypt(*bobManager, *bobDeviceId, *aliceDeviceId, encrypt(*aliceManager, *aliceDeviceId, *bobDeviceId)));
+		BC_ASSERT_TRUE(decrypt(*aliceManager, *aliceDeviceId, *bobDeviceId, encrypt(*bobManager, *bobDeviceId, *aliceDeviceId)));
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
 
-		if (cleanDatabase) {
-			remove(dbFilenameAlice.data()); // delete the database file if already exists
-			remove(dbFilenameBob.data()); // delete the database file if already exists
-		}
+		aliceManager->delete_user(*aliceDeviceId, callback);
+		bobManager->delete_user(*bobDeviceId, callback);
+		expected_success += 2;
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	remove(snapshotFilename.data());
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
 }
 
-static void lime_multithread(void) {
-	for (size_t i=0; i<3; i++) { // loop several times as the first messages sending/receiving are the most susceptible to bump into problems
+static void lime_schemaMigrationFromV1() {
 #ifdef EC25519_ENABLED
-	lime_multithread_test(lime::CurveId::c25519, "lime_multithread", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+	lime_schemaMigration_test(lime::CurveId::c25519, "lime_schemaMigrationFromV1", 0x000001);
 #endif
 #ifdef EC448_ENABLED
-	lime_multithread_test(lime::CurveId::c448, "lime_multithread", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+	lime_schemaMigration_test(lime::CurveId::c448, "lime_schemaMigrationFromV1", 0x000001);
+#endif
+}
+
+static void lime_schemaMigrationFromV2() {
+#ifdef EC25519_ENABLED
+	lime_schemaMigration_test(lime::CurveId::c25519, "lime_schemaMigrationFromV2", 0x000002);
+#endif
+#ifdef EC448_ENABLED
+	lime_schemaMigration_test(lime::CurveId::c448, "lime_schemaMigrationFromV2", 0x000002);
+#endif
+}
+
+static void lime_schemaMigrationFromV4() {
+#ifdef EC25519_ENABLED
+	lime_schemaMigration_test(lime::CurveId::c25519, "lime_schemaMigrationFromV4", 0x000004);
+#endif
+#ifdef EC448_ENABLED
+	lime_schemaMigration_test(lime::CurveId::c448, "lime_schemaMigrationFromV4", 0x000004);
+#endif
+}
+
+static void lime_schemaMigrationFromV5() {
+#ifdef EC25519_ENABLED
+	lime_schemaMigration_test(lime::CurveId::c25519, "lime_schemaMigrationFromV5", 0x000005);
+#endif
+#ifdef EC448_ENABLED
+	lime_schemaMigration_test(lime::CurveId::c448, "lime_schemaMigrationFromV5", 0x000005);
 #endif
-	}
 }
 
 /**
- * Scenario: Server is set to accept 200 OPks per device
- * - Create user alice with 500 OPks -> it shall fail
- * - Create user alice with 100 OPks -> it shall pass
- * - Add 100 OPks to alice -> it shall pass
- * - Add 100 OPks to alice -> is shall fail
+ * OPk generation
+ * - alice.d2 is created while the first insertions of her OPks collide with stored OPk Ids: other Ids are drawn and the published OPks are the stored ones,
+ *   so bob devices each using one of them establish a session with her
+ * - alice devices upload OPk batches large enough to be generated in parallel: all the stored key pairs are valid and different
  */
-static void lime_server_resource_limit_reached_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url) {
+template <typename Curve>
+static void lime_OPkGeneration_test(const lime::CurveId curve, const std::string &dbBaseFilename) {
 	// create DB
 	std::string dbFilenameAlice{dbBaseFilename};
 	dbFilenameAlice.append(".alice.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
+	std::string dbFilenameBob{dbBaseFilename};
+	dbFilenameBob.append(".bob.").append((curve==CurveId::c25519)?"C25519":"C448").append(".sqlite3");
 
 	remove(dbFilenameAlice.data()); // delete the database file if already exists
+	remove(dbFilenameBob.data()); // delete the database file if already exists
+
+	auto globalServer = lime_tester::x3dhLoopbackServer;
+	lime_tester::x3dhLoopbackServer = std::make_shared<lime_tester::X3DHLoopbackServer>(std::chrono::milliseconds{0});
+	const std::string x3dh_server_url{"https://loopback.invalid"};
 
 	lime_tester::events_counters_t counters={};
 	int expected_success=0;
-	int expected_failure=0;
 
 	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
 					if (returnCode == lime::CallbackReturn::success) {
@@ -4012,61 +8661,90 @@ static void lime_server_resource_limit_reached_test(const lime::CurveId curve, c
 						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
 					}
 				});
+
 	try {
-		// create Manager and device for alice
 		auto aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
-		auto aliceDeviceId = lime_tester::makeRandomDeviceName("alice.");
-		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, 500, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed, ++expected_failure,lime_tester::wait_for_timeout));
-
-		// Try again to create the device, with 100 OPks, it shall pass
-		aliceManager->create_user(*aliceDeviceId, x3dh_server_url, curve, 100, callback);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
-
-		// call the update, set the serverLimit 200 and upload an other 100
-		aliceManager->update(callback, 200, 100);
+		auto bobManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameBob, X3DHServerPost));
+		auto aliceDevice1 = lime_tester::makeRandomDeviceName("alice.d1.");
+		auto aliceDevice2 = lime_tester::makeRandomDeviceName("alice.d2.");
+		aliceManager->create_user(*aliceDevice1, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
 		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
-		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDeviceId), 200, int, "%d");
-
-		// call the update, set the serverLimit 300 and upload an other 100 -> it shall fail but we have 300 OPks in DB
-		aliceManager->update(callback, 300, 100);
-		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_failed, ++expected_failure,lime_tester::wait_for_timeout));
-		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDeviceId), 300, int, "%d");
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
 
-		// update again, with correct values, server already holds 200 keys, so the only effect would be to set the failed 100 OPks status to dispatched as they are not on server 
-		aliceManager->update(callback, 125, 25);
+		// the first Ids drawn for alice.d2 OPks are already used
+		lime_tester::inject_OPkIdCollisions(dbFilenameAlice, lime_tester::OPkInitialBatchSize);
+		aliceManager->create_user(*aliceDevice2, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
 		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
-		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDeviceId), 300, int, "%d");
+		const auto decoyIds = lime_tester::clear_OPkIdCollisions(dbFilenameAlice);
+		BC_ASSERT_EQUAL((int)decoyIds.size(), lime_tester::OPkInitialBatchSize, int, "%d");
+		const auto publishedIds = lime_tester::x3dhLoopbackServer->OPkIds(curve, *aliceDevice2);
+		BC_ASSERT_EQUAL((int)publishedIds.size(), lime_tester::OPkInitialBatchSize, int, "%d");
+		for (const auto OPkId : publishedIds) {
+			BC_ASSERT_TRUE(std::find(decoyIds.cbegin(), decoyIds.cend(), OPkId) == decoyIds.cend());
+		}
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDevice2), lime_tester::OPkInitialBatchSize, int, "%d");
+		BC_ASSERT_TRUE(lime_tester::check_OPks<Curve>(dbFilenameAlice, *aliceDevice2));
+
+		// one bob device per published OPk: it is found in alice local storage
+		std::vector<std::shared_ptr<std::string>> bobDevices{};
+		for (size_t i=0; i<publishedIds.size(); i++) {
+			bobDevices.push_back(lime_tester::makeRandomDeviceName("bob."));
+			bobManager->create_user(*(bobDevices.back()), x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
 
-		// forward time by OPK_limboTime_days
-		aliceManager=nullptr; // destroy manager before modifying DB
-		lime_tester::forwardTime(dbFilenameAlice, lime::settings::OPk_limboTime_days+1);
-		aliceManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameAlice, X3DHServerPost));
+			auto recipients = make_shared<std::vector<RecipientData>>();
+			recipients->emplace_back(*aliceDevice2);
+			auto message = make_shared<const std::vector<uint8_t>>(lime_tester::messages_pattern[i].begin(), lime_tester::messages_pattern[i].end());
+			auto cipherMessage = make_shared<std::vector<uint8_t>>();
+			bobManager->encrypt(*(bobDevices.back()), make_shared<const std::string>("alice"), recipients, message, cipherMessage, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
+			bool haveOPk = false;
+			BC_ASSERT_TRUE(lime_tester::DR_message_holdsX3DHInit((*recipients)[0].DRmessage, haveOPk));
+			BC_ASSERT_TRUE(haveOPk);
+			std::vector<uint8_t> receivedMessage{};
+			BC_ASSERT_TRUE(aliceManager->decrypt(*aliceDevice2, "alice", *(bobDevices.back()), (*recipients)[0].DRmessage, *cipherMessage, receivedMessage) != lime::PeerDeviceStatus::fail);
+			BC_ASSERT_TRUE(std::string(receivedMessage.begin(), receivedMessage.end()) == lime_tester::messages_pattern[i]);
+		}
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDevice2), 0, int, "%d");
 
-		// update one last time, with correct values, server already holds 200 keys
-		// so the only effect would be to remove the OPk keys status was set to dispatch before we forward the time
-		// We now hold 200 keys
-		aliceManager->update(callback, 125, 25);
+		// both alice devices are under the server low limit: each one uploads a batch generated on several threads
+		constexpr uint16_t batchSize = 2*lime::settings::OPk_parallelGenerationThreshold;
+		aliceManager->update(callback, lime_tester::OPkInitialBatchSize+1, batchSize);
 		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success,lime_tester::wait_for_timeout));
-		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDeviceId), 200, int, "%d");
-
-		if (cleanDatabase) {
-			aliceManager->delete_user(*aliceDeviceId, callback);
-			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,++expected_success,lime_tester::wait_for_timeout));
-			remove(dbFilenameAlice.data());
+		BC_ASSERT_EQUAL((int)lime_tester::x3dhLoopbackServer->OPkCount(curve, *aliceDevice1), lime_tester::OPkInitialBatchSize+batchSize, int, "%d");
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDevice1), lime_tester::OPkInitialBatchSize+batchSize, int, "%d");
+		BC_ASSERT_TRUE(lime_tester::check_OPks<Curve>(dbFilenameAlice, *aliceDevice1));
+		BC_ASSERT_EQUAL((int)lime_tester::x3dhLoopbackServer->OPkCount(curve, *aliceDevice2), batchSize, int, "%d");
+		BC_ASSERT_EQUAL((int)lime_tester::get_OPks(dbFilenameAlice, *aliceDevice2), batchSize, int, "%d");
+		BC_ASSERT_TRUE(lime_tester::check_OPks<Curve>(dbFilenameAlice, *aliceDevice2));
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		aliceManager->delete_user(*aliceDevice1, callback);
+		aliceManager->delete_user(*aliceDevice2, callback);
+		expected_success += 2;
+		for (const auto &bobDevice : bobDevices) {
+			bobManager->delete_user(*bobDevice, callback);
+			expected_success++;
 		}
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success,expected_success,lime_tester::wait_for_timeout));
 	} catch (BctbxException &e) {
 		LIME_LOGE << e;
 		BC_FAIL("");
 	}
+
+	lime_tester::x3dhLoopbackServer = globalServer;
+	if (cleanDatabase) {
+		remove(dbFilenameAlice.data());
+		remove(dbFilenameBob.data());
+	}
 }
 
-static void lime_server_resource_limit_reached() {
+static void lime_OPkGeneration() {
 #ifdef EC25519_ENABLED
-	lime_server_resource_limit_reached_test(lime::CurveId::c25519, "lime_server_resource_limit_reached", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data());
+	lime_OPkGeneration_test<C255>(lime::CurveId::c25519, "lime_OPkGeneration");
 #endif
 #ifdef EC448_ENABLED
-	lime_server_resource_limit_reached_test(lime::CurveId::c448, "lime_server_resource_limit_reached", std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data());
+	lime_OPkGeneration_test<C448>(lime::CurveId::c448, "lime_OPkGeneration");
 #endif
 }
 
@@ -4077,6 +8755,18 @@ static test_t tests[] = {
 	TEST_NO_TAG("User not found", x3dh_user_not_found),
 	TEST_NO_TAG("Queued encryption", x3dh_operation_queue),
 	TEST_NO_TAG("Multi devices queued encryption", x3dh_multidev_operation_queue),
+	TEST_NO_TAG("Parallel encryption", lime_parallelEncryption),
+	TEST_NO_TAG("Streamed cipher message", lime_streamedCipherMessage),
+	TEST_NO_TAG("Caller buffers encryption", lime_callerBuffers),
+	TEST_NO_TAG("Decrypt batch", lime_decryptBatch),
+	TEST_NO_TAG("DR sessions cache limits", lime_DRSessionsCacheLimits),
+	TEST_NO_TAG("Users cache limit", lime_usersCacheLimit),
+	TEST_NO_TAG("Sessions prefetch", lime_sessionsPrefetch),
+	TEST_NO_TAG("Concurrent key bundles fetch", lime_concurrentBundleFetch),
+	TEST_NO_TAG("Coalesced key bundles fetch", lime_coalescedBundleFetch),
+	TEST_NO_TAG("Key bundles prefetch", lime_peerBundlesPrefetch),
+	TEST_NO_TAG("Connection per user", lime_connectionPerUser),
+	TEST_NO_TAG("Asynchronous decryption", lime_asyncDecryption),
 	TEST_NO_TAG("Multiple sessions", x3dh_multiple_DRsessions),
 	TEST_NO_TAG("Sending chain limit", x3dh_sending_chain_limit),
 	TEST_NO_TAG("Without OPk", x3dh_without_OPk),
@@ -4085,6 +8775,7 @@ static test_t tests[] = {
 	TEST_NO_TAG("Update - OPk", lime_update_OPk),
 	TEST_NO_TAG("Update - Republish", lime_update_republish),
 	TEST_NO_TAG("get self Identity Key", lime_getSelfIk),
+	TEST_NO_TAG("Storage options", lime_storageOptions),
 	TEST_NO_TAG("Verified Status", lime_identityVerifiedStatus),
 	TEST_NO_TAG("Peer Device Status", lime_peerDeviceStatus),
 	TEST_NO_TAG("Encrypt to unsafe", lime_encryptToUnsafe),
@@ -4092,7 +8783,36 @@ static test_t tests[] = {
 	TEST_NO_TAG("Encryption Policy Error", lime_encryptionPolicyError),
 	TEST_NO_TAG("Identity theft", lime_identity_theft),
 	TEST_NO_TAG("Multithread", lime_multithread),
-	TEST_NO_TAG("Server resource limit reached", lime_server_resource_limit_reached)
+	TEST_NO_TAG("Server resource limit reached", lime_server_resource_limit_reached),
+	TEST_NO_TAG("X3DH loopback server", lime_x3dhLoopbackServer),
+	TEST_NO_TAG("Runtime metrics", lime_metrics),
+	TEST_NO_TAG("Tracing", lime_tracing),
+	TEST_NO_TAG("Incremental cleanup", lime_incrementalCleanup),
+	TEST_NO_TAG("Sender key encryption", lime_senderKey),
+	TEST_NO_TAG("Sender key lost distribution", lime_senderKeyLostDistribution),
+	TEST_NO_TAG("DR messages arena", lime_DRmessagesArena),
+	TEST_NO_TAG("Chunked peer devices lookup", lime_chunkedDevicesLookup),
+	TEST_NO_TAG("Peer devices cache", lime_peerDevicesCache),
+	TEST_NO_TAG("Storage shards", lime_storageShards),
+	TEST_NO_TAG("Sessions snapshot", lime_sessionsSnapshot),
+	TEST_NO_TAG("OPk predictive update", lime_OPkPredictiveUpdate),
+	TEST_NO_TAG("Update pipeline", lime_updatePipeline),
+	TEST_NO_TAG("X3DH batch message", lime_X3DHBatch),
+	TEST_NO_TAG("Try encrypt", lime_tryEncrypt),
+	TEST_NO_TAG("Direct session selection", lime_directSessionSelection),
+	TEST_NO_TAG("SPk cache", lime_SPkCache),
+	TEST_NO_TAG("Work lanes", lime_workLanes),
+	TEST_NO_TAG("Write-behind", lime_writeBehind),
+	TEST_NO_TAG("Key pair pool", lime_keyPairPool),
+	TEST_NO_TAG("Storage usage and compaction", lime_storageCompaction),
+	TEST_NO_TAG("Multi-process access", lime_multiProcess),
+	TEST_NO_TAG("Multi-process SPk rotation", lime_multiProcessSPkRotation),
+	TEST_NO_TAG("Sessions save failure", lime_sessionsSaveFailure),
+	TEST_NO_TAG("Schema migration from v0.0.1", lime_schemaMigrationFromV1),
+	TEST_NO_TAG("Schema migration from v0.0.2", lime_schemaMigrationFromV2),
+	TEST_NO_TAG("Schema migration from v0.0.4", lime_schemaMigrationFromV4),
+	TEST_NO_TAG("Schema migration from v0.0.5", lime_schemaMigrationFromV5),
+	TEST_NO_TAG("OPk generation", lime_OPkGeneration)
 };
 
 test_suite_t lime_lime_test_suite = {
@@ -31,6 +31,8 @@
 #include <sstream>
 #include <string>
 #include <memory>
+#include <chrono>
+#include <vector>
 
 using namespace::std;
 using namespace::lime;
@@ -102,6 +104,11 @@ static void process_response(void *data, const belle_http_response_event_t *even
  * @param[in] responseProcess	The function to be called when response from server arrives. Function prototype is defined in lime.hpp: (void)(int responseCode, std::vector<uint8_t>response)
  */
 static limeX3DHServerPostData X3DHServerPost([](const std::string &url, const std::string &from, const std::vector<uint8_t> &message, const limeX3DHServerResponseProcess &responseProcess){
+	if (lime_tester::x3dhLoopbackServer) { // the in-process server is in use, no network involved
+		lime_tester::x3dhLoopbackServer->post(url, from, message, responseProcess);
+		return;
+	}
+
 	belle_http_request_listener_callbacks_t cbs;
 	belle_http_request_listener_t *l;
 	belle_generic_uri_t *uri;
@@ -377,11 +384,206 @@ static void group_all_talking_bench() {
 #endif
 }
 
+/**
+ * @brief Timing of one phase of a group scale bench run
+ */
+struct groupScalePhase {
+	std::string curve;
+	int devices; // group size, sender included
+	std::string phase;
+	size_t operations; // number of operations timed: users created, recipients encrypted to or messages decrypted
+	double time_ms;
+	double perOperation_ms;
+	uint64_t senderDBSize; // local storage sizes at the end of the phase, in bytes
+	uint64_t recipientsDBSize;
+};
+
+/**
+ * Scenario: the scaling of each phase of a group conversation, for a given group size
+ * - the sender and the deviceNumber-1 recipients are created, the recipients share one local storage so the bench is not a benchmark of the files opening
+ * - the sender fetches the recipients key bundles, then creates the sessions from them
+ * - first message: the sender encrypts to all, each recipient decrypts it and creates its session
+ * - steady state: the sender encrypts a few more messages to all, then the recipients decrypt them
+ * The timings and the local storage sizes at the end of each phase are appended to results
+ */
+static void group_scale_test(const lime::CurveId curve, const std::string &dbBaseFilename, const std::string &x3dh_server_url, const int deviceNumber, std::vector<groupScalePhase> &results) {
+	constexpr size_t steadyMessages = 4;
+	const std::string curveName{(curve==lime::CurveId::c25519)?"25519":"448"};
+	auto groupName = make_shared<std::string>("group Name");
+	// server round trips grow with the group size
+	const int timeout = lime_tester::wait_for_timeout*(1 + deviceNumber/100);
+
+	lime_tester::events_counters_t counters={};
+	int expected_success=0;
+
+	limeCallback callback([&counters](lime::CallbackReturn returnCode, std::string anythingToSay) {
+					if (returnCode == lime::CallbackReturn::success) {
+						counters.operation_success++;
+					} else {
+						counters.operation_failed++;
+						LIME_LOGE<<"Lime operation failed : "<<anythingToSay;
+					}
+				});
+
+	std::string dbFilenameSender{dbBaseFilename};
+	dbFilenameSender.append(".").append(curveName).append(".").append(to_string(deviceNumber)).append(".sender.sqlite3");
+	std::string dbFilenameRecipients{dbBaseFilename};
+	dbFilenameRecipients.append(".").append(curveName).append(".").append(to_string(deviceNumber)).append(".recipients.sqlite3");
+	remove(dbFilenameSender.data()); // delete the database file if already exists
+	remove(dbFilenameRecipients.data());
+
+	try {
+		auto senderManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameSender, X3DHServerPost));
+		auto recipientsManager = std::unique_ptr<LimeManager>(new LimeManager(dbFilenameRecipients, X3DHServerPost));
+
+		auto base_deviceId = *(lime_tester::makeRandomDeviceName("alice.")); // the base user name
+		base_deviceId.append(".d");
+		const auto senderDeviceId = base_deviceId + "0";
+		std::vector<std::string> recipientsDeviceId{};
+		for (auto i=1; i<deviceNumber; i++) {
+			recipientsDeviceId.push_back(base_deviceId + to_string(i));
+		}
+		const size_t recipientsNumber = recipientsDeviceId.size();
+
+		auto start = std::chrono::steady_clock::now();
+		// record the phase started at start, it ran operations times, and restart the clock
+		auto record = [&](const std::string &phase, const size_t operations) {
+			const double span = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			lime::StorageUsage senderUsage{}, recipientsUsage{};
+			senderManager->get_storageUsage(senderUsage);
+			recipientsManager->get_storageUsage(recipientsUsage);
+			results.push_back(groupScalePhase{curveName, deviceNumber, phase, operations, span, span/double(operations), senderUsage.fileSize, recipientsUsage.fileSize});
+			LIME_LOGE<<"Curve "<<curveName<<" group of "<<deviceNumber<<" devices: "<<phase<<" in "<<span<<" ms ("<<span/double(operations)<<" ms/operation)";
+			start = std::chrono::steady_clock::now();
+		};
+
+		// user creation
+		senderManager->create_user(senderDeviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success, timeout));
+		for (const auto &deviceId : recipientsDeviceId) {
+			recipientsManager->create_user(deviceId, x3dh_server_url, curve, lime_tester::OPkInitialBatchSize, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success, timeout));
+		}
+		if (counters.operation_failed != 0) return; // skip the end of the test if we can't do this
+		record("userCreation", recipientsNumber + 1);
+
+		// bundle fetch and session creation
+		senderManager->prefetch_peerBundles(senderDeviceId, recipientsDeviceId, callback);
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success, timeout));
+		record("bundleFetch", recipientsNumber);
+		senderManager->prefetch_sessions(senderDeviceId, recipientsDeviceId, callback, true); // the prefetched bundles are used, no server round trip
+		BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success, timeout));
+		record("sessionCreation", recipientsNumber);
+
+		// first message, the recipients sessions are created on decrypt
+		std::vector<std::shared_ptr<std::vector<RecipientData>>> recipients{};
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> cipherMessages{};
+		auto encrypt = [&](const size_t messageIndex) {
+			recipients.push_back(make_shared<std::vector<RecipientData>>());
+			for (const auto &deviceId : recipientsDeviceId) {
+				recipients.back()->emplace_back(deviceId);
+			}
+			const auto &pattern = lime_tester::messages_pattern[messageIndex%lime_tester::messages_pattern.size()];
+			auto message = make_shared<const std::vector<uint8_t>>(pattern.begin(), pattern.end());
+			cipherMessages.push_back(make_shared<std::vector<uint8_t>>());
+			senderManager->encrypt(senderDeviceId, groupName, recipients.back(), message, cipherMessages.back(), callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success, timeout));
+		};
+		auto decrypt = [&](const size_t messageIndex) {
+			const auto &pattern = lime_tester::messages_pattern[messageIndex%lime_tester::messages_pattern.size()];
+			for (size_t j=0; j<recipientsNumber; j++) {
+				std::vector<uint8_t> receivedMessage{};
+				BC_ASSERT_TRUE(recipientsManager->decrypt(recipientsDeviceId[j], *groupName, senderDeviceId, (*recipients[messageIndex])[j].DRmessage, *cipherMessages[messageIndex], receivedMessage) != lime::PeerDeviceStatus::fail);
+				BC_ASSERT_TRUE(std::string{receivedMessage.begin(), receivedMessage.end()} == pattern);
+			}
+		};
+		encrypt(0);
+		record("firstEncrypt", recipientsNumber);
+		decrypt(0);
+		record("firstDecrypt", recipientsNumber);
+
+		// steady state
+		for (size_t i=1; i<=steadyMessages; i++) {
+			encrypt(i);
+		}
+		record("steadyEncrypt", steadyMessages*recipientsNumber);
+		for (size_t i=1; i<=steadyMessages; i++) {
+			decrypt(i);
+		}
+		record("steadyDecrypt", steadyMessages*recipientsNumber);
+		BC_ASSERT_EQUAL(counters.operation_failed, 0, int, "%d");
+
+		if (cleanDatabase) {
+			senderManager->delete_user(senderDeviceId, callback);
+			BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success, timeout));
+			for (const auto &deviceId : recipientsDeviceId) {
+				recipientsManager->delete_user(deviceId, callback);
+				BC_ASSERT_TRUE(lime_tester::wait_for(bc_stack,&counters.operation_success, ++expected_success, timeout));
+			}
+		}
+	} catch (BctbxException &e) {
+		LIME_LOGE << e;
+		BC_FAIL("");
+	}
+
+	if (cleanDatabase) {
+		remove(dbFilenameSender.data());
+		remove(dbFilenameRecipients.data());
+	}
+}
+
+static void group_scale_report(std::ostream &out, const std::vector<groupScalePhase> &results) {
+	if (lime_tester::groupScaleFormat == "json") {
+		out<<"["<<endl;
+		for (size_t i=0; i<results.size(); i++) {
+			const auto &r = results[i];
+			out<<"  {\"curve\": \""<<r.curve<<"\", \"devices\": "<<r.devices<<", \"phase\": \""<<r.phase<<"\", \"operations\": "<<r.operations
+				<<", \"time_ms\": "<<r.time_ms<<", \"per_operation_ms\": "<<r.perOperation_ms
+				<<", \"sender_db_bytes\": "<<r.senderDBSize<<", \"recipients_db_bytes\": "<<r.recipientsDBSize<<"}"<<((i+1<results.size())?",":"")<<endl;
+		}
+		out<<"]"<<endl;
+	} else {
+		out<<"curve,devices,phase,operations,time_ms,per_operation_ms,sender_db_bytes,recipients_db_bytes"<<endl;
+		for (const auto &r : results) {
+			out<<r.curve<<","<<r.devices<<","<<r.phase<<","<<r.operations<<","<<r.time_ms<<","<<r.perOperation_ms<<","<<r.senderDBSize<<","<<r.recipientsDBSize<<endl;
+		}
+	}
+}
+
+static void group_scale_curve(const lime::CurveId curve, const std::string &x3dh_server_url, std::vector<groupScalePhase> &results) {
+	// 1-2-5 progression from 10 devices, up to the maximum one
+	for (const int deviceNumber : {10, 20, 50, 100, 200, 500, 1000, 2000, 5000}) {
+		if (deviceNumber > lime_tester::groupScaleMaxDevices) break;
+		group_scale_test(curve, "group_scale", x3dh_server_url, deviceNumber, results);
+	}
+}
+
+static void group_scale_bench() {
+	if (!bench) return;
+	std::vector<groupScalePhase> results{};
+#ifdef EC25519_ENABLED
+	group_scale_curve(lime::CurveId::c25519, std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c25519_server_port).data(), results);
+#endif
+#ifdef EC448_ENABLED
+	group_scale_curve(lime::CurveId::c448, std::string("https://").append(lime_tester::test_x3dh_server_url).append(":").append(lime_tester::test_x3dh_c448_server_port).data(), results);
+#endif
+	if (lime_tester::groupScaleReport.empty()) {
+		std::ostringstream report;
+		group_scale_report(report, results);
+		LIME_LOGE<<"Group scale bench report:"<<endl<<report.str();
+	} else {
+		std::ofstream report(lime_tester::groupScaleReport);
+		group_scale_report(report, results);
+		BC_ASSERT_TRUE(report.good());
+	}
+}
+
 static test_t tests[] = {
 	TEST_NO_TAG("One message each", group_all_talking),
 	TEST_NO_TAG("One message each Bench", group_all_talking_bench),
 	TEST_NO_TAG("One encrypt to all", group_one_talking),
 	TEST_NO_TAG("One encrypt to all Bench", group_one_talking_bench),
+	TEST_NO_TAG("Scale Bench", group_scale_bench),
 };
 
 test_suite_t lime_massive_group_test_suite = {